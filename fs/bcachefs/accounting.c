@@ -0,0 +1,176 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include "bcachefs.h"
+#include "accounting.h"
+#include "btree_iter.h"
+#include "btree_update.h"
+
+/*
+ * Persistent accounting:
+ *
+ * Counters that are too fine grained to live in struct bch_fs_usage (and thus
+ * the superblock and every journal entry) are kept in BTREE_ID_ACCOUNTING, and
+ * updated by transactional triggers in the same transaction as the update
+ * they account for - so they're always consistent with the rest of the
+ * filesystem, without any special handling in journal replay.
+ *
+ * Updates go through the btree key cache, like alloc keys, so a hot counter
+ * is a read-modify-write of an in memory key, and each counter is split into
+ * shards (picked by the current CPU) so that concurrent transactions aren't
+ * all serialized on the same key lock.
+ */
+
+const u8 bch2_accounting_nr_counters[] = {
+#define x(t, n, nr_counters) [BCH_ACCOUNTING_##t] = nr_counters,
+	BCH_ACCOUNTING_TYPES()
+#undef x
+};
+
+static const char * const bch2_accounting_types[] = {
+#define x(t, n, nr_counters) #t,
+	BCH_ACCOUNTING_TYPES()
+#undef x
+	NULL
+};
+
+const char *bch2_accounting_invalid(const struct bch_fs *c, struct bkey_s_c k)
+{
+	if (k.k->p.inode >= BCH_ACCOUNTING_NR)
+		return "invalid accounting type";
+
+	if (bkey_val_u64s(k.k) != bch2_accounting_nr_counters[k.k->p.inode])
+		return "incorrect value size";
+
+	return NULL;
+}
+
+void bch2_accounting_to_text(struct printbuf *out, struct bch_fs *c,
+			     struct bkey_s_c k)
+{
+	struct bkey_s_c_accounting a = bkey_s_c_to_accounting(k);
+	unsigned i;
+
+	pr_buf(out, "%s id %llu shard %llu:",
+	       bch2_accounting_types[k.k->p.inode],
+	       k.k->p.offset >> BCH_ACCOUNTING_SHARD_BITS,
+	       k.k->p.offset & ~(~0ULL << BCH_ACCOUNTING_SHARD_BITS));
+
+	for (i = 0; i < bkey_val_u64s(k.k); i++)
+		pr_buf(out, " %lli", (s64) le64_to_cpu(a.v->d[i]));
+}
+
+static struct bkey_i_accounting *
+accounting_trans_get_update(struct btree_trans *trans,
+			    enum bch_accounting_type type, u64 id)
+{
+	struct btree_insert_entry *i;
+
+	trans_for_each_update(trans, i)
+		if (i->iter->btree_id == BTREE_ID_ACCOUNTING &&
+		    i->k->k.p.inode == type &&
+		    i->k->k.p.offset >> BCH_ACCOUNTING_SHARD_BITS == id)
+			return bkey_i_to_accounting(i->k);
+
+	return NULL;
+}
+
+static void accounting_add(struct bkey_i_accounting *a, const s64 *d)
+{
+	unsigned i;
+
+	for (i = 0; i < bkey_val_u64s(&a->k); i++)
+		le64_add_cpu(&a->v.d[i], d[i]);
+}
+
+/*
+ * Add @d (which must have bch2_accounting_nr_counters[type] entries) to a
+ * counter, as part of @trans
+ */
+int bch2_accounting_update(struct btree_trans *trans,
+			   enum bch_accounting_type type,
+			   u64 id, const s64 *d)
+{
+	unsigned nr = bch2_accounting_nr_counters[type];
+	unsigned shard = raw_smp_processor_id() &
+		~(~0U << BCH_ACCOUNTING_SHARD_BITS);
+	struct bkey_i_accounting *a;
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	int ret;
+
+	/* Already updating this counter in this transaction? */
+	a = accounting_trans_get_update(trans, type, id);
+	if (a) {
+		accounting_add(a, d);
+		return 0;
+	}
+
+	a = bch2_trans_kmalloc(trans, sizeof(*a) + sizeof(u64) * nr);
+	if (IS_ERR(a))
+		return PTR_ERR(a);
+
+	iter = bch2_trans_get_iter(trans, BTREE_ID_ACCOUNTING,
+				   bch2_accounting_pos(type, id, shard),
+				   BTREE_ITER_CACHED|
+				   BTREE_ITER_INTENT);
+	k = bch2_btree_iter_peek_cached(iter);
+	ret = bkey_err(k);
+	if (ret)
+		goto err;
+
+	bkey_accounting_init(&a->k_i);
+	a->k.p = iter->pos;
+	set_bkey_val_u64s(&a->k, nr);
+
+	if (k.k->type == KEY_TYPE_accounting)
+		memcpy(a->v.d, bkey_s_c_to_accounting(k).v->d,
+		       sizeof(u64) * nr);
+	else
+		memset(a->v.d, 0, sizeof(u64) * nr);
+
+	accounting_add(a, d);
+
+	bch2_trans_update(trans, iter, &a->k_i, 0);
+err:
+	bch2_trans_iter_put(trans, iter);
+	return ret;
+}
+
+/*
+ * Read a counter - @d must have room for bch2_accounting_nr_counters[type]
+ * entries:
+ */
+int bch2_accounting_read(struct bch_fs *c, enum bch_accounting_type type,
+			 u64 id, u64 *d)
+{
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	unsigned i, shard, nr = bch2_accounting_nr_counters[type];
+	int ret = 0;
+
+	bch2_trans_init(&trans, c, 0, 0);
+retry:
+	bch2_trans_begin(&trans);
+	memset(d, 0, sizeof(u64) * nr);
+
+	for (shard = 0; shard < 1U << BCH_ACCOUNTING_SHARD_BITS; shard++) {
+		iter = bch2_trans_get_iter(&trans, BTREE_ID_ACCOUNTING,
+					   bch2_accounting_pos(type, id, shard),
+					   BTREE_ITER_CACHED);
+		k = bch2_btree_iter_peek_cached(iter);
+		ret = bkey_err(k);
+		if (!ret && k.k->type == KEY_TYPE_accounting)
+			for (i = 0; i < min(nr, bkey_val_u64s(k.k)); i++)
+				d[i] += le64_to_cpu(bkey_s_c_to_accounting(k).v->d[i]);
+		bch2_trans_iter_put(&trans, iter);
+
+		if (ret == -EINTR)
+			goto retry;
+		if (ret)
+			break;
+	}
+
+	bch2_trans_exit(&trans);
+	return ret;
+}
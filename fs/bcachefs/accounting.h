@@ -0,0 +1,31 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _BCACHEFS_ACCOUNTING_H
+#define _BCACHEFS_ACCOUNTING_H
+
+extern const u8 bch2_accounting_nr_counters[];
+
+const char *bch2_accounting_invalid(const struct bch_fs *, struct bkey_s_c);
+void bch2_accounting_to_text(struct printbuf *, struct bch_fs *, struct bkey_s_c);
+
+#define bch2_bkey_ops_accounting (struct bkey_ops) {	\
+	.key_invalid	= bch2_accounting_invalid,	\
+	.val_to_text	= bch2_accounting_to_text,	\
+}
+
+static inline bool bch2_fs_has_accounting(struct bch_fs *c)
+{
+	return c->sb.features & (1ULL << BCH_FEATURE_accounting);
+}
+
+static inline struct bpos bch2_accounting_pos(enum bch_accounting_type type,
+					      u64 id, unsigned shard)
+{
+	return POS(type, (id << BCH_ACCOUNTING_SHARD_BITS) | shard);
+}
+
+int bch2_accounting_update(struct btree_trans *, enum bch_accounting_type,
+			   u64, const s64 *);
+int bch2_accounting_read(struct bch_fs *, enum bch_accounting_type,
+			 u64, u64 *);
+
+#endif /* _BCACHEFS_ACCOUNTING_H */
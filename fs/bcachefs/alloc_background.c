@@ -13,6 +13,7 @@
 #include "debug.h"
 #include "ec.h"
 #include "error.h"
+#include "lru.h"
 #include "recovery.h"
 #include "varint.h"
 
@@ -39,26 +40,25 @@ static void pd_controllers_update(struct work_struct *work)
 					   struct bch_fs,
 					   pd_controllers_update);
 	struct bch_dev *ca;
-	s64 free = 0, fragmented = 0;
 	unsigned i;
 
 	for_each_member_device(ca, c, i) {
 		struct bch_dev_usage stats = bch2_dev_usage_read(ca);
-
-		free += bucket_to_sector(ca,
+		s64 free = bucket_to_sector(ca,
 				__dev_buckets_free(ca, stats)) << 9;
 		/*
 		 * Bytes of internal fragmentation, which can be
 		 * reclaimed by copy GC
 		 */
-		fragmented += max_t(s64, 0, (bucket_to_sector(ca,
+		s64 fragmented = max_t(s64, 0, (bucket_to_sector(ca,
 					stats.d[BCH_DATA_user].buckets +
 					stats.d[BCH_DATA_cached].buckets) -
 				  (stats.d[BCH_DATA_user].sectors +
 				   stats.d[BCH_DATA_cached].sectors)) << 9);
+
+		bch2_pd_controller_update(&ca->copygc_pd, free, fragmented, -1);
 	}
 
-	bch2_pd_controller_update(&c->copygc_pd, free, fragmented, -1);
 	schedule_delayed_work(&c->pd_controllers_update,
 			      c->pd_controllers_update_seconds * HZ);
 }
@@ -174,7 +174,7 @@ static int bch2_alloc_unpack_v2(struct bkey_alloc_unpacked *out,
 
 #define x(_name, _bits)							\
 	if (fieldnr < a.v->nr_fields) {					\
-		ret = bch2_varint_decode(in, end, &v);			\
+		ret = __bch2_varint_decode(in, end, &v);		\
 		if (ret < 0)						\
 			return ret;					\
 		in += ret;						\
@@ -210,7 +210,7 @@ static void bch2_alloc_pack_v2(struct bkey_alloc_buf *dst,
 	nr_fields++;							\
 									\
 	if (src._name) {						\
-		out += bch2_varint_encode(out, src._name);		\
+		out += __bch2_varint_encode(out, src._name);		\
 									\
 		last_nonzero_field = out;				\
 		last_nonzero_fieldnr = nr_fields;			\
@@ -328,8 +328,8 @@ static int bch2_alloc_read_fn(struct bch_fs *c, enum btree_id id,
 	g->_mark.data_type	= u.data_type;
 	g->_mark.dirty_sectors	= u.dirty_sectors;
 	g->_mark.cached_sectors	= u.cached_sectors;
-	g->io_time[READ]	= u.read_time;
-	g->io_time[WRITE]	= u.write_time;
+	bucket_io_time_set(g, READ,	u.read_time);
+	bucket_io_time_set(g, WRITE,	u.write_time);
 	g->oldest_gen		= u.oldest_gen;
 	g->gen_valid		= 1;
 
@@ -338,11 +338,13 @@ static int bch2_alloc_read_fn(struct bch_fs *c, enum btree_id id,
 
 int bch2_alloc_read(struct bch_fs *c, struct journal_keys *journal_keys)
 {
+	struct bch_dev *ca;
+	unsigned i;
 	int ret;
 
 	down_read(&c->gc_lock);
-	ret = bch2_btree_and_journal_walk(c, journal_keys, BTREE_ID_ALLOC,
-					  NULL, bch2_alloc_read_fn);
+	ret = bch2_btree_and_journal_walk_parallel(c, journal_keys,
+					BTREE_ID_ALLOC, NULL, bch2_alloc_read_fn);
 	up_read(&c->gc_lock);
 
 	if (ret) {
@@ -350,6 +352,12 @@ int bch2_alloc_read(struct bch_fs *c, struct journal_keys *journal_keys)
 		return ret;
 	}
 
+	for_each_member_device(ca, c, i) {
+		down_read(&ca->bucket_lock);
+		bch2_dev_buckets_frag_rebuild(ca);
+		up_read(&ca->bucket_lock);
+	}
+
 	return 0;
 }
 
@@ -401,32 +409,99 @@ static int bch2_alloc_write_key(struct btree_trans *trans,
 	return ret;
 }
 
+/*
+ * A bucket that has never been written to has no alloc key: a missing key
+ * reads as gen 0, empty, so there's no need to write one out - and on a freshly
+ * formatted or added device, that's nearly every bucket:
+ */
+static bool bucket_never_written(struct bucket *g)
+{
+	struct bucket_mark m = READ_ONCE(g->mark);
+
+	return !m.gen &&
+		!m.data_type &&
+		!m.dirty_sectors &&
+		!m.cached_sectors &&
+		!m.stripe &&
+		!g->oldest_gen &&
+		!g->io_time[READ] &&
+		!g->io_time[WRITE];
+}
+
+/*
+ * Find the next bucket at or after @b that needs its alloc key written: either
+ * it's been used, or it already has a key that might need updating. Unused
+ * buckets are skipped by scanning the in memory bucket array, not the btree:
+ */
+static int bch2_alloc_write_next(struct btree_trans *trans,
+				 struct btree_iter *iter,
+				 struct bch_dev *ca, u64 b, u64 *next)
+{
+	struct bch_fs *c = trans->c;
+	struct bkey_s_c k;
+	u64 end;
+	int ret;
+retry:
+	bch2_trans_begin(trans);
+
+	bch2_btree_iter_set_pos(iter, POS(ca->dev_idx, b));
+	k = bch2_btree_iter_peek(iter);
+	ret = bkey_err(k);
+	if (ret == -EINTR)
+		goto retry;
+	if (ret)
+		return ret;
+
+	end = k.k && k.k->p.inode == ca->dev_idx
+		? min(k.k->p.offset, ca->mi.nbuckets)
+		: ca->mi.nbuckets;
+
+	percpu_down_read(&c->mark_lock);
+	while (b < end && bucket_never_written(bucket(ca, b)))
+		if (!(++b & 0xffff)) {
+			percpu_up_read(&c->mark_lock);
+			cond_resched();
+			percpu_down_read(&c->mark_lock);
+		}
+	percpu_up_read(&c->mark_lock);
+
+	*next = b;
+	return 0;
+}
+
 int bch2_alloc_write(struct bch_fs *c, unsigned flags)
 {
 	struct btree_trans trans;
-	struct btree_iter *iter;
+	struct btree_iter *iter, *next;
 	struct bch_dev *ca;
 	unsigned i;
+	u64 b;
 	int ret = 0;
 
 	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 0);
 
 	iter = bch2_trans_get_iter(&trans, BTREE_ID_ALLOC, POS_MIN,
 				   BTREE_ITER_SLOTS|BTREE_ITER_INTENT);
+	next = bch2_trans_get_iter(&trans, BTREE_ID_ALLOC, POS_MIN,
+				   BTREE_ITER_PREFETCH);
 
 	for_each_member_device(ca, c, i) {
-		bch2_btree_iter_set_pos(iter,
-			POS(ca->dev_idx, ca->mi.first_bucket));
+		b = ca->mi.first_bucket;
 
-		while (iter->pos.offset < ca->mi.nbuckets) {
+		while (!(ret = bch2_alloc_write_next(&trans, next, ca, b, &b)) &&
+		       b < ca->mi.nbuckets) {
 			bch2_trans_cond_resched(&trans);
 
+			bch2_btree_iter_set_pos(iter, POS(ca->dev_idx, b));
 			ret = bch2_alloc_write_key(&trans, iter, flags);
-			if (ret) {
-				percpu_ref_put(&ca->io_ref);
-				goto err;
-			}
-			bch2_btree_iter_next_slot(iter);
+			if (ret)
+				break;
+			b++;
+		}
+
+		if (ret) {
+			percpu_ref_put(&ca->io_ref);
+			goto err;
 		}
 	}
 err:
@@ -434,6 +509,71 @@ int bch2_alloc_write(struct bch_fs *c, unsigned flags)
 	return ret;
 }
 
+struct alloc_bulk_load {
+	unsigned		dev;
+	u64			b;
+	struct bkey_alloc_buf	a;
+};
+
+static struct bkey_i *alloc_bulk_load_next(struct bch_fs *c, void *arg)
+{
+	struct alloc_bulk_load *s = arg;
+	struct bch_dev *ca;
+	struct bucket *g;
+
+	for (; s->dev < c->sb.nr_devices; s->dev++, s->b = 0) {
+		if (!bch2_dev_exists2(c, s->dev))
+			continue;
+
+		ca = bch_dev_bkey_exists(c, s->dev);
+		s->b = max_t(u64, s->b, ca->mi.first_bucket);
+
+		percpu_down_read(&c->mark_lock);
+		while (s->b < ca->mi.nbuckets &&
+		       bucket_never_written(bucket(ca, s->b)))
+			if (!(++s->b & 0xffff)) {
+				percpu_up_read(&c->mark_lock);
+				cond_resched();
+				percpu_down_read(&c->mark_lock);
+			}
+
+		if (s->b < ca->mi.nbuckets) {
+			g = bucket(ca, s->b);
+			bch2_alloc_pack(c, &s->a,
+				__alloc_mem_to_key(c, POS(s->dev, s->b),
+						   g, READ_ONCE(g->mark)));
+			s->b++;
+			percpu_up_read(&c->mark_lock);
+			return &s->a.k;
+		}
+		percpu_up_read(&c->mark_lock);
+	}
+
+	return NULL;
+}
+
+/*
+ * With -o reconstruct_alloc the alloc btree was dropped, so there are no
+ * existing keys to compare against and every used bucket gets a new key: bulk
+ * load them, instead of a transaction per bucket.
+ *
+ * Triggers don't run - the in memory bucket marks are what we're writing out:
+ */
+int bch2_alloc_write_reconstructed(struct bch_fs *c)
+{
+	struct alloc_bulk_load s = { 0 };
+	int ret;
+
+	if (!test_bit(BCH_FS_RW, &c->flags)) {
+		ret = bch2_fs_read_write_early(c);
+		if (ret)
+			return ret;
+	}
+
+	return bch2_btree_bulk_load(c, BTREE_ID_ALLOC, BTREE_TRIGGER_NORUN,
+				    alloc_bulk_load_next, &s);
+}
+
 /* Bucket IO clocks: */
 
 int bch2_bucket_io_time_reset(struct btree_trans *trans, unsigned dev,
@@ -468,9 +608,18 @@ int bch2_bucket_io_time_reset(struct btree_trans *trans, unsigned dev,
 
 	time = rw == READ ? &u.read_time : &u.write_time;
 	now = atomic64_read(&c->io_clock[rw].now);
-	if (*time == now)
+	if (*time >> BUCKET_IO_TIME_SHIFT == now >> BUCKET_IO_TIME_SHIFT)
 		goto out;
 
+	/* Move cached buckets to the end of the LRU: */
+	if (rw == READ &&
+	    bch2_bucket_is_lru(u.dirty_sectors, u.cached_sectors)) {
+		ret   = bch2_lru_delete(trans, dev, bucket_nr, *time) ?:
+			bch2_lru_set(trans, dev, bucket_nr, now);
+		if (ret)
+			goto out;
+	}
+
 	*time = now;
 
 	bch2_alloc_pack(c, a, u);
@@ -558,6 +707,11 @@ static bool bch2_can_invalidate_bucket(struct bch_dev *ca, size_t b,
 	    test_bit(b, ca->buckets_nouse))
 		return false;
 
+	/* Repair the empty bucket index if a full scan found one it missed: */
+	if (is_empty_bucket(m) &&
+	    !test_bit(b, ca->buckets_empty))
+		set_bit(b, ca->buckets_empty);
+
 	gc_gen = bucket_gc_gen(bucket(ca, b));
 
 	if (gc_gen >= BUCKET_GC_GEN_MAX / 2)
@@ -584,7 +738,7 @@ static unsigned bucket_sort_key(struct bucket *g, struct bucket_mark m,
 		 * Prefer to keep buckets that have been read more recently, and
 		 * buckets that have more data in them:
 		 */
-		u64 last_read = max_t(s64, 0, now - g->io_time[READ]);
+		u64 last_read = now - bucket_io_time(g, READ, now);
 		u32 last_read_scaled = max_t(u64, U32_MAX, div_u64(last_read, used));
 
 		return -last_read_scaled;
@@ -617,6 +771,162 @@ static inline int bucket_idx_cmp(const void *_l, const void *_r)
 	return cmp_int(l->bucket, r->bucket);
 }
 
+/*
+ * Empty buckets are always the best candidates, whatever the replacement
+ * policy - find them via the empty bucket index, so that when there's free
+ * space the cost of refilling the freelists doesn't depend on device size:
+ */
+static size_t find_empty_buckets(struct bch_fs *c, struct bch_dev *ca)
+{
+	struct bucket_array *buckets;
+	struct alloc_heap_entry e = { 0 };
+	u64 now, last_seq_ondisk;
+	size_t b, start, end, nr = 0;
+	bool wrapped = false;
+
+	down_read(&ca->bucket_lock);
+
+	buckets = bucket_array(ca);
+	ca->alloc_heap.used = 0;
+	now = atomic64_read(&c->io_clock[READ].now);
+	last_seq_ondisk = c->journal.last_seq_ondisk;
+
+	start = ca->buckets_empty_cursor;
+	if (start < ca->mi.first_bucket || start >= ca->mi.nbuckets)
+		start = ca->mi.first_bucket;
+
+	b	= start;
+	end	= ca->mi.nbuckets;
+
+	/* alloc_heap is twice ALLOC_SCAN_BATCH, so it can't fill up here: */
+	while (nr < ALLOC_SCAN_BATCH(ca)) {
+		struct bucket *g;
+		struct bucket_mark m;
+		unsigned key;
+
+		b = find_next_bit(ca->buckets_empty, end, b);
+		if (b >= end) {
+			if (wrapped)
+				break;
+			wrapped	= true;
+			b	= ca->mi.first_bucket;
+			end	= start;
+			continue;
+		}
+
+		g = bucket_array_entry(buckets, b);
+		m = READ_ONCE(g->mark);
+
+		if (!is_empty_bucket(m)) {
+			/* lost a race with bucket marking: */
+			clear_bit(b, ca->buckets_empty);
+			b++;
+			continue;
+		}
+
+		if (!bch2_can_invalidate_bucket(ca, b, m)) {
+			b++;
+			continue;
+		}
+
+		key = bucket_sort_key(g, m, now, last_seq_ondisk);
+
+		if (e.nr && e.bucket + e.nr == b && e.key == key) {
+			e.nr++;
+		} else {
+			if (e.nr)
+				heap_add(&ca->alloc_heap, e,
+					 bucket_alloc_cmp, NULL);
+
+			e = (struct alloc_heap_entry) {
+				.bucket = b,
+				.nr	= 1,
+				.key	= key,
+			};
+		}
+
+		nr++;
+		b++;
+	}
+
+	if (e.nr)
+		heap_add(&ca->alloc_heap, e, bucket_alloc_cmp, NULL);
+
+	ca->buckets_empty_cursor = b;
+
+	up_read(&ca->bucket_lock);
+	return nr;
+}
+
+/*
+ * Find the least recently read cached buckets from the start of the LRU btree,
+ * without looking at every bucket: entries are visited in LRU order, so the
+ * sort key is just the order we found them in.
+ *
+ * Returns 0 if the LRU btree didn't have a full batch of valid entries - it
+ * doesn't know about cached buckets written before the last write buffer flush,
+ * so then we fall back to a full scan.
+ */
+static size_t find_reclaimable_buckets_lru_btree(struct bch_fs *c,
+						 struct bch_dev *ca)
+{
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	size_t nr = 0, nr_stale = 0;
+	int ret;
+
+	if (!bch2_fs_has_lru(c))
+		return 0;
+
+	ca->alloc_heap.used = 0;
+
+	bch2_trans_init(&trans, c, 0, 0);
+
+	for_each_btree_key(&trans, iter, BTREE_ID_LRU,
+			   bch2_lru_pos(ca->dev_idx, 0, 0), 0, k, ret) {
+		struct alloc_heap_entry e;
+		bool valid;
+
+		if (bch2_lru_pos_dev(k.k->p) != ca->dev_idx ||
+		    nr >= ALLOC_SCAN_BATCH(ca) ||
+		    ca->alloc_heap.used >= ca->alloc_heap.size)
+			break;
+
+		down_read(&ca->bucket_lock);
+		valid = k.k->type == KEY_TYPE_lru &&
+			bch2_lru_entry_valid(ca, k.k->p) &&
+			bch2_can_invalidate_bucket(ca, k.k->p.offset,
+					READ_ONCE(bucket(ca, k.k->p.offset)->mark));
+		up_read(&ca->bucket_lock);
+
+		if (!valid) {
+			nr_stale++;
+			continue;
+		}
+
+		e = (struct alloc_heap_entry) {
+			.bucket	= k.k->p.offset,
+			.nr	= 1,
+			.key	= nr,
+		};
+		heap_add(&ca->alloc_heap, e, bucket_alloc_cmp, NULL);
+		nr++;
+	}
+	bch2_trans_iter_put(&trans, iter);
+	bch2_trans_exit(&trans);
+
+	if (nr_stale)
+		queue_work(system_long_wq, &ca->lru_cleanup_work);
+
+	if (ret || nr < ALLOC_SCAN_BATCH(ca)) {
+		ca->alloc_heap.used = 0;
+		return 0;
+	}
+
+	return nr;
+}
+
 static void find_reclaimable_buckets_lru(struct bch_fs *c, struct bch_dev *ca)
 {
 	struct bucket_array *buckets;
@@ -624,6 +934,9 @@ static void find_reclaimable_buckets_lru(struct bch_fs *c, struct bch_dev *ca)
 	u64 now, last_seq_ondisk;
 	size_t b, i, nr = 0;
 
+	if (find_reclaimable_buckets_lru_btree(c, ca))
+		return;
+
 	down_read(&ca->bucket_lock);
 
 	buckets = bucket_array(ca);
@@ -637,7 +950,7 @@ static void find_reclaimable_buckets_lru(struct bch_fs *c, struct bch_dev *ca)
 	 * all buckets have been visited.
 	 */
 	for (b = ca->mi.first_bucket; b < ca->mi.nbuckets; b++) {
-		struct bucket *g = &buckets->b[b];
+		struct bucket *g = bucket_array_entry(buckets, b);
 		struct bucket_mark m = READ_ONCE(g->mark);
 		unsigned key = bucket_sort_key(g, m, now, last_seq_ondisk);
 
@@ -694,7 +1007,7 @@ static void find_reclaimable_buckets_fifo(struct bch_fs *c, struct bch_dev *ca)
 			ca->fifo_last_bucket = ca->mi.first_bucket;
 
 		b = ca->fifo_last_bucket;
-		m = READ_ONCE(buckets->b[b].mark);
+		m = READ_ONCE(bucket_array_entry(buckets, b)->mark);
 
 		if (bch2_can_invalidate_bucket(ca, b, m)) {
 			struct alloc_heap_entry e = { .bucket = b, .nr = 1, };
@@ -721,7 +1034,7 @@ static void find_reclaimable_buckets_random(struct bch_fs *c, struct bch_dev *ca
 					   ca->mi.first_bucket) +
 			ca->mi.first_bucket;
 
-		m = READ_ONCE(buckets->b[b].mark);
+		m = READ_ONCE(bucket_array_entry(buckets, b)->mark);
 
 		if (bch2_can_invalidate_bucket(ca, b, m)) {
 			struct alloc_heap_entry e = { .bucket = b, .nr = 1, };
@@ -752,6 +1065,9 @@ static size_t find_reclaimable_buckets(struct bch_fs *c, struct bch_dev *ca)
 
 	ca->inc_gen_needs_gc			= 0;
 
+	if (find_empty_buckets(c, ca))
+		goto found;
+
 	switch (ca->mi.replacement) {
 	case CACHE_REPLACEMENT_LRU:
 		find_reclaimable_buckets_lru(c, ca);
@@ -763,7 +1079,7 @@ static size_t find_reclaimable_buckets(struct bch_fs *c, struct bch_dev *ca)
 		find_reclaimable_buckets_random(c, ca);
 		break;
 	}
-
+found:
 	heap_resort(&ca->alloc_heap, bucket_alloc_cmp, NULL);
 
 	for (i = 0; i < ca->alloc_heap.used; i++)
@@ -824,6 +1140,7 @@ static int bch2_invalidate_one_bucket2(struct btree_trans *trans,
 	struct bucket *g;
 	struct bucket_mark m;
 	bool invalidating_cached_data;
+	unsigned cached_sectors = 0;
 	size_t b;
 	int ret = 0;
 
@@ -883,6 +1200,7 @@ static int bch2_invalidate_one_bucket2(struct btree_trans *trans,
 	percpu_up_read(&c->mark_lock);
 
 	invalidating_cached_data = u.cached_sectors != 0;
+	cached_sectors = u.cached_sectors;
 
 	u.gen++;
 	u.data_type	= 0;
@@ -916,6 +1234,8 @@ static int bch2_invalidate_one_bucket2(struct btree_trans *trans,
 		/* remove from alloc_heap: */
 		struct alloc_heap_entry e, *top = ca->alloc_heap.data;
 
+		this_cpu_add(ca->io_done->cache_evicted, cached_sectors);
+
 		top->bucket++;
 		top->nr--;
 
@@ -1014,6 +1334,10 @@ static int push_invalidated_bucket(struct bch_fs *c, struct bch_dev *ca, size_t
 			    i == RESERVE_MOVINGGC)
 				continue;
 
+			if (i == RESERVE_NONE &&
+			    fifo_used(&ca->free[i]) >= ca->free_want)
+				continue;
+
 			if (fifo_push(&ca->free[i], bucket)) {
 				fifo_pop(&ca->free_inc, bucket);
 
@@ -1046,6 +1370,100 @@ static int push_invalidated_bucket(struct bch_fs *c, struct bch_dev *ca, size_t
 	return ret;
 }
 
+/*
+ * If the device still has plenty of free buckets, throttle discards to
+ * opts.discard_rate so they don't compete with foreground IO - but never make
+ * allocations wait on the rate limit:
+ */
+static int discard_ratelimit_wait(struct bch_fs *c, struct bch_dev *ca)
+{
+	u64 delay;
+
+	if (!c->opts.discard_rate)
+		return 0;
+
+	ca->discard_rate.rate = c->opts.discard_rate << 11;
+
+	while (fifo_used(&ca->free[RESERVE_NONE]) * 2 >= ca->free_want &&
+	       (delay = bch2_ratelimit_delay(&ca->discard_rate))) {
+		if (kthread_should_stop())
+			return 1;
+
+		schedule_timeout_interruptible(delay);
+		try_to_freeze();
+	}
+
+	return 0;
+}
+
+static size_t free_inc_run_len(struct bch_dev *ca, size_t i, size_t nr)
+{
+	size_t start = fifo_idx_entry(&ca->free_inc, i), len;
+
+	for (len = 1;
+	     i + len < nr &&
+	     fifo_idx_entry(&ca->free_inc, i + len) == start + len;
+	     len++)
+		;
+
+	return len;
+}
+
+/*
+ * On zoned devices buckets are zones, and a zone has to be reset before it can
+ * be written to again - this replaces discard:
+ */
+static void reset_bucket_zones(struct bch_fs *c, struct bch_dev *ca, size_t nr)
+{
+#ifdef CONFIG_BLK_DEV_ZONED
+	size_t i, start, len;
+	int ret;
+
+	for (i = 0; i < nr; i += len) {
+		start	= fifo_idx_entry(&ca->free_inc, i);
+		len	= free_inc_run_len(ca, i, nr);
+
+		ret = blkdev_zone_mgmt(ca->disk_sb.bdev, REQ_OP_ZONE_RESET,
+				       bucket_to_sector(ca, start),
+				       len * ca->mi.bucket_size, GFP_NOIO);
+		if (ret)
+			bch_err(ca, "error resetting zones: %i", ret);
+	}
+#endif
+}
+
+/*
+ * Discard the first @nr buckets on free_inc: physically adjacent buckets are
+ * merged into a single discard, and all the discards in the batch are in
+ * flight together - we only return once they've all completed:
+ */
+static void discard_buckets_batch(struct bch_fs *c, struct bch_dev *ca,
+				  size_t nr)
+{
+	struct bio *bio = NULL;
+	size_t i, start, len;
+	int ret = 0;
+
+	for (i = 0; i < nr && !ret; i += len) {
+		start	= fifo_idx_entry(&ca->free_inc, i);
+		len	= free_inc_run_len(ca, i, nr);
+
+		ret = __blkdev_issue_discard(ca->disk_sb.bdev,
+					     bucket_to_sector(ca, start),
+					     len * ca->mi.bucket_size,
+					     GFP_NOIO, 0, &bio);
+	}
+
+	if (bio) {
+		submit_bio_wait(bio);
+		bio_put(bio);
+	}
+
+	if (c->opts.discard_rate)
+		bch2_ratelimit_increment(&ca->discard_rate,
+					 nr * ca->mi.bucket_size);
+}
+
 /*
  * Pulls buckets off free_inc, discards them (if enabled), then adds them to
  * freelists, waiting until there's room if necessary:
@@ -1053,21 +1471,60 @@ static int push_invalidated_bucket(struct bch_fs *c, struct bch_dev *ca, size_t
 static int discard_invalidated_buckets(struct bch_fs *c, struct bch_dev *ca)
 {
 	while (!fifo_empty(&ca->free_inc)) {
-		size_t bucket = fifo_peek(&ca->free_inc);
+		size_t nr = fifo_used(&ca->free_inc);
 
-		if (ca->mi.discard &&
-		    blk_queue_discard(bdev_get_queue(ca->disk_sb.bdev)))
-			blkdev_issue_discard(ca->disk_sb.bdev,
-					     bucket_to_sector(ca, bucket),
-					     ca->mi.bucket_size, GFP_NOIO, 0);
+		if (bdev_is_zoned(ca->disk_sb.bdev)) {
+			reset_bucket_zones(c, ca, nr);
+		} else if (ca->mi.discard &&
+			   blk_queue_discard(bdev_get_queue(ca->disk_sb.bdev))) {
+			if (discard_ratelimit_wait(c, ca))
+				return 1;
 
-		if (push_invalidated_bucket(c, ca, bucket))
-			return 1;
+			discard_buckets_batch(c, ca, nr);
+		}
+
+		while (nr--)
+			if (push_invalidated_bucket(c, ca,
+					fifo_peek(&ca->free_inc)))
+				return 1;
 	}
 
 	return 0;
 }
 
+/*
+ * Size free[RESERVE_NONE] so that it covers twice the allocations we expect
+ * while a refill is in progress - and if writers are already blocked on an
+ * empty freelist, grow it quickly:
+ */
+static void bch2_dev_freelist_tune(struct bch_fs *c, struct bch_dev *ca,
+				   u64 refill_time)
+{
+	u64 now = local_clock(), alloced, rate = 0, want;
+
+	spin_lock(&c->freelist_lock);
+	alloced = ca->nr_buckets_alloced - ca->tune_last_alloced;
+	ca->tune_last_alloced = ca->nr_buckets_alloced;
+
+	if (ca->tune_last_time && time_after64(now, ca->tune_last_time))
+		rate = div64_u64(alloced * NSEC_PER_SEC,
+				 now - ca->tune_last_time);
+	ca->tune_last_time = now;
+
+	ca->alloc_rate		= ewma_add(ca->alloc_rate, rate, 3);
+	ca->refill_latency	= ewma_add(ca->refill_latency, refill_time, 3);
+
+	want = div64_u64(ca->alloc_rate * ca->refill_latency * 2,
+			 NSEC_PER_SEC);
+
+	if (c->blocked_allocate)
+		want = max_t(u64, want, ca->free_want * 2);
+
+	ca->free_want = clamp_t(u64, want, ca->free_want_min,
+				ca->free[RESERVE_NONE].size);
+	spin_unlock(&c->freelist_lock);
+}
+
 /**
  * bch_allocator_thread - move buckets from free_inc to reserves
  *
@@ -1080,6 +1537,7 @@ static int bch2_allocator_thread(void *arg)
 {
 	struct bch_dev *ca = arg;
 	struct bch_fs *c = ca->fs;
+	u64 refill_start = 0;
 	size_t nr;
 	int ret;
 
@@ -1107,12 +1565,21 @@ static int bch2_allocator_thread(void *arg)
 		}
 
 		if (!fifo_empty(&ca->free_inc)) {
+			if (refill_start) {
+				bch2_dev_freelist_tune(c, ca,
+						local_clock() - refill_start);
+				refill_start = 0;
+			}
+
 			up_read(&c->gc_lock);
 			continue;
 		}
 
 		pr_debug("free_inc now empty");
 
+		if (!refill_start)
+			refill_start = local_clock();
+
 		do {
 			/*
 			 * Find some buckets that we can invalidate, either
@@ -1175,7 +1642,7 @@ static int bch2_allocator_thread(void *arg)
 void bch2_recalc_capacity(struct bch_fs *c)
 {
 	struct bch_dev *ca;
-	u64 capacity = 0, reserved_sectors = 0, gc_reserve, copygc_threshold = 0;
+	u64 capacity = 0, reserved_sectors = 0, gc_reserve;
 	unsigned bucket_size_max = 0;
 	unsigned long ra_pages = 0;
 	unsigned i, j;
@@ -1218,7 +1685,7 @@ void bch2_recalc_capacity(struct bch_fs *c)
 
 		dev_reserve *= ca->mi.bucket_size;
 
-		copygc_threshold += dev_reserve;
+		ca->copygc_threshold = dev_reserve;
 
 		capacity += bucket_to_sector(ca, ca->mi.nbuckets -
 					     ca->mi.first_bucket);
@@ -1237,7 +1704,6 @@ void bch2_recalc_capacity(struct bch_fs *c)
 
 	reserved_sectors = min(reserved_sectors, capacity);
 
-	c->copygc_threshold = copygc_threshold;
 	c->capacity = capacity - reserved_sectors;
 
 	c->bucket_size_max = bucket_size_max;
@@ -1267,7 +1733,7 @@ static bool bch2_dev_has_open_write_point(struct bch_fs *c, struct bch_dev *ca)
 /* device goes ro: */
 void bch2_dev_allocator_remove(struct bch_fs *c, struct bch_dev *ca)
 {
-	unsigned i;
+	unsigned i, set;
 
 	BUG_ON(ca->alloc_thread);
 
@@ -1285,6 +1751,11 @@ void bch2_dev_allocator_remove(struct bch_fs *c, struct bch_dev *ca)
 	for (i = 0; i < ARRAY_SIZE(c->write_points); i++)
 		bch2_writepoint_stop(c, ca, &c->write_points[i]);
 
+	for (set = 0; set < WRITE_POINT_PERCPU_SETS; set++)
+		for (i = 0; i < WRITE_POINT_TEMP_NR; i++)
+			bch2_writepoint_stop(c, ca,
+				c->write_points_percpu[set].temp + i);
+
 	bch2_writepoint_stop(c, ca, &c->copygc_write_point);
 	bch2_writepoint_stop(c, ca, &c->rebalance_write_point);
 	bch2_writepoint_stop(c, ca, &c->btree_write_point);
@@ -1372,6 +1843,9 @@ void bch2_dev_allocator_stop(struct bch_dev *ca)
 		kthread_stop(p);
 		put_task_struct(p);
 	}
+
+	/* Only queued by the allocator thread: */
+	cancel_work_sync(&ca->lru_cleanup_work);
 }
 
 /* start allocator thread: */
@@ -4,6 +4,7 @@
 
 #include "bcachefs.h"
 #include "alloc_types.h"
+#include "buckets.h"
 #include "debug.h"
 
 struct bkey_alloc_unpacked {
@@ -57,22 +58,31 @@ void bch2_alloc_pack(struct bch_fs *, struct bkey_alloc_buf *,
 int bch2_bucket_io_time_reset(struct btree_trans *, unsigned, size_t, int);
 
 static inline struct bkey_alloc_unpacked
-alloc_mem_to_key(struct btree_iter *iter,
-		 struct bucket *g, struct bucket_mark m)
+__alloc_mem_to_key(struct bch_fs *c, struct bpos pos,
+		   struct bucket *g, struct bucket_mark m)
 {
 	return (struct bkey_alloc_unpacked) {
-		.dev		= iter->pos.inode,
-		.bucket		= iter->pos.offset,
+		.dev		= pos.inode,
+		.bucket		= pos.offset,
 		.gen		= m.gen,
 		.oldest_gen	= g->oldest_gen,
 		.data_type	= m.data_type,
 		.dirty_sectors	= m.dirty_sectors,
 		.cached_sectors	= m.cached_sectors,
-		.read_time	= g->io_time[READ],
-		.write_time	= g->io_time[WRITE],
+		.read_time	= bucket_io_time(g, READ,
+					atomic64_read(&c->io_clock[READ].now)),
+		.write_time	= bucket_io_time(g, WRITE,
+					atomic64_read(&c->io_clock[WRITE].now)),
 	};
 }
 
+static inline struct bkey_alloc_unpacked
+alloc_mem_to_key(struct btree_iter *iter,
+		 struct bucket *g, struct bucket_mark m)
+{
+	return __alloc_mem_to_key(iter->trans->c, iter->pos, g, m);
+}
+
 #define ALLOC_SCAN_BATCH(ca)		max_t(size_t, 1, (ca)->mi.nbuckets >> 9)
 
 const char *bch2_alloc_v1_invalid(const struct bch_fs *, struct bkey_s_c);
@@ -131,6 +141,7 @@ void bch2_dev_allocator_stop(struct bch_dev *);
 int bch2_dev_allocator_start(struct bch_dev *);
 
 int bch2_alloc_write(struct bch_fs *, unsigned);
+int bch2_alloc_write_reconstructed(struct bch_fs *);
 void bch2_fs_allocator_background_init(struct bch_fs *);
 
 #endif /* _BCACHEFS_ALLOC_BACKGROUND_H */
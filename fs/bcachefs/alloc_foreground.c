@@ -158,6 +158,7 @@ static void open_bucket_free_unused(struct bch_fs *c,
 	    may_realloc) {
 		spin_lock(&c->freelist_lock);
 		ob->on_partial_list = true;
+		ob->temp = wp->temp;
 		ca->open_buckets_partial[ca->open_buckets_partial_nr++] =
 			ob - c->open_buckets;
 		spin_unlock(&c->freelist_lock);
@@ -193,8 +194,8 @@ long bch2_bucket_alloc_new_fs(struct bch_dev *ca)
 	buckets = bucket_array(ca);
 
 	for (b = buckets->first_bucket; b < buckets->nbuckets; b++)
-		if (is_available_bucket(buckets->b[b].mark) &&
-		    !buckets->b[b].mark.owned_by_allocator)
+		if (is_available_bucket(bucket_array_entry(buckets, b)->mark) &&
+		    !bucket_array_entry(buckets, b)->mark.owned_by_allocator)
 			goto success;
 	b = -1;
 success:
@@ -222,7 +223,7 @@ static inline unsigned open_buckets_reserved(enum alloc_reserve reserve)
  * */
 struct open_bucket *bch2_bucket_alloc(struct bch_fs *c, struct bch_dev *ca,
 				      enum alloc_reserve reserve,
-				      bool may_alloc_partial,
+				      unsigned flags,
 				      struct closure *cl)
 {
 	struct open_bucket *ob;
@@ -230,13 +231,15 @@ struct open_bucket *bch2_bucket_alloc(struct bch_fs *c, struct bch_dev *ca,
 
 	spin_lock(&c->freelist_lock);
 
-	if (may_alloc_partial) {
+	if (flags & BUCKET_MAY_ALLOC_PARTIAL) {
+		unsigned temp = flags >> BUCKET_ALLOC_TEMP_SHIFT;
 		int i;
 
 		for (i = ca->open_buckets_partial_nr - 1; i >= 0; --i) {
 			ob = c->open_buckets + ca->open_buckets_partial[i];
 
-			if (reserve <= ob->alloc_reserve) {
+			if (reserve <= ob->alloc_reserve &&
+			    temp == ob->temp) {
 				array_remove_item(ca->open_buckets_partial,
 						  ca->open_buckets_partial_nr,
 						  i);
@@ -286,6 +289,7 @@ struct open_bucket *bch2_bucket_alloc(struct bch_fs *c, struct bch_dev *ca,
 out:
 	verify_not_on_freelist(c, ca, b);
 
+	ca->nr_buckets_alloced++;
 	ob = bch2_open_bucket_alloc(c);
 
 	spin_lock(&ob->lock);
@@ -347,6 +351,19 @@ struct dev_alloc_list bch2_dev_alloc_list(struct bch_fs *c,
 	return ret;
 }
 
+/*
+ * How much slower than ideal a device is currently completing writes - recent
+ * write latency (in ~usecs) times the writes in flight, as a log2:
+ */
+static unsigned dev_write_cost_shift(struct bch_dev *ca)
+{
+	unsigned weight = READ_ONCE(ca->fs->opts.alloc_latency_weight);
+	u64 cost = (atomic64_read(&ca->cur_latency[WRITE]) >> 10) *
+		(atomic_read(&ca->data_writes_in_flight) + 1);
+
+	return min(fls64(cost) * weight / 100, 12U);
+}
+
 void bch2_dev_stripe_increment(struct bch_dev *ca,
 			       struct dev_stripe_state *stripe)
 {
@@ -355,7 +372,14 @@ void bch2_dev_stripe_increment(struct bch_dev *ca,
 	u64 free_space_inv = free_space
 		? div64_u64(1ULL << 48, free_space)
 		: 1ULL << 48;
-	u64 scale = *v / 4;
+	u64 scale;
+
+	/*
+	 * Slow or busy devices are charged more per allocation, so they get
+	 * picked less often:
+	 */
+	free_space_inv <<= dev_write_cost_shift(ca);
+	scale = *v / 4;
 
 	if (*v + free_space_inv >= *v)
 		*v += free_space_inv;
@@ -367,9 +391,6 @@ void bch2_dev_stripe_increment(struct bch_dev *ca,
 		*v = *v < scale ? 0 : *v - scale;
 }
 
-#define BUCKET_MAY_ALLOC_PARTIAL	(1 << 0)
-#define BUCKET_ALLOC_USE_DURABILITY	(1 << 1)
-
 static void add_new_bucket(struct bch_fs *c,
 			   struct open_buckets *ptrs,
 			   struct bch_devs_mask *devs_may_alloc,
@@ -419,8 +440,7 @@ bch2_bucket_alloc_set(struct bch_fs *c,
 		if (!ca->mi.durability && *have_cache)
 			continue;
 
-		ob = bch2_bucket_alloc(c, ca, reserve,
-				flags & BUCKET_MAY_ALLOC_PARTIAL, cl);
+		ob = bch2_bucket_alloc(c, ca, reserve, flags, cl);
 		if (IS_ERR(ob)) {
 			ret = -PTR_ERR(ob);
 
@@ -499,6 +519,11 @@ bucket_alloc_from_stripe(struct bch_fs *c,
 		}
 	goto out_put_head;
 got_bucket:
+	if (bch2_ec_stripe_block_buf_alloc(h->s, ec_idx)) {
+		clear_bit(ec_idx, h->s->blocks_allocated);
+		goto out_put_head;
+	}
+
 	ca = bch_dev_bkey_exists(c, ob->ptr.dev);
 
 	ob->ec_idx	= ec_idx;
@@ -738,7 +763,22 @@ static struct write_point *writepoint_find(struct bch_fs *c,
 					   unsigned long write_point)
 {
 	struct write_point *wp, *oldest;
+	struct open_bucket *ob;
 	struct hlist_head *head;
+	enum write_point_temp temp;
+	unsigned i;
+
+	if (writepoint_is_percpu(write_point)) {
+		/*
+		 * We may be migrated to another cpu after this, but that's
+		 * fine - the lock is what protects the write point:
+		 */
+		unsigned set = raw_smp_processor_id() % WRITE_POINT_PERCPU_SETS;
+
+		wp = c->write_points_percpu[set].temp + (write_point >> 2);
+		mutex_lock(&wp->lock);
+		return wp;
+	}
 
 	if (!(write_point & 1UL)) {
 		wp = (struct write_point *) write_point;
@@ -785,6 +825,18 @@ static struct write_point *writepoint_find(struct bch_fs *c,
 	wp->write_point = write_point;
 	hlist_add_head_rcu(&wp->node, head);
 	mutex_unlock(&c->write_points_hash_lock);
+
+	/*
+	 * Don't put data with a different lifetime in the buckets it has open:
+	 * give them back, for reuse by writes with the old lifetime
+	 */
+	temp = writepoint_hashed_to_temp(write_point);
+	if (wp->temp != temp) {
+		open_bucket_for_each(c, &wp->ptrs, ob, i)
+			open_bucket_free_unused(c, wp, ob);
+		wp->ptrs.nr	= 0;
+		wp->temp	= temp;
+	}
 out:
 	wp->last_used = sched_clock();
 	return wp;
@@ -826,7 +878,8 @@ struct write_point *bch2_alloc_sectors_start(struct bch_fs *c,
 	wp = writepoint_find(c, write_point.v);
 
 	if (wp->type == BCH_DATA_user)
-		ob_flags |= BUCKET_MAY_ALLOC_PARTIAL;
+		ob_flags |= BUCKET_MAY_ALLOC_PARTIAL|
+			BUCKET_ALLOC_TEMP(wp->temp);
 
 	/* metadata may not allocate on cache devices: */
 	if (wp->type != BCH_DATA_user)
@@ -892,6 +945,18 @@ struct write_point *bch2_alloc_sectors_start(struct bch_fs *c,
 
 	mutex_unlock(&wp->lock);
 
+	/*
+	 * Per cpu write points each hold a partially used bucket - when we're
+	 * short on buckets fall back to the shared write points, which can be
+	 * shrunk:
+	 */
+	if (ret == FREELIST_EMPTY &&
+	    writepoint_is_percpu(write_point.v)) {
+		write_point = writepoint_hashed_temp((unsigned long) current,
+						     write_point.v >> 2);
+		goto retry;
+	}
+
 	if (ret == FREELIST_EMPTY &&
 	    try_decrease_writepoints(c, write_points_nr))
 		goto retry;
@@ -966,6 +1031,7 @@ void bch2_fs_allocator_foreground_init(struct bch_fs *c)
 {
 	struct open_bucket *ob;
 	struct write_point *wp;
+	unsigned set, i;
 
 	mutex_init(&c->write_points_hash_lock);
 	c->write_points_nr = ARRAY_SIZE(c->write_points);
@@ -985,6 +1051,17 @@ void bch2_fs_allocator_foreground_init(struct bch_fs *c)
 	writepoint_init(&c->btree_write_point,		BCH_DATA_btree);
 	writepoint_init(&c->rebalance_write_point,	BCH_DATA_user);
 	writepoint_init(&c->copygc_write_point,		BCH_DATA_user);
+	/* data copygc moves has already outlived what was around it: */
+	c->copygc_write_point.temp = WRITE_POINT_COLD;
+
+	for (set = 0; set < WRITE_POINT_PERCPU_SETS; set++)
+		for (i = 0; i < WRITE_POINT_TEMP_NR; i++) {
+			wp = c->write_points_percpu[set].temp + i;
+
+			writepoint_init(wp, BCH_DATA_user);
+			wp->write_point	= writepoint_percpu(i).v;
+			wp->temp	= i;
+		}
 
 	for (wp = c->write_points;
 	     wp < c->write_points + c->write_points_nr; wp++) {
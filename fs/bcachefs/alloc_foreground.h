@@ -31,8 +31,14 @@ void bch2_dev_stripe_increment(struct bch_dev *, struct dev_stripe_state *);
 
 long bch2_bucket_alloc_new_fs(struct bch_dev *);
 
+#define BUCKET_MAY_ALLOC_PARTIAL	(1 << 0)
+#define BUCKET_ALLOC_USE_DURABILITY	(1 << 1)
+/* partially used buckets are only reused by writes of the same lifetime: */
+#define BUCKET_ALLOC_TEMP_SHIFT		2
+#define BUCKET_ALLOC_TEMP(_temp)	((_temp) << BUCKET_ALLOC_TEMP_SHIFT)
+
 struct open_bucket *bch2_bucket_alloc(struct bch_fs *, struct bch_dev *,
-				      enum alloc_reserve, bool,
+				      enum alloc_reserve, unsigned,
 				      struct closure *);
 
 static inline void ob_push(struct bch_fs *c, struct open_buckets *obs,
@@ -128,11 +134,41 @@ static inline struct write_point_specifier writepoint_hashed(unsigned long v)
 	return (struct write_point_specifier) { .v = v | 1 };
 }
 
+/*
+ * Hashed write points carry the data lifetime in bit 1, so writes with
+ * different lifetime hints never share one:
+ */
+static inline struct write_point_specifier
+writepoint_hashed_temp(unsigned long v, enum write_point_temp temp)
+{
+	BUILD_BUG_ON(WRITE_POINT_TEMP_NR > 2);
+
+	return writepoint_hashed((v & ~2UL) | ((unsigned long) temp << 1));
+}
+
+static inline enum write_point_temp writepoint_hashed_to_temp(unsigned long v)
+{
+	return (v >> 1) & 1;
+}
+
 static inline struct write_point_specifier writepoint_ptr(struct write_point *wp)
 {
 	return (struct write_point_specifier) { .v = (unsigned long) wp };
 }
 
+static inline struct write_point_specifier
+writepoint_percpu(enum write_point_temp temp)
+{
+	return (struct write_point_specifier) {
+		.v = WRITE_POINT_PERCPU | ((unsigned long) temp << 2)
+	};
+}
+
+static inline bool writepoint_is_percpu(unsigned long v)
+{
+	return (v & 3UL) == WRITE_POINT_PERCPU;
+}
+
 void bch2_fs_allocator_foreground_init(struct bch_fs *);
 
 #endif /* _BCACHEFS_ALLOC_FOREGROUND_H */
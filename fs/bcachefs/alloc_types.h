@@ -25,6 +25,30 @@ typedef FIFO(long)	alloc_fifo;
 #define WRITE_POINT_HASH_NR	32
 #define WRITE_POINT_MAX		32
 
+/*
+ * Small foreground writes may use a per cpu write point, which skips the write
+ * point hash table and is almost never contended - and packs small writes from
+ * many inodes into the same buckets. Each cpu has one per expected data
+ * lifetime, so that short and long lived data don't end up sharing buckets.
+ *
+ * Every one of these write points can hold a partially written bucket open, so
+ * rather than having a set for every possible cpu, cpus are hashed onto a fixed
+ * number of sets - that bounds how many buckets they can strand:
+ *
+ * Hashed write points are kept apart by lifetime too: it's part of the write
+ * point specifier, and buckets a write point had open are only reused by writes
+ * of the same lifetime (see open_bucket.temp).
+ */
+enum write_point_temp {
+	WRITE_POINT_HOT,
+	WRITE_POINT_COLD,
+	WRITE_POINT_TEMP_NR,
+};
+
+#define WRITE_POINT_PERCPU		2UL
+#define WRITE_POINT_PERCPU_MAX_SECTORS	128
+#define WRITE_POINT_PERCPU_SETS		16
+
 typedef u16			open_bucket_idx_t;
 
 struct open_bucket {
@@ -38,6 +62,8 @@ struct open_bucket {
 	 */
 	u8			ec_idx;
 	u8			type;
+	/* lifetime of the write point it was on, for the partial list: */
+	u8			temp;
 	unsigned		valid:1;
 	unsigned		on_partial_list:1;
 	int			alloc_reserve:3;
@@ -63,6 +89,7 @@ struct write_point {
 	u64			last_used;
 	unsigned long		write_point;
 	enum bch_data_type	type;
+	enum write_point_temp	temp;
 
 	/* calculated based on how many pointers we're actually going to use: */
 	unsigned		sectors_free;
@@ -71,6 +98,10 @@ struct write_point {
 	struct dev_stripe_state	stripe;
 };
 
+struct write_points_percpu {
+	struct write_point	temp[WRITE_POINT_TEMP_NR];
+};
+
 struct write_point_specifier {
 	unsigned long		v;
 };
@@ -0,0 +1,198 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include "bcachefs.h"
+#include "backpointers.h"
+#include "btree_cache.h"
+#include "btree_iter.h"
+#include "btree_update.h"
+#include "extents.h"
+
+/*
+ * Backpointers btree:
+ *
+ * Every dirty pointer in the extents and reflink btrees has a backpointer in
+ * BTREE_ID_BACKPOINTERS, keyed by device and offset on the device, pointing
+ * back to the extent - so the data in a bucket (or any other range of a device)
+ * can be found by walking that range of the index, instead of scanning every
+ * extent in the filesystem. Cached pointers aren't indexed: nothing needs to
+ * move them.
+ *
+ * Backpointers are maintained by the extent triggers, via the btree write
+ * buffer, so they're updated atomically with the extents they point to but
+ * aren't visible until the write buffer has been flushed: users flush it before
+ * walking the index. Users also check each entry against the extent it points
+ * to with bch2_backpointer_get_key(), and skip entries that don't match.
+ */
+
+const char *bch2_backpointer_invalid(const struct bch_fs *c, struct bkey_s_c k)
+{
+	struct bkey_s_c_backpointer bp;
+
+	if (bkey_val_bytes(k.k) != sizeof(struct bch_backpointer))
+		return "incorrect value size";
+
+	bp = bkey_s_c_to_backpointer(k);
+
+	if (bp.v->btree_id != BTREE_ID_EXTENTS &&
+	    bp.v->btree_id != BTREE_ID_REFLINK)
+		return "invalid btree id";
+
+	return NULL;
+}
+
+void bch2_backpointer_to_text(struct printbuf *out, struct bch_fs *c,
+			      struct bkey_s_c k)
+{
+	struct bkey_s_c_backpointer bp = bkey_s_c_to_backpointer(k);
+
+	pr_buf(out, "dev %llu offset %llu crc_offset %llu -> %s %llu:%llu",
+	       k.k->p.inode,
+	       bch2_backpointer_pos_offset(k.k->p),
+	       k.k->p.offset & ~(~0ULL << BCH_BACKPOINTER_CRC_OFFSET_BITS),
+	       bp.v->btree_id < BTREE_ID_NR
+	       ? bch2_btree_ids[bp.v->btree_id] : "(unknown)",
+	       le64_to_cpu(bp.v->inode),
+	       le64_to_cpu(bp.v->offset));
+}
+
+static bool backpointers_enabled(struct btree_trans *trans,
+				 enum btree_id btree, struct bkey_s_c k)
+{
+	return bch2_fs_has_backpointers(trans->c) &&
+		!(trans->flags & BTREE_INSERT_JOURNAL_REPLAY) &&
+		(btree == BTREE_ID_EXTENTS || btree == BTREE_ID_REFLINK) &&
+		(k.k->type == KEY_TYPE_extent ||
+		 k.k->type == KEY_TYPE_reflink_v);
+}
+
+static int backpointers_update(struct btree_trans *trans,
+			       enum btree_id btree, struct bkey_s_c k,
+			       bool set)
+{
+	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(k);
+	const union bch_extent_entry *entry;
+	struct extent_ptr_decoded p;
+	struct bkey_i_backpointer bp;
+	int ret;
+
+	bkey_for_each_ptr_decode(k.k, ptrs, p, entry) {
+		if (p.ptr.cached)
+			continue;
+
+		if (set) {
+			bkey_backpointer_init(&bp.k_i);
+			bp.v.btree_id	= btree;
+			bp.v.inode	= cpu_to_le64(bkey_start_pos(k.k).inode);
+			bp.v.offset	= cpu_to_le64(bkey_start_pos(k.k).offset);
+		} else {
+			bkey_init(&bp.k);
+		}
+
+		bp.k.p = bch2_backpointer_pos(p.ptr.dev, p.ptr.offset,
+					      p.crc.offset);
+
+		ret = bch2_trans_update_buffered(trans, BTREE_ID_BACKPOINTERS,
+						 &bp.k_i);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/* Add backpointers for a new extent: */
+int bch2_trans_backpointers_insert(struct btree_trans *trans,
+				   enum btree_id btree, struct bkey_i *new)
+{
+	struct bkey_s_c k = bkey_i_to_s_c(new);
+
+	if (!backpointers_enabled(trans, btree, k))
+		return 0;
+
+	return backpointers_update(trans, btree, k, true);
+}
+
+/*
+ * An existing extent is being overwritten by @new: delete its backpointers, and
+ * add backpointers for the fragments on either side of @new that remain:
+ */
+int bch2_trans_backpointers_overwrite(struct btree_trans *trans,
+				      enum btree_id btree,
+				      struct bkey_s_c old,
+				      const struct bkey *new)
+{
+	struct bkey_i *frag;
+	int ret;
+
+	if (!backpointers_enabled(trans, btree, old))
+		return 0;
+
+	ret = backpointers_update(trans, btree, old, false);
+	if (ret)
+		return ret;
+
+	if (bkey_cmp(bkey_start_pos(old.k), bkey_start_pos(new)) < 0) {
+		frag = bch2_trans_kmalloc(trans, bkey_bytes(old.k));
+		if (IS_ERR(frag))
+			return PTR_ERR(frag);
+
+		bkey_reassemble(frag, old);
+		bch2_cut_back(bkey_start_pos(new), frag);
+
+		ret = backpointers_update(trans, btree, bkey_i_to_s_c(frag), true);
+		if (ret)
+			return ret;
+	}
+
+	if (bkey_cmp(old.k->p, new->p) > 0) {
+		frag = bch2_trans_kmalloc(trans, bkey_bytes(old.k));
+		if (IS_ERR(frag))
+			return PTR_ERR(frag);
+
+		bkey_reassemble(frag, old);
+		bch2_cut_front(new->p, frag);
+
+		ret = backpointers_update(trans, btree, bkey_i_to_s_c(frag), true);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Look up the extent a backpointer at @bp_pos points to: returns
+ * bkey_s_c_null if the backpointer is stale, i.e. the extent no longer exists
+ * or no longer has a matching dirty pointer. The iterator is returned in @iter
+ * and must be put by the caller, whether or not a key was found:
+ */
+struct bkey_s_c bch2_backpointer_get_key(struct btree_trans *trans,
+					 struct btree_iter **iter,
+					 struct bpos bp_pos,
+					 struct bch_backpointer bp)
+{
+	struct bpos pos = POS(le64_to_cpu(bp.inode), le64_to_cpu(bp.offset));
+	struct bkey_ptrs_c ptrs;
+	const union bch_extent_entry *entry;
+	struct extent_ptr_decoded p;
+	struct bkey_s_c k;
+
+	*iter = bch2_trans_get_iter(trans, bp.btree_id, pos, 0);
+	k = bch2_btree_iter_peek(*iter);
+	if (!k.k || bkey_err(k))
+		return k;
+
+	if (bkey_cmp(bkey_start_pos(k.k), pos) ||
+	    (k.k->type != KEY_TYPE_extent &&
+	     k.k->type != KEY_TYPE_reflink_v))
+		return bkey_s_c_null;
+
+	ptrs = bch2_bkey_ptrs_c(k);
+	bkey_for_each_ptr_decode(k.k, ptrs, p, entry)
+		if (!p.ptr.cached &&
+		    !bkey_cmp(bch2_backpointer_pos(p.ptr.dev, p.ptr.offset,
+						   p.crc.offset), bp_pos))
+			return k;
+
+	return bkey_s_c_null;
+}
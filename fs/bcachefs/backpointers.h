@@ -0,0 +1,41 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _BCACHEFS_BACKPOINTERS_H
+#define _BCACHEFS_BACKPOINTERS_H
+
+const char *bch2_backpointer_invalid(const struct bch_fs *, struct bkey_s_c);
+void bch2_backpointer_to_text(struct printbuf *, struct bch_fs *, struct bkey_s_c);
+
+#define bch2_bkey_ops_backpointer (struct bkey_ops) {	\
+	.key_invalid	= bch2_backpointer_invalid,	\
+	.val_to_text	= bch2_backpointer_to_text,	\
+}
+
+static inline bool bch2_fs_has_backpointers(struct bch_fs *c)
+{
+	return c->sb.features & (1ULL << BCH_FEATURE_backpointers);
+}
+
+/* Largest device offset representable in a backpointer position: */
+#define BCH_BACKPOINTER_OFFSET_MAX	(U64_MAX >> BCH_BACKPOINTER_CRC_OFFSET_BITS)
+
+static inline struct bpos bch2_backpointer_pos(unsigned dev, u64 offset,
+					       unsigned crc_offset)
+{
+	return POS(dev, (offset << BCH_BACKPOINTER_CRC_OFFSET_BITS)|crc_offset);
+}
+
+static inline u64 bch2_backpointer_pos_offset(struct bpos pos)
+{
+	return pos.offset >> BCH_BACKPOINTER_CRC_OFFSET_BITS;
+}
+
+int bch2_trans_backpointers_insert(struct btree_trans *, enum btree_id,
+				   struct bkey_i *);
+int bch2_trans_backpointers_overwrite(struct btree_trans *, enum btree_id,
+				      struct bkey_s_c, const struct bkey *);
+
+struct bkey_s_c bch2_backpointer_get_key(struct btree_trans *,
+					 struct btree_iter **, struct bpos,
+					 struct bch_backpointer);
+
+#endif /* _BCACHEFS_BACKPOINTERS_H */
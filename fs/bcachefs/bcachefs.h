@@ -184,10 +184,12 @@
 #include <linux/closure.h>
 #include <linux/kobject.h>
 #include <linux/list.h>
+#include <linux/llist.h>
 #include <linux/math64.h>
 #include <linux/mutex.h>
 #include <linux/percpu-refcount.h>
 #include <linux/percpu-rwsem.h>
+#include <linux/random.h>
 #include <linux/rhashtable.h>
 #include <linux/rwsem.h>
 #include <linux/semaphore.h>
@@ -259,7 +261,11 @@ do {									\
 	BCH_DEBUG_PARAM(btree_gc_rewrite_disabled,			\
 		"Disables rewriting of btree nodes during mark and sweep")\
 	BCH_DEBUG_PARAM(btree_shrinker_disabled,			\
-		"Disables the shrinker callback for the btree node cache")
+		"Disables the shrinker callback for the btree node cache")\
+	BCH_DEBUG_PARAM(trans_commit_phase_times,			\
+		"Time each phase of btree transaction commits, by caller "\
+		"(debugfs trans-commit-phases, trans_commit_phases "	\
+		"tracepoint)")
 
 /* Parameters that should only be compiled in in debug mode: */
 #define BCH_DEBUG_PARAMS_DEBUG()					\
@@ -313,6 +319,34 @@ BCH_DEBUG_PARAMS_DEBUG()
 #undef BCH_DEBUG_PARAM
 #endif
 
+/*
+ * Verify checks in debug builds can be sampled, to bound their overhead under
+ * real load: each check runs on one in verify_<check>_rate calls (0 or 1 for
+ * every call), tunable at runtime in /sys/module/bcachefs/parameters:
+ */
+#define BCH_VERIFY_RATES()						\
+	BCH_VERIFY_RATE(btree_iter,					\
+		"Verify btree iterator positions on 1 in n calls")	\
+	BCH_VERIFY_RATE(btree_node_iter,				\
+		"Verify btree node iterators on 1 in n calls")		\
+	BCH_VERIFY_RATE(btree_trans_locks,				\
+		"Verify btree transaction locks on 1 in n calls")
+
+#ifdef CONFIG_BCACHEFS_DEBUG
+#define BCH_VERIFY_RATE(name, description)				\
+	extern unsigned bch2_verify_##name##_rate;
+BCH_VERIFY_RATES()
+#undef BCH_VERIFY_RATE
+
+static inline bool __bch2_verify_sample(unsigned rate)
+{
+	return rate <= 1 || !prandom_u32_max(rate);
+}
+
+#define bch2_verify_sample(name)					\
+	__bch2_verify_sample(READ_ONCE(bch2_verify_##name##_rate))
+#endif
+
 #define BCH_TIME_STATS()			\
 	x(btree_node_mem_alloc)			\
 	x(btree_node_split)			\
@@ -339,17 +373,44 @@ enum bch_time_stats {
 	BCH_TIME_STAT_NR
 };
 
+#define BCH_RECOVERY_PHASES()			\
+	x(journal_read)				\
+	x(btree_roots_read)			\
+	x(alloc_read)				\
+	x(stripes_read)				\
+	x(initial_gc)				\
+	x(journal_replay)			\
+	x(fsck)
+
+enum bch_recovery_phase {
+#define x(name) BCH_RECOVERY_##name,
+	BCH_RECOVERY_PHASES()
+#undef x
+	BCH_RECOVERY_PHASE_NR
+};
+
+/* What each phase of the last mount cost - IO is to all member devices: */
+struct recovery_phase_stats {
+	u64			duration;	/* nanoseconds */
+	u64			sectors_read;
+	u64			sectors_written;
+	u64			keys;
+};
+
 #include "alloc_types.h"
 #include "btree_types.h"
 #include "buckets_types.h"
 #include "clock_types.h"
+#include "dedup_types.h"
 #include "ec_types.h"
 #include "journal_types.h"
 #include "keylist_types.h"
 #include "quota_types.h"
 #include "rebalance_types.h"
 #include "replicas_types.h"
+#include "scrub_types.h"
 #include "super_types.h"
+#include "usage_history_types.h"
 
 /* Number of nodes btree coalesce will try to coalesce at once */
 #define GC_MERGE_NODES		4U
@@ -390,6 +451,13 @@ struct gc_pos {
 
 struct io_count {
 	u64			sectors[2][BCH_DATA_NR];
+
+	/* sectors read from the promote target, or from a cached pointer: */
+	u64			cache_hit;
+	/* sectors read from outside the promote target: */
+	u64			cache_miss;
+	/* cached sectors dropped by bucket invalidation: */
+	u64			cache_evicted;
 };
 
 struct bch_dev {
@@ -413,6 +481,9 @@ struct bch_dev {
 	struct bch_sb_handle	disk_sb;
 	struct bch_sb		*sb_read_scratch;
 	int			sb_write_error;
+	/* Writes this device's superblock copies, one after another: */
+	struct closure		sb_write_cl;
+	unsigned		sb_write_idx;
 
 	struct bch_devs_mask	self;
 
@@ -427,6 +498,17 @@ struct bch_dev {
 	 */
 	struct bucket_array __rcu *buckets[2];
 	unsigned long		*buckets_nouse;
+	/*
+	 * Index of empty buckets, kept up to date by bucket marking, so the
+	 * allocator doesn't have to scan every bucket to find free ones:
+	 */
+	unsigned long		*buckets_empty;
+	size_t			buckets_empty_cursor;
+	/*
+	 * Buckets copygc may evacuate, binned by how full they are, so copygc
+	 * can start from the emptiest without scanning every bucket:
+	 */
+	unsigned long		*buckets_frag[BUCKET_FRAG_BINS];
 	struct rw_semaphore	bucket_lock;
 
 	struct bch_dev_usage		*usage_base;
@@ -448,11 +530,26 @@ struct bch_dev {
 	alloc_fifo		free[RESERVE_NR];
 	alloc_fifo		free_inc;
 
+	/*
+	 * How many buckets the allocator thread keeps on free[RESERVE_NONE]:
+	 * tuned from the observed allocation rate and how long a refill takes,
+	 * so that bursts don't drain the freelist before we can refill it:
+	 */
+	size_t			free_want;
+	size_t			free_want_min;
+	u64			nr_buckets_alloced;
+	u64			tune_last_alloced;
+	u64			tune_last_time;
+	u64			alloc_rate;
+	u64			refill_latency;
+
 	open_bucket_idx_t	open_buckets_partial[OPEN_BUCKETS_COUNT];
 	open_bucket_idx_t	open_buckets_partial_nr;
 
 	size_t			fifo_last_bucket;
 
+	struct bch_ratelimit	discard_rate;
+
 	size_t			inc_gen_needs_gc;
 	size_t			inc_gen_really_needs_gc;
 
@@ -476,15 +573,40 @@ struct bch_dev {
 
 	struct work_struct	io_error_work;
 
+	/* small sync writes waiting to be submitted together: */
+	spinlock_t		write_coalesce_lock;
+	struct bio_list		write_coalesce_bios;
+	struct work_struct	write_coalesce_work;
+
+	/* deletes stale entries in the LRU btree - see lru.c: */
+	struct work_struct	lru_cleanup_work;
+
+	/* copygc - see movinggc.c: */
+	struct task_struct	*copygc_thread;
+	copygc_heap		copygc_heap;
+	struct bch_pd_controller copygc_pd;
+	u64			copygc_threshold;
+
 	/* The rest of this all shows up in sysfs */
 	atomic64_t		cur_latency[2];
+	atomic_t		reads_in_flight;
+	int			numa_node;
 	struct time_stats	io_latency[2];
+	/*
+	 * Split by data type, for the types in bch2_dev_io_type_tracked(); only
+	 * bios that go through bch2_latency_acct() are counted:
+	 */
+	struct time_stats_hist __percpu *io_latency_hist[2][BCH_DATA_NR];
+	atomic_t		io_in_flight[2][BCH_DATA_NR];
 
 #define CONGESTED_MAX		1024
-	atomic_t		congested;
+	atomic_t		congested[2];
 	u64			congested_last;
 
+	atomic_t		data_writes_in_flight;
+
 	struct io_count __percpu *io_done;
+	struct bch_dev_usage_history usage_history;
 };
 
 enum {
@@ -510,6 +632,7 @@ enum {
 
 	/* misc: */
 	BCH_FS_NEED_ANOTHER_GC,
+	BCH_FS_GC_PARALLEL,
 	BCH_FS_DELETED_NODES,
 	BCH_FS_NEED_ALLOC_WRITE,
 	BCH_FS_REBUILD_REPLICAS,
@@ -521,6 +644,7 @@ struct btree_debug {
 	struct dentry		*btree;
 	struct dentry		*btree_format;
 	struct dentry		*failed;
+	struct dentry		*lock_contention;
 };
 
 struct bch_fs_pcpu {
@@ -554,6 +678,16 @@ struct btree_iter_buf {
 	struct btree_iter	*iter;
 };
 
+/*
+ * Each CPU allocates inode numbers from its own part of the inode number space,
+ * out of a run of numbers that were free the last time it looked - see
+ * bch2_inode_create():
+ */
+struct inode_alloc_shard {
+	atomic64_t		next;
+	u64			end;
+};
+
 struct bch_fs {
 	struct closure		cl;
 
@@ -579,6 +713,9 @@ struct bch_fs {
 	struct bch_dev __rcu	*devs[BCH_SB_MEMBERS_MAX];
 
 	struct bch_replicas_cpu replicas;
+	/* hash index of @replicas: entry idx + 1, 0 is empty */
+	u32			*replicas_hash;
+	unsigned		replicas_hash_mask;
 	struct bch_replicas_cpu replicas_gc;
 	struct mutex		replicas_gc_lock;
 
@@ -615,10 +752,13 @@ struct bch_fs {
 
 	unsigned short		block_bits;	/* ilog2(block_size) */
 
-	u16			btree_foreground_merge_threshold;
+	/* per btree, from BCH_SB_FIELD_btree_node_size: */
+	u16			btree_node_sectors[BTREE_ID_NR];
+	u16			btree_foreground_merge_threshold[BTREE_ID_NR];
 
 	struct closure		sb_write;
 	struct mutex		sb_lock;
+	struct work_struct	sb_write_work;
 
 	/* BTREE CACHE */
 	struct bio_set		btree_bio;
@@ -653,14 +793,37 @@ struct bch_fs {
 	struct list_head	btree_trans_list;
 	mempool_t		btree_iters_pool;
 	struct btree_iter_buf  __percpu	*btree_iters_bufs;
+	struct btree_lockless_stats __percpu *btree_lockless_stats;
+	struct btree_trans_restart_stats __percpu *btree_trans_restart_stats;
+	unsigned long		btree_trans_restart_ips[BCH_TRANS_RESTART_IPS];
+	spinlock_t		btree_trans_commit_ips_lock;
+	u64			btree_trans_commit_ips_dropped;
+	struct btree_trans_commit_ip btree_trans_commit_ips[BCH_TRANS_COMMIT_IPS];
+	struct btree_lock_stats	*btree_lock_stats;
 
 	struct srcu_struct	btree_trans_barrier;
 
 	struct btree_key_cache	btree_key_cache;
+	struct btree_write_buffer btree_write_buffer;
 
+	/* foreground write index updates, and misc: */
 	struct workqueue_struct	*wq;
 	/* copygc needs its own workqueue for index updates.. */
 	struct workqueue_struct	*copygc_wq;
+	/* index updates for other data moves - rebalance, promotes: */
+	struct workqueue_struct	*move_wq;
+	/* btree node read completions, and per bset validation: */
+	struct workqueue_struct	*btree_read_complete_wq;
+	/*
+	 * Foreground read completions: checksumming runs on the bound queue,
+	 * i.e. on the CPU that completed the bio; decompression and
+	 * decryption on the unbound queue, which has per NUMA node pools.
+	 * Reads for data moves get a normal priority queue of their own, so
+	 * that copygc can't delay foreground reads:
+	 */
+	struct workqueue_struct	*read_complete_wq;
+	struct workqueue_struct	*read_complete_unbound_wq;
+	struct workqueue_struct	*move_read_complete_wq;
 
 	/* ALLOCATION */
 	struct delayed_work	pd_controllers_update;
@@ -694,6 +857,12 @@ struct bch_fs {
 	struct mutex		usage_scratch_lock;
 	struct bch_fs_usage	*usage_scratch;
 
+	/* statfs, see bch2_fs_usage_read_short_cached(): */
+	spinlock_t		usage_cached_lock;
+	seqcount_t		usage_cached_seq;
+	u64			usage_cached_time;
+	struct bch_fs_usage_short usage_cached;
+
 	struct io_clock		io_clock[2];
 
 	/* JOURNAL SEQ BLACKLIST */
@@ -718,6 +887,7 @@ struct bch_fs {
 	struct hlist_head	write_points_hash[WRITE_POINT_HASH_NR];
 	struct mutex		write_points_hash_lock;
 	unsigned		write_points_nr;
+	struct write_points_percpu write_points_percpu[WRITE_POINT_PERCPU_SETS];
 
 	/* GARBAGE COLLECTION */
 	struct task_struct	*gc_thread;
@@ -741,6 +911,24 @@ struct bch_fs {
 	 * it's not while a gc is in progress.
 	 */
 	struct rw_semaphore	gc_lock;
+	/* for bucket oldest_gen, when initial gc marks btrees in parallel: */
+	spinlock_t		gc_oldest_gen_lock;
+
+	/* Underfull leaf nodes, for background coalescing - see btree_gc.c: */
+	spinlock_t		btree_merge_lock;
+	struct btree_merge_candidate {
+		enum btree_id	btree_id;
+		struct bpos	pos;
+	}			btree_merge_candidates[64];
+	unsigned		btree_merge_nr;
+	struct delayed_work	btree_merge_work;
+
+	/* Leaf nodes with many dead keys, for background compaction: */
+	spinlock_t		btree_compact_lock;
+	struct btree_merge_candidate
+				btree_compact_candidates[64];
+	unsigned		btree_compact_nr;
+	struct delayed_work	btree_compact_work;
 
 	/* IO PATH */
 	struct semaphore	io_in_flight;
@@ -750,11 +938,15 @@ struct bch_fs {
 	struct mutex		bio_bounce_pages_lock;
 	mempool_t		bio_bounce_pages;
 	struct rhashtable	promote_table;
+	u8			*promote_sketch;
+	atomic_t		promote_sketch_nr;
+	u64 __percpu		*promote_stats;
 
 	mempool_t		compression_bounce[2];
 	mempool_t		compress_workspace[BCH_COMPRESSION_TYPE_NR];
-	mempool_t		decompress_workspace;
+	mempool_t		decompress_workspace[BCH_COMPRESSION_TYPE_NR];
 	ZSTD_parameters		zstd_params;
+	size_t			zstd_workspace_size;
 
 	struct crypto_shash	*sha256;
 	struct crypto_sync_skcipher *chacha20;
@@ -764,21 +956,34 @@ struct bch_fs {
 
 	mempool_t		large_bkey_pool;
 
+#ifdef CONFIG_BLK_CGROUP
+	/* blk-cgroup background data moves are charged to, see move.c: */
+	spinlock_t		move_blkcg_lock;
+	struct cgroup_subsys_state *move_blkcg_css;
+#endif
+
 	/* REBALANCE */
 	struct bch_fs_rebalance	rebalance;
+	struct bch_fs_usage_history usage_history;
+
+	/* SCRUB */
+	struct bch_fs_scrub	scrub;
+
+	/* DEDUP */
+	struct bch_fs_dedup	dedup;
 
 	/* COPYGC */
-	struct task_struct	*copygc_thread;
-	copygc_heap		copygc_heap;
-	struct bch_pd_controller copygc_pd;
 	struct write_point	copygc_write_point;
-	u64			copygc_threshold;
+	/* device copygc threads moving data, at most opts.copygc_threads: */
+	atomic_t		copygc_running;
+	wait_queue_head_t	copygc_running_wait;
 
 	/* STRIPES: */
 	GENRADIX(struct stripe) stripes[2];
 
 	ec_stripes_heap		ec_stripes_heap;
 	spinlock_t		ec_stripes_heap_lock;
+	bool			ec_stripes_heap_overflow;
 
 	/* ERASURE CODING */
 	struct list_head	ec_stripe_head_list;
@@ -795,6 +1000,9 @@ struct bch_fs {
 	struct work_struct	ec_stripe_delete_work;
 	struct llist_head	ec_stripe_delete_list;
 
+	struct mutex		ec_recov_cache_lock;
+	struct ec_recov_cache_entry ec_recov_cache[EC_RECOV_CACHE_NR];
+
 	/* REFLINK */
 	u64			reflink_hint;
 
@@ -824,14 +1032,22 @@ struct bch_fs {
 	struct mutex		verify_lock;
 #endif
 
-	u64			*unused_inode_hints;
+	struct inode_alloc_shard *inode_alloc_shards;
 	unsigned		inode_shard_bits;
 
+	/* Unlinked inodes waiting to be deleted - see bch2_inode_rm_defer(): */
+	struct llist_head	inode_rm_list;
+	struct work_struct	inode_rm_work;
+	atomic_t		nr_async_truncates;
+	/* see bch2_dir_readahead(): */
+	atomic_t		nr_dir_readahead;
+
 	/*
 	 * A btree node on disk could have too many bsets for an iterator to fit
 	 * on the stack - have to dynamically allocate them
 	 */
 	mempool_t		fill_iter;
+	mempool_t		btree_read_bsets;
 
 	mempool_t		btree_bounce_pool;
 
@@ -839,11 +1055,14 @@ struct bch_fs {
 	struct list_head	journal_entries;
 	struct journal_keys	journal_keys;
 	struct list_head	journal_iters;
+	spinlock_t		journal_iters_lock;
 
 	u64			last_bucket_seq_cleanup;
 
 	/* The rest of this all shows up in sysfs */
 	atomic_long_t		read_realloc_races;
+	atomic_long_t		read_hedges;
+	atomic_long_t		read_hedges_won;
 	atomic_long_t		extent_migrate_done;
 	atomic_long_t		extent_migrate_raced;
 
@@ -852,6 +1071,10 @@ struct bch_fs {
 	bool			promote_whole_extents;
 
 	struct time_stats	times[BCH_TIME_STAT_NR];
+
+	struct recovery_phase_stats recovery_phases[BCH_RECOVERY_PHASE_NR];
+	/* keys visited by bch2_btree_and_journal_walk(): */
+	atomic64_t		recovery_keys_walked;
 };
 
 static inline void bch2_set_ra_pages(struct bch_fs *c, unsigned ra_pages)
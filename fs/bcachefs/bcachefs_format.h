@@ -342,7 +342,11 @@ static inline void bkey_init(struct bkey *k)
 	x(inline_data,		17)			\
 	x(btree_ptr_v2,		18)			\
 	x(indirect_inline_data,	19)			\
-	x(alloc_v2,		20)
+	x(alloc_v2,		20)			\
+	x(accounting,		21)			\
+	x(lru,			22)			\
+	x(backpointer,		23)			\
+	x(rebalance_work,	24)
 
 enum bch_bkey_type {
 #define x(name, nr) KEY_TYPE_##name	= nr,
@@ -861,6 +865,87 @@ struct bch_quota {
 	struct bch_quota_counter c[Q_COUNTERS];
 } __attribute__((packed, aligned(8)));
 
+/* Accounting */
+
+/*
+ * Persistent counters, in BTREE_ID_ACCOUNTING: p.inode is the counter type,
+ * and p.offset is (id << BCH_ACCOUNTING_SHARD_BITS) | shard - each counter is
+ * split across shards so that concurrent updates don't all contend on the same
+ * key, and the shards are summed when reading.
+ *
+ * compression:	id is (dev << 8) | compression type; counters are uncompressed
+ *		sectors and compressed (on disk) sectors of user data
+ */
+
+#define BCH_ACCOUNTING_TYPES()		\
+	x(compression,		0,	2)
+
+enum bch_accounting_type {
+#define x(t, n, nr_counters) BCH_ACCOUNTING_##t = n,
+	BCH_ACCOUNTING_TYPES()
+#undef x
+	BCH_ACCOUNTING_NR
+};
+
+#define BCH_ACCOUNTING_SHARD_BITS	3
+#define BCH_ACCOUNTING_COUNTERS_MAX	4
+
+struct bch_accounting {
+	struct bch_val		v;
+	__le64			d[0];
+} __attribute__((packed, aligned(8)));
+
+static inline __u64 bch_accounting_compression_id(unsigned dev,
+						  unsigned compression_type)
+{
+	return ((__u64) dev << 8) | compression_type;
+}
+
+/* LRU */
+
+/*
+ * Index of buckets that only contain cached data, by last read time, in
+ * BTREE_ID_LRU: p.inode is (dev << BCH_LRU_TIME_BITS) | read time (in units of
+ * 1 << BCH_LRU_TIME_SHIFT sectors of io clock), p.offset is the bucket - so
+ * each device's coldest cached buckets sort first. Keys are KEY_TYPE_lru, with
+ * no value.
+ */
+
+#define BCH_LRU_TIME_BITS		48
+#define BCH_LRU_TIME_SHIFT		8
+
+/*
+ * Backpointers, in BTREE_ID_BACKPOINTERS: one for each dirty pointer in the
+ * extents and reflink btrees, so that the data in a bucket can be found without
+ * scanning those btrees. p.inode is the device, p.offset is the pointer's
+ * offset on the device, shifted left by BCH_BACKPOINTER_CRC_OFFSET_BITS, or'd
+ * with the crc entry's offset, since fragments of a checksummed or compressed
+ * extent share a pointer offset. The value is the btree and start position of
+ * the extent.
+ */
+
+#define BCH_BACKPOINTER_CRC_OFFSET_BITS	13
+
+struct bch_backpointer {
+	struct bch_val		v;
+	__u8			btree_id;
+	__u8			pad[7];
+	__le64			inode;
+	__le64			offset;
+} __attribute__((packed, aligned(8)));
+
+/*
+ * Ranges of file data written with options (background_target,
+ * background_compression) that they don't yet satisfy, in
+ * BTREE_ID_REBALANCE_WORK: p is the start of the range in the extents btree,
+ * end is the end offset within the same inode.
+ */
+
+struct bch_rebalance_work {
+	struct bch_val		v;
+	__le64			end;
+} __attribute__((packed, aligned(8)));
+
 /* Erasure coding */
 
 struct bch_stripe {
@@ -908,6 +993,14 @@ struct bch_inline_data {
 	u8			data[0];
 };
 
+/*
+ * Leaves room for the refcount, so that reflink can always convert an inline
+ * data extent to indirect_inline_data:
+ */
+#define BCH_INLINE_DATA_MAX						\
+	(BKEY_VAL_U64s_MAX * sizeof(__u64) -				\
+	 sizeof(struct bch_indirect_inline_data))
+
 /* Optional/variable size superblock sections: */
 
 struct bch_sb_field {
@@ -925,7 +1018,10 @@ struct bch_sb_field {
 	x(disk_groups,	5)	\
 	x(clean,	6)	\
 	x(replicas,	7)	\
-	x(journal_seq_blacklist, 8)
+	x(journal_seq_blacklist, 8)	\
+	x(btree_node_size, 9)	\
+	x(promote_sketch, 10)	\
+	x(scrub,	11)
 
 enum bch_sb_field_type {
 #define x(f, nr)	BCH_SB_FIELD_##f = nr,
@@ -1163,6 +1259,51 @@ struct bch_sb_field_journal_seq_blacklist {
 	};
 };
 
+/*
+ * BCH_SB_FIELD_btree_node_size:
+ *
+ * Node size, in sectors, for each btree - indexed by btree ID. Zero, or a
+ * missing entry, means use BCH_SB_BTREE_NODE_SIZE(), which is also the maximum:
+ */
+
+struct bch_sb_field_btree_node_size {
+	struct bch_sb_field	field;
+	__le16			sectors[0];
+};
+
+/*
+ * BCH_SB_FIELD_promote_sketch:
+ *
+ * The promote admission filter's recent access counts, saved at clean shutdown
+ * so that promote decisions carry on where they left off after a remount, and
+ * dropped when the filesystem next goes read-write. @nr counters of 4 bits
+ * each, two per byte:
+ */
+
+struct bch_sb_field_promote_sketch {
+	struct bch_sb_field	field;
+	__le32			nr;
+	__le32			pad;
+	__u8			counters[0];
+};
+
+/*
+ * BCH_SB_FIELD_scrub:
+ *
+ * Background scrub progress: where the current pass has got to, so that it
+ * resumes from there after a remount, and when the last pass was completed (in
+ * seconds since the epoch):
+ */
+
+struct bch_sb_field_scrub {
+	struct bch_sb_field	field;
+	__le64			last_completed;
+	__le64			inode;
+	__le64			offset;
+	__u8			btree_id;
+	__u8			pad[7];
+};
+
 /* Superblock: */
 
 /*
@@ -1314,6 +1455,12 @@ LE64_BITMASK(BCH_SB_GC_RESERVE_BYTES,	struct bch_sb, flags[2],  4, 64);
 
 LE64_BITMASK(BCH_SB_ERASURE_CODE,	struct bch_sb, flags[3],  0, 16);
 LE64_BITMASK(BCH_SB_METADATA_TARGET,	struct bch_sb, flags[3], 16, 28);
+LE64_BITMASK(BCH_SB_METADATA_COMPRESSION_TYPE,
+					struct bch_sb, flags[3], 28, 32);
+LE64_BITMASK(BCH_SB_JOURNAL_COMPRESSION_TYPE,
+					struct bch_sb, flags[3], 32, 36);
+LE64_BITMASK(BCH_SB_JOURNAL_TARGET,	struct bch_sb, flags[3], 36, 48);
+LE64_BITMASK(BCH_SB_BTREE_LEAF_TARGET,	struct bch_sb, flags[3], 48, 60);
 
 /*
  * Features:
@@ -1322,7 +1469,17 @@ LE64_BITMASK(BCH_SB_METADATA_TARGET,	struct bch_sb, flags[3], 16, 28);
  * reflink:			gates KEY_TYPE_reflink
  * inline_data:			gates KEY_TYPE_inline_data
  * new_siphash:			gates BCH_STR_HASH_SIPHASH
+ * xxhash:			gates BCH_CSUM_XXHASH, BCH_STR_HASH_XXHASH
  * new_extent_overwrite:	gates BTREE_NODE_NEW_EXTENT_OVERWRITE
+ * btree_node_compression:	gates BSET_COMPRESSION_TYPE
+ * journal_compression:		gates JSET_COMPRESSION_TYPE
+ * accounting:			gates BTREE_ID_ACCOUNTING; only set at format
+ *				time, since it means the counters cover all data
+ * lru:				gates BTREE_ID_LRU; only set at format time
+ * backpointers:		gates BTREE_ID_BACKPOINTERS; only set at format
+ *				time
+ * rebalance_work:		gates BTREE_ID_REBALANCE_WORK; only set at
+ *				format time
  */
 #define BCH_SB_FEATURES()			\
 	x(lz4,				0)	\
@@ -1342,7 +1499,14 @@ LE64_BITMASK(BCH_SB_METADATA_TARGET,	struct bch_sb, flags[3], 16, 28);
 	x(reflink_inline_data,		14)	\
 	x(new_varint,			15)	\
 	x(journal_no_flush,		16)	\
-	x(alloc_v2,			17)
+	x(alloc_v2,			17)	\
+	x(btree_node_compression,	18)	\
+	x(journal_compression,		19)	\
+	x(accounting,			20)	\
+	x(lru,				21)	\
+	x(backpointers,			22)	\
+	x(rebalance_work,		23)	\
+	x(xxhash,			24)
 
 #define BCH_SB_FEATURES_ALL				\
 	((1ULL << BCH_FEATURE_new_siphash)|		\
@@ -1383,14 +1547,16 @@ enum bch_str_hash_type {
 	BCH_STR_HASH_CRC64		= 1,
 	BCH_STR_HASH_SIPHASH_OLD	= 2,
 	BCH_STR_HASH_SIPHASH		= 3,
-	BCH_STR_HASH_NR			= 4,
+	BCH_STR_HASH_XXHASH		= 4,
+	BCH_STR_HASH_NR			= 5,
 };
 
 enum bch_str_hash_opts {
 	BCH_STR_HASH_OPT_CRC32C		= 0,
 	BCH_STR_HASH_OPT_CRC64		= 1,
 	BCH_STR_HASH_OPT_SIPHASH	= 2,
-	BCH_STR_HASH_OPT_NR		= 3,
+	BCH_STR_HASH_OPT_XXHASH		= 3,
+	BCH_STR_HASH_OPT_NR		= 4,
 };
 
 enum bch_csum_type {
@@ -1401,7 +1567,8 @@ enum bch_csum_type {
 	BCH_CSUM_CHACHA20_POLY1305_128	= 4,
 	BCH_CSUM_CRC32C			= 5,
 	BCH_CSUM_CRC64			= 6,
-	BCH_CSUM_NR			= 7,
+	BCH_CSUM_XXHASH			= 7,
+	BCH_CSUM_NR			= 8,
 };
 
 static const unsigned bch_crc_bytes[] = {
@@ -1412,6 +1579,7 @@ static const unsigned bch_crc_bytes[] = {
 	[BCH_CSUM_CRC64]			= 8,
 	[BCH_CSUM_CHACHA20_POLY1305_80]		= 10,
 	[BCH_CSUM_CHACHA20_POLY1305_128]	= 16,
+	[BCH_CSUM_XXHASH]			= 8,
 };
 
 static inline _Bool bch2_csum_type_is_encryption(enum bch_csum_type type)
@@ -1429,7 +1597,8 @@ enum bch_csum_opts {
 	BCH_CSUM_OPT_NONE		= 0,
 	BCH_CSUM_OPT_CRC32C		= 1,
 	BCH_CSUM_OPT_CRC64		= 2,
-	BCH_CSUM_OPT_NR			= 3,
+	BCH_CSUM_OPT_XXHASH		= 3,
+	BCH_CSUM_OPT_NR			= 4,
 };
 
 #define BCH_COMPRESSION_TYPES()		\
@@ -1616,6 +1785,19 @@ struct jset {
 LE32_BITMASK(JSET_CSUM_TYPE,	struct jset, flags, 0, 4);
 LE32_BITMASK(JSET_BIG_ENDIAN,	struct jset, flags, 4, 5);
 LE32_BITMASK(JSET_NO_FLUSH,	struct jset, flags, 5, 6);
+LE32_BITMASK(JSET_COMPRESSION_TYPE,
+				struct jset, flags, 6, 10);
+
+/*
+ * If JSET_COMPRESSION_TYPE is set, jset->u64s is the size of the compressed
+ * data, which starts with this header - the jset header itself (up to and
+ * including last_seq) is never compressed:
+ */
+struct jset_compressed {
+	__le32			compressed_bytes;
+	__le32			u64s; /* uncompressed */
+	__u8			data[0];
+} __attribute__((packed, aligned(8)));
 
 #define BCH_JOURNAL_BUCKETS_MIN		8
 
@@ -1629,7 +1811,11 @@ LE32_BITMASK(JSET_NO_FLUSH,	struct jset, flags, 5, 6);
 	x(ALLOC,	4, "alloc")			\
 	x(QUOTAS,	5, "quotas")			\
 	x(EC,		6, "stripes")			\
-	x(REFLINK,	7, "reflink")
+	x(REFLINK,	7, "reflink")			\
+	x(ACCOUNTING,	8, "accounting")		\
+	x(LRU,		9, "lru")				\
+	x(BACKPOINTERS,	10, "backpointers")			\
+	x(REBALANCE_WORK, 11, "rebalance_work")
 
 enum btree_id {
 #define x(kwd, val, name) BTREE_ID_##kwd = val,
@@ -1675,6 +1861,21 @@ LE32_BITMASK(BSET_CSUM_TYPE,	struct bset, flags, 0, 4);
 LE32_BITMASK(BSET_BIG_ENDIAN,	struct bset, flags, 4, 5);
 LE32_BITMASK(BSET_SEPARATE_WHITEOUTS,
 				struct bset, flags, 5, 6);
+LE32_BITMASK(BSET_COMPRESSION_TYPE,
+				struct bset, flags, 6, 10);
+
+/*
+ * If BSET_COMPRESSION_TYPE is set, bset->u64s is the size of the compressed
+ * data, which starts with this header. The bset still takes up its
+ * uncompressed size in the btree node - the next bset starts where it would if
+ * this one wasn't compressed:
+ */
+struct bset_compressed {
+	__le32			compressed_bytes;
+	__le16			u64s; /* uncompressed */
+	__le16			pad;
+	__u8			data[0];
+} __attribute__((packed, aligned(8)));
 
 struct btree_node {
 	struct bch_csum		csum;
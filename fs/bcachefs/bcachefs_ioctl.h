@@ -77,10 +77,15 @@ struct bch_ioctl_incremental {
 #define BCH_IOCTL_DISK_GET_IDX	_IOW(0xbc,	13,  struct bch_ioctl_disk_get_idx)
 #define BCH_IOCTL_DISK_RESIZE	_IOW(0xbc,	14,  struct bch_ioctl_disk_resize)
 #define BCH_IOCTL_DISK_RESIZE_JOURNAL _IOW(0xbc,15,  struct bch_ioctl_disk_resize_journal)
+#define BCH_IOCTL_QUERY_ACCOUNTING _IOWR(0xbc,	16, struct bch_ioctl_query_accounting)
 
 /* ioctl below act on a particular file, not the filesystem as a whole: */
 
 #define BCHFS_IOC_REINHERIT_ATTRS	_IOR(0xbc, 64, const char __user *)
+#define BCHFS_IOC_DEFRAG		_IOW(0xbc, 65, struct bch_ioctl_defrag)
+#define BCHFS_IOC_BULKSTAT		_IOWR(0xbc, 66, struct bch_ioctl_bulkstat)
+#define BCHFS_IOC_ENCODED_READ		_IOWR(0xbc, 67, struct bch_ioctl_encoded_extent)
+#define BCHFS_IOC_ENCODED_WRITE		_IOW(0xbc, 68, struct bch_ioctl_encoded_extent)
 
 /*
  * BCH_IOCTL_QUERY_UUID: get filesystem UUID
@@ -174,17 +179,34 @@ enum bch_data_ops {
 	BCH_DATA_OP_SCRUB	= 0,
 	BCH_DATA_OP_REREPLICATE	= 1,
 	BCH_DATA_OP_MIGRATE	= 2,
-	BCH_DATA_OP_NR		= 3,
+	BCH_DATA_OP_CHECK_MARKS	= 3,
+	BCH_DATA_OP_FSCK	= 4,
+	BCH_DATA_OP_NR		= 5,
 };
 
 /*
  * BCH_IOCTL_DATA: operations that walk and manipulate filesystem data (e.g.
  * scrub, rereplicate, migrate).
  *
+ * BCH_DATA_OP_CHECK_MARKS checks user data in [start, end) against the in
+ * memory bucket marks, online and throttled against foreground IO; progress
+ * events report where it's got to (so it can be restarted from there), and
+ * the number of inconsistent keys found.
+ *
+ * BCH_DATA_OP_FSCK runs the fsck checks that are local to a single key - for
+ * extents, dirents and xattrs in [start, end) - against the live filesystem,
+ * throttled the same way; it reports progress and inconsistent keys like
+ * BCH_DATA_OP_CHECK_MARKS, and likewise only checks, it doesn't repair.
+ *
  * This ioctl kicks off a job in the background, and returns a file descriptor.
  * Reading from the file descriptor returns a struct bch_ioctl_data_event,
  * indicating current progress, and closing the file descriptor will stop the
  * job. The file descriptor is O_CLOEXEC.
+ *
+ * If the buffer passed to read() has room for more than one event, the
+ * progress event is followed by a BCH_DATA_EVENT_DEV_PROGRESS event for each
+ * online member device, with its read and write throughput since the job
+ * started - this is all IO to the device, not just the job's.
  */
 struct bch_ioctl_data {
 	__u32			op;
@@ -205,11 +227,17 @@ struct bch_ioctl_data {
 } __attribute__((packed, aligned(8)));
 
 enum bch_data_event {
-	BCH_DATA_EVENT_PROGRESS	= 0,
+	BCH_DATA_EVENT_PROGRESS		= 0,
+	BCH_DATA_EVENT_DEV_PROGRESS	= 1,
 	/* XXX: add an event for reporting errors */
-	BCH_DATA_EVENT_NR	= 1,
+	BCH_DATA_EVENT_NR		= 2,
 };
 
+/*
+ * Rates are averaged since the job started; sectors_remaining is exact for
+ * migrate (the data left on the device being migrated), otherwise it's
+ * estimated from sectors_total. eta_sec is zero if it can't be estimated yet:
+ */
 struct bch_ioctl_data_progress {
 	__u8			data_type;
 	__u8			btree_id;
@@ -218,6 +246,20 @@ struct bch_ioctl_data_progress {
 
 	__u64			sectors_done;
 	__u64			sectors_total;
+	__u64			keys_inconsistent;
+
+	__u64			bytes_per_sec;
+	__u64			sectors_remaining;
+	__u64			eta_sec;
+	__u32			reads_in_flight;
+	__u32			writes_in_flight;
+} __attribute__((packed, aligned(8)));
+
+struct bch_ioctl_data_dev_progress {
+	__u32			dev;
+	__u32			pad;
+	__u64			read_bytes_per_sec;
+	__u64			write_bytes_per_sec;
 } __attribute__((packed, aligned(8)));
 
 struct bch_ioctl_data_event {
@@ -225,6 +267,7 @@ struct bch_ioctl_data_event {
 	__u8			pad[7];
 	union {
 	struct bch_ioctl_data_progress p;
+	struct bch_ioctl_data_dev_progress d;
 	__u64			pad2[15];
 	};
 } __attribute__((packed, aligned(8)));
@@ -346,4 +389,129 @@ struct bch_ioctl_disk_resize_journal {
 	__u64			nbuckets;
 };
 
+/*
+ * BCH_IOCTL_QUERY_ACCOUNTING: read persistent counters
+ *
+ * @type	- counter type, enum bch_accounting_type
+ * @id		- counter id; for BCH_ACCOUNTING_compression, use
+ *		  bch_accounting_compression_id()
+ * @d		- counter values, summed over all shards
+ *
+ * Reading a counter is a handful of btree key cache lookups, independent of
+ * how much data it covers.
+ *
+ * Returns -EOPNOTSUPP if the filesystem doesn't have accounting (only
+ * filesystems formatted with it do)
+ */
+struct bch_ioctl_query_accounting {
+	__u32			type;
+	__u32			pad;
+	__u64			id;
+	__u64			d[BCH_ACCOUNTING_COUNTERS_MAX];
+};
+
+/*
+ * BCHFS_IOC_DEFRAG: defragment a range of a file
+ *
+ * @start	- start of range, in bytes
+ * @len		- length of range, in bytes; 0 for the rest of the file
+ * @extent_size	- extents smaller than this, in bytes, are considered
+ *		  fragmented; 0 for the defrag_extent_size option, or the
+ *		  maximum encoded extent size if that isn't set
+ *
+ * Runs of adjacent fragmented extents that aren't contiguous on disk are
+ * rewritten, in order, so that they are. Returns when done.
+ */
+struct bch_ioctl_defrag {
+	__u32			flags;
+	__u32			extent_size;
+	__u64			start;
+	__u64			len;
+};
+
+/*
+ * BCHFS_IOC_BULKSTAT: read inode attributes in inode number order
+ *
+ * @start	- in: first inode number to return; out: inode number to pass
+ *		  as @start to continue from where this call stopped
+ * @buf		- userspace pointer to an array of struct
+ *		  bch_ioctl_bulkstat_inode
+ * @nr		- in: size of @buf, in entries; out: entries returned, 0 once
+ *		  there are no inodes left
+ * @mode_type	- if nonzero, only return inodes with (mode & S_IFMT) equal to
+ *		  this
+ * @changed_since - if nonzero, only return inodes with mtime or ctime at or
+ *		  after this, in nanoseconds since the epoch
+ *
+ * Inodes are read straight from the inodes btree, as one sequential scan, so
+ * tools that want to stat every file don't have to walk the directory tree.
+ * Acts on the filesystem the file it's called on is on; requires
+ * CAP_SYS_ADMIN. Times are in nanoseconds since the epoch.
+ */
+struct bch_ioctl_bulkstat_inode {
+	__u64			inum;
+	__u64			size;
+	__u64			sectors;
+	__s64			atime;
+	__s64			mtime;
+	__s64			ctime;
+	__s64			otime;
+	__u32			generation;
+	__u32			flags;
+	__u32			mode;
+	__u32			uid;
+	__u32			gid;
+	__u32			nlink;
+	__u64			dev;
+};
+
+struct bch_ioctl_bulkstat {
+	__u64			start;
+	__u64			buf;
+	__u32			nr;
+	__u32			flags;
+	__u32			mode_type;
+	__u32			pad;
+	__s64			changed_since;
+};
+
+/*
+ * BCHFS_IOC_ENCODED_READ, BCHFS_IOC_ENCODED_WRITE: read or write an extent in
+ * its on disk form, without decompressing or recompressing it
+ *
+ * @offset	- file offset, in sectors; on read, the start of the first extent
+ *		  ending after this is returned here
+ * @buf		- buffer for the encoded data
+ * @buf_len	- size of @buf, in bytes
+ * @size	- size of the extent, in sectors; 0 on read if there is no data
+ *		  at or after @offset
+ * @crc_offset	- offset of the extent's data within the uncompressed data, in
+ *		  sectors
+ * @compressed_size - size of the encoded data, in sectors
+ * @uncompressed_size - size of the data when decoded, in sectors
+ * @compression_type - enum bch_compression_type
+ * @csum_type	- enum bch_csum_type; checksum of the encoded data
+ * @csum	- checksum of the encoded data, as stored in the extent
+ *
+ * Lets tools (send/receive, backup) move compressed data without the cost of
+ * decompressing and recompressing it. If @buf_len is too small, read returns
+ * -E2BIG with everything but the data filled in. Writes are checked against
+ * @csum, and written as is if they fit; otherwise they're decompressed and
+ * recompressed as a normal write would be. Encrypted and reflinked extents
+ * aren't supported. Requires CAP_SYS_ADMIN.
+ */
+struct bch_ioctl_encoded_extent {
+	__u64			offset;
+	__u64			buf;
+	__u32			buf_len;
+	__u32			size;
+	__u32			crc_offset;
+	__u32			compressed_size;
+	__u32			uncompressed_size;
+	__u8			compression_type;
+	__u8			csum_type;
+	__u16			pad;
+	__u64			csum[2];
+};
+
 #endif /* _BCACHEFS_IOCTL_H */
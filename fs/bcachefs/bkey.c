@@ -6,6 +6,8 @@
 #include "bset.h"
 #include "util.h"
 
+#include <asm/cacheflush.h>
+
 #undef EBUG_ON
 
 #ifdef DEBUG_BKEYS
@@ -673,6 +675,36 @@ unsigned bch2_bkey_greatest_differing_bit(const struct btree *b,
 	return 0;
 }
 
+/*
+ * The most significant 64 bits of the key, left aligned: keys with different
+ * prefixes compare the same as their prefixes
+ */
+__pure
+u64 bch2_bkey_packed_prefix(const struct btree *b,
+			    const struct bkey_packed *k)
+{
+	const u64 *p = high_word(&b->format, k);
+	unsigned nr_key_bits = b->nr_key_bits;
+	unsigned word_bits = 64 - high_bit_offset;
+	u64 v;
+
+	EBUG_ON(b->nr_key_bits != bkey_format_key_bits(&b->format));
+
+	if (!nr_key_bits)
+		return 0;
+
+	/* for big endian, skip past header */
+	v = (*p & (~0ULL >> high_bit_offset)) << high_bit_offset;
+
+	if (high_bit_offset && nr_key_bits > word_bits)
+		v |= *next_word(p) >> word_bits;
+
+	if (nr_key_bits < 64)
+		v &= ~0ULL << (64 - nr_key_bits);
+
+	return v;
+}
+
 /*
  * First set bit
  * Bits are indexed from 0 - return is [0, nr_key_bits)
@@ -766,60 +798,17 @@ static inline int __bkey_cmp_bits(const u64 *l, const u64 *r,
 #define I4(i0, i1, i2, i3)	(I3(i0, i1, i2),	I(i3))
 #define I5(i0, i1, i2, i3, i4)	(I4(i0, i1, i2, i3),	I(i4))
 
-static u8 *compile_bkey_field(const struct bkey_format *format, u8 *out,
-			      enum bch_bkey_fields field,
-			      unsigned dst_offset, unsigned dst_size,
-			      bool *eax_zeroed)
+/*
+ * Extract a field from the packed key in rsi into rax, and add the field
+ * offset:
+ */
+static u8 *compile_bkey_field_get(const struct bkey_format *format, u8 *out,
+				  enum bch_bkey_fields field)
 {
 	unsigned bits = format->bits_per_field[field];
 	u64 offset = le64_to_cpu(format->field_offset[field]);
 	unsigned i, byte, bit_offset, align, shl, shr;
 
-	if (!bits && !offset) {
-		if (!*eax_zeroed) {
-			/* xor eax, eax */
-			I2(0x31, 0xc0);
-		}
-
-		*eax_zeroed = true;
-		goto set_field;
-	}
-
-	if (!bits) {
-		/* just return offset: */
-
-		switch (dst_size) {
-		case 8:
-			if (offset > S32_MAX) {
-				/* mov [rdi + dst_offset], offset */
-				I3(0xc7, 0x47, dst_offset);
-				memcpy(out, &offset, 4);
-				out += 4;
-
-				I3(0xc7, 0x47, dst_offset + 4);
-				memcpy(out, (void *) &offset + 4, 4);
-				out += 4;
-			} else {
-				/* mov [rdi + dst_offset], offset */
-				/* sign extended */
-				I4(0x48, 0xc7, 0x47, dst_offset);
-				memcpy(out, &offset, 4);
-				out += 4;
-			}
-			break;
-		case 4:
-			/* mov [rdi + dst_offset], offset */
-			I3(0xc7, 0x47, dst_offset);
-			memcpy(out, &offset, 4);
-			out += 4;
-			break;
-		default:
-			BUG();
-		}
-
-		return out;
-	}
-
 	bit_offset = format->key_u64s * 64;
 	for (i = 0; i <= field; i++)
 		bit_offset -= format->bits_per_field[i];
@@ -827,8 +816,6 @@ static u8 *compile_bkey_field(const struct bkey_format *format, u8 *out,
 	byte = bit_offset / 8;
 	bit_offset -= byte * 8;
 
-	*eax_zeroed = false;
-
 	if (bit_offset == 0 && bits == 8) {
 		/* movzx eax, BYTE PTR [rsi + imm8] */
 		I4(0x0f, 0xb6, 0x46, byte);
@@ -933,6 +920,66 @@ static u8 *compile_bkey_field(const struct bkey_format *format, u8 *out,
 		memcpy(out, &offset, 4);
 		out += 4;
 	}
+
+	return out;
+}
+
+static u8 *compile_bkey_field(const struct bkey_format *format, u8 *out,
+			      enum bch_bkey_fields field,
+			      unsigned dst_offset, unsigned dst_size,
+			      bool *eax_zeroed)
+{
+	unsigned bits = format->bits_per_field[field];
+	u64 offset = le64_to_cpu(format->field_offset[field]);
+
+	if (!bits && !offset) {
+		if (!*eax_zeroed) {
+			/* xor eax, eax */
+			I2(0x31, 0xc0);
+		}
+
+		*eax_zeroed = true;
+		goto set_field;
+	}
+
+	if (!bits) {
+		/* just return offset: */
+
+		switch (dst_size) {
+		case 8:
+			if (offset > S32_MAX) {
+				/* mov [rdi + dst_offset], offset */
+				I3(0xc7, 0x47, dst_offset);
+				memcpy(out, &offset, 4);
+				out += 4;
+
+				I3(0xc7, 0x47, dst_offset + 4);
+				memcpy(out, (void *) &offset + 4, 4);
+				out += 4;
+			} else {
+				/* mov [rdi + dst_offset], offset */
+				/* sign extended */
+				I4(0x48, 0xc7, 0x47, dst_offset);
+				memcpy(out, &offset, 4);
+				out += 4;
+			}
+			break;
+		case 4:
+			/* mov [rdi + dst_offset], offset */
+			I3(0xc7, 0x47, dst_offset);
+			memcpy(out, &offset, 4);
+			out += 4;
+			break;
+		default:
+			BUG();
+		}
+
+		return out;
+	}
+
+	*eax_zeroed = false;
+
+	out = compile_bkey_field_get(format, out, field);
 set_field:
 	switch (dst_size) {
 	case 8:
@@ -988,6 +1035,96 @@ int bch2_compile_bkey_format(const struct bkey_format *format, void *_out)
 	return (void *) out - _out;
 }
 
+static u8 *compile_bkey_field_cmp(const struct bkey_format *format, u8 *out,
+				  enum bch_bkey_fields field,
+				  unsigned r_offset, unsigned r_size)
+{
+	unsigned bits = format->bits_per_field[field];
+	u64 offset = le64_to_cpu(format->field_offset[field]);
+
+	if (bits) {
+		out = compile_bkey_field_get(format, out, field);
+	} else if (offset) {
+		/* mov rax, imm64 */
+		I2(0x48, 0xb8);
+		memcpy(out, &offset, 8);
+		out += 8;
+	} else {
+		/* xor eax, eax */
+		I2(0x31, 0xc0);
+	}
+
+	switch (r_size) {
+	case 8:
+		/* cmp rax, [rdi + r_offset] */
+		I4(0x48, 0x3b, 0x47, r_offset);
+		break;
+	case 4:
+		/* cmp eax, [rdi + r_offset] */
+		I3(0x3b, 0x47, r_offset);
+		break;
+	default:
+		BUG();
+	}
+
+	return out;
+}
+
+/*
+ * Compile a comparison of a packed key against an unpacked bpos - returns the
+ * same thing as bkey_cmp(bkey_unpack_pos(b, l), *r), but only unpacks fields
+ * up to the first one that differs:
+ */
+int bch2_compile_bkey_cmp_left_packed(const struct bkey_format *format, void *_out)
+{
+	u8 *out = _out, *jne[2];
+	unsigned i;
+
+	/*
+	 * rdi: r - unpacked bpos
+	 * rsi: l - packed key
+	 */
+
+	out = compile_bkey_field_cmp(format, out, BKEY_FIELD_INODE,
+				     offsetof(struct bpos, inode), 8);
+	/* jne rel32 */
+	I2(0x0f, 0x85);
+	jne[0] = out;
+	out += 4;
+
+	out = compile_bkey_field_cmp(format, out, BKEY_FIELD_OFFSET,
+				     offsetof(struct bpos, offset), 8);
+	/* jne rel32 */
+	I2(0x0f, 0x85);
+	jne[1] = out;
+	out += 4;
+
+	out = compile_bkey_field_cmp(format, out, BKEY_FIELD_SNAPSHOT,
+				     offsetof(struct bpos, snapshot), 4);
+
+	for (i = 0; i < ARRAY_SIZE(jne); i++) {
+		s32 rel = out - (jne[i] + 4);
+
+		memcpy(jne[i], &rel, 4);
+	}
+
+	/* seta al */
+	I3(0x0f, 0x97, 0xc0);
+	/* setb dl */
+	I3(0x0f, 0x92, 0xc2);
+	/* movzx eax, al */
+	I3(0x0f, 0xb6, 0xc0);
+	/* movzx edx, dl */
+	I3(0x0f, 0xb6, 0xd2);
+	/* sub eax, edx */
+	I2(0x29, 0xd0);
+
+	/* retq */
+	I1(0xc3);
+
+	return (void *) out - _out;
+}
+
 #else
 static inline int __bkey_cmp_bits(const u64 *l, const u64 *r,
 				  unsigned nr_key_bits)
@@ -1025,6 +1162,284 @@ static inline int __bkey_cmp_bits(const u64 *l, const u64 *r,
 }
 #endif
 
+#if defined(CONFIG_ARM64) && defined(HAVE_BCACHEFS_COMPILED_UNPACK)
+
+#define A64(_i)			(*(out)++ = cpu_to_le32(_i))
+
+#define A64_X0			0
+#define A64_X1			1
+#define A64_X2			2
+#define A64_X3			3
+#define A64_ZR			31
+
+#define A64_LDUR(sz, rt, rn, imm)	((sz) | 0x00400000 |		\
+					 (((imm) & 0x1ff) << 12) |	\
+					 ((rn) << 5) | (rt))
+#define A64_STUR(sz, rt, rn, imm)	((sz) |				\
+					 (((imm) & 0x1ff) << 12) |	\
+					 ((rn) << 5) | (rt))
+#define A64_SZ_8		0x38000000
+#define A64_SZ_16		0x78000000
+#define A64_SZ_32		0xb8000000
+#define A64_SZ_64		0xf8000000
+
+/* ubfm, 64 bit: */
+#define A64_UBFX(rd, rn, lsb, width)	(0xd3400000 | ((lsb) << 16) |	\
+					 (((lsb) + (width) - 1) << 10) | \
+					 ((rn) << 5) | (rd))
+#define A64_EXTR(rd, rn, rm, lsb)	(0x93c00000 | ((rm) << 16) |	\
+					 ((lsb) << 10) | ((rn) << 5) | (rd))
+#define A64_ADD_IMM(rd, rn, imm)	(0x91000000 | ((imm) << 10) |	\
+					 ((rn) << 5) | (rd))
+#define A64_ADD(rd, rn, rm)		(0x8b000000 | ((rm) << 16) |	\
+					 ((rn) << 5) | (rd))
+#define A64_MOVZ(rd, imm, hw)		(0xd2800000 | ((hw) << 21) |	\
+					 ((imm) << 5) | (rd))
+#define A64_MOVK(rd, imm, hw)		(0xf2800000 | ((hw) << 21) |	\
+					 ((imm) << 5) | (rd))
+#define A64_CMP64(rn, rm)		(0xeb00001f | ((rm) << 16) | ((rn) << 5))
+#define A64_CMP32(rn, rm)		(0x6b00001f | ((rm) << 16) | ((rn) << 5))
+#define A64_BNE				0x54000001
+#define A64_RET				0xd65f03c0
+
+static u32 *compile_mov_imm64(u32 *out, unsigned rd, u64 v)
+{
+	bool movz = true;
+	unsigned hw;
+
+	for (hw = 0; hw < 4; hw++) {
+		unsigned imm = (v >> (hw * 16)) & 0xffff;
+
+		if (!imm && (hw < 3 || !movz))
+			continue;
+
+		A64(movz
+		    ? A64_MOVZ(rd, imm, hw)
+		    : A64_MOVK(rd, imm, hw));
+		movz = false;
+	}
+
+	return out;
+}
+
+/*
+ * Extract a field from the packed key in x1 into x2, and add the field offset
+ * - clobbers x3:
+ */
+static u32 *compile_bkey_field_get(const struct bkey_format *format, u32 *out,
+				   enum bch_bkey_fields field)
+{
+	unsigned bits = format->bits_per_field[field];
+	u64 offset = le64_to_cpu(format->field_offset[field]);
+	unsigned i, byte, bit_offset, align;
+
+	bit_offset = format->key_u64s * 64;
+	for (i = 0; i <= field; i++)
+		bit_offset -= format->bits_per_field[i];
+
+	byte = bit_offset / 8;
+	bit_offset -= byte * 8;
+
+	/*
+	 * Loads are positioned the same way as on x86, so that we never read
+	 * past the end of the key:
+	 */
+	if (bit_offset == 0 && bits == 8) {
+		/* ldurb w2, [x1, #byte] */
+		A64(A64_LDUR(A64_SZ_8, A64_X2, A64_X1, byte));
+	} else if (bit_offset == 0 && bits == 16) {
+		/* ldurh w2, [x1, #byte] */
+		A64(A64_LDUR(A64_SZ_16, A64_X2, A64_X1, byte));
+	} else if (bit_offset + bits <= 32) {
+		align = min(4 - DIV_ROUND_UP(bit_offset + bits, 8), byte & 3);
+		byte -= align;
+		bit_offset += align * 8;
+
+		BUG_ON(bit_offset + bits > 32);
+
+		/* ldur w2, [x1, #byte] */
+		A64(A64_LDUR(A64_SZ_32, A64_X2, A64_X1, byte));
+
+		if (bits < 32)
+			A64(A64_UBFX(A64_X2, A64_X2, bit_offset, bits));
+	} else if (bit_offset + bits <= 64) {
+		align = min(8 - DIV_ROUND_UP(bit_offset + bits, 8), byte & 7);
+		byte -= align;
+		bit_offset += align * 8;
+
+		BUG_ON(bit_offset + bits > 64);
+
+		/* ldur x2, [x1, #byte] */
+		A64(A64_LDUR(A64_SZ_64, A64_X2, A64_X1, byte));
+
+		if (bits < 64)
+			A64(A64_UBFX(A64_X2, A64_X2, bit_offset, bits));
+	} else {
+		align = byte & 3;
+		byte -= align;
+		bit_offset += align * 8;
+
+		BUG_ON(bit_offset + bits > 96);
+
+		/* ldur x2, [x1, #byte] */
+		A64(A64_LDUR(A64_SZ_64, A64_X2, A64_X1, byte));
+		/* ldur w3, [x1, #byte + 8] */
+		A64(A64_LDUR(A64_SZ_32, A64_X3, A64_X1, byte + 8));
+		/* x2 = x3:x2 >> bit_offset */
+		A64(A64_EXTR(A64_X2, A64_X3, A64_X2, bit_offset));
+
+		if (bits < 64)
+			A64(A64_UBFX(A64_X2, A64_X2, 0, bits));
+	}
+
+	if (offset && offset < 4096) {
+		A64(A64_ADD_IMM(A64_X2, A64_X2, offset));
+	} else if (offset) {
+		out = compile_mov_imm64(out, A64_X3, offset);
+		A64(A64_ADD(A64_X2, A64_X2, A64_X3));
+	}
+
+	return out;
+}
+
+static u32 *compile_bkey_field(const struct bkey_format *format, u32 *out,
+			       enum bch_bkey_fields field,
+			       unsigned dst_offset, unsigned dst_size)
+{
+	unsigned bits = format->bits_per_field[field];
+	u64 offset = le64_to_cpu(format->field_offset[field]);
+	unsigned rt = A64_X2;
+
+	if (bits)
+		out = compile_bkey_field_get(format, out, field);
+	else if (offset)
+		out = compile_mov_imm64(out, A64_X2, offset);
+	else
+		rt = A64_ZR;
+
+	switch (dst_size) {
+	case 8:
+		/* stur x2, [x0, #dst_offset] */
+		A64(A64_STUR(A64_SZ_64, rt, A64_X0, dst_offset));
+		break;
+	case 4:
+		/* stur w2, [x0, #dst_offset] */
+		A64(A64_STUR(A64_SZ_32, rt, A64_X0, dst_offset));
+		break;
+	default:
+		BUG();
+	}
+
+	return out;
+}
+
+int bch2_compile_bkey_format(const struct bkey_format *format, void *_out)
+{
+	u32 *out = _out;
+
+	/*
+	 * x0: dst - unpacked key
+	 * x1: src - packed key
+	 */
+
+	/* k->u64s, k->format, k->type */
+
+	/* ldur w2, [x1] */
+	A64(A64_LDUR(A64_SZ_32, A64_X2, A64_X1, 0));
+
+	/* add w2, w2, BKEY_U64s - format->key_u64s, KEY_FORMAT_CURRENT */
+	A64(0x11000000 |
+	    (((BKEY_U64s - format->key_u64s) | (KEY_FORMAT_CURRENT << 8)) << 10) |
+	    (A64_X2 << 5) | A64_X2);
+
+	/* ubfx w2, w2, #0, #24: mask out k->pad: */
+	A64(0x53000000 | (23 << 10) | (A64_X2 << 5) | A64_X2);
+
+	/* stur w2, [x0] */
+	A64(A64_STUR(A64_SZ_32, A64_X2, A64_X0, 0));
+
+#define x(id, field)							\
+	out = compile_bkey_field(format, out, id,			\
+				 offsetof(struct bkey, field),		\
+				 sizeof(((struct bkey *) NULL)->field));
+	bkey_fields()
+#undef x
+
+	A64(A64_RET);
+
+	flush_icache_range((unsigned long) _out, (unsigned long) out);
+
+	return (void *) out - _out;
+}
+
+static u32 *compile_bkey_field_cmp(const struct bkey_format *format, u32 *out,
+				   enum bch_bkey_fields field,
+				   unsigned r_offset, unsigned r_size)
+{
+	unsigned bits = format->bits_per_field[field];
+	u64 offset = le64_to_cpu(format->field_offset[field]);
+
+	if (bits)
+		out = compile_bkey_field_get(format, out, field);
+	else
+		out = compile_mov_imm64(out, A64_X2, offset);
+
+	switch (r_size) {
+	case 8:
+		/* ldur x3, [x0, #r_offset]; cmp x2, x3 */
+		A64(A64_LDUR(A64_SZ_64, A64_X3, A64_X0, r_offset));
+		A64(A64_CMP64(A64_X2, A64_X3));
+		break;
+	case 4:
+		/* ldur w3, [x0, #r_offset]; cmp w2, w3 */
+		A64(A64_LDUR(A64_SZ_32, A64_X3, A64_X0, r_offset));
+		A64(A64_CMP32(A64_X2, A64_X3));
+		break;
+	default:
+		BUG();
+	}
+
+	return out;
+}
+
+int bch2_compile_bkey_cmp_left_packed(const struct bkey_format *format, void *_out)
+{
+	u32 *out = _out, *bne[2];
+	unsigned i;
+
+	/*
+	 * x0: r - unpacked bpos
+	 * x1: l - packed key
+	 */
+
+	out = compile_bkey_field_cmp(format, out, BKEY_FIELD_INODE,
+				     offsetof(struct bpos, inode), 8);
+	bne[0] = out++;
+
+	out = compile_bkey_field_cmp(format, out, BKEY_FIELD_OFFSET,
+				     offsetof(struct bpos, offset), 8);
+	bne[1] = out++;
+
+	out = compile_bkey_field_cmp(format, out, BKEY_FIELD_SNAPSHOT,
+				     offsetof(struct bpos, snapshot), 4);
+
+	for (i = 0; i < ARRAY_SIZE(bne); i++)
+		*bne[i] = cpu_to_le32(A64_BNE | ((out - bne[i]) << 5));
+
+	/* cset w0, hi */
+	A64(0x1a9f97e0);
+	/* csinv w0, w0, wzr, hs */
+	A64(0x5a9f2000);
+
+	A64(A64_RET);
+
+	flush_icache_range((unsigned long) _out, (unsigned long) out);
+
+	return (void *) out - _out;
+}
+
+#endif
+
 __pure
 int __bch2_bkey_cmp_packed_format_checked(const struct bkey_packed *l,
 					  const struct bkey_packed *r,
@@ -1050,7 +1465,16 @@ int __bch2_bkey_cmp_left_packed_format_checked(const struct btree *b,
 					       const struct bkey_packed *l,
 					       const struct bpos *r)
 {
+#ifdef HAVE_BCACHEFS_COMPILED_UNPACK
+	compiled_cmp_fn cmp_fn = b->aux_data + btree_cmp_fn_offset(b);
+	int ret = cmp_fn(r, l);
+
+	if (bch2_expensive_debug_checks)
+		BUG_ON(ret != bkey_cmp(__bch2_bkey_unpack_key(&b->format, l).p, *r));
+	return ret;
+#else
 	return bkey_cmp(bkey_unpack_pos_format_checked(b, l), *r);
+#endif
 }
 
 __pure __flatten
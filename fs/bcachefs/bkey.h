@@ -8,7 +8,8 @@
 #include "util.h"
 #include "vstructs.h"
 
-#ifdef CONFIG_X86_64
+#if defined(CONFIG_X86_64) ||						\
+	(defined(CONFIG_ARM64) && !defined(CONFIG_CPU_BIG_ENDIAN))
 #define HAVE_BCACHEFS_COMPILED_UNPACK	1
 #endif
 
@@ -110,6 +111,8 @@ unsigned bch2_bkey_greatest_differing_bit(const struct btree *,
 					  const struct bkey_packed *);
 __pure
 unsigned bch2_bkey_ffs(const struct btree *, const struct bkey_packed *);
+__pure
+u64 bch2_bkey_packed_prefix(const struct btree *, const struct bkey_packed *);
 
 __pure
 int __bch2_bkey_cmp_packed_format_checked(const struct bkey_packed *,
@@ -353,11 +356,14 @@ static inline u64 bkey_field_max(const struct bkey_format *f,
 #ifdef HAVE_BCACHEFS_COMPILED_UNPACK
 
 int bch2_compile_bkey_format(const struct bkey_format *, void *);
+int bch2_compile_bkey_cmp_left_packed(const struct bkey_format *, void *);
 
 #else
 
 static inline int bch2_compile_bkey_format(const struct bkey_format *format,
 					  void *out) { return 0; }
+static inline int bch2_compile_bkey_cmp_left_packed(const struct bkey_format *format,
+						    void *out) { return 0; }
 
 #endif
 
@@ -531,6 +537,9 @@ BKEY_VAL_ACCESSORS(inline_data);
 BKEY_VAL_ACCESSORS(btree_ptr_v2);
 BKEY_VAL_ACCESSORS(indirect_inline_data);
 BKEY_VAL_ACCESSORS(alloc_v2);
+BKEY_VAL_ACCESSORS(accounting);
+BKEY_VAL_ACCESSORS(backpointer);
+BKEY_VAL_ACCESSORS(rebalance_work);
 
 /* byte order helpers */
 
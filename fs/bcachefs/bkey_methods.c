@@ -3,13 +3,17 @@
 #include "bcachefs.h"
 #include "bkey_methods.h"
 #include "btree_types.h"
+#include "accounting.h"
 #include "alloc_background.h"
+#include "backpointers.h"
 #include "dirent.h"
 #include "ec.h"
 #include "error.h"
 #include "extents.h"
 #include "inode.h"
+#include "lru.h"
 #include "quota.h"
+#include "rebalance.h"
 #include "reflink.h"
 #include "xattr.h"
 
@@ -14,6 +14,44 @@ static inline bool sort_iter_end(struct sort_iter *iter)
 	return !iter->used;
 }
 
+/*
+ * Each set caches the first 64 bits of its current key, so most comparisons
+ * don't have to look at the keys at all - we only call @cmp when the prefixes
+ * are equal, or when a key isn't packed:
+ */
+static inline void sort_iter_set_prefix(struct sort_iter *iter,
+					struct sort_iter_set *i)
+{
+	if (iter->prefix_cmp && bkey_packed(i->k))
+		i->prefix = bch2_bkey_packed_prefix(iter->b, i->k);
+}
+
+static inline bool sort_iter_prefix_differs(struct sort_iter *iter,
+					    struct sort_iter_set *l,
+					    struct sort_iter_set *r)
+{
+	return iter->prefix_cmp &&
+		l->prefix != r->prefix &&
+		bkey_packed(l->k) &&
+		bkey_packed(r->k);
+}
+
+static inline int sort_iter_cmp(struct sort_iter *iter,
+				struct sort_iter_set *l,
+				struct sort_iter_set *r,
+				sort_cmp_fn cmp)
+{
+	if (sort_iter_prefix_differs(iter, l, r)) {
+		int ret = cmp_int(l->prefix, r->prefix);
+
+		EBUG_ON((ret < 0) !=
+			(bch2_bkey_cmp_packed(iter->b, l->k, r->k) < 0));
+		return ret;
+	}
+
+	return cmp(iter->b, l->k, r->k);
+}
+
 static inline void __sort_iter_sift(struct sort_iter *iter,
 				    unsigned from,
 				    sort_cmp_fn cmp)
@@ -22,7 +60,7 @@ static inline void __sort_iter_sift(struct sort_iter *iter,
 
 	for (i = from;
 	     i + 1 < iter->used &&
-	     cmp(iter->b, iter->data[i].k, iter->data[i + 1].k) > 0;
+	     sort_iter_cmp(iter, iter->data + i, iter->data + i + 1, cmp) > 0;
 	     i++)
 		swap(iter->data[i], iter->data[i + 1]);
 }
@@ -37,6 +75,10 @@ static inline void sort_iter_sort(struct sort_iter *iter, sort_cmp_fn cmp)
 {
 	unsigned i = iter->used;
 
+	while (i--)
+		sort_iter_set_prefix(iter, iter->data + i);
+
+	i = iter->used;
 	while (i--)
 		__sort_iter_sift(iter, i, cmp);
 }
@@ -57,10 +99,12 @@ static inline void __sort_iter_advance(struct sort_iter *iter,
 
 	BUG_ON(i->k > i->end);
 
-	if (i->k == i->end)
+	if (i->k == i->end) {
 		array_remove_item(iter->data, iter->used, idx);
-	else
+	} else {
+		sort_iter_set_prefix(iter, i);
 		__sort_iter_sift(iter, idx, cmp);
+	}
 }
 
 static inline void sort_iter_advance(struct sort_iter *iter, sort_cmp_fn cmp)
@@ -98,6 +142,7 @@ static inline bool should_drop_next_key(struct sort_iter *iter)
 	 * and should be dropped.
 	 */
 	return iter->used >= 2 &&
+		!sort_iter_prefix_differs(iter, iter->data, iter->data + 1) &&
 		!bch2_bkey_cmp_packed(iter->b,
 				 iter->data[0].k,
 				 iter->data[1].k);
@@ -113,6 +158,7 @@ bch2_key_sort_fix_overlapping(struct bch_fs *c, struct bset *dst,
 
 	memset(&nr, 0, sizeof(nr));
 
+	iter->prefix_cmp = true;
 	sort_iter_sort(iter, key_sort_fix_overlapping_cmp);
 
 	while ((k = sort_iter_peek(iter))) {
@@ -235,6 +281,7 @@ unsigned bch2_sort_keys(struct bkey_packed *dst,
 	const struct bkey_format *f = &iter->b->format;
 	struct bkey_packed *in, *next, *out = dst;
 
+	iter->prefix_cmp = true;
 	sort_iter_sort(iter, sort_keys_cmp);
 
 	while ((in = sort_iter_next(iter, sort_keys_cmp))) {
@@ -416,6 +463,7 @@ unsigned bch2_sort_extents(struct bkey_packed *dst,
 {
 	struct bkey_packed *in, *out = dst;
 
+	iter->prefix_cmp = true;
 	sort_iter_sort(iter, sort_extents_cmp);
 
 	while ((in = sort_iter_next(iter, sort_extents_cmp))) {
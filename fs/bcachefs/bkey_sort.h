@@ -6,9 +6,13 @@ struct sort_iter {
 	struct btree		*b;
 	unsigned		used;
 	unsigned		size;
+	/* keys are ordered by position first, so we can compare prefixes: */
+	bool			prefix_cmp;
 
 	struct sort_iter_set {
 		struct bkey_packed *k, *end;
+		/* bch2_bkey_packed_prefix() of @k, if @k is packed: */
+		u64		prefix;
 	} data[MAX_BSETS + 1];
 };
 
@@ -17,6 +21,7 @@ static inline void sort_iter_init(struct sort_iter *iter, struct btree *b)
 	iter->b = b;
 	iter->used = 0;
 	iter->size = ARRAY_SIZE(iter->data);
+	iter->prefix_cmp = false;
 }
 
 static inline void sort_iter_add(struct sort_iter *iter,
@@ -26,7 +31,7 @@ static inline void sort_iter_add(struct sort_iter *iter,
 	BUG_ON(iter->used >= iter->size);
 
 	if (k != end)
-		iter->data[iter->used++] = (struct sort_iter_set) { k, end };
+		iter->data[iter->used++] = (struct sort_iter_set) { k, end, 0 };
 }
 
 struct btree_nr_keys
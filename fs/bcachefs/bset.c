@@ -193,7 +193,8 @@ void bch2_btree_node_iter_verify(struct btree_node_iter *iter,
 	struct bkey_packed *k, *p;
 	struct bset_tree *t;
 
-	if (bch2_btree_node_iter_end(iter))
+	if (bch2_btree_node_iter_end(iter) ||
+	    !bch2_verify_sample(btree_node_iter))
 		return;
 
 	/* Verify no duplicates: */
@@ -299,9 +300,37 @@ struct bkey_float {
 };
 #define BKEY_MANTISSA_BITS	16
 
-static unsigned bkey_float_byte_offset(unsigned idx)
+/*
+ * Wide bfloats, used for a bset when too many 16 bit mantissas would be equal
+ * to their neighbours' (see bset_want_wide_bfloats()); the exponent and
+ * key_offset fields must stay where they are in struct bkey_float:
+ */
+struct bkey_float_wide {
+	u8		exponent;
+	u8		key_offset;
+	u16		pad;
+	u32		mantissa;
+};
+#define BKEY_MANTISSA_BITS_WIDE	32
+
+static inline unsigned bkey_float_bytes(const struct bset_tree *t)
 {
-	return idx * sizeof(struct bkey_float);
+	return t->wide_bfloats
+		? sizeof(struct bkey_float_wide)
+		: sizeof(struct bkey_float);
+}
+
+static inline unsigned bkey_float_mantissa_bits(const struct bset_tree *t)
+{
+	return t->wide_bfloats
+		? BKEY_MANTISSA_BITS_WIDE
+		: BKEY_MANTISSA_BITS;
+}
+
+static unsigned bkey_float_byte_offset(const struct bset_tree *t,
+				       unsigned idx)
+{
+	return idx * bkey_float_bytes(t);
 }
 
 struct ro_aux_tree {
@@ -322,7 +351,7 @@ static unsigned bset_aux_tree_buf_end(const struct bset_tree *t)
 		return t->aux_data_offset;
 	case BSET_RO_AUX_TREE:
 		return t->aux_data_offset +
-			DIV_ROUND_UP(t->size * sizeof(struct bkey_float) +
+			DIV_ROUND_UP(t->size * bkey_float_bytes(t) +
 				     t->size * sizeof(u8), 8);
 	case BSET_RW_AUX_TREE:
 		return t->aux_data_offset +
@@ -336,7 +365,7 @@ static unsigned bset_aux_tree_buf_start(const struct btree *b,
 					const struct bset_tree *t)
 {
 	return t == b->set
-		? DIV_ROUND_UP(b->unpack_fn_len, 8)
+		? DIV_ROUND_UP(btree_cmp_fn_offset(b) + b->cmp_fn_len, 8)
 		: bset_aux_tree_buf_end(t - 1);
 }
 
@@ -359,14 +388,22 @@ static u8 *ro_aux_tree_prev(const struct btree *b,
 {
 	EBUG_ON(bset_aux_tree_type(t) != BSET_RO_AUX_TREE);
 
-	return __aux_tree_base(b, t) + bkey_float_byte_offset(t->size);
+	return __aux_tree_base(b, t) + bkey_float_byte_offset(t, t->size);
 }
 
 static struct bkey_float *bkey_float(const struct btree *b,
 				     const struct bset_tree *t,
 				     unsigned idx)
 {
-	return ro_aux_tree_base(b, t)->f + idx;
+	return (void *) ro_aux_tree_base(b, t) + bkey_float_byte_offset(t, idx);
+}
+
+static unsigned bkey_float_mantissa(const struct bset_tree *t,
+				    const struct bkey_float *f)
+{
+	return t->wide_bfloats
+		? ((const struct bkey_float_wide *) f)->mantissa
+		: f->mantissa;
 }
 
 static void bset_aux_tree_verify(const struct btree *b)
@@ -580,15 +617,15 @@ static unsigned rw_aux_tree_bsearch(struct btree *b,
 	return idx;
 }
 
-static inline unsigned bkey_mantissa(const struct bkey_packed *k,
-				     const struct bkey_float *f,
-				     unsigned idx)
+static __always_inline unsigned bkey_mantissa(const struct bkey_packed *k,
+					      unsigned exponent,
+					      const unsigned bits)
 {
 	u64 v;
 
 	EBUG_ON(!bkey_packed(k));
 
-	v = get_unaligned((u64 *) (((u8 *) k->_data) + (f->exponent >> 3)));
+	v = get_unaligned((u64 *) (((u8 *) k->_data) + (exponent >> 3)));
 
 	/*
 	 * In little endian, we're shifting off low bits (and then the bits we
@@ -597,11 +634,26 @@ static inline unsigned bkey_mantissa(const struct bkey_packed *k,
 	 * back down):
 	 */
 #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-	v >>= f->exponent & 7;
+	v >>= exponent & 7;
 #else
-	v >>= 64 - (f->exponent & 7) - BKEY_MANTISSA_BITS;
+	v >>= 64 - (exponent & 7) - bits;
+#endif
+	return bits == BKEY_MANTISSA_BITS_WIDE ? (u32) v : (u16) v;
+}
+
+static inline bool bkey_mantissa_bits_dropped(const struct btree *b,
+					      unsigned exponent,
+					      const unsigned bits)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	unsigned key_bits_start = b->format.key_u64s * 64 - b->nr_key_bits;
+
+	return exponent > key_bits_start;
+#else
+	unsigned key_bits_end = high_bit_offset + b->nr_key_bits;
+
+	return exponent + bits < key_bits_end;
 #endif
-	return (u16) v;
 }
 
 __always_inline
@@ -618,6 +670,7 @@ static inline void __make_bfloat(struct btree *b, struct bset_tree *t,
 	struct bkey_packed *r = is_power_of_2(j + 1)
 		? max_key
 		: tree_to_bkey(b, t, j >> (ffz(j) + 1));
+	unsigned bits = bkey_float_mantissa_bits(t);
 	unsigned mantissa;
 	int shift, exponent, high_bit;
 
@@ -643,8 +696,8 @@ static inline void __make_bfloat(struct btree *b, struct bset_tree *t,
 	 * of the key: we handle this later:
 	 */
 	high_bit = max(bch2_bkey_greatest_differing_bit(b, l, r),
-		       min_t(unsigned, BKEY_MANTISSA_BITS, b->nr_key_bits) - 1);
-	exponent = high_bit - (BKEY_MANTISSA_BITS - 1);
+		       min_t(unsigned, bits, b->nr_key_bits) - 1);
+	exponent = high_bit - (bits - 1);
 
 	/*
 	 * Then we calculate the actual shift value, from the start of the key
@@ -653,19 +706,19 @@ static inline void __make_bfloat(struct btree *b, struct bset_tree *t,
 #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
 	shift = (int) (b->format.key_u64s * 64 - b->nr_key_bits) + exponent;
 
-	EBUG_ON(shift + BKEY_MANTISSA_BITS > b->format.key_u64s * 64);
+	EBUG_ON(shift + bits > b->format.key_u64s * 64);
 #else
 	shift = high_bit_offset +
 		b->nr_key_bits -
 		exponent -
-		BKEY_MANTISSA_BITS;
+		bits;
 
 	EBUG_ON(shift < KEY_PACKED_BITS_START);
 #endif
 	EBUG_ON(shift < 0 || shift >= BFLOAT_FAILED);
 
 	f->exponent = shift;
-	mantissa = bkey_mantissa(m, f, j);
+	mantissa = bkey_mantissa(m, shift, bits);
 
 	/*
 	 * If we've got garbage bits, set them to all 1s - it's legal for the
@@ -674,7 +727,10 @@ static inline void __make_bfloat(struct btree *b, struct bset_tree *t,
 	if (exponent < 0)
 		mantissa |= ~(~0U << -exponent);
 
-	f->mantissa = mantissa;
+	if (t->wide_bfloats)
+		((struct bkey_float_wide *) f)->mantissa = mantissa;
+	else
+		f->mantissa = mantissa;
 }
 
 static void make_bfloat(struct btree *b, struct bset_tree *t,
@@ -701,18 +757,23 @@ static void make_bfloat(struct btree *b, struct bset_tree *t,
 	__make_bfloat(b, t, j, min_key, max_key);
 }
 
-/* bytes remaining - only valid for last bset: */
+/* bytes remaining, up to the next bset's aux tree: */
 static unsigned __bset_tree_capacity(const struct btree *b, const struct bset_tree *t)
 {
+	unsigned end = t + 1 < b->set + b->nsets &&
+		t[1].aux_data_offset != U16_MAX
+		? t[1].aux_data_offset
+		: btree_aux_data_u64s(b);
+
 	bset_aux_tree_verify(b);
 
-	return btree_aux_data_bytes(b) - t->aux_data_offset * sizeof(u64);
+	return (end - t->aux_data_offset) * sizeof(u64);
 }
 
 static unsigned bset_ro_tree_capacity(const struct btree *b, const struct bset_tree *t)
 {
 	return __bset_tree_capacity(b, t) /
-		(sizeof(struct bkey_float) + sizeof(u8));
+		(bkey_float_bytes(t) + sizeof(u8));
 }
 
 static unsigned bset_rw_tree_capacity(const struct btree *b, const struct bset_tree *t)
@@ -792,22 +853,226 @@ static noinline void __build_ro_aux_tree(struct btree *b, struct bset_tree *t)
 			      bkey_to_packed(&max_key));
 }
 
-static void bset_alloc_tree(struct btree *b, struct bset_tree *t)
+/* Bloom filters: */
+
+static inline bool btree_node_has_bloom(struct btree *b)
+{
+	return !b->c.level && !btree_node_is_extents(b);
+}
+
+static inline u64 bset_bloom_hash(struct bpos pos)
 {
-	struct bset_tree *i;
+	u64 h = pos.inode;
+
+	h = (h ^ (h >> 31)) * 0x9e3779b97f4a7c15ULL ^ pos.offset;
+	h = (h ^ (h >> 31)) * 0x9e3779b97f4a7c15ULL ^ pos.snapshot;
+	return (h ^ (h >> 31)) * 0xbf58476d1ce4e5b9ULL;
+}
+
+/*
+ * The rw (last) bset can grow to the end of the node; once it's been written
+ * it gets a ro aux tree, and its filter is rebuilt to cover only its keys:
+ */
+static inline void bset_bloom_range(const struct btree *b,
+				    const struct bset_tree *t,
+				    unsigned *start, unsigned *nr)
+{
+	unsigned end = bset_aux_tree_type(t) == BSET_RW_AUX_TREE
+		? btree_bloom_bytes(b) * 8
+		: t->end_offset;
+
+	*start	= t->data_offset;
+	*nr	= end - t->data_offset;
+}
+
+static inline void bset_bloom_bits(const struct btree *b,
+				   const struct bset_tree *t,
+				   struct bpos pos, unsigned bits[2])
+{
+	u64 h = bset_bloom_hash(pos);
+	unsigned start, nr;
+
+	bset_bloom_range(b, t, &start, &nr);
+
+	bits[0] = start + (((u64) (u32) h * nr) >> 32);
+	bits[1] = start + (((h >> 32) * nr) >> 32);
+}
+
+static inline void bset_bloom_add(struct btree *b, struct bset_tree *t,
+				  struct bpos pos)
+{
+	unsigned bits[2];
+
+	bset_bloom_bits(b, t, pos, bits);
+	__set_bit(bits[0], btree_bloom(b));
+	__set_bit(bits[1], btree_bloom(b));
+}
+
+static void bset_bloom_build(struct btree *b, struct bset_tree *t)
+{
+	struct bkey_packed *k;
+	unsigned start, nr;
+
+	if (!btree_node_has_bloom(b) ||
+	    bset_aux_tree_type(t) == BSET_NO_AUX_TREE)
+		return;
+
+	bset_bloom_range(b, t, &start, &nr);
+	bitmap_clear(btree_bloom(b), start, nr);
+
+	bset_tree_for_each_key(b, t, k)
+		bset_bloom_add(b, t, bkey_unpack_pos(b, k));
+}
+
+/*
+ * Returns false if no bset in @b has a key (including whiteouts) at @pos: bsets
+ * without an aux tree don't have a filter, but they're small enough that
+ * searching them is cheap anyways
+ */
+bool bch2_btree_node_maybe_contains(struct btree *b, struct bpos pos)
+{
+	struct bset_tree *t;
+	unsigned bits[2];
+
+	if (!btree_node_has_bloom(b))
+		return true;
+
+	for_each_bset(b, t) {
+		if (bset_aux_tree_type(t) == BSET_NO_AUX_TREE)
+			return true;
+
+		bset_bloom_bits(b, t, pos, bits);
+		if (test_bit(bits[0], btree_bloom(b)) &&
+		    test_bit(bits[1], btree_bloom(b)))
+			return true;
+	}
+
+	return false;
+}
+
+static unsigned bset_aux_tree_u64s(const struct btree *b,
+				   const struct bset_tree *t,
+				   bool writeable)
+{
+	unsigned bytes = writeable
+		? (DIV_ROUND_UP((void *) btree_bkey_last(b, t) -
+				(void *) btree_bkey_first(b, t),
+				L1_CACHE_BYTES) + 1) *
+		  sizeof(struct rw_aux_tree)
+		: bkey_to_cacheline(b, t, btree_bkey_last(b, t)) *
+		  (bkey_float_bytes(t) + sizeof(u8));
+
+	return DIV_ROUND_UP(bytes, sizeof(u64));
+}
+
+/*
+ * Aux trees are position independent within b->aux_data, so when rebuilding
+ * @t's we just move the aux trees of later bsets to make room (or to give back
+ * space we no longer need) instead of rebuilding them too - unless they don't
+ * fit anymore:
+ */
+static void bset_alloc_tree(struct btree *b, struct bset_tree *t,
+			    bool writeable)
+{
+	unsigned cacheline_u64s = SMP_CACHE_BYTES / sizeof(u64);
+	struct bset_tree *i, *last = NULL;
 
 	for (i = b->set; i != t; i++)
 		BUG_ON(bset_has_rw_aux_tree(i));
 
-	bch2_bset_set_no_aux_tree(b, t);
+	bch2_bset_invalidate_aux_tree(b, t);
 
 	/* round up to next cacheline: */
 	t->aux_data_offset = round_up(bset_aux_tree_buf_start(b, t),
-				      SMP_CACHE_BYTES / sizeof(u64));
+				      cacheline_u64s);
+
+	for (i = t + 1;
+	     i < b->set + b->nsets && i->aux_data_offset != U16_MAX;
+	     i++)
+		last = i;
+
+	if (last) {
+		unsigned src = t[1].aux_data_offset;
+		unsigned dst = round_up(t->aux_data_offset +
+					bset_aux_tree_u64s(b, t, writeable),
+					cacheline_u64s);
+		unsigned len = bset_aux_tree_buf_end(last) - src;
+
+		if (dst + len > btree_aux_data_u64s(b)) {
+			bch2_bset_set_no_aux_tree(b, t + 1);
+		} else if (dst != src) {
+			memmove((u64 *) b->aux_data + dst,
+				(u64 *) b->aux_data + src,
+				len * sizeof(u64));
+
+			for (i = t + 1; i <= last; i++)
+				i->aux_data_offset = i->aux_data_offset - src + dst;
+		}
+	}
 
 	bset_aux_tree_verify(b);
 }
 
+/*
+ * A bfloat whose mantissa is equal to the mantissa of the key before it (at the
+ * same exponent) can't distinguish search keys between the two, so lookups that
+ * land there have to compare against the original key:
+ */
+static bool bkey_float_imprecise(const struct btree *b,
+				 const struct bset_tree *t,
+				 unsigned j)
+{
+	struct bkey_float *f = bkey_float(b, t, j);
+	struct bkey_packed *prev = tree_to_prev_bkey(b, t, j);
+	unsigned bits = bkey_float_mantissa_bits(t);
+
+	return f->exponent < BFLOAT_FAILED &&
+		bkey_packed(prev) &&
+		bkey_mantissa(prev, f->exponent, bits) ==
+		bkey_float_mantissa(t, f) &&
+		bkey_mantissa_bits_dropped(b, f->exponent, bits);
+}
+
+/*
+ * Wide bfloats take 9 bytes per cacheline instead of 5, more than the 8 bytes
+ * per cacheline of aux data a node gets - so we only switch a bset to wide
+ * bfloats when a quarter of its 16 bit bfloats are imprecise, and only if the
+ * whole tree fits without evicting later bsets' aux trees:
+ */
+static bool bset_want_wide_bfloats(const struct btree *b,
+				   const struct bset_tree *t)
+{
+	unsigned cacheline_u64s = SMP_CACHE_BYTES / sizeof(u64);
+	const struct bset_tree *i, *last = NULL;
+	unsigned j, imprecise = 0, u64s, later_u64s = 0;
+
+	if (t->wide_bfloats ||
+	    !bset_has_ro_aux_tree(t) ||
+	    b->nr_key_bits < BKEY_MANTISSA_BITS_WIDE)
+		return false;
+
+	for (j = 1; j < t->size; j++)
+		imprecise += bkey_float_imprecise(b, t, j);
+
+	if (imprecise * 4 < t->size)
+		return false;
+
+	for (i = t + 1;
+	     i < b->set + b->nsets && i->aux_data_offset != U16_MAX;
+	     i++)
+		last = i;
+
+	if (last)
+		later_u64s = bset_aux_tree_buf_end(last) - t[1].aux_data_offset;
+
+	u64s = DIV_ROUND_UP(bkey_to_cacheline(b, t, btree_bkey_last(b, t)) *
+			    (sizeof(struct bkey_float_wide) + sizeof(u8)),
+			    sizeof(u64));
+
+	return t->aux_data_offset + round_up(u64s, cacheline_u64s) +
+		later_u64s <= btree_aux_data_u64s(b);
+}
+
 void bch2_bset_build_aux_tree(struct btree *b, struct bset_tree *t,
 			     bool writeable)
 {
@@ -816,16 +1081,25 @@ void bch2_bset_build_aux_tree(struct btree *b, struct bset_tree *t,
 	    : bset_has_ro_aux_tree(t))
 		return;
 
-	bset_alloc_tree(b, t);
+	t->wide_bfloats = false;
+	bset_alloc_tree(b, t, writeable);
 
 	if (!__bset_tree_capacity(b, t))
 		return;
 
-	if (writeable)
+	if (writeable) {
 		__build_rw_aux_tree(b, t);
-	else
+	} else {
 		__build_ro_aux_tree(b, t);
 
+		if (bset_want_wide_bfloats(b, t)) {
+			t->wide_bfloats = true;
+			bset_alloc_tree(b, t, false);
+			__build_ro_aux_tree(b, t);
+		}
+	}
+
+	bset_bloom_build(b, t);
 	bset_aux_tree_verify(b);
 }
 
@@ -1143,6 +1417,9 @@ void bch2_bset_insert(struct btree *b,
 	if (src->u64s != clobber_u64s)
 		bch2_bset_fix_lookup_table(b, t, where, clobber_u64s, src->u64s);
 
+	if (btree_node_has_bloom(b) && bset_has_rw_aux_tree(t))
+		bset_bloom_add(b, t, insert->k.p);
+
 	bch2_verify_btree_nr_keys(b);
 }
 
@@ -1206,48 +1483,49 @@ static inline void prefetch_four_cachelines(void *p)
 #endif
 }
 
-static inline bool bkey_mantissa_bits_dropped(const struct btree *b,
-					      const struct bkey_float *f,
-					      unsigned idx)
-{
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-	unsigned key_bits_start = b->format.key_u64s * 64 - b->nr_key_bits;
-
-	return f->exponent > key_bits_start;
-#else
-	unsigned key_bits_end = high_bit_offset + b->nr_key_bits;
-
-	return f->exponent + BKEY_MANTISSA_BITS < key_bits_end;
-#endif
-}
-
-__flatten
-static struct bkey_packed *bset_search_tree(const struct btree *b,
+static __always_inline
+struct bkey_packed *__bset_search_tree(const struct btree *b,
 				const struct bset_tree *t,
 				const struct bpos *search,
-				const struct bkey_packed *packed_search)
-{
-	struct ro_aux_tree *base = ro_aux_tree_base(b, t);
+				const struct bkey_packed *packed_search,
+				const bool wide)
+{
+	void *base = ro_aux_tree_base(b, t);
+	const unsigned stride = wide
+		? sizeof(struct bkey_float_wide)
+		: sizeof(struct bkey_float);
+	const unsigned bits = wide
+		? BKEY_MANTISSA_BITS_WIDE
+		: BKEY_MANTISSA_BITS;
 	struct bkey_float *f;
 	struct bkey_packed *k;
 	unsigned inorder, n = 1, l, r;
 	int cmp;
 
+	/*
+	 * Each step of the descent depends on the result of the previous
+	 * comparison, so the best we can do is keep the common case - comparing
+	 * mantissas - free of branches that don't depend on the key:
+	 */
+	if (unlikely(!packed_search))
+		goto slowpath_only;
+
 	do {
 		if (likely(n << 4 < t->size))
-			prefetch(&base->f[n << 4]);
+			prefetch(base + (n << 4) * stride);
 
-		f = &base->f[n];
+		f = base + n * stride;
 
-		if (!unlikely(packed_search))
-			goto slowpath;
 		if (unlikely(f->exponent >= BFLOAT_FAILED))
 			goto slowpath;
 
-		l = f->mantissa;
-		r = bkey_mantissa(packed_search, f, n);
+		l = wide
+			? ((struct bkey_float_wide *) f)->mantissa
+			: f->mantissa;
+		r = bkey_mantissa(packed_search, f->exponent, bits);
 
-		if (unlikely(l == r) && bkey_mantissa_bits_dropped(b, f, n))
+		if (unlikely(l == r) &&
+		    bkey_mantissa_bits_dropped(b, f->exponent, bits))
 			goto slowpath;
 
 		n = n * 2 + (l < r);
@@ -1261,6 +1539,22 @@ static struct bkey_packed *bset_search_tree(const struct btree *b,
 		n = n * 2 + (cmp < 0);
 	} while (n < t->size);
 
+	goto found;
+slowpath_only:
+	/* Search key couldn't be packed, bfloats are of no use: */
+	do {
+		if (likely(n << 4 < t->size))
+			prefetch(base + (n << 4) * stride);
+
+		f = base + n * stride;
+		k = tree_to_bkey(b, t, n);
+		cmp = bkey_cmp_p_or_unp(b, k, NULL, search);
+		if (!cmp)
+			return k;
+
+		n = n * 2 + (cmp < 0);
+	} while (n < t->size);
+found:
 	inorder = __eytzinger1_to_inorder(n >> 1, t->size, t->extra);
 
 	/*
@@ -1272,12 +1566,23 @@ static struct bkey_packed *bset_search_tree(const struct btree *b,
 		if (unlikely(!inorder))
 			return btree_bkey_first(b, t);
 
-		f = &base->f[eytzinger1_prev(n >> 1, t->size)];
+		f = base + eytzinger1_prev(n >> 1, t->size) * stride;
 	}
 
 	return cacheline_to_bkey(b, t, inorder, f->key_offset);
 }
 
+__flatten
+static struct bkey_packed *bset_search_tree(const struct btree *b,
+				const struct bset_tree *t,
+				const struct bpos *search,
+				const struct bkey_packed *packed_search)
+{
+	return t->wide_bfloats
+		? __bset_search_tree(b, t, search, packed_search, true)
+		: __bset_search_tree(b, t, search, packed_search, false);
+}
+
 static __always_inline __flatten
 struct bkey_packed *__bch2_bset_search(struct btree *b,
 				struct bset_tree *t,
@@ -1696,10 +2001,16 @@ void bch2_btree_keys_stats(struct btree *b, struct bset_stats *stats)
 		if (bset_has_ro_aux_tree(t)) {
 			stats->floats += t->size - 1;
 
-			for (j = 1; j < t->size; j++)
+			if (t->wide_bfloats)
+				stats->wide_floats += t->size - 1;
+
+			for (j = 1; j < t->size; j++) {
 				stats->failed +=
 					bkey_float(b, t, j)->exponent ==
 					BFLOAT_FAILED;
+				stats->imprecise +=
+					bkey_float_imprecise(b, t, j);
+			}
 		}
 	}
 }
@@ -205,7 +205,29 @@ static inline size_t btree_aux_data_u64s(const struct btree *b)
 	return btree_aux_data_bytes(b) / sizeof(u64);
 }
 
+/*
+ * Leaf nodes of non extent btrees have a Bloom filter for each bset with an aux
+ * tree, after the aux data: one bit per u64 of the node, each bset using the
+ * bits corresponding to the space it occupies:
+ */
+static inline size_t btree_bloom_bytes(const struct btree *b)
+{
+	return (1U << b->byte_order) / 64;
+}
+
+static inline unsigned long *btree_bloom(const struct btree *b)
+{
+	return b->aux_data + btree_aux_data_bytes(b);
+}
+
 typedef void (*compiled_unpack_fn)(struct bkey *, const struct bkey_packed *);
+typedef int (*compiled_cmp_fn)(const struct bpos *, const struct bkey_packed *);
+
+/* The compiled comparison function follows the compiled unpack function: */
+static inline unsigned btree_cmp_fn_offset(const struct btree *b)
+{
+	return round_up(b->unpack_fn_len, 16);
+}
 
 static inline void
 __bkey_unpack_key_format_checked(const struct btree *b,
@@ -329,6 +351,17 @@ static inline void bch2_bset_set_no_aux_tree(struct btree *b,
 	}
 }
 
+/*
+ * Like bch2_bset_set_no_aux_tree(), but later bsets keep their aux trees: they're
+ * moved out of the way if necessary when @t's is rebuilt.
+ */
+static inline void bch2_bset_invalidate_aux_tree(struct btree *b,
+						 struct bset_tree *t)
+{
+	t->size = 0;
+	t->extra = BSET_NO_AUX_TREE_VAL;
+}
+
 static inline void btree_node_set_format(struct btree *b,
 					 struct bkey_format f)
 {
@@ -342,6 +375,12 @@ static inline void btree_node_set_format(struct btree *b,
 
 	b->unpack_fn_len = len;
 
+	len = bch2_compile_bkey_cmp_left_packed(&b->format,
+				b->aux_data + btree_cmp_fn_offset(b));
+	BUG_ON(len < 0 || len > U8_MAX);
+
+	b->cmp_fn_len = len;
+
 	bch2_bset_set_no_aux_tree(b, b->set);
 }
 
@@ -361,6 +400,7 @@ void bch2_bset_init_first(struct btree *, struct bset *);
 void bch2_bset_init_next(struct bch_fs *, struct btree *,
 			 struct btree_node_entry *);
 void bch2_bset_build_aux_tree(struct btree *, struct bset_tree *, bool);
+bool bch2_btree_node_maybe_contains(struct btree *, struct bpos);
 void bch2_bset_fix_invalidated_key(struct btree *, struct bkey_packed *);
 
 void bch2_bset_insert(struct btree *, struct btree_node_iter *,
@@ -611,6 +651,8 @@ struct bset_stats {
 
 	size_t floats;
 	size_t failed;
+	size_t wide_floats;
+	size_t imprecise;
 };
 
 void bch2_btree_keys_stats(struct btree *, struct bset_stats *);
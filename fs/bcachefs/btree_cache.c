@@ -8,6 +8,7 @@
 #include "btree_locking.h"
 #include "debug.h"
 #include "error.h"
+#include "journal.h"
 
 #include <linux/prefetch.h>
 #include <linux/sched/mm.h>
@@ -35,9 +36,59 @@ void bch2_recalc_btree_reserve(struct bch_fs *c)
 	c->btree_cache.reserve = reserve;
 }
 
-static inline unsigned btree_cache_can_free(struct btree_cache *bc)
+/*
+ * Interior nodes of the btrees in opts.btree_pin_interior are never evicted by
+ * the shrinker, as long as they fit in opts.btree_pin_interior_size: btrees are
+ * considered in order, and a btree is only pinned if all of its interior nodes
+ * fit.
+ *
+ * Returns a bitmask of pinned btrees:
+ */
+static unsigned btree_cache_pinned(struct bch_fs *c, unsigned *nr_pinned)
+{
+	struct btree_cache *bc = &c->btree_cache;
+	u64 budget = c->opts.btree_pin_interior_size << 9;
+	unsigned i, nr, pinned = 0;
+
+	*nr_pinned = 0;
+
+	for (i = 0; i < BTREE_ID_NR; i++) {
+		if (!(c->opts.btree_pin_interior & (1U << i)))
+			continue;
+
+		nr = atomic_read(&bc->nr_interior[i]);
+		if ((u64) (*nr_pinned + nr) * btree_bytes(c) > budget)
+			continue;
+
+		*nr_pinned += nr;
+		pinned |= 1U << i;
+	}
+
+	return pinned;
+}
+
+static inline bool btree_node_pinned(struct btree *b, unsigned pinned)
 {
-	return max_t(int, 0, bc->used - bc->reserve);
+	return b->c.level && (pinned & (1U << b->c.btree_id));
+}
+
+/*
+ * The shrinker never takes the btree node cache below the reserve plus pinned
+ * interior nodes, or below opts.btree_cache_min_size - so that memory pressure
+ * from one workload can't evict all the metadata everyone else is using:
+ */
+static inline unsigned btree_cache_can_free(struct bch_fs *c)
+{
+	struct btree_cache *bc = &c->btree_cache;
+	u64 min_nodes = div64_u64(c->opts.btree_cache_min_size << 9,
+				  btree_bytes(c));
+	unsigned nr_pinned;
+
+	btree_cache_pinned(c, &nr_pinned);
+
+	min_nodes = max_t(u64, min_nodes, bc->reserve + nr_pinned);
+
+	return bc->used > min_nodes ? bc->used - min_nodes : 0;
 }
 
 static void __btree_node_data_free(struct bch_fs *c, struct btree *b)
@@ -48,6 +99,11 @@ static void __btree_node_data_free(struct bch_fs *c, struct btree *b)
 	b->data = NULL;
 	vfree(b->aux_data);
 	b->aux_data = NULL;
+
+	if (b->lockless_table) {
+		kvfree_rcu(b->lockless_table, rcu);
+		b->lockless_table = NULL;
+	}
 }
 
 static void btree_node_data_free(struct bch_fs *c, struct btree *b)
@@ -83,7 +139,8 @@ static int btree_node_data_alloc(struct bch_fs *c, struct btree *b, gfp_t gfp)
 	if (!b->data)
 		return -ENOMEM;
 
-	b->aux_data = vmalloc_exec(btree_aux_data_bytes(b), gfp);
+	b->aux_data = vmalloc_exec(btree_aux_data_bytes(b) +
+				   btree_bloom_bytes(b), gfp);
 	if (!b->aux_data) {
 		kvpfree(b->data, btree_bytes(c));
 		b->data = NULL;
@@ -128,7 +185,10 @@ static struct btree *btree_node_mem_alloc(struct bch_fs *c)
 
 void bch2_btree_node_hash_remove(struct btree_cache *bc, struct btree *b)
 {
-	rhashtable_remove_fast(&bc->table, &b->hash, bch_btree_cache_params);
+	if (!rhashtable_remove_fast(&bc->table, &b->hash,
+				    bch_btree_cache_params) &&
+	    b->c.level)
+		atomic_dec(&bc->nr_interior[b->c.btree_id]);
 
 	/* Cause future lookups for this node to fail: */
 	b->hash_val = 0;
@@ -138,25 +198,33 @@ void bch2_btree_node_hash_remove(struct btree_cache *bc, struct btree *b)
 
 int __bch2_btree_node_hash_insert(struct btree_cache *bc, struct btree *b)
 {
+	int ret;
+
 	BUG_ON(b->hash_val);
 	b->hash_val = btree_ptr_hash_val(&b->key);
 
-	return rhashtable_lookup_insert_fast(&bc->table, &b->hash,
-					     bch_btree_cache_params);
+	ret = rhashtable_lookup_insert_fast(&bc->table, &b->hash,
+					    bch_btree_cache_params);
+	if (!ret && b->c.level)
+		atomic_inc(&bc->nr_interior[b->c.btree_id]);
+	return ret;
 }
 
 int bch2_btree_node_hash_insert(struct btree_cache *bc, struct btree *b,
 				unsigned level, enum btree_id id)
 {
+	struct bch_fs *c = container_of(bc, struct bch_fs, btree_cache);
 	int ret;
 
 	b->c.level	= level;
 	b->c.btree_id	= id;
+	/* Nodes being read in may be bigger, see btree_node_read_done(): */
+	b->node_sectors	= btree_id_node_sectors(c, id);
 
 	mutex_lock(&bc->lock);
 	ret = __bch2_btree_node_hash_insert(bc, b);
 	if (!ret)
-		list_add(&b->list, &bc->live);
+		list_add(&b->list, level ? &bc->live_hot : &bc->live);
 	mutex_unlock(&bc->lock);
 
 	return ret;
@@ -182,8 +250,10 @@ static int __btree_node_reclaim(struct bch_fs *c, struct btree *b, bool flush)
 
 	lockdep_assert_held(&bc->lock);
 
-	if (!six_trylock_intent(&b->c.lock))
+	if (!six_trylock_intent(&b->c.lock)) {
+		this_cpu_inc(bc->stats->reclaim_fail);
 		return -ENOMEM;
+	}
 
 	if (!six_trylock_write(&b->c.lock))
 		goto out_unlock_intent;
@@ -229,6 +299,7 @@ static int __btree_node_reclaim(struct bch_fs *c, struct btree *b, bool flush)
 	six_unlock_write(&b->c.lock);
 out_unlock_intent:
 	six_unlock_intent(&b->c.lock);
+	this_cpu_inc(bc->stats->reclaim_fail);
 	ret = -ENOMEM;
 	goto out;
 }
@@ -243,6 +314,36 @@ static int btree_node_write_and_reclaim(struct bch_fs *c, struct btree *b)
 	return __btree_node_reclaim(c, b, true);
 }
 
+/*
+ * Age the hot list: nodes that haven't been accessed since the last pass go
+ * back on the cold list, to be evicted if they aren't accessed again first -
+ * interior nodes only if we're still short after trying leaves:
+ */
+static void btree_cache_age_hot(struct btree_cache *bc, unsigned long nr,
+				unsigned pinned, bool interior)
+{
+	struct btree *b, *t;
+	unsigned long demoted = 0;
+
+	list_for_each_entry_safe(b, t, &bc->live_hot, list) {
+		if (demoted >= nr) {
+			/* Save position */
+			list_move_tail(&bc->live_hot, &b->list);
+			break;
+		}
+
+		if (btree_node_pinned(b, pinned))
+			continue;
+
+		if (btree_node_accessed(b)) {
+			clear_btree_node_accessed(b);
+		} else if (!b->c.level || interior) {
+			list_move_tail(&b->list, &bc->live);
+			demoted++;
+		}
+	}
+}
+
 static unsigned long bch2_btree_cache_scan(struct shrinker *shrink,
 					   struct shrink_control *sc)
 {
@@ -254,7 +355,7 @@ static unsigned long bch2_btree_cache_scan(struct shrinker *shrink,
 	unsigned long can_free;
 	unsigned long touched = 0;
 	unsigned long freed = 0;
-	unsigned i, flags;
+	unsigned i, pass, flags, pinned, nr_pinned;
 
 	if (bch2_btree_shrinker_disabled)
 		return SHRINK_STOP;
@@ -275,9 +376,11 @@ static unsigned long bch2_btree_cache_scan(struct shrinker *shrink,
 	 * IO can always make forward progress:
 	 */
 	nr /= btree_pages(c);
-	can_free = btree_cache_can_free(bc);
+	can_free = btree_cache_can_free(c);
 	nr = min_t(unsigned long, nr, can_free);
 
+	pinned = btree_cache_pinned(c, &nr_pinned);
+
 	i = 0;
 	list_for_each_entry_safe(b, t, &bc->freeable, list) {
 		touched++;
@@ -293,41 +396,55 @@ static unsigned long bch2_btree_cache_scan(struct shrinker *shrink,
 			freed++;
 		}
 	}
+	/*
+	 * First evict from the cold list, then age the hot list if we have to -
+	 * leaves first, then interior nodes:
+	 */
+	for (pass = 0; pass < 3 && freed < nr; pass++) {
+		if (pass)
+			btree_cache_age_hot(bc, nr - freed, pinned, pass > 1);
 restart:
-	list_for_each_entry_safe(b, t, &bc->live, list) {
-		touched++;
+		list_for_each_entry_safe(b, t, &bc->live, list) {
+			touched++;
+
+			if (freed >= nr) {
+				/* Save position */
+				if (&t->list != &bc->live)
+					list_move_tail(&bc->live, &t->list);
+				break;
+			}
 
-		if (freed >= nr) {
-			/* Save position */
-			if (&t->list != &bc->live)
-				list_move_tail(&bc->live, &t->list);
-			break;
+			if (btree_node_pinned(b, pinned)) {
+				list_move_tail(&b->list, &bc->live_hot);
+			} else if (btree_node_accessed(b)) {
+				/* Accessed again since it was read in: */
+				clear_btree_node_accessed(b);
+				list_move_tail(&b->list, &bc->live_hot);
+			} else if (!btree_node_reclaim(c, b)) {
+				this_cpu_inc(bc->stats->evict[b->c.btree_id][b->c.level]);
+
+				/* can't call bch2_btree_node_hash_remove under lock  */
+				freed++;
+				if (&t->list != &bc->live)
+					list_move_tail(&bc->live, &t->list);
+
+				btree_node_data_free(c, b);
+				mutex_unlock(&bc->lock);
+
+				bch2_btree_node_hash_remove(bc, b);
+				six_unlock_write(&b->c.lock);
+				six_unlock_intent(&b->c.lock);
+
+				if (freed >= nr)
+					goto out;
+
+				if (sc->gfp_mask & __GFP_FS)
+					mutex_lock(&bc->lock);
+				else if (!mutex_trylock(&bc->lock))
+					goto out;
+				goto restart;
+			}
 		}
-
-		if (!btree_node_accessed(b) &&
-		    !btree_node_reclaim(c, b)) {
-			/* can't call bch2_btree_node_hash_remove under lock  */
-			freed++;
-			if (&t->list != &bc->live)
-				list_move_tail(&bc->live, &t->list);
-
-			btree_node_data_free(c, b);
-			mutex_unlock(&bc->lock);
-
-			bch2_btree_node_hash_remove(bc, b);
-			six_unlock_write(&b->c.lock);
-			six_unlock_intent(&b->c.lock);
-
-			if (freed >= nr)
-				goto out;
-
-			if (sc->gfp_mask & __GFP_FS)
-				mutex_lock(&bc->lock);
-			else if (!mutex_trylock(&bc->lock))
-				goto out;
-			goto restart;
-		} else
-			clear_btree_node_accessed(b);
 	}
 
 	mutex_unlock(&bc->lock);
@@ -346,7 +463,7 @@ static unsigned long bch2_btree_cache_count(struct shrinker *shrink,
 	if (bch2_btree_shrinker_disabled)
 		return 0;
 
-	return btree_cache_can_free(bc) * btree_pages(c);
+	return btree_cache_can_free(c) * btree_pages(c);
 }
 
 void bch2_fs_btree_cache_exit(struct bch_fs *c)
@@ -373,6 +490,7 @@ void bch2_fs_btree_cache_exit(struct bch_fs *c)
 		if (c->btree_roots[i].b)
 			list_add(&c->btree_roots[i].b->list, &bc->live);
 
+	list_splice(&bc->live_hot, &bc->live);
 	list_splice(&bc->freeable, &bc->live);
 
 	while (!list_empty(&bc->live)) {
@@ -393,6 +511,7 @@ void bch2_fs_btree_cache_exit(struct bch_fs *c)
 	while (!list_empty(&bc->freed)) {
 		b = list_first_entry(&bc->freed, struct btree, list);
 		list_del(&b->list);
+		six_lock_pcpu_free(&b->c.lock);
 		kfree(b);
 	}
 
@@ -401,6 +520,8 @@ void bch2_fs_btree_cache_exit(struct bch_fs *c)
 
 	if (bc->table_init_done)
 		rhashtable_destroy(&bc->table);
+
+	free_percpu(bc->stats);
 }
 
 int bch2_fs_btree_cache_init(struct bch_fs *c)
@@ -411,6 +532,12 @@ int bch2_fs_btree_cache_init(struct bch_fs *c)
 
 	pr_verbose_init(c->opts, "");
 
+	bc->stats = alloc_percpu(struct btree_cache_stats);
+	if (!bc->stats) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
 	ret = rhashtable_init(&bc->table, &bch_btree_cache_params);
 	if (ret)
 		goto out;
@@ -459,6 +586,7 @@ void bch2_fs_btree_cache_init_early(struct btree_cache *bc)
 {
 	mutex_init(&bc->lock);
 	INIT_LIST_HEAD(&bc->live);
+	INIT_LIST_HEAD(&bc->live_hot);
 	INIT_LIST_HEAD(&bc->freeable);
 	INIT_LIST_HEAD(&bc->freed);
 }
@@ -490,6 +618,7 @@ int bch2_btree_cache_cannibalize_lock(struct bch_fs *c, struct closure *cl)
 		goto success;
 
 	if (!cl) {
+		this_cpu_inc(bc->stats->cannibalize_lock_fail);
 		trace_btree_node_cannibalize_lock_fail(c);
 		return -ENOMEM;
 	}
@@ -504,6 +633,7 @@ int bch2_btree_cache_cannibalize_lock(struct bch_fs *c, struct closure *cl)
 		goto success;
 	}
 
+	this_cpu_inc(bc->stats->cannibalize_lock_fail);
 	trace_btree_node_cannibalize_lock_fail(c);
 	return -EAGAIN;
 
@@ -516,9 +646,16 @@ static struct btree *btree_node_cannibalize(struct bch_fs *c)
 {
 	struct btree_cache *bc = &c->btree_cache;
 	struct btree *b;
+	unsigned nr_pinned, pinned = btree_cache_pinned(c, &nr_pinned);
 
 	list_for_each_entry_reverse(b, &bc->live, list)
-		if (!btree_node_reclaim(c, b))
+		if (!btree_node_pinned(b, pinned) &&
+		    !btree_node_reclaim(c, b))
+			return b;
+
+	list_for_each_entry_reverse(b, &bc->live_hot, list)
+		if (!btree_node_pinned(b, pinned) &&
+		    !btree_node_reclaim(c, b))
 			return b;
 
 	while (1) {
@@ -526,6 +663,10 @@ static struct btree *btree_node_cannibalize(struct bch_fs *c)
 			if (!btree_node_write_and_reclaim(c, b))
 				return b;
 
+		list_for_each_entry_reverse(b, &bc->live_hot, list)
+			if (!btree_node_write_and_reclaim(c, b))
+				return b;
+
 		/*
 		 * Rare case: all nodes were intent-locked.
 		 * Just busy-wait.
@@ -535,10 +676,28 @@ static struct btree *btree_node_cannibalize(struct bch_fs *c)
 	}
 }
 
-struct btree *bch2_btree_node_mem_alloc(struct bch_fs *c)
+static inline bool btree_node_pcpu_read_locks(struct btree *b)
+{
+	return b->c.lock.readers != NULL;
+}
+
+/*
+ * Interior nodes are read locked by every traversal that goes through them:
+ * @pcpu_read_locks gets a node whose lock has per-CPU reader counts, so read
+ * locking it doesn't bounce the lock's cacheline between CPUs. Leaves are
+ * write locked far more often, and a write lock on a per-CPU lock has to sum
+ * the reader counts of every CPU, so they get normal locks.
+ *
+ * The lock can only switch modes while nothing can see it: struct btree is
+ * never freed while the filesystem is running, and stale pointers to it may be
+ * relocked at any time. So the mode is picked when a struct btree is first
+ * allocated, and nodes are only reused for the same mode - short of
+ * cannibalizing, where any node will do:
+ */
+struct btree *bch2_btree_node_mem_alloc(struct bch_fs *c, bool pcpu_read_locks)
 {
 	struct btree_cache *bc = &c->btree_cache;
-	struct btree *b;
+	struct btree *b, *b2;
 	u64 start_time = local_clock();
 	unsigned flags;
 
@@ -550,7 +709,8 @@ struct btree *bch2_btree_node_mem_alloc(struct bch_fs *c)
 	 * the list. Check if there's any freed nodes there:
 	 */
 	list_for_each_entry(b, &bc->freeable, list)
-		if (!btree_node_reclaim(c, b))
+		if (btree_node_pcpu_read_locks(b) == pcpu_read_locks &&
+		    !btree_node_reclaim(c, b))
 			goto got_node;
 
 	/*
@@ -558,7 +718,8 @@ struct btree *bch2_btree_node_mem_alloc(struct bch_fs *c)
 	 * disk node. Check the freed list before allocating a new one:
 	 */
 	list_for_each_entry(b, &bc->freed, list)
-		if (!btree_node_reclaim(c, b))
+		if (btree_node_pcpu_read_locks(b) == pcpu_read_locks &&
+		    !btree_node_reclaim(c, b))
 			goto got_node;
 
 	b = NULL;
@@ -574,10 +735,15 @@ struct btree *bch2_btree_node_mem_alloc(struct bch_fs *c)
 
 		BUG_ON(!six_trylock_intent(&b->c.lock));
 		BUG_ON(!six_trylock_write(&b->c.lock));
+
+		/* if this fails, the node just keeps a normal lock: */
+		if (pcpu_read_locks)
+			six_lock_pcpu_alloc(&b->c.lock);
 	}
 
 	if (!b->data) {
-		if (btree_node_data_alloc(c, b, __GFP_NOWARN|GFP_KERNEL))
+		if (btree_node_data_alloc(c, b,
+				btree_cache_gfp(c, __GFP_NOWARN|GFP_KERNEL)))
 			goto err;
 
 		mutex_lock(&bc->lock);
@@ -590,10 +756,12 @@ struct btree *bch2_btree_node_mem_alloc(struct bch_fs *c)
 out:
 	b->flags		= 0;
 	b->written		= 0;
+	b->node_sectors		= c->opts.btree_node_size;
 	b->nsets		= 0;
 	b->sib_u64s[0]		= 0;
 	b->sib_u64s[1]		= 0;
 	b->whiteout_u64s	= 0;
+	journal_res_pos_reset(&c->journal, &b->c.journal_pos);
 	bch2_btree_keys_init(b);
 
 	bch2_time_stats_update(&c->times[BCH_TIME_btree_node_mem_alloc],
@@ -604,24 +772,45 @@ struct btree *bch2_btree_node_mem_alloc(struct bch_fs *c)
 err:
 	mutex_lock(&bc->lock);
 
-	if (b) {
-		list_add(&b->list, &bc->freed);
-		six_unlock_write(&b->c.lock);
-		six_unlock_intent(&b->c.lock);
-	}
-
 	/* Try to cannibalize another cached btree node: */
 	if (bc->alloc_lock == current) {
-		b = btree_node_cannibalize(c);
-		list_del_init(&b->list);
+		b2 = btree_node_cannibalize(c);
+		list_del_init(&b2->list);
 		mutex_unlock(&bc->lock);
 
-		bch2_btree_node_hash_remove(bc, b);
+		bch2_btree_node_hash_remove(bc, b2);
+
+		if (b) {
+			/* Keep the node with the lock mode we wanted: */
+			swap(b->data, b2->data);
+			swap(b->aux_data, b2->aux_data);
+
+			if (b2->lockless_table) {
+				kvfree_rcu(b2->lockless_table, rcu);
+				b2->lockless_table = NULL;
+			}
+
+			mutex_lock(&bc->lock);
+			list_add(&b2->list, &bc->freed);
+			mutex_unlock(&bc->lock);
 
+			six_unlock_write(&b2->c.lock);
+			six_unlock_intent(&b2->c.lock);
+		} else {
+			b = b2;
+		}
+
+		this_cpu_inc(bc->stats->cannibalize);
 		trace_btree_node_cannibalize(c);
 		goto out;
 	}
 
+	if (b) {
+		list_add(&b->list, &bc->freed);
+		six_unlock_write(&b->c.lock);
+		six_unlock_intent(&b->c.lock);
+	}
+
 	mutex_unlock(&bc->lock);
 	memalloc_nofs_restore(flags);
 	return ERR_PTR(-ENOMEM);
@@ -647,7 +836,7 @@ static noinline struct btree *bch2_btree_node_fill(struct bch_fs *c,
 	if (iter && !bch2_btree_node_relock(iter, level + 1))
 		return ERR_PTR(-EINTR);
 
-	b = bch2_btree_node_mem_alloc(c);
+	b = bch2_btree_node_mem_alloc(c, level != 0);
 	if (IS_ERR(b))
 		return b;
 
@@ -698,6 +887,146 @@ static int lock_node_check_fn(struct six_lock *lock, void *p)
 	return b->hash_val == btree_ptr_hash_val(k) ? 0 : -1;
 }
 
+static int lock_node_hash_check_fn(struct six_lock *lock, void *p)
+{
+	struct btree *b = container_of(lock, struct btree, c.lock);
+	const u64 *hash_val = p;
+
+	return b->hash_val == *hash_val ? 0 : -1;
+}
+
+/*
+ * Lockless traversal:
+ *
+ * For lockless traversal of interior nodes, we keep a flat table of each
+ * interior node's children - their max keys and hash table keys - tagged with
+ * the node's lock sequence number at the time the table was built.
+ *
+ * Readers binary search the table under rcu_read_lock() without locking the
+ * node, and then check that the node's sequence number hasn't changed: every
+ * modification to a btree node is done with a write lock held, which bumps the
+ * sequence number. Tables are freed with kvfree_rcu(), and struct btree is
+ * never freed while the filesystem is running, so a reader racing with a
+ * modification sees stale data, never freed memory.
+ *
+ * Tables are (re)built by whoever has the node locked and finds the table out
+ * of date:
+ */
+void bch2_btree_node_lockless_table_update(struct bch_fs *c, struct btree *b)
+{
+	struct btree_lockless_table *t, *old = READ_ONCE(b->lockless_table);
+	struct btree_node_iter iter;
+	struct bkey unpacked;
+	struct bkey_s_c k;
+	__BKEY_PADDED(k, BKEY_BTREE_PTR_VAL_U64s_MAX) tmp;
+	unsigned nr = b->nr.packed_keys + b->nr.unpacked_keys;
+	u32 seq = b->c.lock.state.seq;
+
+	EBUG_ON(!b->c.level);
+	EBUG_ON(seq & 1);
+
+	if (old && old->seq == seq)
+		return;
+
+	/* We're holding btree locks, don't block: */
+	t = kvmalloc(struct_size(t, d, nr), GFP_NOWAIT|__GFP_NOWARN);
+	if (!t)
+		return;
+
+	t->seq	= seq;
+	t->nr	= 0;
+
+	for_each_btree_node_key_unpack(b, k, &iter, &unpacked) {
+		if (WARN_ON_ONCE(t->nr >= nr) ||
+		    bkey_val_u64s(k.k) > BKEY_BTREE_PTR_VAL_U64s_MAX) {
+			kvfree(t);
+			return;
+		}
+
+		bkey_reassemble(&tmp.k, k);
+
+		t->d[t->nr].max_key	= k.k->p;
+		t->d[t->nr].hash_val	= btree_ptr_hash_val(&tmp.k);
+		t->nr++;
+	}
+
+	/* Someone else might be updating it at the same time: */
+	if (cmpxchg(&b->lockless_table, old, t) != old) {
+		kvfree(t);
+		return;
+	}
+
+	if (old)
+		kvfree_rcu(old, rcu);
+}
+
+/*
+ * A node read in by a cache miss doesn't get the accessed bit until it's hit -
+ * see bch2_btree_cache_scan():
+ */
+static inline void btree_cache_lookup_done(struct bch_fs *c, struct btree *b,
+					   bool hit)
+{
+	struct btree_cache_stats __percpu *s = c->btree_cache.stats;
+
+	if (hit) {
+		this_cpu_inc(s->hit[b->c.btree_id][b->c.level]);
+
+		/* avoid atomic set bit if it's not needed: */
+		if (!btree_node_accessed(b))
+			set_btree_node_accessed(b);
+	} else {
+		this_cpu_inc(s->miss[b->c.btree_id][b->c.level]);
+	}
+}
+
+/* Find a btree node by its hash table key, without locking it: */
+struct btree *bch2_btree_node_find_by_hash(struct bch_fs *c, u64 hash_val)
+{
+	return rhashtable_lookup_fast(&c->btree_cache.table, &hash_val,
+				      bch_btree_cache_params);
+}
+
+/*
+ * Like bch2_btree_node_get(), but for when we have the node's hash table key
+ * instead of its btree pointer and the parent isn't locked: so we can't read
+ * the node in on a cache miss, and on any sort of failure we return NULL and
+ * the caller falls back to a normal traversal:
+ */
+struct btree *bch2_btree_node_get_by_hash(struct bch_fs *c,
+					  struct btree_iter *iter,
+					  u64 hash_val, struct bpos pos,
+					  unsigned level,
+					  enum six_lock_type lock_type,
+					  unsigned long trace_ip)
+{
+	struct btree *b = bch2_btree_node_find_by_hash(c, hash_val);
+
+	if (!b)
+		return NULL;
+
+	if (!btree_node_lock(b, pos, level, iter, lock_type,
+			     lock_node_hash_check_fn, &hash_val, trace_ip))
+		return NULL;
+
+	if (unlikely(b->hash_val != hash_val ||
+		     b->c.level != level ||
+		     b->c.btree_id != iter->btree_id))
+		goto err;
+
+	wait_on_bit_io(&b->flags, BTREE_NODE_read_in_flight,
+		       TASK_UNINTERRUPTIBLE);
+
+	if (unlikely(btree_node_read_error(b)))
+		goto err;
+
+	btree_cache_lookup_done(c, b, true);
+	return b;
+err:
+	six_unlock_type(&b->c.lock, lock_type);
+	return NULL;
+}
+
 /**
  * bch_btree_node_get - find a btree node in the cache and lock it, reading it
  * in from disk if necessary.
@@ -715,6 +1044,7 @@ struct btree *bch2_btree_node_get(struct bch_fs *c, struct btree_iter *iter,
 	struct btree_cache *bc = &c->btree_cache;
 	struct btree *b;
 	struct bset_tree *t;
+	bool hit = true;
 
 	EBUG_ON(level >= BTREE_MAX_DEPTH);
 
@@ -738,6 +1068,8 @@ struct btree *bch2_btree_node_get(struct bch_fs *c, struct btree_iter *iter,
 
 		if (IS_ERR(b))
 			return b;
+
+		hit = false;
 	} else {
 lock_node:
 		/*
@@ -785,6 +1117,8 @@ struct btree *bch2_btree_node_get(struct bch_fs *c, struct btree_iter *iter,
 			if (bch2_btree_node_relock(iter, level + 1))
 				goto retry;
 
+			bch2_trans_restart_record(iter->trans,
+					BCH_TRANS_RESTART_btree_node_reused);
 			trace_trans_restart_btree_node_reused(iter->trans->ip);
 			return ERR_PTR(-EINTR);
 		}
@@ -804,9 +1138,7 @@ struct btree *bch2_btree_node_get(struct bch_fs *c, struct btree_iter *iter,
 		prefetch(p + L1_CACHE_BYTES * 2);
 	}
 
-	/* avoid atomic set bit if it's not needed: */
-	if (!btree_node_accessed(b))
-		set_btree_node_accessed(b);
+	btree_cache_lookup_done(c, b, hit);
 
 	if (unlikely(btree_node_read_error(b))) {
 		six_unlock_type(&b->c.lock, lock_type);
@@ -832,6 +1164,7 @@ struct btree *bch2_btree_node_get_noiter(struct bch_fs *c,
 	struct btree_cache *bc = &c->btree_cache;
 	struct btree *b;
 	struct bset_tree *t;
+	bool hit = true;
 	int ret;
 
 	EBUG_ON(level >= BTREE_MAX_DEPTH);
@@ -854,6 +1187,8 @@ struct btree *bch2_btree_node_get_noiter(struct bch_fs *c,
 
 		if (IS_ERR(b))
 			return b;
+
+		hit = false;
 	} else {
 lock_node:
 		ret = six_lock_read(&b->c.lock, lock_node_check_fn, (void *) k);
@@ -882,9 +1217,7 @@ struct btree *bch2_btree_node_get_noiter(struct bch_fs *c,
 		prefetch(p + L1_CACHE_BYTES * 2);
 	}
 
-	/* avoid atomic set bit if it's not needed: */
-	if (!btree_node_accessed(b))
-		set_btree_node_accessed(b);
+	btree_cache_lookup_done(c, b, hit);
 
 	if (unlikely(btree_node_read_error(b))) {
 		six_unlock_read(&b->c.lock);
@@ -1048,6 +1381,23 @@ void bch2_btree_node_prefetch(struct bch_fs *c, struct btree_iter *iter,
 	bch2_btree_node_fill(c, iter, k, btree_id, level, SIX_LOCK_read, false);
 }
 
+/*
+ * Returns true if the node @k points to is in the btree cache and has been read
+ * in - without taking any locks, so only good as a hint:
+ */
+bool bch2_btree_node_cached(struct bch_fs *c, const struct bkey_i *k)
+{
+	struct btree *b;
+	bool ret;
+
+	rcu_read_lock();
+	b = btree_cache_find(&c->btree_cache, k);
+	ret = b && !btree_node_read_in_flight(b);
+	rcu_read_unlock();
+
+	return ret;
+}
+
 void bch2_btree_node_to_text(struct printbuf *out, struct bch_fs *c,
 			     struct btree *b)
 {
@@ -1075,7 +1425,9 @@ void bch2_btree_node_to_text(struct printbuf *out, struct bch_fs *c,
 	       "    nr packed keys %u\n"
 	       "    nr unpacked keys %u\n"
 	       "    floats %zu\n"
-	       "    failed unpacked %zu\n",
+	       "    failed unpacked %zu\n"
+	       "    wide floats %zu\n"
+	       "    imprecise floats %zu\n",
 	       f->key_u64s,
 	       f->bits_per_field[0],
 	       f->bits_per_field[1],
@@ -1084,20 +1436,57 @@ void bch2_btree_node_to_text(struct printbuf *out, struct bch_fs *c,
 	       f->bits_per_field[4],
 	       b->unpack_fn_len,
 	       b->nr.live_u64s * sizeof(u64),
-	       btree_bytes(c) - sizeof(struct btree_node),
-	       b->nr.live_u64s * 100 / btree_max_u64s(c),
+	       (b->node_sectors << 9) - sizeof(struct btree_node),
+	       b->nr.live_u64s * 100 / btree_id_max_u64s(c, b->c.btree_id),
 	       b->sib_u64s[0],
 	       b->sib_u64s[1],
-	       BTREE_FOREGROUND_MERGE_THRESHOLD(c),
+	       BTREE_FOREGROUND_MERGE_THRESHOLD(c, b->c.btree_id),
 	       b->nr.packed_keys,
 	       b->nr.unpacked_keys,
 	       stats.floats,
-	       stats.failed);
+	       stats.failed,
+	       stats.wide_floats,
+	       stats.imprecise);
 }
 
 void bch2_btree_cache_to_text(struct printbuf *out, struct bch_fs *c)
 {
+	unsigned nr_pinned;
+
 	pr_buf(out, "nr nodes:\t\t%u\n", c->btree_cache.used);
 	pr_buf(out, "nr dirty:\t\t%u\n", atomic_read(&c->btree_cache.dirty));
 	pr_buf(out, "cannibalize lock:\t%p\n", c->btree_cache.alloc_lock);
+	btree_cache_pinned(c, &nr_pinned);
+	pr_buf(out, "nr pinned:\t\t%u\n", nr_pinned);
+}
+
+void bch2_btree_cache_stats_to_text(struct printbuf *out, struct bch_fs *c)
+{
+	struct btree_cache_stats __percpu *s = c->btree_cache.stats;
+	unsigned id, level;
+
+	pr_buf(out, "reclaim failures:\t%llu\n",
+	       percpu_u64_get(&s->reclaim_fail));
+	pr_buf(out, "cannibalized:\t\t%llu\n",
+	       percpu_u64_get(&s->cannibalize));
+	pr_buf(out, "cannibalize lock fail:\t%llu\n",
+	       percpu_u64_get(&s->cannibalize_lock_fail));
+	pr_buf(out, "\n");
+
+	pr_buf(out, "btree\tlevel\thits\tmisses\thit %%\tevicted\n");
+
+	for (id = 0; id < BTREE_ID_NR; id++)
+		for (level = 0; level < BTREE_MAX_DEPTH; level++) {
+			u64 hit   = percpu_u64_get(&s->hit[id][level]);
+			u64 miss  = percpu_u64_get(&s->miss[id][level]);
+			u64 evict = percpu_u64_get(&s->evict[id][level]);
+
+			if (!hit && !miss && !evict)
+				continue;
+
+			pr_buf(out, "%s\t%u\t%llu\t%llu\t%llu\t%llu\n",
+			       bch2_btree_ids[id], level, hit, miss,
+			       div64_u64(hit * 100, max(hit + miss, 1ULL)),
+			       evict);
+		}
 }
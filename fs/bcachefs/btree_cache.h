@@ -19,12 +19,18 @@ int bch2_btree_node_hash_insert(struct btree_cache *, struct btree *,
 void bch2_btree_cache_cannibalize_unlock(struct bch_fs *);
 int bch2_btree_cache_cannibalize_lock(struct bch_fs *, struct closure *);
 
-struct btree *bch2_btree_node_mem_alloc(struct bch_fs *);
+struct btree *bch2_btree_node_mem_alloc(struct bch_fs *, bool);
 
 struct btree *bch2_btree_node_get(struct bch_fs *, struct btree_iter *,
 				  const struct bkey_i *, unsigned,
 				  enum six_lock_type, unsigned long);
 
+void bch2_btree_node_lockless_table_update(struct bch_fs *, struct btree *);
+struct btree *bch2_btree_node_find_by_hash(struct bch_fs *, u64);
+struct btree *bch2_btree_node_get_by_hash(struct bch_fs *, struct btree_iter *,
+					  u64, struct bpos, unsigned,
+					  enum six_lock_type, unsigned long);
+
 struct btree *bch2_btree_node_get_noiter(struct bch_fs *, const struct bkey_i *,
 					 enum btree_id, unsigned, bool);
 
@@ -33,6 +39,7 @@ struct btree *bch2_btree_node_get_sibling(struct bch_fs *, struct btree_iter *,
 
 void bch2_btree_node_prefetch(struct bch_fs *, struct btree_iter *,
 			      const struct bkey_i *, enum btree_id, unsigned);
+bool bch2_btree_node_cached(struct bch_fs *, const struct bkey_i *);
 
 void bch2_fs_btree_cache_exit(struct bch_fs *);
 int bch2_fs_btree_cache_init(struct bch_fs *);
@@ -84,22 +91,52 @@ static inline size_t btree_pages(struct bch_fs *c)
 	return btree_bytes(c) / PAGE_SIZE;
 }
 
+/*
+ * With opts.btree_cache_memcg, growing the btree node and key caches is charged
+ * to the memory cgroup of the task whose IO needed it - so a cgroup can't grow
+ * them past its own limit. Only for allocations that can fall back to reusing
+ * an existing cache entry, so we don't retry or OOM within the cgroup:
+ */
+static inline gfp_t btree_cache_gfp(struct bch_fs *c, gfp_t gfp)
+{
+	return c->opts.btree_cache_memcg
+		? gfp|__GFP_ACCOUNT|__GFP_NORETRY
+		: gfp;
+}
+
 static inline unsigned btree_blocks(struct bch_fs *c)
 {
 	return c->opts.btree_node_size >> c->block_bits;
 }
 
-#define BTREE_SPLIT_THRESHOLD(c)		(btree_max_u64s(c) * 2 / 3)
+/*
+ * Btrees may be configured with a node size smaller than btree_node_size (see
+ * BCH_SB_FIELD_btree_node_size) - node buffers are always btree_bytes(), but
+ * we split nodes once they've used this much:
+ */
+static inline unsigned btree_id_node_sectors(struct bch_fs *c, enum btree_id id)
+{
+	return c->btree_node_sectors[id];
+}
+
+static inline size_t btree_id_max_u64s(struct bch_fs *c, enum btree_id id)
+{
+	return ((btree_id_node_sectors(c, id) << 9) -
+		sizeof(struct btree_node)) / sizeof(u64);
+}
+
+#define BTREE_SPLIT_THRESHOLD(c, id)		(btree_id_max_u64s(c, id) * 2 / 3)
 
-#define BTREE_FOREGROUND_MERGE_THRESHOLD(c)	(btree_max_u64s(c) * 1 / 3)
-#define BTREE_FOREGROUND_MERGE_HYSTERESIS(c)			\
-	(BTREE_FOREGROUND_MERGE_THRESHOLD(c) +			\
-	 (BTREE_FOREGROUND_MERGE_THRESHOLD(c) << 2))
+#define BTREE_FOREGROUND_MERGE_THRESHOLD(c, id)	(btree_id_max_u64s(c, id) * 1 / 3)
+#define BTREE_FOREGROUND_MERGE_HYSTERESIS(c, id)		\
+	(BTREE_FOREGROUND_MERGE_THRESHOLD(c, id) +		\
+	 (BTREE_FOREGROUND_MERGE_THRESHOLD(c, id) << 2))
 
 #define btree_node_root(_c, _b)	((_c)->btree_roots[(_b)->c.btree_id].b)
 
 void bch2_btree_node_to_text(struct printbuf *, struct bch_fs *,
 			     struct btree *);
 void bch2_btree_cache_to_text(struct printbuf *, struct bch_fs *);
+void bch2_btree_cache_stats_to_text(struct printbuf *, struct bch_fs *);
 
 #endif /* _BCACHEFS_BTREE_CACHE_H */
@@ -70,6 +70,14 @@ static int bch2_gc_check_topology(struct bch_fs *c,
 	bool update_max = false;
 	int ret = 0;
 
+	/* Repairs are left to the single threaded pass: */
+	if (test_bit(BCH_FS_GC_PARALLEL, &c->flags) &&
+	    ((cur.k->k.type == KEY_TYPE_btree_ptr_v2 &&
+	      bkey_cmp(expected_start,
+		       bkey_i_to_btree_ptr_v2(cur.k)->v.min_key)) ||
+	     (is_last && bkey_cmp(cur.k->k.p, node_end))))
+		return -EAGAIN;
+
 	if (cur.k->k.type == KEY_TYPE_btree_ptr_v2) {
 		struct bkey_i_btree_ptr_v2 *bp = bkey_i_to_btree_ptr_v2(cur.k);
 
@@ -158,6 +166,24 @@ static int bch2_gc_check_topology(struct bch_fs *c,
 	return ret;
 }
 
+static bool gc_ptrs_need_fix(struct bch_fs *c, struct bkey_s_c k)
+{
+	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(k);
+	const struct bch_extent_ptr *ptr;
+
+	bkey_for_each_ptr(ptrs, ptr) {
+		struct bch_dev *ca = bch_dev_bkey_exists(c, ptr->dev);
+		struct bucket *g = PTR_BUCKET(ca, ptr, true);
+
+		if (!g->gen_valid ||
+		    gen_cmp(ptr->gen, g->mark.gen) > 0 ||
+		    (!ptr->cached && gen_cmp(ptr->gen, g->mark.gen) < 0))
+			return true;
+	}
+
+	return false;
+}
+
 static int bch2_check_fix_ptrs(struct bch_fs *c, enum btree_id btree_id,
 			       unsigned level, bool is_root,
 			       struct bkey_s_c *k)
@@ -167,6 +193,14 @@ static int bch2_check_fix_ptrs(struct bch_fs *c, enum btree_id btree_id,
 	bool do_update = false;
 	int ret = 0;
 
+	/*
+	 * Fixing pointers modifies bucket gens and the journal keys, which
+	 * can't be done while other threads are marking:
+	 */
+	if (test_bit(BCH_FS_GC_PARALLEL, &c->flags) &&
+	    gc_ptrs_need_fix(c, *k))
+		return -EAGAIN;
+
 	bkey_for_each_ptr(ptrs, ptr) {
 		struct bch_dev *ca = bch_dev_bkey_exists(c, ptr->dev);
 		struct bucket *g = PTR_BUCKET(ca, ptr, true);
@@ -257,15 +291,20 @@ static int bch2_gc_mark_key(struct bch_fs *c, enum btree_id btree_id,
 {
 	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(k);
 	const struct bch_extent_ptr *ptr;
+	bool parallel = test_bit(BCH_FS_GC_PARALLEL, &c->flags);
 	unsigned flags =
 		BTREE_TRIGGER_GC|
-		(initial ? BTREE_TRIGGER_NOATOMIC : 0);
+		(initial && !parallel ? BTREE_TRIGGER_NOATOMIC : 0);
 	int ret = 0;
 
 	if (initial) {
 		BUG_ON(bch2_journal_seq_verify &&
 		       k.k->version.lo > journal_cur_seq(&c->journal));
 
+		if (parallel &&
+		    k.k->version.lo > atomic64_read(&c->key_version))
+			return -EAGAIN;
+
 		if (fsck_err_on(k.k->version.lo > atomic64_read(&c->key_version), c,
 				"key version number higher than recorded: %llu > %llu",
 				k.k->version.lo,
@@ -288,8 +327,12 @@ static int bch2_gc_mark_key(struct bch_fs *c, enum btree_id btree_id,
 		struct bch_dev *ca = bch_dev_bkey_exists(c, ptr->dev);
 		struct bucket *g = PTR_BUCKET(ca, ptr, true);
 
-		if (gen_after(g->oldest_gen, ptr->gen))
-			g->oldest_gen = ptr->gen;
+		if (gen_after(g->oldest_gen, ptr->gen)) {
+			spin_lock(&c->gc_oldest_gen_lock);
+			if (gen_after(g->oldest_gen, ptr->gen))
+				g->oldest_gen = ptr->gen;
+			spin_unlock(&c->gc_oldest_gen_lock);
+		}
 
 		*max_stale = max(*max_stale, ptr_stale(ca, ptr));
 	}
@@ -457,6 +500,10 @@ static int bch2_gc_btree_init_recurse(struct bch_fs *c, struct btree *b,
 						false);
 			ret = PTR_ERR_OR_ZERO(child);
 
+			if (ret == -EIO &&
+			    test_bit(BCH_FS_GC_PARALLEL, &c->flags))
+				ret = -EAGAIN;
+
 			if (fsck_err_on(ret == -EIO, c,
 					"unreadable btree node")) {
 				ret = bch2_journal_key_delete(c, b->c.btree_id,
@@ -535,11 +582,68 @@ static inline int btree_id_gc_phase_cmp(enum btree_id l, enum btree_id r)
 		(int) btree_id_to_gc_phase(r);
 }
 
-static int bch2_gc_btrees(struct bch_fs *c, bool initial)
+struct gc_btree_thread {
+	struct closure		cl;
+	struct bch_fs		*c;
+	enum btree_id		id;
+	int			ret;
+};
+
+static void bch2_gc_btree_init_thread(struct closure *cl)
+{
+	struct gc_btree_thread *t = container_of(cl, struct gc_btree_thread, cl);
+
+	t->ret = bch2_gc_btree_init(t->c, t->id);
+	closure_return(cl);
+}
+
+/*
+ * Initial gc, marking each btree in its own thread: bucket marks are updated
+ * atomically and usage goes to percpu counters, so marking is safe to do
+ * concurrently, but repairs aren't - if anything needs fixing we return
+ * -EAGAIN, and the caller redoes the whole pass single threaded.
+ */
+static int bch2_gc_btrees_parallel(struct bch_fs *c)
+{
+	struct gc_btree_thread threads[BTREE_ID_NR];
+	struct closure cl;
+	unsigned i;
+	int ret;
+
+	/* Stripes must be marked before the pointers that refer to them: */
+	ret = bch2_gc_btree_init(c, BTREE_ID_EC);
+	if (ret)
+		return ret;
+
+	set_bit(BCH_FS_GC_PARALLEL, &c->flags);
+	closure_init_stack(&cl);
+
+	for (i = 0; i < BTREE_ID_NR; i++) {
+		threads[i] = (struct gc_btree_thread) { .c = c, .id = i };
+
+		if (i != BTREE_ID_EC)
+			closure_call(&threads[i].cl, bch2_gc_btree_init_thread,
+				     system_unbound_wq, &cl);
+	}
+
+	closure_sync(&cl);
+	clear_bit(BCH_FS_GC_PARALLEL, &c->flags);
+
+	for (i = 0; i < BTREE_ID_NR; i++)
+		if (threads[i].ret && (!ret || ret == -EAGAIN))
+			ret = threads[i].ret;
+
+	return ret;
+}
+
+static int bch2_gc_btrees(struct bch_fs *c, bool initial, bool parallel)
 {
 	enum btree_id ids[BTREE_ID_NR];
 	unsigned i;
 
+	if (initial && parallel)
+		return bch2_gc_btrees_parallel(c);
+
 	for (i = 0; i < BTREE_ID_NR; i++)
 		ids[i] = i;
 	bubble_sort(ids, BTREE_ID_NR, btree_id_gc_phase_cmp);
@@ -701,9 +805,8 @@ static void bch2_gc_free(struct bch_fs *c)
 	genradix_free(&c->stripes[1]);
 
 	for_each_member_device(ca, c, i) {
-		kvpfree(rcu_dereference_protected(ca->buckets[1], 1),
-			sizeof(struct bucket_array) +
-			ca->mi.nbuckets * sizeof(struct bucket));
+		if (ca->buckets[1])
+			bch2_bucket_array_free(rcu_dereference_protected(ca->buckets[1], 1));
 		ca->buckets[1] = NULL;
 
 		free_percpu(ca->usage_gc);
@@ -742,14 +845,14 @@ static int bch2_gc_done(struct bch_fs *c,
 		set_bit(BCH_FS_NEED_ALLOC_WRITE, &c->flags);		\
 	}
 #define copy_bucket_field(_f)						\
-	if (dst->b[b].mark._f != src->b[b].mark._f) {			\
+	if (bucket_array_entry(dst, b)->mark._f != bucket_array_entry(src, b)->mark._f) {			\
 		if (verify)						\
 			fsck_err(c, "bucket %u:%zu gen %u data type %s has wrong " #_f	\
 				": got %u, should be %u", i, b,		\
-				dst->b[b].mark.gen,			\
-				bch2_data_types[dst->b[b].mark.data_type],\
-				dst->b[b].mark._f, src->b[b].mark._f);	\
-		dst->b[b]._mark._f = src->b[b].mark._f;			\
+				bucket_array_entry(dst, b)->mark.gen,			\
+				bch2_data_types[bucket_array_entry(dst, b)->mark.data_type],\
+				bucket_array_entry(dst, b)->mark._f, bucket_array_entry(src, b)->mark._f);	\
+		bucket_array_entry(dst, b)->_mark._f = bucket_array_entry(src, b)->mark._f;			\
 		set_bit(BCH_FS_NEED_ALLOC_WRITE, &c->flags);		\
 	}
 #define copy_dev_field(_f, _msg, ...)					\
@@ -802,9 +905,11 @@ static int bch2_gc_done(struct bch_fs *c,
 			copy_bucket_field(dirty_sectors);
 			copy_bucket_field(cached_sectors);
 
-			dst->b[b].oldest_gen = src->b[b].oldest_gen;
+			bucket_array_entry(dst, b)->oldest_gen = bucket_array_entry(src, b)->oldest_gen;
 		}
 
+		bch2_dev_buckets_frag_rebuild(ca);
+
 		{
 			struct bch_dev_usage *dst = ca->usage_base;
 			struct bch_dev_usage *src = (void *)
@@ -878,9 +983,8 @@ static int bch2_gc_start(struct bch_fs *c)
 		BUG_ON(ca->buckets[1]);
 		BUG_ON(ca->usage_gc);
 
-		ca->buckets[1] = kvpmalloc(sizeof(struct bucket_array) +
-				ca->mi.nbuckets * sizeof(struct bucket),
-				GFP_KERNEL|__GFP_ZERO);
+		ca->buckets[1] = bch2_bucket_array_alloc(ca->mi.nbuckets,
+						ca->mi.first_bucket, NULL);
 		if (!ca->buckets[1]) {
 			percpu_ref_put(&ca->ref);
 			bch_err(c, "error allocating ca->buckets[gc]");
@@ -918,10 +1022,10 @@ static int bch2_gc_start(struct bch_fs *c)
 		dst->nbuckets		= src->nbuckets;
 
 		for (b = 0; b < src->nbuckets; b++) {
-			struct bucket *d = &dst->b[b];
-			struct bucket *s = &src->b[b];
+			struct bucket *d = bucket_array_entry(dst, b);
+			struct bucket *s = bucket_array_entry(src, b);
 
-			d->_mark.gen = dst->b[b].oldest_gen = s->mark.gen;
+			d->_mark.gen = bucket_array_entry(dst, b)->oldest_gen = s->mark.gen;
 			d->gen_valid = s->gen_valid;
 		}
 	};
@@ -954,6 +1058,7 @@ int bch2_gc(struct bch_fs *c, bool initial)
 	struct bch_dev *ca;
 	u64 start_time = local_clock();
 	unsigned i, iter = 0;
+	bool parallel = initial && c->opts.gc_parallel;
 	int ret;
 
 	lockdep_assert_held(&c->state_lock);
@@ -971,7 +1076,17 @@ int bch2_gc(struct bch_fs *c, bool initial)
 
 	bch2_mark_superblocks(c);
 
-	ret = bch2_gc_btrees(c, initial);
+	ret = bch2_gc_btrees(c, initial, parallel);
+	if (ret == -EAGAIN && parallel) {
+		bch_info(c, "Parallel GC found errors, restarting single threaded:");
+		parallel = false;
+		__gc_pos_set(c, gc_phase(GC_PHASE_NOT_RUNNING));
+
+		percpu_down_write(&c->mark_lock);
+		bch2_gc_free(c);
+		percpu_up_write(&c->mark_lock);
+		goto again;
+	}
 	if (ret)
 		goto out;
 
@@ -1070,16 +1185,66 @@ static bool gc_btree_gens_key(struct bch_fs *c, struct bkey_s_c k)
 	return false;
 }
 
+/*
+ * Walking every key with pointers takes a long time on a big filesystem, so
+ * it's done in batches: between batches we drop btree locks and gc_lock, so
+ * as not to block full gc or device resize for the whole walk, and when
+ * running in the background we're paced by the write io_clock - unless the
+ * allocator is actually waiting on us for buckets.
+ *
+ * Dropping gc_lock is safe: buckets that are invalidated while we walk get a
+ * newer gen than the gc_gen we started with, so the oldest_gen we compute can
+ * only be too old, never too new.
+ */
+#define GC_GENS_BATCH		512
+
+static bool gc_gens_urgent(struct bch_fs *c)
+{
+	struct bch_dev *ca;
+	unsigned i;
+	bool ret = false;
+
+	rcu_read_lock();
+	for_each_member_device_rcu(ca, c, i, NULL)
+		ret |= READ_ONCE(ca->inc_gen_really_needs_gc) != 0;
+	rcu_read_unlock();
+
+	return ret;
+}
+
+static int gc_gens_pause(struct bch_fs *c, struct btree_trans *trans,
+			 bool background)
+{
+	struct io_clock *clock = &c->io_clock[WRITE];
+
+	bch2_trans_unlock(trans);
+	up_read(&c->gc_lock);
+
+	if (background && !gc_gens_urgent(c))
+		bch2_kthread_io_clock_wait(clock,
+				atomic64_read(&clock->now) + (c->capacity >> 16),
+				HZ / 100);
+	else
+		cond_resched();
+
+	down_read(&c->gc_lock);
+
+	return (current->flags & PF_KTHREAD) && kthread_should_stop()
+		? -EINTR : 0;
+}
+
 /*
  * For recalculating oldest gen, we only need to walk keys in leaf nodes; btree
  * node pointers currently never have cached pointers that can become stale:
  */
-static int bch2_gc_btree_gens(struct bch_fs *c, enum btree_id btree_id)
+static int bch2_gc_btree_gens(struct bch_fs *c, enum btree_id btree_id,
+			      bool background)
 {
 	struct btree_trans trans;
 	struct btree_iter *iter;
 	struct bkey_s_c k;
 	struct bkey_buf sk;
+	unsigned nr = 0;
 	int ret = 0;
 
 	bch2_bkey_buf_init(&sk);
@@ -1108,6 +1273,12 @@ static int bch2_gc_btree_gens(struct bch_fs *c, enum btree_id btree_id)
 		}
 
 		bch2_btree_iter_next(iter);
+
+		if (!(++nr % GC_GENS_BATCH)) {
+			ret = gc_gens_pause(c, &trans, background);
+			if (ret)
+				break;
+		}
 	}
 
 	bch2_trans_exit(&trans);
@@ -1116,11 +1287,16 @@ static int bch2_gc_btree_gens(struct bch_fs *c, enum btree_id btree_id)
 	return ret;
 }
 
-int bch2_gc_gens(struct bch_fs *c)
+/*
+ * Recalculate oldest_gen for every bucket: @background is set when called from
+ * the gc thread, and paces the walk so as to not compete with foreground IO
+ */
+int bch2_gc_gens(struct bch_fs *c, bool background)
 {
 	struct bch_dev *ca;
 	struct bucket_array *buckets;
 	struct bucket *g;
+	size_t b;
 	unsigned i;
 	int ret;
 
@@ -1135,14 +1311,19 @@ int bch2_gc_gens(struct bch_fs *c)
 		down_read(&ca->bucket_lock);
 		buckets = bucket_array(ca);
 
-		for_each_bucket(g, buckets)
+		for_each_bucket(g, b, buckets)
 			g->gc_gen = g->mark.gen;
 		up_read(&ca->bucket_lock);
 	}
 
 	for (i = 0; i < BTREE_ID_NR; i++)
 		if (btree_node_type_needs_gc(i)) {
-			ret = bch2_gc_btree_gens(c, i);
+			ret = bch2_gc_btree_gens(c, i, background);
+			if (ret == -EINTR) {
+				/* shutting down: */
+				ret = 0;
+				goto err;
+			}
 			if (ret) {
 				bch_err(c, "error recalculating oldest_gen: %i", ret);
 				goto err;
@@ -1153,7 +1334,7 @@ int bch2_gc_gens(struct bch_fs *c)
 		down_read(&ca->bucket_lock);
 		buckets = bucket_array(ca);
 
-		for_each_bucket(g, buckets)
+		for_each_bucket(g, b, buckets)
 			g->oldest_gen = g->gc_gen;
 		up_read(&ca->bucket_lock);
 	}
@@ -1164,6 +1345,127 @@ int bch2_gc_gens(struct bch_fs *c)
 	return ret;
 }
 
+/* Online mark checking: */
+
+/*
+ * Check a key against the live in memory bucket marks: we can't recompute
+ * bucket sector counts without walking everything (that needs the full
+ * bch2_gc()), but we can check everything that's local to a key - that the
+ * bucket's gen, data type and sector count are consistent with each pointer,
+ * and that the key's replicas entry is marked.
+ *
+ * The key's leaf node is read locked while we check it, so marks for the key
+ * itself can't be changing underneath us.
+ */
+static bool gc_check_key_marks(struct bch_fs *c, struct bkey_s_c k)
+{
+	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(k);
+	const union bch_extent_entry *entry;
+	struct extent_ptr_decoded p;
+	const char *err = NULL;
+	char buf[200];
+
+	if (!bch2_bkey_replicas_marked(c, k))
+		err = "replicas entry not marked";
+
+	bkey_for_each_ptr_decode(k.k, ptrs, p, entry) {
+		struct bch_dev *ca = bch_dev_bkey_exists(c, p.ptr.dev);
+		struct bucket_mark m = ptr_bucket_mark(ca, &p.ptr);
+
+		if (err)
+			break;
+
+		if (gen_after(p.ptr.gen, m.gen))
+			err = "pointer gen newer than bucket gen";
+		else if (p.ptr.cached)
+			continue;
+		else if (gen_after(m.gen, p.ptr.gen))
+			err = "stale dirty pointer";
+		else if (m.data_type != BCH_DATA_user)
+			err = "bucket has wrong data type";
+		else if (m.dirty_sectors < ptr_disk_sectors(p))
+			err = "bucket sector count too small";
+	}
+
+	if (err)
+		bch_err_ratelimited(c, "%s: %s", err,
+			(bch2_bkey_val_to_text(&PBUF(buf), c, k), buf));
+
+	return err != NULL;
+}
+
+static int bch2_gc_check_marks_btree(struct bch_fs *c, enum btree_id btree_id,
+				     struct bpos start, struct bpos end,
+				     struct bch_move_stats *stats)
+{
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	unsigned nr = 0;
+	int ret = 0;
+
+	bch2_trans_init(&trans, c, 0, 0);
+
+	stats->btree_id = btree_id;
+
+	iter = bch2_trans_get_iter(&trans, btree_id, start,
+				   BTREE_ITER_PREFETCH);
+
+	down_read(&c->gc_lock);
+
+	while ((k = bch2_btree_iter_peek(iter)).k &&
+	       !(ret = bkey_err(k))) {
+		if (bkey_cmp(bkey_start_pos(k.k), end) >= 0)
+			break;
+
+		if (gc_check_key_marks(c, k))
+			atomic64_inc(&stats->keys_inconsistent);
+
+		stats->pos = iter->pos;
+		atomic64_add(k.k->size, &stats->sectors_seen);
+
+		bch2_btree_iter_next(iter);
+
+		if (!(++nr % GC_GENS_BATCH)) {
+			ret = gc_gens_pause(c, &trans, true);
+			if (ret)
+				break;
+		}
+	}
+
+	up_read(&c->gc_lock);
+
+	bch2_trans_iter_put(&trans, iter);
+	bch2_trans_exit(&trans);
+	return ret;
+}
+
+/*
+ * Incrementally verify bucket marks against the user data in [@start, @end),
+ * without stopping the world - progress is reported via @stats, so an
+ * interrupted check can be resumed from stats->btree_id and stats->pos.
+ *
+ * @start and @end are extents btree positions; reflink btree keys all live at
+ * inode 0, so the whole reflink btree is always checked.
+ *
+ * This only checks, it doesn't repair: inconsistencies are logged and counted
+ * in stats->keys_inconsistent, and need an offline fsck to fix.
+ */
+int bch2_gc_check_marks(struct bch_fs *c, struct bpos start, struct bpos end,
+			struct bch_move_stats *stats)
+{
+	int ret;
+
+	stats->data_type = BCH_DATA_user;
+
+	ret   = bch2_gc_check_marks_btree(c, BTREE_ID_EXTENTS,
+					  start, end, stats) ?:
+		bch2_gc_check_marks_btree(c, BTREE_ID_REFLINK,
+					  POS_MIN, POS_MAX, stats);
+
+	return ret == -EINTR ? 0 : ret;
+}
+
 /* Btree coalescing */
 
 static void recalc_packed_keys(struct btree *b)
@@ -1184,7 +1486,9 @@ static void bch2_coalesce_nodes(struct bch_fs *c, struct btree_iter *iter,
 {
 	struct btree *parent = btree_node_parent(iter, old_nodes[0]);
 	unsigned i, nr_old_nodes, nr_new_nodes, u64s = 0;
-	unsigned blocks = btree_blocks(c) * 2 / 3;
+	unsigned nr_nodes[2] = { 0, 0 };
+	unsigned blocks = (btree_id_node_sectors(c, iter->btree_id) >>
+			   c->block_bits) * 2 / 3;
 	struct btree *new_nodes[GC_MERGE_NODES];
 	struct btree_update *as;
 	struct keylist keylist;
@@ -1229,8 +1533,10 @@ static void bch2_coalesce_nodes(struct bch_fs *c, struct btree_iter *iter,
 		return;
 	}
 
-	as = bch2_btree_update_start(iter->trans, iter->btree_id,
-			btree_update_reserve_required(c, parent) + nr_old_nodes,
+	btree_update_reserve_required(c, parent, nr_nodes);
+	nr_nodes[!!old_nodes[0]->c.level] += nr_old_nodes;
+
+	as = bch2_btree_update_start(iter->trans, iter->btree_id, nr_nodes,
 			BTREE_INSERT_NOFAIL|
 			BTREE_INSERT_USE_RESERVE,
 			NULL);
@@ -1399,13 +1705,18 @@ static void bch2_coalesce_nodes(struct bch_fs *c, struct btree_iter *iter,
 	bch2_keylist_free(&keylist, NULL);
 }
 
-static int bch2_coalesce_btree(struct bch_fs *c, enum btree_id btree_id)
+/*
+ * Coalesces the nodes of @btree_id, starting from the leaf containing @start,
+ * stopping after @max_nodes nodes:
+ */
+static int bch2_coalesce_btree(struct bch_fs *c, enum btree_id btree_id,
+			       struct bpos start, unsigned max_nodes)
 {
 	struct btree_trans trans;
 	struct btree_iter *iter;
 	struct btree *b;
 	bool kthread = (current->flags & PF_KTHREAD) != 0;
-	unsigned i;
+	unsigned i, nr_nodes = 0;
 
 	/* Sliding window of adjacent btree nodes */
 	struct btree *merge[GC_MERGE_NODES];
@@ -1422,7 +1733,7 @@ static int bch2_coalesce_btree(struct bch_fs *c, enum btree_id btree_id)
 	 */
 	memset(merge, 0, sizeof(merge));
 
-	__for_each_btree_node(&trans, iter, btree_id, POS_MIN,
+	__for_each_btree_node(&trans, iter, btree_id, start,
 			      BTREE_MAX_DEPTH, 0,
 			      BTREE_ITER_PREFETCH, b) {
 		memmove(merge + 1, merge,
@@ -1458,6 +1769,9 @@ static int bch2_coalesce_btree(struct bch_fs *c, enum btree_id btree_id)
 			return -ESHUTDOWN;
 		}
 
+		if (++nr_nodes >= max_nodes)
+			break;
+
 		bch2_trans_cond_resched(&trans);
 
 		/*
@@ -1485,18 +1799,206 @@ void bch2_coalesce(struct bch_fs *c)
 
 	for (id = 0; id < BTREE_ID_NR; id++) {
 		int ret = c->btree_roots[id].b
-			? bch2_coalesce_btree(c, id)
+			? bch2_coalesce_btree(c, id, POS_MIN, UINT_MAX)
 			: 0;
 
 		if (ret) {
 			if (ret != -ESHUTDOWN)
 				bch_err(c, "btree coalescing failed: %d", ret);
-			return;
+			goto out;
 		}
 	}
 
 	trace_gc_coalesce_end(c);
+out:
+	up_read(&c->gc_lock);
+}
+
+/*
+ * Background coalescing:
+ *
+ * Foreground merging only merges a node with a sibling once it's down to
+ * BTREE_FOREGROUND_MERGE_THRESHOLD, so deletes can leave a btree full of nodes
+ * that are half empty. Leaf nodes that are less than half full after an update
+ * are noted here, and a rate limited worker coalesces them with their
+ * neighbours - each node at most once per time it's read in:
+ */
+
+#define BTREE_MERGE_BATCH	8
+#define BTREE_MERGE_DELAY	HZ
+
+void bch2_btree_merge_candidate_add(struct bch_fs *c, struct btree *b)
+{
+	/*
+	 * Commits keep coming in while going read only, after the work has
+	 * been cancelled - don't queue it again:
+	 */
+	if (!c->opts.btree_background_merge ||
+	    !test_bit(JOURNAL_REPLAY_DONE, &c->journal.flags) ||
+	    !test_bit(BCH_FS_RW, &c->flags) ||
+	    percpu_ref_is_dying(&c->writes) ||
+	    b->c.level ||
+	    btree_node_merge_candidate(b) ||
+	    b->nr.live_u64s * 2 >= btree_id_max_u64s(c, b->c.btree_id))
+		return;
+
+	spin_lock(&c->btree_merge_lock);
+	if (c->btree_merge_nr < ARRAY_SIZE(c->btree_merge_candidates)) {
+		c->btree_merge_candidates[c->btree_merge_nr++] =
+			(struct btree_merge_candidate) {
+				.btree_id	= b->c.btree_id,
+				.pos		= b->data->min_key,
+			};
+		set_btree_node_merge_candidate(b);
+
+		/* no-op if it's already queued: */
+		queue_delayed_work(system_long_wq, &c->btree_merge_work,
+				   BTREE_MERGE_DELAY);
+	}
+	spin_unlock(&c->btree_merge_lock);
+}
+
+static void bch2_btree_merge_work(struct work_struct *work)
+{
+	struct bch_fs *c = container_of(to_delayed_work(work),
+					struct bch_fs, btree_merge_work);
+	struct btree_merge_candidate m[BTREE_MERGE_BATCH];
+	unsigned i, nr;
+
+	spin_lock(&c->btree_merge_lock);
+	nr = min_t(unsigned, c->btree_merge_nr, ARRAY_SIZE(m));
+	c->btree_merge_nr -= nr;
+	memcpy(m, c->btree_merge_candidates + c->btree_merge_nr,
+	       sizeof(m[0]) * nr);
+	spin_unlock(&c->btree_merge_lock);
+
+	if (!percpu_ref_tryget(&c->writes))
+		return;
+
+	down_read(&c->gc_lock);
+	for (i = 0; i < nr; i++)
+		bch2_coalesce_btree(c, m[i].btree_id, m[i].pos,
+				    GC_MERGE_NODES * 2);
 	up_read(&c->gc_lock);
+
+	percpu_ref_put(&c->writes);
+
+	spin_lock(&c->btree_merge_lock);
+	if (c->btree_merge_nr)
+		queue_delayed_work(system_long_wq, &c->btree_merge_work,
+				   BTREE_MERGE_DELAY);
+	spin_unlock(&c->btree_merge_lock);
+}
+
+void bch2_fs_btree_merge_init(struct bch_fs *c)
+{
+	spin_lock_init(&c->btree_merge_lock);
+	INIT_DELAYED_WORK(&c->btree_merge_work, bch2_btree_merge_work);
+}
+
+/*
+ * Background compaction:
+ *
+ * Inserts only compact a bset once it's a third dead keys - so with deletes
+ * spread out over several bsets, lookups in a leaf can end up skipping over
+ * nearly as many dead keys as live ones until the node is next written. Leaf
+ * nodes where dead keys are a quarter of the node are noted at commit time,
+ * and compacted here instead of on the commit path:
+ */
+
+void bch2_btree_compact_candidate_add(struct bch_fs *c, struct btree *b)
+{
+	/* As with bch2_btree_merge_candidate_add(): */
+	if (!c->opts.btree_background_compact ||
+	    !test_bit(JOURNAL_REPLAY_DONE, &c->journal.flags) ||
+	    !test_bit(BCH_FS_RW, &c->flags) ||
+	    percpu_ref_is_dying(&c->writes) ||
+	    b->c.level ||
+	    btree_node_old_extent_overwrite(b) ||
+	    btree_node_compact_candidate(b) ||
+	    !should_compact_node(b))
+		return;
+
+	spin_lock(&c->btree_compact_lock);
+	if (c->btree_compact_nr < ARRAY_SIZE(c->btree_compact_candidates)) {
+		c->btree_compact_candidates[c->btree_compact_nr++] =
+			(struct btree_merge_candidate) {
+				.btree_id	= b->c.btree_id,
+				.pos		= b->data->min_key,
+			};
+		set_btree_node_compact_candidate(b);
+
+		/* no-op if it's already queued: */
+		queue_delayed_work(system_long_wq, &c->btree_compact_work,
+				   BTREE_MERGE_DELAY);
+	}
+	spin_unlock(&c->btree_compact_lock);
+}
+
+static void bch2_btree_compact_node(struct btree_trans *trans,
+				    enum btree_id id, struct bpos pos)
+{
+	struct bch_fs *c = trans->c;
+	struct btree_iter *iter;
+	struct btree *b;
+
+	iter = bch2_trans_get_node_iter(trans, id, pos, 1, 0, 0);
+
+	if (bch2_btree_iter_traverse(iter))
+		goto out;
+
+	b = bch2_btree_iter_peek_node(iter);
+	if (!b || !btree_node_compact_candidate(b))
+		goto out;
+
+	bch2_btree_node_lock_for_insert(c, b, iter);
+	clear_btree_node_compact_candidate(b);
+
+	if (should_compact_node(b) &&
+	    bch2_compact_whiteouts(c, b, COMPACT_ALL))
+		bch2_btree_iter_reinit_node(iter, b);
+
+	bch2_btree_node_unlock_write(b, iter);
+out:
+	bch2_trans_iter_put(trans, iter);
+}
+
+static void bch2_btree_compact_work(struct work_struct *work)
+{
+	struct bch_fs *c = container_of(to_delayed_work(work),
+					struct bch_fs, btree_compact_work);
+	struct btree_merge_candidate m[BTREE_MERGE_BATCH];
+	struct btree_trans trans;
+	unsigned i, nr;
+
+	spin_lock(&c->btree_compact_lock);
+	nr = min_t(unsigned, c->btree_compact_nr, ARRAY_SIZE(m));
+	c->btree_compact_nr -= nr;
+	memcpy(m, c->btree_compact_candidates + c->btree_compact_nr,
+	       sizeof(m[0]) * nr);
+	spin_unlock(&c->btree_compact_lock);
+
+	if (!percpu_ref_tryget(&c->writes))
+		return;
+
+	bch2_trans_init(&trans, c, 0, 0);
+	for (i = 0; i < nr; i++)
+		bch2_btree_compact_node(&trans, m[i].btree_id, m[i].pos);
+	bch2_trans_exit(&trans);
+
+	percpu_ref_put(&c->writes);
+
+	spin_lock(&c->btree_compact_lock);
+	if (c->btree_compact_nr)
+		queue_delayed_work(system_long_wq, &c->btree_compact_work,
+				   BTREE_MERGE_DELAY);
+	spin_unlock(&c->btree_compact_lock);
+}
+
+void bch2_fs_btree_compact_init(struct bch_fs *c)
+{
+	spin_lock_init(&c->btree_compact_lock);
+	INIT_DELAYED_WORK(&c->btree_compact_work, bch2_btree_compact_work);
 }
 
 static int bch2_gc_thread(void *arg)
@@ -1545,7 +2047,7 @@ static int bch2_gc_thread(void *arg)
 #if 0
 		ret = bch2_gc(c, false, false);
 #else
-		ret = bch2_gc_gens(c);
+		ret = bch2_gc_gens(c, true);
 #endif
 		if (ret < 0)
 			bch_err(c, "btree gc failed: %i", ret);
@@ -5,9 +5,17 @@
 #include "btree_types.h"
 
 void bch2_coalesce(struct bch_fs *);
+void bch2_btree_merge_candidate_add(struct bch_fs *, struct btree *);
+void bch2_fs_btree_merge_init(struct bch_fs *);
+void bch2_btree_compact_candidate_add(struct bch_fs *, struct btree *);
+void bch2_fs_btree_compact_init(struct bch_fs *);
 
 int bch2_gc(struct bch_fs *, bool);
-int bch2_gc_gens(struct bch_fs *);
+int bch2_gc_gens(struct bch_fs *, bool);
+
+struct bch_move_stats;
+int bch2_gc_check_marks(struct bch_fs *, struct bpos, struct bpos,
+			struct bch_move_stats *);
 void bch2_gc_thread_stop(struct bch_fs *);
 int bch2_gc_thread_start(struct bch_fs *);
 void bch2_mark_dev_superblock(struct bch_fs *, struct bch_dev *, unsigned);
@@ -11,6 +11,7 @@
 #include "btree_update_interior.h"
 #include "buckets.h"
 #include "checksum.h"
+#include "compress.h"
 #include "debug.h"
 #include "error.h"
 #include "extents.h"
@@ -234,6 +235,7 @@ static bool bch2_compact_extent_whiteouts(struct bch_fs *c,
 					sizeof(u64));
 				i = &dst->keys;
 				set_btree_bset(b, t, i);
+				bch2_bset_invalidate_aux_tree(b, t);
 			}
 			continue;
 		}
@@ -278,7 +280,7 @@ static bool bch2_compact_extent_whiteouts(struct bch_fs *c,
 
 		i->u64s = cpu_to_le16((u64 *) out - i->_data);
 		set_btree_bset_end(b, t);
-		bch2_bset_set_no_aux_tree(b, t);
+		bch2_bset_invalidate_aux_tree(b, t);
 	}
 
 	b->whiteout_u64s = (u64 *) u_pos - (u64 *) whiteouts;
@@ -340,6 +342,7 @@ static bool bch2_drop_whiteouts(struct btree *b, enum compact_mode mode)
 					sizeof(u64));
 				i = &dst->keys;
 				set_btree_bset(b, t, i);
+				bch2_bset_invalidate_aux_tree(b, t);
 			}
 			continue;
 		}
@@ -368,7 +371,7 @@ static bool bch2_drop_whiteouts(struct btree *b, enum compact_mode mode)
 
 		i->u64s = cpu_to_le16((u64 *) out - i->_data);
 		set_btree_bset_end(b, t);
-		bch2_bset_set_no_aux_tree(b, t);
+		bch2_bset_invalidate_aux_tree(b, t);
 		ret = true;
 	}
 
@@ -620,7 +623,11 @@ static void btree_err_msg(struct printbuf *out, struct bch_fs *c,
 	pr_buf(out, "at btree ");
 	btree_pos_to_text(out, c, b);
 
-	pr_buf(out, "\n  node offset %u", b->written);
+	/* When reading, bsets are validated ahead of b->written: */
+	if (!write && i)
+		offset = ((void *) i - (void *) b->data) >> 9;
+
+	pr_buf(out, "\n  node offset %u", offset);
 	if (i)
 		pr_buf(out, " bset u64s %u", le16_to_cpu(i->u64s));
 }
@@ -710,7 +717,14 @@ static int validate_bset(struct bch_fs *c, struct bch_dev *ca,
 		     BTREE_ERR_FATAL, c, ca, b, i,
 		     "unsupported bset version");
 
-	if (btree_err_on(b->written + sectors > c->opts.btree_node_size,
+	/*
+	 * We write up to this btree's node size (b->node_sectors, see
+	 * BCH_SB_FIELD_btree_node_size) - but nodes being read may have been
+	 * written before it was reduced, so they can go up to btree_node_size:
+	 */
+	if (btree_err_on(b->written + sectors > (write
+				? b->node_sectors
+				: c->opts.btree_node_size),
 			 BTREE_ERR_FIXABLE, c, ca, b, i,
 			 "bset past end of btree node")) {
 		i->u64s = 0;
@@ -907,6 +921,115 @@ static int validate_bset_keys(struct bch_fs *c, struct btree *b,
 	return ret;
 }
 
+/*
+ * A compressed bset still takes up its uncompressed size in the node, so the
+ * next bset is somewhere after the compressed data - find it, so that we don't
+ * uncompress over it:
+ */
+static unsigned next_bset_offset(struct bch_fs *c, struct btree *b,
+				 unsigned offset)
+{
+	struct btree_node_entry *bne;
+
+	for (;
+	     offset < btree_bytes(c);
+	     offset += block_bytes(c)) {
+		bne = (void *) b->data + offset;
+		if (bne->keys.seq == b->data->keys.seq)
+			break;
+	}
+
+	return min_t(unsigned, offset, btree_bytes(c));
+}
+
+static int bset_uncompress(struct bch_fs *c, struct bch_dev *ca,
+			   struct btree *b, struct bset *i,
+			   unsigned sectors, bool have_retry)
+{
+	struct bset_compressed *h = (void *) i->_data;
+	unsigned compressed_bytes = le32_to_cpu(h->compressed_bytes);
+	unsigned bytes = le16_to_cpu(h->u64s) * sizeof(u64);
+	unsigned end = next_bset_offset(c, b, (b->written + sectors) << 9);
+	bool used_mempool = false;
+	void *buf = NULL;
+	int ret = 0, write = READ;
+
+	btree_err_on(!(c->sb.features & (1ULL << BCH_FEATURE_btree_node_compression)),
+		     BTREE_ERR_FATAL, c, ca, b, i,
+		     "compressed bset, but btree_node_compression feature not set");
+
+	btree_err_on(sizeof(*h) + compressed_bytes > vstruct_bytes(i) - sizeof(*i),
+		     BTREE_ERR_MUST_RETRY, c, ca, b, i,
+		     "compressed size past end of bset");
+
+	btree_err_on((void *) i->_data + bytes > (void *) b->data + end,
+		     BTREE_ERR_MUST_RETRY, c, ca, b, i,
+		     "uncompressed bset overlaps next bset");
+
+	buf = btree_bounce_alloc(c, btree_bytes(c), &used_mempool);
+
+	btree_err_on(bch2_uncompress_buf(c, BSET_COMPRESSION_TYPE(i),
+					 h->data, compressed_bytes,
+					 buf, bytes),
+		     BTREE_ERR_MUST_RETRY, c, ca, b, i,
+		     "decompression error");
+
+	memcpy(i->_data, buf, bytes);
+	i->u64s = h->u64s;
+	SET_BSET_COMPRESSION_TYPE(i, 0);
+fsck_err:
+	if (buf)
+		btree_bounce_free(c, btree_bytes(c), used_mempool, buf);
+	return ret;
+}
+
+/*
+ * Validating keys is the expensive part of reading a btree node, and bsets are
+ * independent once we've found where they start - so large bsets are validated
+ * on btree_read_complete_wq while we checksum the rest of the node.
+ *
+ * We never just wait on a queued bset: if it hasn't started yet we cancel it and
+ * validate it ourselves, so this can't deadlock when called from
+ * btree_read_complete_wq itself, or stall behind a busy workqueue.
+ */
+#define BTREE_READ_BSET_PARALLEL_U64S	(1U << 11)
+
+static void btree_read_bset_validate(struct btree_read_bset *s)
+{
+	s->ret = validate_bset_keys(s->c, s->b, s->i, &s->whiteout_u64s,
+				    READ, s->have_retry);
+	SET_BSET_BIG_ENDIAN(s->i, CPU_BIG_ENDIAN);
+}
+
+static void btree_read_bset_work(struct work_struct *work)
+{
+	btree_read_bset_validate(container_of(work, struct btree_read_bset, work));
+}
+
+static void btree_read_bset_start(struct btree_read_bset *s)
+{
+	if (le16_to_cpu(s->i->u64s) < BTREE_READ_BSET_PARALLEL_U64S) {
+		btree_read_bset_validate(s);
+		return;
+	}
+
+	INIT_WORK(&s->work, btree_read_bset_work);
+	s->queued = true;
+	queue_work(s->c->btree_read_complete_wq, &s->work);
+}
+
+static void btree_read_bsets_wait(struct btree_read_bset *sets, unsigned nr)
+{
+	struct btree_read_bset *s;
+
+	for (s = sets; s < sets + nr; s++)
+		if (s->queued) {
+			if (cancel_work_sync(&s->work))
+				btree_read_bset_validate(s);
+			s->queued = false;
+		}
+}
+
 int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
 			      struct btree *b, bool have_retry)
 {
@@ -915,15 +1038,18 @@ int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
 	struct btree_node *sorted;
 	struct bkey_packed *k;
 	struct bch_extent_ptr *ptr;
+	struct btree_read_bset *sets, *s;
 	struct bset *i;
 	bool used_mempool, blacklisted;
-	unsigned u64s;
+	unsigned u64s, nr_sets = 0;
 	int ret, retry_read = 0, write = READ;
 
 	iter = mempool_alloc(&c->fill_iter, GFP_NOIO);
 	sort_iter_init(iter, b);
 	iter->size = (btree_blocks(c) + 1) * 2;
 
+	sets = mempool_alloc(&c->btree_read_bsets, GFP_NOIO);
+
 	if (bch2_meta_read_fault("btree"))
 		btree_err(BTREE_ERR_MUST_RETRY, c, ca, b, NULL,
 			  "dynamic fault");
@@ -947,7 +1073,7 @@ int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
 	}
 
 	while (b->written < c->opts.btree_node_size) {
-		unsigned sectors, whiteout_u64s = 0;
+		unsigned sectors;
 		struct nonce nonce;
 		struct bch_csum csum;
 		bool first = !b->written;
@@ -1000,6 +1126,16 @@ int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
 			sectors = vstruct_sectors(bne, c->block_bits);
 		}
 
+		if (BSET_COMPRESSION_TYPE(i)) {
+			ret = bset_uncompress(c, ca, b, i, sectors, have_retry);
+			if (ret)
+				goto fsck_err;
+
+			sectors = first
+				? vstruct_sectors(b->data, c->block_bits)
+				: vstruct_sectors(bne, c->block_bits);
+		}
+
 		ret = validate_bset(c, ca, b, i, sectors,
 				    READ, have_retry);
 		if (ret)
@@ -1008,12 +1144,14 @@ int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
 		if (!b->written)
 			btree_node_set_format(b, b->data->format);
 
-		ret = validate_bset_keys(c, b, i, &whiteout_u64s,
-				    READ, have_retry);
-		if (ret)
-			goto fsck_err;
+		s = sets + nr_sets++;
+		memset(s, 0, sizeof(*s));
+		s->c		= c;
+		s->b		= b;
+		s->i		= i;
+		s->have_retry	= have_retry;
 
-		SET_BSET_BIG_ENDIAN(i, CPU_BIG_ENDIAN);
+		btree_read_bset_start(s);
 
 		b->written += sectors;
 
@@ -1024,17 +1162,36 @@ int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
 		btree_err_on(blacklisted && first,
 			     BTREE_ERR_FIXABLE, c, ca, b, i,
 			     "first btree node bset has blacklisted journal seq");
-		if (blacklisted && !first)
+		s->blacklisted = blacklisted && !first;
+	}
+
+	btree_read_bsets_wait(sets, nr_sets);
+
+	for (s = sets; s < sets + nr_sets; s++) {
+		ret = s->ret;
+		if (ret)
+			goto fsck_err;
+
+		if (s->blacklisted)
 			continue;
 
+		i = s->i;
+
 		sort_iter_add(iter, i->start,
-			      vstruct_idx(i, whiteout_u64s));
+			      vstruct_idx(i, s->whiteout_u64s));
 
 		sort_iter_add(iter,
-			      vstruct_idx(i, whiteout_u64s),
+			      vstruct_idx(i, s->whiteout_u64s),
 			      vstruct_last(i));
 	}
 
+	/*
+	 * Nodes written before this btree's node size was reduced may be bigger
+	 * than it - they'll be split on the next insert that doesn't fit:
+	 */
+	b->node_sectors = max_t(unsigned, b->written,
+				btree_id_node_sectors(c, b->c.btree_id));
+
 	for (bne = write_block(b);
 	     bset_byte_offset(b, bne) < btree_bytes(c);
 	     bne = (void *) bne + block_bytes(c))
@@ -1108,6 +1265,8 @@ int bch2_btree_node_read_done(struct bch_fs *c, struct bch_dev *ca,
 			set_btree_node_need_rewrite(b);
 	}
 out:
+	btree_read_bsets_wait(sets, nr_sets);
+	mempool_free(sets, &c->btree_read_bsets);
 	mempool_free(iter, &c->fill_iter);
 	return retry_read;
 fsck_err:
@@ -1189,10 +1348,10 @@ static void btree_node_read_endio(struct bio *bio)
 
 	if (rb->have_ioref) {
 		struct bch_dev *ca = bch_dev_bkey_exists(c, rb->pick.ptr.dev);
-		bch2_latency_acct(ca, rb->start_time, READ);
+		bch2_latency_acct(ca, rb->start_time, READ, BCH_DATA_btree);
 	}
 
-	queue_work(system_unbound_wq, &rb->work);
+	queue_work(c->btree_read_complete_wq, &rb->work);
 }
 
 void bch2_btree_node_read(struct bch_fs *c, struct btree *b,
@@ -1236,10 +1395,13 @@ void bch2_btree_node_read(struct bch_fs *c, struct btree *b,
 	if (rb->have_ioref) {
 		this_cpu_add(ca->io_done->sectors[READ][BCH_DATA_btree],
 			     bio_sectors(bio));
+		bch2_dev_io_start(ca, READ, BCH_DATA_btree);
 		bio_set_dev(bio, ca->disk_sb.bdev);
 
 		if (sync) {
 			submit_bio_wait(bio);
+			/* submit_bio_wait() bypasses btree_node_read_endio(): */
+			bch2_latency_acct(ca, rb->start_time, READ, BCH_DATA_btree);
 
 			bio->bi_private	= b;
 			btree_node_read_work(&rb->work);
@@ -1252,13 +1414,19 @@ void bch2_btree_node_read(struct bch_fs *c, struct btree *b,
 		if (sync)
 			btree_node_read_work(&rb->work);
 		else
-			queue_work(system_unbound_wq, &rb->work);
+			queue_work(c->btree_read_complete_wq, &rb->work);
 
 	}
 }
 
-int bch2_btree_root_read(struct bch_fs *c, enum btree_id id,
-			const struct bkey_i *k, unsigned level)
+/*
+ * Btree roots are read in two halves, so that at mount time all the root reads
+ * can be in flight at once: bch2_btree_root_read_start() issues the read and
+ * returns the new node, locked, and bch2_btree_root_read_finish() waits for it
+ * and makes it the root:
+ */
+struct btree *bch2_btree_root_read_start(struct bch_fs *c, enum btree_id id,
+					 const struct bkey_i *k, unsigned level)
 {
 	struct closure cl;
 	struct btree *b;
@@ -1271,7 +1439,7 @@ int bch2_btree_root_read(struct bch_fs *c, enum btree_id id,
 		closure_sync(&cl);
 	} while (ret);
 
-	b = bch2_btree_node_mem_alloc(c);
+	b = bch2_btree_node_mem_alloc(c, level != 0);
 	bch2_btree_cache_cannibalize_unlock(c);
 
 	BUG_ON(IS_ERR(b));
@@ -1279,7 +1447,16 @@ int bch2_btree_root_read(struct bch_fs *c, enum btree_id id,
 	bkey_copy(&b->key, k);
 	BUG_ON(bch2_btree_node_hash_insert(&c->btree_cache, b, level, id));
 
-	bch2_btree_node_read(c, b, true);
+	bch2_btree_node_read(c, b, false);
+	return b;
+}
+
+int bch2_btree_root_read_finish(struct bch_fs *c, struct btree *b)
+{
+	int ret = 0;
+
+	wait_on_bit_io(&b->flags, BTREE_NODE_read_in_flight,
+		       TASK_UNINTERRUPTIBLE);
 
 	if (btree_node_read_error(b)) {
 		bch2_btree_node_hash_remove(&c->btree_cache, b);
@@ -1300,6 +1477,13 @@ int bch2_btree_root_read(struct bch_fs *c, enum btree_id id,
 	return ret;
 }
 
+int bch2_btree_root_read(struct bch_fs *c, enum btree_id id,
+			const struct bkey_i *k, unsigned level)
+{
+	return bch2_btree_root_read_finish(c,
+			bch2_btree_root_read_start(c, id, k, level));
+}
+
 void bch2_btree_complete_write(struct bch_fs *c, struct btree *b,
 			      struct btree_write *w)
 {
@@ -1437,7 +1621,7 @@ static void btree_node_write_endio(struct bio *bio)
 	unsigned long flags;
 
 	if (wbio->have_ioref)
-		bch2_latency_acct(ca, wbio->submit_time, WRITE);
+		bch2_latency_acct(ca, wbio->submit_time, WRITE, BCH_DATA_btree);
 
 	if (bch2_dev_io_err_on(bio->bi_status, ca, "btree write error: %s",
 			       bch2_blk_status_to_str(bio->bi_status)) ||
@@ -1481,6 +1665,53 @@ static int validate_bset_for_write(struct bch_fs *c, struct btree *b,
 	return ret;
 }
 
+/*
+ * Compress the keys of a bset we're about to write, if that saves at least one
+ * block - the bset still takes up its uncompressed size in the btree node, the
+ * next bset goes where it would have without compression.
+ *
+ * Returns the number of bytes to write:
+ */
+static unsigned bset_compress(struct bch_fs *c, void *data, struct bset *i,
+			      unsigned compression_type,
+			      unsigned bytes_to_write)
+{
+	struct bset_compressed *h = (void *) i->_data;
+	unsigned src_bytes = le16_to_cpu(i->u64s) * sizeof(u64);
+	unsigned hdr_bytes = (void *) h->data - data;
+	unsigned max_bytes = round_up(bytes_to_write, block_bytes(c)) -
+		block_bytes(c);
+	size_t dst_bytes;
+	bool used_mempool;
+	void *buf;
+
+	if (max_bytes <= hdr_bytes)
+		return bytes_to_write;
+
+	buf = btree_bounce_alloc(c, src_bytes, &used_mempool);
+
+	dst_bytes = bch2_compress_buf(c, compression_type,
+				      i->_data, src_bytes,
+				      buf, max_bytes - hdr_bytes);
+	if (dst_bytes) {
+		h->compressed_bytes	= cpu_to_le32(dst_bytes);
+		h->u64s			= i->u64s;
+		h->pad			= 0;
+		memcpy(h->data, buf, dst_bytes);
+
+		i->u64s = cpu_to_le16(DIV_ROUND_UP(sizeof(*h) + dst_bytes,
+						   sizeof(u64)));
+		memset(h->data + dst_bytes, 0,
+		       (void *) vstruct_end(i) - (void *) (h->data + dst_bytes));
+		SET_BSET_COMPRESSION_TYPE(i, compression_type);
+
+		bytes_to_write = vstruct_end(i) - data;
+	}
+
+	btree_bounce_free(c, src_bytes, used_mempool, buf);
+	return bytes_to_write;
+}
+
 void __bch2_btree_node_write(struct bch_fs *c, struct btree *b,
 			    enum six_lock_type lock_type_held)
 {
@@ -1493,7 +1724,9 @@ void __bch2_btree_node_write(struct bch_fs *c, struct btree *b,
 	struct bch_extent_ptr *ptr;
 	struct sort_iter sort_iter;
 	struct nonce nonce;
-	unsigned bytes_to_write, sectors_to_write, bytes, u64s;
+	unsigned bytes_to_write, sectors_to_write, disk_sectors, bytes, u64s;
+	unsigned compression_type =
+		bch2_compression_opt_to_type[c->opts.metadata_compression];
 	u64 seq = 0;
 	bool used_mempool;
 	unsigned long old, new;
@@ -1541,7 +1774,7 @@ void __bch2_btree_node_write(struct bch_fs *c, struct btree *b,
 	BUG_ON(btree_node_fake(b));
 	BUG_ON((b->will_make_reachable != 0) != !b->written);
 
-	BUG_ON(b->written >= c->opts.btree_node_size);
+	BUG_ON(b->written >= b->node_sectors);
 	BUG_ON(b->written & (c->opts.block_size - 1));
 	BUG_ON(bset_written(b, btree_bset_last(b)));
 	BUG_ON(le64_to_cpu(b->data->magic) != bset_magic(c));
@@ -1619,10 +1852,7 @@ void __bch2_btree_node_write(struct bch_fs *c, struct btree *b,
 	bytes_to_write = vstruct_end(i) - data;
 	sectors_to_write = round_up(bytes_to_write, block_bytes(c)) >> 9;
 
-	memset(data + bytes_to_write, 0,
-	       (sectors_to_write << 9) - bytes_to_write);
-
-	BUG_ON(b->written + sectors_to_write > c->opts.btree_node_size);
+	BUG_ON(b->written + sectors_to_write > b->node_sectors);
 	BUG_ON(BSET_BIG_ENDIAN(i) != CPU_BIG_ENDIAN);
 	BUG_ON(i->seq != b->data->keys.seq);
 
@@ -1630,6 +1860,7 @@ void __bch2_btree_node_write(struct bch_fs *c, struct btree *b,
 		? cpu_to_le16(BCH_BSET_VERSION_OLD)
 		: cpu_to_le16(c->sb.version);
 	SET_BSET_CSUM_TYPE(i, bch2_meta_checksum_type(c));
+	SET_BSET_COMPRESSION_TYPE(i, 0);
 
 	if (bch2_csum_type_is_encryption(BSET_CSUM_TYPE(i)))
 		validate_before_checksum = true;
@@ -1638,11 +1869,24 @@ void __bch2_btree_node_write(struct bch_fs *c, struct btree *b,
 	if (le16_to_cpu(i->version) <= bcachefs_metadata_version_inode_btree_change)
 		validate_before_checksum = true;
 
+	/* can't validate after compressing: */
+	if (compression_type)
+		validate_before_checksum = true;
+
 	/* if we're going to be encrypting, check metadata validity first: */
 	if (validate_before_checksum &&
 	    validate_bset_for_write(c, b, i, sectors_to_write))
 		goto err;
 
+	if (compression_type)
+		bytes_to_write = bset_compress(c, data, i, compression_type,
+					       bytes_to_write);
+
+	disk_sectors = round_up(bytes_to_write, block_bytes(c)) >> 9;
+
+	memset(data + bytes_to_write, 0,
+	       (disk_sectors << 9) - bytes_to_write);
+
 	bset_encrypt(c, i, b->written << 9);
 
 	nonce = btree_nonce(i, b->written << 9);
@@ -1679,10 +1923,10 @@ void __bch2_btree_node_write(struct bch_fs *c, struct btree *b,
 	    c->opts.nochanges)
 		goto err;
 
-	trace_btree_write(b, bytes_to_write, sectors_to_write);
+	trace_btree_write(b, bytes_to_write, disk_sectors);
 
 	wbio = container_of(bio_alloc_bioset(GFP_NOIO,
-				buf_pages(data, sectors_to_write << 9),
+				buf_pages(data, disk_sectors << 9),
 				&c->btree_bio),
 			    struct btree_write_bio, wbio.bio);
 	wbio_init(&wbio->wbio.bio);
@@ -1693,7 +1937,7 @@ void __bch2_btree_node_write(struct bch_fs *c, struct btree *b,
 	wbio->wbio.bio.bi_end_io	= btree_node_write_endio;
 	wbio->wbio.bio.bi_private	= b;
 
-	bch2_bio_map(&wbio->wbio.bio, data, sectors_to_write << 9);
+	bch2_bio_map(&wbio->wbio.bio, data, disk_sectors << 9);
 
 	/*
 	 * If we're appending to a leaf node, we don't technically need FUA -
@@ -40,6 +40,22 @@ struct btree_read_bio {
 	struct bio		bio;
 };
 
+/*
+ * bch2_btree_node_read_done() validates the keys in large bsets in parallel,
+ * on btree_read_complete_wq:
+ */
+struct btree_read_bset {
+	struct work_struct	work;
+	struct bch_fs		*c;
+	struct btree		*b;
+	struct bset		*i;
+	unsigned		whiteout_u64s;
+	int			ret;
+	unsigned		have_retry:1;
+	unsigned		queued:1;
+	unsigned		blacklisted:1;
+};
+
 struct btree_write_bio {
 	struct work_struct	work;
 	void			*data;
@@ -89,6 +105,32 @@ static inline bool should_compact_bset_lazy(struct btree *b,
 	return dead_u64s > 64 && dead_u64s * 3 > total_u64s;
 }
 
+/*
+ * Deleted and overwritten keys still taking up space in the node's bsets, that
+ * lookups have to skip over:
+ */
+static inline unsigned btree_node_dead_u64s(struct btree *b)
+{
+	struct bset_tree *t;
+	unsigned dead_u64s = 0;
+
+	for_each_bset(b, t)
+		dead_u64s += bset_dead_u64s(b, t);
+
+	return dead_u64s;
+}
+
+/*
+ * Lazy compaction only looks at one bset at a time - this looks at the whole
+ * node, for background compaction:
+ */
+static inline bool should_compact_node(struct btree *b)
+{
+	unsigned dead_u64s = btree_node_dead_u64s(b);
+
+	return dead_u64s > 64 && dead_u64s * 4 > b->nr.live_u64s + dead_u64s;
+}
+
 static inline bool bch2_maybe_compact_whiteouts(struct bch_fs *c, struct btree *b)
 {
 	struct bset_tree *t;
@@ -137,6 +179,9 @@ void bch2_btree_init_next(struct bch_fs *, struct btree *,
 int bch2_btree_node_read_done(struct bch_fs *, struct bch_dev *,
 			      struct btree *, bool);
 void bch2_btree_node_read(struct bch_fs *, struct btree *, bool);
+struct btree *bch2_btree_root_read_start(struct bch_fs *, enum btree_id,
+					 const struct bkey_i *, unsigned);
+int bch2_btree_root_read_finish(struct bch_fs *, struct btree *);
 int bch2_btree_root_read(struct bch_fs *, enum btree_id,
 			 const struct bkey_i *, unsigned);
 
@@ -12,6 +12,7 @@
 #include "extents.h"
 #include "journal.h"
 
+#include <linux/hash.h>
 #include <linux/prefetch.h>
 #include <trace/events/bcachefs.h>
 
@@ -76,11 +77,19 @@ void __bch2_btree_node_lock_write(struct btree *b, struct btree_iter *iter)
 	 * goes to 0, and it's safe because we have the node intent
 	 * locked:
 	 */
-	atomic64_sub(__SIX_VAL(read_lock, readers),
-		     &b->c.lock.state.counter);
+	if (!b->c.lock.readers)
+		atomic64_sub(__SIX_VAL(read_lock, readers),
+			     &b->c.lock.state.counter);
+	else
+		this_cpu_sub(*b->c.lock.readers, readers);
+
 	btree_node_lock_type(iter->trans->c, b, SIX_LOCK_write);
-	atomic64_add(__SIX_VAL(read_lock, readers),
-		     &b->c.lock.state.counter);
+
+	if (!b->c.lock.readers)
+		atomic64_add(__SIX_VAL(read_lock, readers),
+			     &b->c.lock.state.counter);
+	else
+		this_cpu_add(*b->c.lock.readers, readers);
 }
 
 bool __bch2_btree_node_relock(struct btree_iter *iter, unsigned level)
@@ -98,6 +107,7 @@ bool __bch2_btree_node_relock(struct btree_iter *iter, unsigned level)
 	    (btree_node_lock_seq_matches(iter, b, level) &&
 	     btree_node_lock_increment(iter->trans, b, level, want))) {
 		mark_btree_node_locked(iter, level, want);
+		btree_node_set_intent_ip(iter->trans, b, want);
 		return true;
 	} else {
 		return false;
@@ -133,6 +143,7 @@ static bool bch2_btree_node_upgrade(struct btree_iter *iter, unsigned level)
 	return false;
 success:
 	mark_btree_node_intent_locked(iter, level);
+	btree_node_set_intent_ip(iter->trans, b, SIX_LOCK_intent);
 	return true;
 }
 
@@ -204,6 +215,7 @@ bool __bch2_btree_node_lock(struct btree *b, struct bpos pos,
 	struct btree_trans *trans = iter->trans;
 	struct btree_iter *linked, *deadlock_iter = NULL;
 	u64 start_time = local_clock();
+	unsigned long holder_ip;
 	unsigned reason = 9;
 
 	/* Check if it's safe to block: */
@@ -301,6 +313,8 @@ bool __bch2_btree_node_lock(struct btree *b, struct bpos pos,
 	}
 
 	if (unlikely(deadlock_iter)) {
+		bch2_trans_restart_record(iter->trans,
+				BCH_TRANS_RESTART_would_deadlock);
 		trace_trans_restart_would_deadlock(iter->trans->ip, ip,
 				reason,
 				deadlock_iter->btree_id,
@@ -313,11 +327,14 @@ bool __bch2_btree_node_lock(struct btree *b, struct bpos pos,
 	if (six_trylock_type(&b->c.lock, type))
 		return true;
 
+	holder_ip = btree_node_lock_holder_ip(b, type);
+
 	if (six_lock_type(&b->c.lock, type, should_sleep_fn, p))
 		return false;
 
 	bch2_time_stats_update(&trans->c->times[lock_to_time_stat(type)],
 			       start_time);
+	bch2_btree_lock_contended(trans->c, &b->c, type, holder_ip, start_time);
 	return true;
 }
 
@@ -328,7 +345,7 @@ static void bch2_btree_iter_verify_locks(struct btree_iter *iter)
 {
 	unsigned l;
 
-	if (!(iter->trans->iters_linked & (1ULL << iter->idx))) {
+	if (!test_bit(iter->idx, iter->trans->iters_linked)) {
 		BUG_ON(iter->nodes_locked);
 		return;
 	}
@@ -347,6 +364,9 @@ void bch2_btree_trans_verify_locks(struct btree_trans *trans)
 {
 	struct btree_iter *iter;
 
+	if (!bch2_verify_sample(btree_trans_locks))
+		return;
+
 	trans_for_each_iter(trans, iter)
 		bch2_btree_iter_verify_locks(iter);
 }
@@ -470,6 +490,43 @@ void bch2_trans_unlock(struct btree_trans *trans)
 
 /* Btree iterator: */
 
+/*
+ * Point lookups at positions the leaf's Bloom filters rule out don't initialize
+ * the leaf node iterator - it's initialized on first use:
+ */
+static inline bool btree_iter_may_defer_node_iter(struct btree_iter *iter)
+{
+	return (iter->flags & (BTREE_ITER_TYPE|
+			       BTREE_ITER_SLOTS|
+			       BTREE_ITER_INTENT|
+			       BTREE_ITER_KEEP_UNTIL_COMMIT|
+			       BTREE_ITER_IS_EXTENTS)) ==
+		(BTREE_ITER_KEYS|BTREE_ITER_SLOTS);
+}
+
+static inline bool btree_iter_node_iter_deferred(struct btree_iter *iter,
+						 struct btree_iter_level *l)
+{
+	return unlikely(iter->flags & BTREE_ITER_NODE_ITER_DEFERRED) &&
+		l == &iter->l[0];
+}
+
+static inline void btree_iter_node_iter_resolve(struct btree_iter *iter,
+						struct btree_iter_level *l)
+{
+	if (btree_iter_node_iter_deferred(iter, l)) {
+		struct bpos pos = btree_iter_search_key(iter);
+
+		iter->flags &= ~BTREE_ITER_NODE_ITER_DEFERRED;
+		bch2_btree_node_iter_init(&l->iter, l->b, &pos);
+	}
+}
+
+void bch2_btree_iter_node_iter_resolve(struct btree_iter *iter)
+{
+	btree_iter_node_iter_resolve(iter, &iter->l[0]);
+}
+
 #ifdef CONFIG_BCACHEFS_DEBUG
 
 static void bch2_btree_iter_verify_cached(struct btree_iter *iter)
@@ -521,8 +578,9 @@ static void bch2_btree_iter_verify_level(struct btree_iter *iter,
 	/*
 	 * node iterators don't use leaf node iterator:
 	 */
-	if (btree_iter_type(iter) == BTREE_ITER_NODES &&
-	    level <= iter->min_depth)
+	if ((btree_iter_type(iter) == BTREE_ITER_NODES &&
+	     level <= iter->min_depth) ||
+	    btree_iter_node_iter_deferred(iter, l))
 		goto unlock;
 
 	bch2_btree_node_iter_verify(&l->iter, l->b);
@@ -582,6 +640,9 @@ static void bch2_btree_iter_verify(struct btree_iter *iter)
 
 	bch2_btree_trans_verify_locks(iter->trans);
 
+	if (!bch2_verify_sample(btree_iter))
+		return;
+
 	for (i = 0; i < BTREE_MAX_DEPTH; i++)
 		bch2_btree_iter_verify_level(iter, i);
 }
@@ -590,7 +651,8 @@ void bch2_btree_trans_verify_iters(struct btree_trans *trans, struct btree *b)
 {
 	struct btree_iter *iter;
 
-	if (!bch2_debug_check_iterators)
+	if (!bch2_debug_check_iterators ||
+	    !bch2_verify_sample(btree_iter))
 		return;
 
 	trans_for_each_iter_with_node(trans, b, iter)
@@ -628,6 +690,11 @@ static void __bch2_btree_iter_fix_key_modified(struct btree_iter *iter,
 	struct btree_iter_level *l = &iter->l[b->c.level];
 	struct bpos pos = btree_iter_search_key(iter);
 
+	if (btree_iter_node_iter_deferred(iter, l)) {
+		btree_iter_set_dirty(iter, BTREE_ITER_NEED_PEEK);
+		return;
+	}
+
 	if (where != bch2_btree_node_iter_peek_all(&l->iter, l->b))
 		return;
 
@@ -668,6 +735,13 @@ static void __bch2_btree_node_iter_fix(struct btree_iter *iter,
 		orig_iter_pos <= offset + clobber_u64s;
 	struct bpos iter_pos = btree_iter_search_key(iter);
 
+	/* Will be initialized after the update, when it's next used: */
+	if (node_iter == &iter->l[0].iter &&
+	    btree_iter_node_iter_deferred(iter, &iter->l[0])) {
+		btree_iter_set_dirty(iter, BTREE_ITER_NEED_PEEK);
+		return;
+	}
+
 	btree_node_iter_for_each(node_iter, set)
 		if (set->end == old_end)
 			goto found;
@@ -803,6 +877,7 @@ static inline struct bkey_s_c __btree_iter_peek_all(struct btree_iter *iter,
 						    struct btree_iter_level *l,
 						    struct bkey *u)
 {
+	btree_iter_node_iter_resolve(iter, l);
 	return __btree_iter_unpack(iter, l, u,
 			bch2_btree_node_iter_peek_all(&l->iter, l->b));
 }
@@ -810,6 +885,7 @@ static inline struct bkey_s_c __btree_iter_peek_all(struct btree_iter *iter,
 static inline struct bkey_s_c __btree_iter_peek(struct btree_iter *iter,
 						struct btree_iter_level *l)
 {
+	btree_iter_node_iter_resolve(iter, l);
 	return __btree_iter_unpack(iter, l, &iter->k,
 			bch2_btree_node_iter_peek(&l->iter, l->b));
 }
@@ -817,6 +893,7 @@ static inline struct bkey_s_c __btree_iter_peek(struct btree_iter *iter,
 static inline struct bkey_s_c __btree_iter_prev(struct btree_iter *iter,
 						struct btree_iter_level *l)
 {
+	btree_iter_node_iter_resolve(iter, l);
 	return __btree_iter_unpack(iter, l, &iter->k,
 			bch2_btree_node_iter_prev(&l->iter, l->b));
 }
@@ -829,6 +906,8 @@ static inline bool btree_iter_advance_to_pos(struct btree_iter *iter,
 	struct bkey_packed *k;
 	int nr_advanced = 0;
 
+	btree_iter_node_iter_resolve(iter, l);
+
 	while ((k = bch2_btree_node_iter_peek_all(&l->iter, l->b)) &&
 	       bkey_iter_pos_cmp(l->b, k, &pos) < 0) {
 		if (max_advance > 0 && nr_advanced >= max_advance)
@@ -896,6 +975,17 @@ static inline void __btree_iter_init(struct btree_iter *iter,
 	struct bpos pos = btree_iter_search_key(iter);
 	struct btree_iter_level *l = &iter->l[level];
 
+	if (!level) {
+		iter->flags &= ~BTREE_ITER_NODE_ITER_DEFERRED;
+
+		if (btree_iter_may_defer_node_iter(iter) &&
+		    !bch2_btree_node_maybe_contains(l->b, pos)) {
+			iter->flags |= BTREE_ITER_NODE_ITER_DEFERRED;
+			btree_iter_set_dirty(iter, BTREE_ITER_NEED_PEEK);
+			return;
+		}
+	}
+
 	bch2_btree_node_iter_init(&l->iter, l->b, &pos);
 
 	/*
@@ -1037,22 +1127,147 @@ static inline int btree_iter_lock_root(struct btree_iter *iter,
 	}
 }
 
+/* Lockless traversal, see bch2_btree_node_lockless_table_update(): */
+
+static inline u32 btree_node_seq_read(struct btree *b)
+{
+	union six_lock_state s = { .v = READ_ONCE(b->c.lock.state.v) };
+
+	smp_rmb();
+	return s.seq;
+}
+
+static inline bool btree_iter_lockless_ok(struct btree_iter *iter)
+{
+	return iter->trans->c->opts.btree_lockless_reads &&
+		btree_iter_type(iter) == BTREE_ITER_KEYS &&
+		!iter->locks_want &&
+		!(iter->flags & BTREE_ITER_PREFETCH);
+}
+
+/*
+ * Walk down to the leaf node for @iter's position without locking any interior
+ * nodes, and return the leaf read locked: returns false if we raced with an
+ * update or an interior node's table wasn't up to date, in which case the
+ * caller does a normal traversal.
+ */
+static bool btree_iter_traverse_lockless(struct btree_iter *iter,
+					 unsigned long trace_ip)
+{
+	struct bch_fs *c = iter->trans->c;
+	struct btree *b, *parent, *root, **rootp = &c->btree_roots[iter->btree_id].b;
+	struct btree_lockless_table *t;
+	struct bpos search_key = btree_iter_search_key(iter);
+	unsigned i, l, r, level, root_level;
+	u64 hash_val = 0;
+	u32 seq;
+
+	EBUG_ON(iter->nodes_locked);
+
+	rcu_read_lock();
+	b = root = READ_ONCE(*rootp);
+	level = root_level = READ_ONCE(b->c.level);
+
+	if (!level)
+		goto err;
+
+	while (1) {
+		seq = btree_node_seq_read(b);
+		if (seq & 1)
+			goto err;
+
+		t = READ_ONCE(b->lockless_table);
+		if (!t || t->seq != seq)
+			goto err;
+
+		if (b->c.level != level ||
+		    b->c.btree_id != iter->btree_id ||
+		    (level != root_level && b->hash_val != hash_val))
+			goto err;
+
+		/* Find the first child with max_key >= search_key: */
+		l = 0;
+		r = t->nr;
+		while (l < r) {
+			unsigned m = l + ((r - l) >> 1);
+
+			if (bkey_cmp(t->d[m].max_key, search_key) < 0)
+				l = m + 1;
+			else
+				r = m;
+		}
+
+		if (l == t->nr)
+			goto err;
+
+		hash_val = t->d[l].hash_val;
+
+		smp_rmb();
+		if (READ_ONCE(b->c.lock.state.seq) != seq)
+			goto err;
+
+		if (level == root_level && READ_ONCE(*rootp) != root)
+			goto err;
+
+		if (level == 1)
+			break;
+
+		b = bch2_btree_node_find_by_hash(c, hash_val);
+		if (!b)
+			goto err;
+		level--;
+	}
+	rcu_read_unlock();
+
+	parent = b;
+
+	b = bch2_btree_node_get_by_hash(c, iter, hash_val, search_key, 0,
+					SIX_LOCK_read, trace_ip);
+	if (!b)
+		goto fallback;
+
+	/*
+	 * Nodes are only freed or replaced with their parent write locked - if
+	 * the parent hasn't changed since we read its table, the leaf we just
+	 * locked is still reachable:
+	 */
+	if (READ_ONCE(parent->c.lock.state.seq) != seq ||
+	    !btree_iter_pos_in_node(iter, b)) {
+		six_unlock_read(&b->c.lock);
+		goto fallback;
+	}
+
+	for (i = 1; i <= root_level; i++)
+		iter->l[i].b = BTREE_ITER_NO_NODE_LOCKLESS;
+	for (i = root_level + 1; i < BTREE_MAX_DEPTH; i++)
+		iter->l[i].b = NULL;
+
+	mark_btree_node_locked(iter, 0, SIX_LOCK_read);
+	btree_iter_node_set(iter, b);
+	iter->level = 0;
+
+	this_cpu_inc(c->btree_lockless_stats->traverse);
+	return true;
+err:
+	rcu_read_unlock();
+fallback:
+	this_cpu_inc(c->btree_lockless_stats->fallback);
+	return false;
+}
+
 noinline
-static void btree_iter_prefetch(struct btree_iter *iter)
+static void btree_iter_prefetch(struct btree_iter *iter, unsigned nr)
 {
 	struct bch_fs *c = iter->trans->c;
 	struct btree_iter_level *l = &iter->l[iter->level];
 	struct btree_node_iter node_iter = l->iter;
 	struct bkey_packed *k;
 	struct bkey_buf tmp;
-	unsigned nr = test_bit(BCH_FS_STARTED, &c->flags)
-		? (iter->level > 1 ? 0 :  2)
-		: (iter->level > 1 ? 1 : 16);
 	bool was_locked = btree_node_locked(iter, iter->level);
 
 	bch2_bkey_buf_init(&tmp);
 
-	while (nr) {
+	while (nr--) {
 		if (!bch2_btree_node_relock(iter, iter->level))
 			break;
 
@@ -1072,6 +1287,28 @@ static void btree_iter_prefetch(struct btree_iter *iter)
 	bch2_bkey_buf_exit(&tmp, c);
 }
 
+#define BTREE_ITER_READAHEAD_MAX	16
+
+/*
+ * Sequential scan detection: if the leaf we're descending to starts where the
+ * last leaf this iterator visited ended, we're scanning - double the number of
+ * leaves we read ahead of the scan each time, up to BTREE_ITER_READAHEAD_MAX:
+ */
+static unsigned btree_iter_readahead(struct btree_iter *iter, struct btree *b)
+{
+	if (!bkey_cmp(b->data->min_key, iter->readahead_pos))
+		iter->readahead = min_t(unsigned, BTREE_ITER_READAHEAD_MAX,
+					max_t(unsigned, iter->readahead * 2, 1));
+	else
+		iter->readahead = 0;
+
+	iter->readahead_pos = bkey_cmp(b->key.k.p, POS_MAX)
+		? bkey_successor(b->key.k.p)
+		: POS_MAX;
+
+	return iter->readahead;
+}
+
 static noinline void btree_node_mem_ptr_set(struct btree_iter *iter,
 					    unsigned plevel, struct btree *b)
 {
@@ -1102,10 +1339,14 @@ static __always_inline int btree_iter_down(struct btree_iter *iter,
 	unsigned level = iter->level - 1;
 	enum six_lock_type lock_type = __btree_lock_want(iter, level);
 	struct bkey_buf tmp;
+	unsigned nr;
 	int ret;
 
 	EBUG_ON(!btree_node_locked(iter, iter->level));
 
+	if (c->opts.btree_lockless_reads)
+		bch2_btree_node_lockless_table_update(c, l->b);
+
 	bch2_bkey_buf_init(&tmp);
 	bch2_bkey_buf_unpack(&tmp, c, l->b,
 			 bch2_btree_node_iter_peek(&l->iter, l->b));
@@ -1123,7 +1364,11 @@ static __always_inline int btree_iter_down(struct btree_iter *iter,
 		btree_node_mem_ptr_set(iter, level + 1, b);
 
 	if (iter->flags & BTREE_ITER_PREFETCH)
-		btree_iter_prefetch(iter);
+		btree_iter_prefetch(iter, test_bit(BCH_FS_STARTED, &c->flags)
+				    ? (level ? 0 : 2)
+				    : (level ? 1 : 16));
+	else if (!level && (nr = btree_iter_readahead(iter, b)))
+		btree_iter_prefetch(iter, nr);
 
 	iter->level = level;
 err:
@@ -1138,17 +1383,104 @@ static void btree_iter_up(struct btree_iter *iter)
 
 static int btree_iter_traverse_one(struct btree_iter *, unsigned long);
 
-static int __btree_iter_traverse_all(struct btree_trans *trans, int ret)
+/*
+ * Dropping and retaking all our locks only requires a transaction restart if
+ * something the caller may still be looking at changed in the meantime: we
+ * remember the node (and lock sequence number) of every iterator the caller
+ * may have returned keys from, and if after retraversing they all point to the
+ * same unmodified nodes, the transaction can carry on:
+ */
+#define TRAVERSE_ALL_SAVED_MAX		16
+
+struct traverse_all_saved {
+	struct btree		*b;
+	u32			seq;
+	u8			idx;
+	u8			level;
+};
+
+/*
+ * Iterators with pending updates, and iterators other than the one being
+ * traversed that are live or that were touched (put, but the caller may have
+ * computed updates from keys they returned):
+ */
+static inline bool traverse_all_tracked(struct btree_trans *trans,
+					struct btree_iter *iter,
+					struct btree_iter *traversing)
+{
+	return (iter->flags & BTREE_ITER_KEEP_UNTIL_COMMIT) ||
+		(iter != traversing &&
+		 (test_bit(iter->idx, trans->iters_live) ||
+		  test_bit(iter->idx, trans->iters_touched)));
+}
+
+static bool traverse_all_save(struct btree_trans *trans,
+			      struct btree_iter *traversing,
+			      struct traverse_all_saved *saved,
+			      unsigned *nr_saved)
+{
+	struct btree_iter *iter;
+	unsigned l;
+
+	trans_for_each_iter(trans, iter) {
+		if (!traverse_all_tracked(trans, iter, traversing))
+			continue;
+
+		l = iter->level;
+
+		if (l >= BTREE_MAX_DEPTH ||
+		    !btree_node_locked(iter, l) ||
+		    *nr_saved >= TRAVERSE_ALL_SAVED_MAX)
+			return false;
+
+		saved[(*nr_saved)++] = (struct traverse_all_saved) {
+			.b	= iter->l[l].b,
+			.seq	= iter->l[l].b->c.lock.state.seq,
+			.idx	= iter->idx,
+			.level	= l,
+		};
+	}
+
+	return true;
+}
+
+static bool traverse_all_unchanged(struct btree_trans *trans,
+				   struct traverse_all_saved *saved,
+				   unsigned nr_saved)
+{
+	struct traverse_all_saved *i;
+	struct btree_iter *iter;
+
+	for (i = saved; i < saved + nr_saved; i++) {
+		iter = btree_trans_iter(trans, i->idx);
+
+		if (!test_bit(i->idx, trans->iters_linked) ||
+		    iter->level != i->level ||
+		    iter->l[i->level].b != i->b ||
+		    !btree_node_locked(iter, i->level) ||
+		    i->b->c.lock.state.seq != i->seq)
+			return false;
+	}
+
+	return true;
+}
+
+static int __btree_iter_traverse_all(struct btree_trans *trans,
+				     struct btree_iter *traversing, int ret)
 {
 	struct bch_fs *c = trans->c;
 	struct btree_iter *iter;
+	struct traverse_all_saved saved[TRAVERSE_ALL_SAVED_MAX];
 	u8 sorted[BTREE_ITER_MAX];
-	unsigned i, nr_sorted = 0;
+	unsigned i, nr_sorted = 0, nr_saved = 0;
+	bool can_continue, need_restart;
 
 	if (trans->in_traverse_all)
 		return -EINTR;
 
 	trans->in_traverse_all = true;
+
+	can_continue = traverse_all_save(trans, traversing, saved, &nr_saved);
 retry_all:
 	nr_sorted = 0;
 
@@ -1156,7 +1488,8 @@ static int __btree_iter_traverse_all(struct btree_trans *trans, int ret)
 		sorted[nr_sorted++] = iter->idx;
 
 #define btree_iter_cmp_by_idx(_l, _r)				\
-		btree_iter_lock_cmp(&trans->iters[_l], &trans->iters[_r])
+		btree_iter_lock_cmp(btree_trans_iter(trans, _l),	\
+				    btree_trans_iter(trans, _r))
 
 	bubble_sort(sorted, nr_sorted, btree_iter_cmp_by_idx);
 #undef btree_iter_cmp_by_idx
@@ -1189,22 +1522,24 @@ static int __btree_iter_traverse_all(struct btree_trans *trans, int ret)
 		 * sucessfully traversing one iterator can cause another to be
 		 * unlinked, in btree_key_cache_fill()
 		 */
-		if (!(trans->iters_linked & (1ULL << idx)))
+		if (!test_bit(idx, trans->iters_linked))
 			continue;
 
-		ret = btree_iter_traverse_one(&trans->iters[idx], _THIS_IP_);
+		ret = btree_iter_traverse_one(btree_trans_iter(trans, idx),
+					      _THIS_IP_);
 		if (ret)
 			goto retry_all;
 	}
 
-	if (hweight64(trans->iters_live) > 1)
+	need_restart = bitmap_weight(trans->iters_live, BTREE_ITER_MAX) > 1;
+	trans_for_each_iter(trans, iter)
+		if (traverse_all_tracked(trans, iter, traversing))
+			need_restart = true;
+
+	if (need_restart &&
+	    !(can_continue &&
+	      traverse_all_unchanged(trans, saved, nr_saved)))
 		ret = -EINTR;
-	else
-		trans_for_each_iter(trans, iter)
-			if (iter->flags & BTREE_ITER_KEEP_UNTIL_COMMIT) {
-				ret = -EINTR;
-				break;
-			}
 out:
 	bch2_btree_cache_cannibalize_unlock(c);
 
@@ -1214,7 +1549,7 @@ static int __btree_iter_traverse_all(struct btree_trans *trans, int ret)
 
 int bch2_btree_iter_traverse_all(struct btree_trans *trans)
 {
-	return __btree_iter_traverse_all(trans, 0);
+	return __btree_iter_traverse_all(trans, NULL, 0);
 }
 
 static inline bool btree_iter_good_node(struct btree_iter *iter,
@@ -1301,6 +1636,12 @@ static int btree_iter_traverse_one(struct btree_iter *iter,
 	 * here it indicates that relocking the root failed - it's critical that
 	 * btree_iter_lock_root() comes next and that it can't fail
 	 */
+	if (!btree_iter_node(iter, iter->level) &&
+	    !depth_want &&
+	    btree_iter_lockless_ok(iter) &&
+	    btree_iter_traverse_lockless(iter, trace_ip))
+		goto out;
+
 	while (iter->level > depth_want) {
 		int ret = btree_iter_node(iter, iter->level)
 			? btree_iter_down(iter, trace_ip)
@@ -1322,7 +1663,7 @@ static int btree_iter_traverse_one(struct btree_iter *iter,
 			return ret;
 		}
 	}
-
+out:
 	iter->uptodate = BTREE_ITER_NEED_PEEK;
 
 	bch2_btree_iter_verify(iter);
@@ -1334,10 +1675,14 @@ int __must_check __bch2_btree_iter_traverse(struct btree_iter *iter)
 	struct btree_trans *trans = iter->trans;
 	int ret;
 
+	/* see btree_trans_iter_alloc(): */
+	if (unlikely(trans->restart_pending))
+		return -EINTR;
+
 	ret =   bch2_trans_cond_resched(trans) ?:
 		btree_iter_traverse_one(iter, _RET_IP_);
 	if (unlikely(ret))
-		ret = __btree_iter_traverse_all(trans, ret);
+		ret = __btree_iter_traverse_all(trans, iter, ret);
 
 	return ret;
 }
@@ -1476,6 +1821,7 @@ static void btree_iter_pos_changed(struct btree_iter *iter, int cmp)
 		 * is expensive).
 		 */
 		if (cmp < 0 ||
+		    btree_iter_node_iter_deferred(iter, &iter->l[l]) ||
 		    !btree_iter_advance_to_pos(iter, &iter->l[l], 8))
 			__btree_iter_init(iter, l);
 
@@ -1876,6 +2222,18 @@ struct bkey_s_c bch2_btree_iter_peek_slot(struct btree_iter *iter)
 	if (iter->flags & BTREE_ITER_IS_EXTENTS)
 		return __bch2_btree_iter_peek_slot_extents(iter);
 
+	/*
+	 * Keys may have been inserted into the leaf since the node iterator was
+	 * deferred - the Bloom filters are updated on insert:
+	 */
+	if (btree_iter_node_iter_deferred(iter, l) &&
+	    !bch2_btree_node_maybe_contains(l->b, iter->pos)) {
+		bkey_init(&iter->k);
+		iter->k.p = iter->pos;
+		iter->uptodate = BTREE_ITER_UPTODATE;
+		return (struct bkey_s_c) { &iter->k, NULL };
+	}
+
 	k = __btree_iter_peek_all(iter, l, &iter->k);
 
 	EBUG_ON(k.k && bkey_deleted(k.k) && bkey_cmp(k.k->p, iter->pos) == 0);
@@ -1944,6 +2302,8 @@ static inline void bch2_btree_iter_init(struct btree_trans *trans,
 	iter->locks_want		= flags & BTREE_ITER_INTENT ? 1 : 0;
 	iter->nodes_locked		= 0;
 	iter->nodes_intent_locked	= 0;
+	iter->readahead			= 0;
+	iter->readahead_pos		= POS_MAX;
 	for (i = 0; i < ARRAY_SIZE(iter->l); i++)
 		iter->l[i].b		= BTREE_ITER_NO_NODE_INIT;
 
@@ -1955,10 +2315,10 @@ static inline void bch2_btree_iter_init(struct btree_trans *trans,
 static inline void __bch2_trans_iter_free(struct btree_trans *trans,
 					  unsigned idx)
 {
-	__bch2_btree_iter_unlock(&trans->iters[idx]);
-	trans->iters_linked		&= ~(1ULL << idx);
-	trans->iters_live		&= ~(1ULL << idx);
-	trans->iters_touched		&= ~(1ULL << idx);
+	__bch2_btree_iter_unlock(btree_trans_iter(trans, idx));
+	__clear_bit(idx, trans->iters_linked);
+	__clear_bit(idx, trans->iters_live);
+	__clear_bit(idx, trans->iters_touched);
 }
 
 int bch2_trans_iter_put(struct btree_trans *trans,
@@ -1969,15 +2329,15 @@ int bch2_trans_iter_put(struct btree_trans *trans,
 	if (IS_ERR_OR_NULL(iter))
 		return 0;
 
-	BUG_ON(trans->iters + iter->idx != iter);
+	BUG_ON(btree_trans_iter(trans, iter->idx) != iter);
 
 	ret = btree_iter_err(iter);
 
-	if (!(trans->iters_touched & (1ULL << iter->idx)) &&
+	if (!test_bit(iter->idx, trans->iters_touched) &&
 	    !(iter->flags & BTREE_ITER_KEEP_UNTIL_COMMIT))
 		__bch2_trans_iter_free(trans, iter->idx);
 
-	trans->iters_live	&= ~(1ULL << iter->idx);
+	__clear_bit(iter->idx, trans->iters_live);
 	return ret;
 }
 
@@ -1987,7 +2347,7 @@ int bch2_trans_iter_free(struct btree_trans *trans,
 	if (IS_ERR_OR_NULL(iter))
 		return 0;
 
-	trans->iters_touched &= ~(1ULL << iter->idx);
+	__clear_bit(iter->idx, trans->iters_touched);
 
 	return bch2_trans_iter_put(trans, iter);
 }
@@ -2004,8 +2364,8 @@ static void btree_trans_iter_alloc_fail(struct btree_trans *trans)
 		       bch2_btree_ids[iter->btree_id],
 		       iter->pos.inode,
 		       iter->pos.offset,
-		       (trans->iters_live & (1ULL << iter->idx)) ? " live" : "",
-		       (trans->iters_touched & (1ULL << iter->idx)) ? " touched" : "",
+		       test_bit(iter->idx, trans->iters_live) ? " live" : "",
+		       test_bit(iter->idx, trans->iters_touched) ? " touched" : "",
 		       iter->flags & BTREE_ITER_KEEP_UNTIL_COMMIT ? " keep" : "",
 		       (void *) iter->ip_allocated);
 
@@ -2021,18 +2381,40 @@ static void btree_trans_iter_alloc_fail(struct btree_trans *trans)
 
 static struct btree_iter *btree_trans_iter_alloc(struct btree_trans *trans)
 {
-	unsigned idx;
+	struct btree_iter *iter;
+	unsigned idx = find_first_zero_bit(trans->iters_linked, BTREE_ITER_MAX);
 
-	if (unlikely(trans->iters_linked ==
-		     ~((~0ULL << 1) << (BTREE_ITER_MAX - 1))))
+	if (unlikely(idx >= BTREE_ITER_MAX))
 		btree_trans_iter_alloc_fail(trans);
 
-	idx = __ffs64(~trans->iters_linked);
+	if (unlikely(!trans->iters[idx / BTREE_ITER_CHUNK])) {
+		struct btree_iter **chunk = &trans->iters[idx / BTREE_ITER_CHUNK];
 
-	trans->iters_linked	|= 1ULL << idx;
-	trans->iters[idx].idx	 = idx;
-	trans->iters[idx].flags	 = 0;
-	return &trans->iters[idx];
+		/*
+		 * We may be holding btree locks, so we can't go into reclaim:
+		 * if that's what it takes, drop them first and have the
+		 * transaction restart:
+		 */
+		*chunk = kmalloc_array(BTREE_ITER_CHUNK,
+				       sizeof(struct btree_iter),
+				       GFP_NOWAIT|__GFP_NOWARN);
+		if (unlikely(!*chunk)) {
+			bch2_trans_unlock(trans);
+			*chunk = kmalloc_array(BTREE_ITER_CHUNK,
+					       sizeof(struct btree_iter),
+					       GFP_NOFS|__GFP_NOFAIL);
+			trans->restart_pending = true;
+			bch2_trans_restart_record(trans,
+					BCH_TRANS_RESTART_mem_realloced);
+		}
+	}
+
+	__set_bit(idx, trans->iters_linked);
+
+	iter = btree_trans_iter(trans, idx);
+	iter->idx	= idx;
+	iter->flags	= 0;
+	return iter;
 }
 
 static inline void btree_iter_copy(struct btree_iter *dst,
@@ -2085,7 +2467,7 @@ static struct btree_iter *__btree_trans_get_iter(struct btree_trans *trans,
 	if (!best) {
 		iter = btree_trans_iter_alloc(trans);
 		bch2_btree_iter_init(trans, iter, btree_id, pos, flags);
-	} else if ((trans->iters_live & (1ULL << best->idx)) ||
+	} else if (test_bit(best->idx, trans->iters_live) ||
 		   (best->flags & BTREE_ITER_KEEP_UNTIL_COMMIT)) {
 		iter = btree_trans_iter_alloc(trans);
 		btree_iter_copy(iter, best);
@@ -2109,10 +2491,10 @@ static struct btree_iter *__btree_trans_get_iter(struct btree_trans *trans,
 	BUG_ON((iter->flags ^ flags) & BTREE_ITER_TYPE);
 	BUG_ON(iter->flags & BTREE_ITER_KEEP_UNTIL_COMMIT);
 	BUG_ON(iter->flags & BTREE_ITER_SET_POS_AFTER_COMMIT);
-	BUG_ON(trans->iters_live & (1ULL << iter->idx));
+	BUG_ON(test_bit(iter->idx, trans->iters_live));
 
-	trans->iters_live	|= 1ULL << iter->idx;
-	trans->iters_touched	|= 1ULL << iter->idx;
+	__set_bit(iter->idx, trans->iters_live);
+	__set_bit(iter->idx, trans->iters_touched);
 
 	return iter;
 }
@@ -2162,12 +2544,12 @@ struct btree_iter *__bch2_trans_copy_iter(struct btree_trans *trans,
 	iter = btree_trans_iter_alloc(trans);
 	btree_iter_copy(iter, src);
 
-	trans->iters_live |= 1ULL << iter->idx;
+	__set_bit(iter->idx, trans->iters_live);
 	/*
 	 * We don't need to preserve this iter since it's cheap to copy it
 	 * again - this will cause trans_iter_put() to free it right away:
 	 */
-	trans->iters_touched &= ~(1ULL << iter->idx);
+	__clear_bit(iter->idx, trans->iters_touched);
 
 	return iter;
 }
@@ -2186,6 +2568,8 @@ static int bch2_trans_preload_mem(struct btree_trans *trans, size_t size)
 		trans->mem_bytes = new_bytes;
 
 		if (old_bytes) {
+			bch2_trans_restart_record(trans,
+					BCH_TRANS_RESTART_mem_realloced);
 			trace_trans_restart_mem_realloced(trans->ip, new_bytes);
 			return -EINTR;
 		}
@@ -2208,18 +2592,74 @@ void *bch2_trans_kmalloc(struct btree_trans *trans, size_t size)
 	return p;
 }
 
+/**
+ * bch2_btree_lookup_batch - look up many keys in one btree with one iterator
+ * @trans:	btree transaction
+ * @btree_id:	btree to search
+ * @pos:	positions to look up, sorted in ascending order
+ * @k:		returns the key at each position - a deleted key if there's a
+ *		hole; keys are copied into transaction memory and are valid
+ *		until the transaction is reset
+ * @nr:		number of positions
+ * @flags:	iterator flags
+ *
+ * Since the positions are sorted, each lookup only walks back up the btree as
+ * far as it has to, and neighbouring keys in the same leaf share the leaf's
+ * lock and node iterator instead of doing a full traversal from the root.
+ *
+ * May return -EINTR, in which case the caller must restart the transaction.
+ */
+int bch2_btree_lookup_batch(struct btree_trans *trans, enum btree_id btree_id,
+			    const struct bpos *pos, struct bkey_s_c *k,
+			    unsigned nr, unsigned flags)
+{
+	struct btree_iter *iter;
+	struct bkey_s_c s;
+	struct bkey_i *n;
+	unsigned i;
+	int ret = 0;
+
+	if (!nr)
+		return 0;
+
+	iter = bch2_trans_get_iter(trans, btree_id, pos[0],
+				   flags|BTREE_ITER_SLOTS);
+
+	for (i = 0; i < nr; i++) {
+		EBUG_ON(i && bkey_cmp(pos[i - 1], pos[i]) > 0);
+
+		bch2_btree_iter_set_pos(iter, pos[i]);
+
+		s = bch2_btree_iter_peek_slot(iter);
+		ret = bkey_err(s);
+		if (ret)
+			break;
+
+		n = bch2_trans_kmalloc(trans, bkey_bytes(s.k));
+		ret = PTR_ERR_OR_ZERO(n);
+		if (ret)
+			break;
+
+		bkey_reassemble(n, s);
+		k[i] = bkey_i_to_s_c(n);
+	}
+
+	bch2_trans_iter_put(trans, iter);
+	return ret;
+}
+
 inline void bch2_trans_unlink_iters(struct btree_trans *trans)
 {
-	u64 iters = trans->iters_linked &
-		~trans->iters_touched &
-		~trans->iters_live;
+	unsigned long iters[BITS_TO_LONGS(BTREE_ITER_MAX)];
+	unsigned idx;
 
-	while (iters) {
-		unsigned idx = __ffs64(iters);
+	bitmap_andnot(iters, trans->iters_linked,
+		      trans->iters_touched, BTREE_ITER_MAX);
+	bitmap_andnot(iters, iters,
+		      trans->iters_live, BTREE_ITER_MAX);
 
-		iters &= ~(1ULL << idx);
+	for_each_set_bit(idx, iters, BTREE_ITER_MAX)
 		__bch2_trans_iter_free(trans, idx);
-	}
 }
 
 void bch2_trans_reset(struct btree_trans *trans, unsigned flags)
@@ -2232,14 +2672,20 @@ void bch2_trans_reset(struct btree_trans *trans, unsigned flags)
 
 	bch2_trans_unlink_iters(trans);
 
-	trans->iters_touched &= trans->iters_live;
+	bitmap_and(trans->iters_touched, trans->iters_touched,
+		   trans->iters_live, BTREE_ITER_MAX);
 
 	trans->nr_updates		= 0;
 	trans->nr_updates2		= 0;
+	trans->restart_pending		= 0;
+	trans->nr_wb_updates		= 0;
+	trans->wb_updates_size		= 0;
+	trans->wb_updates		= NULL;
 	trans->mem_top			= 0;
 
 	trans->extra_journal_entries	= NULL;
 	trans->extra_journal_entry_u64s	= 0;
+	trans->alloc_updates		= NULL;
 
 	if (trans->fs_usage_deltas) {
 		trans->fs_usage_deltas->used = 0;
@@ -2254,7 +2700,7 @@ void bch2_trans_reset(struct btree_trans *trans, unsigned flags)
 
 static void bch2_trans_alloc_iters(struct btree_trans *trans, struct bch_fs *c)
 {
-	size_t iters_bytes	= sizeof(struct btree_iter) * BTREE_ITER_MAX;
+	size_t iters_bytes	= sizeof(struct btree_iter) * BTREE_ITER_CHUNK;
 	size_t updates_bytes	= sizeof(struct btree_insert_entry) * BTREE_ITER_MAX;
 	void *p = NULL;
 
@@ -2266,7 +2712,7 @@ static void bch2_trans_alloc_iters(struct btree_trans *trans, struct bch_fs *c)
 	if (!p)
 		p = mempool_alloc(&trans->c->btree_iters_pool, GFP_NOFS);
 
-	trans->iters		= p; p += iters_bytes;
+	trans->iters[0]		= p; p += iters_bytes;
 	trans->updates		= p; p += updates_bytes;
 	trans->updates2		= p; p += updates_bytes;
 }
@@ -2303,6 +2749,7 @@ void bch2_trans_init(struct btree_trans *trans, struct bch_fs *c,
 int bch2_trans_exit(struct btree_trans *trans)
 {
 	struct bch_fs *c = trans->c;
+	unsigned i;
 
 	bch2_trans_unlock(trans);
 
@@ -2323,13 +2770,17 @@ int bch2_trans_exit(struct btree_trans *trans)
 	/*
 	 * Userspace doesn't have a real percpu implementation:
 	 */
-	trans->iters = this_cpu_xchg(c->btree_iters_bufs->iter, trans->iters);
+	trans->iters[0] = this_cpu_xchg(c->btree_iters_bufs->iter,
+					trans->iters[0]);
 #endif
-	if (trans->iters)
-		mempool_free(trans->iters, &trans->c->btree_iters_pool);
+	if (trans->iters[0])
+		mempool_free(trans->iters[0], &trans->c->btree_iters_pool);
+
+	for (i = 1; i < BTREE_ITER_CHUNKS; i++)
+		kfree(trans->iters[i]);
 
 	trans->mem	= (void *) 0x1;
-	trans->iters	= (void *) 0x1;
+	trans->iters[0]	= (void *) 0x1;
 
 	return trans->error ? -EIO : 0;
 }
@@ -2390,7 +2841,8 @@ void bch2_btree_trans_to_text(struct printbuf *out, struct bch_fs *c)
 			pr_buf(out, " node ");
 			bch2_btree_iter_node_to_text(out,
 					(void *) b,
-					btree_iter_type(&trans->iters[trans->locking_iter_idx]));
+					btree_iter_type(btree_trans_iter(trans,
+							trans->locking_iter_idx)));
 			pr_buf(out, "\n");
 		}
 	}
@@ -2398,22 +2850,230 @@ void bch2_btree_trans_to_text(struct printbuf *out, struct bch_fs *c)
 #endif
 }
 
+/* Transaction restart accounting: */
+
+static const char * const bch2_trans_restart_reasons[] = {
+#define x(n)	#n,
+	BCH_TRANS_RESTART_REASONS()
+#undef x
+	NULL
+};
+
+void bch2_trans_restart_record(struct btree_trans *trans,
+			       enum btree_trans_restart_reason reason)
+{
+	struct bch_fs *c = trans->c;
+	unsigned long *p, ip;
+	unsigned i, slot;
+	unsigned idx = hash_long(trans->ip, ilog2(BCH_TRANS_RESTART_IPS));
+
+	trans->restart_reason = reason;
+	trans->nr_restarts++;
+
+	this_cpu_inc(c->btree_trans_restart_stats->reason[reason]);
+
+	for (i = 0; i < BCH_TRANS_RESTART_IPS; i++) {
+		slot = (idx + i) & (BCH_TRANS_RESTART_IPS - 1);
+		p = c->btree_trans_restart_ips + slot;
+
+		ip = READ_ONCE(*p);
+		if (!ip)
+			ip = cmpxchg(p, 0, trans->ip) ?: trans->ip;
+
+		if (ip == trans->ip) {
+			this_cpu_inc(c->btree_trans_restart_stats->ip_nr[slot]);
+			break;
+		}
+	}
+}
+
+/* Called on successful commit, to record how many times we had to restart: */
+void bch2_trans_restarts_per_commit(struct btree_trans *trans)
+{
+	unsigned bucket = min_t(unsigned, fls(trans->nr_restarts),
+				BCH_TRANS_RESTART_HIST_NR - 1);
+
+	this_cpu_inc(trans->c->btree_trans_restart_stats->restarts_per_commit[bucket]);
+	trans->nr_restarts = 0;
+}
+
+void bch2_btree_trans_restarts_to_text(struct printbuf *out, struct bch_fs *c)
+{
+	struct btree_trans_restart_stats *s = c->btree_trans_restart_stats;
+	unsigned long ip;
+	u64 nr, total = 0, by_ip = 0;
+	unsigned i;
+
+	pr_buf(out, "restarts by reason:\n");
+	for (i = 0; i < BCH_TRANS_RESTART_NR; i++) {
+		nr = percpu_u64_get(&s->reason[i]);
+		total += nr;
+		if (nr)
+			pr_buf(out, "  %s:\t%llu\n",
+			       bch2_trans_restart_reasons[i], nr);
+	}
+
+	pr_buf(out, "restarts by caller:\n");
+	for (i = 0; i < BCH_TRANS_RESTART_IPS; i++) {
+		ip = READ_ONCE(c->btree_trans_restart_ips[i]);
+		if (!ip)
+			continue;
+
+		nr = percpu_u64_get(&s->ip_nr[i]);
+		by_ip += nr;
+		pr_buf(out, "  %ps:\t%llu\n", (void *) ip, nr);
+	}
+
+	if (total > by_ip)
+		pr_buf(out, "  other:\t%llu\n", total - by_ip);
+
+	pr_buf(out, "restarts per commit:\n");
+	for (i = 0; i < BCH_TRANS_RESTART_HIST_NR; i++) {
+		nr = percpu_u64_get(&s->restarts_per_commit[i]);
+
+		if (!i)
+			pr_buf(out, "  0:\t%llu\n", nr);
+		else if (i + 1 < BCH_TRANS_RESTART_HIST_NR)
+			pr_buf(out, "  %u-%u:\t%llu\n",
+			       1U << (i - 1), (1U << i) - 1, nr);
+		else
+			pr_buf(out, "  %u+:\t%llu\n", 1U << (i - 1), nr);
+	}
+}
+
+static const char * const six_lock_type_names[] = {
+	[SIX_LOCK_read]		= "read",
+	[SIX_LOCK_intent]	= "intent",
+	[SIX_LOCK_write]	= "write",
+};
+
+/* Called after blocking on a btree node or key cache lock: */
+void bch2_btree_lock_contended(struct bch_fs *c,
+			       struct btree_bkey_cached_common *b,
+			       enum six_lock_type type,
+			       unsigned long holder_ip,
+			       u64 start_time)
+{
+	struct btree_lock_contention *s;
+	struct btree_lock_holder *h;
+	u64 now = local_clock();
+	u64 wait = now > start_time ? now - start_time : 0;
+	unsigned bucket = min_t(unsigned, fls64(div_u64(wait, NSEC_PER_USEC)),
+				BTREE_LOCK_HIST_NR - 1);
+	unsigned i, idx = hash_long(holder_ip, ilog2(BTREE_LOCK_HOLDERS_NR));
+
+	s = &c->btree_lock_stats->l[b->btree_id][b->cached
+		? BTREE_MAX_DEPTH
+		: b->level];
+
+	spin_lock(&s->lock);
+	s->hist[type][bucket]++;
+	s->wait_ns[type] += wait;
+
+	for (i = 0; holder_ip && i < BTREE_LOCK_HOLDERS_NR; i++) {
+		h = s->holders + ((idx + i) & (BTREE_LOCK_HOLDERS_NR - 1));
+
+		if (!h->ip)
+			h->ip = holder_ip;
+
+		if (h->ip == holder_ip) {
+			h->nr++;
+			h->wait_ns += wait;
+			break;
+		}
+	}
+	spin_unlock(&s->lock);
+}
+
+void bch2_btree_lock_contention_to_text(struct printbuf *out,
+					struct bch_fs *c,
+					enum btree_id id,
+					unsigned level)
+{
+	struct btree_lock_contention *s;
+	struct btree_lock_holder *h;
+	unsigned type, i;
+	u64 nr;
+
+	s = &c->btree_lock_stats->l[id][level];
+
+	spin_lock(&s->lock);
+	for (type = 0; type < ARRAY_SIZE(s->hist); type++) {
+		for (nr = 0, i = 0; i < BTREE_LOCK_HIST_NR; i++)
+			nr += s->hist[type][i];
+		if (!nr)
+			continue;
+
+		pr_buf(out, "  %s:	%llu waits, %llu us total\n",
+		       six_lock_type_names[type], nr,
+		       div_u64(s->wait_ns[type], NSEC_PER_USEC));
+
+		for (i = 0; i < BTREE_LOCK_HIST_NR; i++)
+			if (s->hist[type][i]) {
+				if (!i)
+					pr_buf(out, "    <1 us:\t");
+				else if (i + 1 < BTREE_LOCK_HIST_NR)
+					pr_buf(out, "    %u-%u us:\t",
+					       1U << (i - 1), (1U << i) - 1);
+				else
+					pr_buf(out, "    %u+ us:\t", 1U << (i - 1));
+				pr_buf(out, "%llu\n", s->hist[type][i]);
+			}
+	}
+
+	for (h = s->holders; h < s->holders + BTREE_LOCK_HOLDERS_NR; h++)
+		if (h->ip)
+			pr_buf(out, "  holder %ps:\t%llu waits, %llu us\n",
+			       (void *) h->ip, h->nr,
+			       div_u64(h->wait_ns, NSEC_PER_USEC));
+	spin_unlock(&s->lock);
+}
+
+void bch2_btree_lockless_stats_to_text(struct printbuf *out, struct bch_fs *c)
+{
+	u64 traverse = percpu_u64_get(&c->btree_lockless_stats->traverse);
+	u64 fallback = percpu_u64_get(&c->btree_lockless_stats->fallback);
+
+	pr_buf(out, "traversals:\t%llu\n", traverse);
+	pr_buf(out, "fallbacks:\t%llu\n", fallback);
+	pr_buf(out, "fallback %%:\t%llu\n",
+	       div64_u64(fallback * 100, max(traverse + fallback, 1ULL)));
+}
+
 void bch2_fs_btree_iter_exit(struct bch_fs *c)
 {
+	kvfree(c->btree_lock_stats);
+	free_percpu(c->btree_trans_restart_stats);
+	free_percpu(c->btree_lockless_stats);
 	mempool_exit(&c->btree_iters_pool);
 	cleanup_srcu_struct(&c->btree_trans_barrier);
 }
 
 int bch2_fs_btree_iter_init(struct bch_fs *c)
 {
-	unsigned nr = BTREE_ITER_MAX;
+	unsigned i, l, nr = BTREE_ITER_MAX;
 
 	INIT_LIST_HEAD(&c->btree_trans_list);
 	mutex_init(&c->btree_trans_lock);
 
+	spin_lock_init(&c->btree_trans_commit_ips_lock);
+
+	c->btree_lockless_stats = alloc_percpu(struct btree_lockless_stats);
+	c->btree_trans_restart_stats =
+		alloc_percpu(struct btree_trans_restart_stats);
+	c->btree_lock_stats = kvzalloc(sizeof(*c->btree_lock_stats), GFP_KERNEL);
+	if (!c->btree_lockless_stats ||
+	    !c->btree_trans_restart_stats ||
+	    !c->btree_lock_stats)
+		return -ENOMEM;
+
+	for (i = 0; i < BTREE_ID_NR; i++)
+		for (l = 0; l <= BTREE_MAX_DEPTH; l++)
+			spin_lock_init(&c->btree_lock_stats->l[i][l].lock);
+
 	return  init_srcu_struct(&c->btree_trans_barrier) ?:
 		mempool_init_kmalloc_pool(&c->btree_iters_pool, 1,
-			sizeof(struct btree_iter) * nr +
+			sizeof(struct btree_iter) * BTREE_ITER_CHUNK +
 			sizeof(struct btree_insert_entry) * nr +
 			sizeof(struct btree_insert_entry) * nr);
 }
@@ -38,7 +38,7 @@ static inline struct btree *btree_node_parent(struct btree_iter *iter,
 
 static inline bool btree_trans_has_multiple_iters(const struct btree_trans *trans)
 {
-	return hweight64(trans->iters_linked) > 1;
+	return bitmap_weight(trans->iters_linked, BTREE_ITER_MAX) > 1;
 }
 
 static inline int btree_iter_err(const struct btree_iter *iter)
@@ -46,24 +46,31 @@ static inline int btree_iter_err(const struct btree_iter *iter)
 	return iter->flags & BTREE_ITER_ERROR ? -EIO : 0;
 }
 
+static inline struct btree_iter *btree_trans_iter(struct btree_trans *trans,
+						  unsigned idx)
+{
+	EBUG_ON(idx >= BTREE_ITER_MAX);
+
+	return trans->iters[idx / BTREE_ITER_CHUNK] + idx % BTREE_ITER_CHUNK;
+}
+
 /* Iterate over iters within a transaction: */
 
 static inline struct btree_iter *
 __trans_next_iter(struct btree_trans *trans, unsigned idx)
 {
-	u64 l;
+	struct btree_iter *iter;
 
-	if (idx == BTREE_ITER_MAX)
+	if (idx >= BTREE_ITER_MAX)
 		return NULL;
 
-	l = trans->iters_linked >> idx;
-	if (!l)
+	idx = find_next_bit(trans->iters_linked, BTREE_ITER_MAX, idx);
+	if (idx >= BTREE_ITER_MAX)
 		return NULL;
 
-	idx += __ffs64(l);
-	EBUG_ON(idx >= BTREE_ITER_MAX);
-	EBUG_ON(trans->iters[idx].idx != idx);
-	return &trans->iters[idx];
+	iter = btree_trans_iter(trans, idx);
+	EBUG_ON(iter->idx != idx);
+	return iter;
 }
 
 #define trans_for_each_iter(_trans, _iter)				\
@@ -174,6 +181,8 @@ struct bkey_s_c bch2_btree_iter_next_slot(struct btree_iter *);
 
 struct bkey_s_c bch2_btree_iter_peek_cached(struct btree_iter *);
 
+void bch2_btree_iter_node_iter_resolve(struct btree_iter *);
+
 void __bch2_btree_iter_set_pos(struct btree_iter *, struct bpos, bool);
 void bch2_btree_iter_set_pos(struct btree_iter *, struct bpos);
 
@@ -299,10 +308,24 @@ static inline void bch2_trans_begin(struct btree_trans *trans)
 }
 
 void *bch2_trans_kmalloc(struct btree_trans *, size_t);
+
+int bch2_btree_lookup_batch(struct btree_trans *, enum btree_id,
+			    const struct bpos *, struct bkey_s_c *,
+			    unsigned, unsigned);
 void bch2_trans_init(struct btree_trans *, struct bch_fs *, unsigned, size_t);
 int bch2_trans_exit(struct btree_trans *);
 
+void bch2_trans_restart_record(struct btree_trans *,
+			       enum btree_trans_restart_reason);
+void bch2_trans_restarts_per_commit(struct btree_trans *);
+
 void bch2_btree_trans_to_text(struct printbuf *, struct bch_fs *);
+void bch2_btree_trans_restarts_to_text(struct printbuf *, struct bch_fs *);
+void bch2_btree_lock_contended(struct bch_fs *, struct btree_bkey_cached_common *,
+			       enum six_lock_type, unsigned long, u64);
+void bch2_btree_lock_contention_to_text(struct printbuf *, struct bch_fs *,
+					enum btree_id, unsigned);
+void bch2_btree_lockless_stats_to_text(struct printbuf *, struct bch_fs *);
 
 void bch2_fs_btree_iter_exit(struct bch_fs *);
 int bch2_fs_btree_iter_init(struct bch_fs *);
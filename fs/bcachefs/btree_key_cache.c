@@ -73,6 +73,26 @@ static void bkey_cached_evict(struct btree_key_cache *c,
 	c->nr_keys--;
 }
 
+#define key_cache_stat_inc(_bc, _stat)	this_cpu_inc((_bc)->stats->_stat)
+
+static bool bkey_cached_free_pcpu(struct btree_key_cache *bc,
+				  struct bkey_cached *ck)
+{
+	struct btree_key_cache_freelist *f;
+	bool ret = false;
+
+	preempt_disable();
+	f = this_cpu_ptr(bc->pcpu_freed);
+	if (f->nr < ARRAY_SIZE(f->objs)) {
+		list_del_init(&ck->list);
+		f->objs[f->nr++] = ck;
+		ret = true;
+	}
+	preempt_enable();
+
+	return ret;
+}
+
 static void bkey_cached_free(struct btree_key_cache *bc,
 			     struct bkey_cached *ck)
 {
@@ -80,35 +100,78 @@ static void bkey_cached_free(struct btree_key_cache *bc,
 
 	BUG_ON(test_bit(BKEY_CACHED_DIRTY, &ck->flags));
 
+	kfree(ck->k);
+	ck->k		= NULL;
+	ck->u64s	= 0;
+
+	six_unlock_write(&ck->c.lock);
+	six_unlock_intent(&ck->c.lock);
+
+	/*
+	 * Entries on the percpu freelists are only ever reused, not freed until
+	 * shutdown - so they don't have to wait for an srcu barrier:
+	 */
+	if (bkey_cached_free_pcpu(bc, ck))
+		return;
+
 	ck->btree_trans_barrier_seq =
 		start_poll_synchronize_srcu(&c->btree_trans_barrier);
 
 	list_move_tail(&ck->list, &bc->freed);
 	bc->nr_freed++;
+}
 
-	kfree(ck->k);
-	ck->k		= NULL;
-	ck->u64s	= 0;
+static struct bkey_cached *
+bkey_cached_alloc_pcpu(struct btree_key_cache *c)
+{
+	struct bch_fs *fs = container_of(c, struct bch_fs, btree_key_cache);
+	struct btree_key_cache_freelist *f;
+	struct bkey_cached *ck = NULL;
 
-	six_unlock_write(&ck->c.lock);
-	six_unlock_intent(&ck->c.lock);
+	preempt_disable();
+	f = this_cpu_ptr(c->pcpu_freed);
+	if (f->nr)
+		ck = f->objs[--f->nr];
+	preempt_enable();
+
+	if (!ck || bkey_cached_lock_for_evict(ck))
+		return ck;
+
+	/*
+	 * Someone who looked this entry up before it was freed still has it
+	 * locked; they'll notice the key doesn't match and drop it, but we
+	 * can't wait - punt it to the shared freelist:
+	 */
+	mutex_lock(&c->lock);
+	ck->btree_trans_barrier_seq =
+		start_poll_synchronize_srcu(&fs->btree_trans_barrier);
+	list_add_tail(&ck->list, &c->freed);
+	c->nr_freed++;
+	mutex_unlock(&c->lock);
+
+	return NULL;
 }
 
 static struct bkey_cached *
 bkey_cached_alloc(struct btree_key_cache *c)
 {
+	struct bch_fs *fs = container_of(c, struct bch_fs, btree_key_cache);
 	struct bkey_cached *ck;
 
+	lockdep_assert_held(&c->lock);
+
 	list_for_each_entry_reverse(ck, &c->freed, list)
 		if (bkey_cached_lock_for_evict(ck)) {
 			c->nr_freed--;
 			return ck;
 		}
 
-	ck = kmem_cache_alloc(bch2_key_cache, GFP_NOFS|__GFP_ZERO);
+	ck = kmem_cache_alloc(bch2_key_cache,
+			      btree_cache_gfp(fs, GFP_NOFS|__GFP_ZERO));
 	if (likely(ck)) {
 		INIT_LIST_HEAD(&ck->list);
 		six_lock_init(&ck->c.lock);
+		ck->c.cached = true;
 		BUG_ON(!six_trylock_intent(&ck->c.lock));
 		BUG_ON(!six_trylock_write(&ck->c.lock));
 		return ck;
@@ -117,6 +180,7 @@ bkey_cached_alloc(struct btree_key_cache *c)
 	list_for_each_entry(ck, &c->clean, list)
 		if (bkey_cached_lock_for_evict(ck)) {
 			bkey_cached_evict(c, ck);
+			key_cache_stat_inc(c, evict);
 			return ck;
 		}
 
@@ -128,11 +192,22 @@ btree_key_cache_create(struct btree_key_cache *c,
 		       enum btree_id btree_id,
 		       struct bpos pos)
 {
+	struct bch_fs *fs = container_of(c, struct bch_fs, btree_key_cache);
 	struct bkey_cached *ck;
 
-	ck = bkey_cached_alloc(c);
+	/*
+	 * Fast path: take an entry off this cpu's freelist without touching the
+	 * shared lock, then only take it to add the new entry to the clean list:
+	 */
+	ck = bkey_cached_alloc_pcpu(c);
+
+	mutex_lock(&c->lock);
 	if (!ck)
+		ck = bkey_cached_alloc(c);
+	if (!ck) {
+		mutex_unlock(&c->lock);
 		return ERR_PTR(-ENOMEM);
+	}
 
 	ck->c.level		= 0;
 	ck->c.btree_id		= btree_id;
@@ -140,18 +215,21 @@ btree_key_cache_create(struct btree_key_cache *c,
 	ck->key.pos		= pos;
 	ck->valid		= false;
 	ck->flags		= 1U << BKEY_CACHED_ACCESSED;
+	journal_res_pos_reset(&fs->journal, &ck->c.journal_pos);
 
 	if (rhashtable_lookup_insert_fast(&c->table,
 					  &ck->hash,
 					  bch2_btree_key_cache_params)) {
 		/* We raced with another fill: */
 		bkey_cached_free(c, ck);
+		mutex_unlock(&c->lock);
 		return NULL;
 	}
 
 	c->nr_keys++;
 
 	list_move(&ck->list, &c->clean);
+	mutex_unlock(&c->lock);
 	six_unlock_write(&ck->c.lock);
 
 	return ck;
@@ -239,10 +317,8 @@ int bch2_btree_iter_traverse_cached(struct btree_iter *iter)
 			return 0;
 		}
 
-		mutex_lock(&c->btree_key_cache.lock);
 		ck = btree_key_cache_create(&c->btree_key_cache,
 					    iter->btree_id, iter->pos);
-		mutex_unlock(&c->btree_key_cache.lock);
 
 		ret = PTR_ERR_OR_ZERO(ck);
 		if (ret)
@@ -250,7 +326,9 @@ int bch2_btree_iter_traverse_cached(struct btree_iter *iter)
 		if (!ck)
 			goto retry;
 
+		key_cache_stat_inc(&c->btree_key_cache, miss);
 		mark_btree_node_locked(iter, 0, SIX_LOCK_intent);
+		ck->c.intent_ip = trans->ip;
 		iter->locks_want = 1;
 	} else {
 		enum six_lock_type lock_want = __btree_lock_want(iter, 0);
@@ -273,6 +351,7 @@ int bch2_btree_iter_traverse_cached(struct btree_iter *iter)
 			goto retry;
 		}
 
+		key_cache_stat_inc(&c->btree_key_cache, hit);
 		mark_btree_node_locked(iter, 0, lock_want);
 	}
 
@@ -534,12 +613,25 @@ static unsigned long bch2_btree_key_cache_scan(struct shrinker *shrink,
 	if (scanned >= nr)
 		goto out;
 
+	/*
+	 * Only clean entries are on this list - dirty entries are written back by
+	 * journal reclaim, not by us. Entries get a second chance if they've been
+	 * accessed since the last scan; entries that were never filled are
+	 * free to drop:
+	 */
 	list_for_each_entry_safe(ck, t, &bc->clean, list) {
-		if (test_bit(BKEY_CACHED_ACCESSED, &ck->flags))
+		if (bc->nr_keys <= c->opts.btree_key_cache_min_nr)
+			break;
+
+		if (ck->valid &&
+		    test_bit(BKEY_CACHED_ACCESSED, &ck->flags))
 			clear_bit(BKEY_CACHED_ACCESSED, &ck->flags);
 		else if (bkey_cached_lock_for_evict(ck)) {
 			bkey_cached_evict(bc, ck);
 			bkey_cached_free(bc, ck);
+			key_cache_stat_inc(bc, evict);
+		} else {
+			key_cache_stat_inc(bc, evict_fail);
 		}
 
 		scanned++;
@@ -562,18 +654,31 @@ static unsigned long bch2_btree_key_cache_count(struct shrinker *shrink,
 	struct bch_fs *c = container_of(shrink, struct bch_fs,
 					btree_key_cache.shrink);
 	struct btree_key_cache *bc = &c->btree_key_cache;
+	size_t min_nr = c->opts.btree_key_cache_min_nr;
 
-	return bc->nr_keys;
+	return bc->nr_keys > min_nr ? bc->nr_keys - min_nr : 0;
 }
 
 void bch2_fs_btree_key_cache_exit(struct btree_key_cache *bc)
 {
 	struct bch_fs *c = container_of(bc, struct bch_fs, btree_key_cache);
 	struct bkey_cached *ck, *n;
+	int cpu;
 
 	if (bc->shrink.list.next)
 		unregister_shrinker(&bc->shrink);
 
+	if (bc->pcpu_freed)
+		for_each_possible_cpu(cpu) {
+			struct btree_key_cache_freelist *f =
+				per_cpu_ptr(bc->pcpu_freed, cpu);
+
+			while (f->nr)
+				kmem_cache_free(bch2_key_cache, f->objs[--f->nr]);
+		}
+	free_percpu(bc->pcpu_freed);
+	free_percpu(bc->stats);
+
 	mutex_lock(&bc->lock);
 	list_splice(&bc->dirty, &bc->clean);
 
@@ -616,6 +721,11 @@ int bch2_fs_btree_key_cache_init(struct btree_key_cache *c)
 {
 	int ret;
 
+	c->pcpu_freed	= alloc_percpu(struct btree_key_cache_freelist);
+	c->stats	= alloc_percpu(struct btree_key_cache_stats);
+	if (!c->pcpu_freed || !c->stats)
+		return -ENOMEM;
+
 	c->shrink.seeks			= 1;
 	c->shrink.count_objects		= bch2_btree_key_cache_count;
 	c->shrink.scan_objects		= bch2_btree_key_cache_scan;
@@ -637,6 +747,27 @@ void bch2_btree_key_cache_to_text(struct printbuf *out, struct btree_key_cache *
 	pr_buf(out, "nr_freed:\t%zu\n",	c->nr_freed);
 	pr_buf(out, "nr_keys:\t%zu\n",	c->nr_keys);
 	pr_buf(out, "nr_dirty:\t%zu\n",	c->nr_dirty);
+
+	if (c->stats) {
+		struct btree_key_cache_stats s = { 0 };
+		int cpu;
+
+		for_each_possible_cpu(cpu) {
+			struct btree_key_cache_stats *p = per_cpu_ptr(c->stats, cpu);
+
+			s.hit	+= p->hit;
+			s.miss	+= p->miss;
+			s.evict	+= p->evict;
+			s.evict_fail += p->evict_fail;
+		}
+
+		pr_buf(out, "hit:\t\t%llu\n",	s.hit);
+		pr_buf(out, "miss:\t\t%llu\n",	s.miss);
+		pr_buf(out, "hit %%:\t\t%llu\n",
+		       div64_u64(s.hit * 100, max(s.hit + s.miss, 1ULL)));
+		pr_buf(out, "evict:\t\t%llu\n",	s.evict);
+		pr_buf(out, "evict fail:\t%llu\n",	s.evict_fail);
+	}
 }
 
 void bch2_btree_key_cache_exit(void)
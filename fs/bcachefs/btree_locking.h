@@ -135,16 +135,36 @@ static inline enum bch_time_stats lock_to_time_stat(enum six_lock_type type)
 	}
 }
 
+static inline void btree_node_set_intent_ip(struct btree_trans *trans,
+					    struct btree *b,
+					    enum six_lock_type type)
+{
+	if (type == SIX_LOCK_intent)
+		b->c.intent_ip = trans->ip;
+}
+
+/*
+ * Who we're waiting on, for contention stats: readers and writers wait on the
+ * intent lock holder; a writer waits on readers, which we don't track:
+ */
+static inline unsigned long btree_node_lock_holder_ip(struct btree *b,
+						      enum six_lock_type type)
+{
+	return type != SIX_LOCK_write ? READ_ONCE(b->c.intent_ip) : 0;
+}
+
 /*
  * wrapper around six locks that just traces lock contended time
  */
 static inline void __btree_node_lock_type(struct bch_fs *c, struct btree *b,
 					  enum six_lock_type type)
 {
+	unsigned long holder_ip = btree_node_lock_holder_ip(b, type);
 	u64 start_time = local_clock();
 
 	six_lock_type(&b->c.lock, type, NULL, NULL);
 	bch2_time_stats_update(&c->times[lock_to_time_stat(type)], start_time);
+	bch2_btree_lock_contended(c, &b->c, type, holder_ip, start_time);
 }
 
 static inline void btree_node_lock_type(struct bch_fs *c, struct btree *b,
@@ -190,7 +210,7 @@ static inline bool btree_node_lock(struct btree *b,
 	bool ret;
 
 	EBUG_ON(level >= BTREE_MAX_DEPTH);
-	EBUG_ON(!(trans->iters_linked & (1ULL << iter->idx)));
+	EBUG_ON(!test_bit(iter->idx, trans->iters_linked));
 
 #ifdef CONFIG_BCACHEFS_DEBUG
 	trans->locking		= b;
@@ -203,6 +223,8 @@ static inline bool btree_node_lock(struct btree *b,
 		btree_node_lock_increment(trans, b, level, type) ||
 		__bch2_btree_node_lock(b, pos, level, iter, type,
 				       should_sleep_fn, p, ip);
+	if (ret)
+		btree_node_set_intent_ip(trans, b, type);
 
 #ifdef CONFIG_BCACHEFS_DEBUG
 	trans->locking = NULL;
@@ -13,6 +13,7 @@
 struct open_bucket;
 struct btree_update;
 struct btree_trans;
+struct trans_alloc_update;
 
 #define MAX_BSETS		3U
 
@@ -48,6 +49,9 @@ struct bset_tree {
 	u16			aux_data_offset;
 	u16			end_offset;
 
+	/* ro aux tree uses struct bkey_float_wide: */
+	u8			wide_bfloats;
+
 	struct bpos		max_key;
 };
 
@@ -57,13 +61,38 @@ struct btree_write {
 
 struct btree_alloc {
 	struct open_buckets	ob;
+	unsigned		target;
 	__BKEY_PADDED(k, BKEY_BTREE_PTR_VAL_U64s_MAX);
 };
 
+/*
+ * Flat table of an interior node's children, for lockless traversal: valid
+ * only while the node's lock sequence number is still @seq
+ */
+struct btree_lockless_table {
+	struct rcu_head		rcu;
+	u32			seq;
+	unsigned		nr;
+	struct btree_lockless_entry {
+		struct bpos	max_key;
+		u64		hash_val;
+	}			d[];
+};
+
+struct btree_lockless_stats {
+	u64			traverse;
+	u64			fallback;
+};
+
 struct btree_bkey_cached_common {
 	struct six_lock		lock;
 	u8			level;
 	u8			btree_id;
+	bool			cached;
+	/* trans->ip of the last intent lock holder, for contention stats: */
+	unsigned long		intent_ip;
+	/* Last journal reservation used to update this (leaves only): */
+	struct journal_res_pos	journal_pos;
 };
 
 struct btree {
@@ -74,6 +103,8 @@ struct btree {
 
 	unsigned long		flags;
 	u16			written;
+	/* sectors we'll fill before splitting, see btree_id_node_sectors(): */
+	u16			node_sectors;
 	u8			nsets;
 	u8			nr_key_bits;
 
@@ -82,6 +113,9 @@ struct btree {
 	struct btree_node	*data;
 	void			*aux_data;
 
+	/* Interior nodes only, see bch2_btree_node_lockless_table_update(): */
+	struct btree_lockless_table *lockless_table;
+
 	/*
 	 * Sets of sorted keys - the real btree node - plus a binary search tree
 	 *
@@ -96,6 +130,7 @@ struct btree {
 	u16			whiteout_u64s;
 	u8			byte_order;
 	u8			unpack_fn_len;
+	u8			cmp_fn_len;
 
 	/*
 	 * XXX: add a delete sequence number, so when bch2_btree_node_relock()
@@ -134,6 +169,17 @@ struct btree {
 	__BKEY_PADDED(key, BKEY_BTREE_PTR_VAL_U64s_MAX);
 };
 
+struct btree_cache_stats {
+	u64			hit[BTREE_ID_NR][BTREE_MAX_DEPTH];
+	u64			miss[BTREE_ID_NR][BTREE_MAX_DEPTH];
+	/* Freed by the shrinker: */
+	u64			evict[BTREE_ID_NR][BTREE_MAX_DEPTH];
+	/* Nodes we tried to reclaim, but were locked, dirty or pinned: */
+	u64			reclaim_fail;
+	u64			cannibalize;
+	u64			cannibalize_lock_fail;
+};
+
 struct btree_cache {
 	struct rhashtable	table;
 	bool			table_init_done;
@@ -149,15 +195,24 @@ struct btree_cache {
 	 * high order page allocations can be rather expensive, and it's quite
 	 * common to delete and allocate btree nodes in quick succession. It
 	 * should never grow past ~2-3 nodes in practice.
+	 *
+	 * Live nodes are on one of two lists, 2Q style: nodes start out on
+	 * btree_cache_live (interior nodes excepted) and are moved to
+	 * btree_cache_live_hot if they're accessed again before the shrinker
+	 * gets to them, so that nodes only touched once - by a large scan - are
+	 * evicted first.
 	 */
 	struct mutex		lock;
 	struct list_head	live;
+	struct list_head	live_hot;
 	struct list_head	freeable;
 	struct list_head	freed;
 
 	/* Number of elements in live + freeable lists */
 	unsigned		used;
 	unsigned		reserve;
+	/* Number of interior nodes in the hash table, per btree: */
+	atomic_t		nr_interior[BTREE_ID_NR];
 	atomic_t		dirty;
 	struct shrinker		shrink;
 
@@ -169,6 +224,8 @@ struct btree_cache {
 	 */
 	struct task_struct	*alloc_lock;
 	struct closure_waitlist	alloc_wait;
+
+	struct btree_cache_stats __percpu *stats;
 };
 
 struct btree_node_iter {
@@ -214,6 +271,11 @@ enum btree_iter_type {
 #define BTREE_ITER_SET_POS_AFTER_COMMIT	(1 << 8)
 #define BTREE_ITER_CACHED_NOFILL	(1 << 9)
 #define BTREE_ITER_CACHED_NOCREATE	(1 << 10)
+/*
+ * The leaf node iterator hasn't been initialized, because the leaf's Bloom
+ * filters say there's no key at the iterator's position:
+ */
+#define BTREE_ITER_NODE_ITER_DEFERRED	(1 << 11)
 
 #define BTREE_ITER_USER_FLAGS				\
 	(BTREE_ITER_SLOTS				\
@@ -236,6 +298,7 @@ enum btree_iter_uptodate {
 #define BTREE_ITER_NO_NODE_DOWN		((struct btree *) 5)
 #define BTREE_ITER_NO_NODE_INIT		((struct btree *) 6)
 #define BTREE_ITER_NO_NODE_ERROR	((struct btree *) 7)
+#define BTREE_ITER_NO_NODE_LOCKLESS	((struct btree *) 8)
 
 /*
  * @pos			- iterator's current position
@@ -243,6 +306,7 @@ enum btree_iter_uptodate {
  * @locks_want		- btree level below which we start taking intent locks
  * @nodes_locked	- bitmask indicating which nodes in @nodes are locked
  * @nodes_intent_locked	- bitmask indicating which locks are intent locks
+ * @readahead		- number of leaves to prefetch ahead of a sequential scan
  */
 struct btree_iter {
 	struct btree_trans	*trans;
@@ -251,6 +315,7 @@ struct btree_iter {
 
 	u16			flags;
 	u8			idx;
+	u8			readahead;
 
 	enum btree_id		btree_id:4;
 	enum btree_iter_uptodate uptodate:4;
@@ -272,6 +337,9 @@ struct btree_iter {
 	 */
 	struct bkey		k;
 	unsigned long		ip_allocated;
+
+	/* Start of the next leaf, if we're doing a sequential scan: */
+	struct bpos		readahead_pos;
 };
 
 static inline enum btree_iter_type
@@ -290,6 +358,19 @@ static inline struct btree_iter_level *iter_l(struct btree_iter *iter)
 	return iter->l + iter->level;
 }
 
+struct btree_key_cache_freelist {
+	struct bkey_cached	*objs[16];
+	unsigned		nr;
+};
+
+struct btree_key_cache_stats {
+	u64			hit;
+	u64			miss;
+	u64			evict;
+	/* Clean entries the shrinker couldn't lock: */
+	u64			evict_fail;
+};
+
 struct btree_key_cache {
 	struct mutex		lock;
 	struct rhashtable	table;
@@ -299,6 +380,9 @@ struct btree_key_cache {
 	struct list_head	dirty;
 	struct shrinker		shrink;
 
+	struct btree_key_cache_freelist __percpu *pcpu_freed;
+	struct btree_key_cache_stats __percpu *stats;
+
 	size_t			nr_freed;
 	size_t			nr_keys;
 	size_t			nr_dirty;
@@ -330,6 +414,36 @@ struct bkey_cached {
 	struct bkey_i		*k;
 };
 
+/*
+ * Btree write buffer: updates that don't need to read the btree (and that
+ * aren't ordered with respect to other updates in the same btree) go only to
+ * the journal at commit time, and are applied to the btree later in sorted
+ * batches - see btree_write_buffer.c:
+ */
+#define BTREE_WRITE_BUFFERED_VAL_U64s_MAX	8
+#define BTREE_WRITE_BUFFER_SIZE			4096
+
+struct btree_write_buffered_key {
+	u64			journal_seq;
+	unsigned		journal_offset;
+	enum btree_id		btree:8;
+	__BKEY_PADDED(k, BTREE_WRITE_BUFFERED_VAL_U64s_MAX);
+};
+
+struct btree_write_buffer {
+	struct mutex		flush_lock;
+	struct journal_entry_pin journal_pin;
+
+	spinlock_t		lock;
+	size_t			nr;
+	size_t			size;
+	struct btree_write_buffered_key *keys;
+	/* Keys being flushed, swapped with @keys by the flush path: */
+	struct btree_write_buffered_key *flushing;
+	/* Journal reclaim wanted a flush while one was already running: */
+	bool			flush_pending;
+};
+
 struct btree_insert_entry {
 	unsigned		trigger_flags;
 	unsigned		trans_triggers_run:1;
@@ -337,12 +451,118 @@ struct btree_insert_entry {
 	struct btree_iter	*iter;
 };
 
+/*
+ * Iterators are allocated in chunks: the first chunk comes from the percpu
+ * buffers/mempool along with the updates arrays, the rest are allocated as
+ * needed by btree_trans_iter_alloc(). Chunks are never moved or freed before
+ * bch2_trans_exit(), so iterator pointers stay valid as the table grows:
+ */
 #ifndef CONFIG_LOCKDEP
-#define BTREE_ITER_MAX		64
+#define BTREE_ITER_CHUNK	64
+#define BTREE_ITER_CHUNKS	4
 #else
-#define BTREE_ITER_MAX		32
+#define BTREE_ITER_CHUNK	32
+#define BTREE_ITER_CHUNKS	1
 #endif
 
+#define BTREE_ITER_MAX		(BTREE_ITER_CHUNK * BTREE_ITER_CHUNKS)
+
+#define BCH_TRANS_RESTART_REASONS()		\
+	x(btree_node_reused)			\
+	x(would_deadlock)			\
+	x(mem_realloced)			\
+	x(journal_res_get)			\
+	x(journal_preres_get)			\
+	x(journal_reclaim)			\
+	x(mark_replicas)			\
+	x(fault_inject)				\
+	x(btree_node_split)			\
+	x(mark)					\
+	x(upgrade)				\
+	x(iter_upgrade)				\
+	x(traverse)				\
+	x(write_buffer_flush)
+
+enum btree_trans_restart_reason {
+#define x(n)	BCH_TRANS_RESTART_##n,
+	BCH_TRANS_RESTART_REASONS()
+#undef x
+	BCH_TRANS_RESTART_NR,
+};
+
+/* Histogram of restarts per commit, power of two buckets: */
+#define BCH_TRANS_RESTART_HIST_NR	8
+
+/*
+ * Restarts by transaction caller - a small open addressed hash table: slots
+ * are claimed with cmpxchg() and never freed, and the counts are percpu, so
+ * recording a restart takes no locks:
+ */
+#define BCH_TRANS_RESTART_IPS		64
+
+struct btree_trans_restart_stats {
+	u64			reason[BCH_TRANS_RESTART_NR];
+	u64			restarts_per_commit[BCH_TRANS_RESTART_HIST_NR];
+	u64			ip_nr[BCH_TRANS_RESTART_IPS];
+};
+
+/*
+ * Phases of a transaction commit, timed when the trans_commit_phase_times
+ * debug param is set:
+ */
+#define BCH_TRANS_COMMIT_PHASES()		\
+	x(triggers)				\
+	x(journal_preres)			\
+	x(write_locks)				\
+	x(journal_res)				\
+	x(mark)					\
+	x(insert)				\
+	x(unlock)
+
+enum btree_trans_commit_phase {
+#define x(n)	BCH_TRANS_COMMIT_PHASE_##n,
+	BCH_TRANS_COMMIT_PHASES()
+#undef x
+	BCH_TRANS_COMMIT_PHASE_NR,
+};
+
+/* Commit phase times by transaction caller - open addressed hash table: */
+#define BCH_TRANS_COMMIT_IPS		64
+
+struct btree_trans_commit_ip {
+	unsigned long		ip;
+	u64			nr;
+	u64			max_ns;
+	u64			ns[BCH_TRANS_COMMIT_PHASE_NR];
+};
+
+/*
+ * Lock contention, per btree and level - key cache locks are accounted as an
+ * extra level, BTREE_MAX_DEPTH:
+ */
+
+/* Histogram of time spent waiting, power of two buckets in microseconds: */
+#define BTREE_LOCK_HIST_NR		24
+/* Wait time by call site of the intent lock holder - open addressed hash table: */
+#define BTREE_LOCK_HOLDERS_NR		16
+
+struct btree_lock_holder {
+	unsigned long		ip;
+	u64			nr;
+	u64			wait_ns;
+};
+
+struct btree_lock_contention {
+	spinlock_t		lock;
+	u64			hist[3][BTREE_LOCK_HIST_NR];
+	u64			wait_ns[3];
+	struct btree_lock_holder holders[BTREE_LOCK_HOLDERS_NR];
+};
+
+struct btree_lock_stats {
+	struct btree_lock_contention l[BTREE_ID_NR][BTREE_MAX_DEPTH + 1];
+};
+
 struct btree_trans {
 	struct bch_fs		*c;
 #ifdef CONFIG_BCACHEFS_DEBUG
@@ -357,29 +577,40 @@ struct btree_trans {
 	unsigned long		ip;
 	int			srcu_idx;
 
-	u8			nr_updates;
-	u8			nr_updates2;
+	u16			nr_updates;
+	u16			nr_updates2;
+	u8			restart_reason;
+	unsigned		nr_restarts;
+	u64			commit_phase_start;
+	u64			commit_phase_ns[BCH_TRANS_COMMIT_PHASE_NR];
 	unsigned		used_mempool:1;
 	unsigned		error:1;
 	unsigned		nounlock:1;
 	unsigned		in_traverse_all:1;
+	unsigned		restart_pending:1;
 
-	u64			iters_linked;
-	u64			iters_live;
-	u64			iters_touched;
+	unsigned long		iters_linked[BITS_TO_LONGS(BTREE_ITER_MAX)];
+	unsigned long		iters_live[BITS_TO_LONGS(BTREE_ITER_MAX)];
+	unsigned long		iters_touched[BITS_TO_LONGS(BTREE_ITER_MAX)];
 
 	unsigned		mem_top;
 	unsigned		mem_bytes;
 	void			*mem;
 
-	struct btree_iter	*iters;
+	struct btree_iter	*iters[BTREE_ITER_CHUNKS];
 	struct btree_insert_entry *updates;
 	struct btree_insert_entry *updates2;
 
+	struct btree_write_buffered_key *wb_updates;
+	u16			nr_wb_updates;
+	u16			wb_updates_size;
+
 	/* update path: */
 	struct jset_entry	*extra_journal_entries;
 	unsigned		extra_journal_entry_u64s;
 	struct journal_entry_pin *journal_pin;
+	/* For BTREE_INSERT_JOURNALED: */
+	u64			journaled_seq;
 
 	struct journal_res	journal_res;
 	struct journal_preres	journal_preres;
@@ -389,6 +620,7 @@ struct btree_trans {
 	unsigned		journal_u64s;
 	unsigned		journal_preres_u64s;
 	struct replicas_delta_list *fs_usage_deltas;
+	struct trans_alloc_update *alloc_updates;
 };
 
 #define BTREE_FLAG(flag)						\
@@ -416,6 +648,8 @@ enum btree_flags {
 	BTREE_NODE_old_extent_overwrite,
 	BTREE_NODE_need_rewrite,
 	BTREE_NODE_never_write,
+	BTREE_NODE_merge_candidate,
+	BTREE_NODE_compact_candidate,
 };
 
 BTREE_FLAG(read_in_flight);
@@ -431,6 +665,8 @@ BTREE_FLAG(fake);
 BTREE_FLAG(old_extent_overwrite);
 BTREE_FLAG(need_rewrite);
 BTREE_FLAG(never_write);
+BTREE_FLAG(merge_candidate);
+BTREE_FLAG(compact_candidate);
 
 static inline struct btree_write *btree_current_write(struct btree *b)
 {
@@ -650,6 +886,7 @@ enum btree_insert_ret {
 	BTREE_INSERT_NEED_MARK_REPLICAS,
 	BTREE_INSERT_NEED_JOURNAL_RES,
 	BTREE_INSERT_NEED_JOURNAL_RECLAIM,
+	BTREE_INSERT_NEED_WRITE_BUFFER_FLUSH,
 };
 
 enum btree_gc_coalesce_fail_reason {
@@ -21,6 +21,7 @@ enum btree_insert_flags {
 	__BTREE_INSERT_LAZY_RW,
 	__BTREE_INSERT_USE_RESERVE,
 	__BTREE_INSERT_JOURNAL_REPLAY,
+	__BTREE_INSERT_JOURNALED,
 	__BTREE_INSERT_JOURNAL_RESERVED,
 	__BTREE_INSERT_JOURNAL_RECLAIM,
 	__BTREE_INSERT_NOWAIT,
@@ -46,6 +47,12 @@ enum btree_insert_flags {
 /* Insert is for journal replay - don't get journal reservations: */
 #define BTREE_INSERT_JOURNAL_REPLAY	(1 << __BTREE_INSERT_JOURNAL_REPLAY)
 
+/*
+ * Keys are already in the journal (btree write buffer flush) - don't journal
+ * them again, just pin trans->journaled_seq:
+ */
+#define BTREE_INSERT_JOURNALED		(1 << __BTREE_INSERT_JOURNALED)
+
 /* Indicates that we have pre-reserved space in the journal: */
 #define BTREE_INSERT_JOURNAL_RESERVED	(1 << __BTREE_INSERT_JOURNAL_RESERVED)
 
@@ -70,14 +77,33 @@ int bch2_btree_delete_range_trans(struct btree_trans *, enum btree_id,
 int bch2_btree_delete_range(struct bch_fs *, enum btree_id,
 			    struct bpos, struct bpos, u64 *);
 
+typedef bool (*btree_node_rewrite_pred_fn)(struct bch_fs *, struct btree *,
+					   void *);
+
 int bch2_btree_node_rewrite(struct bch_fs *c, struct btree_iter *,
 			    __le64, unsigned);
+int bch2_btree_node_rewrite_batch(struct bch_fs *, struct btree_iter *,
+				  __le64, unsigned,
+				  btree_node_rewrite_pred_fn, void *);
+int bch2_btree_node_drop_batch(struct bch_fs *, struct btree_iter *,
+			       __le64, unsigned,
+			       btree_node_rewrite_pred_fn, void *);
+
+typedef struct bkey_i *(*btree_bulk_load_fn)(struct bch_fs *, void *);
+
+int bch2_btree_bulk_load(struct bch_fs *, enum btree_id, unsigned,
+			 btree_bulk_load_fn, void *);
+
 int bch2_btree_node_update_key(struct bch_fs *, struct btree_iter *,
 			       struct btree *, struct bkey_i *);
 
 int bch2_trans_update(struct btree_trans *, struct btree_iter *,
 		      struct bkey_i *, enum btree_trigger_flags);
+int bch2_trans_update_buffered(struct btree_trans *, enum btree_id,
+			       struct bkey_i *);
 int __bch2_trans_commit(struct btree_trans *);
+void bch2_trans_commit_phases_to_text(struct printbuf *, struct bch_fs *,
+				      unsigned);
 
 /**
  * bch2_trans_commit - insert keys at given iterator positions
@@ -2,6 +2,7 @@
 
 #include "bcachefs.h"
 #include "alloc_foreground.h"
+#include "bkey_buf.h"
 #include "bkey_methods.h"
 #include "btree_cache.h"
 #include "btree_gc.h"
@@ -137,6 +138,20 @@ bool bch2_btree_node_format_fits(struct bch_fs *c, struct btree *b,
 	return __vstruct_bytes(struct btree_node, u64s) < btree_bytes(c);
 }
 
+/*
+ * A new node filled from a node bigger than its btree's node size - i.e. one
+ * written before the node size was reduced - keeps the space it needs, and will
+ * be split on the next insert that doesn't fit:
+ */
+static void btree_node_size_fit(struct bch_fs *c, struct btree *b)
+{
+	size_t bytes = __vstruct_bytes(struct btree_node,
+				       le16_to_cpu(b->data->keys.u64s) + 1);
+
+	b->node_sectors = max_t(unsigned, b->node_sectors,
+				round_up(bytes, block_bytes(c)) >> 9);
+}
+
 /* Btree node freeing/allocation: */
 
 static void __btree_node_free(struct bch_fs *c, struct btree *b)
@@ -188,9 +203,37 @@ void bch2_btree_node_free_inmem(struct bch_fs *c, struct btree *b,
 	six_unlock_intent(&b->c.lock);
 }
 
+/*
+ * Cached reservations are tagged with the target they were allocated from: we
+ * prefer one from the target we want, else one from a target that's no longer
+ * in use, so that changing the options doesn't strand them:
+ */
+static struct btree_alloc *btree_reserve_cache_find(struct bch_fs *c,
+						    unsigned target)
+{
+	unsigned metadata_target =
+		c->opts.metadata_target ?: c->opts.foreground_target;
+	struct btree_alloc *a, *stale = NULL;
+
+	for (a = c->btree_reserve_cache;
+	     a < c->btree_reserve_cache + c->btree_reserve_cache_nr;
+	     a++) {
+		if (a->target == target)
+			return a;
+
+		if (a->target != metadata_target &&
+		    a->target != c->opts.btree_leaf_target)
+			stale = a;
+	}
+
+	return stale;
+}
+
 static struct btree *__bch2_btree_node_alloc(struct bch_fs *c,
 					     struct disk_reservation *res,
 					     struct closure *cl,
+					     unsigned target,
+					     bool interior,
 					     unsigned flags)
 {
 	struct write_point *wp;
@@ -211,21 +254,20 @@ static struct btree *__bch2_btree_node_alloc(struct bch_fs *c,
 
 	mutex_lock(&c->btree_reserve_cache_lock);
 	if (c->btree_reserve_cache_nr > nr_reserve) {
-		struct btree_alloc *a =
-			&c->btree_reserve_cache[--c->btree_reserve_cache_nr];
-
-		ob = a->ob;
-		bkey_copy(&tmp.k, &a->k);
-		mutex_unlock(&c->btree_reserve_cache_lock);
-		goto mem_alloc;
+		struct btree_alloc *a = btree_reserve_cache_find(c, target);
+
+		if (a) {
+			ob = a->ob;
+			bkey_copy(&tmp.k, &a->k);
+			*a = c->btree_reserve_cache[--c->btree_reserve_cache_nr];
+			mutex_unlock(&c->btree_reserve_cache_lock);
+			goto mem_alloc;
+		}
 	}
 	mutex_unlock(&c->btree_reserve_cache_lock);
 
 retry:
-	wp = bch2_alloc_sectors_start(c,
-				      c->opts.metadata_target ?:
-				      c->opts.foreground_target,
-				      0,
+	wp = bch2_alloc_sectors_start(c, target, 0,
 				      writepoint_ptr(&c->btree_write_point),
 				      &devs_have,
 				      res->nr_replicas,
@@ -256,7 +298,7 @@ static struct btree *__bch2_btree_node_alloc(struct bch_fs *c,
 	bch2_open_bucket_get(c, wp, &ob);
 	bch2_alloc_sectors_done(c, wp);
 mem_alloc:
-	b = bch2_btree_node_mem_alloc(c);
+	b = bch2_btree_node_mem_alloc(c, interior);
 
 	/* we hold cannibalize_lock: */
 	BUG_ON(IS_ERR(b));
@@ -271,13 +313,14 @@ static struct btree *__bch2_btree_node_alloc(struct bch_fs *c,
 static struct btree *bch2_btree_node_alloc(struct btree_update *as, unsigned level)
 {
 	struct bch_fs *c = as->c;
+	struct prealloc_nodes *p = &as->prealloc_nodes[!!level];
 	struct btree *b;
 	int ret;
 
 	BUG_ON(level >= BTREE_MAX_DEPTH);
-	BUG_ON(!as->nr_prealloc_nodes);
+	BUG_ON(!p->nr);
 
-	b = as->prealloc_nodes[--as->nr_prealloc_nodes];
+	b = p->b[--p->nr];
 
 	set_btree_node_accessed(b);
 	set_btree_node_dirty(c, b);
@@ -286,6 +329,9 @@ static struct btree *bch2_btree_node_alloc(struct btree_update *as, unsigned lev
 	bch2_bset_init_first(b, &b->data->keys);
 	b->c.level	= level;
 	b->c.btree_id	= as->btree_id;
+	b->node_sectors	= btree_id_node_sectors(c, as->btree_id);
+	/* The keys we're about to copy in may have been updated just now: */
+	journal_res_pos_reset(&c->journal, &b->c.journal_pos);
 
 	memset(&b->nr, 0, sizeof(b->nr));
 	b->data->magic = cpu_to_le64(bset_magic(c));
@@ -351,6 +397,8 @@ struct btree *__bch2_btree_node_alloc_replacement(struct btree_update *as,
 
 	bch2_btree_sort_into(as->c, n, b);
 
+	btree_node_size_fit(as->c, n);
+
 	btree_node_reset_sib_u64s(n);
 
 	n->key.k.p = b->key.k.p;
@@ -392,44 +440,53 @@ static struct btree *__btree_root_alloc(struct btree_update *as, unsigned level)
 static void bch2_btree_reserve_put(struct btree_update *as)
 {
 	struct bch_fs *c = as->c;
+	unsigned interior;
 
 	mutex_lock(&c->btree_reserve_cache_lock);
 
-	while (as->nr_prealloc_nodes) {
-		struct btree *b = as->prealloc_nodes[--as->nr_prealloc_nodes];
+	for (interior = 0; interior < 2; interior++) {
+		struct prealloc_nodes *p = &as->prealloc_nodes[interior];
 
-		six_unlock_write(&b->c.lock);
+		while (p->nr) {
+			struct btree *b = p->b[--p->nr];
 
-		if (c->btree_reserve_cache_nr <
-		    ARRAY_SIZE(c->btree_reserve_cache)) {
-			struct btree_alloc *a =
-				&c->btree_reserve_cache[c->btree_reserve_cache_nr++];
+			six_unlock_write(&b->c.lock);
 
-			a->ob = b->ob;
-			b->ob.nr = 0;
-			bkey_copy(&a->k, &b->key);
-		} else {
-			bch2_open_buckets_put(c, &b->ob);
-		}
+			if (c->btree_reserve_cache_nr <
+			    ARRAY_SIZE(c->btree_reserve_cache)) {
+				struct btree_alloc *a =
+					&c->btree_reserve_cache[c->btree_reserve_cache_nr++];
 
-		btree_node_lock_type(c, b, SIX_LOCK_write);
-		__btree_node_free(c, b);
-		six_unlock_write(&b->c.lock);
+				a->ob = b->ob;
+				a->target = btree_node_target(c, as->btree_id,
+							      interior);
+				b->ob.nr = 0;
+				bkey_copy(&a->k, &b->key);
+			} else {
+				bch2_open_buckets_put(c, &b->ob);
+			}
 
-		six_unlock_intent(&b->c.lock);
+			btree_node_lock_type(c, b, SIX_LOCK_write);
+			__btree_node_free(c, b);
+			six_unlock_write(&b->c.lock);
+
+			six_unlock_intent(&b->c.lock);
+		}
 	}
 
 	mutex_unlock(&c->btree_reserve_cache_lock);
 }
 
-static int bch2_btree_reserve_get(struct btree_update *as, unsigned nr_nodes,
+static int bch2_btree_reserve_get(struct btree_update *as,
+				  unsigned nr_nodes[2],
 				  unsigned flags, struct closure *cl)
 {
 	struct bch_fs *c = as->c;
 	struct btree *b;
+	unsigned interior;
 	int ret;
 
-	BUG_ON(nr_nodes > BTREE_RESERVE_MAX);
+	BUG_ON(nr_nodes[0] + nr_nodes[1] > BTREE_RESERVE_MAX);
 
 	/*
 	 * Protects reaping from the btree node cache and using the btree node
@@ -439,27 +496,32 @@ static int bch2_btree_reserve_get(struct btree_update *as, unsigned nr_nodes,
 	if (ret)
 		return ret;
 
-	while (as->nr_prealloc_nodes < nr_nodes) {
-		b = __bch2_btree_node_alloc(c, &as->disk_res,
-					    flags & BTREE_INSERT_NOWAIT
-					    ? NULL : cl, flags);
-		if (IS_ERR(b)) {
-			ret = PTR_ERR(b);
-			goto err_free;
-		}
+	for (interior = 0; interior < 2; interior++) {
+		struct prealloc_nodes *p = &as->prealloc_nodes[interior];
+
+		while (p->nr < nr_nodes[interior]) {
+			b = __bch2_btree_node_alloc(c, &as->disk_res,
+					flags & BTREE_INSERT_NOWAIT ? NULL : cl,
+					btree_node_target(c, as->btree_id, interior),
+					interior, flags);
+			if (IS_ERR(b)) {
+				ret = PTR_ERR(b);
+				goto err_free;
+			}
 
-		ret = bch2_mark_bkey_replicas(c, bkey_i_to_s_c(&b->key));
-		if (ret)
-			goto err_free;
+			ret = bch2_mark_bkey_replicas(c, bkey_i_to_s_c(&b->key));
+			if (ret)
+				goto err_free;
 
-		as->prealloc_nodes[as->nr_prealloc_nodes++] = b;
+			p->b[p->nr++] = b;
+		}
 	}
 
 	bch2_btree_cache_cannibalize_unlock(c);
 	return 0;
 err_free:
 	bch2_btree_cache_cannibalize_unlock(c);
-	trace_btree_reserve_get_fail(c, nr_nodes, cl);
+	trace_btree_reserve_get_fail(c, nr_nodes[0] + nr_nodes[1], cl);
 	return ret;
 }
 
@@ -911,7 +973,7 @@ void bch2_btree_update_done(struct btree_update *as)
 
 struct btree_update *
 bch2_btree_update_start(struct btree_trans *trans, enum btree_id id,
-			unsigned nr_nodes, unsigned flags,
+			unsigned nr_nodes[2], unsigned flags,
 			struct closure *cl)
 {
 	struct bch_fs *c = trans->c;
@@ -965,7 +1027,7 @@ bch2_btree_update_start(struct btree_trans *trans, enum btree_id id,
 	}
 
 	ret = bch2_disk_reservation_get(c, &as->disk_res,
-			nr_nodes * c->opts.btree_node_size,
+			(nr_nodes[0] + nr_nodes[1]) * c->opts.btree_node_size,
 			c->opts.metadata_replicas,
 			disk_res_flags);
 	if (ret)
@@ -1094,16 +1156,18 @@ static void bch2_insert_fixup_btree_ptr(struct btree_update *as, struct btree *b
 
 /*
  * Move keys from n1 (original replacement node, now lower node) to n2 (higher
- * node)
+ * node) - at @pivot if non NULL and n2 won't be too big, otherwise 3/5 of the
+ * way through:
  */
 static struct btree *__btree_split_node(struct btree_update *as,
 					struct btree *n1,
-					struct btree_iter *iter)
+					struct btree_iter *iter,
+					const struct bpos *pivot)
 {
-	size_t nr_packed = 0, nr_unpacked = 0;
+	size_t nr_packed, nr_unpacked;
 	struct btree *n2;
 	struct bset *set1, *set2;
-	struct bkey_packed *k, *prev = NULL;
+	struct bkey_packed *k, *prev;
 
 	n2 = bch2_btree_node_alloc(as, n1->c.level);
 	bch2_btree_update_add_new_node(as, n2);
@@ -1122,13 +1186,18 @@ static struct btree *__btree_split_node(struct btree_update *as,
 	 * Has to be a linear search because we don't have an auxiliary
 	 * search tree yet
 	 */
+again:
+	nr_packed = nr_unpacked = 0;
+	prev = NULL;
 	k = set1->start;
 	while (1) {
 		struct bkey_packed *n = bkey_next_skip_noops(k, vstruct_last(set1));
 
 		if (n == vstruct_last(set1))
 			break;
-		if (k->_data - set1->_data >= (le16_to_cpu(set1->u64s) * 3) / 5)
+		if (pivot
+		    ? bkey_cmp_left_packed(n1, k, pivot) >= 0
+		    : k->_data - set1->_data >= (le16_to_cpu(set1->u64s) * 3) / 5)
 			break;
 
 		if (bkey_packed(k))
@@ -1140,6 +1209,14 @@ static struct btree *__btree_split_node(struct btree_update *as,
 		k = n;
 	}
 
+	if (pivot &&
+	    (!prev ||
+	     (u64 *) vstruct_last(set1) - k->_data >
+	     BTREE_SPLIT_THRESHOLD(as->c, as->btree_id))) {
+		pivot = NULL;
+		goto again;
+	}
+
 	BUG_ON(!prev);
 
 	btree_set_max(n1, bkey_unpack_pos(n1, prev));
@@ -1168,6 +1245,8 @@ static struct btree *__btree_split_node(struct btree_update *as,
 		    vstruct_end(set1),
 		    le16_to_cpu(set2->u64s));
 
+	btree_node_size_fit(as->c, n2);
+
 	btree_node_reset_sib_u64s(n1);
 	btree_node_reset_sib_u64s(n2);
 
@@ -1248,6 +1327,7 @@ static void btree_split(struct btree_update *as, struct btree *b,
 	struct bch_fs *c = as->c;
 	struct btree *parent = btree_node_parent(iter, b);
 	struct btree *n1, *n2 = NULL, *n3 = NULL;
+	struct bpos pivot = POS_MIN;
 	u64 start_time = local_clock();
 
 	BUG_ON(!parent && (b != btree_node_root(c, b)));
@@ -1258,13 +1338,16 @@ static void btree_split(struct btree_update *as, struct btree *b,
 	n1 = bch2_btree_node_alloc_replacement(as, b);
 	bch2_btree_update_add_new_node(as, n1);
 
-	if (keys)
+	if (keys) {
+		pivot = bch2_keylist_front(keys)->k.p;
 		btree_split_insert_keys(as, n1, iter, keys);
+	}
 
-	if (bset_u64s(&n1->set[0]) > BTREE_SPLIT_THRESHOLD(c)) {
+	if (bset_u64s(&n1->set[0]) > BTREE_SPLIT_THRESHOLD(c, b->c.btree_id)) {
 		trace_btree_split(c, b);
 
-		n2 = __btree_split_node(as, n1, iter);
+		n2 = __btree_split_node(as, n1, iter,
+					keys && as->append ? &pivot : NULL);
 
 		bch2_btree_build_aux_trees(n2);
 		bch2_btree_build_aux_trees(n1);
@@ -1456,6 +1539,7 @@ int bch2_btree_split_leaf(struct bch_fs *c, struct btree_iter *iter,
 	struct btree *b = iter_l(iter)->b;
 	struct btree_update *as;
 	struct closure cl;
+	unsigned nr_nodes[2] = { 0, 0 };
 	int ret = 0;
 
 	closure_init_stack(&cl);
@@ -1480,13 +1564,15 @@ int bch2_btree_split_leaf(struct bch_fs *c, struct btree_iter *iter,
 	 * instead of locking/reserving all the way to the root:
 	 */
 	if (!bch2_btree_iter_upgrade(iter, U8_MAX)) {
+		bch2_trans_restart_record(trans, BCH_TRANS_RESTART_iter_upgrade);
 		trace_trans_restart_iter_upgrade(trans->ip);
 		ret = -EINTR;
 		goto out;
 	}
 
-	as = bch2_btree_update_start(trans, iter->btree_id,
-		btree_update_reserve_required(c, b), flags,
+	btree_update_reserve_required(c, b, nr_nodes);
+
+	as = bch2_btree_update_start(trans, iter->btree_id, nr_nodes, flags,
 		!(flags & BTREE_INSERT_NOUNLOCK) ? &cl : NULL);
 	if (IS_ERR(as)) {
 		ret = PTR_ERR(as);
@@ -1528,6 +1614,7 @@ void __bch2_foreground_maybe_merge(struct bch_fs *c,
 	struct bkey_i delete;
 	struct btree *b, *m, *n, *prev, *next, *parent;
 	struct closure cl;
+	unsigned nr_nodes[2];
 	size_t sib_u64s;
 	int ret = 0;
 
@@ -1543,7 +1630,7 @@ void __bch2_foreground_maybe_merge(struct bch_fs *c,
 	if (!parent)
 		goto out;
 
-	if (b->sib_u64s[sib] > BTREE_FOREGROUND_MERGE_THRESHOLD(c))
+	if (b->sib_u64s[sib] > BTREE_FOREGROUND_MERGE_THRESHOLD(c, b->c.btree_id))
 		goto out;
 
 	/* XXX: can't be holding read locks */
@@ -1575,16 +1662,16 @@ void __bch2_foreground_maybe_merge(struct bch_fs *c,
 	sib_u64s = btree_node_u64s_with_format(b, &new_f) +
 		btree_node_u64s_with_format(m, &new_f);
 
-	if (sib_u64s > BTREE_FOREGROUND_MERGE_HYSTERESIS(c)) {
-		sib_u64s -= BTREE_FOREGROUND_MERGE_HYSTERESIS(c);
+	if (sib_u64s > BTREE_FOREGROUND_MERGE_HYSTERESIS(c, b->c.btree_id)) {
+		sib_u64s -= BTREE_FOREGROUND_MERGE_HYSTERESIS(c, b->c.btree_id);
 		sib_u64s /= 2;
-		sib_u64s += BTREE_FOREGROUND_MERGE_HYSTERESIS(c);
+		sib_u64s += BTREE_FOREGROUND_MERGE_HYSTERESIS(c, b->c.btree_id);
 	}
 
-	sib_u64s = min(sib_u64s, btree_max_u64s(c));
+	sib_u64s = min(sib_u64s, btree_id_max_u64s(c, b->c.btree_id));
 	b->sib_u64s[sib] = sib_u64s;
 
-	if (b->sib_u64s[sib] > BTREE_FOREGROUND_MERGE_THRESHOLD(c)) {
+	if (b->sib_u64s[sib] > BTREE_FOREGROUND_MERGE_THRESHOLD(c, b->c.btree_id)) {
 		six_unlock_intent(&m->c.lock);
 		goto out;
 	}
@@ -1599,8 +1686,11 @@ void __bch2_foreground_maybe_merge(struct bch_fs *c,
 		goto err_unlock;
 	}
 
-	as = bch2_btree_update_start(trans, iter->btree_id,
-			 btree_update_reserve_required(c, parent) + 1,
+	nr_nodes[0] = nr_nodes[1] = 0;
+	btree_update_reserve_required(c, parent, nr_nodes);
+	nr_nodes[!!level]++;
+
+	as = bch2_btree_update_start(trans, iter->btree_id, nr_nodes,
 			 flags|
 			 BTREE_INSERT_NOFAIL|
 			 BTREE_INSERT_USE_RESERVE,
@@ -1707,66 +1797,256 @@ void __bch2_foreground_maybe_merge(struct bch_fs *c,
 	goto out;
 }
 
+/*
+ * Find and intent lock the siblings following @b in @parent that @pred also
+ * wants rewritten, so that they can all be rewritten with a single update to
+ * the parent node (and a single journal entry):
+ */
+static unsigned btree_node_rewrite_lock_siblings(struct bch_fs *c,
+				struct btree_iter *iter,
+				struct btree *b, struct btree *parent,
+				struct btree **nodes, unsigned max,
+				btree_node_rewrite_pred_fn pred, void *arg)
+{
+	struct btree_node_iter node_iter = iter->l[parent->c.level].iter;
+	struct btree_node_iter sib_iter;
+	struct bkey_packed *k;
+	struct bkey_buf tmp;
+	unsigned i, nr = 1;
+
+	nodes[0] = b;
+
+	k = bch2_btree_node_iter_peek_all(&node_iter, parent);
+	if (!k || bkey_cmp_left_packed(parent, k, &b->key.k.p))
+		return nr;
+
+	bch2_bkey_buf_init(&tmp);
+
+	/* Start reads for the whole batch before we block on any of them: */
+	sib_iter = node_iter;
+	for (i = 1; i < max; i++) {
+		bch2_btree_node_iter_advance(&sib_iter, parent);
+		k = bch2_btree_node_iter_peek(&sib_iter, parent);
+		if (!k)
+			break;
+
+		bch2_bkey_buf_unpack(&tmp, c, parent, k);
+		bch2_btree_node_prefetch(c, iter, tmp.k,
+					 iter->btree_id, b->c.level);
+	}
+
+	sib_iter = node_iter;
+	while (nr < max) {
+		struct btree *m;
+
+		bch2_btree_node_iter_advance(&sib_iter, parent);
+		k = bch2_btree_node_iter_peek(&sib_iter, parent);
+		if (!k)
+			break;
+
+		bch2_bkey_buf_unpack(&tmp, c, parent, k);
+
+		/* Siblings are locked in key order, after @b: */
+		m = bch2_btree_node_get(c, iter, tmp.k, b->c.level,
+					SIX_LOCK_intent, _THIS_IP_);
+		if (IS_ERR(m))
+			break;
+
+		if (!pred(c, m, arg)) {
+			six_unlock_intent(&m->c.lock);
+			break;
+		}
+
+		nodes[nr++] = m;
+	}
+
+	bch2_bkey_buf_exit(&tmp, c);
+	return nr;
+}
+
 static int __btree_node_rewrite(struct bch_fs *c, struct btree_iter *iter,
 				struct btree *b, unsigned flags,
-				struct closure *cl)
+				struct closure *cl,
+				btree_node_rewrite_pred_fn pred, void *arg)
 {
-	struct btree *n, *parent = btree_node_parent(iter, b);
+	struct btree *old[GC_MERGE_NODES], *n[GC_MERGE_NODES];
+	struct btree *parent = btree_node_parent(iter, b);
 	struct btree_update *as;
+	struct keylist keys;
+	u64 keys_buf[BKEY_BTREE_PTR_U64s_MAX * GC_MERGE_NODES];
+	unsigned i, nr = 1, nr_nodes[2] = { 0, 0 };
+
+	old[0] = b;
+
+	if (parent)
+		btree_update_reserve_required(c, parent, nr_nodes);
+
+	if (parent && pred)
+		nr = btree_node_rewrite_lock_siblings(c, iter, b, parent, old,
+				min_t(unsigned, GC_MERGE_NODES,
+				      BTREE_RESERVE_MAX -
+				      nr_nodes[0] - nr_nodes[1]),
+				pred, arg);
+
+	nr_nodes[!!b->c.level] += nr;
 
 	as = bch2_btree_update_start(iter->trans, iter->btree_id,
-		(parent
-		 ? btree_update_reserve_required(c, parent)
-		 : 0) + 1,
-		flags, cl);
+				     nr_nodes, flags, cl);
 	if (IS_ERR(as)) {
 		trace_btree_gc_rewrite_node_fail(c, b);
+		for (i = 1; i < nr; i++)
+			six_unlock_intent(&old[i]->c.lock);
 		return PTR_ERR(as);
 	}
 
-	bch2_btree_interior_update_will_free_node(as, b);
+	bch2_keylist_init(&keys, keys_buf);
 
-	n = bch2_btree_node_alloc_replacement(as, b);
-	bch2_btree_update_add_new_node(as, n);
+	for (i = 0; i < nr; i++) {
+		bch2_btree_interior_update_will_free_node(as, old[i]);
 
-	bch2_btree_build_aux_trees(n);
-	six_unlock_write(&n->c.lock);
+		n[i] = bch2_btree_node_alloc_replacement(as, old[i]);
+		bch2_btree_update_add_new_node(as, n[i]);
 
-	trace_btree_gc_rewrite_node(c, b);
+		bch2_btree_build_aux_trees(n[i]);
+		six_unlock_write(&n[i]->c.lock);
 
-	bch2_btree_node_write(c, n, SIX_LOCK_intent);
+		trace_btree_gc_rewrite_node(c, old[i]);
+
+		bch2_btree_node_write(c, n[i], SIX_LOCK_intent);
+
+		bch2_keylist_add(&keys, &n[i]->key);
+	}
 
 	if (parent) {
-		bch2_keylist_add(&as->parent_keys, &n->key);
-		bch2_btree_insert_node(as, parent, iter, &as->parent_keys, flags);
+		bch2_btree_insert_node(as, parent, iter, &keys, flags);
+		BUG_ON(!bch2_keylist_empty(&keys));
 	} else {
-		bch2_btree_set_root(as, n, iter);
+		bch2_btree_set_root(as, n[0], iter);
+	}
+
+	for (i = 0; i < nr; i++)
+		bch2_btree_update_get_open_buckets(as, n[i]);
+
+	six_lock_increment(&b->c.lock, SIX_LOCK_intent);
+	for (i = 0; i < nr; i++)
+		bch2_btree_iter_node_drop(iter, old[i]);
+	for (i = 0; i < nr; i++)
+		bch2_btree_iter_node_replace(iter, n[i]);
+	for (i = 0; i < nr; i++) {
+		bch2_btree_node_free_inmem(c, old[i], iter);
+		six_unlock_intent(&n[i]->c.lock);
+	}
+
+	bch2_btree_update_done(as);
+	return 0;
+}
+
+/*
+ * Free @b and the following siblings @pred selects, replacing them all with a
+ * single empty node covering the same range: the parent gets a deletion for
+ * each dropped node's key, and the new node's key.
+ *
+ * If the batch was full, *@next_seq is set to the new node's seq, for the
+ * caller to drop it along with the next batch of siblings; @b is then only
+ * dropped if it has siblings to drop with it.
+ */
+static int __btree_node_drop(struct bch_fs *c, struct btree_iter *iter,
+			     struct btree *b, unsigned flags,
+			     struct closure *cl,
+			     btree_node_rewrite_pred_fn pred, void *arg,
+			     bool need_siblings, __le64 *next_seq)
+{
+	struct btree *old[GC_MERGE_NODES], *n;
+	struct btree *parent = btree_node_parent(iter, b);
+	struct btree_update *as;
+	struct keylist keys;
+	u64 keys_buf[BKEY_BTREE_PTR_U64s_MAX + GC_MERGE_NODES * BKEY_U64s];
+	struct bkey_i delete;
+	unsigned i, nr, max, nr_nodes[2] = { 0, 0 };
+
+	BUG_ON(!parent);
+
+	*next_seq = 0;
+
+	btree_update_reserve_required(c, parent, nr_nodes);
+
+	max = min_t(unsigned, GC_MERGE_NODES,
+		    BTREE_RESERVE_MAX - nr_nodes[0] - nr_nodes[1]);
+	nr = btree_node_rewrite_lock_siblings(c, iter, b, parent, old,
+					      max, pred, arg);
+	if (nr == 1 && need_siblings)
+		return 0;
+
+	nr_nodes[!!b->c.level]++;
+
+	as = bch2_btree_update_start(iter->trans, iter->btree_id,
+				     nr_nodes, flags, cl);
+	if (IS_ERR(as)) {
+		for (i = 1; i < nr; i++)
+			six_unlock_intent(&old[i]->c.lock);
+		return PTR_ERR(as);
+	}
+
+	bch2_keylist_init(&keys, keys_buf);
+
+	for (i = 0; i < nr; i++) {
+		bch2_btree_interior_update_will_free_node(as, old[i]);
+
+		if (i + 1 < nr) {
+			bkey_init(&delete.k);
+			delete.k.p = old[i]->key.k.p;
+			bch2_keylist_add(&keys, &delete);
+		}
 	}
 
+	n = bch2_btree_node_alloc(as, b->c.level);
+
+	btree_set_min(n, old[0]->data->min_key);
+	btree_set_max(n, old[nr - 1]->data->max_key);
+	n->data->format = bch2_btree_calc_format(n);
+
+	btree_node_set_format(n, n->data->format);
+	bch2_btree_build_aux_trees(n);
+
+	bch2_btree_update_add_new_node(as, n);
+	six_unlock_write(&n->c.lock);
+
+	bch2_btree_node_write(c, n, SIX_LOCK_intent);
+
+	bch2_keylist_add(&keys, &n->key);
+
+	bch2_btree_insert_node(as, parent, iter, &keys, flags);
+	BUG_ON(!bch2_keylist_empty(&keys));
+
 	bch2_btree_update_get_open_buckets(as, n);
 
+	/* An empty node is the first thing background merging should fold: */
+	bch2_btree_merge_candidate_add(c, n);
+
 	six_lock_increment(&b->c.lock, SIX_LOCK_intent);
-	bch2_btree_iter_node_drop(iter, b);
+	for (i = 0; i < nr; i++)
+		bch2_btree_iter_node_drop(iter, old[i]);
 	bch2_btree_iter_node_replace(iter, n);
-	bch2_btree_node_free_inmem(c, b, iter);
+	for (i = 0; i < nr; i++)
+		bch2_btree_node_free_inmem(c, old[i], iter);
+
+	if (nr == max)
+		*next_seq = n->data->keys.seq;
 	six_unlock_intent(&n->c.lock);
 
 	bch2_btree_update_done(as);
 	return 0;
 }
 
-/**
- * bch_btree_node_rewrite - Rewrite/move a btree node
- *
- * Returns 0 on success, -EINTR or -EAGAIN on failure (i.e.
- * btree_check_reserve() has to wait)
- */
-int bch2_btree_node_rewrite(struct bch_fs *c, struct btree_iter *iter,
-			    __le64 seq, unsigned flags)
+static int __bch2_btree_node_rewrite(struct bch_fs *c, struct btree_iter *iter,
+				     __le64 seq, unsigned flags, bool drop,
+				     btree_node_rewrite_pred_fn pred, void *arg)
 {
 	struct btree_trans *trans = iter->trans;
 	struct closure cl;
 	struct btree *b;
+	__le64 next_seq;
+	bool need_siblings = false;
 	int ret;
 
 	flags |= BTREE_INSERT_NOFAIL;
@@ -1791,7 +2071,22 @@ int bch2_btree_node_rewrite(struct bch_fs *c, struct btree_iter *iter,
 		if (!b || b->data->keys.seq != seq)
 			break;
 
-		ret = __btree_node_rewrite(c, iter, b, flags, &cl);
+		ret = drop
+			? __btree_node_drop(c, iter, b, flags, &cl, pred, arg,
+					    need_siblings, &next_seq)
+			: __btree_node_rewrite(c, iter, b, flags, &cl, pred, arg);
+
+		/*
+		 * Dropping is limited to a few nodes per update: keep folding
+		 * the empty node we just made into the next batch, so that a
+		 * run of dropped nodes leaves just one empty node behind:
+		 */
+		if (!ret && drop && next_seq) {
+			seq		= next_seq;
+			need_siblings	= true;
+			continue;
+		}
+
 		if (ret != -EAGAIN &&
 		    ret != -EINTR)
 			break;
@@ -1809,6 +2104,426 @@ int bch2_btree_node_rewrite(struct bch_fs *c, struct btree_iter *iter,
 	return ret;
 }
 
+/**
+ * bch_btree_node_rewrite - Rewrite/move a btree node
+ *
+ * Returns 0 on success, -EINTR or -EAGAIN on failure (i.e.
+ * btree_check_reserve() has to wait)
+ */
+int bch2_btree_node_rewrite(struct bch_fs *c, struct btree_iter *iter,
+			    __le64 seq, unsigned flags)
+{
+	return __bch2_btree_node_rewrite(c, iter, seq, flags, false, NULL, NULL);
+}
+
+/**
+ * bch2_btree_node_rewrite_batch - Rewrite/move a btree node, along with
+ * following siblings
+ *
+ * Like bch2_btree_node_rewrite(), but siblings after the iterator's node for
+ * which @pred returns true are rewritten in the same interior update - as many
+ * as the btree reserve allows - so they share one update to the parent node and
+ * one journal entry.
+ */
+int bch2_btree_node_rewrite_batch(struct bch_fs *c, struct btree_iter *iter,
+				  __le64 seq, unsigned flags,
+				  btree_node_rewrite_pred_fn pred, void *arg)
+{
+	return __bch2_btree_node_rewrite(c, iter, seq, flags, false, pred, arg);
+}
+
+/**
+ * bch2_btree_node_drop_batch - Drop a btree node and its contents, along with
+ * following siblings
+ *
+ * The iterator's node, and the siblings after it for which @pred returns true,
+ * are freed without their keys being deleted individually, and replaced with a
+ * single empty node spanning the same range - across as many interior updates
+ * as it takes, up to the end of the parent node. Nothing is left behind in the
+ * journal to delete those keys, so the caller must ensure journal replay can't
+ * resurrect them - and that they have no triggers that needed to run.
+ */
+int bch2_btree_node_drop_batch(struct bch_fs *c, struct btree_iter *iter,
+			       __le64 seq, unsigned flags,
+			       btree_node_rewrite_pred_fn pred, void *arg)
+{
+	return __bch2_btree_node_rewrite(c, iter, seq, flags, true, pred, arg);
+}
+
+/* Bulk loading: */
+
+struct btree_bulk_load {
+	btree_bulk_load_fn	fn;
+	void			*arg;
+	enum btree_id		btree_id;
+	unsigned		trigger_flags;
+
+	/* Next key to load, and the last one loaded - to check ordering: */
+	struct bkey_buf		next;
+	bool			have_next;
+	bool			have_last;
+	struct bpos		last;
+
+	/* Keys for the node currently being built, unpacked: */
+	struct keylist		keys;
+	u64			*buf;
+
+	int			err;
+};
+
+static void btree_bulk_load_advance(struct bch_fs *c,
+				    struct btree_bulk_load *s)
+{
+	struct bkey_i *k;
+
+	if (s->have_next) {
+		s->last		= s->next.k->k.p;
+		s->have_last	= true;
+	}
+
+	s->have_next = false;
+
+	k = s->fn(c, s->arg);
+	if (IS_ERR_OR_NULL(k)) {
+		s->err = PTR_ERR_OR_ZERO(k);
+		return;
+	}
+
+	if (s->have_last &&
+	    (btree_node_type_is_extents(s->btree_id)
+	     ? bkey_cmp(bkey_start_pos(&k->k), s->last) < 0
+	     : bkey_cmp(k->k.p, s->last) <= 0)) {
+		bch_err(c, "bulk load: keys out of order");
+		s->err = -EINVAL;
+		return;
+	}
+
+	/* Replicas entries for keys in new nodes have to be marked up front: */
+	s->err = bch2_mark_bkey_replicas(c, bkey_i_to_s_c(k));
+	if (s->err)
+		return;
+
+	bch2_bkey_buf_copy(&s->next, c, k);
+	s->have_next = true;
+}
+
+/* Upper bound on the size of @b's keys when repacked, in any format: */
+static size_t btree_node_u64s_unpacked(struct btree *b)
+{
+	return b->nr.live_u64s +
+		b->nr.packed_keys * (BKEY_U64s - b->format.key_u64s);
+}
+
+/*
+ * Build a node from @b's keys (if @b is non NULL) followed by as many keys from
+ * the stream as fit within @b_max:
+ */
+static struct btree *btree_bulk_load_node(struct btree_update *as,
+					  struct btree *b, struct bpos min,
+					  struct bpos b_max, bool last,
+					  struct btree_bulk_load *s)
+{
+	struct bch_fs *c = as->c;
+	size_t max_u64s = btree_id_max_u64s(c, as->btree_id);
+	struct bkey_format_state format_state;
+	struct bkey_format format;
+	struct btree *n;
+	struct bset *i;
+	struct bkey_packed *out;
+	struct bkey_i *k;
+	struct bpos max;
+
+	if (b)
+		max_u64s -= min(max_u64s, btree_node_u64s_unpacked(b));
+
+	bch2_keylist_init(&s->keys, s->buf);
+
+	while (!s->err &&
+	       s->have_next &&
+	       bkey_cmp(s->next.k->k.p, b_max) <= 0 &&
+	       bch2_keylist_u64s(&s->keys) + s->next.k->k.u64s <= max_u64s) {
+		bch2_keylist_add(&s->keys, s->next.k);
+		btree_bulk_load_advance(c, s);
+	}
+
+	/* Nothing here overwrites an existing key, so these are pure inserts: */
+	if (btree_node_type_needs_gc(as->btree_id) &&
+	    !(s->trigger_flags & BTREE_TRIGGER_NORUN))
+		for_each_keylist_key(&s->keys, k)
+			bch2_mark_key(c, bkey_i_to_s_c(k), 0, k->k.size,
+				      NULL, 0, s->trigger_flags);
+
+	/*
+	 * The last node takes the rest of @b's range - so does this one, if
+	 * there's nothing more to load in it; otherwise it ends just before the
+	 * next key, which starts the next node:
+	 */
+	if (last ||
+	    !s->have_next ||
+	    bkey_cmp(s->next.k->k.p, b_max) > 0)
+		max = b_max;
+	else
+		max = bkey_predecessor(s->next.k->k.p);
+
+	bch2_bkey_format_init(&format_state);
+	bch2_bkey_format_add_pos(&format_state, min);
+	if (b)
+		__bch2_btree_calc_format(&format_state, b);
+	for_each_keylist_key(&s->keys, k)
+		bch2_bkey_format_add_key(&format_state, &k->k);
+	format = bch2_bkey_format_done(&format_state);
+
+	if (b) {
+		n = __bch2_btree_node_alloc_replacement(as, b, format);
+	} else {
+		n = bch2_btree_node_alloc(as, 0);
+		btree_set_min(n, min);
+
+		n->data->format = format;
+		btree_node_set_format(n, format);
+	}
+
+	btree_set_max(n, max);
+
+	i = btree_bset_first(n);
+	out = vstruct_last(i);
+
+	for_each_keylist_key(&s->keys, k) {
+		if (!bch2_bkey_pack(out, k, &n->format))
+			bkey_copy((struct bkey_i *) out, k);
+
+		btree_keys_account_key_add(&n->nr, 0, out);
+		out = bkey_next(out);
+	}
+
+	i->u64s = cpu_to_le16((u64 *) out - i->_data);
+	set_btree_bset_end(n, n->set);
+
+	btree_node_reset_sib_u64s(n);
+	bch2_verify_btree_nr_keys(n);
+
+	bch2_btree_update_add_new_node(as, n);
+	bch2_btree_build_aux_trees(n);
+	six_unlock_write(&n->c.lock);
+
+	bch2_btree_node_write(c, n, SIX_LOCK_intent);
+	return n;
+}
+
+/*
+ * Replace leaf @b, which has no keys at or after the next key to load, with new
+ * nodes holding @b's keys and then as many keys from the stream as fit - built
+ * directly, and spliced into the parent with a single interior update:
+ */
+static int __btree_bulk_load(struct bch_fs *c, struct btree_iter *iter,
+			     struct btree *b, unsigned flags,
+			     struct closure *cl, struct btree_bulk_load *s)
+{
+	struct btree *parent = btree_node_parent(iter, b);
+	struct btree *n[GC_MERGE_NODES], *root = NULL;
+	struct btree_update *as;
+	struct keylist keys;
+	u64 keys_buf[BKEY_BTREE_PTR_U64s_MAX * GC_MERGE_NODES];
+	unsigned i, nr, max_nodes, nr_nodes[2] = { 0, 0 };
+
+	if (parent)
+		btree_update_reserve_required(c, parent, nr_nodes);
+	else
+		nr_nodes[1]++;
+
+	max_nodes = min_t(unsigned, GC_MERGE_NODES,
+			  BTREE_RESERVE_MAX - nr_nodes[0] - nr_nodes[1]);
+	nr_nodes[0] += max_nodes;
+
+	as = bch2_btree_update_start(iter->trans, iter->btree_id,
+				     nr_nodes, flags, cl);
+	if (IS_ERR(as))
+		return PTR_ERR(as);
+
+	/* Parents fill up as we go instead of being split in half: */
+	as->append = true;
+
+	bch2_btree_interior_update_will_free_node(as, b);
+
+	bch2_keylist_init(&keys, keys_buf);
+
+	n[0] = btree_bulk_load_node(as, b, b->data->min_key, b->key.k.p,
+				    max_nodes == 1, s);
+	bch2_keylist_add(&keys, &n[0]->key);
+
+	for (nr = 1;
+	     nr < max_nodes && !s->err && s->have_next &&
+	     bkey_cmp(s->next.k->k.p, b->key.k.p) <= 0;
+	     nr++) {
+		n[nr] = btree_bulk_load_node(as, NULL,
+				bkey_successor(n[nr - 1]->key.k.p),
+				b->key.k.p, nr + 1 == max_nodes, s);
+		bch2_keylist_add(&keys, &n[nr]->key);
+	}
+
+	if (parent) {
+		bch2_btree_insert_node(as, parent, iter, &keys, flags);
+		BUG_ON(!bch2_keylist_empty(&keys));
+	} else if (nr > 1) {
+		/* Depth increases, make a new root */
+		root = __btree_root_alloc(as, 1);
+
+		root->sib_u64s[0] = U16_MAX;
+		root->sib_u64s[1] = U16_MAX;
+
+		btree_split_insert_keys(as, root, iter, &keys);
+
+		bch2_btree_node_write(c, root, SIX_LOCK_intent);
+		bch2_btree_set_root(as, root, iter);
+	} else {
+		bch2_btree_set_root(as, n[0], iter);
+	}
+
+	for (i = 0; i < nr; i++)
+		bch2_btree_update_get_open_buckets(as, n[i]);
+	if (root)
+		bch2_btree_update_get_open_buckets(as, root);
+
+	six_lock_increment(&b->c.lock, SIX_LOCK_intent);
+	bch2_btree_iter_node_drop(iter, b);
+	if (root)
+		bch2_btree_iter_node_replace(iter, root);
+	for (i = 0; i < nr; i++)
+		bch2_btree_iter_node_replace(iter, n[i]);
+	bch2_btree_node_free_inmem(c, b, iter);
+
+	if (root)
+		six_unlock_intent(&root->c.lock);
+	for (i = 0; i < nr; i++)
+		six_unlock_intent(&n[i]->c.lock);
+
+	bch2_btree_update_done(as);
+	return 0;
+}
+
+static int btree_bulk_load_leaf(struct btree_trans *trans,
+				struct btree_iter *iter,
+				struct closure *cl,
+				struct btree_bulk_load *s)
+{
+	struct bch_fs *c = trans->c;
+	struct btree *b;
+	int ret;
+
+	ret = bch2_btree_iter_traverse(iter);
+	if (ret)
+		return ret;
+
+	b = iter_l(iter)->b;
+
+	/*
+	 * Existing keys after the one we're loading, or an extent that
+	 * straddles the end of this leaf? Do a normal insert:
+	 */
+	if (bch2_btree_node_iter_peek(&iter_l(iter)->iter, b) ||
+	    bkey_cmp(s->next.k->k.p, b->key.k.p) > 0)
+		return 1;
+
+	return __btree_bulk_load(c, iter, b, BTREE_INSERT_NOFAIL, cl, s);
+}
+
+/**
+ * bch2_btree_bulk_load - load a sorted stream of keys into a btree
+ *
+ * @fn returns keys in strictly increasing order, NULL at the end of the stream,
+ * or an ERR_PTR(); the key it returns need only stay valid until the next call.
+ *
+ * Where the next key comes after every existing key in its leaf node - always,
+ * when loading into an empty btree or appending past the end of one - leaves
+ * are built directly from the stream and written full, replacing the existing
+ * leaf in a single interior update, a batch of nodes at a time; interior nodes
+ * are filled the same way, left to right. Other keys are inserted normally.
+ *
+ * Keys in nodes built this way don't go through the journal, and the caller
+ * must ensure nothing else updates the range being loaded while it runs.
+ * In memory triggers are run as keys are added to new nodes; transactional
+ * triggers (which update other btrees) aren't, so btrees that have them can
+ * only be loaded with BTREE_TRIGGER_NORUN - by callers that rebuild what the
+ * triggers would have updated themselves, as gc does.
+ */
+int bch2_btree_bulk_load(struct bch_fs *c, enum btree_id id,
+			 unsigned trigger_flags,
+			 btree_bulk_load_fn fn, void *arg)
+{
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct btree_bulk_load s = {
+		.fn		= fn,
+		.arg		= arg,
+		.btree_id	= id,
+		.trigger_flags	= trigger_flags,
+	};
+	struct closure cl;
+	int ret = 0;
+
+	if ((BTREE_NODE_TYPE_HAS_TRANS_TRIGGERS & (1U << id)) &&
+	    !(trigger_flags & BTREE_TRIGGER_NORUN))
+		return -EINVAL;
+
+	s.buf = kvmalloc(btree_bytes(c), GFP_KERNEL);
+	if (!s.buf)
+		return -ENOMEM;
+
+	bch2_bkey_buf_init(&s.next);
+	closure_init_stack(&cl);
+
+	/*
+	 * Pre-existing journal entries mustn't be replayed on top of keys that
+	 * skipped the journal:
+	 */
+	bch2_journal_flush_all_pins(&c->journal);
+	ret = bch2_journal_meta(&c->journal);
+	if (ret)
+		goto out;
+
+	btree_bulk_load_advance(c, &s);
+
+	bch2_trans_init(&trans, c, 0, 0);
+	iter = bch2_trans_get_iter(&trans, id, POS_MIN, BTREE_ITER_INTENT);
+
+	while (!ret && s.have_next) {
+		bch2_trans_begin(&trans);
+		bch2_btree_iter_set_pos(iter, bkey_start_pos(&s.next.k->k));
+
+		if (!down_read_trylock(&c->gc_lock)) {
+			bch2_trans_unlock(&trans);
+			down_read(&c->gc_lock);
+		}
+
+		bch2_btree_iter_upgrade(iter, U8_MAX);
+		ret = btree_bulk_load_leaf(&trans, iter, &cl, &s);
+		bch2_btree_iter_downgrade(iter);
+
+		up_read(&c->gc_lock);
+
+		if (ret > 0) {
+			bch2_trans_update(&trans, iter, s.next.k, trigger_flags);
+			ret = bch2_trans_commit(&trans, NULL, NULL,
+						BTREE_INSERT_NOFAIL);
+			if (!ret)
+				btree_bulk_load_advance(c, &s);
+		}
+
+		if (ret == -EINTR || ret == -EAGAIN) {
+			bch2_trans_unlock(&trans);
+			closure_sync(&cl);
+			ret = 0;
+		}
+	}
+
+	bch2_trans_exit(&trans);
+	closure_sync(&cl);
+out:
+	bch2_bkey_buf_exit(&s.next, c);
+	kvfree(s.buf);
+	return ret ?: s.err;
+}
+
 static void __bch2_btree_node_update_key(struct bch_fs *c,
 					 struct btree_update *as,
 					 struct btree_iter *iter,
@@ -1876,6 +2591,7 @@ int bch2_btree_node_update_key(struct bch_fs *c, struct btree_iter *iter,
 	struct btree_update *as = NULL;
 	struct btree *new_hash = NULL;
 	struct closure cl;
+	unsigned nr_nodes[2];
 	int ret;
 
 	closure_init_stack(&cl);
@@ -1912,12 +2628,15 @@ int bch2_btree_node_update_key(struct bch_fs *c, struct btree_iter *iter,
 			}
 		}
 
-		new_hash = bch2_btree_node_mem_alloc(c);
+		new_hash = bch2_btree_node_mem_alloc(c, b->c.level != 0);
 	}
 retry:
-	as = bch2_btree_update_start(iter->trans, iter->btree_id,
-		parent ? btree_update_reserve_required(c, parent) : 0,
-		BTREE_INSERT_NOFAIL, &cl);
+	nr_nodes[0] = nr_nodes[1] = 0;
+	if (parent)
+		btree_update_reserve_required(c, parent, nr_nodes);
+
+	as = bch2_btree_update_start(iter->trans, iter->btree_id, nr_nodes,
+				     BTREE_INSERT_NOFAIL, &cl);
 
 	if (IS_ERR(as)) {
 		ret = PTR_ERR(as);
@@ -1987,13 +2706,14 @@ void bch2_btree_root_alloc(struct bch_fs *c, enum btree_id id)
 		closure_sync(&cl);
 	} while (ret);
 
-	b = bch2_btree_node_mem_alloc(c);
+	b = bch2_btree_node_mem_alloc(c, false);
 	bch2_btree_cache_cannibalize_unlock(c);
 
 	set_btree_node_fake(b);
 	set_btree_node_need_rewrite(b);
 	b->c.level	= 0;
 	b->c.btree_id	= id;
+	b->node_sectors	= btree_id_node_sectors(c, id);
 
 	bkey_btree_ptr_init(&b->key);
 	b->key.k.p = POS_MAX;
@@ -48,6 +48,11 @@ struct btree_update {
 	} mode;
 
 	unsigned			nodes_written:1;
+	/*
+	 * Keys are being appended (bulk load): split interior nodes at the
+	 * first new key rather than in the middle, so nodes are left full:
+	 */
+	unsigned			append:1;
 
 	enum btree_id			btree_id;
 
@@ -73,9 +78,15 @@ struct btree_update {
 	 */
 	struct journal_entry_pin	journal;
 
-	/* Preallocated nodes we reserve when we start the update: */
-	struct btree			*prealloc_nodes[BTREE_UPDATE_NODES_MAX];
-	unsigned			nr_prealloc_nodes;
+	/*
+	 * Preallocated nodes we reserve when we start the update - leaf and
+	 * interior nodes separately, since they may be placed on different
+	 * targets (see btree_node_target()):
+	 */
+	struct prealloc_nodes {
+		struct btree		*b[BTREE_UPDATE_NODES_MAX];
+		unsigned		nr;
+	}				prealloc_nodes[2];
 
 	/* Nodes being freed: */
 	struct keylist			old_keys;
@@ -120,7 +131,7 @@ struct btree *__bch2_btree_node_alloc_replacement(struct btree_update *,
 
 void bch2_btree_update_done(struct btree_update *);
 struct btree_update *
-bch2_btree_update_start(struct btree_trans *, enum btree_id, unsigned,
+bch2_btree_update_start(struct btree_trans *, enum btree_id, unsigned[2],
 			unsigned, struct closure *);
 
 void bch2_btree_interior_update_will_free_node(struct btree_update *,
@@ -149,7 +160,7 @@ static inline void bch2_foreground_maybe_merge_sibling(struct bch_fs *c,
 		return;
 
 	b = iter->l[level].b;
-	if (b->sib_u64s[sib] > c->btree_foreground_merge_threshold)
+	if (b->sib_u64s[sib] > c->btree_foreground_merge_threshold[b->c.btree_id])
 		return;
 
 	__bch2_foreground_maybe_merge(c, iter, level, flags, sib);
@@ -169,20 +180,47 @@ static inline void bch2_foreground_maybe_merge(struct bch_fs *c,
 void bch2_btree_set_root_for_read(struct bch_fs *, struct btree *);
 void bch2_btree_root_alloc(struct bch_fs *, enum btree_id);
 
-static inline unsigned btree_update_reserve_required(struct bch_fs *c,
-						     struct btree *b)
+/*
+ * Leaf nodes of the extents and reflink btrees are the bulk of the metadata,
+ * and the least latency sensitive - a lookup only touches one of them, after
+ * walking the interior nodes: with btree_leaf_target set they go there, and
+ * everything else stays on metadata_target:
+ */
+static inline unsigned btree_node_target(struct bch_fs *c, enum btree_id id,
+					 unsigned level)
+{
+	if (c->opts.btree_leaf_target && !level &&
+	    (id == BTREE_ID_EXTENTS || id == BTREE_ID_REFLINK))
+		return c->opts.btree_leaf_target;
+
+	return c->opts.metadata_target ?: c->opts.foreground_target;
+}
+
+/*
+ * Adds the number of nodes we might have to allocate in a worst case btree
+ * split operation to @nr_nodes, indexed by whether they're interior nodes:
+ */
+static inline void btree_update_reserve_required(struct bch_fs *c,
+						 struct btree *b,
+						 unsigned nr_nodes[2])
 {
 	unsigned depth = btree_node_root(c, b)->c.level + 1;
+	unsigned nr, nr_level;
 
 	/*
-	 * Number of nodes we might have to allocate in a worst case btree
-	 * split operation - we split all the way up to the root, then allocate
-	 * a new root, unless we're already at max depth:
+	 * We split all the way up to the root, then allocate a new root,
+	 * unless we're already at max depth:
 	 */
 	if (depth < BTREE_MAX_DEPTH)
-		return (depth - b->c.level) * 2 + 1;
+		nr = (depth - b->c.level) * 2 + 1;
 	else
-		return (depth - b->c.level) * 2 - 1;
+		nr = (depth - b->c.level) * 2 - 1;
+
+	/* @b and its new sibling; the rest are above @b: */
+	nr_level = min(nr, 2U);
+
+	nr_nodes[!!b->c.level]	+= nr_level;
+	nr_nodes[1]		+= nr - nr_level;
 }
 
 static inline void btree_node_reset_sib_u64s(struct btree *b)
@@ -234,7 +272,7 @@ static inline ssize_t __bch_btree_u64s_remaining(struct bch_fs *c,
 {
 	ssize_t used = bset_byte_offset(b, end) / sizeof(u64) +
 		b->whiteout_u64s;
-	ssize_t total = c->opts.btree_node_size << 6;
+	ssize_t total = b->node_sectors << 6;
 
 	/* Always leave one extra u64 for bch2_varint_decode: */
 	used++;
@@ -8,6 +8,7 @@
 #include "btree_iter.h"
 #include "btree_key_cache.h"
 #include "btree_locking.h"
+#include "btree_write_buffer.h"
 #include "buckets.h"
 #include "debug.h"
 #include "error.h"
@@ -17,10 +18,110 @@
 #include "keylist.h"
 #include "replicas.h"
 
+#include <linux/hash.h>
 #include <linux/prefetch.h>
 #include <linux/sort.h>
 #include <trace/events/bcachefs.h>
 
+/* Commit phase timing: */
+
+static inline void trans_commit_phase_start(struct btree_trans *trans)
+{
+	if (unlikely(bch2_trans_commit_phase_times))
+		trans->commit_phase_start = local_clock();
+}
+
+static inline void trans_commit_phase_done(struct btree_trans *trans,
+					   enum btree_trans_commit_phase phase)
+{
+	if (unlikely(bch2_trans_commit_phase_times)) {
+		u64 now = local_clock();
+
+		trans->commit_phase_ns[phase] += now - trans->commit_phase_start;
+		trans->commit_phase_start = now;
+	}
+}
+
+static const char * const bch2_trans_commit_phases[] = {
+#define x(n)	#n,
+	BCH_TRANS_COMMIT_PHASES()
+#undef x
+	NULL
+};
+
+/*
+ * Called on successful commit: phase times accumulate across restarts, so they
+ * cover all the attempts it took to get this commit in:
+ */
+static noinline void bch2_trans_commit_phases_record(struct btree_trans *trans)
+{
+	struct bch_fs *c = trans->c;
+	struct btree_trans_commit_ip *p;
+	unsigned i, j, idx = hash_long(trans->ip, ilog2(BCH_TRANS_COMMIT_IPS));
+	u64 total = 0;
+
+	for (j = 0; j < BCH_TRANS_COMMIT_PHASE_NR; j++)
+		total += trans->commit_phase_ns[j];
+
+	trace_trans_commit_phases(trans->ip, trans->commit_phase_ns);
+
+	spin_lock(&c->btree_trans_commit_ips_lock);
+	for (i = 0; i < BCH_TRANS_COMMIT_IPS; i++) {
+		p = c->btree_trans_commit_ips +
+			((idx + i) & (BCH_TRANS_COMMIT_IPS - 1));
+
+		if (!p->ip)
+			p->ip = trans->ip;
+
+		if (p->ip == trans->ip) {
+			p->nr++;
+			p->max_ns = max(p->max_ns, total);
+			for (j = 0; j < BCH_TRANS_COMMIT_PHASE_NR; j++)
+				p->ns[j] += trans->commit_phase_ns[j];
+			break;
+		}
+	}
+
+	if (i == BCH_TRANS_COMMIT_IPS)
+		c->btree_trans_commit_ips_dropped++;
+	spin_unlock(&c->btree_trans_commit_ips_lock);
+
+	memset(trans->commit_phase_ns, 0, sizeof(trans->commit_phase_ns));
+}
+
+/*
+ * Prints slot @idx of the by-caller table, so that debugfs can emit it a page
+ * at a time; idx == BCH_TRANS_COMMIT_IPS prints commits that didn't fit:
+ */
+void bch2_trans_commit_phases_to_text(struct printbuf *out, struct bch_fs *c,
+				      unsigned idx)
+{
+	struct btree_trans_commit_ip p;
+	unsigned i;
+
+	if (idx >= BCH_TRANS_COMMIT_IPS) {
+		pr_buf(out, "commits not by caller:\t%llu\n",
+		       READ_ONCE(c->btree_trans_commit_ips_dropped));
+		return;
+	}
+
+	spin_lock(&c->btree_trans_commit_ips_lock);
+	p = c->btree_trans_commit_ips[idx];
+	spin_unlock(&c->btree_trans_commit_ips_lock);
+
+	if (!p.ip)
+		return;
+
+	pr_buf(out, "%ps:\n", (void *) p.ip);
+	pr_buf(out, "  commits:\t\t%llu\n", p.nr);
+	pr_buf(out, "  max ns:\t\t%llu\n", p.max_ns);
+
+	for (i = 0; i < BCH_TRANS_COMMIT_PHASE_NR; i++)
+		pr_buf(out, "  %s avg ns:\t%llu\n",
+		       bch2_trans_commit_phases[i],
+		       div64_u64(p.ns[i], max(p.nr, 1ULL)));
+}
+
 static inline bool same_leaf_as_prev(struct btree_trans *trans,
 				     struct btree_insert_entry *i)
 {
@@ -181,6 +282,8 @@ static bool btree_insert_key_leaf(struct btree_trans *trans,
 	EBUG_ON(!iter->level &&
 		!test_bit(BCH_FS_BTREE_INTERIOR_REPLAY_DONE, &c->flags));
 
+	bch2_btree_iter_node_iter_resolve(iter);
+
 	if (unlikely(!bch2_btree_bset_insert_key(iter, b,
 					&iter_l(iter)->iter, insert)))
 		return false;
@@ -239,6 +342,8 @@ bch2_trans_journal_preres_get_cold(struct btree_trans *trans, unsigned u64s)
 		return ret;
 
 	if (!bch2_trans_relock(trans)) {
+		bch2_trans_restart_record(trans,
+				BCH_TRANS_RESTART_journal_preres_get);
 		trace_trans_restart_journal_preres_get(trans->ip);
 		return -EINTR;
 	}
@@ -246,6 +351,36 @@ bch2_trans_journal_preres_get_cold(struct btree_trans *trans, unsigned u64s)
 	return 0;
 }
 
+/*
+ * Our reservation has to come after the last one used to update any of the
+ * nodes we're updating, see journal_res_pos_after():
+ */
+static inline bool trans_journal_res_in_order(struct btree_trans *trans)
+{
+	struct btree_insert_entry *i;
+
+	trans_for_each_update2(trans, i)
+		if (!journal_res_pos_after(&trans->journal_res,
+				&iter_l(i->iter)->b->c.journal_pos))
+			return false;
+	return true;
+}
+
+static inline bool trans_journal_res_needs_order(struct btree_trans *trans)
+{
+	struct btree_insert_entry *i;
+
+	/* Only write buffer updates - no node to order against: */
+	if (!trans->nr_updates2)
+		return true;
+
+	trans_for_each_update2(trans, i)
+		if (journal_res_pos_needs_order(&trans->c->journal,
+				&iter_l(i->iter)->b->c.journal_pos))
+			return true;
+	return false;
+}
+
 static inline int bch2_trans_journal_res_get(struct btree_trans *trans,
 					     unsigned flags)
 {
@@ -255,9 +390,24 @@ static inline int bch2_trans_journal_res_get(struct btree_trans *trans,
 	if (trans->flags & BTREE_INSERT_JOURNAL_RESERVED)
 		flags |= JOURNAL_RES_GET_RESERVED;
 
+	if (trans_journal_res_needs_order(trans))
+		flags |= JOURNAL_RES_GET_ORDERED;
+
 	ret = bch2_journal_res_get(&c->journal, &trans->journal_res,
 				   trans->journal_u64s, flags);
 
+	/*
+	 * Raced with the journal entry changing - give back the chunk
+	 * reservation (it's padded out with empty entries) and get one from
+	 * j->reservations:
+	 */
+	if (!ret && unlikely(!trans_journal_res_in_order(trans))) {
+		bch2_journal_res_put(&c->journal, &trans->journal_res);
+		ret = bch2_journal_res_get(&c->journal, &trans->journal_res,
+					   trans->journal_u64s,
+					   flags|JOURNAL_RES_GET_ORDERED);
+	}
+
 	return ret == -EAGAIN ? BTREE_INSERT_NEED_JOURNAL_RES : ret;
 }
 
@@ -312,7 +462,8 @@ static inline void do_btree_insert_one(struct btree_trans *trans,
 	bool did_work;
 
 	EBUG_ON(trans->journal_res.ref !=
-		!(trans->flags & BTREE_INSERT_JOURNAL_REPLAY));
+		!(trans->flags & (BTREE_INSERT_JOURNAL_REPLAY|
+				  BTREE_INSERT_JOURNALED)));
 
 	insert->k.needs_whiteout = false;
 
@@ -322,12 +473,12 @@ static inline void do_btree_insert_one(struct btree_trans *trans,
 	if (!did_work)
 		return;
 
-	if (likely(!(trans->flags & BTREE_INSERT_JOURNAL_REPLAY))) {
+	if (likely(!(trans->flags & (BTREE_INSERT_JOURNAL_REPLAY|
+				     BTREE_INSERT_JOURNALED)))) {
 		bch2_journal_add_keys(j, &trans->journal_res,
 				      iter->btree_id, insert);
-
-		bch2_journal_set_has_inode(j, &trans->journal_res,
-					   insert->k.p.inode);
+		journal_res_pos_update(&iter_l(iter)->b->c.journal_pos,
+				       &trans->journal_res);
 
 		if (trans->journal_seq)
 			*trans->journal_seq = trans->journal_res.seq;
@@ -381,6 +532,8 @@ bch2_trans_commit_write_locked(struct btree_trans *trans,
 	int ret;
 
 	if (race_fault()) {
+		bch2_trans_restart_record(trans,
+				BCH_TRANS_RESTART_fault_inject);
 		trace_trans_restart_fault_inject(trans->ip);
 		return -EINTR;
 	}
@@ -420,7 +573,11 @@ bch2_trans_commit_write_locked(struct btree_trans *trans,
 	 * Don't get journal reservation until after we know insert will
 	 * succeed:
 	 */
-	if (likely(!(trans->flags & BTREE_INSERT_JOURNAL_REPLAY))) {
+	if (unlikely(trans->flags & BTREE_INSERT_JOURNALED)) {
+		EBUG_ON(trans->extra_journal_entry_u64s ||
+			trans->nr_wb_updates);
+		trans->journal_res.seq = trans->journaled_seq;
+	} else if (likely(!(trans->flags & BTREE_INSERT_JOURNAL_REPLAY))) {
 		ret = bch2_trans_journal_res_get(trans,
 				JOURNAL_RES_GET_NONBLOCK);
 		if (ret)
@@ -429,6 +586,8 @@ bch2_trans_commit_write_locked(struct btree_trans *trans,
 		trans->journal_res.seq = c->journal.replay_journal_seq;
 	}
 
+	trans_commit_phase_done(trans, BCH_TRANS_COMMIT_PHASE_journal_res);
+
 	if (unlikely(trans->extra_journal_entry_u64s)) {
 		memcpy_u64s_small(journal_res_entry(&c->journal, &trans->journal_res),
 				  trans->extra_journal_entries,
@@ -460,6 +619,12 @@ bch2_trans_commit_write_locked(struct btree_trans *trans,
 		goto err;
 	}
 
+	if (unlikely(trans->nr_wb_updates)) {
+		ret = bch2_btree_write_buffer_add_trans(trans);
+		if (ret)
+			goto err;
+	}
+
 	trans_for_each_update(trans, i)
 		if (iter_has_nontrans_triggers(i->iter))
 			bch2_mark_update(trans, i->iter, i->k,
@@ -471,8 +636,12 @@ bch2_trans_commit_write_locked(struct btree_trans *trans,
 	if (unlikely(c->gc_pos.phase))
 		bch2_trans_mark_gc(trans);
 
+	trans_commit_phase_done(trans, BCH_TRANS_COMMIT_PHASE_mark);
+
 	trans_for_each_update2(trans, i)
 		do_btree_insert_one(trans, i->iter, i->k);
+
+	trans_commit_phase_done(trans, BCH_TRANS_COMMIT_PHASE_insert);
 err:
 	if (marking) {
 		bch2_fs_usage_scratch_put(c, fs_usage);
@@ -495,6 +664,8 @@ static inline int do_bch2_trans_commit(struct btree_trans *trans,
 	trans_for_each_update2(trans, i)
 		BUG_ON(!btree_node_intent_locked(i->iter, i->iter->level));
 
+	trans_commit_phase_start(trans);
+
 	ret = bch2_journal_preres_get(&trans->c->journal,
 			&trans->journal_preres, trans->journal_preres_u64s,
 			JOURNAL_RES_GET_NONBLOCK|
@@ -506,6 +677,8 @@ static inline int do_bch2_trans_commit(struct btree_trans *trans,
 	if (unlikely(ret))
 		return ret;
 
+	trans_commit_phase_done(trans, BCH_TRANS_COMMIT_PHASE_journal_preres);
+
 	/*
 	 * Can't be holding any read locks when we go to take write locks:
 	 * another thread could be holding an intent lock on the same node we
@@ -520,8 +693,10 @@ static inline int do_bch2_trans_commit(struct btree_trans *trans,
 	trans_for_each_iter(trans, iter) {
 		if (iter->nodes_locked != iter->nodes_intent_locked) {
 			if ((iter->flags & BTREE_ITER_KEEP_UNTIL_COMMIT) ||
-			    (trans->iters_live & (1ULL << iter->idx))) {
+			    test_bit(iter->idx, trans->iters_live)) {
 				if (!bch2_btree_iter_upgrade(iter, 1)) {
+					bch2_trans_restart_record(trans,
+							BCH_TRANS_RESTART_upgrade);
 					trace_trans_restart_upgrade(trans->ip);
 					return -EINTR;
 				}
@@ -541,6 +716,8 @@ static inline int do_bch2_trans_commit(struct btree_trans *trans,
 			bch2_btree_node_lock_for_insert(trans->c,
 					iter_l(i->iter)->b, i->iter);
 
+	trans_commit_phase_done(trans, BCH_TRANS_COMMIT_PHASE_write_locks);
+
 	ret = bch2_trans_commit_write_locked(trans, stopped_at);
 
 	trans_for_each_update2(trans, i)
@@ -558,6 +735,8 @@ static inline int do_bch2_trans_commit(struct btree_trans *trans,
 	 */
 	bch2_journal_res_put(&trans->c->journal, &trans->journal_res);
 
+	trans_commit_phase_done(trans, BCH_TRANS_COMMIT_PHASE_unlock);
+
 	if (unlikely(ret))
 		return ret;
 
@@ -566,9 +745,14 @@ static inline int do_bch2_trans_commit(struct btree_trans *trans,
 
 	trans_for_each_update2(trans, i)
 		if (btree_iter_type(i->iter) != BTREE_ITER_CACHED &&
-		    !same_leaf_as_prev(trans, i))
+		    !same_leaf_as_prev(trans, i)) {
+			bch2_btree_merge_candidate_add(trans->c,
+						       iter_l(i->iter)->b);
+			bch2_btree_compact_candidate_add(trans->c,
+							 iter_l(i->iter)->b);
 			bch2_foreground_maybe_merge(trans->c, i->iter,
 						    0, trans->flags);
+		}
 
 	trans->nounlock = false;
 
@@ -621,6 +805,8 @@ int bch2_trans_commit_error(struct btree_trans *trans,
 		if (!ret ||
 		    ret == -EINTR ||
 		    (flags & BTREE_INSERT_NOUNLOCK)) {
+			bch2_trans_restart_record(trans,
+					BCH_TRANS_RESTART_btree_node_split);
 			trace_trans_restart_btree_node_split(trans->ip);
 			ret = -EINTR;
 		}
@@ -640,6 +826,8 @@ int bch2_trans_commit_error(struct btree_trans *trans,
 		if (bch2_trans_relock(trans))
 			return 0;
 
+		bch2_trans_restart_record(trans,
+				BCH_TRANS_RESTART_mark_replicas);
 		trace_trans_restart_mark_replicas(trans->ip);
 		ret = -EINTR;
 		break;
@@ -653,6 +841,8 @@ int bch2_trans_commit_error(struct btree_trans *trans,
 		if (bch2_trans_relock(trans))
 			return 0;
 
+		bch2_trans_restart_record(trans,
+				BCH_TRANS_RESTART_journal_res_get);
 		trace_trans_restart_journal_res_get(trans->ip);
 		ret = -EINTR;
 		break;
@@ -668,9 +858,25 @@ int bch2_trans_commit_error(struct btree_trans *trans,
 		if (!ret && bch2_trans_relock(trans))
 			return 0;
 
+		bch2_trans_restart_record(trans,
+				BCH_TRANS_RESTART_journal_reclaim);
 		trace_trans_restart_journal_reclaim(trans->ip);
 		ret = -EINTR;
 		break;
+	case BTREE_INSERT_NEED_WRITE_BUFFER_FLUSH:
+		bch2_trans_unlock(trans);
+
+		ret = bch2_btree_write_buffer_flush(c);
+		if (ret)
+			return ret;
+
+		if (bch2_trans_relock(trans))
+			return 0;
+
+		bch2_trans_restart_record(trans,
+				BCH_TRANS_RESTART_write_buffer_flush);
+		ret = -EINTR;
+		break;
 	default:
 		BUG_ON(ret >= 0);
 		break;
@@ -830,14 +1036,23 @@ static int extent_handle_overwrites(struct btree_trans *trans,
 int __bch2_trans_commit(struct btree_trans *trans)
 {
 	struct btree_insert_entry *i = NULL;
+	struct btree_write_buffered_key *wb;
 	struct btree_iter *iter;
 	bool trans_trigger_run;
 	unsigned u64s;
 	int ret = 0;
 
-	if (!trans->nr_updates)
+	if (!trans->nr_updates &&
+	    !trans->nr_wb_updates &&
+	    !trans->alloc_updates)
 		goto out_reset;
 
+	/* see btree_trans_iter_alloc(): */
+	if (unlikely(trans->restart_pending)) {
+		ret = -EINTR;
+		goto out_reset;
+	}
+
 	if (trans->flags & BTREE_INSERT_GC_LOCK_HELD)
 		lockdep_assert_held(&trans->c->gc_lock);
 
@@ -861,6 +1076,8 @@ int __bch2_trans_commit(struct btree_trans *trans)
 					i->iter->btree_id, i->iter->pos);
 #endif
 
+	trans_commit_phase_start(trans);
+
 	/*
 	 * Running triggers will append more updates to the list of updates as
 	 * we're walking it:
@@ -871,6 +1088,8 @@ int __bch2_trans_commit(struct btree_trans *trans)
 		trans_for_each_update(trans, i) {
 			ret = bch2_btree_iter_traverse(i->iter);
 			if (unlikely(ret)) {
+				bch2_trans_restart_record(trans,
+						BCH_TRANS_RESTART_traverse);
 				trace_trans_restart_traverse(trans->ip);
 				goto out;
 			}
@@ -881,6 +1100,8 @@ int __bch2_trans_commit(struct btree_trans *trans)
 			 */
 			if (unlikely(!btree_node_intent_locked(i->iter, i->iter->level) &&
 				     !__bch2_btree_iter_upgrade(i->iter, i->iter->level + 1))) {
+				bch2_trans_restart_record(trans,
+						BCH_TRANS_RESTART_upgrade);
 				trace_trans_restart_upgrade(trans->ip);
 				ret = -EINTR;
 				goto out;
@@ -894,14 +1115,32 @@ int __bch2_trans_commit(struct btree_trans *trans)
 				ret = bch2_trans_mark_update(trans, i->iter, i->k,
 							     i->trigger_flags);
 				if (unlikely(ret)) {
-					if (ret == -EINTR)
+					if (ret == -EINTR) {
+						bch2_trans_restart_record(trans,
+								BCH_TRANS_RESTART_mark);
 						trace_trans_restart_mark(trans->ip);
+					}
 					goto out;
 				}
 			}
 		}
+
+		/*
+		 * Alloc key updates from triggers are batched up, and added to
+		 * the list of updates once all triggers have run:
+		 */
+		if (!trans_trigger_run && trans->alloc_updates) {
+			ret = bch2_trans_alloc_updates_flush(trans);
+			if (unlikely(ret < 0))
+				goto out;
+
+			trans_trigger_run = ret > 0;
+			ret = 0;
+		}
 	} while (trans_trigger_run);
 
+	trans_commit_phase_done(trans, BCH_TRANS_COMMIT_PHASE_triggers);
+
 	/* Turn extents updates into keys: */
 	trans_for_each_update(trans, i)
 		if (i->iter->flags & BTREE_ITER_IS_EXTENTS) {
@@ -938,6 +1177,14 @@ int __bch2_trans_commit(struct btree_trans *trans)
 			trans->journal_preres_u64s += u64s;
 		trans->journal_u64s += u64s;
 	}
+
+	/* Triggers may also have added buffered updates: */
+	bch2_trans_wb_updates_dedup(trans);
+
+	for (wb = trans->wb_updates;
+	     wb < trans->wb_updates + trans->nr_wb_updates;
+	     wb++)
+		trans->journal_u64s += jset_u64s(wb->k.k.u64s);
 retry:
 	memset(&trans->journal_res, 0, sizeof(trans->journal_res));
 
@@ -949,8 +1196,13 @@ int __bch2_trans_commit(struct btree_trans *trans)
 	if (ret)
 		goto err;
 
+	bch2_trans_restarts_per_commit(trans);
+
+	if (unlikely(bch2_trans_commit_phase_times))
+		bch2_trans_commit_phases_record(trans);
+
 	trans_for_each_iter(trans, iter)
-		if ((trans->iters_live & (1ULL << iter->idx)) &&
+		if (test_bit(iter->idx, trans->iters_live) &&
 		    (iter->flags & BTREE_ITER_SET_POS_AFTER_COMMIT))
 			bch2_btree_iter_set_pos(iter, iter->pos_after_commit);
 out:
@@ -970,6 +1222,48 @@ int __bch2_trans_commit(struct btree_trans *trans)
 	goto retry;
 }
 
+/**
+ * bch2_trans_update_buffered - add an update via the btree write buffer
+ *
+ * The update is journalled when the transaction commits, but only applied to
+ * the btree later (and it isn't visible to lookups until then) - see
+ * btree_write_buffer.c. Not for extents, and a btree that's updated via the
+ * write buffer shouldn't also be updated directly.
+ *
+ * Updates to the same position within a transaction replace each other, since
+ * the flush wouldn't otherwise know which of them came last - duplicates are
+ * dropped at commit time, see bch2_trans_wb_updates_dedup().
+ */
+int bch2_trans_update_buffered(struct btree_trans *trans,
+			       enum btree_id btree,
+			       struct bkey_i *k)
+{
+	struct btree_write_buffered_key *i;
+
+	EBUG_ON(btree_node_type_is_extents(btree));
+	EBUG_ON(bkey_val_u64s(&k->k) > BTREE_WRITE_BUFFERED_VAL_U64s_MAX);
+
+	if (trans->nr_wb_updates == trans->wb_updates_size) {
+		unsigned new_size = max_t(unsigned, trans->wb_updates_size * 2, 8);
+
+		i = bch2_trans_kmalloc(trans, sizeof(*i) * new_size);
+		if (IS_ERR(i))
+			return PTR_ERR(i);
+
+		memcpy(i, trans->wb_updates,
+		       sizeof(*i) * trans->nr_wb_updates);
+		trans->wb_updates	= i;
+		trans->wb_updates_size	= new_size;
+	}
+
+	i = trans->wb_updates + trans->nr_wb_updates;
+	i->journal_seq		= 0;
+	i->journal_offset	= trans->nr_wb_updates++;
+	i->btree		= btree;
+	bkey_copy(&i->k, k);
+	return 0;
+}
+
 int bch2_trans_update(struct btree_trans *trans, struct btree_iter *iter,
 		      struct bkey_i *k, enum btree_trigger_flags flags)
 {
@@ -1033,7 +1327,7 @@ int bch2_trans_update(struct btree_trans *trans, struct btree_iter *iter,
 		 * the iterator pos if some other code is using it, so we may
 		 * need to clone it:
 		 */
-		if (trans->iters_live & (1ULL << i->iter->idx)) {
+		if (test_bit(i->iter->idx, trans->iters_live)) {
 			i->iter = bch2_trans_copy_iter(trans, i->iter);
 
 			i->iter->flags |= BTREE_ITER_KEEP_UNTIL_COMMIT;
@@ -1095,6 +1389,71 @@ int bch2_btree_delete_at(struct btree_trans *trans,
 				 BTREE_INSERT_NOFAIL|flags);
 }
 
+/*
+ * Btrees whose keys can be dropped wholesale by a range delete: no triggers
+ * that have to see each key deleted, and no write buffer that might still be
+ * holding an older update to flush on top of the deletion:
+ */
+#define BTREE_ID_DROP_RANGE_OK				\
+	((1U << BTREE_ID_DIRENTS)|			\
+	 (1U << BTREE_ID_XATTRS)|			\
+	 (1U << BTREE_ID_QUOTAS))
+
+struct btree_drop_range {
+	struct bpos		start;
+	struct bpos		end;
+};
+
+static bool btree_node_droppable(struct bch_fs *c, struct btree *b, void *_r)
+{
+	struct btree_drop_range *r = _r;
+	struct bset_tree *t;
+
+	if (b->c.level ||
+	    bkey_cmp(b->data->min_key, r->start) < 0 ||
+	    bkey_cmp(b->key.k.p, r->end) >= 0 ||
+	    btree_node_dirty(b) ||
+	    btree_node_write_in_flight(b))
+		return false;
+
+	/*
+	 * No whiteouts are left behind for the keys in a dropped node, so
+	 * journal replay must not be able to reinsert any of them:
+	 */
+	for_each_bset(b, t)
+		if (le64_to_cpu(bset(b, t)->journal_seq) >=
+		    c->journal.last_seq_ondisk)
+			return false;
+
+	return true;
+}
+
+/*
+ * If the iterator's leaf node lies entirely within the range being deleted,
+ * drop it - along with as many following leaves that also do - with a single
+ * interior update, instead of deleting every key: returns 1 if nodes were
+ * dropped.
+ */
+static int btree_delete_range_drop_nodes(struct btree_trans *trans,
+					 struct btree_iter *iter,
+					 struct bpos start, struct bpos end)
+{
+	struct bch_fs *c = trans->c;
+	struct btree_drop_range r = { .start = start, .end = end };
+	struct btree *b = iter_l(iter)->b;
+	int ret;
+
+	if (!(BTREE_ID_DROP_RANGE_OK & (1U << iter->btree_id)) ||
+	    iter->level ||
+	    btree_node_root(c, b) == b ||
+	    !btree_node_droppable(c, b, &r))
+		return 0;
+
+	ret = bch2_btree_node_drop_batch(c, iter, b->data->keys.seq, 0,
+					 btree_node_droppable, &r);
+	return ret ?: 1;
+}
+
 int bch2_btree_delete_range_trans(struct btree_trans *trans, enum btree_id id,
 				  struct bpos start, struct bpos end,
 				  u64 *journal_seq)
@@ -1112,6 +1471,14 @@ int bch2_btree_delete_range_trans(struct btree_trans *trans, enum btree_id id,
 
 		bch2_trans_begin(trans);
 
+		ret = btree_delete_range_drop_nodes(trans, iter, start, end);
+		if (ret < 0)
+			break;
+		if (ret) {
+			ret = 0;
+			continue;
+		}
+
 		bkey_init(&delete.k);
 
 		/*
@@ -0,0 +1,322 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include "bcachefs.h"
+#include "btree_iter.h"
+#include "btree_update.h"
+#include "btree_write_buffer.h"
+#include "error.h"
+#include "journal.h"
+#include "journal_reclaim.h"
+
+#include <linux/sort.h>
+
+/*
+ * Btree write buffer:
+ *
+ * Updates added with bch2_trans_update_buffered() don't touch the btree at
+ * commit time: they're added to the journal along with the rest of the
+ * transaction, and to an in memory buffer that pins the journal. When the
+ * buffer fills up, or journal reclaim wants that journal entry, we flush it:
+ * the keys are sorted and inserted in large batches, so we walk the btree in
+ * order and take each leaf lock once for many keys - and only the newest key
+ * at a given position is inserted.
+ *
+ * Since buffered keys are normal btree_keys journal entries, journal replay
+ * needs nothing special - and the flush doesn't journal them a second time:
+ * the btree nodes it updates pin the journal entry the keys are already in.
+ *
+ * Buffered updates aren't visible to lookups until the buffer is flushed, and
+ * since keys are applied in journal order only relative to other buffered
+ * keys, a btree (or range of a btree) should only ever be updated via the
+ * write buffer.
+ */
+
+#define BTREE_WRITE_BUFFER_BATCH	32
+
+static int btree_write_buffered_key_cmp(const void *_l, const void *_r)
+{
+	const struct btree_write_buffered_key *l = _l;
+	const struct btree_write_buffered_key *r = _r;
+
+	return  cmp_int(l->btree, r->btree) ?:
+		bkey_cmp(l->k.k.p, r->k.k.p) ?:
+		cmp_int(l->journal_seq, r->journal_seq) ?:
+		cmp_int(l->journal_offset, r->journal_offset);
+}
+
+static int btree_write_buffer_insert_batch(struct btree_trans *trans,
+					   struct btree_write_buffered_key *i,
+					   struct btree_write_buffered_key *end,
+					   struct btree_write_buffered_key **batch_end)
+{
+	struct btree_write_buffered_key *start = i;
+	struct btree_iter *iter;
+	int ret = 0;
+
+	for (; i < end && i < start + BTREE_WRITE_BUFFER_BATCH; i++) {
+		/* Superseded by a newer key at the same position: */
+		if (i + 1 < end &&
+		    i[0].btree == i[1].btree &&
+		    !bkey_cmp(i[0].k.k.p, i[1].k.k.p))
+			continue;
+
+		iter = bch2_trans_get_iter(trans, i->btree, i->k.k.p,
+					   BTREE_ITER_INTENT);
+		ret   = bch2_btree_iter_traverse(iter) ?:
+			bch2_trans_update(trans, iter, &i->k, 0);
+		bch2_trans_iter_put(trans, iter);
+		if (ret)
+			return ret;
+	}
+
+	*batch_end = i;
+	return 0;
+}
+
+static int __bch2_btree_write_buffer_flush(struct btree_trans *trans)
+{
+	struct bch_fs *c = trans->c;
+	struct journal *j = &c->journal;
+	struct btree_write_buffer *wb = &c->btree_write_buffer;
+	struct btree_write_buffered_key *i, *end, *batch_end;
+	struct journal_entry_pin pin;
+	int ret = 0;
+
+	lockdep_assert_held(&wb->flush_lock);
+
+	memset(&pin, 0, sizeof(pin));
+
+	/*
+	 * Take the keys, and transfer the journal pin to our own pin - new
+	 * keys may be added while we're flushing:
+	 */
+	spin_lock(&wb->lock);
+	swap(wb->keys, wb->flushing);
+	end = wb->flushing + wb->nr;
+	wb->nr = 0;
+
+	bch2_journal_pin_copy(j, &pin, &wb->journal_pin, NULL);
+	bch2_journal_pin_drop(j, &wb->journal_pin);
+	spin_unlock(&wb->lock);
+
+	sort(wb->flushing, end - wb->flushing, sizeof(wb->flushing[0]),
+	     btree_write_buffered_key_cmp, NULL);
+
+	/*
+	 * The keys are journalled at or after pin.seq, which we hold until
+	 * they're in the btree; btree node splits still need journal space,
+	 * which bch2_btree_update_start() gets from the reclaim reserve:
+	 */
+	trans->journaled_seq = pin.seq;
+
+	for (i = wb->flushing; i < end; i = batch_end) {
+		ret = __bch2_trans_do(trans, NULL, NULL,
+				      BTREE_INSERT_NOCHECK_RW|
+				      BTREE_INSERT_NOFAIL|
+				      BTREE_INSERT_JOURNALED|
+				      BTREE_INSERT_JOURNAL_RESERVED|
+				      BTREE_INSERT_JOURNAL_RECLAIM,
+				btree_write_buffer_insert_batch(trans, i, end,
+								&batch_end));
+		if (ret) {
+			bch2_fs_fatal_err_on(!bch2_journal_error(j), c,
+				"error flushing btree write buffer: %i", ret);
+			break;
+		}
+	}
+
+	bch2_journal_pin_drop(j, &pin);
+	return ret;
+}
+
+static void btree_write_buffer_journal_flush(struct journal *,
+					     struct journal_entry_pin *, u64);
+
+static void btree_write_buffer_flush_unlock(struct bch_fs *c)
+{
+	struct journal *j = &c->journal;
+	struct btree_write_buffer *wb = &c->btree_write_buffer;
+
+	mutex_unlock(&wb->flush_lock);
+
+	/*
+	 * If journal reclaim tried to flush the write buffer while we were
+	 * running, it skipped our pin: put it back on the list now that we're
+	 * done, so that keys added since we started get flushed:
+	 */
+	spin_lock(&wb->lock);
+	if (wb->flush_pending) {
+		wb->flush_pending = false;
+		if (journal_pin_active(&wb->journal_pin))
+			bch2_journal_pin_set(j, wb->journal_pin.seq,
+					     &wb->journal_pin,
+					     btree_write_buffer_journal_flush);
+	}
+	spin_unlock(&wb->lock);
+}
+
+int bch2_btree_write_buffer_flush(struct bch_fs *c)
+{
+	struct btree_write_buffer *wb = &c->btree_write_buffer;
+	struct btree_trans trans;
+	int ret;
+
+	bch2_trans_init(&trans, c, 0, 0);
+
+	mutex_lock(&wb->flush_lock);
+	ret = __bch2_btree_write_buffer_flush(&trans);
+	btree_write_buffer_flush_unlock(c);
+
+	bch2_trans_exit(&trans);
+	return ret;
+}
+
+static void btree_write_buffer_journal_flush(struct journal *j,
+					     struct journal_entry_pin *pin,
+					     u64 seq)
+{
+	struct bch_fs *c = container_of(j, struct bch_fs, journal);
+	struct btree_write_buffer *wb = &c->btree_write_buffer;
+	struct btree_trans trans;
+
+	/*
+	 * If someone else is flushing, they may be waiting on journal reclaim
+	 * so we can't block here. Journal reclaim won't call us again for this
+	 * pin unless it's put back on the list of pins to flush - but doing
+	 * that here would have reclaim spinning on us until the other flush
+	 * finishes, so leave it to the other flush to do when it unlocks.
+	 *
+	 * Retry the trylock after setting flush_pending, in case the other
+	 * flush unlocked before it could see it:
+	 */
+	if (!mutex_trylock(&wb->flush_lock)) {
+		spin_lock(&wb->lock);
+		wb->flush_pending = true;
+		spin_unlock(&wb->lock);
+
+		if (!mutex_trylock(&wb->flush_lock))
+			return;
+	}
+
+	bch2_trans_init(&trans, c, 0, 0);
+	__bch2_btree_write_buffer_flush(&trans);
+	bch2_trans_exit(&trans);
+
+	btree_write_buffer_flush_unlock(c);
+}
+
+/*
+ * Updates to the same position within a transaction replace each other, since
+ * the flush couldn't otherwise tell which came last: until the transaction is
+ * journalled, journal_offset is the order they were added in, so sort and keep
+ * the last of each position.
+ */
+void bch2_trans_wb_updates_dedup(struct btree_trans *trans)
+{
+	struct btree_write_buffered_key *i, *dst = trans->wb_updates;
+
+	if (trans->nr_wb_updates < 2)
+		return;
+
+	sort(trans->wb_updates, trans->nr_wb_updates,
+	     sizeof(trans->wb_updates[0]),
+	     btree_write_buffered_key_cmp, NULL);
+
+	for (i = trans->wb_updates;
+	     i < trans->wb_updates + trans->nr_wb_updates;
+	     i++) {
+		if (i + 1 < trans->wb_updates + trans->nr_wb_updates &&
+		    i[0].btree == i[1].btree &&
+		    !bkey_cmp(i[0].k.k.p, i[1].k.k.p))
+			continue;
+
+		if (dst != i)
+			*dst = *i;
+		dst++;
+	}
+
+	trans->nr_wb_updates = dst - trans->wb_updates;
+}
+
+/*
+ * Called from the commit path with the transaction's journal reservation held,
+ * after the last point the commit can fail: journal the transaction's buffered
+ * keys and add them to the write buffer.
+ */
+int bch2_btree_write_buffer_add_trans(struct btree_trans *trans)
+{
+	struct bch_fs *c = trans->c;
+	struct journal *j = &c->journal;
+	struct btree_write_buffer *wb = &c->btree_write_buffer;
+	struct btree_write_buffered_key *i, *dst;
+	bool kick_reclaim;
+
+	EBUG_ON(trans->flags & BTREE_INSERT_JOURNAL_REPLAY);
+
+	spin_lock(&wb->lock);
+	if (wb->nr + trans->nr_wb_updates > wb->size) {
+		spin_unlock(&wb->lock);
+		return BTREE_INSERT_NEED_WRITE_BUFFER_FLUSH;
+	}
+
+	dst = wb->keys + wb->nr;
+
+	for (i = trans->wb_updates;
+	     i < trans->wb_updates + trans->nr_wb_updates;
+	     i++, dst++) {
+		i->journal_seq		= trans->journal_res.seq;
+		i->journal_offset	= trans->journal_res.offset;
+
+		bch2_journal_add_keys(j, &trans->journal_res, i->btree, &i->k);
+
+		*dst = *i;
+	}
+
+	wb->nr += trans->nr_wb_updates;
+	kick_reclaim = bch2_btree_write_buffer_should_flush(c);
+
+	bch2_journal_pin_add(j, trans->journal_res.seq, &wb->journal_pin,
+			     btree_write_buffer_journal_flush);
+	spin_unlock(&wb->lock);
+
+	if (trans->journal_seq)
+		*trans->journal_seq = trans->journal_res.seq;
+
+	if (kick_reclaim)
+		journal_reclaim_kick(j);
+	return 0;
+}
+
+void bch2_btree_write_buffer_to_text(struct printbuf *out, struct bch_fs *c)
+{
+	struct btree_write_buffer *wb = &c->btree_write_buffer;
+
+	pr_buf(out, "nr:\t%zu\n", READ_ONCE(wb->nr));
+	pr_buf(out, "size:\t%zu\n", wb->size);
+}
+
+void bch2_fs_btree_write_buffer_exit(struct bch_fs *c)
+{
+	struct btree_write_buffer *wb = &c->btree_write_buffer;
+
+	BUG_ON(wb->nr && !bch2_journal_error(&c->journal));
+
+	kvfree(wb->flushing);
+	kvfree(wb->keys);
+}
+
+int bch2_fs_btree_write_buffer_init(struct bch_fs *c)
+{
+	struct btree_write_buffer *wb = &c->btree_write_buffer;
+
+	mutex_init(&wb->flush_lock);
+	spin_lock_init(&wb->lock);
+	wb->size = BTREE_WRITE_BUFFER_SIZE;
+
+	wb->keys	= kvmalloc_array(wb->size, sizeof(*wb->keys), GFP_KERNEL);
+	wb->flushing	= kvmalloc_array(wb->size, sizeof(*wb->flushing), GFP_KERNEL);
+	if (!wb->keys || !wb->flushing)
+		return -ENOMEM;
+
+	return 0;
+}
@@ -0,0 +1,22 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _BCACHEFS_BTREE_WRITE_BUFFER_H
+#define _BCACHEFS_BTREE_WRITE_BUFFER_H
+
+static inline bool bch2_btree_write_buffer_should_flush(struct bch_fs *c)
+{
+	struct btree_write_buffer *wb = &c->btree_write_buffer;
+
+	return READ_ONCE(wb->nr) > wb->size * 3 / 4;
+}
+
+int bch2_btree_write_buffer_flush(struct bch_fs *);
+
+void bch2_trans_wb_updates_dedup(struct btree_trans *);
+int bch2_btree_write_buffer_add_trans(struct btree_trans *);
+
+void bch2_btree_write_buffer_to_text(struct printbuf *, struct bch_fs *);
+
+void bch2_fs_btree_write_buffer_exit(struct bch_fs *);
+int bch2_fs_btree_write_buffer_init(struct bch_fs *);
+
+#endif /* _BCACHEFS_BTREE_WRITE_BUFFER_H */
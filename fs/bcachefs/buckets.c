@@ -64,13 +64,16 @@
  */
 
 #include "bcachefs.h"
+#include "accounting.h"
 #include "alloc_background.h"
+#include "backpointers.h"
 #include "bset.h"
 #include "btree_gc.h"
 #include "btree_update.h"
 #include "buckets.h"
 #include "ec.h"
 #include "error.h"
+#include "lru.h"
 #include "movinggc.h"
 #include "replicas.h"
 
@@ -110,6 +113,7 @@ void bch2_bucket_seq_cleanup(struct bch_fs *c)
 	struct bucket *g;
 	struct bucket_mark m;
 	unsigned i;
+	size_t b;
 
 	if (journal_seq - c->last_bucket_seq_cleanup <
 	    (1U << (BUCKET_JOURNAL_SEQ_BITS - 2)))
@@ -121,7 +125,7 @@ void bch2_bucket_seq_cleanup(struct bch_fs *c)
 		down_read(&ca->bucket_lock);
 		buckets = bucket_array(ca);
 
-		for_each_bucket(g, buckets) {
+		for_each_bucket(g, b, buckets) {
 			bucket_cmpxchg(g, m, ({
 				if (!m.journal_seq_valid ||
 				    bucket_needs_journal_commit(m, last_seq_ondisk))
@@ -404,6 +408,47 @@ bch2_fs_usage_read_short(struct bch_fs *c)
 	return ret;
 }
 
+/*
+ * Summing the percpu counters gets expensive with many CPUs, and statfs gets
+ * called a lot by monitoring and the like: return a cached summary, refreshed
+ * at most every statfs_cache_ms. Exact usage is still available via
+ * bch2_fs_usage_read_short(), i.e. the usage ioctls:
+ */
+struct bch_fs_usage_short
+bch2_fs_usage_read_short_cached(struct bch_fs *c)
+{
+	u64 max_age = msecs_to_jiffies(c->opts.statfs_cache_ms);
+	u64 now = get_jiffies_64();
+	struct bch_fs_usage_short ret;
+	unsigned seq;
+	bool fresh;
+
+	if (!max_age)
+		return bch2_fs_usage_read_short(c);
+
+	do {
+		seq	= read_seqcount_begin(&c->usage_cached_seq);
+		ret	= c->usage_cached;
+		fresh	= time_before64(now, c->usage_cached_time + max_age);
+	} while (read_seqcount_retry(&c->usage_cached_seq, seq));
+
+	if (fresh)
+		return ret;
+
+	ret = bch2_fs_usage_read_short(c);
+
+	/* If someone else is already refreshing it, don't wait for them: */
+	if (spin_trylock(&c->usage_cached_lock)) {
+		write_seqcount_begin(&c->usage_cached_seq);
+		c->usage_cached		= ret;
+		c->usage_cached_time	= now;
+		write_seqcount_end(&c->usage_cached_seq);
+		spin_unlock(&c->usage_cached_lock);
+	}
+
+	return ret;
+}
+
 static inline int is_unavailable_bucket(struct bucket_mark m)
 {
 	return !is_available_bucket(m);
@@ -485,7 +530,7 @@ static inline void account_bucket(struct bch_fs_usage *fs_usage,
 }
 
 static void bch2_dev_usage_update(struct bch_fs *c, struct bch_dev *ca,
-				  struct bch_fs_usage *fs_usage,
+				  size_t b, struct bch_fs_usage *fs_usage,
 				  struct bucket_mark old, struct bucket_mark new,
 				  u64 journal_seq, bool gc)
 {
@@ -520,6 +565,26 @@ static void bch2_dev_usage_update(struct bch_fs *c, struct bch_dev *ca,
 
 	preempt_enable();
 
+	if (!gc && ca->buckets_empty &&
+	    is_empty_bucket(old) != is_empty_bucket(new)) {
+		if (is_empty_bucket(new))
+			set_bit(b, ca->buckets_empty);
+		else
+			clear_bit(b, ca->buckets_empty);
+	}
+
+	if (!gc && ca->buckets_frag[0]) {
+		int old_bin = bucket_frag_bin(ca, old);
+		int new_bin = bucket_frag_bin(ca, new);
+
+		if (old_bin != new_bin) {
+			if (old_bin >= 0)
+				clear_bit(b, ca->buckets_frag[old_bin]);
+			if (new_bin >= 0)
+				set_bit(b, ca->buckets_frag[new_bin]);
+		}
+	}
+
 	if (!is_available_bucket(old) && is_available_bucket(new))
 		bch2_wake_allocator(ca);
 }
@@ -666,7 +731,7 @@ static int __bch2_mark_alloc_bucket(struct bch_fs *c, struct bch_dev *ca,
 	 * buckets_alloc counter that don't have an open journal buffer and
 	 * we'll race with the machinery that accumulates that to ca->usage_base
 	 */
-	bch2_dev_usage_update(c, ca, fs_usage, old, new, 0, gc);
+	bch2_dev_usage_update(c, ca, b, fs_usage, old, new, 0, gc);
 
 	BUG_ON(!gc &&
 	       !owned_by_allocator && !old.owned_by_allocator);
@@ -730,10 +795,11 @@ static int bch2_mark_alloc(struct bch_fs *c,
 		}
 	}));
 
-	bch2_dev_usage_update(c, ca, fs_usage, old_m, m, journal_seq, gc);
+	bch2_dev_usage_update(c, ca, new.k->p.offset, fs_usage,
+			      old_m, m, journal_seq, gc);
 
-	g->io_time[READ]	= u.read_time;
-	g->io_time[WRITE]	= u.write_time;
+	bucket_io_time_set(g, READ,	u.read_time);
+	bucket_io_time_set(g, WRITE,	u.write_time);
 	g->oldest_gen		= u.oldest_gen;
 	g->gen_valid		= 1;
 	g->stripe		= u.stripe;
@@ -794,7 +860,7 @@ static int __bch2_mark_metadata_bucket(struct bch_fs *c, struct bch_dev *ca,
 		old.dirty_sectors, sectors);
 
 	if (c)
-		bch2_dev_usage_update(c, ca, fs_usage_ptr(c, 0, gc),
+		bch2_dev_usage_update(c, ca, b, fs_usage_ptr(c, 0, gc),
 				      old, new, 0, gc);
 
 	return 0;
@@ -976,7 +1042,8 @@ static int mark_stripe_bucket(struct bch_fs *c, struct bkey_s_c k,
 	g->stripe		= k.k->p.offset;
 	g->stripe_redundancy	= s->nr_redundant;
 
-	bch2_dev_usage_update(c, ca, fs_usage, old, new, journal_seq, gc);
+	bch2_dev_usage_update(c, ca, PTR_BUCKET_NR(ca, ptr), fs_usage,
+			      old, new, journal_seq, gc);
 	return 0;
 }
 
@@ -1043,7 +1110,8 @@ static int bch2_mark_pointer(struct bch_fs *c, struct bkey_s_c k,
 			      old.v.counter,
 			      new.v.counter)) != old.v.counter);
 
-	bch2_dev_usage_update(c, ca, fs_usage, old, new, journal_seq, gc);
+	bch2_dev_usage_update(c, ca, PTR_BUCKET_NR(ca, &p.ptr), fs_usage,
+			      old, new, journal_seq, gc);
 
 	BUG_ON(!gc && bucket_became_unavailable(old, new));
 
@@ -1196,6 +1264,7 @@ static int bch2_mark_stripe(struct bch_fs *c,
 			m->block_sectors[i] =
 				stripe_blockcount_get(new_s, i);
 			m->blocks_nonempty += !!m->block_sectors[i];
+			m->block_devs[i] = new_s->ptrs[i].dev;
 		}
 
 		bch2_bkey_to_replicas(&m->r.e, new);
@@ -1518,27 +1587,49 @@ static int trans_get_key(struct btree_trans *trans,
 	return ret;
 }
 
-static struct bkey_alloc_buf *
-bch2_trans_start_alloc_update(struct btree_trans *trans, struct btree_iter **_iter,
-			      const struct bch_extent_ptr *ptr,
-			      struct bkey_alloc_unpacked *u)
+/*
+ * Alloc key updates from triggers are kept unpacked in a list hanging off the
+ * transaction, and only packed and added to the transaction's updates once all
+ * triggers have run: a bucket referenced by many pointers in the same
+ * transaction (e.g. a large write split into many extents) is looked up and
+ * packed once per commit, not once per pointer.
+ */
+struct trans_alloc_update {
+	struct trans_alloc_update	*next;
+	struct bpos			pos;
+	bool				dirty;
+	bool				was_lru;
+	struct bkey_alloc_unpacked	u;
+	struct bkey_alloc_buf		a;
+};
+
+static struct trans_alloc_update *
+bch2_trans_start_alloc_update(struct btree_trans *trans,
+			      const struct bch_extent_ptr *ptr)
 {
 	struct bch_fs *c = trans->c;
 	struct bch_dev *ca = bch_dev_bkey_exists(c, ptr->dev);
 	struct bpos pos = POS(ptr->dev, PTR_BUCKET_NR(ca, ptr));
+	struct trans_alloc_update *n;
 	struct bucket *g;
 	struct btree_iter *iter;
 	struct bkey_s_c k;
-	struct bkey_alloc_buf *a;
 	int ret;
 
-	a = bch2_trans_kmalloc(trans, sizeof(struct bkey_alloc_buf));
-	if (IS_ERR(a))
-		return a;
+	for (n = trans->alloc_updates; n; n = n->next)
+		if (!bkey_cmp(pos, n->pos))
+			return n;
+
+	n = bch2_trans_kmalloc(trans, sizeof(*n));
+	if (IS_ERR(n))
+		return n;
+
+	n->pos		= pos;
+	n->dirty	= false;
 
 	iter = trans_get_update(trans, BTREE_ID_ALLOC, pos, &k);
 	if (iter) {
-		*u = bch2_alloc_unpack(k);
+		n->u = bch2_alloc_unpack(k);
 	} else {
 		iter = bch2_trans_get_iter(trans, BTREE_ID_ALLOC, pos,
 					   BTREE_ITER_CACHED|
@@ -1552,12 +1643,67 @@ bch2_trans_start_alloc_update(struct btree_trans *trans, struct btree_iter **_it
 
 		percpu_down_read(&c->mark_lock);
 		g = bucket(ca, pos.offset);
-		*u = alloc_mem_to_key(iter, g, READ_ONCE(g->mark));
+		n->u = alloc_mem_to_key(iter, g, READ_ONCE(g->mark));
 		percpu_up_read(&c->mark_lock);
+
+		bch2_trans_iter_put(trans, iter);
+	}
+
+	n->was_lru		= bch2_bucket_is_lru(n->u.dirty_sectors,
+						     n->u.cached_sectors);
+	n->next			= trans->alloc_updates;
+	trans->alloc_updates	= n;
+	return n;
+}
+
+/*
+ * Called by the commit path after triggers have run: returns 1 if updates were
+ * added, and triggers/traversal need to be rerun for them
+ */
+int bch2_trans_alloc_updates_flush(struct btree_trans *trans)
+{
+	struct trans_alloc_update *n;
+	struct btree_iter *iter;
+	bool is_lru;
+	int ret = 0;
+
+	for (n = trans->alloc_updates; n; n = n->next) {
+		if (!n->dirty)
+			continue;
+
+		/*
+		 * Buckets that became (or stopped being) cached only are added
+		 * to (or removed from) the LRU btree:
+		 */
+		is_lru = bch2_bucket_is_lru(n->u.dirty_sectors,
+					    n->u.cached_sectors);
+		if (is_lru != n->was_lru &&
+		    !(trans->flags & BTREE_INSERT_JOURNAL_REPLAY)) {
+			ret = is_lru
+				? bch2_lru_set(trans, n->u.dev, n->u.bucket,
+					       n->u.read_time)
+				: bch2_lru_delete(trans, n->u.dev, n->u.bucket,
+						  n->u.read_time);
+			if (ret)
+				return ret;
+		}
+
+		iter = bch2_trans_get_iter(trans, BTREE_ID_ALLOC, n->pos,
+					   BTREE_ITER_CACHED|
+					   BTREE_ITER_CACHED_NOFILL|
+					   BTREE_ITER_INTENT);
+		bch2_alloc_pack(trans->c, &n->a, n->u);
+		ret = bch2_trans_update(trans, iter, &n->a.k, 0);
+		bch2_trans_iter_put(trans, iter);
+		if (ret)
+			return ret;
+
+		n->dirty = false;
+		ret = 1;
 	}
 
-	*_iter = iter;
-	return a;
+	trans->alloc_updates = NULL;
+	return ret;
 }
 
 static int bch2_trans_mark_pointer(struct btree_trans *trans,
@@ -1565,25 +1711,22 @@ static int bch2_trans_mark_pointer(struct btree_trans *trans,
 			s64 sectors, enum bch_data_type data_type)
 {
 	struct bch_fs *c = trans->c;
-	struct btree_iter *iter;
-	struct bkey_alloc_unpacked u;
-	struct bkey_alloc_buf *a;
+	struct trans_alloc_update *n;
 	int ret;
 
-	a = bch2_trans_start_alloc_update(trans, &iter, &p.ptr, &u);
-	if (IS_ERR(a))
-		return PTR_ERR(a);
+	n = bch2_trans_start_alloc_update(trans, &p.ptr);
+	if (IS_ERR(n))
+		return PTR_ERR(n);
 
-	ret = __mark_pointer(c, k, &p.ptr, sectors, data_type, u.gen, &u.data_type,
-			     &u.dirty_sectors, &u.cached_sectors);
+	ret = __mark_pointer(c, k, &p.ptr, sectors, data_type, n->u.gen,
+			     &n->u.data_type,
+			     &n->u.dirty_sectors,
+			     &n->u.cached_sectors);
 	if (ret)
-		goto out;
+		return ret;
 
-	bch2_alloc_pack(c, a, u);
-	bch2_trans_update(trans, iter, &a->k, 0);
-out:
-	bch2_trans_iter_put(trans, iter);
-	return ret;
+	n->dirty = true;
+	return 0;
 }
 
 static int bch2_trans_mark_stripe_ptr(struct btree_trans *trans,
@@ -1609,7 +1752,8 @@ static int bch2_trans_mark_stripe_ptr(struct btree_trans *trans,
 		goto out;
 	}
 
-	if (!bch2_ptr_matches_stripe(bkey_s_c_to_stripe(k).v, p)) {
+	if (!bch2_ptr_matches_stripe(bkey_s_c_to_stripe(k).v, p) &&
+	    !bch2_ptr_in_rebuilding_stripe_block(c, bkey_s_c_to_stripe(k).v, p)) {
 		bch2_fs_inconsistent(c,
 			"stripe pointer doesn't match stripe %llu",
 			(u64) p.ec.idx);
@@ -1636,11 +1780,25 @@ static int bch2_trans_mark_stripe_ptr(struct btree_trans *trans,
 	return ret;
 }
 
+static int bch2_trans_account_ptr(struct btree_trans *trans,
+			struct extent_ptr_decoded p,
+			s64 sectors, s64 disk_sectors)
+{
+	s64 d[] = { sectors, disk_sectors };
+
+	return bch2_accounting_update(trans, BCH_ACCOUNTING_compression,
+			bch_accounting_compression_id(p.ptr.dev,
+						      p.crc.compression_type),
+			d);
+}
+
 static int bch2_trans_mark_extent(struct btree_trans *trans,
 			struct bkey_s_c k, unsigned offset,
 			s64 sectors, unsigned flags,
 			enum bch_data_type data_type)
 {
+	bool account = data_type == BCH_DATA_user &&
+		bch2_fs_has_accounting(trans->c);
 	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(k);
 	const union bch_extent_entry *entry;
 	struct extent_ptr_decoded p;
@@ -1667,6 +1825,13 @@ static int bch2_trans_mark_extent(struct btree_trans *trans,
 
 		stale = ret > 0;
 
+		if (account && !p.ptr.cached) {
+			ret = bch2_trans_account_ptr(trans, p, sectors,
+						     disk_sectors);
+			if (ret)
+				return ret;
+		}
+
 		if (p.ptr.cached) {
 			if (!stale)
 				update_cached_sectors_list(trans, p.ptr.dev,
@@ -1696,15 +1861,15 @@ static int bch2_trans_mark_stripe_alloc_ref(struct btree_trans *trans,
 {
 	struct bch_fs *c = trans->c;
 	const struct bch_extent_ptr *ptr = &s.v->ptrs[idx];
-	struct bkey_alloc_buf *a;
-	struct btree_iter *iter;
-	struct bkey_alloc_unpacked u;
+	struct trans_alloc_update *n;
+	struct bkey_alloc_unpacked *u;
 	bool parity = idx >= s.v->nr_blocks - s.v->nr_redundant;
-	int ret = 0;
 
-	a = bch2_trans_start_alloc_update(trans, &iter, ptr, &u);
-	if (IS_ERR(a))
-		return PTR_ERR(a);
+	n = bch2_trans_start_alloc_update(trans, ptr);
+	if (IS_ERR(n))
+		return PTR_ERR(n);
+
+	u = &n->u;
 
 	if (parity) {
 		s64 sectors = le16_to_cpu(s.v->sectors);
@@ -1712,33 +1877,28 @@ static int bch2_trans_mark_stripe_alloc_ref(struct btree_trans *trans,
 		if (deleting)
 			sectors = -sectors;
 
-		u.dirty_sectors += sectors;
-		u.data_type = u.dirty_sectors
+		u->dirty_sectors += sectors;
+		u->data_type = u->dirty_sectors
 			? BCH_DATA_parity
 			: 0;
 	}
 
 	if (!deleting) {
-		if (bch2_fs_inconsistent_on(u.stripe && u.stripe != s.k->p.offset, c,
+		if (bch2_fs_inconsistent_on(u->stripe && u->stripe != s.k->p.offset, c,
 				"bucket %llu:%llu gen %u: multiple stripes using same bucket (%u, %llu)",
-				iter->pos.inode, iter->pos.offset, u.gen,
-				u.stripe, s.k->p.offset)) {
-			ret = -EIO;
-			goto err;
-		}
+				n->pos.inode, n->pos.offset, u->gen,
+				u->stripe, s.k->p.offset))
+			return -EIO;
 
-		u.stripe		= s.k->p.offset;
-		u.stripe_redundancy	= s.v->nr_redundant;
+		u->stripe		= s.k->p.offset;
+		u->stripe_redundancy	= s.v->nr_redundant;
 	} else {
-		u.stripe		= 0;
-		u.stripe_redundancy	= 0;
+		u->stripe		= 0;
+		u->stripe_redundancy	= 0;
 	}
 
-	bch2_alloc_pack(c, a, u);
-	bch2_trans_update(trans, iter, &a->k, 0);
-err:
-	bch2_trans_iter_put(trans, iter);
-	return ret;
+	n->dirty = true;
+	return 0;
 }
 
 static int bch2_trans_mark_stripe(struct btree_trans *trans,
@@ -2011,7 +2171,7 @@ int bch2_trans_mark_update(struct btree_trans *trans,
 			flags |= BTREE_TRIGGER_OVERWRITE;
 
 			if (bkey_cmp(new->k.p, bkey_start_pos(old.k)) <= 0)
-				return 0;
+				break;
 
 			switch (bch2_extent_overlap(&new->k, old.k)) {
 			case BCH_EXTENT_OVERLAP_ALL:
@@ -2040,12 +2200,20 @@ int bch2_trans_mark_update(struct btree_trans *trans,
 			BUG_ON(sectors >= 0);
 
 			ret = bch2_trans_mark_key(trans, old, bkey_i_to_s_c(new),
-					offset, sectors, flags);
+					offset, sectors, flags) ?:
+				bch2_trans_backpointers_overwrite(trans,
+					iter->btree_id, old, &new->k);
 			if (ret)
 				return ret;
 
 			bch2_btree_node_iter_advance(&node_iter, b);
 		}
+
+		/*
+		 * After the overwrites, so that for pointers that haven't
+		 * changed the new backpointer replaces the deletion:
+		 */
+		ret = bch2_trans_backpointers_insert(trans, iter->btree_id, new);
 	}
 
 	return ret;
@@ -2057,55 +2225,49 @@ static int __bch2_trans_mark_metadata_bucket(struct btree_trans *trans,
 				    unsigned sectors)
 {
 	struct bch_fs *c = trans->c;
-	struct btree_iter *iter;
-	struct bkey_alloc_unpacked u;
-	struct bkey_alloc_buf *a;
+	struct trans_alloc_update *n;
+	struct bkey_alloc_unpacked *u;
 	struct bch_extent_ptr ptr = {
 		.dev = ca->dev_idx,
 		.offset = bucket_to_sector(ca, b),
 	};
-	int ret = 0;
 
-	a = bch2_trans_start_alloc_update(trans, &iter, &ptr, &u);
-	if (IS_ERR(a))
-		return PTR_ERR(a);
+	n = bch2_trans_start_alloc_update(trans, &ptr);
+	if (IS_ERR(n))
+		return PTR_ERR(n);
+
+	u = &n->u;
 
-	if (u.data_type && u.data_type != type) {
+	if (u->data_type && u->data_type != type) {
 		bch2_fsck_err(c, FSCK_CAN_IGNORE|FSCK_NEED_FSCK,
 			"bucket %llu:%llu gen %u different types of data in same bucket: %s, %s\n"
 			"while marking %s",
-			iter->pos.inode, iter->pos.offset, u.gen,
-			bch2_data_types[u.data_type],
+			n->pos.inode, n->pos.offset, u->gen,
+			bch2_data_types[u->data_type],
 			bch2_data_types[type],
 			bch2_data_types[type]);
-		ret = -EIO;
-		goto out;
+		return -EIO;
 	}
 
-	if ((unsigned) (u.dirty_sectors + sectors) > ca->mi.bucket_size) {
+	if ((unsigned) (u->dirty_sectors + sectors) > ca->mi.bucket_size) {
 		bch2_fsck_err(c, FSCK_CAN_IGNORE|FSCK_NEED_FSCK,
 			"bucket %llu:%llu gen %u data type %s sector count overflow: %u + %u > %u\n"
 			"while marking %s",
-			iter->pos.inode, iter->pos.offset, u.gen,
-			bch2_data_types[u.data_type ?: type],
-			u.dirty_sectors, sectors, ca->mi.bucket_size,
+			n->pos.inode, n->pos.offset, u->gen,
+			bch2_data_types[u->data_type ?: type],
+			u->dirty_sectors, sectors, ca->mi.bucket_size,
 			bch2_data_types[type]);
-		ret = -EIO;
-		goto out;
+		return -EIO;
 	}
 
-	if (u.data_type		== type &&
-	    u.dirty_sectors	== sectors)
-		goto out;
-
-	u.data_type	= type;
-	u.dirty_sectors	= sectors;
+	if (u->data_type	== type &&
+	    u->dirty_sectors	== sectors)
+		return 0;
 
-	bch2_alloc_pack(c, a, u);
-	bch2_trans_update(trans, iter, &a->k, 0);
-out:
-	bch2_trans_iter_put(trans, iter);
-	return ret;
+	u->data_type	= type;
+	u->dirty_sectors	= sectors;
+	n->dirty	= true;
+	return 0;
 }
 
 int bch2_trans_mark_metadata_bucket(struct btree_trans *trans,
@@ -2284,20 +2446,102 @@ int bch2_disk_reservation_add(struct bch_fs *c, struct disk_reservation *res,
 
 /* Startup/shutdown: */
 
+void bch2_bucket_array_free(struct bucket_array *buckets)
+{
+	size_t i, nr = bucket_array_nr_chunks(buckets->nbuckets);
+
+	for (i = buckets->free_chunks_from; i < nr; i++)
+		if (buckets->chunks[i])
+			kvpfree(buckets->chunks[i],
+				BUCKET_ARRAY_CHUNK * sizeof(struct bucket));
+
+	kvpfree(buckets, struct_size(buckets, chunks, nr));
+}
+
+/*
+ * Allocates a bucket array of @nbuckets; if @old is non NULL the new array
+ * shares @old's chunks, so only chunks past the end of @old are allocated:
+ */
+struct bucket_array *bch2_bucket_array_alloc(size_t nbuckets, u16 first_bucket,
+					     struct bucket_array *old)
+{
+	struct bucket_array *buckets;
+	size_t i, nr = bucket_array_nr_chunks(nbuckets);
+	size_t old_nr = old ? bucket_array_nr_chunks(old->nbuckets) : 0;
+	size_t shared = min(nr, old_nr);
+
+	buckets = kvpmalloc(struct_size(buckets, chunks, nr),
+			    GFP_KERNEL|__GFP_ZERO);
+	if (!buckets)
+		return NULL;
+
+	buckets->first_bucket		= first_bucket;
+	buckets->nbuckets		= nbuckets;
+	/* until it's swapped in, shared chunks still belong to @old: */
+	buckets->free_chunks_from	= shared;
+
+	for (i = 0; i < shared; i++)
+		buckets->chunks[i] = old->chunks[i];
+
+	for (i = shared; i < nr; i++) {
+		buckets->chunks[i] = kvpmalloc(BUCKET_ARRAY_CHUNK *
+					       sizeof(struct bucket),
+					       GFP_KERNEL|__GFP_ZERO);
+		if (!buckets->chunks[i]) {
+			bch2_bucket_array_free(buckets);
+			return NULL;
+		}
+	}
+
+	/*
+	 * Growing into the tail of the last shared chunk: those buckets may
+	 * have been in use before a previous shrink:
+	 */
+	if (old && nbuckets > old->nbuckets) {
+		size_t end = min_t(size_t, nbuckets,
+				   shared << BUCKET_ARRAY_CHUNK_SHIFT);
+
+		if (end > old->nbuckets)
+			memset(bucket_array_entry(buckets, old->nbuckets), 0,
+			       (end - old->nbuckets) * sizeof(struct bucket));
+	}
+
+	return buckets;
+}
+
 static void buckets_free_rcu(struct rcu_head *rcu)
 {
-	struct bucket_array *buckets =
-		container_of(rcu, struct bucket_array, rcu);
+	bch2_bucket_array_free(container_of(rcu, struct bucket_array, rcu));
+}
 
-	kvpfree(buckets,
-		sizeof(struct bucket_array) +
-		buckets->nbuckets * sizeof(struct bucket));
+/*
+ * Rebuild the copygc bucket index from the bucket marks, for paths that set
+ * marks without going through bch2_dev_usage_update() - reading alloc info,
+ * and gc fixing up marks. Caller must hold ca->bucket_lock or c->mark_lock:
+ */
+void bch2_dev_buckets_frag_rebuild(struct bch_dev *ca)
+{
+	struct bucket_array *buckets = bucket_array(ca);
+	unsigned i;
+	size_t b;
+	int bin;
+
+	for (i = 0; i < BUCKET_FRAG_BINS; i++)
+		bitmap_zero(ca->buckets_frag[i], buckets->nbuckets);
+
+	for (b = buckets->first_bucket; b < buckets->nbuckets; b++) {
+		bin = bucket_frag_bin(ca, READ_ONCE(bucket_array_entry(buckets, b)->mark));
+		if (bin >= 0)
+			set_bit(b, ca->buckets_frag[bin]);
+	}
 }
 
 int bch2_dev_buckets_resize(struct bch_fs *c, struct bch_dev *ca, u64 nbuckets)
 {
 	struct bucket_array *buckets = NULL, *old_buckets = NULL;
 	unsigned long *buckets_nouse = NULL;
+	unsigned long *buckets_empty = NULL;
+	unsigned long *buckets_frag[BUCKET_FRAG_BINS] = { NULL };
 	alloc_fifo	free[RESERVE_NR];
 	alloc_fifo	free_inc;
 	alloc_heap	alloc_heap;
@@ -2306,6 +2550,8 @@ int bch2_dev_buckets_resize(struct bch_fs *c, struct bch_dev *ca, u64 nbuckets)
 			     ca->mi.bucket_size / c->opts.btree_node_size);
 	/* XXX: these should be tunable */
 	size_t reserve_none	= max_t(size_t, 1, nbuckets >> 9);
+	/* room for free_want to grow to, see bch2_dev_freelist_tune(): */
+	size_t reserve_none_max	= max_t(size_t, 1, nbuckets >> 7);
 	size_t copygc_reserve	= max_t(size_t, 2, nbuckets >> 6);
 	size_t free_inc_nr	= max(max_t(size_t, 1, nbuckets >> 12),
 				      btree_reserve * 2);
@@ -2317,47 +2563,68 @@ int bch2_dev_buckets_resize(struct bch_fs *c, struct bch_dev *ca, u64 nbuckets)
 	memset(&free_inc,	0, sizeof(free_inc));
 	memset(&alloc_heap,	0, sizeof(alloc_heap));
 
-	if (!(buckets		= kvpmalloc(sizeof(struct bucket_array) +
-					    nbuckets * sizeof(struct bucket),
-					    GFP_KERNEL|__GFP_ZERO)) ||
+	for (i = 0; i < BUCKET_FRAG_BINS; i++)
+		if (!(buckets_frag[i] = kvpmalloc(BITS_TO_LONGS(nbuckets) *
+						  sizeof(unsigned long),
+						  GFP_KERNEL|__GFP_ZERO)))
+			goto err;
+
+	/* Only resize swaps ca->buckets[0], and resizes are serialized: */
+	old_buckets = rcu_dereference_protected(ca->buckets[0], 1);
+
+	if (!(buckets		= bch2_bucket_array_alloc(nbuckets,
+						ca->mi.first_bucket, old_buckets)) ||
 	    !(buckets_nouse	= kvpmalloc(BITS_TO_LONGS(nbuckets) *
 					    sizeof(unsigned long),
 					    GFP_KERNEL|__GFP_ZERO)) ||
+	    !(buckets_empty	= kvpmalloc(BITS_TO_LONGS(nbuckets) *
+					    sizeof(unsigned long),
+					    GFP_KERNEL|__GFP_ZERO)) ||
 	    !init_fifo(&free[RESERVE_MOVINGGC],
 		       copygc_reserve, GFP_KERNEL) ||
-	    !init_fifo(&free[RESERVE_NONE], reserve_none, GFP_KERNEL) ||
+	    !init_fifo(&free[RESERVE_NONE], reserve_none_max, GFP_KERNEL) ||
 	    !init_fifo(&free_inc,	free_inc_nr, GFP_KERNEL) ||
 	    !init_heap(&alloc_heap,	ALLOC_SCAN_BATCH(ca) << 1, GFP_KERNEL))
 		goto err;
 
-	buckets->first_bucket	= ca->mi.first_bucket;
-	buckets->nbuckets	= nbuckets;
-
 	bch2_copygc_stop(c);
 
+	/*
+	 * Buckets themselves are shared with the old array, not copied - we
+	 * only have to block marking while copying the bitmaps:
+	 */
 	if (resize) {
+		size_t n = min(buckets->nbuckets, old_buckets->nbuckets);
+
 		down_write(&c->gc_lock);
 		down_write(&ca->bucket_lock);
 		percpu_down_write(&c->mark_lock);
-	}
-
-	old_buckets = bucket_array(ca);
 
-	if (resize) {
-		size_t n = min(buckets->nbuckets, old_buckets->nbuckets);
-
-		memcpy(buckets->b,
-		       old_buckets->b,
-		       n * sizeof(struct bucket));
 		memcpy(buckets_nouse,
 		       ca->buckets_nouse,
 		       BITS_TO_LONGS(n) * sizeof(unsigned long));
+		memcpy(buckets_empty,
+		       ca->buckets_empty,
+		       BITS_TO_LONGS(n) * sizeof(unsigned long));
+		for (i = 0; i < BUCKET_FRAG_BINS; i++)
+			memcpy(buckets_frag[i],
+			       ca->buckets_frag[i],
+			       BITS_TO_LONGS(n) * sizeof(unsigned long));
 	}
 
+	buckets->free_chunks_from = 0;
+	if (old_buckets)
+		old_buckets->free_chunks_from =
+			bucket_array_nr_chunks(min(buckets->nbuckets,
+						   old_buckets->nbuckets));
+
 	rcu_assign_pointer(ca->buckets[0], buckets);
 	buckets = old_buckets;
 
 	swap(ca->buckets_nouse, buckets_nouse);
+	swap(ca->buckets_empty, buckets_empty);
+	for (i = 0; i < BUCKET_FRAG_BINS; i++)
+		swap(ca->buckets_frag[i], buckets_frag[i]);
 
 	if (resize) {
 		percpu_up_write(&c->mark_lock);
@@ -2371,6 +2638,10 @@ int bch2_dev_buckets_resize(struct bch_fs *c, struct bch_dev *ca, u64 nbuckets)
 	}
 	fifo_move(&free_inc, &ca->free_inc);
 	swap(ca->free_inc, free_inc);
+
+	ca->free_want_min	= reserve_none;
+	ca->free_want		= clamp(ca->free_want, reserve_none,
+					ca->free[RESERVE_NONE].size);
 	spin_unlock(&c->freelist_lock);
 
 	/* with gc lock held, alloc_heap can't be in use: */
@@ -2389,8 +2660,17 @@ int bch2_dev_buckets_resize(struct bch_fs *c, struct bch_dev *ca, u64 nbuckets)
 		free_fifo(&free[i]);
 	kvpfree(buckets_nouse,
 		BITS_TO_LONGS(nbuckets) * sizeof(unsigned long));
-	if (buckets)
-		call_rcu(&old_buckets->rcu, buckets_free_rcu);
+	kvpfree(buckets_empty,
+		BITS_TO_LONGS(nbuckets) * sizeof(unsigned long));
+	for (i = 0; i < BUCKET_FRAG_BINS; i++)
+		kvpfree(buckets_frag[i],
+			BITS_TO_LONGS(nbuckets) * sizeof(unsigned long));
+	if (buckets) {
+		if (!ret)
+			call_rcu(&buckets->rcu, buckets_free_rcu);
+		else
+			bch2_bucket_array_free(buckets);
+	}
 
 	return ret;
 }
@@ -2405,9 +2685,13 @@ void bch2_dev_buckets_free(struct bch_dev *ca)
 		free_fifo(&ca->free[i]);
 	kvpfree(ca->buckets_nouse,
 		BITS_TO_LONGS(ca->mi.nbuckets) * sizeof(unsigned long));
-	kvpfree(rcu_dereference_protected(ca->buckets[0], 1),
-		sizeof(struct bucket_array) +
-		ca->mi.nbuckets * sizeof(struct bucket));
+	kvpfree(ca->buckets_empty,
+		BITS_TO_LONGS(ca->mi.nbuckets) * sizeof(unsigned long));
+	for (i = 0; i < BUCKET_FRAG_BINS; i++)
+		kvpfree(ca->buckets_frag[i],
+			BITS_TO_LONGS(ca->mi.nbuckets) * sizeof(unsigned long));
+	if (ca->buckets[0])
+		bch2_bucket_array_free(rcu_dereference_protected(ca->buckets[0], 1));
 
 	for (i = 0; i < ARRAY_SIZE(ca->usage); i++)
 		free_percpu(ca->usage[i]);
@@ -11,9 +11,11 @@
 #include "buckets_types.h"
 #include "super.h"
 
-#define for_each_bucket(_b, _buckets)				\
-	for (_b = (_buckets)->b + (_buckets)->first_bucket;	\
-	     _b < (_buckets)->b + (_buckets)->nbuckets; _b++)
+#define for_each_bucket(_g, _b, _buckets)				\
+	for (_b = (_buckets)->first_bucket;				\
+	     _b < (_buckets)->nbuckets &&				\
+	     ((_g) = bucket_array_entry(_buckets, _b), true);		\
+	     _b++)
 
 #define bucket_cmpxchg(g, new, expr)				\
 ({								\
@@ -30,6 +32,18 @@
 	_old;							\
 })
 
+static inline size_t bucket_array_nr_chunks(size_t nbuckets)
+{
+	return DIV_ROUND_UP(nbuckets, BUCKET_ARRAY_CHUNK);
+}
+
+static inline struct bucket *bucket_array_entry(struct bucket_array *buckets,
+						size_t b)
+{
+	return buckets->chunks[b >> BUCKET_ARRAY_CHUNK_SHIFT] +
+		(b & (BUCKET_ARRAY_CHUNK - 1));
+}
+
 static inline struct bucket_array *__bucket_array(struct bch_dev *ca,
 						  bool gc)
 {
@@ -50,7 +64,7 @@ static inline struct bucket *__bucket(struct bch_dev *ca, size_t b, bool gc)
 	struct bucket_array *buckets = __bucket_array(ca, gc);
 
 	BUG_ON(b < buckets->first_bucket || b >= buckets->nbuckets);
-	return buckets->b + b;
+	return bucket_array_entry(buckets, b);
 }
 
 static inline struct bucket *bucket(struct bch_dev *ca, size_t b)
@@ -68,6 +82,25 @@ static inline u8 bucket_gc_gen(struct bucket *g)
 	return g->mark.gen - g->oldest_gen;
 }
 
+/*
+ * Bucket io times are kept truncated to 32 bits to keep struct bucket small,
+ * and reconstructed relative to the current io clock - so they're exact unless
+ * the bucket hasn't been touched in 2^40 sectors of IO, in which case it'll
+ * look more recently used than it really is:
+ */
+static inline u64 bucket_io_time(struct bucket *g, int rw, u64 now)
+{
+	u64 now_scaled = now >> BUCKET_IO_TIME_SHIFT;
+	u32 age = (u32) now_scaled - g->io_time[rw];
+
+	return (now_scaled - min_t(u64, age, now_scaled)) << BUCKET_IO_TIME_SHIFT;
+}
+
+static inline void bucket_io_time_set(struct bucket *g, int rw, u64 time)
+{
+	g->io_time[rw] = time >> BUCKET_IO_TIME_SHIFT;
+}
+
 static inline size_t PTR_BUCKET_NR(const struct bch_dev *ca,
 				   const struct bch_extent_ptr *ptr)
 {
@@ -151,6 +184,32 @@ static inline bool is_available_bucket(struct bucket_mark mark)
 	return !mark.dirty_sectors && !mark.stripe;
 }
 
+/* Empty buckets are tracked in ca->buckets_empty, for the allocator: */
+static inline bool is_empty_bucket(struct bucket_mark mark)
+{
+	return !bucket_sectors_used(mark) &&
+		!mark.stripe &&
+		!mark.owned_by_allocator;
+}
+
+/*
+ * Buckets copygc may evacuate - partly full user data buckets - are tracked in
+ * ca->buckets_frag, in the bin for how full they are; returns -1 for buckets
+ * that aren't candidates:
+ */
+static inline int bucket_frag_bin(struct bch_dev *ca, struct bucket_mark mark)
+{
+	unsigned sectors = bucket_sectors_used(mark);
+
+	if (mark.owned_by_allocator ||
+	    mark.data_type != BCH_DATA_user ||
+	    !sectors ||
+	    sectors >= ca->mi.bucket_size)
+		return -1;
+
+	return sectors * BUCKET_FRAG_BINS / ca->mi.bucket_size;
+}
+
 static inline bool bucket_needs_journal_commit(struct bucket_mark m,
 					       u16 last_seq_ondisk)
 {
@@ -226,6 +285,8 @@ u64 bch2_fs_sectors_used(struct bch_fs *, struct bch_fs_usage *);
 
 struct bch_fs_usage_short
 bch2_fs_usage_read_short(struct bch_fs *);
+struct bch_fs_usage_short
+bch2_fs_usage_read_short_cached(struct bch_fs *);
 
 /* key/bucket marking: */
 
@@ -251,6 +312,7 @@ int bch2_replicas_delta_list_apply(struct bch_fs *,
 				   struct replicas_delta_list *);
 int bch2_trans_mark_key(struct btree_trans *, struct bkey_s_c, struct bkey_s_c,
 			unsigned, s64, unsigned);
+int bch2_trans_alloc_updates_flush(struct btree_trans *);
 int bch2_trans_mark_update(struct btree_trans *, struct btree_iter *iter,
 			   struct bkey_i *insert, unsigned);
 void bch2_trans_fs_usage_apply(struct btree_trans *, struct bch_fs_usage *);
@@ -301,6 +363,10 @@ static inline int bch2_disk_reservation_get(struct bch_fs *c,
 	return bch2_disk_reservation_add(c, res, sectors * nr_replicas, flags);
 }
 
+struct bucket_array *bch2_bucket_array_alloc(size_t, u16, struct bucket_array *);
+void bch2_bucket_array_free(struct bucket_array *);
+
+void bch2_dev_buckets_frag_rebuild(struct bch_dev *);
 int bch2_dev_buckets_resize(struct bch_fs *, struct bch_dev *, u64);
 void bch2_dev_buckets_free(struct bch_dev *);
 int bch2_dev_buckets_alloc(struct bch_fs *, struct bch_dev *);
@@ -6,6 +6,9 @@
 #include "util.h"
 
 #define BUCKET_JOURNAL_SEQ_BITS		16
+#define BUCKET_IO_TIME_SHIFT		8
+/* Number of fullness bins in the copygc bucket index, ca->buckets_frag: */
+#define BUCKET_FRAG_BINS		16
 
 struct bucket_mark {
 	union {
@@ -37,19 +40,35 @@ struct bucket {
 		const struct bucket_mark mark;
 	};
 
-	u64				io_time[2];
+	/*
+	 * Low bits of the io clock, in units of 1 << BUCKET_IO_TIME_SHIFT
+	 * sectors, when this bucket was last read/written - see
+	 * bucket_io_time():
+	 */
+	u32				io_time[2];
+	u32				stripe;
 	u8				oldest_gen;
 	u8				gc_gen;
-	unsigned			gen_valid:1;
 	u8				stripe_redundancy;
-	u32				stripe;
+	unsigned			gen_valid:1;
 };
 
+/*
+ * Bucket arrays are chunked, so that resizing a device only allocates or frees
+ * chunks at the end and builds a new (small) table of chunk pointers: the
+ * buckets themselves are never copied or moved, and the old and new arrays
+ * share chunks.
+ */
+#define BUCKET_ARRAY_CHUNK_SHIFT	12
+#define BUCKET_ARRAY_CHUNK		(1U << BUCKET_ARRAY_CHUNK_SHIFT)
+
 struct bucket_array {
 	struct rcu_head		rcu;
 	u16			first_bucket;
 	size_t			nbuckets;
-	struct bucket		b[];
+	/* when freed, chunks below this are still in use by the new array: */
+	size_t			free_chunks_from;
+	struct bucket		*chunks[];
 };
 
 struct bch_dev_usage {
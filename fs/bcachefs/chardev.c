@@ -2,6 +2,7 @@
 #ifndef NO_BCACHEFS_CHARDEV
 
 #include "bcachefs.h"
+#include "accounting.h"
 #include "bcachefs_ioctl.h"
 #include "buckets.h"
 #include "chardev.h"
@@ -275,8 +276,49 @@ struct bch_data_ctx {
 	int				ret;
 
 	struct task_struct		*thread;
+
+	/* for computing rates: */
+	unsigned long			start_time;
+	u64				io_done_start[BCH_SB_MEMBERS_MAX][2];
 };
 
+static u64 dev_io_done(struct bch_dev *ca, int rw)
+{
+	u64 ret = 0;
+	unsigned i;
+
+	for (i = 0; i < BCH_DATA_NR; i++)
+		ret += percpu_u64_get(&ca->io_done->sectors[rw][i]);
+	return ret;
+}
+
+static u64 bytes_per_sec(u64 sectors, unsigned long elapsed_ms)
+{
+	return elapsed_ms ? div64_u64((sectors << 9) * MSEC_PER_SEC, elapsed_ms) : 0;
+}
+
+/* For migrate, the data left on the device being migrated is exact: */
+static bool data_job_sectors_remaining(struct bch_data_ctx *ctx, u64 *ret)
+{
+	struct bch_fs *c = ctx->c;
+	struct bch_dev *ca;
+	struct bch_dev_usage u;
+
+	if (ctx->arg.op != BCH_DATA_OP_MIGRATE ||
+	    ctx->arg.migrate.dev >= c->sb.nr_devices)
+		return false;
+
+	rcu_read_lock();
+	ca = rcu_dereference(c->devs[ctx->arg.migrate.dev]);
+	if (ca) {
+		u = bch2_dev_usage_read(ca);
+		*ret = u.d[BCH_DATA_btree].sectors + u.d[BCH_DATA_user].sectors;
+	}
+	rcu_read_unlock();
+
+	return ca != NULL;
+}
+
 static int bch2_data_thread(void *arg)
 {
 	struct bch_data_ctx *ctx = arg;
@@ -302,6 +344,7 @@ static ssize_t bch2_data_job_read(struct file *file, char __user *buf,
 {
 	struct bch_data_ctx *ctx = file->private_data;
 	struct bch_fs *c = ctx->c;
+	unsigned long elapsed_ms = jiffies_to_msecs(jiffies - ctx->start_time);
 	struct bch_ioctl_data_event e = {
 		.type			= BCH_DATA_EVENT_PROGRESS,
 		.p.data_type		= ctx->stats.data_type,
@@ -309,12 +352,51 @@ static ssize_t bch2_data_job_read(struct file *file, char __user *buf,
 		.p.pos			= ctx->stats.pos,
 		.p.sectors_done		= atomic64_read(&ctx->stats.sectors_seen),
 		.p.sectors_total	= bch2_fs_usage_read_short(c).used,
+		.p.keys_inconsistent	= atomic64_read(&ctx->stats.keys_inconsistent),
+		.p.reads_in_flight	= atomic_read(&ctx->stats.reads_in_flight),
+		.p.writes_in_flight	= atomic_read(&ctx->stats.writes_in_flight),
 	};
+	struct bch_dev *ca;
+	size_t ret = 0;
+	unsigned i;
 
 	if (len < sizeof(e))
 		return -EINVAL;
 
-	return copy_to_user(buf, &e, sizeof(e)) ?: sizeof(e);
+	e.p.bytes_per_sec	= bytes_per_sec(e.p.sectors_done, elapsed_ms);
+	if (!data_job_sectors_remaining(ctx, &e.p.sectors_remaining))
+		e.p.sectors_remaining = e.p.sectors_total -
+			min(e.p.sectors_total, e.p.sectors_done);
+	if (e.p.bytes_per_sec)
+		e.p.eta_sec	= div64_u64(e.p.sectors_remaining << 9,
+					    e.p.bytes_per_sec);
+
+	if (copy_to_user(buf, &e, sizeof(e)))
+		return -EFAULT;
+	ret += sizeof(e);
+
+	for_each_online_member(ca, c, i) {
+		if (len - ret < sizeof(e)) {
+			percpu_ref_put(&ca->io_ref);
+			break;
+		}
+
+		memset(&e, 0, sizeof(e));
+		e.type			= BCH_DATA_EVENT_DEV_PROGRESS;
+		e.d.dev			= ca->dev_idx;
+		e.d.read_bytes_per_sec	= bytes_per_sec(dev_io_done(ca, READ) -
+					ctx->io_done_start[ca->dev_idx][READ], elapsed_ms);
+		e.d.write_bytes_per_sec	= bytes_per_sec(dev_io_done(ca, WRITE) -
+					ctx->io_done_start[ca->dev_idx][WRITE], elapsed_ms);
+
+		if (copy_to_user(buf + ret, &e, sizeof(e))) {
+			percpu_ref_put(&ca->io_ref);
+			return -EFAULT;
+		}
+		ret += sizeof(e);
+	}
+
+	return ret;
 }
 
 static const struct file_operations bcachefs_data_ops = {
@@ -329,6 +411,7 @@ static long bch2_ioctl_data(struct bch_fs *c,
 	struct bch_data_ctx *ctx = NULL;
 	struct file *file = NULL;
 	unsigned flags = O_RDONLY|O_CLOEXEC|O_NONBLOCK;
+	unsigned i;
 	int ret, fd = -1;
 
 	if (arg.op >= BCH_DATA_OP_NR || arg.flags)
@@ -340,6 +423,18 @@ static long bch2_ioctl_data(struct bch_fs *c,
 
 	ctx->c = c;
 	ctx->arg = arg;
+	ctx->start_time = jiffies;
+
+	rcu_read_lock();
+	for (i = 0; i < c->sb.nr_devices; i++) {
+		struct bch_dev *ca = rcu_dereference(c->devs[i]);
+
+		if (ca) {
+			ctx->io_done_start[i][READ]	= dev_io_done(ca, READ);
+			ctx->io_done_start[i][WRITE]	= dev_io_done(ca, WRITE);
+		}
+	}
+	rcu_read_unlock();
 
 	ctx->thread = kthread_create(bch2_data_thread, ctx,
 				     "bch-data/%s", c->name);
@@ -489,6 +584,34 @@ static long bch2_ioctl_dev_usage(struct bch_fs *c,
 	return copy_to_user(user_arg, &arg, sizeof(arg));
 }
 
+static long bch2_ioctl_query_accounting(struct bch_fs *c,
+			struct bch_ioctl_query_accounting __user *user_arg)
+{
+	struct bch_ioctl_query_accounting arg;
+	int ret;
+
+	if (!test_bit(BCH_FS_STARTED, &c->flags))
+		return -EINVAL;
+
+	if (!bch2_fs_has_accounting(c))
+		return -EOPNOTSUPP;
+
+	if (copy_from_user(&arg, user_arg, sizeof(arg)))
+		return -EFAULT;
+
+	if (arg.type >= BCH_ACCOUNTING_NR ||
+	    arg.pad)
+		return -EINVAL;
+
+	memset(arg.d, 0, sizeof(arg.d));
+
+	ret = bch2_accounting_read(c, arg.type, arg.id, arg.d);
+	if (ret)
+		return ret;
+
+	return copy_to_user(user_arg, &arg, sizeof(arg));
+}
+
 static long bch2_ioctl_read_super(struct bch_fs *c,
 				  struct bch_ioctl_read_super arg)
 {
@@ -604,6 +727,8 @@ long bch2_fs_ioctl(struct bch_fs *c, unsigned cmd, void __user *arg)
 		return bch2_ioctl_fs_usage(c, arg);
 	case BCH_IOCTL_DEV_USAGE:
 		return bch2_ioctl_dev_usage(c, arg);
+	case BCH_IOCTL_QUERY_ACCOUNTING:
+		return bch2_ioctl_query_accounting(c, arg);
 	}
 
 	if (!capable(CAP_SYS_ADMIN))
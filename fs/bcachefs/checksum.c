@@ -4,10 +4,12 @@
 #include "super.h"
 #include "super-io.h"
 
+#include <linux/crc32.h>
 #include <linux/crc32c.h>
 #include <linux/crypto.h>
 #include <linux/key.h>
 #include <linux/random.h>
+#include <linux/xxhash.h>
 #include <linux/scatterlist.h>
 #include <crypto/algapi.h>
 #include <crypto/chacha.h>
@@ -16,53 +18,75 @@
 #include <crypto/skcipher.h>
 #include <keys/user-type.h>
 
-static u64 bch2_checksum_init(unsigned type)
+/*
+ * bch2_checksum state - for the crcs this is just the running crc; xxhash
+ * needs its full streaming state:
+ */
+struct bch2_checksum_state {
+	union {
+		u64			seed;
+		struct xxh64_state	h64state;
+	};
+	unsigned			type;
+};
+
+static void bch2_checksum_init(struct bch2_checksum_state *state)
 {
-	switch (type) {
+	switch (state->type) {
 	case BCH_CSUM_NONE:
-		return 0;
-	case BCH_CSUM_CRC32C_NONZERO:
-		return U32_MAX;
-	case BCH_CSUM_CRC64_NONZERO:
-		return U64_MAX;
 	case BCH_CSUM_CRC32C:
-		return 0;
 	case BCH_CSUM_CRC64:
-		return 0;
+		state->seed = 0;
+		break;
+	case BCH_CSUM_CRC32C_NONZERO:
+		state->seed = U32_MAX;
+		break;
+	case BCH_CSUM_CRC64_NONZERO:
+		state->seed = U64_MAX;
+		break;
+	case BCH_CSUM_XXHASH:
+		xxh64_reset(&state->h64state, 0);
+		break;
 	default:
 		BUG();
 	}
 }
 
-static u64 bch2_checksum_final(unsigned type, u64 crc)
+static u64 bch2_checksum_final(const struct bch2_checksum_state *state)
 {
-	switch (type) {
+	switch (state->type) {
 	case BCH_CSUM_NONE:
-		return 0;
-	case BCH_CSUM_CRC32C_NONZERO:
-		return crc ^ U32_MAX;
-	case BCH_CSUM_CRC64_NONZERO:
-		return crc ^ U64_MAX;
 	case BCH_CSUM_CRC32C:
-		return crc;
 	case BCH_CSUM_CRC64:
-		return crc;
+		return state->seed;
+	case BCH_CSUM_CRC32C_NONZERO:
+		return state->seed ^ U32_MAX;
+	case BCH_CSUM_CRC64_NONZERO:
+		return state->seed ^ U64_MAX;
+	case BCH_CSUM_XXHASH:
+		return xxh64_digest(&state->h64state);
 	default:
 		BUG();
 	}
 }
 
-static u64 bch2_checksum_update(unsigned type, u64 crc, const void *data, size_t len)
+static void bch2_checksum_update(struct bch2_checksum_state *state,
+				 const void *data, size_t len)
 {
-	switch (type) {
+	switch (state->type) {
 	case BCH_CSUM_NONE:
-		return 0;
+		return;
 	case BCH_CSUM_CRC32C_NONZERO:
 	case BCH_CSUM_CRC32C:
-		return crc32c(crc, data, len);
+		state->seed = crc32c(state->seed, data, len);
+		break;
 	case BCH_CSUM_CRC64_NONZERO:
 	case BCH_CSUM_CRC64:
-		return crc64_be(crc, data, len);
+		state->seed = crc64_be(state->seed, data, len);
+		break;
+	case BCH_CSUM_XXHASH:
+		xxh64_update(&state->h64state, data, len);
+		break;
 	default:
 		BUG();
 	}
@@ -140,13 +164,16 @@ struct bch_csum bch2_checksum(struct bch_fs *c, unsigned type,
 	case BCH_CSUM_CRC32C_NONZERO:
 	case BCH_CSUM_CRC64_NONZERO:
 	case BCH_CSUM_CRC32C:
-	case BCH_CSUM_CRC64: {
-		u64 crc = bch2_checksum_init(type);
+	case BCH_CSUM_CRC64:
+	case BCH_CSUM_XXHASH: {
+		struct bch2_checksum_state state = { .type = type };
 
-		crc = bch2_checksum_update(type, crc, data, len);
-		crc = bch2_checksum_final(type, crc);
+		bch2_checksum_init(&state);
+		bch2_checksum_update(&state, data, len);
 
-		return (struct bch_csum) { .lo = cpu_to_le64(crc) };
+		return (struct bch_csum) {
+			.lo = cpu_to_le64(bch2_checksum_final(&state))
+		};
 	}
 
 	case BCH_CSUM_CHACHA20_POLY1305_80:
@@ -189,24 +216,28 @@ static struct bch_csum __bch2_checksum_bio(struct bch_fs *c, unsigned type,
 	case BCH_CSUM_CRC32C_NONZERO:
 	case BCH_CSUM_CRC64_NONZERO:
 	case BCH_CSUM_CRC32C:
-	case BCH_CSUM_CRC64: {
-		u64 crc = bch2_checksum_init(type);
+	case BCH_CSUM_CRC64:
+	case BCH_CSUM_XXHASH: {
+		struct bch2_checksum_state state = { .type = type };
+
+		bch2_checksum_init(&state);
 
 #ifdef CONFIG_HIGHMEM
 		__bio_for_each_segment(bv, bio, *iter, *iter) {
 			void *p = kmap_atomic(bv.bv_page) + bv.bv_offset;
-			crc = bch2_checksum_update(type,
-				crc, p, bv.bv_len);
+
+			bch2_checksum_update(&state, p, bv.bv_len);
 			kunmap_atomic(p);
 		}
 #else
 		__bio_for_each_bvec(bv, bio, *iter, *iter)
-			crc = bch2_checksum_update(type, crc,
+			bch2_checksum_update(&state,
 				page_address(bv.bv_page) + bv.bv_offset,
 				bv.bv_len);
 #endif
-		crc = bch2_checksum_final(type, crc);
-		return (struct bch_csum) { .lo = cpu_to_le64(crc) };
+		return (struct bch_csum) {
+			.lo = cpu_to_le64(bch2_checksum_final(&state))
+		};
 	}
 
 	case BCH_CSUM_CHACHA20_POLY1305_80:
@@ -240,28 +271,143 @@ static struct bch_csum __bch2_checksum_bio(struct bch_fs *c, unsigned type,
 	}
 }
 
+/*
+ * Large bios are split into chunks that are processed in parallel on other
+ * CPUs: crc32c checksums of chunks can be combined in logarithmic time (see
+ * bch2_checksum_merge()), and ChaCha20 can start at any block by offsetting the
+ * nonce:
+ */
+#define BCH_BIO_PARALLEL_MIN		(1U << 20)
+#define BCH_BIO_PARALLEL_CHUNK		(256U << 10)
+#define BCH_BIO_PARALLEL_MAX_CHUNKS	16
+
+struct bch_bio_chunk {
+	struct closure		cl;
+	struct bch_fs		*c;
+	struct bio		*bio;
+	struct bvec_iter	iter;
+	unsigned		type;
+	unsigned		bytes;
+	struct nonce		nonce;
+	struct bch_csum		csum;
+};
+
+static struct bch_bio_chunk *bio_chunks_init(struct bch_fs *c, unsigned type,
+					     struct nonce nonce,
+					     struct bio *bio, unsigned *nr)
+{
+	struct bch_bio_chunk *chunks;
+	struct bvec_iter iter = bio->bi_iter;
+	unsigned i, bytes, offset = 0;
+
+	if (bio->bi_iter.bi_size < BCH_BIO_PARALLEL_MIN)
+		return NULL;
+
+	*nr = min3(DIV_ROUND_UP(bio->bi_iter.bi_size, BCH_BIO_PARALLEL_CHUNK),
+		   BCH_BIO_PARALLEL_MAX_CHUNKS, num_online_cpus());
+	if (*nr < 2)
+		return NULL;
+
+	chunks = kmalloc_array(*nr, sizeof(*chunks), GFP_NOIO);
+	if (!chunks)
+		return NULL;
+
+	bytes = round_up(DIV_ROUND_UP(bio->bi_iter.bi_size, *nr), PAGE_SIZE);
+
+	for (i = 0; i < *nr; i++) {
+		chunks[i].c	= c;
+		chunks[i].bio	= bio;
+		chunks[i].type	= type;
+		chunks[i].nonce	= nonce_add(nonce, offset);
+		chunks[i].iter	= iter;
+		chunks[i].bytes	= min(bytes, iter.bi_size);
+		chunks[i].iter.bi_size = chunks[i].bytes;
+
+		bio_advance_iter(bio, &iter, chunks[i].bytes);
+		offset += chunks[i].bytes;
+	}
+
+	return chunks;
+}
+
+/* The first chunk is done on this CPU: */
+static void bio_chunks_run(struct bch_bio_chunk *chunks, unsigned nr,
+			   closure_fn *fn)
+{
+	struct closure cl;
+	unsigned i;
+
+	closure_init_stack(&cl);
+
+	for (i = 1; i < nr; i++)
+		closure_call(&chunks[i].cl, fn, system_unbound_wq, &cl);
+
+	closure_init(&chunks[0].cl, &cl);
+	fn(&chunks[0].cl);
+
+	closure_sync(&cl);
+}
+
+static void bch2_checksum_chunk_work(struct closure *cl)
+{
+	struct bch_bio_chunk *chunk =
+		container_of(cl, struct bch_bio_chunk, cl);
+
+	chunk->csum = __bch2_checksum_bio(chunk->c, chunk->type, chunk->nonce,
+					  chunk->bio, &chunk->iter);
+	closure_return(cl);
+}
+
+static bool bch2_checksum_bio_parallel(struct bch_fs *c, unsigned type,
+				       struct bio *bio, struct bch_csum *csum)
+{
+	struct bch_bio_chunk *chunks;
+	unsigned i, nr;
+
+	if (type != BCH_CSUM_CRC32C)
+		return false;
+
+	chunks = bio_chunks_init(c, type, (struct nonce) {{ 0 }}, bio, &nr);
+	if (!chunks)
+		return false;
+
+	bio_chunks_run(chunks, nr, bch2_checksum_chunk_work);
+
+	*csum = chunks[0].csum;
+	for (i = 1; i < nr; i++)
+		*csum = bch2_checksum_merge(type, *csum, chunks[i].csum,
+					    chunks[i].bytes);
+
+	kfree(chunks);
+	return true;
+}
+
 struct bch_csum bch2_checksum_bio(struct bch_fs *c, unsigned type,
 				  struct nonce nonce, struct bio *bio)
 {
 	struct bvec_iter iter = bio->bi_iter;
+	struct bch_csum csum;
+
+	if (bch2_checksum_bio_parallel(c, type, bio, &csum))
+		return csum;
 
 	return __bch2_checksum_bio(c, type, nonce, bio, &iter);
 }
 
-void bch2_encrypt_bio(struct bch_fs *c, unsigned type,
-		      struct nonce nonce, struct bio *bio)
+static void __bch2_encrypt_bio(struct bch_fs *c, struct nonce nonce,
+			       struct bio *bio, struct bvec_iter iter)
 {
 	struct bio_vec bv;
-	struct bvec_iter iter;
 	struct scatterlist sgl[16], *sg = sgl;
 	size_t bytes = 0;
 
-	if (!bch2_csum_type_is_encryption(type))
-		return;
-
 	sg_init_table(sgl, ARRAY_SIZE(sgl));
 
-	bio_for_each_segment(bv, bio, iter) {
+	/*
+	 * Multi page bvecs are physically contiguous, so each one only needs
+	 * a single scatterlist entry:
+	 */
+	__bio_for_each_bvec(bv, bio, iter, iter) {
 		if (sg == sgl + ARRAY_SIZE(sgl)) {
 			sg_mark_end(sg - 1);
 			do_encrypt_sg(c->chacha20, nonce, sgl, bytes);
@@ -281,19 +427,57 @@ void bch2_encrypt_bio(struct bch_fs *c, unsigned type,
 	do_encrypt_sg(c->chacha20, nonce, sgl, bytes);
 }
 
+static void bch2_encrypt_chunk_work(struct closure *cl)
+{
+	struct bch_bio_chunk *chunk =
+		container_of(cl, struct bch_bio_chunk, cl);
+
+	__bch2_encrypt_bio(chunk->c, chunk->nonce, chunk->bio, chunk->iter);
+	closure_return(cl);
+}
+
+void bch2_encrypt_bio(struct bch_fs *c, unsigned type,
+		      struct nonce nonce, struct bio *bio)
+{
+	struct bch_bio_chunk *chunks;
+	unsigned nr;
+
+	if (!bch2_csum_type_is_encryption(type))
+		return;
+
+	chunks = bio_chunks_init(c, type, nonce, bio, &nr);
+	if (chunks) {
+		bio_chunks_run(chunks, nr, bch2_encrypt_chunk_work);
+		kfree(chunks);
+		return;
+	}
+
+	__bch2_encrypt_bio(c, nonce, bio, bio->bi_iter);
+}
+
 struct bch_csum bch2_checksum_merge(unsigned type, struct bch_csum a,
 				    struct bch_csum b, size_t b_len)
 {
+	struct bch2_checksum_state state = { .type = type };
+
 	BUG_ON(!bch2_checksum_mergeable(type));
 
+	if (type == BCH_CSUM_CRC32C) {
+		a.lo = cpu_to_le64(__crc32c_le_shift(le64_to_cpu(a.lo), b_len));
+		b_len = 0;
+	}
+
+	state.seed = le64_to_cpu(a.lo);
+
 	while (b_len) {
 		unsigned b = min_t(unsigned, b_len, PAGE_SIZE);
 
-		a.lo = bch2_checksum_update(type, a.lo,
+		bch2_checksum_update(&state,
 				page_address(ZERO_PAGE(0)), b);
 		b_len -= b;
 	}
 
+	a.lo = cpu_to_le64(state.seed);
 	a.lo ^= b.lo;
 	a.hi ^= b.hi;
 	return a;
@@ -83,6 +83,8 @@ static inline enum bch_csum_type bch2_csum_opt_to_type(enum bch_csum_opts type,
 	     return data ? BCH_CSUM_CRC32C : BCH_CSUM_CRC32C_NONZERO;
 	case BCH_CSUM_OPT_CRC64:
 	     return data ? BCH_CSUM_CRC64 : BCH_CSUM_CRC64_NONZERO;
+	case BCH_CSUM_OPT_XXHASH:
+	     return BCH_CSUM_XXHASH;
 	default:
 	     BUG();
 	}
@@ -107,6 +109,21 @@ static inline enum bch_csum_type bch2_meta_checksum_type(struct bch_fs *c)
 	return bch2_csum_opt_to_type(c->opts.metadata_checksum, false);
 }
 
+/*
+ * Checksummed uncompressed extents are split at this size when written, and
+ * not merged past it - a read has to read and verify everything a checksum
+ * covers:
+ */
+static inline unsigned bch2_csum_granularity(struct bch_fs *c)
+{
+	unsigned sectors = round_down(c->opts.checksum_granularity,
+				      c->opts.block_size);
+
+	return sectors && sectors < c->sb.encoded_extent_max
+		? sectors
+		: c->sb.encoded_extent_max;
+}
+
 static const unsigned bch2_compression_opt_to_type[] = {
 #define x(t, n) [BCH_COMPRESSION_OPT_##t] = BCH_COMPRESSION_TYPE_##t,
 	BCH_COMPRESSION_OPTS()
@@ -13,6 +13,16 @@ static inline long io_timer_cmp(io_timer_heap *h,
 	return l->expire - r->expire;
 }
 
+/* Called with timer_lock held, whenever the first timer in the heap changes: */
+static void io_clock_next_expire_update(struct io_clock *clock)
+{
+	WRITE_ONCE(clock->next_expire, clock->timers.used
+		   ? clock->timers.data[0]->expire
+		   : (unsigned long) atomic64_read(&clock->now) + LONG_MAX);
+}
+
+static void io_clock_run_expired(struct io_clock *, unsigned long);
+
 void bch2_io_timer_add(struct io_clock *clock, struct io_timer *timer)
 {
 	size_t i;
@@ -31,8 +41,17 @@ void bch2_io_timer_add(struct io_clock *clock, struct io_timer *timer)
 			goto out;
 
 	BUG_ON(!heap_add(&clock->timers, timer, io_timer_cmp, NULL));
+	io_clock_next_expire_update(clock);
 out:
 	spin_unlock(&clock->timer_lock);
+
+	/*
+	 * Pairs with the atomic64_add_return() in __bch2_increment_clock(): if
+	 * the clock advanced past our timer before it saw the new next_expire,
+	 * we have to run it ourselves:
+	 */
+	smp_mb();
+	io_clock_run_expired(clock, atomic64_read(&clock->now));
 }
 
 void bch2_io_timer_del(struct io_clock *clock, struct io_timer *timer)
@@ -44,6 +63,7 @@ void bch2_io_timer_del(struct io_clock *clock, struct io_timer *timer)
 	for (i = 0; i < clock->timers.used; i++)
 		if (clock->timers.data[i] == timer) {
 			heap_del(&clock->timers, i, io_timer_cmp, NULL);
+			io_clock_next_expire_update(clock);
 			break;
 		}
 
@@ -135,23 +155,33 @@ static struct io_timer *get_expired_timer(struct io_clock *clock,
 	spin_lock(&clock->timer_lock);
 
 	if (clock->timers.used &&
-	    time_after_eq(now, clock->timers.data[0]->expire))
+	    time_after_eq(now, clock->timers.data[0]->expire)) {
 		heap_pop(&clock->timers, ret, io_timer_cmp, NULL);
+		io_clock_next_expire_update(clock);
+	}
 
 	spin_unlock(&clock->timer_lock);
 
 	return ret;
 }
 
-void __bch2_increment_clock(struct io_clock *clock, unsigned sectors)
+static void io_clock_run_expired(struct io_clock *clock, unsigned long now)
 {
 	struct io_timer *timer;
-	unsigned long now = atomic64_add_return(sectors, &clock->now);
+
+	if (time_before(now, READ_ONCE(clock->next_expire)))
+		return;
 
 	while ((timer = get_expired_timer(clock, now)))
 		timer->fn(timer);
 }
 
+void __bch2_increment_clock(struct io_clock *clock, unsigned sectors)
+{
+	/* atomic64_add_return() implies a full barrier before next_expire: */
+	io_clock_run_expired(clock, atomic64_add_return(sectors, &clock->now));
+}
+
 void bch2_io_timers_to_text(struct printbuf *out, struct io_clock *clock)
 {
 	unsigned long now;
@@ -176,6 +206,7 @@ void bch2_io_clock_exit(struct io_clock *clock)
 int bch2_io_clock_init(struct io_clock *clock)
 {
 	atomic64_set(&clock->now, 0);
+	clock->next_expire = LONG_MAX;
 	spin_lock_init(&clock->timer_lock);
 
 	clock->max_slop = IO_CLOCK_PCPU_SECTORS * num_possible_cpus();
@@ -30,6 +30,12 @@ struct io_clock {
 	u16 __percpu		*pcpu_buf;
 	unsigned		max_slop;
 
+	/*
+	 * Expiry of the first timer in the heap, so that advancing the clock
+	 * doesn't have to take timer_lock unless a timer might have expired:
+	 */
+	unsigned long		next_expire;
+
 	spinlock_t		timer_lock;
 	io_timer_heap		timers;
 };
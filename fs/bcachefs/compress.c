@@ -20,6 +20,8 @@ struct bbuf {
 		BB_MEMPOOL,
 	}		type;
 	int		rw;
+	/* BB_VMAP: */
+	unsigned	nr_pages;
 };
 
 static struct bbuf __bounce_alloc(struct bch_fs *c, unsigned size, int rw)
@@ -103,14 +105,20 @@ static struct bbuf __bio_map_or_bounce(struct bch_fs *c, struct bio *bio,
 	__bio_for_each_segment(bv, bio, iter, start)
 		pages[nr_pages++] = bv.bv_page;
 
-	data = vmap(pages, nr_pages, VM_MAP, PAGE_KERNEL);
+	/*
+	 * vm_map_ram() maps small ranges out of per cpu blocks, and batches
+	 * the TLB flushes on unmap - unlike vmap(), which takes the global
+	 * vmap_area_lock every time, and would make mapping more expensive
+	 * than bouncing at high throughput:
+	 */
+	data = vm_map_ram(pages, nr_pages, NUMA_NO_NODE);
 	if (pages != stack_pages)
 		kfree(pages);
 
 	if (data)
 		return (struct bbuf) {
 			.b = data + bio_iter_offset(bio, start),
-			.type = BB_VMAP, .rw = rw
+			.type = BB_VMAP, .rw = rw, .nr_pages = nr_pages,
 		};
 bounce:
 	ret = __bounce_alloc(c, start.bi_size, rw);
@@ -132,7 +140,8 @@ static void bio_unmap_or_unbounce(struct bch_fs *c, struct bbuf buf)
 	case BB_NONE:
 		break;
 	case BB_VMAP:
-		vunmap((void *) ((unsigned long) buf.b & PAGE_MASK));
+		vm_unmap_ram((void *) ((unsigned long) buf.b & PAGE_MASK),
+			     buf.nr_pages);
 		break;
 	case BB_KMALLOC:
 		kfree(buf.b);
@@ -150,75 +159,84 @@ static inline void zlib_set_workspace(z_stream *strm, void *workspace)
 #endif
 }
 
-static int __bio_uncompress(struct bch_fs *c, struct bio *src,
-			    void *dst_data, struct bch_extent_crc_unpacked crc)
+static int __uncompress(struct bch_fs *c, unsigned compression_type,
+			void *src_data, size_t src_len,
+			void *dst_data, size_t dst_len)
 {
-	struct bbuf src_data = { NULL };
-	size_t src_len = src->bi_iter.bi_size;
-	size_t dst_len = crc.uncompressed_size << 9;
 	void *workspace;
 	int ret;
 
-	src_data = bio_map_or_bounce(c, src, READ);
-
-	switch (crc.compression_type) {
+	switch (compression_type) {
 	case BCH_COMPRESSION_TYPE_lz4_old:
 	case BCH_COMPRESSION_TYPE_lz4:
-		ret = LZ4_decompress_safe_partial(src_data.b, dst_data,
+		ret = LZ4_decompress_safe_partial(src_data, dst_data,
 						  src_len, dst_len, dst_len);
 		if (ret != dst_len)
-			goto err;
+			return -EIO;
 		break;
 	case BCH_COMPRESSION_TYPE_gzip: {
 		z_stream strm = {
-			.next_in	= src_data.b,
+			.next_in	= src_data,
 			.avail_in	= src_len,
 			.next_out	= dst_data,
 			.avail_out	= dst_len,
 		};
 
-		workspace = mempool_alloc(&c->decompress_workspace, GFP_NOIO);
+		workspace = mempool_alloc(&c->decompress_workspace[compression_type],
+					  GFP_NOIO);
 
 		zlib_set_workspace(&strm, workspace);
 		zlib_inflateInit2(&strm, -MAX_WBITS);
 		ret = zlib_inflate(&strm, Z_FINISH);
 
-		mempool_free(workspace, &c->decompress_workspace);
+		mempool_free(workspace, &c->decompress_workspace[compression_type]);
 
 		if (ret != Z_STREAM_END)
-			goto err;
+			return -EIO;
 		break;
 	}
 	case BCH_COMPRESSION_TYPE_zstd: {
 		ZSTD_DCtx *ctx;
-		size_t real_src_len = le32_to_cpup(src_data.b);
+		size_t real_src_len = le32_to_cpup(src_data);
 
 		if (real_src_len > src_len - 4)
-			goto err;
+			return -EIO;
 
-		workspace = mempool_alloc(&c->decompress_workspace, GFP_NOIO);
+		workspace = mempool_alloc(&c->decompress_workspace[compression_type],
+					  GFP_NOIO);
 		ctx = ZSTD_initDCtx(workspace, ZSTD_DCtxWorkspaceBound());
 
 		ret = ZSTD_decompressDCtx(ctx,
 				dst_data,	dst_len,
-				src_data.b + 4, real_src_len);
+				src_data + 4, real_src_len);
 
-		mempool_free(workspace, &c->decompress_workspace);
+		mempool_free(workspace, &c->decompress_workspace[compression_type]);
 
 		if (ret != dst_len)
-			goto err;
+			return -EIO;
 		break;
 	}
 	default:
 		BUG();
 	}
-	ret = 0;
-out:
+
+	return 0;
+}
+
+static int __bio_uncompress(struct bch_fs *c, struct bio *src,
+			    void *dst_data, struct bch_extent_crc_unpacked crc)
+{
+	struct bbuf src_data = { NULL };
+	int ret;
+
+	src_data = bio_map_or_bounce(c, src, READ);
+
+	ret = __uncompress(c, crc.compression_type,
+			   src_data.b, src->bi_iter.bi_size,
+			   dst_data, crc.uncompressed_size << 9);
+
 	bio_unmap_or_unbounce(c, src_data);
 	return ret;
-err:
-	ret = -EIO;
-	goto out;
 }
 
 int bch2_bio_uncompress_inplace(struct bch_fs *c, struct bio *bio,
@@ -292,16 +310,100 @@ int bch2_bio_uncompress(struct bch_fs *c, struct bio *src,
 	return ret;
 }
 
+/*
+ * Buffer (de)compression, for metadata - bch2_uncompress_buf() must be given
+ * the exact compressed size:
+ */
+int bch2_uncompress_buf(struct bch_fs *c, unsigned compression_type,
+			void *src, size_t src_len,
+			void *dst, size_t dst_len)
+{
+	if (compression_type != BCH_COMPRESSION_TYPE_lz4 &&
+	    compression_type != BCH_COMPRESSION_TYPE_gzip &&
+	    compression_type != BCH_COMPRESSION_TYPE_zstd)
+		return -EINVAL;
+
+	if (compression_type != BCH_COMPRESSION_TYPE_lz4 &&
+	    !mempool_initialized(&c->decompress_workspace[compression_type]))
+		return -EINVAL;
+
+	return __uncompress(c, compression_type, src, src_len, dst, dst_len);
+}
+
+/*
+ * Cheap check for data that's already compressed (or encrypted, or random):
+ * estimate the Shannon entropy of a sample of the input, so we don't pay for a
+ * full compression attempt that's going to fail.
+ *
+ * Entropy is computed in units of quarter bits, using ilog2() of the fourth
+ * power of counts for a bit of extra precision:
+ */
+#define ENTROPY_SAMPLE_STRIDE		256
+#define ENTROPY_SAMPLE_LEN		16
+#define ENTROPY_MIN_INPUT		(ENTROPY_SAMPLE_STRIDE * 16)
+#define ENTROPY_MAX_SAMPLES		4096
+/* 7.5 bits per byte: */
+#define ENTROPY_INCOMPRESSIBLE		30
+
+static inline u64 pow4(u64 v)
+{
+	return v * v * v * v;
+}
+
+static bool data_looks_incompressible(const void *src, size_t len)
+{
+	u16 counts[256];
+	const u8 *p = src;
+	size_t i, j, nr = 0, stride;
+	u64 sum = 0;
+	unsigned entropy;
+
+	if (len < ENTROPY_MIN_INPUT)
+		return false;
+
+	stride = max_t(size_t, ENTROPY_SAMPLE_STRIDE,
+		       len / (ENTROPY_MAX_SAMPLES / ENTROPY_SAMPLE_LEN));
+
+	memset(counts, 0, sizeof(counts));
+
+	for (i = 0; i + ENTROPY_SAMPLE_LEN <= len; i += stride)
+		for (j = 0; j < ENTROPY_SAMPLE_LEN; j++, nr++)
+			counts[p[i + j]]++;
+
+	for (i = 0; i < ARRAY_SIZE(counts); i++)
+		if (counts[i])
+			sum += counts[i] * ilog2(pow4(counts[i]));
+
+	entropy = ilog2(pow4(nr)) - div64_u64(sum, nr);
+
+	return entropy >= ENTROPY_INCOMPRESSIBLE;
+}
+
 static int attempt_compress(struct bch_fs *c,
 			    void *workspace,
 			    void *dst, size_t dst_len,
 			    void *src, size_t src_len,
-			    enum bch_compression_type compression_type)
+			    enum bch_compression_type compression_type,
+			    unsigned level)
 {
 	switch (compression_type) {
 	case BCH_COMPRESSION_TYPE_lz4: {
 		int len = src_len;
-		int ret = LZ4_compress_destSize(
+		int ret;
+
+		/*
+		 * A nonzero level means lz4hc: the output is plain lz4 and
+		 * decompresses the same way, but lz4hc can't tell us how much
+		 * input would fit, so __compress_buf() has to search:
+		 */
+		if (level)
+			return LZ4_compress_HC(src, dst, src_len, dst_len,
+					clamp_t(unsigned, level,
+						LZ4HC_MIN_CLEVEL,
+						LZ4HC_MAX_CLEVEL),
+					workspace);
+
+		ret = LZ4_compress_destSize(
 				src,		dst,
 				&len,		dst_len,
 				workspace);
@@ -320,7 +422,8 @@ static int attempt_compress(struct bch_fs *c,
 		};
 
 		zlib_set_workspace(&strm, workspace);
-		zlib_deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+		zlib_deflateInit2(&strm,
+				  level ? min(level, 9U) : Z_DEFAULT_COMPRESSION,
 				  Z_DEFLATED, -MAX_WBITS, DEF_MEM_LEVEL,
 				  Z_DEFAULT_STRATEGY);
 
@@ -333,8 +436,12 @@ static int attempt_compress(struct bch_fs *c,
 		return strm.total_out;
 	}
 	case BCH_COMPRESSION_TYPE_zstd: {
+		ZSTD_parameters params = level
+			? ZSTD_getParams(min_t(unsigned, level, ZSTD_maxCLevel()),
+					 c->sb.encoded_extent_max << 9, 0)
+			: c->zstd_params;
 		ZSTD_CCtx *ctx = ZSTD_initCCtx(workspace,
-			ZSTD_CCtxWorkspaceBound(c->zstd_params.cParams));
+					       c->zstd_workspace_size);
 
 		/*
 		 * ZSTD requires that when we decompress we pass in the exact
@@ -350,7 +457,7 @@ static int attempt_compress(struct bch_fs *c,
 		size_t len = ZSTD_compressCCtx(ctx,
 				dst + 4,	dst_len - 4 - 7,
 				src,		src_len,
-				c->zstd_params);
+				params);
 		if (ZSTD_isError(len))
 			return 0;
 
@@ -362,30 +469,27 @@ static int attempt_compress(struct bch_fs *c,
 	}
 }
 
-static unsigned __bio_compress(struct bch_fs *c,
-			       struct bio *dst, size_t *dst_len,
-			       struct bio *src, size_t *src_len,
-			       enum bch_compression_type compression_type)
+/*
+ * Compress as much of @src as fits in @dst, padded to a block boundary - on
+ * success returns 0, and @src_len and @dst_len are updated to the amount
+ * consumed and produced. @workspace may be NULL, to use one from the mempool:
+ */
+static int __compress_buf(struct bch_fs *c, void *workspace,
+			  void *dst, size_t *dst_len,
+			  void *src, size_t *src_len,
+			  enum bch_compression_type compression_type,
+			  unsigned level)
 {
-	struct bbuf src_data = { NULL }, dst_data = { NULL };
-	void *workspace;
+	mempool_t *pool = &c->compress_workspace[compression_type];
+	bool from_pool = !workspace;
 	unsigned pad;
 	int ret = 0;
 
-	BUG_ON(compression_type >= BCH_COMPRESSION_TYPE_NR);
-	BUG_ON(!mempool_initialized(&c->compress_workspace[compression_type]));
-
-	/* If it's only one block, don't bother trying to compress: */
-	if (bio_sectors(src) <= c->opts.block_size)
-		return 0;
-
-	dst_data = bio_map_or_bounce(c, dst, WRITE);
-	src_data = bio_map_or_bounce(c, src, READ);
+	if (data_looks_incompressible(src, *src_len))
+		return -1;
 
-	workspace = mempool_alloc(&c->compress_workspace[compression_type], GFP_NOIO);
-
-	*src_len = src->bi_iter.bi_size;
-	*dst_len = dst->bi_iter.bi_size;
+	if (from_pool)
+		workspace = mempool_alloc(pool, GFP_NOIO);
 
 	/*
 	 * XXX: this algorithm sucks when the compression code doesn't tell us
@@ -398,9 +502,9 @@ static unsigned __bio_compress(struct bch_fs *c,
 		}
 
 		ret = attempt_compress(c, workspace,
-				       dst_data.b,	*dst_len,
-				       src_data.b,	*src_len,
-				       compression_type);
+				       dst,	*dst_len,
+				       src,	*src_len,
+				       compression_type, level);
 		if (ret > 0) {
 			*dst_len = ret;
 			ret = 0;
@@ -425,41 +529,160 @@ static unsigned __bio_compress(struct bch_fs *c,
 		*src_len = round_down(*src_len, block_bytes(c));
 	}
 
-	mempool_free(workspace, &c->compress_workspace[compression_type]);
+	if (from_pool)
+		mempool_free(workspace, pool);
 
 	if (ret)
-		goto err;
+		return ret;
 
 	/* Didn't get smaller: */
 	if (round_up(*dst_len, block_bytes(c)) >= *src_len)
-		goto err;
+		return -1;
 
 	pad = round_up(*dst_len, block_bytes(c)) - *dst_len;
 
-	memset(dst_data.b + *dst_len, 0, pad);
+	memset(dst + *dst_len, 0, pad);
 	*dst_len += pad;
 
+	BUG_ON(*dst_len & (block_bytes(c) - 1));
+	BUG_ON(*src_len & (block_bytes(c) - 1));
+	return 0;
+}
+
+static unsigned __bio_compress(struct bch_fs *c,
+			       struct bio *dst, size_t *dst_len,
+			       struct bio *src, size_t *src_len,
+			       enum bch_compression_type compression_type,
+			       unsigned level)
+{
+	struct bbuf src_data = { NULL }, dst_data = { NULL };
+
+	BUG_ON(compression_type >= BCH_COMPRESSION_TYPE_NR);
+	BUG_ON(!mempool_initialized(&c->compress_workspace[compression_type]));
+
+	/* If it's only one block, don't bother trying to compress: */
+	if (bio_sectors(src) <= c->opts.block_size)
+		return 0;
+
+	dst_data = bio_map_or_bounce(c, dst, WRITE);
+	src_data = bio_map_or_bounce(c, src, READ);
+
+	*src_len = src->bi_iter.bi_size;
+	*dst_len = dst->bi_iter.bi_size;
+
+	if (__compress_buf(c, NULL, dst_data.b, dst_len, src_data.b, src_len,
+			   compression_type, level)) {
+		compression_type = BCH_COMPRESSION_TYPE_incompressible;
+		goto out;
+	}
+
 	if (dst_data.type != BB_NONE &&
 	    dst_data.type != BB_VMAP)
 		memcpy_to_bio(dst, dst->bi_iter, dst_data.b);
 
 	BUG_ON(!*dst_len || *dst_len > dst->bi_iter.bi_size);
 	BUG_ON(!*src_len || *src_len > src->bi_iter.bi_size);
-	BUG_ON(*dst_len & (block_bytes(c) - 1));
-	BUG_ON(*src_len & (block_bytes(c) - 1));
 out:
 	bio_unmap_or_unbounce(c, src_data);
 	bio_unmap_or_unbounce(c, dst_data);
 	return compression_type;
-err:
-	compression_type = BCH_COMPRESSION_TYPE_incompressible;
-	goto out;
+}
+
+/*
+ * Workspaces for compressing several extents of a write in parallel: each
+ * worker needs its own, and the mempool only reserves enough for one
+ * compression at a time, so these are allocated outside it and may fail:
+ */
+void *bch2_compress_workspace_alloc(struct bch_fs *c,
+				    unsigned compression_type)
+{
+	if (compression_type == BCH_COMPRESSION_TYPE_lz4_old)
+		compression_type = BCH_COMPRESSION_TYPE_lz4;
+
+	return kvpmalloc((size_t)
+			 c->compress_workspace[compression_type].pool_data,
+			 GFP_NOIO|__GFP_NOWARN);
+}
+
+void bch2_compress_workspace_free(struct bch_fs *c,
+				  unsigned compression_type, void *workspace)
+{
+	if (compression_type == BCH_COMPRESSION_TYPE_lz4_old)
+		compression_type = BCH_COMPRESSION_TYPE_lz4;
+
+	kvpfree(workspace, (size_t)
+		c->compress_workspace[compression_type].pool_data);
+}
+
+/*
+ * Compress the data at @src_iter into a linear buffer of at least @dst_len
+ * bytes, for when the output's position in the write bio isn't known yet (i.e.
+ * when compressing several extents of a write in parallel), using a workspace
+ * from bch2_compress_workspace_alloc():
+ */
+unsigned bch2_bio_compress_to_buf(struct bch_fs *c, void *workspace,
+				  void *dst, size_t *dst_len,
+				  struct bio *src, struct bvec_iter src_iter,
+				  size_t *src_len,
+				  unsigned compression_type,
+				  unsigned level)
+{
+	struct bbuf src_data;
+
+	if (compression_type == BCH_COMPRESSION_TYPE_lz4_old)
+		compression_type = BCH_COMPRESSION_TYPE_lz4;
+
+	BUG_ON(compression_type >= BCH_COMPRESSION_TYPE_NR);
+	BUG_ON(!mempool_initialized(&c->compress_workspace[compression_type]));
+
+	src_iter.bi_size = min_t(unsigned, src_iter.bi_size,
+				 c->sb.encoded_extent_max << 9);
+	*dst_len = min_t(size_t, *dst_len, src_iter.bi_size);
+
+	if (bvec_iter_sectors(src_iter) <= c->opts.block_size)
+		return 0;
+
+	src_data = __bio_map_or_bounce(c, src, src_iter, READ);
+	*src_len = src_iter.bi_size;
+
+	if (__compress_buf(c, workspace, dst, dst_len, src_data.b, src_len,
+			   compression_type, level))
+		compression_type = BCH_COMPRESSION_TYPE_incompressible;
+
+	bio_unmap_or_unbounce(c, src_data);
+	return compression_type;
+}
+
+/* Returns compressed size, or 0 if the result didn't fit in @dst_len: */
+size_t bch2_compress_buf(struct bch_fs *c, unsigned compression_type,
+			 void *src, size_t src_len,
+			 void *dst, size_t dst_len)
+{
+	void *workspace;
+	int ret;
+
+	BUG_ON(compression_type >= BCH_COMPRESSION_TYPE_NR);
+
+	if (!mempool_initialized(&c->compress_workspace[compression_type]))
+		return 0;
+
+	workspace = mempool_alloc(&c->compress_workspace[compression_type], GFP_NOIO);
+
+	ret = attempt_compress(c, workspace,
+			       dst, dst_len,
+			       src, src_len,
+			       compression_type, 0);
+
+	mempool_free(workspace, &c->compress_workspace[compression_type]);
+
+	return max(ret, 0);
 }
 
 unsigned bch2_bio_compress(struct bch_fs *c,
 			   struct bio *dst, size_t *dst_len,
 			   struct bio *src, size_t *src_len,
-			   unsigned compression_type)
+			   unsigned compression_type,
+			   unsigned level)
 {
 	unsigned orig_dst = dst->bi_iter.bi_size;
 	unsigned orig_src = src->bi_iter.bi_size;
@@ -474,7 +697,8 @@ unsigned bch2_bio_compress(struct bch_fs *c,
 		compression_type = BCH_COMPRESSION_TYPE_lz4;
 
 	compression_type =
-		__bio_compress(c, dst, dst_len, src, src_len, compression_type);
+		__bio_compress(c, dst, dst_len, src, src_len,
+			       compression_type, level);
 
 	dst->bi_iter.bi_size = orig_dst;
 	src->bi_iter.bi_size = orig_src;
@@ -535,31 +759,62 @@ void bch2_fs_compress_exit(struct bch_fs *c)
 {
 	unsigned i;
 
-	mempool_exit(&c->decompress_workspace);
+	for (i = 0; i < ARRAY_SIZE(c->decompress_workspace); i++)
+		mempool_exit(&c->decompress_workspace[i]);
 	for (i = 0; i < ARRAY_SIZE(c->compress_workspace); i++)
 		mempool_exit(&c->compress_workspace[i]);
 	mempool_exit(&c->compression_bounce[WRITE]);
 	mempool_exit(&c->compression_bounce[READ]);
 }
 
+/* Workspaces have to be big enough for any of the configured levels: */
+static size_t zstd_workspace_size(struct bch_fs *c, size_t max_extent)
+{
+	unsigned levels[] = {
+		0,
+		c->opts.compression_level,
+		c->opts.background_compression_level,
+	};
+	size_t ret = 0;
+	unsigned i;
+
+	for (i = 0; i < ARRAY_SIZE(levels); i++) {
+		ZSTD_parameters params =
+			ZSTD_getParams(min_t(unsigned, levels[i], ZSTD_maxCLevel()),
+				       max_extent, 0);
+
+		ret = max(ret, ZSTD_CCtxWorkspaceBound(params.cParams));
+	}
+
+	return ret;
+}
+
+static size_t lz4_workspace_size(struct bch_fs *c)
+{
+	return c->opts.compression_level ||
+		c->opts.background_compression_level
+		? max(LZ4_MEM_COMPRESS, LZ4HC_MEM_COMPRESS)
+		: LZ4_MEM_COMPRESS;
+}
+
 static int __bch2_fs_compress_init(struct bch_fs *c, u64 features)
 {
 	size_t max_extent = c->sb.encoded_extent_max << 9;
-	size_t decompress_workspace_size = 0;
-	bool decompress_workspace_needed;
 	ZSTD_parameters params = ZSTD_getParams(0, max_extent, 0);
+	size_t zstd_workspace = zstd_workspace_size(c, max_extent);
 	struct {
 		unsigned	feature;
 		unsigned	type;
 		size_t		compress_workspace;
 		size_t		decompress_workspace;
 	} compression_types[] = {
-		{ BCH_FEATURE_lz4, BCH_COMPRESSION_TYPE_lz4, LZ4_MEM_COMPRESS, 0 },
+		{ BCH_FEATURE_lz4, BCH_COMPRESSION_TYPE_lz4,
+			lz4_workspace_size(c), 0 },
 		{ BCH_FEATURE_gzip, BCH_COMPRESSION_TYPE_gzip,
 			zlib_deflate_workspacesize(MAX_WBITS, DEF_MEM_LEVEL),
 			zlib_inflate_workspacesize(), },
 		{ BCH_FEATURE_zstd, BCH_COMPRESSION_TYPE_zstd,
-			ZSTD_CCtxWorkspaceBound(params.cParams),
+			zstd_workspace,
 			ZSTD_DCtxWorkspaceBound() },
 	}, *i;
 	int ret = 0;
@@ -567,6 +822,7 @@ static int __bch2_fs_compress_init(struct bch_fs *c, u64 features)
 	pr_verbose_init(c->opts, "");
 
 	c->zstd_params = params;
+	c->zstd_workspace_size = zstd_workspace;
 
 	for (i = compression_types;
 	     i < compression_types + ARRAY_SIZE(compression_types);
@@ -591,40 +847,63 @@ static int __bch2_fs_compress_init(struct bch_fs *c, u64 features)
 			goto out;
 	}
 
+	/*
+	 * Workspaces are only allocated for the compression types that are
+	 * enabled; the zstd workspaces in particular are large. Decompression
+	 * workspaces are per type too, so that enabling a new type later never
+	 * requires resizing a pool that may be in use:
+	 */
 	for (i = compression_types;
 	     i < compression_types + ARRAY_SIZE(compression_types);
 	     i++) {
-		decompress_workspace_size =
-			max(decompress_workspace_size, i->decompress_workspace);
-
 		if (!(features & (1 << i->feature)))
 			continue;
 
-		if (i->decompress_workspace)
-			decompress_workspace_needed = true;
-
-		if (mempool_initialized(&c->compress_workspace[i->type]))
-			continue;
-
-		ret = mempool_init_kvpmalloc_pool(
-				&c->compress_workspace[i->type],
-				1, i->compress_workspace);
-		if (ret)
-			goto out;
-	}
+		if (!mempool_initialized(&c->compress_workspace[i->type])) {
+			ret = mempool_init_kvpmalloc_pool(
+					&c->compress_workspace[i->type],
+					1, i->compress_workspace);
+			if (ret)
+				goto out;
+		}
 
-	if (!mempool_initialized(&c->decompress_workspace)) {
-		ret = mempool_init_kvpmalloc_pool(
-				&c->decompress_workspace,
-				1, decompress_workspace_size);
-		if (ret)
-			goto out;
+		if (i->decompress_workspace &&
+		    !mempool_initialized(&c->decompress_workspace[i->type])) {
+			ret = mempool_init_kvpmalloc_pool(
+					&c->decompress_workspace[i->type],
+					1, i->decompress_workspace);
+			if (ret)
+				goto out;
+		}
 	}
 out:
 	pr_verbose_init(c->opts, "ret %i", ret);
 	return ret;
 }
 
+/*
+ * Metadata compression options may have been set at format time, or as mount
+ * options, without going through bch2_opt_check_may_set() - returns the feature
+ * bits journal and btree node writes need (with the compression types), for
+ * setting in the superblock before we start writing:
+ */
+u64 bch2_metadata_compression_features(struct bch_fs *c)
+{
+	unsigned btree = c->opts.metadata_compression;
+	unsigned journal = c->opts.journal_compression;
+	u64 f = 0;
+
+	if (btree)
+		f |= (1ULL << BCH_FEATURE_btree_node_compression)|
+		     (1ULL << bch2_compression_opt_to_feature[btree]);
+
+	if (journal)
+		f |= (1ULL << BCH_FEATURE_journal_compression)|
+		     (1ULL << bch2_compression_opt_to_feature[journal]);
+
+	return f;
+}
+
 int bch2_fs_compress_init(struct bch_fs *c)
 {
 	u64 f = c->sb.features;
@@ -635,6 +914,12 @@ int bch2_fs_compress_init(struct bch_fs *c)
 	if (c->opts.background_compression)
 		f |= 1ULL << bch2_compression_opt_to_feature[c->opts.background_compression];
 
+	if (c->opts.metadata_compression)
+		f |= 1ULL << bch2_compression_opt_to_feature[c->opts.metadata_compression];
+
+	if (c->opts.journal_compression)
+		f |= 1ULL << bch2_compression_opt_to_feature[c->opts.journal_compression];
+
 	return __bch2_fs_compress_init(c, f);
 
 }
@@ -9,9 +9,20 @@ int bch2_bio_uncompress_inplace(struct bch_fs *, struct bio *,
 int bch2_bio_uncompress(struct bch_fs *, struct bio *, struct bio *,
 		       struct bvec_iter, struct bch_extent_crc_unpacked);
 unsigned bch2_bio_compress(struct bch_fs *, struct bio *, size_t *,
-			   struct bio *, size_t *, unsigned);
+			   struct bio *, size_t *, unsigned, unsigned);
+void *bch2_compress_workspace_alloc(struct bch_fs *, unsigned);
+void bch2_compress_workspace_free(struct bch_fs *, unsigned, void *);
+unsigned bch2_bio_compress_to_buf(struct bch_fs *, void *, void *, size_t *,
+				  struct bio *, struct bvec_iter,
+				  size_t *, unsigned, unsigned);
+
+int bch2_uncompress_buf(struct bch_fs *, unsigned,
+			void *, size_t, void *, size_t);
+size_t bch2_compress_buf(struct bch_fs *, unsigned,
+			 void *, size_t, void *, size_t);
 
 int bch2_check_set_has_compressed_data(struct bch_fs *, unsigned);
+u64 bch2_metadata_compression_features(struct bch_fs *);
 void bch2_fs_compress_exit(struct bch_fs *);
 int bch2_fs_compress_init(struct bch_fs *);
 
@@ -374,6 +374,101 @@ static const struct file_operations bfloat_failed_debug_ops = {
 	.read		= bch2_read_bfloat_failed,
 };
 
+/* i->from.offset is the next level to print; BTREE_MAX_DEPTH is the key cache */
+static ssize_t bch2_read_lock_contention(struct file *file, char __user *buf,
+					 size_t size, loff_t *ppos)
+{
+	struct dump_iter *i = file->private_data;
+	int err;
+
+	i->ubuf = buf;
+	i->size	= size;
+	i->ret	= 0;
+
+	err = flush_buf(i);
+	if (err)
+		return err;
+
+	while (i->size && i->from.offset <= BTREE_MAX_DEPTH) {
+		struct printbuf out = _PBUF(i->buf, sizeof(i->buf));
+
+		if (i->from.offset < BTREE_MAX_DEPTH)
+			pr_buf(&out, "level %llu:\n", i->from.offset);
+		else
+			pr_buf(&out, "key cache:\n");
+
+		bch2_btree_lock_contention_to_text(&out, i->c, i->id,
+						   i->from.offset);
+		i->bytes = out.pos - i->buf;
+		i->from.offset++;
+
+		err = flush_buf(i);
+		if (err)
+			return err;
+	}
+
+	return i->ret;
+}
+
+static const struct file_operations lock_contention_debug_ops = {
+	.owner		= THIS_MODULE,
+	.open		= bch2_dump_open,
+	.release	= bch2_dump_release,
+	.read		= bch2_read_lock_contention,
+};
+
+static int bch2_dump_fs_open(struct inode *inode, struct file *file)
+{
+	struct dump_iter *i;
+
+	i = kzalloc(sizeof(struct dump_iter), GFP_KERNEL);
+	if (!i)
+		return -ENOMEM;
+
+	file->private_data = i;
+	i->from = POS_MIN;
+	i->c	= inode->i_private;
+
+	return 0;
+}
+
+static ssize_t bch2_read_trans_commit_phases(struct file *file,
+					     char __user *buf,
+					     size_t size, loff_t *ppos)
+{
+	struct dump_iter *i = file->private_data;
+	int err;
+
+	i->ubuf = buf;
+	i->size	= size;
+	i->ret	= 0;
+
+	err = flush_buf(i);
+	if (err)
+		return err;
+
+	while (i->size && i->from.offset <= BCH_TRANS_COMMIT_IPS) {
+		struct printbuf out = _PBUF(i->buf, sizeof(i->buf));
+
+		bch2_trans_commit_phases_to_text(&out, i->c, i->from.offset);
+		i->bytes = out.pos - i->buf;
+		i->from.offset++;
+
+		err = flush_buf(i);
+		if (err)
+			return err;
+	}
+
+	return i->ret;
+}
+
+static const struct file_operations trans_commit_phases_debug_ops = {
+	.owner		= THIS_MODULE,
+	.open		= bch2_dump_fs_open,
+	.release	= bch2_dump_release,
+	.read		= bch2_read_trans_commit_phases,
+};
+
 void bch2_fs_debug_exit(struct bch_fs *c)
 {
 	if (!IS_ERR_OR_NULL(c->debug))
@@ -393,6 +488,9 @@ void bch2_fs_debug_init(struct bch_fs *c)
 	if (IS_ERR_OR_NULL(c->debug))
 		return;
 
+	debugfs_create_file("trans-commit-phases", 0400, c->debug, c,
+			    &trans_commit_phases_debug_ops);
+
 	for (bd = c->btree_debug;
 	     bd < c->btree_debug + ARRAY_SIZE(c->btree_debug);
 	     bd++) {
@@ -412,6 +510,12 @@ void bch2_fs_debug_init(struct bch_fs *c)
 
 		bd->failed = debugfs_create_file(name, 0400, c->debug, bd,
 						 &bfloat_failed_debug_ops);
+
+		snprintf(name, sizeof(name), "%s-lock-contention",
+			 bch2_btree_ids[bd->id]);
+
+		bd->lock_contention = debugfs_create_file(name, 0400, c->debug,
+						bd, &lock_contention_debug_ops);
 	}
 }
 
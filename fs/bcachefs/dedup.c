@@ -0,0 +1,284 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include "bcachefs.h"
+#include "btree_iter.h"
+#include "checksum.h"
+#include "dedup.h"
+#include "extents.h"
+#include "fs-io.h"
+
+#include <linux/freezer.h>
+#include <linux/hash.h>
+#include <linux/kthread.h>
+#include <linux/vmalloc.h>
+
+/*
+ * Background dedup:
+ *
+ * Every opts.dedup_interval seconds (or when triggered via sysfs), walk the
+ * extents btree looking for extents with the same contents, and make them share
+ * one copy of their data via the reflink btree.
+ *
+ * The checksums we already store are the first pass filter: two whole extents
+ * with the same checksum, size and compression type almost certainly have the
+ * same data. The most recently seen extent for each checksum is kept in a fixed
+ * size table, so memory use doesn't depend on the size of the filesystem; a
+ * lost table entry just means a missed duplicate, found by a later pass if the
+ * next copy hashes differently. Matches are confirmed by comparing the data
+ * under the inode locks, the same as FIDEDUPERANGE, by bch2_dedup_extents().
+ *
+ * Extents that are already reflinked aren't looked at - they're already
+ * shared, and comparing them would mean reading through the reflink btree.
+ */
+
+#define DEDUP_TABLE_BITS	16
+/* not worth a reflink pointer and an indirect extent: */
+#define DEDUP_MIN_SECTORS	8
+
+struct dedup_entry {
+	struct bpos			pos;
+	struct bch_extent_crc_unpacked	crc;
+};
+
+/*
+ * Only whole, checksummed extents: then the checksum covers exactly the data
+ * the extent points to:
+ */
+static bool dedup_extent_crc(struct bkey_s_c k,
+			     struct bch_extent_crc_unpacked *crc)
+{
+	struct bkey_ptrs_c ptrs;
+	const union bch_extent_entry *entry;
+	struct extent_ptr_decoded p;
+
+	if (k.k->type != KEY_TYPE_extent ||
+	    k.k->size < DEDUP_MIN_SECTORS)
+		return false;
+
+	ptrs = bch2_bkey_ptrs_c(k);
+	bkey_for_each_ptr_decode(k.k, ptrs, p, entry) {
+		if (p.ptr.cached)
+			continue;
+
+		*crc = p.crc;
+		return crc->csum_type &&
+			!bch2_csum_type_is_encryption(crc->csum_type) &&
+			!crc->offset &&
+			crc->live_size == crc->uncompressed_size;
+	}
+
+	return false;
+}
+
+static bool dedup_crc_eq(struct bch_extent_crc_unpacked l,
+			 struct bch_extent_crc_unpacked r)
+{
+	return  l.csum_type		== r.csum_type &&
+		l.compression_type	== r.compression_type &&
+		l.compressed_size	== r.compressed_size &&
+		l.uncompressed_size	== r.uncompressed_size &&
+		!bch2_crc_cmp(l.csum, r.csum);
+}
+
+static unsigned dedup_hash(struct bch_extent_crc_unpacked crc)
+{
+	return hash_64(le64_to_cpu(crc.csum.lo) ^
+		       le64_to_cpu(crc.csum.hi) ^
+		       crc.uncompressed_size, DEDUP_TABLE_BITS);
+}
+
+static void dedup_candidate(struct bch_fs *c, struct bpos src, struct bpos dst,
+			    unsigned sectors)
+{
+	struct bch_fs_dedup *s = &c->dedup;
+	s64 ret;
+
+	atomic64_inc(&s->candidates);
+
+	ret = bch2_dedup_extents(c, src, dst, sectors);
+	if (ret > 0) {
+		atomic64_inc(&s->extents_deduped);
+		atomic64_add(ret, &s->sectors_deduped);
+	} else if (!ret) {
+		atomic64_inc(&s->mismatches);
+	} else {
+		bch_err_ratelimited(c, "dedup: error %lli deduplicating %llu:%llu with %llu:%llu",
+				    ret, dst.inode, dst.offset,
+				    src.inode, src.offset);
+	}
+}
+
+/* Returns nonzero if the thread should stop: */
+static int dedup_pass(struct bch_fs *c)
+{
+	struct bch_fs_dedup *s = &c->dedup;
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	struct dedup_entry *table, *e;
+	struct bch_extent_crc_unpacked crc;
+	struct bpos src, dst;
+	int ret = 0;
+
+	/* We need the VFS inodes, for their locks and page cache: */
+	if (!c->opts.reflink || !c->vfs_sb)
+		goto out;
+
+	table = vzalloc(sizeof(*table) << DEDUP_TABLE_BITS);
+	if (!table) {
+		bch_err(c, "dedup: error allocating table");
+		goto out;
+	}
+
+	bch2_trans_init(&trans, c, 0, 0);
+
+	iter = bch2_trans_get_iter(&trans, BTREE_ID_EXTENTS, POS_MIN,
+				   BTREE_ITER_PREFETCH);
+
+	while (!kthread_should_stop()) {
+		k = bch2_btree_iter_peek(iter);
+		if (!k.k)
+			break;
+		ret = bkey_err(k);
+		if (ret == -EINTR) {
+			bch2_trans_reset(&trans, 0);
+			ret = 0;
+			continue;
+		}
+		if (ret)
+			break;
+
+		if (dedup_extent_crc(k, &crc)) {
+			atomic64_inc(&s->extents_checked);
+
+			e	= table + dedup_hash(crc);
+			dst	= bkey_start_pos(k.k);
+
+			if (dedup_crc_eq(e->crc, crc)) {
+				src = e->pos;
+
+				/* don't hold btree locks while doing IO: */
+				bch2_trans_unlock(&trans);
+
+				dedup_candidate(c, src, dst,
+						crc.uncompressed_size);
+			} else {
+				e->pos	= dst;
+				e->crc	= crc;
+			}
+		}
+
+		bch2_btree_iter_next(iter);
+		s->pos = iter->pos;
+
+		bch2_trans_cond_resched(&trans);
+	}
+
+	bch2_trans_exit(&trans);
+	vfree(table);
+
+	if (ret)
+		bch_err(c, "dedup: error %i walking extents", ret);
+out:
+	s->pos			= POS_MIN;
+	s->last_completed	= ktime_get_real_seconds();
+	return kthread_should_stop();
+}
+
+static int bch2_dedup_thread(void *arg)
+{
+	struct bch_fs *c = arg;
+	struct bch_fs_dedup *s = &c->dedup;
+	u64 now, next;
+
+	set_freezable();
+
+	while (!kthread_wait_freezable(c->opts.dedup_interval ||
+				       READ_ONCE(s->requested))) {
+		now	= ktime_get_real_seconds();
+		next	= s->last_completed + c->opts.dedup_interval;
+
+		if (!READ_ONCE(s->requested) && now < next) {
+			s->state = DEDUP_WAITING;
+
+			set_current_state(TASK_INTERRUPTIBLE);
+			if (kthread_should_stop())
+				break;
+
+			/* woken early if dedup_interval changes: */
+			if (!READ_ONCE(s->requested))
+				schedule_timeout(min_t(u64, next - now,
+						       3600) * HZ);
+			__set_current_state(TASK_RUNNING);
+			try_to_freeze();
+			continue;
+		}
+
+		WRITE_ONCE(s->requested, false);
+		s->state = DEDUP_RUNNING;
+
+		if (dedup_pass(c))
+			break;
+	}
+
+	__set_current_state(TASK_RUNNING);
+	s->state = DEDUP_WAITING;
+	return 0;
+}
+
+void bch2_dedup_status_to_text(struct printbuf *out, struct bch_fs *c)
+{
+	struct bch_fs_dedup *s = &c->dedup;
+
+	pr_buf(out, "%s\n", s->state == DEDUP_RUNNING ? "running" : "waiting");
+	pr_buf(out, "pos:\t\t\t%llu:%llu\n", s->pos.inode, s->pos.offset);
+	pr_buf(out, "last completed:\t\t%llu\n", s->last_completed);
+	pr_buf(out, "extents checked:\t%llu\n",
+	       (u64) atomic64_read(&s->extents_checked));
+	pr_buf(out, "candidates:\t\t%llu\n",
+	       (u64) atomic64_read(&s->candidates));
+	pr_buf(out, "mismatches:\t\t%llu\n",
+	       (u64) atomic64_read(&s->mismatches));
+	pr_buf(out, "extents deduped:\t%llu\n",
+	       (u64) atomic64_read(&s->extents_deduped));
+	pr_buf(out, "sectors deduped:\t%llu\n",
+	       (u64) atomic64_read(&s->sectors_deduped));
+}
+
+void bch2_dedup_stop(struct bch_fs *c)
+{
+	struct task_struct *p;
+
+	p = rcu_dereference_protected(c->dedup.thread, 1);
+	c->dedup.thread = NULL;
+
+	if (p) {
+		/* for sychronizing with bch2_dedup_wakeup() */
+		synchronize_rcu();
+
+		kthread_stop(p);
+		put_task_struct(p);
+	}
+}
+
+int bch2_dedup_start(struct bch_fs *c)
+{
+	struct bch_fs_dedup *s = &c->dedup;
+	struct task_struct *p;
+
+	if (c->opts.nochanges)
+		return 0;
+
+	/* The first pass runs one interval after going read-write: */
+	s->pos			= POS_MIN;
+	s->last_completed	= ktime_get_real_seconds();
+
+	p = kthread_create(bch2_dedup_thread, c, "bch-dedup/%s", c->name);
+	if (IS_ERR(p))
+		return PTR_ERR(p);
+
+	get_task_struct(p);
+	rcu_assign_pointer(s->thread, p);
+	wake_up_process(p);
+	return 0;
+}
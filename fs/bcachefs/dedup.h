@@ -0,0 +1,29 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _BCACHEFS_DEDUP_H
+#define _BCACHEFS_DEDUP_H
+
+#include "dedup_types.h"
+
+static inline void bch2_dedup_wakeup(struct bch_fs *c)
+{
+	struct task_struct *p;
+
+	rcu_read_lock();
+	p = rcu_dereference(c->dedup.thread);
+	if (p)
+		wake_up_process(p);
+	rcu_read_unlock();
+}
+
+static inline void bch2_dedup_trigger(struct bch_fs *c)
+{
+	c->dedup.requested = true;
+	bch2_dedup_wakeup(c);
+}
+
+void bch2_dedup_status_to_text(struct printbuf *, struct bch_fs *);
+
+void bch2_dedup_stop(struct bch_fs *);
+int bch2_dedup_start(struct bch_fs *);
+
+#endif /* _BCACHEFS_DEDUP_H */
@@ -0,0 +1,27 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _BCACHEFS_DEDUP_TYPES_H
+#define _BCACHEFS_DEDUP_TYPES_H
+
+enum dedup_state {
+	DEDUP_WAITING,
+	DEDUP_RUNNING,
+};
+
+struct bch_fs_dedup {
+	struct task_struct __rcu *thread;
+
+	enum dedup_state	state;
+	/* run a pass now, regardless of opts.dedup_interval: */
+	bool			requested;
+
+	struct bpos		pos;
+	u64			last_completed;
+
+	atomic64_t		extents_checked;
+	atomic64_t		candidates;
+	atomic64_t		mismatches;
+	atomic64_t		extents_deduped;
+	atomic64_t		sectors_deduped;
+};
+
+#endif /* _BCACHEFS_DEDUP_TYPES_H */
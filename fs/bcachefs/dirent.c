@@ -19,8 +19,8 @@ unsigned bch2_dirent_name_bytes(struct bkey_s_c_dirent d)
 	return strnlen(d.v->d_name, len);
 }
 
-static u64 bch2_dirent_hash(const struct bch_hash_info *info,
-			    const struct qstr *name)
+u64 bch2_dirent_hash(const struct bch_hash_info *info,
+		     const struct qstr *name)
 {
 	struct bch_str_hash_ctx ctx;
 
@@ -347,39 +347,117 @@ int bch2_empty_dir_trans(struct btree_trans *trans, u64 dir_inum)
 	return ret;
 }
 
-int bch2_readdir(struct bch_fs *c, u64 inum, struct dir_context *ctx)
+struct readdir_ent {
+	u64			offset;
+	u64			inum;
+	u16			name_len;
+	u8			type;
+	char			name[];
+};
+
+static inline unsigned readdir_ent_bytes(unsigned name_len)
+{
+	return round_up(sizeof(struct readdir_ent) + name_len, sizeof(u64));
+}
+
+/*
+ * Copy out as many dirents as fit in @buf, starting from @pos, so that they can
+ * be emitted without btree locks held - dir_emit() can fault and block:
+ */
+static int readdir_fill(struct bch_fs *c, u64 inum, u64 pos,
+			struct readdir_buf *buf)
 {
 	struct btree_trans trans;
 	struct btree_iter *iter;
 	struct bkey_s_c k;
 	struct bkey_s_c_dirent dirent;
+	struct readdir_ent *e;
+	unsigned len;
 	int ret;
 
+	buf->dir	= inum;
+	buf->used	= 0;
+	buf->next	= 0;
+	buf->eof	= true;
+
 	bch2_trans_init(&trans, c, 0, 0);
 
 	for_each_btree_key(&trans, iter, BTREE_ID_DIRENTS,
-			   POS(inum, ctx->pos), 0, k, ret) {
+			   POS(inum, pos), BTREE_ITER_PREFETCH, k, ret) {
 		if (k.k->p.inode > inum)
 			break;
 
 		if (k.k->type != KEY_TYPE_dirent)
 			continue;
 
-		dirent = bkey_s_c_to_dirent(k);
-
-		/*
-		 * XXX: dir_emit() can fault and block, while we're holding
-		 * locks
-		 */
-		ctx->pos = dirent.k->p.offset;
-		if (!dir_emit(ctx, dirent.v->d_name,
-			      bch2_dirent_name_bytes(dirent),
-			      le64_to_cpu(dirent.v->d_inum),
-			      dirent.v->d_type))
+		dirent	= bkey_s_c_to_dirent(k);
+		len	= bch2_dirent_name_bytes(dirent);
+
+		if (buf->used + readdir_ent_bytes(len) > READDIR_BUF_BYTES) {
+			buf->eof = false;
 			break;
-		ctx->pos = dirent.k->p.offset + 1;
+		}
+
+		e = (void *) buf->data + buf->used;
+		e->offset	= dirent.k->p.offset;
+		e->inum		= le64_to_cpu(dirent.v->d_inum);
+		e->name_len	= len;
+		e->type		= dirent.v->d_type;
+		memcpy(e->name, dirent.v->d_name, len);
+
+		buf->used += readdir_ent_bytes(len);
 	}
+	bch2_trans_iter_put(&trans, iter);
+
 	ret = bch2_trans_exit(&trans) ?: ret;
+	if (ret) {
+		buf->used	= 0;
+		buf->eof	= false;
+	}
+	return ret;
+}
+
+int bch2_readdir(struct bch_fs *c, u64 inum, struct dir_context *ctx,
+		 struct readdir_buf *buf)
+{
+	struct readdir_buf *tmp = NULL;
+	struct readdir_ent *e;
+	int ret = 0;
+
+	if (!buf) {
+		buf = tmp = kzalloc(sizeof(*buf), GFP_KERNEL);
+		if (!buf)
+			return -ENOMEM;
+	}
+
+	/* Buffered entries are only good if we're continuing where we left off: */
+	if (buf->dir != inum || buf->pos != ctx->pos) {
+		buf->used	= 0;
+		buf->next	= 0;
+		buf->eof	= false;
+	}
+
+	while (1) {
+		if (buf->next == buf->used) {
+			if (buf->eof)
+				break;
+
+			ret = readdir_fill(c, inum, ctx->pos, buf);
+			if (ret || !buf->used)
+				break;
+		}
+
+		e = (void *) buf->data + buf->next;
+
+		ctx->pos = e->offset;
+		if (!dir_emit(ctx, e->name, e->name_len, e->inum, e->type))
+			break;
+		ctx->pos = e->offset + 1;
+
+		buf->next += readdir_ent_bytes(e->name_len);
+	}
 
+	buf->pos = ctx->pos;
+	kfree(tmp);
 	return ret;
 }
@@ -58,6 +58,27 @@ u64 bch2_dirent_lookup(struct bch_fs *, u64, const struct bch_hash_info *,
 		       const struct qstr *);
 
 int bch2_empty_dir_trans(struct btree_trans *, u64);
-int bch2_readdir(struct bch_fs *, u64, struct dir_context *);
+
+u64 bch2_dirent_hash(const struct bch_hash_info *, const struct qstr *);
+
+/*
+ * Dirents read ahead by bch2_readdir(), kept in the struct file between
+ * getdents calls so that a sequential readdir doesn't re-traverse the btree for
+ * every call:
+ */
+#define READDIR_BUF_BYTES	PAGE_SIZE
+
+struct readdir_buf {
+	u64			dir;
+	/* ctx->pos the next buffered entry is emitted at: */
+	u64			pos;
+	unsigned		used;
+	unsigned		next;
+	bool			eof;
+	u8			data[READDIR_BUF_BYTES];
+};
+
+int bch2_readdir(struct bch_fs *, u64, struct dir_context *,
+		 struct readdir_buf *);
 
 #endif /* _BCACHEFS_DIRENT_H */
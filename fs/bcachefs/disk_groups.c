@@ -124,8 +124,10 @@ int bch2_sb_disk_groups_to_cpu(struct bch_fs *c)
 	groups		= bch2_sb_get_disk_groups(c->disk_sb.sb);
 	nr_groups	= disk_groups_nr(groups);
 
-	if (!groups)
-		return 0;
+	if (!groups) {
+		cpu_g = NULL;
+		goto publish;
+	}
 
 	cpu_g = kzalloc(sizeof(*cpu_g) +
 			sizeof(cpu_g->entries[0]) * nr_groups, GFP_KERNEL);
@@ -158,6 +160,7 @@ int bch2_sb_disk_groups_to_cpu(struct bch_fs *c)
 		}
 	}
 
+publish:
 	old_g = rcu_dereference_protected(c->disk_groups,
 				lockdep_is_held(&c->sb_lock));
 	rcu_assign_pointer(c->disk_groups, cpu_g);
@@ -180,46 +183,25 @@ const struct bch_devs_mask *bch2_target_to_mask(struct bch_fs *c, unsigned targe
 			: NULL;
 		return ca ? &ca->self : NULL;
 	}
-	case TARGET_GROUP: {
-		struct bch_disk_groups_cpu *g = rcu_dereference(c->disk_groups);
-
-		return g && t.group < g->nr && !g->entries[t.group].deleted
-			? &g->entries[t.group].devs
-			: NULL;
-	}
+	case TARGET_GROUP:
+		return __bch2_disk_group_devs(rcu_dereference(c->disk_groups),
+					      t.group);
 	default:
 		BUG();
 	}
 }
 
-bool bch2_dev_in_target(struct bch_fs *c, unsigned dev, unsigned target)
+bool __bch2_dev_in_group(struct bch_fs *c, unsigned dev, unsigned group)
 {
-	struct target t = target_decode(target);
+	const struct bch_devs_mask *m;
+	bool ret;
 
-	switch (t.type) {
-	case TARGET_NULL:
-		return false;
-	case TARGET_DEV:
-		return dev == t.dev;
-	case TARGET_GROUP: {
-		struct bch_disk_groups_cpu *g;
-		const struct bch_devs_mask *m;
-		bool ret;
+	rcu_read_lock();
+	m = __bch2_disk_group_devs(rcu_dereference(c->disk_groups), group);
+	ret = m ? test_bit(dev, m->d) : false;
+	rcu_read_unlock();
 
-		rcu_read_lock();
-		g = rcu_dereference(c->disk_groups);
-		m = g && t.group < g->nr && !g->entries[t.group].deleted
-			? &g->entries[t.group].devs
-			: NULL;
-
-		ret = m ? test_bit(dev, m->d) : false;
-		rcu_read_unlock();
-
-		return ret;
-	}
-	default:
-		BUG();
-	}
+	return ret;
 }
 
 static int __bch2_disk_group_find(struct bch_sb_field_disk_groups *groups,
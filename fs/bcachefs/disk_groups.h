@@ -54,6 +54,14 @@ static inline struct target target_decode(unsigned target)
 	return (struct target) { .type = TARGET_NULL };
 }
 
+static inline const struct bch_devs_mask *
+__bch2_disk_group_devs(struct bch_disk_groups_cpu *g, unsigned group)
+{
+	return g && group < g->nr && !g->entries[group].deleted
+		? &g->entries[group].devs
+		: NULL;
+}
+
 const struct bch_devs_mask *bch2_target_to_mask(struct bch_fs *, unsigned);
 
 static inline struct bch_devs_mask target_rw_devs(struct bch_fs *c,
@@ -68,7 +76,25 @@ static inline struct bch_devs_mask target_rw_devs(struct bch_fs *c,
 	return devs;
 }
 
-bool bch2_dev_in_target(struct bch_fs *, unsigned, unsigned);
+bool __bch2_dev_in_group(struct bch_fs *, unsigned, unsigned);
+
+/* Called for every pointer when checking extents against io options: */
+static inline bool bch2_dev_in_target(struct bch_fs *c, unsigned dev,
+				      unsigned target)
+{
+	struct target t = target_decode(target);
+
+	switch (t.type) {
+	case TARGET_NULL:
+		return false;
+	case TARGET_DEV:
+		return dev == t.dev;
+	case TARGET_GROUP:
+		return __bch2_dev_in_group(c, dev, t.group);
+	default:
+		BUG();
+	}
+}
 
 int bch2_disk_path_find(struct bch_sb_handle *, const char *);
 
@@ -4,6 +4,7 @@
 
 #include "bcachefs.h"
 #include "alloc_foreground.h"
+#include "backpointers.h"
 #include "bkey_buf.h"
 #include "bset.h"
 #include "btree_gc.h"
@@ -15,9 +16,11 @@
 #include "io.h"
 #include "keylist.h"
 #include "recovery.h"
+#include "super.h"
 #include "super-io.h"
 #include "util.h"
 
+#include <linux/kthread.h>
 #include <linux/sort.h>
 
 #ifdef __KERNEL__
@@ -92,6 +95,302 @@ static void raid_rec(int nr, int *ir, int nd, int np, size_t size, void **v)
 
 #endif
 
+/*
+ * Reed-Solomon parity beyond P and Q:
+ *
+ * Parity block p is the sum over data blocks i of g^(p * i) * D_i in GF(2^8),
+ * with g = 2 and the same field polynomial as lib/raid6 - so the first two
+ * parity blocks are exactly raid6 P and Q, generated and recovered by the
+ * (SIMD) raid6 code, and only the third uses the table based code here. With
+ * distinct g^i, any three rows of this matrix restricted to any set of columns
+ * are invertible, so up to three blocks of a stripe can be lost.
+ */
+
+#define EC_RS_PARITY_MAX	3
+
+static const u8 ec_gf_exp[256] = {
+	0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80,
+	0x1d, 0x3a, 0x74, 0xe8, 0xcd, 0x87, 0x13, 0x26,
+	0x4c, 0x98, 0x2d, 0x5a, 0xb4, 0x75, 0xea, 0xc9,
+	0x8f, 0x03, 0x06, 0x0c, 0x18, 0x30, 0x60, 0xc0,
+	0x9d, 0x27, 0x4e, 0x9c, 0x25, 0x4a, 0x94, 0x35,
+	0x6a, 0xd4, 0xb5, 0x77, 0xee, 0xc1, 0x9f, 0x23,
+	0x46, 0x8c, 0x05, 0x0a, 0x14, 0x28, 0x50, 0xa0,
+	0x5d, 0xba, 0x69, 0xd2, 0xb9, 0x6f, 0xde, 0xa1,
+	0x5f, 0xbe, 0x61, 0xc2, 0x99, 0x2f, 0x5e, 0xbc,
+	0x65, 0xca, 0x89, 0x0f, 0x1e, 0x3c, 0x78, 0xf0,
+	0xfd, 0xe7, 0xd3, 0xbb, 0x6b, 0xd6, 0xb1, 0x7f,
+	0xfe, 0xe1, 0xdf, 0xa3, 0x5b, 0xb6, 0x71, 0xe2,
+	0xd9, 0xaf, 0x43, 0x86, 0x11, 0x22, 0x44, 0x88,
+	0x0d, 0x1a, 0x34, 0x68, 0xd0, 0xbd, 0x67, 0xce,
+	0x81, 0x1f, 0x3e, 0x7c, 0xf8, 0xed, 0xc7, 0x93,
+	0x3b, 0x76, 0xec, 0xc5, 0x97, 0x33, 0x66, 0xcc,
+	0x85, 0x17, 0x2e, 0x5c, 0xb8, 0x6d, 0xda, 0xa9,
+	0x4f, 0x9e, 0x21, 0x42, 0x84, 0x15, 0x2a, 0x54,
+	0xa8, 0x4d, 0x9a, 0x29, 0x52, 0xa4, 0x55, 0xaa,
+	0x49, 0x92, 0x39, 0x72, 0xe4, 0xd5, 0xb7, 0x73,
+	0xe6, 0xd1, 0xbf, 0x63, 0xc6, 0x91, 0x3f, 0x7e,
+	0xfc, 0xe5, 0xd7, 0xb3, 0x7b, 0xf6, 0xf1, 0xff,
+	0xe3, 0xdb, 0xab, 0x4b, 0x96, 0x31, 0x62, 0xc4,
+	0x95, 0x37, 0x6e, 0xdc, 0xa5, 0x57, 0xae, 0x41,
+	0x82, 0x19, 0x32, 0x64, 0xc8, 0x8d, 0x07, 0x0e,
+	0x1c, 0x38, 0x70, 0xe0, 0xdd, 0xa7, 0x53, 0xa6,
+	0x51, 0xa2, 0x59, 0xb2, 0x79, 0xf2, 0xf9, 0xef,
+	0xc3, 0x9b, 0x2b, 0x56, 0xac, 0x45, 0x8a, 0x09,
+	0x12, 0x24, 0x48, 0x90, 0x3d, 0x7a, 0xf4, 0xf5,
+	0xf7, 0xf3, 0xfb, 0xeb, 0xcb, 0x8b, 0x0b, 0x16,
+	0x2c, 0x58, 0xb0, 0x7d, 0xfa, 0xe9, 0xcf, 0x83,
+	0x1b, 0x36, 0x6c, 0xd8, 0xad, 0x47, 0x8e, 0x01,
+};
+
+static const u8 ec_gf_log[256] = {
+	0x00, 0x00, 0x01, 0x19, 0x02, 0x32, 0x1a, 0xc6,
+	0x03, 0xdf, 0x33, 0xee, 0x1b, 0x68, 0xc7, 0x4b,
+	0x04, 0x64, 0xe0, 0x0e, 0x34, 0x8d, 0xef, 0x81,
+	0x1c, 0xc1, 0x69, 0xf8, 0xc8, 0x08, 0x4c, 0x71,
+	0x05, 0x8a, 0x65, 0x2f, 0xe1, 0x24, 0x0f, 0x21,
+	0x35, 0x93, 0x8e, 0xda, 0xf0, 0x12, 0x82, 0x45,
+	0x1d, 0xb5, 0xc2, 0x7d, 0x6a, 0x27, 0xf9, 0xb9,
+	0xc9, 0x9a, 0x09, 0x78, 0x4d, 0xe4, 0x72, 0xa6,
+	0x06, 0xbf, 0x8b, 0x62, 0x66, 0xdd, 0x30, 0xfd,
+	0xe2, 0x98, 0x25, 0xb3, 0x10, 0x91, 0x22, 0x88,
+	0x36, 0xd0, 0x94, 0xce, 0x8f, 0x96, 0xdb, 0xbd,
+	0xf1, 0xd2, 0x13, 0x5c, 0x83, 0x38, 0x46, 0x40,
+	0x1e, 0x42, 0xb6, 0xa3, 0xc3, 0x48, 0x7e, 0x6e,
+	0x6b, 0x3a, 0x28, 0x54, 0xfa, 0x85, 0xba, 0x3d,
+	0xca, 0x5e, 0x9b, 0x9f, 0x0a, 0x15, 0x79, 0x2b,
+	0x4e, 0xd4, 0xe5, 0xac, 0x73, 0xf3, 0xa7, 0x57,
+	0x07, 0x70, 0xc0, 0xf7, 0x8c, 0x80, 0x63, 0x0d,
+	0x67, 0x4a, 0xde, 0xed, 0x31, 0xc5, 0xfe, 0x18,
+	0xe3, 0xa5, 0x99, 0x77, 0x26, 0xb8, 0xb4, 0x7c,
+	0x11, 0x44, 0x92, 0xd9, 0x23, 0x20, 0x89, 0x2e,
+	0x37, 0x3f, 0xd1, 0x5b, 0x95, 0xbc, 0xcf, 0xcd,
+	0x90, 0x87, 0x97, 0xb2, 0xdc, 0xfc, 0xbe, 0x61,
+	0xf2, 0x56, 0xd3, 0xab, 0x14, 0x2a, 0x5d, 0x9e,
+	0x84, 0x3c, 0x39, 0x53, 0x47, 0x6d, 0x41, 0xa2,
+	0x1f, 0x2d, 0x43, 0xd8, 0xb7, 0x7b, 0xa4, 0x76,
+	0xc4, 0x17, 0x49, 0xec, 0x7f, 0x0c, 0x6f, 0xf6,
+	0x6c, 0xa1, 0x3b, 0x52, 0x29, 0x9d, 0x55, 0xaa,
+	0xfb, 0x60, 0x86, 0xb1, 0xbb, 0xcc, 0x3e, 0x5a,
+	0xcb, 0x59, 0x5f, 0xb0, 0x9c, 0xa9, 0xa0, 0x51,
+	0x0b, 0xf5, 0x16, 0xeb, 0x7a, 0x75, 0x2c, 0xd7,
+	0x4f, 0xae, 0xd5, 0xe9, 0xe6, 0xe7, 0xad, 0xe8,
+	0x74, 0xd6, 0xf4, 0xea, 0xa8, 0x50, 0x58, 0xaf,
+};
+static inline u8 ec_gf_mul(u8 a, u8 b)
+{
+	return a && b
+		? ec_gf_exp[(ec_gf_log[a] + ec_gf_log[b]) % 255]
+		: 0;
+}
+
+static inline u8 ec_gf_inv(u8 a)
+{
+	return ec_gf_exp[(255 - ec_gf_log[a]) % 255];
+}
+
+/* coefficient of data block @i in parity block @p: */
+static inline u8 ec_rs_coef(unsigned p, unsigned i)
+{
+	return ec_gf_exp[(p * i) % 255];
+}
+
+static void ec_rs_mul_add(u8 *dst, const u8 *src, u8 c, size_t size)
+{
+	u8 t[256];
+	size_t i;
+
+	for (i = 0; i < 256; i++)
+		t[i] = ec_gf_mul(c, i);
+
+	for (i = 0; i < size; i++)
+		dst[i] ^= t[src[i]];
+}
+
+static void ec_rs_gen(int nd, int p, size_t size, void **v)
+{
+	int i;
+
+	memset(v[nd + p], 0, size);
+
+	for (i = 0; i < nd; i++)
+		ec_rs_mul_add(v[nd + p], v[i], ec_rs_coef(p, i), size);
+}
+
+/* Gauss-Jordan elimination; @m is always invertible, see above: */
+static void ec_gf_matrix_invert(u8 m[EC_RS_PARITY_MAX][EC_RS_PARITY_MAX],
+				u8 inv[EC_RS_PARITY_MAX][EC_RS_PARITY_MAX],
+				int n)
+{
+	int i, j, k;
+
+	for (i = 0; i < n; i++)
+		for (j = 0; j < n; j++)
+			inv[i][j] = i == j;
+
+	for (i = 0; i < n; i++) {
+		u8 c;
+
+		for (k = i; k < n && !m[k][i]; k++)
+			;
+		BUG_ON(k == n);
+
+		for (j = 0; j < n; j++) {
+			swap(m[i][j], m[k][j]);
+			swap(inv[i][j], inv[k][j]);
+		}
+
+		c = ec_gf_inv(m[i][i]);
+		for (j = 0; j < n; j++) {
+			m[i][j]		= ec_gf_mul(m[i][j], c);
+			inv[i][j]	= ec_gf_mul(inv[i][j], c);
+		}
+
+		for (k = 0; k < n; k++) {
+			if (k == i || !m[k][i])
+				continue;
+
+			c = m[k][i];
+			for (j = 0; j < n; j++) {
+				m[k][j]		^= ec_gf_mul(m[i][j], c);
+				inv[k][j]	^= ec_gf_mul(inv[i][j], c);
+			}
+		}
+	}
+}
+
+#define EC_RS_REC_CHUNK		64
+
+/*
+ * Recover failed data blocks from any surviving parity blocks: syndromes are
+ * computed into the failed data blocks, then multiplied by the inverse of the
+ * matrix of their coefficients:
+ */
+static void ec_rs_rec_data(int nr, int *ir, int nd, int np,
+			   size_t size, void **v)
+{
+	u8 m[EC_RS_PARITY_MAX][EC_RS_PARITY_MAX];
+	u8 inv[EC_RS_PARITY_MAX][EC_RS_PARITY_MAX];
+	u8 s[EC_RS_PARITY_MAX][EC_RS_REC_CHUNK];
+	int fd[EC_RS_PARITY_MAX], rows[EC_RS_PARITY_MAX];
+	bool parity_failed[EC_RS_PARITY_MAX] = { false };
+	int i, j, p, r, nr_data = 0, nr_rows = 0;
+	size_t b, n;
+
+	for (i = 0; i < nr; i++)
+		if (ir[i] < nd)
+			fd[nr_data++] = ir[i];
+		else
+			parity_failed[ir[i] - nd] = true;
+
+	for (p = 0; p < np && nr_rows < nr_data; p++)
+		if (!parity_failed[p])
+			rows[nr_rows++] = p;
+
+	BUG_ON(nr_rows < nr_data);
+
+	for (r = 0; r < nr_data; r++) {
+		memcpy(v[fd[r]], v[nd + rows[r]], size);
+
+		for (i = 0, j = 0; i < nd; i++) {
+			if (j < nr_data && i == fd[j]) {
+				j++;
+				continue;
+			}
+
+			ec_rs_mul_add(v[fd[r]], v[i], ec_rs_coef(rows[r], i), size);
+		}
+	}
+
+	for (r = 0; r < nr_data; r++)
+		for (j = 0; j < nr_data; j++)
+			m[r][j] = ec_rs_coef(rows[r], fd[j]);
+
+	ec_gf_matrix_invert(m, inv, nr_data);
+
+	for (b = 0; b < size; b += n) {
+		n = min_t(size_t, size - b, EC_RS_REC_CHUNK);
+
+		for (r = 0; r < nr_data; r++)
+			memcpy(s[r], v[fd[r]] + b, n);
+
+		for (j = 0; j < nr_data; j++) {
+			u8 *d = v[fd[j]] + b;
+			size_t k;
+
+			for (k = 0; k < n; k++) {
+				u8 x = 0;
+
+				for (r = 0; r < nr_data; r++)
+					x ^= ec_gf_mul(inv[j][r], s[r][k]);
+				d[k] = x;
+			}
+		}
+	}
+}
+
+static void ec_gen(int nd, int np, size_t size, void **v)
+{
+	int p;
+
+	BUG_ON(np > EC_RS_PARITY_MAX);
+
+	raid_gen(nd, min(np, 2), size, v);
+
+	for (p = 2; p < np; p++)
+		ec_rs_gen(nd, p, size, v);
+}
+
+/* @ir: indices of failed blocks, data or parity, in ascending order */
+static void ec_rec(int nr, int *ir, int nd, int np, size_t size, void **v)
+{
+	int i, nr_pq = 0;
+
+	BUG_ON(np > EC_RS_PARITY_MAX);
+	BUG_ON(nr > np);
+
+	while (nr_pq < nr && ir[nr_pq] < nd + 2)
+		nr_pq++;
+
+	if (np <= 2 || nr_pq < nr || nr <= 2) {
+		/*
+		 * Either the third parity block failed - so the rest can only
+		 * have failed as much as raid6 handles - or it isn't needed:
+		 */
+		raid_rec(nr_pq, ir, nd, min(np, 2), size, v);
+	} else {
+		ec_rs_rec_data(nr, ir, nd, np, size, v);
+
+		/* and regenerate P and/or Q, if they failed: */
+		if (ir[nr - 1] >= nd)
+			raid_gen(nd, 2, size, v);
+	}
+
+	/* the third parity block is regenerated last, from the data: */
+	for (i = nr_pq; i < nr; i++)
+		ec_rs_gen(nd, ir[i] - nd, size, v);
+}
+
+/*
+ * Add data block @i's contribution to all parity blocks - so that parity can
+ * be computed incrementally, a data block at a time; only @v[i] and the parity
+ * blocks are accessed:
+ */
+static void ec_gen_block(int nd, int np, int i, size_t size, void **v)
+{
+	int p = 0;
+
+	BUG_ON(np > EC_RS_PARITY_MAX);
+#ifdef __KERNEL__
+	if (np >= 2 && raid6_call.xor_syndrome) {
+		raid6_call.xor_syndrome(nd + 2, i, i, size, v);
+		p = 2;
+	}
+#endif
+	for (; p < np; p++)
+		ec_rs_mul_add(v[nd + p], v[i], ec_rs_coef(p, i), size);
+}
+
 struct ec_bio {
 	struct bch_dev		*ca;
 	struct ec_stripe_buf	*buf;
@@ -118,6 +417,9 @@ const char *bch2_stripe_invalid(const struct bch_fs *c, struct bkey_s_c k)
 	    bkey_val_u64s(k.k) < stripe_val_u64s(s))
 		return "incorrect value size";
 
+	if (s->nr_redundant > EC_RS_PARITY_MAX)
+		return "too many redundant blocks";
+
 	return bch2_bkey_ptrs_invalid(c, k);
 }
 
@@ -189,8 +491,9 @@ static void ec_stripe_buf_exit(struct ec_stripe_buf *buf)
 	}
 }
 
-static int ec_stripe_buf_init(struct ec_stripe_buf *buf,
-			       unsigned offset, unsigned size)
+static int __ec_stripe_buf_init(struct ec_stripe_buf *buf,
+				 unsigned offset, unsigned size,
+				 unsigned first_block)
 {
 	struct bch_stripe *v = &buf->key.v;
 	unsigned csum_granularity = 1U << v->csum_granularity_bits;
@@ -208,7 +511,7 @@ static int ec_stripe_buf_init(struct ec_stripe_buf *buf,
 
 	memset(buf->valid, 0xFF, sizeof(buf->valid));
 
-	for (i = 0; i < buf->key.v.nr_blocks; i++) {
+	for (i = first_block; i < buf->key.v.nr_blocks; i++) {
 		buf->data[i] = kvpmalloc(buf->size << 9, GFP_KERNEL);
 		if (!buf->data[i])
 			goto err;
@@ -220,6 +523,12 @@ static int ec_stripe_buf_init(struct ec_stripe_buf *buf,
 	return -ENOMEM;
 }
 
+static int ec_stripe_buf_init(struct ec_stripe_buf *buf,
+			      unsigned offset, unsigned size)
+{
+	return __ec_stripe_buf_init(buf, offset, size, 0);
+}
+
 /* Checksumming: */
 
 static struct bch_csum ec_block_checksum(struct ec_stripe_buf *buf,
@@ -242,10 +551,11 @@ static struct bch_csum ec_block_checksum(struct ec_stripe_buf *buf,
 			     len << 9);
 }
 
-static void ec_generate_checksums(struct ec_stripe_buf *buf)
+static void ec_generate_block_checksums(struct ec_stripe_buf *buf,
+					unsigned block)
 {
 	struct bch_stripe *v = &buf->key.v;
-	unsigned i, j, csums_per_device = stripe_csums_per_device(v);
+	unsigned j, csums_per_device = stripe_csums_per_device(v);
 
 	if (!v->csum_type)
 		return;
@@ -253,10 +563,17 @@ static void ec_generate_checksums(struct ec_stripe_buf *buf)
 	BUG_ON(buf->offset);
 	BUG_ON(buf->size != le16_to_cpu(v->sectors));
 
-	for (i = 0; i < v->nr_blocks; i++)
-		for (j = 0; j < csums_per_device; j++)
-			stripe_csum_set(v, i, j,
-				ec_block_checksum(buf, i, j << v->csum_granularity_bits));
+	for (j = 0; j < csums_per_device; j++)
+		stripe_csum_set(v, block, j,
+			ec_block_checksum(buf, block, j << v->csum_granularity_bits));
+}
+
+static void ec_generate_checksums(struct ec_stripe_buf *buf)
+{
+	unsigned i;
+
+	for (i = 0; i < buf->key.v.nr_blocks; i++)
+		ec_generate_block_checksums(buf, i);
 }
 
 static void ec_validate_checksums(struct bch_fs *c, struct ec_stripe_buf *buf)
@@ -307,7 +624,7 @@ static void ec_generate_ec(struct ec_stripe_buf *buf)
 	unsigned nr_data = v->nr_blocks - v->nr_redundant;
 	unsigned bytes = le16_to_cpu(v->sectors) << 9;
 
-	raid_gen(nr_data, v->nr_redundant, bytes, buf->data);
+	ec_gen(nr_data, v->nr_redundant, bytes, buf->data);
 }
 
 static unsigned ec_nr_failed(struct ec_stripe_buf *buf)
@@ -319,9 +636,9 @@ static unsigned ec_nr_failed(struct ec_stripe_buf *buf)
 static int ec_do_recov(struct bch_fs *c, struct ec_stripe_buf *buf)
 {
 	struct bch_stripe *v = &buf->key.v;
-	unsigned i, failed[BCH_BKEY_PTRS_MAX], nr_failed = 0;
-	unsigned nr_data = v->nr_blocks - v->nr_redundant;
+	unsigned i, nr_data = v->nr_blocks - v->nr_redundant;
 	unsigned bytes = buf->size << 9;
+	int failed[BCH_BKEY_PTRS_MAX], nr_failed = 0;
 
 	if (ec_nr_failed(buf) > v->nr_redundant) {
 		bch_err_ratelimited(c,
@@ -329,11 +646,12 @@ static int ec_do_recov(struct bch_fs *c, struct ec_stripe_buf *buf)
 		return -1;
 	}
 
-	for (i = 0; i < nr_data; i++)
+	/* Parity blocks that couldn't be read mustn't be used either: */
+	for (i = 0; i < v->nr_blocks; i++)
 		if (!test_bit(i, buf->valid))
 			failed[nr_failed++] = i;
 
-	raid_rec(nr_failed, failed, nr_data, v->nr_redundant, bytes, buf->data);
+	ec_rec(nr_failed, failed, nr_data, v->nr_redundant, bytes, buf->data);
 	return 0;
 }
 
@@ -401,122 +719,769 @@ static void ec_block_io(struct bch_fs *c, struct ec_stripe_buf *buf,
 						       &c->ec_bioset),
 				      struct ec_bio, bio);
 
-		ec_bio->ca			= ca;
-		ec_bio->buf			= buf;
-		ec_bio->idx			= idx;
+		ec_bio->ca			= ca;
+		ec_bio->buf			= buf;
+		ec_bio->idx			= idx;
+
+		bio_set_dev(&ec_bio->bio, ca->disk_sb.bdev);
+		bio_set_op_attrs(&ec_bio->bio, rw, 0);
+
+		ec_bio->bio.bi_iter.bi_sector	= ptr->offset + buf->offset + (offset >> 9);
+		ec_bio->bio.bi_end_io		= ec_block_endio;
+		ec_bio->bio.bi_private		= cl;
+
+		bch2_bio_map(&ec_bio->bio, buf->data[idx] + offset, b);
+
+		closure_get(cl);
+		percpu_ref_get(&ca->io_ref);
+
+		submit_bio(&ec_bio->bio);
+
+		offset += b;
+	}
+
+	percpu_ref_put(&ca->io_ref);
+}
+
+static int get_stripe_key(struct bch_fs *c, u64 idx, struct ec_stripe_buf *stripe)
+{
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	int ret;
+
+	bch2_trans_init(&trans, c, 0, 0);
+	iter = bch2_trans_get_iter(&trans, BTREE_ID_EC, POS(0, idx), BTREE_ITER_SLOTS);
+	k = bch2_btree_iter_peek_slot(iter);
+	ret = bkey_err(k);
+	if (ret)
+		goto err;
+	if (k.k->type != KEY_TYPE_stripe) {
+		ret = -ENOENT;
+		goto err;
+	}
+	bkey_reassemble(&stripe->key.k_i, k);
+err:
+	bch2_trans_exit(&trans);
+	return ret;
+}
+
+/* recovery read path: */
+/*
+ * Degraded reads: the blocks we reconstruct are cached, so that neighbouring
+ * reads of the same stripe don't each have to read and reconstruct it again.
+ * Reconstruction is done in EC_RECOV_READ_SECTORS aligned ranges for the same
+ * reason.
+ *
+ * The data at a given bucket and generation never changes, so entries are
+ * valid for as long as the stripe still points to the same bucket:
+ */
+#define EC_RECOV_READ_SECTORS	128
+
+static bool ec_recov_cache_read(struct bch_fs *c, struct bch_read_bio *rbio,
+				u64 idx, const struct bch_extent_ptr *ptr,
+				unsigned offset)
+{
+	struct ec_recov_cache_entry *e;
+	bool ret = false;
+
+	mutex_lock(&c->ec_recov_cache_lock);
+	for (e = c->ec_recov_cache;
+	     e < c->ec_recov_cache + ARRAY_SIZE(c->ec_recov_cache);
+	     e++)
+		if (e->data &&
+		    e->idx == idx &&
+		    !memcmp(&e->ptr, ptr, sizeof(*ptr)) &&
+		    offset >= e->offset &&
+		    offset + bio_sectors(&rbio->bio) <= e->offset + e->size) {
+			memcpy_to_bio(&rbio->bio, rbio->bio.bi_iter,
+				      e->data + ((offset - e->offset) << 9));
+			e->last_used = jiffies;
+			ret = true;
+			break;
+		}
+	mutex_unlock(&c->ec_recov_cache_lock);
+
+	return ret;
+}
+
+/* Takes ownership of @buf's buffer for @block: */
+static void ec_recov_cache_add(struct bch_fs *c, struct ec_stripe_buf *buf,
+			       u64 idx, unsigned block)
+{
+	struct ec_recov_cache_entry *e, *victim = c->ec_recov_cache;
+
+	mutex_lock(&c->ec_recov_cache_lock);
+	for (e = c->ec_recov_cache;
+	     e < c->ec_recov_cache + ARRAY_SIZE(c->ec_recov_cache);
+	     e++) {
+		if (!e->data) {
+			victim = e;
+			break;
+		}
+
+		if (time_before(e->last_used, victim->last_used))
+			victim = e;
+	}
+
+	kvpfree(victim->data, victim->size << 9);
+
+	victim->idx		= idx;
+	victim->ptr		= buf->key.v.ptrs[block];
+	victim->offset		= buf->offset;
+	victim->size		= buf->size;
+	victim->last_used	= jiffies;
+	victim->data		= buf->data[block];
+	buf->data[block]	= NULL;
+	mutex_unlock(&c->ec_recov_cache_lock);
+}
+
+static void ec_recov_cache_exit(struct bch_fs *c)
+{
+	struct ec_recov_cache_entry *e;
+
+	for (e = c->ec_recov_cache;
+	     e < c->ec_recov_cache + ARRAY_SIZE(c->ec_recov_cache);
+	     e++) {
+		kvpfree(e->data, e->size << 9);
+		e->data = NULL;
+	}
+}
+
+/*
+ * Read just the blocks needed to reconstruct @block: the other data blocks and
+ * one parity block, and more parity blocks only as blocks fail. Blocks not read
+ * are left marked invalid, and are regenerated along with @block:
+ */
+static void ec_recov_read(struct bch_fs *c, struct ec_stripe_buf *buf,
+			  unsigned block)
+{
+	struct bch_stripe *v = &buf->key.v;
+	unsigned i, nr_data = v->nr_blocks - v->nr_redundant;
+	unsigned next_parity = nr_data, want = 1, nr_failed;
+	struct closure cl;
+
+	closure_init_stack(&cl);
+
+	clear_bit(block, buf->valid);
+	for (i = nr_data; i < v->nr_blocks; i++)
+		clear_bit(i, buf->valid);
+
+	for (i = 0; i < nr_data; i++)
+		if (i != block)
+			ec_block_io(c, buf, REQ_OP_READ, i, &cl);
+
+	do {
+		for (; want && next_parity < v->nr_blocks; want--) {
+			set_bit(next_parity, buf->valid);
+			ec_block_io(c, buf, REQ_OP_READ, next_parity++, &cl);
+		}
+
+		closure_sync(&cl);
+
+		ec_validate_checksums(c, buf);
+
+		nr_failed = ec_nr_failed(buf);
+		want = nr_failed > v->nr_redundant
+			? nr_failed - v->nr_redundant
+			: 0;
+	} while (want && next_parity < v->nr_blocks);
+}
+
+int bch2_ec_read_extent(struct bch_fs *c, struct bch_read_bio *rbio)
+{
+	struct ec_stripe_buf *buf;
+	struct bch_stripe *v;
+	unsigned block = rbio->pick.ec.block;
+	unsigned offset, start, end;
+	u64 idx = rbio->pick.ec.idx;
+	int ret = 0;
+
+	BUG_ON(!rbio->pick.has_ec);
+
+	buf = kzalloc(sizeof(*buf), GFP_NOIO);
+	if (!buf)
+		return -ENOMEM;
+
+	ret = get_stripe_key(c, idx, buf);
+	if (ret) {
+		bch_err_ratelimited(c,
+			"error doing reconstruct read: error %i looking up stripe", ret);
+		kfree(buf);
+		return -EIO;
+	}
+
+	v = &buf->key.v;
+
+	if (!bch2_ptr_matches_stripe(v, rbio->pick)) {
+		bch_err_ratelimited(c,
+			"error doing reconstruct read: pointer doesn't match stripe");
+		ret = -EIO;
+		goto err;
+	}
+
+	offset = rbio->bio.bi_iter.bi_sector - v->ptrs[block].offset;
+	if (offset + bio_sectors(&rbio->bio) > le16_to_cpu(v->sectors)) {
+		bch_err_ratelimited(c,
+			"error doing reconstruct read: read is bigger than stripe");
+		ret = -EIO;
+		goto err;
+	}
+
+	if (ec_recov_cache_read(c, rbio, idx, &v->ptrs[block], offset))
+		goto err;
+
+	start	= round_down(offset, EC_RECOV_READ_SECTORS);
+	end	= min_t(unsigned, le16_to_cpu(v->sectors),
+			round_up(offset + bio_sectors(&rbio->bio),
+				 EC_RECOV_READ_SECTORS));
+
+	ret = ec_stripe_buf_init(buf, start, end - start);
+	if (ret)
+		goto err;
+
+	ec_recov_read(c, buf, block);
+
+	if (ec_nr_failed(buf) > v->nr_redundant) {
+		bch_err_ratelimited(c,
+			"error doing reconstruct read: unable to read enough blocks");
+		ret = -EIO;
+		goto err;
+	}
+
+	ret = ec_do_recov(c, buf);
+	if (ret)
+		goto err;
+
+	memcpy_to_bio(&rbio->bio, rbio->bio.bi_iter,
+		      buf->data[block] + ((offset - buf->offset) << 9));
+
+	ec_recov_cache_add(c, buf, idx, block);
+err:
+	ec_stripe_buf_exit(buf);
+	kfree(buf);
+	return ret;
+}
+
+/*
+ * Scrub: read every block of a stripe and check it against the stripe's
+ * checksums, a chunk at a time. Returns the number of blocks that couldn't be
+ * read or had checksum errors:
+ */
+#define EC_SCRUB_CHUNK_SECTORS	256
+
+int bch2_ec_stripe_scrub(struct bch_fs *c, struct bkey_s_c k)
+{
+	struct ec_stripe_buf *buf;
+	struct closure cl;
+	struct bch_stripe *v;
+	unsigned long bad[BITS_TO_LONGS(BCH_BKEY_PTRS_MAX)] = { 0 };
+	unsigned i, offset = 0, sectors;
+	int ret = 0;
+
+	closure_init_stack(&cl);
+
+	buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	bkey_reassemble(&buf->key.k_i, k);
+	v = &buf->key.v;
+	sectors = le16_to_cpu(v->sectors);
+
+	while (offset < sectors) {
+		ret = ec_stripe_buf_init(buf, offset,
+				min(sectors - offset, EC_SCRUB_CHUNK_SECTORS));
+		if (ret)
+			break;
+
+		for (i = 0; i < v->nr_blocks; i++)
+			ec_block_io(c, buf, REQ_OP_READ, i, &cl);
+
+		closure_sync(&cl);
+
+		ec_validate_checksums(c, buf);
+
+		for (i = 0; i < v->nr_blocks; i++)
+			if (!test_bit(i, buf->valid))
+				__set_bit(i, bad);
+
+		offset = buf->offset + buf->size;
+		ec_stripe_buf_exit(buf);
+	}
+
+	ret = ret ?: bitmap_weight(bad, v->nr_blocks);
+	kfree(buf);
+	return ret;
+}
+
+/*
+ * Stripe rebuild: after a device fails, restore the redundancy of the stripes
+ * that had blocks on it a stripe at a time, instead of rereplicating the
+ * extents in them one by one. Each lost block is reconstructed from the
+ * surviving blocks, read in large chunks, and written to a new bucket on
+ * another device; then the extents in the lost block, found via backpointers,
+ * are pointed at the new bucket, and the stripe last.
+ *
+ * Until the stripe is updated, the extents already moved don't match it - see
+ * bch2_ptr_in_rebuilding_stripe_block(). The other way around, the extents not
+ * yet moved would point at a block the stripe no longer has.
+ *
+ * The stripes btree is split into opts.rebuild_threads ranges, each rebuilt by
+ * its own thread.
+ */
+#define EC_REBUILD_CHUNK_SECTORS	2048
+
+struct ec_rebuild_worker {
+	struct bch_fs		*c;
+	struct bch_move_stats	*stats;
+	u64			start;
+	u64			end;
+
+	struct dev_stripe_state	stripe;
+	struct bch_extent_ptr	old_ptrs[BCH_BKEY_PTRS_MAX];
+	struct ec_stripe_buf	buf;
+
+	struct task_struct	*thread;
+	struct completion	done;
+	int			ret;
+};
+
+/*
+ * Point the pointers in @k that are to lost blocks of stripe @idx at the
+ * blocks' new location in @v: blocks are whole buckets, so the offset within
+ * the bucket is unchanged:
+ */
+static bool ec_rebuild_update_ptrs(struct bch_fs *c, struct bkey_s k,
+				   u64 idx, const struct bch_stripe *v)
+{
+	struct bkey_ptrs ptrs = bch2_bkey_ptrs(k);
+	union bch_extent_entry *entry;
+	struct extent_ptr_decoded p;
+	bool ret = false;
+
+	bkey_for_each_ptr_decode(k.k, ptrs, p, entry) {
+		const struct bch_extent_ptr *new;
+		struct bch_dev *ca;
+
+		if (p.ptr.cached ||
+		    !p.has_ec ||
+		    p.ec.idx != idx ||
+		    p.ec.block >= v->nr_blocks)
+			continue;
+
+		new = &v->ptrs[p.ec.block];
+		ca = bch_dev_bkey_exists(c, p.ptr.dev);
+
+		if (new->dev == p.ptr.dev || bch2_dev_is_readable(ca))
+			continue;
+
+		entry->ptr.dev		= new->dev;
+		entry->ptr.offset	= new->offset +
+			bucket_remainder(ca, p.ptr.offset);
+		entry->ptr.gen		= new->gen;
+		ret = true;
+	}
+
+	return ret;
+}
+
+/*
+ * A pointer the stripe rebuild has already moved to a lost block's new bucket:
+ * it's to the same block, but the stripe still has that block on a device
+ * that's gone:
+ */
+bool bch2_ptr_in_rebuilding_stripe_block(struct bch_fs *c,
+					 const struct bch_stripe *s,
+					 struct extent_ptr_decoded p)
+{
+	const struct bch_extent_ptr *old;
+	unsigned nr_data = s->nr_blocks - s->nr_redundant;
+
+	if (p.ec.block >= nr_data)
+		return false;
+
+	old = &s->ptrs[p.ec.block];
+
+	return old->dev != p.ptr.dev &&
+		!bch2_dev_is_readable(bch_dev_bkey_exists(c, old->dev)) &&
+		bucket_remainder(bch_dev_bkey_exists(c, p.ptr.dev),
+				 p.ptr.offset) < le16_to_cpu(s->sectors);
+}
+
+static int ec_rebuild_update_key(struct btree_trans *trans,
+				 enum btree_id btree_id, struct bpos pos,
+				 u64 idx, const struct bch_stripe *v,
+				 struct bkey_buf *sk)
+{
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	int ret;
+
+	iter = bch2_trans_get_iter(trans, btree_id, pos, BTREE_ITER_INTENT);
+	k = bch2_btree_iter_peek(iter);
+	ret = bkey_err(k);
+	if (ret || !k.k || bkey_cmp(bkey_start_pos(k.k), pos))
+		goto out;
+
+	bch2_bkey_buf_reassemble(sk, trans->c, k);
+	if (ec_rebuild_update_ptrs(trans->c, bkey_i_to_s(sk->k), idx, v))
+		bch2_trans_update(trans, iter, sk->k, 0);
+out:
+	bch2_trans_iter_put(trans, iter);
+	return ret;
+}
+
+/* Update the extents in the lost blocks of a stripe, found via backpointers: */
+static int ec_rebuild_update_extents(struct bch_fs *c,
+				     struct ec_rebuild_worker *w,
+				     unsigned long *lost)
+{
+	struct bch_stripe *v = &w->buf.key.v;
+	u64 idx = w->buf.key.k.p.offset;
+	struct btree_trans trans;
+	struct btree_iter *bp_iter;
+	struct bkey_s_c k;
+	struct bkey_buf sk;
+	unsigned i;
+	int ret = 0;
+
+	bch2_bkey_buf_init(&sk);
+	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 0);
+
+	for_each_set_bit(i, lost, v->nr_blocks) {
+		struct bch_extent_ptr *old = &w->old_ptrs[i];
+
+		bp_iter = bch2_trans_get_iter(&trans, BTREE_ID_BACKPOINTERS,
+				bch2_backpointer_pos(old->dev, old->offset, 0), 0);
+
+		while ((k = bch2_btree_iter_peek(bp_iter)).k &&
+		       !(ret = bkey_err(k)) &&
+		       bkey_cmp(k.k->p, bch2_backpointer_pos(old->dev,
+				old->offset + le16_to_cpu(v->sectors), 0)) < 0) {
+			struct bch_backpointer bp;
+
+			if (k.k->type != KEY_TYPE_backpointer)
+				goto next;
+
+			bp = *bkey_s_c_to_backpointer(k).v;
+
+			ret = __bch2_trans_do(&trans, NULL, NULL,
+					      BTREE_INSERT_NOFAIL,
+				ec_rebuild_update_key(&trans, bp.btree_id,
+					POS(le64_to_cpu(bp.inode),
+					    le64_to_cpu(bp.offset)),
+					idx, v, &sk));
+			if (ret)
+				break;
+next:
+			bch2_btree_iter_next(bp_iter);
+		}
+
+		bch2_trans_iter_put(&trans, bp_iter);
+		if (ret)
+			break;
+	}
+
+	ret = bch2_trans_exit(&trans) ?: ret;
+	bch2_bkey_buf_exit(&sk, c);
+	return ret;
+}
+
+/* Point the stripe at the new blocks, if it hasn't changed underneath us: */
+static int ec_rebuild_stripe_update(struct btree_trans *trans,
+				    struct ec_rebuild_worker *w)
+{
+	struct bkey_i_stripe *new = &w->buf.key;
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	const struct bch_stripe *existing;
+	unsigned i;
+	int ret;
+
+	iter = bch2_trans_get_iter(trans, BTREE_ID_EC,
+				   new->k.p, BTREE_ITER_INTENT);
+	k = bch2_btree_iter_peek_slot(iter);
+	ret = bkey_err(k);
+	if (ret)
+		goto err;
+
+	if (k.k->type != KEY_TYPE_stripe) {
+		ret = -EAGAIN;
+		goto err;
+	}
+
+	existing = bkey_s_c_to_stripe(k).v;
+
+	if (existing->nr_blocks != new->v.nr_blocks ||
+	    memcmp(existing->ptrs, w->old_ptrs,
+		   sizeof(existing->ptrs[0]) * existing->nr_blocks)) {
+		ret = -EAGAIN;
+		goto err;
+	}
+
+	for (i = 0; i < new->v.nr_blocks; i++)
+		stripe_blockcount_set(&new->v, i,
+			stripe_blockcount_get(existing, i));
+
+	bch2_trans_update(trans, iter, &new->k_i, 0);
+err:
+	bch2_trans_iter_put(trans, iter);
+	return ret;
+}
+
+static int ec_rebuild_alloc(struct bch_fs *c, struct ec_rebuild_worker *w,
+			    struct open_buckets *obs, unsigned nr)
+{
+	struct bch_stripe *v = &w->buf.key.v;
+	struct bch_devs_mask devs = target_rw_devs(c, BCH_DATA_user, 0);
+	struct bch_dev *ca;
+	unsigned i, nr_have = 0;
+	bool have_cache = true;
+	enum bucket_alloc_ret ret;
+	struct closure cl;
+
+	closure_init_stack(&cl);
+
+	for (i = 0; i < v->nr_blocks; i++)
+		__clear_bit(v->ptrs[i].dev, devs.d);
+
+	/* The new bucket has to be big enough for the whole block: */
+	rcu_read_lock();
+	for_each_member_device_rcu(ca, c, i, &devs)
+		if (ca->mi.bucket_size < le16_to_cpu(v->sectors))
+			__clear_bit(ca->dev_idx, devs.d);
+	rcu_read_unlock();
+
+	while (1) {
+		percpu_down_read(&c->mark_lock);
+		rcu_read_lock();
+		ret = bch2_bucket_alloc_set(c, obs, &w->stripe, &devs,
+					    nr, &nr_have, &have_cache,
+					    RESERVE_NONE, 0, &cl);
+		rcu_read_unlock();
+		percpu_up_read(&c->mark_lock);
+
+		if (ret != FREELIST_EMPTY || kthread_should_stop())
+			break;
+
+		closure_sync(&cl);
+	}
+
+	closure_sync(&cl);
+
+	return ret == ALLOC_SUCCESS ? 0 : -ENOSPC;
+}
+
+static int ec_rebuild_stripe(struct bch_fs *c, struct ec_rebuild_worker *w)
+{
+	struct ec_stripe_buf *buf = &w->buf;
+	struct bch_stripe *v = &buf->key.v;
+	unsigned long lost[BITS_TO_LONGS(BCH_BKEY_PTRS_MAX)] = { 0 };
+	unsigned i, j, nr_lost = 0, offset = 0;
+	unsigned sectors = le16_to_cpu(v->sectors);
+	struct open_buckets obs = { .nr = 0 };
+	struct open_bucket *ob;
+	struct closure cl;
+	int ret = 0;
+
+	closure_init_stack(&cl);
+
+	for (i = 0; i < v->nr_blocks; i++)
+		if (!bch2_dev_is_readable(bch_dev_bkey_exists(c, v->ptrs[i].dev))) {
+			__set_bit(i, lost);
+			nr_lost++;
+		}
+
+	if (!nr_lost)
+		return 0;
+
+	if (nr_lost > v->nr_redundant) {
+		bch_err_ratelimited(c, "can't rebuild stripe %llu: %u blocks lost",
+				    buf->key.k.p.offset, nr_lost);
+		return 0;
+	}
+
+	memcpy(w->old_ptrs, v->ptrs, sizeof(v->ptrs[0]) * v->nr_blocks);
+
+	ret = ec_rebuild_alloc(c, w, &obs, nr_lost);
+	if (ret)
+		goto out;
+
+	j = 0;
+	for_each_set_bit(i, lost, v->nr_blocks)
+		v->ptrs[i] = c->open_buckets[obs.v[j++]].ptr;
+
+	while (offset < sectors) {
+		ret = ec_stripe_buf_init(buf, offset,
+				min(sectors - offset, EC_REBUILD_CHUNK_SECTORS));
+		if (ret)
+			goto out;
+
+		for (i = 0; i < v->nr_blocks; i++)
+			if (test_bit(i, lost))
+				clear_bit(i, buf->valid);
+			else
+				ec_block_io(c, buf, REQ_OP_READ, i, &cl);
+
+		closure_sync(&cl);
+
+		ec_validate_checksums(c, buf);
 
-		bio_set_dev(&ec_bio->bio, ca->disk_sb.bdev);
-		bio_set_op_attrs(&ec_bio->bio, rw, 0);
+		ret = ec_do_recov(c, buf);
+		if (ret) {
+			ret = -EIO;
+			goto out;
+		}
 
-		ec_bio->bio.bi_iter.bi_sector	= ptr->offset + buf->offset + (offset >> 9);
-		ec_bio->bio.bi_end_io		= ec_block_endio;
-		ec_bio->bio.bi_private		= cl;
+		for_each_set_bit(i, lost, v->nr_blocks) {
+			set_bit(i, buf->valid);
+			ec_block_io(c, buf, REQ_OP_WRITE, i, &cl);
+		}
 
-		bch2_bio_map(&ec_bio->bio, buf->data[idx] + offset, b);
+		closure_sync(&cl);
 
-		closure_get(cl);
-		percpu_ref_get(&ca->io_ref);
+		for_each_set_bit(i, lost, v->nr_blocks)
+			if (!test_bit(i, buf->valid)) {
+				bch_err_ratelimited(c,
+					"error rebuilding stripe %llu: write error",
+					buf->key.k.p.offset);
+				ret = -EIO;
+				goto out;
+			}
 
-		submit_bio(&ec_bio->bio);
+		atomic64_add(buf->size * nr_lost, &w->stats->sectors_moved);
 
-		offset += b;
+		offset = buf->offset + buf->size;
+		ec_stripe_buf_exit(buf);
 	}
 
-	percpu_ref_put(&ca->io_ref);
+	/*
+	 * We still hold the new buckets open, so they can't be reused before
+	 * the extents or the stripe point to them:
+	 */
+	ret = ec_rebuild_update_extents(c, w, lost) ?:
+		bch2_trans_do(c, NULL, NULL, BTREE_INSERT_NOFAIL,
+			      ec_rebuild_stripe_update(&trans, w));
+	if (ret == -EAGAIN) {
+		/* stripe was deleted or rewritten while we were rebuilding it */
+		bch_err_ratelimited(c, "stripe %llu changed while rebuilding it",
+				    buf->key.k.p.offset);
+		ret = 0;
+		goto out;
+	}
+	if (ret)
+		goto out;
+
+	atomic64_inc(&w->stats->keys_moved);
+out:
+	ec_stripe_buf_exit(buf);
+	open_bucket_for_each(c, &obs, ob, i)
+		bch2_open_bucket_put(c, ob);
+	return ret;
 }
 
-static int get_stripe_key(struct bch_fs *c, u64 idx, struct ec_stripe_buf *stripe)
+static int ec_rebuild_worker_thread(void *arg)
 {
+	struct ec_rebuild_worker *w = arg;
+	struct bch_fs *c = w->c;
 	struct btree_trans trans;
 	struct btree_iter *iter;
 	struct bkey_s_c k;
-	int ret;
+	int ret = 0;
 
 	bch2_trans_init(&trans, c, 0, 0);
-	iter = bch2_trans_get_iter(&trans, BTREE_ID_EC, POS(0, idx), BTREE_ITER_SLOTS);
-	k = bch2_btree_iter_peek_slot(iter);
-	ret = bkey_err(k);
-	if (ret)
-		goto err;
-	if (k.k->type != KEY_TYPE_stripe) {
-		ret = -ENOENT;
-		goto err;
-	}
-	bkey_reassemble(&stripe->key.k_i, k);
-err:
-	bch2_trans_exit(&trans);
-	return ret;
-}
 
-/* recovery read path: */
-int bch2_ec_read_extent(struct bch_fs *c, struct bch_read_bio *rbio)
-{
-	struct ec_stripe_buf *buf;
-	struct closure cl;
-	struct bch_stripe *v;
-	unsigned i, offset;
-	int ret = 0;
+	for_each_btree_key(&trans, iter, BTREE_ID_EC, POS(0, w->start),
+			   BTREE_ITER_PREFETCH, k, ret) {
+		if (k.k->p.offset >= w->end || kthread_should_stop())
+			break;
 
-	closure_init_stack(&cl);
+		if (k.k->type != KEY_TYPE_stripe)
+			continue;
 
-	BUG_ON(!rbio->pick.has_ec);
+		w->stats->pos = k.k->p;
 
-	buf = kzalloc(sizeof(*buf), GFP_NOIO);
-	if (!buf)
-		return -ENOMEM;
+		bkey_reassemble(&w->buf.key.k_i, k);
+		bch2_trans_unlock(&trans);
 
-	ret = get_stripe_key(c, rbio->pick.ec.idx, buf);
-	if (ret) {
-		bch_err_ratelimited(c,
-			"error doing reconstruct read: error %i looking up stripe", ret);
-		kfree(buf);
-		return -EIO;
+		ret = ec_rebuild_stripe(c, w);
+		if (ret)
+			break;
 	}
+	bch2_trans_iter_put(&trans, iter);
 
-	v = &buf->key.v;
+	w->ret = bch2_trans_exit(&trans) ?: ret;
+	complete(&w->done);
+	return 0;
+}
 
-	if (!bch2_ptr_matches_stripe(v, rbio->pick)) {
-		bch_err_ratelimited(c,
-			"error doing reconstruct read: pointer doesn't match stripe");
-		ret = -EIO;
-		goto err;
-	}
+int bch2_ec_rebuild(struct bch_fs *c, struct bch_move_stats *stats)
+{
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	struct ec_rebuild_worker *w;
+	unsigned i, nr = c->opts.rebuild_threads;
+	u64 nr_stripes = 0;
+	int ret = 0;
 
-	offset = rbio->bio.bi_iter.bi_sector - v->ptrs[rbio->pick.ec.block].offset;
-	if (offset + bio_sectors(&rbio->bio) > le16_to_cpu(v->sectors)) {
-		bch_err_ratelimited(c,
-			"error doing reconstruct read: read is bigger than stripe");
-		ret = -EIO;
-		goto err;
-	}
+	/*
+	 * Without backpointers, finding a lost block's extents means walking
+	 * every extent - leave them to the rereplicate pass:
+	 */
+	if (!bch2_fs_has_backpointers(c))
+		return 0;
 
-	ret = ec_stripe_buf_init(buf, offset, bio_sectors(&rbio->bio));
-	if (ret)
-		goto err;
+	bch2_trans_init(&trans, c, 0, 0);
+	iter = bch2_trans_get_iter(&trans, BTREE_ID_EC, POS(0, U64_MAX), 0);
+	k = bch2_btree_iter_prev(iter);
+	if (!IS_ERR_OR_NULL(k.k))
+		nr_stripes = k.k->p.offset + 1;
+	bch2_trans_iter_put(&trans, iter);
+	ret = bch2_trans_exit(&trans);
+	if (ret || !nr_stripes)
+		return ret;
 
-	for (i = 0; i < v->nr_blocks; i++)
-		ec_block_io(c, buf, REQ_OP_READ, i, &cl);
+	stats->data_type = BCH_DATA_user;
+	stats->btree_id	= BTREE_ID_EC;
 
-	closure_sync(&cl);
+	w = kvcalloc(nr, sizeof(*w), GFP_KERNEL);
+	if (!w)
+		return -ENOMEM;
 
-	if (ec_nr_failed(buf) > v->nr_redundant) {
-		bch_err_ratelimited(c,
-			"error doing reconstruct read: unable to read enough blocks");
-		ret = -EIO;
-		goto err;
+	for (i = 0; i < nr; i++) {
+		w[i].c		= c;
+		w[i].stats	= stats;
+		w[i].start	= div_u64(nr_stripes * i, nr);
+		w[i].end	= i + 1 < nr ? div_u64(nr_stripes * (i + 1), nr) : U64_MAX;
+		init_completion(&w[i].done);
+
+		w[i].thread = kthread_create(ec_rebuild_worker_thread, &w[i],
+					     "bch-ec-rebuild/%s", c->name);
+		if (IS_ERR(w[i].thread)) {
+			ret = PTR_ERR(w[i].thread);
+			w[i].thread = NULL;
+			break;
+		}
+
+		get_task_struct(w[i].thread);
+		wake_up_process(w[i].thread);
 	}
 
-	ec_validate_checksums(c, buf);
+	/* Run until done, or until we're told to stop: */
+	for (i = 0; i < nr && w[i].thread; i++)
+		while (!wait_for_completion_timeout(&w[i].done, HZ / 10) &&
+		       !kthread_should_stop())
+			;
 
-	ret = ec_do_recov(c, buf);
-	if (ret)
-		goto err;
+	for (i = 0; i < nr && w[i].thread; i++) {
+		kthread_stop(w[i].thread);
+		put_task_struct(w[i].thread);
+		ret = w[i].ret ?: ret;
+	}
 
-	memcpy_to_bio(&rbio->bio, rbio->bio.bi_iter,
-		      buf->data[rbio->pick.ec.block] + ((offset - buf->offset) << 9));
-err:
-	ec_stripe_buf_exit(buf);
-	kfree(buf);
+	kvfree(w);
 	return ret;
 }
 
@@ -524,23 +1489,6 @@ int bch2_ec_read_extent(struct bch_fs *c, struct bch_read_bio *rbio)
 
 static int __ec_stripe_mem_alloc(struct bch_fs *c, size_t idx, gfp_t gfp)
 {
-	ec_stripes_heap n, *h = &c->ec_stripes_heap;
-
-	if (idx >= h->size) {
-		if (!init_heap(&n, max(1024UL, roundup_pow_of_two(idx + 1)), gfp))
-			return -ENOMEM;
-
-		spin_lock(&c->ec_stripes_heap_lock);
-		if (n.size > h->size) {
-			memcpy(n.data, h->data, h->used * sizeof(h->data[0]));
-			n.used = h->used;
-			swap(*h, n);
-		}
-		spin_unlock(&c->ec_stripes_heap_lock);
-
-		free_heap(&n);
-	}
-
 	if (!genradix_ptr_alloc(&c->stripes[0], idx, gfp))
 		return -ENOMEM;
 
@@ -577,12 +1525,16 @@ static ssize_t stripe_idx_to_delete(struct bch_fs *c)
 		? h->data[0].idx : -1;
 }
 
+/*
+ * The stripes heap is ordered by fill ratio - the fraction of data blocks that
+ * still have live data - so that stripes of different widths compare fairly:
+ */
 static inline int ec_stripes_heap_cmp(ec_stripes_heap *h,
 				      struct ec_stripe_heap_entry l,
 				      struct ec_stripe_heap_entry r)
 {
-	return ((l.blocks_nonempty > r.blocks_nonempty) -
-		(l.blocks_nonempty < r.blocks_nonempty));
+	return cmp_int(l.blocks_nonempty * r.nr_data,
+		       r.blocks_nonempty * l.nr_data);
 }
 
 static inline void ec_stripes_heap_set_backpointer(ec_stripes_heap *h,
@@ -603,8 +1555,8 @@ static void heap_verify_backpointer(struct bch_fs *c, size_t idx)
 	BUG_ON(h->data[m->heap_idx].idx != idx);
 }
 
-void bch2_stripes_heap_del(struct bch_fs *c,
-			   struct stripe *m, size_t idx)
+static void stripes_heap_remove(struct bch_fs *c,
+				struct stripe *m, size_t idx)
 {
 	if (!m->on_heap)
 		return;
@@ -618,50 +1570,167 @@ void bch2_stripes_heap_del(struct bch_fs *c,
 		 ec_stripes_heap_set_backpointer);
 }
 
-void bch2_stripes_heap_insert(struct bch_fs *c,
-			      struct stripe *m, size_t idx)
+/*
+ * The heap only indexes stripes that can be reused or deleted - stripes with
+ * at least one empty data block. On a large filesystem most stripes are full,
+ * and those are never looked up through the heap, so the heap is sized to the
+ * number of stripes it actually holds and grown on demand.
+ *
+ * If the heap is full we can't allocate here (we're under the heap lock, and
+ * often the mark lock); the stripe is left off the heap and the delete worker
+ * grows the heap and reindexes.
+ */
+static void stripes_heap_index(struct bch_fs *c,
+			       struct stripe *m, size_t idx)
 {
-	if (m->on_heap)
-		return;
+	ec_stripes_heap *h = &c->ec_stripes_heap;
+	bool want = m->indexed &&
+		m->blocks_nonempty < m->nr_blocks - m->nr_redundant;
+	size_t i;
 
-	BUG_ON(heap_full(&c->ec_stripes_heap));
+	if (!want) {
+		stripes_heap_remove(c, m, idx);
+		return;
+	}
 
-	m->on_heap = true;
+	if (!m->on_heap) {
+		if (heap_full(h)) {
+			c->ec_stripes_heap_overflow = true;
+			if (!percpu_ref_is_dying(&c->writes))
+				schedule_work(&c->ec_stripe_delete_work);
+			return;
+		}
 
-	heap_add(&c->ec_stripes_heap, ((struct ec_stripe_heap_entry) {
-			.idx = idx,
-			.blocks_nonempty = m->blocks_nonempty,
-		}),
-		 ec_stripes_heap_cmp,
-		 ec_stripes_heap_set_backpointer);
+		m->on_heap = true;
+
+		heap_add(h, ((struct ec_stripe_heap_entry) {
+				.idx = idx,
+				.blocks_nonempty = m->blocks_nonempty,
+				.nr_data = m->nr_blocks - m->nr_redundant,
+			}),
+			 ec_stripes_heap_cmp,
+			 ec_stripes_heap_set_backpointer);
+	} else {
+		heap_verify_backpointer(c, idx);
+
+		h->data[m->heap_idx].blocks_nonempty = m->blocks_nonempty;
+		h->data[m->heap_idx].nr_data = m->nr_blocks - m->nr_redundant;
+
+		i = m->heap_idx;
+		heap_sift_up(h,	  i, ec_stripes_heap_cmp,
+			     ec_stripes_heap_set_backpointer);
+		heap_sift_down(h, i, ec_stripes_heap_cmp,
+			       ec_stripes_heap_set_backpointer);
+	}
 
 	heap_verify_backpointer(c, idx);
+
+	if (stripe_idx_to_delete(c) >= 0 &&
+	    !percpu_ref_is_dying(&c->writes))
+		schedule_work(&c->ec_stripe_delete_work);
+}
+
+void bch2_stripes_heap_del(struct bch_fs *c,
+			   struct stripe *m, size_t idx)
+{
+	m->indexed = false;
+	stripes_heap_remove(c, m, idx);
+}
+
+void bch2_stripes_heap_insert(struct bch_fs *c,
+			      struct stripe *m, size_t idx)
+{
+	m->indexed = true;
+	stripes_heap_index(c, m, idx);
 }
 
 void bch2_stripes_heap_update(struct bch_fs *c,
 			      struct stripe *m, size_t idx)
 {
-	ec_stripes_heap *h = &c->ec_stripes_heap;
-	size_t i;
+	if (m->indexed)
+		stripes_heap_index(c, m, idx);
+}
 
-	if (!m->on_heap)
-		return;
+static int stripes_heap_grow(struct bch_fs *c)
+{
+	ec_stripes_heap n, *h = &c->ec_stripes_heap;
 
-	heap_verify_backpointer(c, idx);
+	if (!init_heap(&n, max_t(size_t, 1024, h->size * 2), GFP_KERNEL))
+		return -ENOMEM;
 
-	h->data[m->heap_idx].blocks_nonempty = m->blocks_nonempty;
+	spin_lock(&c->ec_stripes_heap_lock);
+	if (n.size > h->size) {
+		memcpy(n.data, h->data, h->used * sizeof(h->data[0]));
+		n.used = h->used;
+		swap(*h, n);
+	}
+	spin_unlock(&c->ec_stripes_heap_lock);
 
-	i = m->heap_idx;
-	heap_sift_up(h,	  i, ec_stripes_heap_cmp,
-		     ec_stripes_heap_set_backpointer);
-	heap_sift_down(h, i, ec_stripes_heap_cmp,
-		       ec_stripes_heap_set_backpointer);
+	free_heap(&n);
+	return 0;
+}
 
-	heap_verify_backpointer(c, idx);
+/* Index the stripes that were left off the heap because it was full: */
+static void stripes_heap_reindex(struct bch_fs *c)
+{
+	struct genradix_iter iter;
+	struct stripe *m;
 
-	if (stripe_idx_to_delete(c) >= 0 &&
-	    !percpu_ref_is_dying(&c->writes))
-		schedule_work(&c->ec_stripe_delete_work);
+	while (READ_ONCE(c->ec_stripes_heap_overflow)) {
+		if (stripes_heap_grow(c))
+			return;
+
+		c->ec_stripes_heap_overflow = false;
+
+		genradix_for_each(&c->stripes[0], iter, m) {
+			spin_lock(&c->ec_stripes_heap_lock);
+			if (m->indexed && !m->on_heap)
+				stripes_heap_index(c, m, iter.pos);
+			spin_unlock(&c->ec_stripes_heap_lock);
+		}
+	}
+}
+
+/*
+ * Stripes that are at most half full are worth compacting: copygc moves their
+ * live data into new, full stripes, and once the last block is empty the stripe
+ * is deleted and all of its buckets are freed.
+ *
+ * Returns up to @nr such stripes with a nonempty block on @dev, sorted by
+ * index:
+ */
+static int stripe_idx_cmp(const void *l, const void *r)
+{
+	return cmp_int(*((u32 *) l), *((u32 *) r));
+}
+
+size_t bch2_ec_sparse_stripes(struct bch_fs *c, unsigned dev,
+			      u32 *idx, size_t nr)
+{
+	ec_stripes_heap *h = &c->ec_stripes_heap;
+	struct ec_stripe_heap_entry *e;
+	size_t ret = 0;
+	unsigned i;
+
+	spin_lock(&c->ec_stripes_heap_lock);
+	for (e = h->data; e < h->data + h->used && ret < nr; e++) {
+		struct stripe *m = genradix_ptr(&c->stripes[0], e->idx);
+
+		if (!e->blocks_nonempty ||
+		    e->blocks_nonempty * 2 > e->nr_data)
+			continue;
+
+		for (i = 0; i < m->nr_blocks - m->nr_redundant; i++)
+			if (m->block_sectors[i] &&
+			    m->block_devs[i] == dev) {
+				idx[ret++] = e->idx;
+				break;
+			}
+	}
+	spin_unlock(&c->ec_stripes_heap_lock);
+
+	sort(idx, ret, sizeof(idx[0]), stripe_idx_cmp, NULL);
+	return ret;
 }
 
 /* stripe deletion */
@@ -680,6 +1749,8 @@ static void ec_stripe_delete_work(struct work_struct *work)
 		container_of(work, struct bch_fs, ec_stripe_delete_work);
 	ssize_t idx;
 
+	stripes_heap_reindex(c);
+
 	while (1) {
 		spin_lock(&c->ec_stripes_heap_lock);
 		idx = stripe_idx_to_delete(c);
@@ -923,9 +1994,14 @@ static void ec_stripe_create(struct ec_stripe_new *s)
 	if (!percpu_ref_tryget(&c->writes))
 		goto err;
 
-	ec_generate_ec(&s->new_stripe);
-
-	ec_generate_checksums(&s->new_stripe);
+	if (s->have_existing_stripe) {
+		ec_generate_ec(&s->new_stripe);
+		ec_generate_checksums(&s->new_stripe);
+	} else {
+		/* data blocks were folded into parity as they were written: */
+		for (i = nr_data; i < v->nr_blocks; i++)
+			ec_generate_block_checksums(&s->new_stripe, i);
+	}
 
 	/* write p/q: */
 	for (i = nr_data; i < v->nr_blocks; i++)
@@ -957,7 +2033,7 @@ static void ec_stripe_create(struct ec_stripe_new *s)
 	spin_lock(&c->ec_stripes_heap_lock);
 	m = genradix_ptr(&c->stripes[0], s->new_stripe.key.k.p.offset);
 
-	BUG_ON(m->on_heap);
+	BUG_ON(m->indexed);
 	bch2_stripes_heap_insert(c, m, s->new_stripe.key.k.p.offset);
 	spin_unlock(&c->ec_stripes_heap_lock);
 err_put_writes:
@@ -1028,6 +2104,37 @@ static void ec_stripe_set_pending(struct bch_fs *c, struct ec_stripe_head *h)
 	ec_stripe_new_put(c, s);
 }
 
+/*
+ * New stripes that aren't reusing an existing stripe have their parity computed
+ * incrementally: each data block is folded into the parity blocks, and its
+ * buffer freed, as soon as it's been written - so that we're only holding
+ * buffers for parity and for data blocks still being written:
+ */
+static void ec_stripe_fold_block(struct ec_stripe_new *s, unsigned block)
+{
+	struct ec_stripe_buf *buf = &s->new_stripe;
+	struct bch_stripe *v = &buf->key.v;
+	unsigned nr_data = v->nr_blocks - v->nr_redundant;
+
+	mutex_lock(&s->lock);
+	ec_generate_block_checksums(buf, block);
+	ec_gen_block(nr_data, v->nr_redundant, block, buf->size << 9, buf->data);
+
+	kvpfree(buf->data[block], buf->size << 9);
+	buf->data[block] = NULL;
+	mutex_unlock(&s->lock);
+}
+
+int bch2_ec_stripe_block_buf_alloc(struct ec_stripe_new *s, unsigned block)
+{
+	struct ec_stripe_buf *buf = &s->new_stripe;
+
+	if (!buf->data[block])
+		buf->data[block] = kvpmalloc(buf->size << 9, GFP_KERNEL);
+
+	return buf->data[block] ? 0 : -ENOMEM;
+}
+
 /* have a full bucket - hand it off to be erasure coded: */
 void bch2_ec_bucket_written(struct bch_fs *c, struct open_bucket *ob)
 {
@@ -1035,6 +2142,8 @@ void bch2_ec_bucket_written(struct bch_fs *c, struct open_bucket *ob)
 
 	if (ob->sectors_free)
 		s->err = -1;
+	else if (!s->have_existing_stripe)
+		ec_stripe_fold_block(s, ob->ec_idx);
 
 	ec_stripe_new_put(c, s);
 }
@@ -1354,19 +2463,38 @@ new_stripe_alloc_buckets(struct bch_fs *c, struct ec_stripe_head *h,
 	return ret;
 }
 
-/* XXX: doesn't obey target: */
+/*
+ * Pick a stripe to reuse: the blocks that still have data stay where they are,
+ * and new buckets are allocated for the rest. So prefer stripes with the fewest
+ * nonempty blocks, and among those, stripes whose nonempty blocks are on the
+ * fullest devices - new data then goes to the emptier devices.
+ *
+ * Nonempty blocks on devices outside the head's target rule a stripe out.
+ */
 static s64 get_existing_stripe(struct bch_fs *c,
 			       struct ec_stripe_head *head)
 {
 	ec_stripes_heap *h = &c->ec_stripes_heap;
+	u8 dev_free[BCH_SB_MEMBERS_MAX] = { 0 };
+	struct bch_dev *ca;
 	struct stripe *m;
 	size_t heap_idx;
-	u64 stripe_idx;
+	u64 stripe_idx, score, best_score = U64_MAX;
+	unsigned i;
 	s64 ret = -1;
 
 	if (may_create_new_stripe(c))
 		return -1;
 
+	rcu_read_lock();
+	for_each_set_bit(i, head->devs.d, BCH_SB_MEMBERS_MAX) {
+		ca = rcu_dereference(c->devs[i]);
+		if (ca)
+			dev_free[i] = div64_u64(dev_buckets_available(ca) * 100,
+						max_t(u64, 1, ca->mi.nbuckets));
+	}
+	rcu_read_unlock();
+
 	spin_lock(&c->ec_stripes_heap_lock);
 	for (heap_idx = 0; heap_idx < h->used; heap_idx++) {
 		/* No blocks worth reusing, stripe will just be deleted: */
@@ -1376,15 +2504,35 @@ static s64 get_existing_stripe(struct bch_fs *c,
 		stripe_idx = h->data[heap_idx].idx;
 		m = genradix_ptr(&c->stripes[0], stripe_idx);
 
-		if (m->algorithm	== head->algo &&
-		    m->nr_redundant	== head->redundancy &&
-		    m->sectors		== head->blocksize &&
-		    m->blocks_nonempty	< m->nr_blocks - m->nr_redundant) {
-			bch2_stripes_heap_del(c, m, stripe_idx);
-			ret = stripe_idx;
-			break;
+		if (m->algorithm	!= head->algo ||
+		    m->nr_redundant	!= head->redundancy ||
+		    m->sectors		!= head->blocksize ||
+		    m->blocks_nonempty	>= m->nr_blocks - m->nr_redundant)
+			continue;
+
+		score = (u64) m->blocks_nonempty * 256 * BCH_BKEY_PTRS_MAX;
+
+		for (i = 0; i < m->nr_blocks - m->nr_redundant; i++) {
+			if (!m->block_sectors[i])
+				continue;
+
+			if (!test_bit(m->block_devs[i], head->devs.d))
+				break;
+
+			score += dev_free[m->block_devs[i]];
+		}
+
+		if (i < m->nr_blocks - m->nr_redundant)
+			continue;
+
+		if (score < best_score) {
+			best_score	= score;
+			ret		= stripe_idx;
 		}
 	}
+
+	if (ret >= 0)
+		bch2_stripes_heap_del(c, genradix_ptr(&c->stripes[0], ret), ret);
 	spin_unlock(&c->ec_stripes_heap_lock);
 	return ret;
 }
@@ -1448,9 +2596,21 @@ struct ec_stripe_head *bch2_ec_stripe_head_get(struct bch_fs *c,
 				  &h->s->existing_stripe.key.k_i);
 		}
 
-		if (ec_stripe_buf_init(&h->s->new_stripe, 0, h->blocksize)) {
+		/*
+		 * Without an existing stripe, data block buffers are allocated
+		 * as blocks are handed out, and parity accumulated into:
+		 */
+		if (__ec_stripe_buf_init(&h->s->new_stripe, 0, h->blocksize,
+					 h->s->have_existing_stripe
+					 ? 0 : h->s->nr_data)) {
 			BUG();
 		}
+
+		if (!h->s->have_existing_stripe)
+			for (i = h->s->nr_data;
+			     i < h->s->new_stripe.key.v.nr_blocks; i++)
+				memset(h->s->new_stripe.data[i], 0,
+				       h->blocksize << 9);
 	}
 
 	if (!h->s->allocated) {
@@ -1514,14 +2674,29 @@ void bch2_ec_stop_dev(struct bch_fs *c, struct bch_dev *ca)
 	mutex_unlock(&c->ec_stripe_head_lock);
 }
 
-void bch2_stripes_heap_start(struct bch_fs *c)
+int bch2_stripes_heap_start(struct bch_fs *c)
 {
+	ec_stripes_heap *h = &c->ec_stripes_heap;
 	struct genradix_iter iter;
 	struct stripe *m;
+	size_t nr = 0;
+
+	genradix_for_each(&c->stripes[0], iter, m)
+		nr += m->alive &&
+			m->blocks_nonempty < m->nr_blocks - m->nr_redundant;
+
+	free_heap(h);
+	if (!init_heap(h, max_t(size_t, 1024, roundup_pow_of_two(nr + 1)),
+		       GFP_KERNEL))
+		return -ENOMEM;
 
+	spin_lock(&c->ec_stripes_heap_lock);
 	genradix_for_each(&c->stripes[0], iter, m)
 		if (m->alive)
 			bch2_stripes_heap_insert(c, m, iter.pos);
+	spin_unlock(&c->ec_stripes_heap_lock);
+
+	return 0;
 }
 
 static int __bch2_stripe_write_key(struct btree_trans *trans,
@@ -1646,10 +2821,6 @@ int bch2_ec_mem_alloc(struct bch_fs *c, bool gc)
 	if (!idx)
 		return 0;
 
-	if (!gc &&
-	    !init_heap(&c->ec_stripes_heap, roundup_pow_of_two(idx),
-		       GFP_KERNEL))
-		return -ENOMEM;
 #if 0
 	ret = genradix_prealloc(&c->stripes[gc], idx, GFP_KERNEL);
 #else
@@ -1670,7 +2841,7 @@ void bch2_stripes_heap_to_text(struct printbuf *out, struct bch_fs *c)
 	for (i = 0; i < min_t(size_t, h->used, 20); i++) {
 		m = genradix_ptr(&c->stripes[0], h->data[i].idx);
 
-		pr_buf(out, "%zu %u/%u+%u\n", h->data[i].idx,
+		pr_buf(out, "%u %u/%u+%u\n", h->data[i].idx,
 		       h->data[i].blocks_nonempty,
 		       m->nr_blocks - m->nr_redundant,
 		       m->nr_redundant);
@@ -1725,6 +2896,7 @@ void bch2_fs_ec_exit(struct bch_fs *c)
 
 	BUG_ON(!list_empty(&c->ec_stripe_new_list));
 
+	ec_recov_cache_exit(c);
 	free_heap(&c->ec_stripes_heap);
 	genradix_free(&c->stripes[0]);
 	bioset_exit(&c->ec_bioset);
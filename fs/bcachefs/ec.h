@@ -176,11 +176,17 @@ struct ec_stripe_head {
 };
 
 int bch2_ec_read_extent(struct bch_fs *, struct bch_read_bio *);
+int bch2_ec_stripe_scrub(struct bch_fs *, struct bkey_s_c);
+bool bch2_ptr_in_rebuilding_stripe_block(struct bch_fs *,
+					 const struct bch_stripe *,
+					 struct extent_ptr_decoded);
+int bch2_ec_rebuild(struct bch_fs *, struct bch_move_stats *);
 
 void *bch2_writepoint_ec_buf(struct bch_fs *, struct write_point *);
 void bch2_ec_add_backpointer(struct bch_fs *, struct write_point *,
 			     struct bpos, unsigned);
 
+int bch2_ec_stripe_block_buf_alloc(struct ec_stripe_new *, unsigned);
 void bch2_ec_bucket_written(struct bch_fs *, struct open_bucket *);
 void bch2_ec_bucket_cancel(struct bch_fs *, struct open_bucket *);
 
@@ -193,12 +199,13 @@ struct ec_stripe_head *bch2_ec_stripe_head_get(struct bch_fs *,
 void bch2_stripes_heap_update(struct bch_fs *, struct stripe *, size_t);
 void bch2_stripes_heap_del(struct bch_fs *, struct stripe *, size_t);
 void bch2_stripes_heap_insert(struct bch_fs *, struct stripe *, size_t);
+size_t bch2_ec_sparse_stripes(struct bch_fs *, unsigned, u32 *, size_t);
 
 void bch2_ec_stop_dev(struct bch_fs *, struct bch_dev *);
 
 void bch2_ec_flush_new_stripes(struct bch_fs *);
 
-void bch2_stripes_heap_start(struct bch_fs *);
+int bch2_stripes_heap_start(struct bch_fs *);
 
 struct journal_keys;
 int bch2_stripes_read(struct bch_fs *, struct journal_keys *);
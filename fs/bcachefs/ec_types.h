@@ -20,17 +20,32 @@ struct stripe {
 
 	unsigned		alive:1; /* does a corresponding key exist in stripes btree? */
 	unsigned		on_heap:1;
+	unsigned		indexed:1; /* may be indexed by the stripes heap */
 	u8			blocks_nonempty;
 	u16			block_sectors[BCH_BKEY_PTRS_MAX];
+	u8			block_devs[BCH_BKEY_PTRS_MAX];
 
 	struct bch_replicas_padded r;
 };
 
 struct ec_stripe_heap_entry {
-	size_t			idx;
-	unsigned		blocks_nonempty;
+	u32			idx;
+	u8			blocks_nonempty;
+	u8			nr_data;
 };
 
 typedef HEAP(struct ec_stripe_heap_entry) ec_stripes_heap;
 
+#define EC_RECOV_CACHE_NR	8
+
+/* A range of one block of a stripe, as reconstructed by a degraded read: */
+struct ec_recov_cache_entry {
+	u64			idx;
+	struct bch_extent_ptr	ptr;
+	unsigned		offset;
+	unsigned		size;
+	unsigned long		last_used;
+	void			*data;
+};
+
 #endif /* _BCACHEFS_EC_TYPES_H */
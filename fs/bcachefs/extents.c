@@ -70,6 +70,24 @@ void bch2_mark_io_failure(struct bch_io_failures *failed,
 	}
 }
 
+/*
+ * Expected cost of a read from @ca: reads already queued on the device have to
+ * complete first, and a device attached to another NUMA node costs more to
+ * DMA to and complete on:
+ */
+static inline u64 dev_read_cost(struct bch_dev *ca)
+{
+	u64 cost = atomic64_read(&ca->cur_latency[READ]);
+
+	cost *= 1 + atomic_read(&ca->reads_in_flight);
+
+	if (ca->numa_node != NUMA_NO_NODE &&
+	    ca->numa_node != numa_node_id())
+		cost += cost >> 1;
+
+	return cost;
+}
+
 /*
  * returns true if p1 is better than p2:
  */
@@ -81,10 +99,10 @@ static inline bool ptr_better(struct bch_fs *c,
 		struct bch_dev *dev1 = bch_dev_bkey_exists(c, p1.ptr.dev);
 		struct bch_dev *dev2 = bch_dev_bkey_exists(c, p2.ptr.dev);
 
-		u64 l1 = atomic64_read(&dev1->cur_latency[READ]);
-		u64 l2 = atomic64_read(&dev2->cur_latency[READ]);
+		u64 l1 = dev_read_cost(dev1);
+		u64 l2 = dev_read_cost(dev2);
 
-		/* Pick at random, biased in favor of the faster device: */
+		/* Pick at random, biased in favor of the cheaper device: */
 
 		return bch2_rand_range(l1 + l2) > l1;
 	}
@@ -363,7 +381,7 @@ enum merge_result bch2_extent_merge(struct bch_fs *c,
 
 			if (crc_l.csum_type &&
 			    crc_l.uncompressed_size +
-			    crc_r.uncompressed_size > c->sb.encoded_extent_max)
+			    crc_r.uncompressed_size > bch2_csum_granularity(c))
 				return BCH_MERGE_NOMERGE;
 
 			if (crc_l.uncompressed_size + crc_r.uncompressed_size >
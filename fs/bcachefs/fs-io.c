@@ -3,10 +3,13 @@
 
 #include "bcachefs.h"
 #include "alloc_foreground.h"
+#include "bcachefs_ioctl.h"
 #include "bkey_buf.h"
 #include "btree_update.h"
 #include "buckets.h"
 #include "clock.h"
+#include "compress.h"
+#include "disk_groups.h"
 #include "error.h"
 #include "extents.h"
 #include "extent_update.h"
@@ -58,6 +61,8 @@ struct quota_res {
 struct bch_writepage_io {
 	struct closure			cl;
 	struct bch_inode_info		*inode;
+	/* bvecs, if too many for the bioset: */
+	struct bio_vec			*bvecs;
 
 	/* must be last: */
 	struct bch_write_op		op;
@@ -72,6 +77,9 @@ struct dio_write {
 					free_iov:1;
 	struct quota_res		quota_res;
 	u64				written;
+	/* range of ei_pagecache_lock held for block: */
+	pgoff_t				pagecache_start;
+	pgoff_t				pagecache_end;
 
 	struct iov_iter			iter;
 	struct iovec			inline_vecs[2];
@@ -122,19 +130,37 @@ static int write_invalidate_inode_pages_range(struct address_space *mapping,
 
 #ifdef CONFIG_BCACHEFS_QUOTA
 
+/*
+ * Quota is reserved in batches of QUOTA_RESERVE_BATCH sectors, which are
+ * cached in the inode (ei_quota_cached, included in ei_quota_reserved) and
+ * handed out to reservations from there - so that we aren't taking the quota
+ * locks, which are shared by the whole filesystem, for every page or write:
+ */
+#define QUOTA_RESERVE_BATCH	1024
+
 static void bch2_quota_reservation_put(struct bch_fs *c,
 				       struct bch_inode_info *inode,
 				       struct quota_res *res)
 {
+	u64 excess;
+
 	if (!res->sectors)
 		return;
 
 	mutex_lock(&inode->ei_quota_lock);
 	BUG_ON(res->sectors > inode->ei_quota_reserved);
 
-	bch2_quota_acct(c, inode->ei_qid, Q_SPC,
-			-((s64) res->sectors), KEY_TYPE_QUOTA_PREALLOC);
-	inode->ei_quota_reserved -= res->sectors;
+	inode->ei_quota_cached += res->sectors;
+
+	excess = inode->ei_quota_cached > QUOTA_RESERVE_BATCH * 2
+		? inode->ei_quota_cached - QUOTA_RESERVE_BATCH
+		: 0;
+	if (excess) {
+		bch2_quota_acct(c, inode->ei_qid, Q_SPC,
+				-((s64) excess), KEY_TYPE_QUOTA_PREALLOC);
+		inode->ei_quota_cached		-= excess;
+		inode->ei_quota_reserved	-= excess;
+	}
 	mutex_unlock(&inode->ei_quota_lock);
 
 	res->sectors = 0;
@@ -146,20 +172,57 @@ static int bch2_quota_reservation_add(struct bch_fs *c,
 				      unsigned sectors,
 				      bool check_enospc)
 {
-	int ret;
+	enum quota_acct_mode mode = check_enospc
+		? KEY_TYPE_QUOTA_PREALLOC : KEY_TYPE_QUOTA_NOCHECK;
+	u64 want;
+	int ret = 0;
 
 	mutex_lock(&inode->ei_quota_lock);
-	ret = bch2_quota_acct(c, inode->ei_qid, Q_SPC, sectors,
-			      check_enospc ? KEY_TYPE_QUOTA_PREALLOC : KEY_TYPE_QUOTA_NOCHECK);
-	if (likely(!ret)) {
-		inode->ei_quota_reserved += sectors;
-		res->sectors += sectors;
+	if (inode->ei_quota_cached < sectors) {
+		want = sectors - inode->ei_quota_cached;
+
+		/* Near the limit, fall back to reserving exactly: */
+		if (!bch2_quota_acct(c, inode->ei_qid, Q_SPC,
+				     want + QUOTA_RESERVE_BATCH, mode))
+			want += QUOTA_RESERVE_BATCH;
+		else
+			ret = bch2_quota_acct(c, inode->ei_qid, Q_SPC,
+					      want, mode);
+		if (unlikely(ret))
+			goto out;
+
+		inode->ei_quota_cached		+= want;
+		inode->ei_quota_reserved	+= want;
 	}
+
+	inode->ei_quota_cached	-= sectors;
+	res->sectors		+= sectors;
+out:
 	mutex_unlock(&inode->ei_quota_lock);
 
 	return ret;
 }
 
+/*
+ * Return quota cached in the inode - when the last writer is done with it
+ * (release, fsync), and before it's freed:
+ */
+void bch2_quota_reservation_flush(struct bch_fs *c,
+				  struct bch_inode_info *inode)
+{
+	mutex_lock(&inode->ei_quota_lock);
+	if (inode->ei_quota_cached) {
+		BUG_ON(inode->ei_quota_cached > inode->ei_quota_reserved);
+
+		bch2_quota_acct(c, inode->ei_qid, Q_SPC,
+				-((s64) inode->ei_quota_cached),
+				KEY_TYPE_QUOTA_PREALLOC);
+		inode->ei_quota_reserved	-= inode->ei_quota_cached;
+		inode->ei_quota_cached		= 0;
+	}
+	mutex_unlock(&inode->ei_quota_lock);
+}
+
 #else
 
 static void bch2_quota_reservation_put(struct bch_fs *c,
@@ -177,6 +240,11 @@ static int bch2_quota_reservation_add(struct bch_fs *c,
 	return 0;
 }
 
+void bch2_quota_reservation_flush(struct bch_fs *c,
+				  struct bch_inode_info *inode)
+{
+}
+
 #endif
 
 /* i_size updates: */
@@ -384,14 +452,13 @@ static void bch2_page_reservation_put(struct bch_fs *c,
 	bch2_quota_reservation_put(c, inode, &res->quota);
 }
 
-static int bch2_page_reservation_get(struct bch_fs *c,
-			struct bch_inode_info *inode, struct page *page,
+static int bch2_page_reservation_count(struct bch_fs *c, struct page *page,
 			struct bch2_page_reservation *res,
-			unsigned offset, unsigned len, bool check_enospc)
+			unsigned offset, unsigned len,
+			unsigned *disk_sectors, unsigned *quota_sectors)
 {
 	struct bch_page_state *s = bch2_page_state_create(page, 0);
-	unsigned i, disk_sectors = 0, quota_sectors = 0;
-	int ret;
+	unsigned i;
 
 	if (!s)
 		return -ENOMEM;
@@ -399,11 +466,22 @@ static int bch2_page_reservation_get(struct bch_fs *c,
 	for (i = round_down(offset, block_bytes(c)) >> 9;
 	     i < round_up(offset + len, block_bytes(c)) >> 9;
 	     i++) {
-		disk_sectors += sectors_to_reserve(&s->s[i],
+		*disk_sectors += sectors_to_reserve(&s->s[i],
 						res->disk.nr_replicas);
-		quota_sectors += s->s[i].state == SECTOR_UNALLOCATED;
+		*quota_sectors += s->s[i].state == SECTOR_UNALLOCATED;
 	}
 
+	return 0;
+}
+
+static int __bch2_page_reservation_get(struct bch_fs *c,
+			struct bch_inode_info *inode,
+			struct bch2_page_reservation *res,
+			unsigned disk_sectors, unsigned quota_sectors,
+			bool check_enospc)
+{
+	int ret;
+
 	if (disk_sectors) {
 		ret = bch2_disk_reservation_add(c, &res->disk,
 						disk_sectors,
@@ -432,6 +510,39 @@ static int bch2_page_reservation_get(struct bch_fs *c,
 	return 0;
 }
 
+static int bch2_page_reservation_get(struct bch_fs *c,
+			struct bch_inode_info *inode, struct page *page,
+			struct bch2_page_reservation *res,
+			unsigned offset, unsigned len, bool check_enospc)
+{
+	unsigned disk_sectors = 0, quota_sectors = 0;
+
+	return  bch2_page_reservation_count(c, page, res, offset, len,
+					    &disk_sectors, &quota_sectors) ?:
+		__bch2_page_reservation_get(c, inode, res, disk_sectors,
+					    quota_sectors, check_enospc);
+}
+
+/*
+ * Move up to *@disk_sectors and *@quota_sectors of reservation from @src to
+ * @dst, decrementing them by what was moved:
+ */
+static void bch2_page_reservation_move(struct bch2_page_reservation *dst,
+			struct bch2_page_reservation *src,
+			unsigned *disk_sectors, unsigned *quota_sectors)
+{
+	unsigned disk = min_t(u64, *disk_sectors, src->disk.sectors);
+	unsigned quota = min_t(u64, *quota_sectors, src->quota.sectors);
+
+	src->disk.sectors	-= disk;
+	dst->disk.sectors	+= disk;
+	*disk_sectors		-= disk;
+
+	src->quota.sectors	-= quota;
+	dst->quota.sectors	+= quota;
+	*quota_sectors		-= quota;
+}
+
 static void bch2_clear_page_bits(struct page *page)
 {
 	struct bch_inode_info *inode = to_bch_ei(page->mapping->host);
@@ -464,7 +575,11 @@ static void bch2_clear_page_bits(struct page *page)
 	bch2_page_state_release(page);
 }
 
-static void bch2_set_page_dirty(struct bch_fs *c,
+/*
+ * Returns the number of newly dirtied sectors, for the caller to account with
+ * i_sectors_acct() - buffered writes do that once for a batch of pages:
+ */
+static unsigned __bch2_set_page_dirty(struct bch_fs *c,
 			struct bch_inode_info *inode, struct page *page,
 			struct bch2_page_reservation *res,
 			unsigned offset, unsigned len)
@@ -500,11 +615,19 @@ static void bch2_set_page_dirty(struct bch_fs *c,
 
 	spin_unlock(&s->lock);
 
-	if (dirty_sectors)
-		i_sectors_acct(c, inode, &res->quota, dirty_sectors);
-
 	if (!PageDirty(page))
 		__set_page_dirty_nobuffers(page);
+
+	return dirty_sectors;
+}
+
+static void bch2_set_page_dirty(struct bch_fs *c,
+			struct bch_inode_info *inode, struct page *page,
+			struct bch2_page_reservation *res,
+			unsigned offset, unsigned len)
+{
+	i_sectors_acct(c, inode, &res->quota,
+		       __bch2_set_page_dirty(c, inode, page, res, offset, len));
 }
 
 vm_fault_t bch2_page_fault(struct vm_fault *vmf)
@@ -518,21 +641,19 @@ vm_fault_t bch2_page_fault(struct vm_fault *vmf)
 	if (fdm == mapping)
 		return VM_FAULT_SIGBUS;
 
-	/* Lock ordering: */
+	/*
+	 * Fault-around and readahead add pages outside the faulting page, so
+	 * this takes the whole file, as in bch2_read_iter().
+	 *
+	 * Lock ordering: we can't wait on our lock while the dio write that
+	 * disabled faults holds fdm's lock - but only the dio write knows which
+	 * range of fdm it has locked, so it does the dropping and retaking:
+	 */
 	if (fdm > mapping) {
-		struct bch_inode_info *fdm_host = to_bch_ei(fdm->host);
-
 		if (bch2_pagecache_add_tryget(&inode->ei_pagecache_lock))
 			goto got_lock;
 
-		bch2_pagecache_block_put(&fdm_host->ei_pagecache_lock);
-
-		bch2_pagecache_add_get(&inode->ei_pagecache_lock);
-		bch2_pagecache_add_put(&inode->ei_pagecache_lock);
-
-		bch2_pagecache_block_get(&fdm_host->ei_pagecache_lock);
-
-		/* Signal that lock has been dropped: */
+		/* Signal that lock has to be dropped: */
 		set_fdm_dropped_locks();
 		return VM_FAULT_SIGBUS;
 	}
@@ -545,6 +666,100 @@ vm_fault_t bch2_page_fault(struct vm_fault *vmf)
 	return ret;
 }
 
+#define MKWRITE_RESERVE_PAGES	16
+
+static unsigned mkwrite_page_sectors(struct bch_fs *c, struct page *page,
+				     loff_t isize)
+{
+	return round_up(min_t(loff_t, PAGE_SIZE, isize - page_offset(page)),
+			block_bytes(c)) >> 9;
+}
+
+static unsigned mkwrite_sectors_to_reserve(struct bch_fs *c,
+					   struct bch_page_state *s,
+					   struct page *page, loff_t isize,
+					   unsigned nr_replicas)
+{
+	unsigned i, sectors = 0, end = mkwrite_page_sectors(c, page, isize);
+
+	for (i = 0; i < end; i++)
+		sectors += sectors_to_reserve(&s->s[i], nr_replicas);
+	return sectors;
+}
+
+/*
+ * Write faults on a range that isn't allocated yet - typically a file being
+ * filled in through mmap - take the disk reservation for the following pages
+ * that are already in the page cache along with the faulting page's. It's
+ * recorded in the page state, so faults on those pages find it there and
+ * don't have to reserve; if the pages are never dirtied it's released when
+ * they're evicted.
+ *
+ * @page is locked; failure isn't an error, the caller reserves for @page as
+ * usual:
+ */
+static void bch2_page_mkwrite_reserve_around(struct bch_fs *c,
+				struct bch_inode_info *inode,
+				struct page *page, loff_t isize)
+{
+	struct page *pages[MKWRITE_RESERVE_PAGES];
+	struct disk_reservation disk_res = { 0 };
+	unsigned nr_replicas = inode_nr_replicas(c, inode);
+	unsigned i, j, nr, sectors = 0;
+	struct bch_page_state *s = bch2_page_state_create(page, 0);
+
+	if (!s || !mkwrite_sectors_to_reserve(c, s, page, isize, nr_replicas))
+		return;
+
+	pages[0] = page;
+	nr = 1 + find_get_pages_contig(page->mapping, page->index + 1,
+				       MKWRITE_RESERVE_PAGES - 1, pages + 1);
+
+	for (i = j = 1; i < nr; i++) {
+		struct page *p = pages[i];
+
+		if (page_offset(p) >= isize ||
+		    !trylock_page(p)) {
+			put_page(p);
+			continue;
+		}
+
+		/* Page state of a page that hasn't been read in isn't valid: */
+		if (p->mapping != page->mapping ||
+		    !PageUptodate(p) ||
+		    !bch2_page_state_create(p, 0)) {
+			unlock_page(p);
+			put_page(p);
+			continue;
+		}
+
+		pages[j++] = p;
+	}
+	nr = j;
+
+	for (i = 0; i < nr; i++)
+		sectors += mkwrite_sectors_to_reserve(c,
+				bch2_page_state(pages[i]), pages[i],
+				isize, nr_replicas);
+
+	if (!bch2_disk_reservation_get(c, &disk_res, sectors, 1, 0))
+		for (i = 0; i < nr; i++) {
+			unsigned k, end = mkwrite_page_sectors(c, pages[i],
+							       isize);
+
+			s = bch2_page_state(pages[i]);
+			for (k = 0; k < end; k++)
+				s->s[k].replicas_reserved +=
+					sectors_to_reserve(&s->s[k],
+							   nr_replicas);
+		}
+
+	for (i = 1; i < nr; i++) {
+		unlock_page(pages[i]);
+		put_page(pages[i]);
+	}
+}
+
 vm_fault_t bch2_page_mkwrite(struct vm_fault *vmf)
 {
 	struct page *page = vmf->page;
@@ -568,7 +783,8 @@ vm_fault_t bch2_page_mkwrite(struct vm_fault *vmf)
 	 * a write_invalidate_inode_pages_range() that works without dropping
 	 * page lock before invalidating page
 	 */
-	bch2_pagecache_add_get(&inode->ei_pagecache_lock);
+	bch2_pagecache_add_get_range(&inode->ei_pagecache_lock,
+				     page->index, page->index);
 
 	lock_page(page);
 	isize = i_size_read(&inode->v);
@@ -581,6 +797,8 @@ vm_fault_t bch2_page_mkwrite(struct vm_fault *vmf)
 
 	len = min_t(loff_t, PAGE_SIZE, isize - page_offset(page));
 
+	bch2_page_mkwrite_reserve_around(c, inode, page, isize);
+
 	if (bch2_page_reservation_get(c, inode, page, &res, 0, len, true)) {
 		unlock_page(page);
 		ret = VM_FAULT_SIGBUS;
@@ -592,7 +810,8 @@ vm_fault_t bch2_page_mkwrite(struct vm_fault *vmf)
 
 	wait_for_stable_page(page);
 out:
-	bch2_pagecache_add_put(&inode->ei_pagecache_lock);
+	bch2_pagecache_add_put_range(&inode->ei_pagecache_lock,
+				     page->index, page->index);
 	sb_end_pagefault(inode->v.i_sb);
 
 	return ret;
@@ -787,70 +1006,138 @@ static void readpage_bio_extend(struct readpages_iter *iter,
 	}
 }
 
-static void bchfs_read(struct btree_trans *trans, struct btree_iter *iter,
-		       struct bch_read_bio *rbio, u64 inum,
-		       struct readpages_iter *readpages_iter)
+/*
+ * Extents for a read are looked up a batch at a time, walking the leaf with
+ * bch2_btree_iter_next_slot() instead of dropping locks and re-seeking for
+ * every extent:
+ */
+#define BCHFS_READ_EXTENTS_BATCH	4
+
+struct bchfs_read_extent {
+	struct bkey_buf		sk;
+	unsigned		offset_into_extent;
+	unsigned		sectors;
+};
+
+static int bchfs_read_lookup_extents(struct btree_trans *trans,
+				     struct btree_iter *iter,
+				     struct bchfs_read_extent *e,
+				     u64 inum, u64 pos, u64 end,
+				     unsigned *nr)
 {
 	struct bch_fs *c = trans->c;
-	struct bkey_buf sk;
-	int flags = BCH_READ_RETRY_IF_STALE|
-		BCH_READ_MAY_PROMOTE;
+	struct bkey_s_c k;
 	int ret = 0;
 
-	rbio->c = c;
-	rbio->start_time = local_clock();
+	*nr = 0;
 
-	bch2_bkey_buf_init(&sk);
-retry:
-	while (1) {
-		struct bkey_s_c k;
-		unsigned bytes, sectors, offset_into_extent;
+	bch2_btree_iter_set_pos(iter, POS(inum, pos));
+	k = bch2_btree_iter_peek_slot(iter);
 
-		bch2_btree_iter_set_pos(iter,
-				POS(inum, rbio->bio.bi_iter.bi_sector));
+	while (1) {
+		u64 k_end;
 
-		k = bch2_btree_iter_peek_slot(iter);
 		ret = bkey_err(k);
-		if (ret)
+		if (ret || !k.k)
 			break;
 
-		offset_into_extent = iter->pos.offset -
-			bkey_start_offset(k.k);
-		sectors = k.k->size - offset_into_extent;
+		k_end = k.k->p.offset;
+
+		e->offset_into_extent = pos - bkey_start_offset(k.k);
+		e->sectors = k.k->size - e->offset_into_extent;
 
-		bch2_bkey_buf_reassemble(&sk, c, k);
+		bch2_bkey_buf_reassemble(&e->sk, c, k);
 
 		ret = bch2_read_indirect_extent(trans,
-					&offset_into_extent, &sk);
+					&e->offset_into_extent, &e->sk);
 		if (ret)
 			break;
 
-		k = bkey_i_to_s_c(sk.k);
+		e->sectors = min(e->sectors,
+				 e->sk.k->k.size - e->offset_into_extent);
+		pos += e->sectors;
+		e++;
 
-		sectors = min(sectors, k.k->size - offset_into_extent);
+		/*
+		 * Stop if the indirect extent didn't cover the rest of this
+		 * key - the next lookup has to start in the middle of it:
+		 */
+		if (++*nr == BCHFS_READ_EXTENTS_BATCH ||
+		    pos != k_end ||
+		    pos >= end)
+			break;
 
-		bch2_trans_unlock(trans);
+		k = bch2_btree_iter_next_slot(iter);
+	}
 
-		if (readpages_iter)
-			readpage_bio_extend(readpages_iter, &rbio->bio, sectors,
-					    extent_partial_reads_expensive(k));
+	/* Keys we already have are still good if we hit an error: */
+	return *nr && ret != -EINTR ? 0 : ret;
+}
 
-		bytes = min(sectors, bio_sectors(&rbio->bio)) << 9;
-		swap(rbio->bio.bi_iter.bi_size, bytes);
+static void bchfs_read(struct btree_trans *trans, struct btree_iter *iter,
+		       struct bch_read_bio *rbio, u64 inum,
+		       struct readpages_iter *readpages_iter)
+{
+	struct bch_fs *c = trans->c;
+	struct bchfs_read_extent e[BCHFS_READ_EXTENTS_BATCH];
+	struct blk_plug plug;
+	u64 end = bio_end_sector(&rbio->bio);
+	unsigned i, nr;
+	int flags = BCH_READ_RETRY_IF_STALE|
+		BCH_READ_MAY_PROMOTE;
+	int ret = 0;
 
-		if (rbio->bio.bi_iter.bi_size == bytes)
-			flags |= BCH_READ_LAST_FRAGMENT;
+	rbio->c = c;
+	rbio->start_time = local_clock();
 
-		if (bkey_extent_is_allocation(k.k))
-			bch2_add_page_sectors(&rbio->bio, k);
+	if (readpages_iter)
+		end = max_t(u64, end,
+			    (u64) (readpages_iter->offset +
+				   readpages_iter->nr_pages) << PAGE_SECTOR_SHIFT);
 
-		bch2_read_extent(trans, rbio, k, offset_into_extent, flags);
+	for (i = 0; i < ARRAY_SIZE(e); i++)
+		bch2_bkey_buf_init(&e[i].sk);
 
-		if (flags & BCH_READ_LAST_FRAGMENT)
+	/*
+	 * Plug so that reads to physically adjacent extents get merged by the
+	 * block layer:
+	 */
+	blk_start_plug(&plug);
+retry:
+	while (!(flags & BCH_READ_LAST_FRAGMENT)) {
+		ret = bchfs_read_lookup_extents(trans, iter, e, inum,
+				rbio->bio.bi_iter.bi_sector, end, &nr);
+		if (ret)
 			break;
 
-		swap(rbio->bio.bi_iter.bi_size, bytes);
-		bio_advance(&rbio->bio, bytes);
+		bch2_trans_unlock(trans);
+
+		for (i = 0; i < nr; i++) {
+			struct bkey_s_c k = bkey_i_to_s_c(e[i].sk.k);
+			unsigned bytes, sectors = e[i].sectors;
+
+			if (readpages_iter)
+				readpage_bio_extend(readpages_iter, &rbio->bio, sectors,
+						    extent_partial_reads_expensive(k));
+
+			bytes = min(sectors, bio_sectors(&rbio->bio)) << 9;
+			swap(rbio->bio.bi_iter.bi_size, bytes);
+
+			if (rbio->bio.bi_iter.bi_size == bytes)
+				flags |= BCH_READ_LAST_FRAGMENT;
+
+			if (bkey_extent_is_allocation(k.k))
+				bch2_add_page_sectors(&rbio->bio, k);
+
+			bch2_read_extent(trans, rbio, k,
+					 e[i].offset_into_extent, flags);
+
+			if (flags & BCH_READ_LAST_FRAGMENT)
+				break;
+
+			swap(rbio->bio.bi_iter.bi_size, bytes);
+			bio_advance(&rbio->bio, bytes);
+		}
 	}
 
 	if (ret == -EINTR)
@@ -863,7 +1150,10 @@ static void bchfs_read(struct btree_trans *trans, struct btree_iter *iter,
 		bio_endio(&rbio->bio);
 	}
 
-	bch2_bkey_buf_exit(&sk, c);
+	blk_finish_plug(&plug);
+
+	for (i = 0; i < ARRAY_SIZE(e); i++)
+		bch2_bkey_buf_exit(&e[i].sk, c);
 }
 
 void bch2_readahead(struct readahead_control *ractl)
@@ -885,7 +1175,10 @@ void bch2_readahead(struct readahead_control *ractl)
 	iter = bch2_trans_get_iter(&trans, BTREE_ID_EXTENTS, POS_MIN,
 				   BTREE_ITER_SLOTS);
 
-	bch2_pagecache_add_get(&inode->ei_pagecache_lock);
+	bch2_pagecache_add_get_range(&inode->ei_pagecache_lock,
+				     readpages_iter.offset,
+				     readpages_iter.offset +
+				     readpages_iter.nr_pages - 1);
 
 	while ((page = readpage_iter_next(&readpages_iter))) {
 		pgoff_t index = readpages_iter.offset + readpages_iter.idx;
@@ -908,7 +1201,10 @@ void bch2_readahead(struct readahead_control *ractl)
 			   &readpages_iter);
 	}
 
-	bch2_pagecache_add_put(&inode->ei_pagecache_lock);
+	bch2_pagecache_add_put_range(&inode->ei_pagecache_lock,
+				     readpages_iter.offset,
+				     readpages_iter.offset +
+				     readpages_iter.nr_pages - 1);
 
 	bch2_trans_exit(&trans);
 	kfree(readpages_iter.pages);
@@ -984,16 +1280,67 @@ static int bch2_read_single_page(struct page *page,
 
 /* writepages: */
 
+/* Map the write lifetime hint (F_SET_RW_HINT) to a write point temperature: */
+static inline enum write_point_temp rw_hint_to_temp(enum rw_hint hint)
+{
+	return hint == WRITE_LIFE_LONG || hint == WRITE_LIFE_EXTREME
+		? WRITE_POINT_COLD
+		: WRITE_POINT_HOT;
+}
+
 struct bch_writepage_state {
 	struct bch_writepage_io	*io;
 	struct bch_io_opts	opts;
+	unsigned		max_sectors;
+	unsigned		align;
 };
 
+/*
+ * Writeback bios are split at multiples of writeback_io_align, else at the
+ * devices' optimal IO size - or bucket size, if we're erasure coding, since
+ * stripes are made of whole buckets - so that sequential writeback lines up
+ * with what's underneath:
+ */
+static unsigned bch2_writeback_io_align(struct bch_fs *c,
+					struct bch_io_opts *opts)
+{
+	const struct bch_devs_mask *devs;
+	struct bch_dev *ca;
+	unsigned d, align = c->opts.writeback_io_align;
+
+	if (!align) {
+		rcu_read_lock();
+		devs = bch2_target_to_mask(c, opts->foreground_target) ?:
+			&c->rw_devs[BCH_DATA_user];
+
+		for_each_set_bit(d, devs->d, BCH_SB_MEMBERS_MAX) {
+			ca = rcu_dereference(c->devs[d]);
+			if (!ca || !ca->disk_sb.bdev)
+				continue;
+
+			align = max_t(unsigned, align,
+				      bdev_io_opt(ca->disk_sb.bdev) >> 9);
+			if (opts->erasure_code)
+				align = max_t(unsigned, align,
+					      ca->mi.bucket_size);
+		}
+		rcu_read_unlock();
+	}
+
+	return align >= PAGE_SECTORS ? rounddown_pow_of_two(align) : 0;
+}
+
 static inline struct bch_writepage_state bch_writepage_state_init(struct bch_fs *c,
 								  struct bch_inode_info *inode)
 {
+	struct bch_io_opts opts = io_opts(c, &inode->ei_inode);
+
 	return (struct bch_writepage_state) {
-		.opts = io_opts(c, &inode->ei_inode)
+		.opts		= opts,
+		.max_sectors	= max_t(unsigned, PAGE_SECTORS,
+					round_down(c->opts.writeback_max_io,
+						   PAGE_SECTORS)),
+		.align		= bch2_writeback_io_align(c, &opts),
 	};
 }
 
@@ -1001,8 +1348,10 @@ static void bch2_writepage_io_free(struct closure *cl)
 {
 	struct bch_writepage_io *io = container_of(cl,
 					struct bch_writepage_io, cl);
+	struct bio_vec *bvecs = io->bvecs;
 
 	bio_put(&io->op.wbio.bio);
+	kfree(bvecs);
 }
 
 static void bch2_writepage_io_done(struct closure *cl)
@@ -1073,10 +1422,46 @@ static void bch2_writepage_io_done(struct closure *cl)
 	closure_return_with_destructor(&io->cl, bch2_writepage_io_free);
 }
 
+static inline struct write_point_specifier
+inode_write_point(struct bch_inode_info *inode, unsigned long v,
+		  enum rw_hint hint)
+{
+	return writepoint_hashed_temp(test_bit(EI_INODE_PREALLOCATED,
+					       &inode->ei_flags)
+				      ? (unsigned long) inode : v,
+				      rw_hint_to_temp(hint));
+}
+
+/*
+ * Have the index update write the inode's current timestamps along with
+ * i_size and i_sectors, so fsync doesn't have to do a second inode update just
+ * for the timestamps:
+ */
+static void bch2_write_op_set_times(struct bch_write_op *op,
+				    struct bch_inode_info *inode)
+{
+	struct bch_fs *c = op->c;
+
+	op->new_mtime = timespec_to_bch2_time(c, inode->v.i_mtime);
+	op->new_ctime = timespec_to_bch2_time(c, inode->v.i_ctime);
+}
+
 static void bch2_writepage_do_io(struct bch_writepage_state *w)
 {
 	struct bch_writepage_io *io = w->io;
 
+	/*
+	 * Small writes from many inodes get packed together, instead of each
+	 * leaving a partially filled bucket on its own write point - unless
+	 * the file was preallocated, then we want its data contiguous:
+	 */
+	if (bio_sectors(&io->op.wbio.bio) <= WRITE_POINT_PERCPU_MAX_SECTORS &&
+	    !test_bit(EI_INODE_PREALLOCATED, &io->inode->ei_flags))
+		io->op.write_point = writepoint_percpu(
+			rw_hint_to_temp(io->inode->v.i_write_hint));
+
+	bch2_write_op_set_times(&io->op, io->inode);
+
 	w->io = NULL;
 	closure_call(&io->op.cl, bch2_write, NULL, &io->cl);
 	continue_at(&io->cl, bch2_writepage_io_done, NULL);
@@ -1094,22 +1479,38 @@ static void bch2_writepage_io_alloc(struct bch_fs *c,
 				    unsigned nr_replicas)
 {
 	struct bch_write_op *op;
+	unsigned nr_vecs = w->max_sectors >> PAGE_SECTOR_SHIFT;
+	struct bio_vec *bvecs = nr_vecs > BIO_MAX_PAGES
+		? kmalloc_array(nr_vecs, sizeof(*bvecs), GFP_NOFS|__GFP_NOWARN)
+		: NULL;
+	struct bio *bio;
+
+	if (!bvecs)
+		nr_vecs = min_t(unsigned, nr_vecs, BIO_MAX_PAGES);
+
+	bio = bio_alloc_bioset(GFP_NOFS, bvecs ? 0 : nr_vecs,
+			       &c->writepage_bioset);
+	if (bvecs) {
+		bio->bi_io_vec		= bvecs;
+		bio->bi_max_vecs	= nr_vecs;
+	}
 
-	w->io = container_of(bio_alloc_bioset(GFP_NOFS,
-					      BIO_MAX_PAGES,
-					      &c->writepage_bioset),
-			     struct bch_writepage_io, op.wbio.bio);
+	w->io = container_of(bio, struct bch_writepage_io, op.wbio.bio);
 
 	closure_init(&w->io->cl, NULL);
 	w->io->inode		= inode;
+	w->io->bvecs		= bvecs;
 
 	op			= &w->io->op;
 	bch2_write_op_init(op, c, w->opts);
 	op->target		= w->opts.foreground_target;
 	op_journal_seq_set(op, &inode->ei_journal_seq);
+	op->acks_pending	= &inode->ei_write_acks_pending;
 	op->nr_replicas		= nr_replicas;
 	op->res.nr_replicas	= nr_replicas;
-	op->write_point		= writepoint_hashed(inode->ei_last_dirtied);
+	op->write_point		= inode_write_point(inode,
+						inode->ei_last_dirtied,
+						inode->v.i_write_hint);
 	op->pos			= POS(inode->v.i_ino, sector);
 	op->wbio.bio.bi_iter.bi_sector = sector;
 	op->wbio.bio.bi_opf	= wbc_to_write_flags(wbc);
@@ -1218,8 +1619,9 @@ static int __bch2_writepage(struct page *page,
 		if (w->io &&
 		    (w->io->op.res.nr_replicas != nr_replicas_this_write ||
 		     bio_full(&w->io->op.wbio.bio, PAGE_SIZE) ||
-		     w->io->op.wbio.bio.bi_iter.bi_size + (sectors << 9) >=
-		     (BIO_MAX_PAGES * PAGE_SIZE) ||
+		     bio_sectors(&w->io->op.wbio.bio) + sectors >
+		     w->max_sectors ||
+		     (w->align && !(sector & (w->align - 1))) ||
 		     bio_end_sector(&w->io->op.wbio.bio) != sector))
 			bch2_writepage_do_io(w);
 
@@ -1301,7 +1703,7 @@ int bch2_write_begin(struct file *file, struct address_space *mapping,
 	bch2_page_reservation_init(c, inode, res);
 	*fsdata = res;
 
-	bch2_pagecache_add_get(&inode->ei_pagecache_lock);
+	bch2_pagecache_add_get_range(&inode->ei_pagecache_lock, index, index);
 
 	page = grab_cache_page_write_begin(mapping, index, flags);
 	if (!page)
@@ -1353,7 +1755,7 @@ int bch2_write_begin(struct file *file, struct address_space *mapping,
 	put_page(page);
 	*pagep = NULL;
 err_unlock:
-	bch2_pagecache_add_put(&inode->ei_pagecache_lock);
+	bch2_pagecache_add_put_range(&inode->ei_pagecache_lock, index, index);
 	kfree(res);
 	*fsdata = NULL;
 	return ret;
@@ -1397,7 +1799,8 @@ int bch2_write_end(struct file *file, struct address_space *mapping,
 
 	unlock_page(page);
 	put_page(page);
-	bch2_pagecache_add_put(&inode->ei_pagecache_lock);
+	bch2_pagecache_add_put_range(&inode->ei_pagecache_lock,
+				     pos >> PAGE_SHIFT, pos >> PAGE_SHIFT);
 
 	bch2_page_reservation_put(c, inode, res);
 	kfree(res);
@@ -1406,11 +1809,34 @@ int bch2_write_end(struct file *file, struct address_space *mapping,
 }
 
 #define WRITE_BATCH_PAGES	32
+#define WRITE_RESERVE_SECTORS	(16U << (20 - 9))
+
+/*
+ * Like grab_cache_page_write_begin(), for IOCB_NOWAIT: doesn't wait on the page
+ * lock, and doesn't return pages under writeback since we might have to wait
+ * for them to be stable:
+ */
+static struct page *grab_cache_page_write_begin_nowait(struct address_space *mapping,
+						       pgoff_t index)
+{
+	struct page *page = pagecache_get_page(mapping, index,
+				FGP_LOCK|FGP_WRITE|FGP_CREAT|FGP_NOWAIT,
+				mapping_gfp_mask(mapping));
+
+	if (page && PageWriteback(page)) {
+		unlock_page(page);
+		put_page(page);
+		page = NULL;
+	}
+
+	return page;
+}
 
 static int __bch2_buffered_write(struct bch_inode_info *inode,
 				 struct address_space *mapping,
 				 struct iov_iter *iter,
-				 loff_t pos, unsigned len)
+				 struct bch2_page_reservation *pool,
+				 loff_t pos, unsigned len, bool nowait)
 {
 	struct bch_fs *c = inode->v.i_sb->s_fs_info;
 	struct page *pages[WRITE_BATCH_PAGES];
@@ -1419,7 +1845,8 @@ static int __bch2_buffered_write(struct bch_inode_info *inode,
 	unsigned offset = pos & (PAGE_SIZE - 1);
 	unsigned nr_pages = DIV_ROUND_UP(offset + len, PAGE_SIZE);
 	unsigned i, reserved = 0, set_dirty = 0;
-	unsigned copied = 0, nr_pages_copied = 0;
+	unsigned copied = 0;
+	unsigned disk_sectors = 0, quota_sectors = 0, dirty_sectors = 0;
 	int ret = 0;
 
 	BUG_ON(!len);
@@ -1428,11 +1855,13 @@ static int __bch2_buffered_write(struct bch_inode_info *inode,
 	bch2_page_reservation_init(c, inode, &res);
 
 	for (i = 0; i < nr_pages; i++) {
-		pages[i] = grab_cache_page_write_begin(mapping, index + i, 0);
+		pages[i] = !nowait
+			? grab_cache_page_write_begin(mapping, index + i, 0)
+			: grab_cache_page_write_begin_nowait(mapping, index + i);
 		if (!pages[i]) {
 			nr_pages = i;
 			if (!i) {
-				ret = -ENOMEM;
+				ret = nowait ? -EAGAIN : -ENOMEM;
 				goto out;
 			}
 			len = min_t(unsigned, len,
@@ -1442,7 +1871,9 @@ static int __bch2_buffered_write(struct bch_inode_info *inode,
 	}
 
 	if (offset && !PageUptodate(pages[0])) {
-		ret = bch2_read_single_page(pages[0], mapping);
+		ret = !nowait
+			? bch2_read_single_page(pages[0], mapping)
+			: -EAGAIN;
 		if (ret)
 			goto out;
 	}
@@ -1452,12 +1883,45 @@ static int __bch2_buffered_write(struct bch_inode_info *inode,
 		if ((index + nr_pages - 1) << PAGE_SHIFT >= inode->v.i_size) {
 			zero_user(pages[nr_pages - 1], 0, PAGE_SIZE);
 		} else {
-			ret = bch2_read_single_page(pages[nr_pages - 1], mapping);
+			ret = !nowait
+				? bch2_read_single_page(pages[nr_pages - 1], mapping)
+				: -EAGAIN;
 			if (ret)
 				goto out;
 		}
 	}
 
+	/*
+	 * Try to take the disk and quota reservations for the whole write at
+	 * once - quota accounting takes a lock per quota type that's shared by
+	 * the whole filesystem, which we don't want to be doing per page. If
+	 * that fails, fall back to reserving page by page, reading in pages
+	 * that aren't uptodate:
+	 */
+	while (!ret && reserved < len) {
+		struct page *page = pages[(offset + reserved) >> PAGE_SHIFT];
+		unsigned pg_offset = (offset + reserved) & (PAGE_SIZE - 1);
+		unsigned pg_len = min_t(unsigned, len - reserved,
+					PAGE_SIZE - pg_offset);
+
+		ret = bch2_page_reservation_count(c, page, &res,
+					pg_offset, pg_len,
+					&disk_sectors, &quota_sectors);
+		reserved += pg_len;
+	}
+
+	if (!ret)
+		bch2_page_reservation_move(&res, pool,
+					   &disk_sectors, &quota_sectors);
+
+	ret = ret ?: __bch2_page_reservation_get(c, inode, &res, disk_sectors,
+						 quota_sectors, true);
+	if (ret) {
+		/* Don't sit on space the page by page path might need: */
+		bch2_page_reservation_put(c, inode, pool);
+		reserved = 0;
+	}
+
 	while (reserved < len) {
 		struct page *page = pages[(offset + reserved) >> PAGE_SHIFT];
 		unsigned pg_offset = (offset + reserved) & (PAGE_SIZE - 1);
@@ -1467,7 +1931,7 @@ static int __bch2_buffered_write(struct bch_inode_info *inode,
 		ret = bch2_page_reservation_get(c, inode, page, &res,
 						pg_offset, pg_len, true);
 
-		if (ret && !PageUptodate(page)) {
+		if (ret && !PageUptodate(page) && !nowait) {
 			ret = bch2_read_single_page(page, mapping);
 			if (!ret)
 				goto retry_reservation;
@@ -1526,41 +1990,80 @@ static int __bch2_buffered_write(struct bch_inode_info *inode,
 		if (!PageUptodate(page))
 			SetPageUptodate(page);
 
-		bch2_set_page_dirty(c, inode, page, &res, pg_offset, pg_len);
-		unlock_page(page);
-		put_page(page);
-
+		dirty_sectors += __bch2_set_page_dirty(c, inode, page, &res,
+						       pg_offset, pg_len);
 		set_dirty += pg_len;
 	}
 
-	nr_pages_copied = DIV_ROUND_UP(offset + copied, PAGE_SIZE);
+	/* Account i_sectors once for the whole batch, before unlocking: */
+	i_sectors_acct(c, inode, &res.quota, dirty_sectors);
+
 	inode->ei_last_dirtied = (unsigned long) current;
 out:
-	for (i = nr_pages_copied; i < nr_pages; i++) {
+	for (i = 0; i < nr_pages; i++) {
 		unlock_page(pages[i]);
 		put_page(pages[i]);
 	}
 
-	bch2_page_reservation_put(c, inode, &res);
+	/* Unused reservation goes back to the pool for the next batch: */
+	disk_sectors = quota_sectors = UINT_MAX;
+	bch2_page_reservation_move(pool, &res, &disk_sectors, &quota_sectors);
 
 	return copied ?: ret;
 }
 
+/*
+ * Large writes reserve disk space and quota for many batches at once, instead
+ * of going to the percpu counters (and the quota lock) on every batch - the
+ * batches take what they need out of the pool, and whatever's left over is
+ * released at the end. Failure isn't an error here, we just fall back to
+ * reserving per batch:
+ */
+static void bch2_buffered_write_reserve(struct bch_fs *c,
+					struct bch_inode_info *inode,
+					struct bch2_page_reservation *pool,
+					size_t bytes)
+{
+	unsigned sectors = min_t(size_t, round_up(bytes, block_bytes(c)) >> 9,
+				 WRITE_RESERVE_SECTORS);
+
+	__bch2_page_reservation_get(c, inode, pool,
+				    sectors * pool->disk.nr_replicas,
+				    sectors, true);
+}
+
 static ssize_t bch2_buffered_write(struct kiocb *iocb, struct iov_iter *iter)
 {
 	struct file *file = iocb->ki_filp;
 	struct address_space *mapping = file->f_mapping;
 	struct bch_inode_info *inode = file_bch_inode(file);
+	struct bch_fs *c = inode->v.i_sb->s_fs_info;
+	bool nowait = iocb->ki_flags & IOCB_NOWAIT;
 	loff_t pos = iocb->ki_pos;
+	pgoff_t start = pos >> PAGE_SHIFT;
+	pgoff_t end = (pos + iov_iter_count(iter) - 1) >> PAGE_SHIFT;
+	struct bch2_page_reservation pool;
 	ssize_t written = 0;
 	int ret = 0;
 
-	bch2_pagecache_add_get(&inode->ei_pagecache_lock);
+	if (!nowait)
+		bch2_pagecache_add_get_range(&inode->ei_pagecache_lock,
+					     start, end);
+	else if (!bch2_pagecache_add_tryget_range(&inode->ei_pagecache_lock,
+						  start, end))
+		return -EAGAIN;
+
+	bch2_page_reservation_init(c, inode, &pool);
 
 	do {
 		unsigned offset = pos & (PAGE_SIZE - 1);
 		unsigned bytes = min_t(unsigned long, iov_iter_count(iter),
 			      PAGE_SIZE * WRITE_BATCH_PAGES - offset);
+
+		if (!pool.disk.sectors &&
+		    iov_iter_count(iter) > PAGE_SIZE * WRITE_BATCH_PAGES)
+			bch2_buffered_write_reserve(c, inode, &pool,
+						    iov_iter_count(iter));
 again:
 		/*
 		 * Bring in the user page that we will copy from _first_.
@@ -1587,7 +2090,8 @@ static ssize_t bch2_buffered_write(struct kiocb *iocb, struct iov_iter *iter)
 			break;
 		}
 
-		ret = __bch2_buffered_write(inode, mapping, iter, pos, bytes);
+		ret = __bch2_buffered_write(inode, mapping, iter, &pool,
+					    pos, bytes, nowait);
 		if (unlikely(ret < 0))
 			break;
 
@@ -1613,7 +2117,8 @@ static ssize_t bch2_buffered_write(struct kiocb *iocb, struct iov_iter *iter)
 		balance_dirty_pages_ratelimited(mapping);
 	} while (iov_iter_count(iter));
 
-	bch2_pagecache_add_put(&inode->ei_pagecache_lock);
+	bch2_page_reservation_put(c, inode, &pool);
+	bch2_pagecache_add_put_range(&inode->ei_pagecache_lock, start, end);
 
 	return written ? written : ret;
 }
@@ -1772,6 +2277,11 @@ ssize_t bch2_read_iter(struct kiocb *iocb, struct iov_iter *iter)
 	if (iocb->ki_flags & IOCB_DIRECT) {
 		struct blk_plug plug;
 
+		if ((iocb->ki_flags & IOCB_NOWAIT) &&
+		    filemap_range_has_page(mapping, iocb->ki_pos,
+					   iocb->ki_pos + count - 1))
+			return -EAGAIN;
+
 		ret = filemap_write_and_wait_range(mapping,
 					iocb->ki_pos,
 					iocb->ki_pos + count - 1);
@@ -1787,7 +2297,17 @@ ssize_t bch2_read_iter(struct kiocb *iocb, struct iov_iter *iter)
 		if (ret >= 0)
 			iocb->ki_pos += ret;
 	} else {
-		bch2_pagecache_add_get(&inode->ei_pagecache_lock);
+		/*
+		 * Readahead adds pages outside the range we're reading, and
+		 * takes their stripes with pages locked - so lock the whole
+		 * file, else a dio write holding those stripes and waiting on
+		 * the pages would deadlock with us:
+		 */
+		if (!(iocb->ki_flags & IOCB_NOWAIT))
+			bch2_pagecache_add_get(&inode->ei_pagecache_lock);
+		else if (!bch2_pagecache_add_tryget(&inode->ei_pagecache_lock))
+			return -EAGAIN;
+
 		ret = generic_file_read_iter(iocb, iter);
 		bch2_pagecache_add_put(&inode->ei_pagecache_lock);
 	}
@@ -1829,13 +2349,27 @@ static long bch2_dio_write_loop(struct dio_write *dio)
 		dropped_locks = fdm_dropped_locks();
 
 		current->faults_disabled_mapping = NULL;
-		if (kthread)
-			kthread_unuse_mm(dio->mm);
+
+		/*
+		 * The fault handler couldn't take the lock for the page cache
+		 * our buffer is mapped from without waiting while we hold our
+		 * own lock: drop it, fault the buffer in and retake it:
+		 */
+		if (unlikely(dropped_locks)) {
+			bch2_pagecache_block_put_range(&inode->ei_pagecache_lock,
+					dio->pagecache_start, dio->pagecache_end);
+			iov_iter_fault_in_readable(&dio->iter, dio->iter.count);
+			bch2_pagecache_block_get_range(&inode->ei_pagecache_lock,
+					dio->pagecache_start, dio->pagecache_end);
+		}
+
+		if (kthread)
+			kthread_unuse_mm(dio->mm);
 
 		/*
 		 * If the fault handler returned an error but also signalled
-		 * that it dropped & retook ei_pagecache_lock, we just need to
-		 * re-shoot down the page cache and retry:
+		 * that we had to drop & retake ei_pagecache_lock, we just need
+		 * to re-shoot down the page cache and retry:
 		 */
 		if (dropped_locks && ret)
 			ret = 0;
@@ -1873,9 +2407,15 @@ static long bch2_dio_write_loop(struct dio_write *dio)
 		dio->op.end_io		= bch2_dio_write_loop_async;
 		dio->op.target		= dio->op.opts.foreground_target;
 		op_journal_seq_set(&dio->op, &inode->ei_journal_seq);
-		dio->op.write_point	= writepoint_hashed((unsigned long) current);
+		dio->op.acks_pending	= &inode->ei_write_acks_pending;
+		dio->op.write_point	= bio_sectors(bio) <= WRITE_POINT_PERCPU_MAX_SECTORS &&
+			!test_bit(EI_INODE_PREALLOCATED, &inode->ei_flags)
+			? writepoint_percpu(rw_hint_to_temp(req->ki_hint))
+			: inode_write_point(inode, (unsigned long) current,
+					    req->ki_hint);
 		dio->op.nr_replicas	= dio->op.opts.data_replicas;
 		dio->op.pos		= POS(inode->v.i_ino, (u64) req->ki_pos >> 9);
+		bch2_write_op_set_times(&dio->op, inode);
 
 		if ((req->ki_flags & IOCB_DSYNC) &&
 		    !c->opts.journal_flush_disabled)
@@ -1945,7 +2485,8 @@ static long bch2_dio_write_loop(struct dio_write *dio)
 
 	ret = dio->op.error ?: ((long) dio->written << 9);
 err:
-	bch2_pagecache_block_put(&inode->ei_pagecache_lock);
+	bch2_pagecache_block_put_range(&inode->ei_pagecache_lock,
+				       dio->pagecache_start, dio->pagecache_end);
 	bch2_quota_reservation_put(c, inode, &dio->quota_res);
 
 	if (dio->free_iov)
@@ -1973,6 +2514,80 @@ static void bch2_dio_write_loop_async(struct bch_write_op *op)
 		bch2_dio_write_loop(dio);
 }
 
+/*
+ * If removing privileges or updating times is going to require an inode
+ * update, we can't do it without blocking - S_NOSEC gets set the first time
+ * file_remove_privs() finds nothing to do:
+ */
+static int bch2_write_check_nowait(struct kiocb *iocb)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	struct timespec64 now;
+
+	if (!(iocb->ki_flags & IOCB_NOWAIT))
+		return 0;
+
+	if (!IS_NOSEC(inode))
+		return -EAGAIN;
+
+	if (IS_NOCMTIME(inode))
+		return 0;
+
+	now = current_time(inode);
+	if (!timespec64_equal(&inode->i_mtime, &now) ||
+	    !timespec64_equal(&inode->i_ctime, &now))
+		return -EAGAIN;
+
+	return 0;
+}
+
+static void bch2_truncate_wait(struct bch_inode_info *inode)
+{
+	wait_on_bit(&inode->ei_flags, EI_INODE_TRUNCATING,
+		    TASK_UNINTERRUPTIBLE);
+}
+
+/* Writes past i_size have to wait for a background truncate to finish: */
+static int bch2_write_truncate_wait(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct bch_inode_info *inode = file_bch_inode(iocb->ki_filp);
+
+	if (likely(!test_bit(EI_INODE_TRUNCATING, &inode->ei_flags)) ||
+	    iocb->ki_pos + iov_iter_count(from) <= inode->v.i_size)
+		return 0;
+
+	if (iocb->ki_flags & IOCB_NOWAIT)
+		return -EAGAIN;
+
+	bch2_truncate_wait(inode);
+	return 0;
+}
+
+/*
+ * Non extending, block aligned overwrites can run under the shared inode lock:
+ * i_size can't change underneath us, and the extent updates are atomic btree
+ * transactions, so all we need the inode lock for is to exclude truncate and
+ * fallocate:
+ */
+static bool bch2_dio_write_can_share(struct kiocb *req, struct iov_iter *iter)
+{
+	struct bch_inode_info *inode = file_bch_inode(req->ki_filp);
+	struct bch_fs *c = inode->v.i_sb->s_fs_info;
+
+	return !(req->ki_flags & IOCB_APPEND) &&
+		IS_NOSEC(&inode->v) &&
+		!((req->ki_pos|iov_iter_count(iter)) & (block_bytes(c) - 1)) &&
+		req->ki_pos + iov_iter_count(iter) <= i_size_read(&inode->v);
+}
+
+static void bch2_dio_write_unlock(struct bch_inode_info *inode, bool shared)
+{
+	if (shared)
+		inode_unlock_shared(&inode->v);
+	else
+		inode_unlock(&inode->v);
+}
+
 static noinline
 ssize_t bch2_direct_write(struct kiocb *req, struct iov_iter *iter)
 {
@@ -1982,7 +2597,8 @@ ssize_t bch2_direct_write(struct kiocb *req, struct iov_iter *iter)
 	struct bch_fs *c = inode->v.i_sb->s_fs_info;
 	struct dio_write *dio;
 	struct bio *bio;
-	bool locked = true, extending;
+	pgoff_t start, end;
+	bool locked = true, extending, shared;
 	ssize_t ret;
 
 	prefetch(&c->opts);
@@ -1990,12 +2606,43 @@ ssize_t bch2_direct_write(struct kiocb *req, struct iov_iter *iter)
 	prefetch(&inode->ei_inode);
 	prefetch((void *) &inode->ei_inode + 64);
 
-	inode_lock(&inode->v);
+	shared = bch2_dio_write_can_share(req, iter);
+retry:
+	if (shared) {
+		if (!(req->ki_flags & IOCB_NOWAIT))
+			inode_lock_shared(&inode->v);
+		else if (!inode_trylock_shared(&inode->v))
+			return -EAGAIN;
+	} else {
+		if (!(req->ki_flags & IOCB_NOWAIT))
+			inode_lock(&inode->v);
+		else if (!inode_trylock(&inode->v))
+			return -EAGAIN;
+	}
 
 	ret = generic_write_checks(req, iter);
 	if (unlikely(ret <= 0))
 		goto err;
 
+	/* Recheck now that i_size is stable: */
+	if (shared && !bch2_dio_write_can_share(req, iter)) {
+		inode_unlock_shared(&inode->v);
+		shared = false;
+		goto retry;
+	}
+
+	ret = bch2_write_check_nowait(req) ?:
+		bch2_write_truncate_wait(req, iter);
+	if (unlikely(ret))
+		goto err;
+
+	if ((req->ki_flags & IOCB_NOWAIT) &&
+	    filemap_range_has_page(mapping, req->ki_pos,
+				   req->ki_pos + iter->count - 1)) {
+		ret = -EAGAIN;
+		goto err;
+	}
+
 	ret = file_remove_privs(file);
 	if (unlikely(ret))
 		goto err;
@@ -2007,12 +2654,15 @@ ssize_t bch2_direct_write(struct kiocb *req, struct iov_iter *iter)
 	if (unlikely((req->ki_pos|iter->count) & (block_bytes(c) - 1)))
 		goto err;
 
+	start	= req->ki_pos >> PAGE_SHIFT;
+	end	= (req->ki_pos + iter->count - 1) >> PAGE_SHIFT;
+
 	inode_dio_begin(&inode->v);
-	bch2_pagecache_block_get(&inode->ei_pagecache_lock);
+	bch2_pagecache_block_get_range(&inode->ei_pagecache_lock, start, end);
 
 	extending = req->ki_pos + iter->count > inode->v.i_size;
 	if (!extending) {
-		inode_unlock(&inode->v);
+		bch2_dio_write_unlock(inode, shared);
 		locked = false;
 	}
 
@@ -2028,6 +2678,8 @@ ssize_t bch2_direct_write(struct kiocb *req, struct iov_iter *iter)
 	dio->free_iov		= false;
 	dio->quota_res.sectors	= 0;
 	dio->written		= 0;
+	dio->pagecache_start	= start;
+	dio->pagecache_end	= end;
 	dio->iter		= *iter;
 
 	ret = bch2_quota_reservation_add(c, inode, &dio->quota_res,
@@ -2044,10 +2696,10 @@ ssize_t bch2_direct_write(struct kiocb *req, struct iov_iter *iter)
 	ret = bch2_dio_write_loop(dio);
 err:
 	if (locked)
-		inode_unlock(&inode->v);
+		bch2_dio_write_unlock(inode, shared);
 	return ret;
 err_put_bio:
-	bch2_pagecache_block_put(&inode->ei_pagecache_lock);
+	bch2_pagecache_block_put_range(&inode->ei_pagecache_lock, start, end);
 	bch2_quota_reservation_put(c, inode, &dio->quota_res);
 	bio_put(bio);
 	inode_dio_end(&inode->v);
@@ -2063,14 +2715,23 @@ ssize_t bch2_write_iter(struct kiocb *iocb, struct iov_iter *from)
 	if (iocb->ki_flags & IOCB_DIRECT)
 		return bch2_direct_write(iocb, from);
 
+	if (!(iocb->ki_flags & IOCB_NOWAIT))
+		inode_lock(&inode->v);
+	else if (!inode_trylock(&inode->v))
+		return -EAGAIN;
+
 	/* We can write back this queue in page reclaim */
 	current->backing_dev_info = inode_to_bdi(&inode->v);
-	inode_lock(&inode->v);
 
 	ret = generic_write_checks(iocb, from);
 	if (ret <= 0)
 		goto unlock;
 
+	ret = bch2_write_check_nowait(iocb) ?:
+		bch2_write_truncate_wait(iocb, from);
+	if (ret)
+		goto unlock;
+
 	ret = file_remove_privs(file);
 	if (ret)
 		goto unlock;
@@ -2092,18 +2753,397 @@ ssize_t bch2_write_iter(struct kiocb *iocb, struct iov_iter *from)
 	return ret;
 }
 
+/* encoded extents: */
+
+int bch2_encoded_read(struct file *file, struct bch_ioctl_encoded_extent *arg)
+{
+	struct bch_inode_info *inode = file_bch_inode(file);
+	struct bch_fs *c = inode->v.i_sb->s_fs_info;
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct bkey_buf sk;
+	struct bkey_s_c k;
+	struct bkey_ptrs_c ptrs;
+	const union bch_extent_entry *entry;
+	struct extent_ptr_decoded p;
+	struct bch_extent_crc_unpacked crc;
+	struct bch_read_bio *rbio;
+	struct bvec_iter_all bv_iter;
+	struct bio_vec *bv;
+	char __user *dst;
+	unsigned sectors, bytes;
+	int ret;
+	DECLARE_COMPLETION_ONSTACK(done);
+
+	/* Dirty data in the page cache isn't in the extents btree yet: */
+	ret = filemap_write_and_wait(inode->v.i_mapping);
+	if (ret)
+		return ret;
+
+	bch2_bkey_buf_init(&sk);
+	bch2_trans_init(&trans, c, 0, 0);
+retry:
+	bch2_trans_begin(&trans);
+
+	iter = bch2_trans_get_iter(&trans, BTREE_ID_EXTENTS,
+				   POS(inode->v.i_ino, arg->offset), 0);
+
+	for_each_btree_key_continue(iter, 0, k, ret)
+		if (k.k->p.inode != inode->v.i_ino ||
+		    bkey_extent_is_data(k.k))
+			break;
+	if (ret)
+		goto err;
+
+	if (!k.k || k.k->p.inode != inode->v.i_ino) {
+		arg->size = 0;
+		goto err;
+	}
+
+	/* Reflinked and inline data extents aren't supported: */
+	if (k.k->type != KEY_TYPE_extent) {
+		ret = -EOPNOTSUPP;
+		goto err;
+	}
+
+	sectors = 0;
+	ptrs = bch2_bkey_ptrs_c(k);
+	bkey_for_each_ptr_decode(k.k, ptrs, p, entry) {
+		if (bch2_csum_type_is_encryption(p.crc.csum_type)) {
+			ret = -EOPNOTSUPP;
+			goto err;
+		}
+
+		sectors = max_t(unsigned, sectors, p.crc.compressed_size);
+	}
+
+	/* unlock before allocating and doing IO: */
+	bch2_bkey_buf_reassemble(&sk, c, k);
+	k = bkey_i_to_s_c(sk.k);
+	bch2_trans_unlock(&trans);
+
+	rbio = rbio_init(bio_alloc_bioset(GFP_KERNEL,
+					  DIV_ROUND_UP(sectors, PAGE_SECTORS),
+					  &c->bio_read),
+			 io_opts(c, &inode->ei_inode));
+	rbio->c			= c;
+	rbio->start_time	= local_clock();
+	rbio->bio.bi_private	= &done;
+	rbio->bio.bi_end_io	= bch2_read_single_page_end_io;
+	rbio->bio.bi_iter.bi_sector = bkey_start_offset(k.k);
+	bio_set_op_attrs(&rbio->bio, REQ_OP_READ, 0);
+
+	if (bch2_bio_alloc_pages(&rbio->bio, sectors << 9, GFP_KERNEL)) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	reinit_completion(&done);
+	bch2_read_extent(&trans, rbio, k, 0,
+			 BCH_READ_NODECODE|BCH_READ_LAST_FRAGMENT);
+	wait_for_completion(&done);
+
+	ret = blk_status_to_errno(rbio->bio.bi_status);
+	if (ret)
+		goto out;
+
+	/* The extent was overwritten while we were retrying the read: */
+	if (rbio->hole) {
+		bio_free_pages(&rbio->bio);
+		bio_put(&rbio->bio);
+		goto retry;
+	}
+
+	crc = rbio->pick.crc;
+
+	arg->offset		= bkey_start_offset(k.k);
+	arg->size		= k.k->size;
+	arg->crc_offset		= crc.offset;
+	arg->compressed_size	= crc.compressed_size;
+	arg->uncompressed_size	= crc.uncompressed_size;
+	arg->compression_type	= crc.compression_type;
+	arg->csum_type		= crc.csum_type;
+	arg->csum[0]		= (__force __u64) crc.csum.lo;
+	arg->csum[1]		= (__force __u64) crc.csum.hi;
+
+	bytes = crc.compressed_size << 9;
+	if (arg->buf_len < bytes) {
+		ret = -E2BIG;
+		goto out;
+	}
+
+	/* No btree locks held, so faulting in @buf is safe: */
+	dst = (void __user *)(unsigned long) arg->buf;
+
+	bio_for_each_segment_all(bv, &rbio->bio, bv_iter) {
+		unsigned len = min(bv->bv_len, bytes);
+
+		if (!len)
+			break;
+
+		if (copy_to_user(dst, page_address(bv->bv_page) +
+				 bv->bv_offset, len)) {
+			ret = -EFAULT;
+			break;
+		}
+
+		dst	+= len;
+		bytes	-= len;
+	}
+out:
+	bio_free_pages(&rbio->bio);
+	bio_put(&rbio->bio);
+err:
+	if (ret == -EINTR)
+		goto retry;
+
+	bch2_trans_exit(&trans);
+	bch2_bkey_buf_exit(&sk, c);
+	return ret;
+}
+
+struct encoded_write {
+	struct completion	done;
+	struct quota_res	quota_res;
+	/* Must be last since it is variable size */
+	struct bch_write_op	op;
+	struct bio_vec		bi_inline_vecs[0];
+};
+
+static void bch2_encoded_write_done(struct bch_write_op *op)
+{
+	struct encoded_write *w = container_of(op, struct encoded_write, op);
+
+	complete(&w->done);
+}
+
+/*
+ * We're going to be writing compressed data the filesystem may not have had
+ * before, so the superblock has to say so - the decompressor won't be set up
+ * otherwise:
+ */
+static int bch2_encoded_check_compression(struct bch_fs *c, unsigned type)
+{
+	switch (type) {
+	case BCH_COMPRESSION_TYPE_none:
+	case BCH_COMPRESSION_TYPE_incompressible:
+		return 0;
+	case BCH_COMPRESSION_TYPE_lz4:
+		return bch2_check_set_has_compressed_data(c,
+					BCH_COMPRESSION_OPT_lz4);
+	case BCH_COMPRESSION_TYPE_gzip:
+		return bch2_check_set_has_compressed_data(c,
+					BCH_COMPRESSION_OPT_gzip);
+	case BCH_COMPRESSION_TYPE_zstd:
+		return bch2_check_set_has_compressed_data(c,
+					BCH_COMPRESSION_OPT_zstd);
+	default:
+		return -EINVAL;
+	}
+}
+
+int bch2_encoded_write(struct file *file, struct bch_ioctl_encoded_extent *arg)
+{
+	struct address_space *mapping = file->f_mapping;
+	struct bch_inode_info *inode = file_bch_inode(file);
+	struct bch_fs *c = inode->v.i_sb->s_fs_info;
+	struct bch_io_opts opts = io_opts(c, &inode->ei_inode);
+	struct bch_extent_crc_unpacked crc = { 0 };
+	struct encoded_write *w;
+	struct bio *bio;
+	struct bvec_iter_all bv_iter;
+	struct bio_vec *bv;
+	struct bch_csum csum;
+	char __user *src;
+	unsigned pages, bytes;
+	u64 start = arg->offset << 9, end = start + ((u64) arg->size << 9);
+	pgoff_t pagecache_start = start >> PAGE_SHIFT;
+	pgoff_t pagecache_end = (end - 1) >> PAGE_SHIFT;
+	int ret;
+
+	crc.compressed_size	= arg->compressed_size;
+	crc.uncompressed_size	= arg->uncompressed_size;
+	crc.offset		= arg->crc_offset;
+	crc.live_size		= arg->size;
+	crc.compression_type	= arg->compression_type;
+	crc.csum_type		= arg->csum_type;
+	crc.csum.lo		= (__force __le64) arg->csum[0];
+	crc.csum.hi		= (__force __le64) arg->csum[1];
+
+	if (arg->pad ||
+	    arg->csum_type >= BCH_CSUM_NR ||
+	    bch2_csum_type_is_encryption(arg->csum_type) ||
+	    !arg->size ||
+	    !arg->compressed_size ||
+	    (u64) arg->crc_offset + arg->size > arg->uncompressed_size ||
+	    arg->uncompressed_size > c->sb.encoded_extent_max ||
+	    arg->compressed_size > arg->uncompressed_size ||
+	    (!crc_is_compressed(crc) &&
+	     arg->compressed_size != arg->uncompressed_size) ||
+	    (u64) arg->compressed_size << 9 > arg->buf_len ||
+	    ((arg->offset|arg->size) & (c->opts.block_size - 1)) ||
+	    ((arg->compressed_size|arg->uncompressed_size|arg->crc_offset) &
+	     (c->opts.block_size - 1)) ||
+	    arg->offset > (MAX_LFS_FILESIZE >> 9) - arg->size)
+		return -EINVAL;
+
+	/* We'd have to encrypt it, and the key isn't the user's to provide: */
+	if (bch2_csum_type_is_encryption(bch2_data_checksum_type(c,
+						opts.data_checksum)))
+		return -EOPNOTSUPP;
+
+	ret = bch2_encoded_check_compression(c, arg->compression_type);
+	if (ret)
+		return ret;
+
+	/*
+	 * Leave room for decompressing in place, if the write path can't write
+	 * it out as is:
+	 */
+	pages = DIV_ROUND_UP(arg->uncompressed_size, PAGE_SECTORS);
+
+	w = kzalloc(sizeof(*w) + sizeof(struct bio_vec) * pages, GFP_KERNEL);
+	if (!w)
+		return -ENOMEM;
+
+	init_completion(&w->done);
+	bio = &w->op.wbio.bio;
+	bio_init(bio, w->bi_inline_vecs, pages);
+
+	if (bch2_bio_alloc_pages(bio, arg->uncompressed_size << 9,
+				 GFP_KERNEL)) {
+		ret = -ENOMEM;
+		goto err_free;
+	}
+
+	bytes	= arg->compressed_size << 9;
+	src	= (void __user *)(unsigned long) arg->buf;
+
+	bio_for_each_segment_all(bv, bio, bv_iter) {
+		unsigned len = min(bv->bv_len, bytes);
+
+		if (!len)
+			break;
+
+		if (copy_from_user(page_address(bv->bv_page) + bv->bv_offset,
+				   src, len)) {
+			ret = -EFAULT;
+			goto err_free;
+		}
+
+		src	+= len;
+		bytes	-= len;
+	}
+
+	bio->bi_iter.bi_size = arg->compressed_size << 9;
+
+	/*
+	 * The write path passes whole extents through without looking at them,
+	 * so catch bad data now instead of on read:
+	 */
+	csum = bch2_checksum_bio(c, crc.csum_type,
+				 extent_nonce(ZERO_VERSION, crc), bio);
+	if (bch2_crc_cmp(csum, crc.csum)) {
+		ret = -EINVAL;
+		goto err_free;
+	}
+
+	ret = mnt_want_write_file(file);
+	if (ret)
+		goto err_free;
+
+	inode_lock(&inode->v);
+
+	ret = file_remove_privs(file) ?:
+		file_update_time(file);
+	if (ret)
+		goto err_unlock;
+
+	if (test_bit(EI_INODE_TRUNCATING, &inode->ei_flags) &&
+	    end > inode->v.i_size)
+		bch2_truncate_wait(inode);
+
+	inode_dio_begin(&inode->v);
+	bch2_pagecache_block_get_range(&inode->ei_pagecache_lock,
+				       pagecache_start, pagecache_end);
+
+	ret = bch2_quota_reservation_add(c, inode, &w->quota_res,
+					 arg->size, true) ?:
+		write_invalidate_inode_pages_range(mapping, start, end - 1);
+	if (ret)
+		goto err_put;
+
+	bch2_write_op_init(&w->op, c, opts);
+	w->op.end_io		= bch2_encoded_write_done;
+	w->op.target		= opts.foreground_target;
+	op_journal_seq_set(&w->op, &inode->ei_journal_seq);
+	w->op.acks_pending	= &inode->ei_write_acks_pending;
+	w->op.write_point	= inode_write_point(inode,
+						(unsigned long) current,
+						inode->v.i_write_hint);
+	w->op.nr_replicas	= opts.data_replicas;
+	w->op.pos		= POS(inode->v.i_ino, arg->offset);
+	w->op.flags		|= BCH_WRITE_DATA_ENCODED|
+				   BCH_WRITE_PAGES_STABLE|
+				   BCH_WRITE_PAGES_OWNED;
+	w->op.crc		= crc;
+	if (crc.compression_type == BCH_COMPRESSION_TYPE_incompressible)
+		w->op.incompressible = true;
+	else
+		w->op.compression_type = crc.compression_type;
+	bch2_write_op_set_times(&w->op, inode);
+
+	ret = bch2_disk_reservation_get(c, &w->op.res, arg->size,
+					opts.data_replicas, 0);
+	if (ret)
+		goto err_put;
+
+	closure_call(&w->op.cl, bch2_write, NULL, NULL);
+	wait_for_completion(&w->done);
+
+	i_sectors_acct(c, inode, &w->quota_res, w->op.i_sectors_delta);
+
+	end = start + ((u64) w->op.written << 9);
+	spin_lock(&inode->v.i_lock);
+	if (end > inode->v.i_size)
+		i_size_write(&inode->v, end);
+	spin_unlock(&inode->v.i_lock);
+
+	ret = w->op.error;
+	if (ret)
+		set_bit(EI_INODE_ERROR, &inode->ei_flags);
+err_put:
+	bch2_pagecache_block_put_range(&inode->ei_pagecache_lock,
+				       pagecache_start, pagecache_end);
+	bch2_quota_reservation_put(c, inode, &w->quota_res);
+	inode_dio_end(&inode->v);
+err_unlock:
+	inode_unlock(&inode->v);
+	mnt_drop_write_file(file);
+err_free:
+	bio_free_pages(bio);
+	kfree(w);
+	return ret;
+}
+
 /* fsync: */
 
 int bch2_fsync(struct file *file, loff_t start, loff_t end, int datasync)
 {
 	struct bch_inode_info *inode = file_bch_inode(file);
 	struct bch_fs *c = inode->v.i_sb->s_fs_info;
+	u64 seq;
 	int ret, ret2;
 
 	ret = file_write_and_wait_range(file, start, end);
 	if (ret)
 		return ret;
 
+	bch2_inode_write_acks_wait(inode);
+
+	/* Written back, so whatever quota is still cached isn't needed: */
+	bch2_quota_reservation_flush(c, inode);
+
 	if (datasync && !(inode->v.i_state & I_DIRTY_DATASYNC))
 		goto out;
 
@@ -2111,9 +3151,17 @@ int bch2_fsync(struct file *file, loff_t start, loff_t end, int datasync)
 	if (ret)
 		return ret;
 out:
+	/*
+	 * Data and i_size updates are tracked by ei_journal_seq; updates that
+	 * only touch timestamps go to ei_journal_seq_times, which fdatasync
+	 * doesn't need to wait on:
+	 */
+	seq = datasync
+		? inode->ei_journal_seq
+		: max(inode->ei_journal_seq, inode->ei_journal_seq_times);
+
 	if (!c->opts.journal_flush_disabled)
-		ret = bch2_journal_flush_seq(&c->journal,
-					     inode->ei_journal_seq);
+		ret = bch2_journal_flush_seq(&c->journal, seq);
 	ret2 = file_check_and_advance_wb_err(file);
 
 	return ret ?: ret2;
@@ -2279,6 +3327,24 @@ static int bch2_truncate_finish_fn(struct bch_inode_info *inode,
 	return 0;
 }
 
+static int bch2_truncate_times_fn(struct bch_inode_info *inode,
+				  struct bch_inode_unpacked *bi,
+				  void *p)
+{
+	struct bch_fs *c = inode->v.i_sb->s_fs_info;
+
+	bi->bi_mtime = bi->bi_ctime = bch2_current_time(c);
+	return 0;
+}
+
+static int bch2_truncate_done_fn(struct bch_inode_info *inode,
+				 struct bch_inode_unpacked *bi,
+				 void *p)
+{
+	bi->bi_flags &= ~BCH_INODE_I_SIZE_DIRTY;
+	return 0;
+}
+
 static int bch2_truncate_start_fn(struct bch_inode_info *inode,
 				  struct bch_inode_unpacked *bi, void *p)
 {
@@ -2289,6 +3355,48 @@ static int bch2_truncate_start_fn(struct bch_inode_info *inode,
 	return 0;
 }
 
+/*
+ * Truncates that would delete more than this much are finished in the
+ * background: i_size is updated and BCH_INODE_I_SIZE_DIRTY set synchronously,
+ * so if we crash before the extents past i_size are gone, recovery finishes the
+ * job:
+ */
+#define TRUNCATE_ASYNC_BYTES	(64ULL << 20)
+
+void bch2_truncate_work(struct work_struct *work)
+{
+	struct bch_inode_info *inode =
+		container_of(work, struct bch_inode_info, ei_truncate_work);
+	struct bch_fs *c = inode->v.i_sb->s_fs_info;
+	s64 i_sectors_delta = 0;
+	int ret;
+
+	ret = bch2_fpunch(c, inode->v.i_ino, inode->ei_truncate_start,
+			  U64_MAX, &inode->ei_journal_seq, &i_sectors_delta);
+	i_sectors_acct(c, inode, NULL, i_sectors_delta);
+
+	if (!ret) {
+		mutex_lock(&inode->ei_update_lock);
+		ret = bch2_write_inode(c, inode, bch2_truncate_done_fn,
+				       NULL, 0);
+		mutex_unlock(&inode->ei_update_lock);
+	}
+
+	if (ret)
+		bch_err_inum_ratelimited(c, inode->v.i_ino,
+			"error %i in background truncate", ret);
+
+	clear_bit_unlock(EI_INODE_TRUNCATING, &inode->ei_flags);
+	smp_mb__after_atomic();
+	wake_up_bit(&inode->ei_flags, EI_INODE_TRUNCATING);
+
+	percpu_ref_put(&c->writes);
+	iput(&inode->v);
+
+	if (atomic_dec_and_test(&c->nr_async_truncates))
+		wake_up_var(&c->nr_async_truncates);
+}
+
 int bch2_truncate(struct bch_inode_info *inode, struct iattr *iattr)
 {
 	struct bch_fs *c = inode->v.i_sb->s_fs_info;
@@ -2300,6 +3408,7 @@ int bch2_truncate(struct bch_inode_info *inode, struct iattr *iattr)
 	s64 i_sectors_delta = 0;
 	int ret = 0;
 
+	bch2_truncate_wait(inode);
 	inode_dio_wait(&inode->v);
 	bch2_pagecache_block_get(&inode->ei_pagecache_lock);
 
@@ -2367,6 +3476,29 @@ int bch2_truncate(struct bch_inode_info *inode, struct iattr *iattr)
 
 	truncate_setsize(&inode->v, iattr->ia_size);
 
+	if (inode_u.bi_size > iattr->ia_size + TRUNCATE_ASYNC_BYTES &&
+	    percpu_ref_tryget(&c->writes)) {
+		setattr_copy(&inode->v, iattr);
+
+		mutex_lock(&inode->ei_update_lock);
+		ret = bch2_write_inode(c, inode, bch2_truncate_times_fn, NULL,
+				       ATTR_MTIME|ATTR_CTIME);
+		mutex_unlock(&inode->ei_update_lock);
+
+		if (unlikely(ret)) {
+			percpu_ref_put(&c->writes);
+			goto err;
+		}
+
+		inode->ei_truncate_start =
+			round_up(iattr->ia_size, block_bytes(c)) >> 9;
+		set_bit(EI_INODE_TRUNCATING, &inode->ei_flags);
+		ihold(&inode->v);
+		atomic_inc(&c->nr_async_truncates);
+		queue_work(system_long_wq, &inode->ei_truncate_work);
+		goto err;
+	}
+
 	ret = bch2_fpunch(c, inode->v.i_ino,
 			round_up(iattr->ia_size, block_bytes(c)) >> 9,
 			U64_MAX, &inode->ei_journal_seq, &i_sectors_delta);
@@ -2393,11 +3525,13 @@ static long bchfs_fpunch(struct bch_inode_info *inode, loff_t offset, loff_t len
 	struct bch_fs *c = inode->v.i_sb->s_fs_info;
 	u64 discard_start = round_up(offset, block_bytes(c)) >> 9;
 	u64 discard_end = round_down(offset + len, block_bytes(c)) >> 9;
+	pgoff_t start = offset >> PAGE_SHIFT;
+	pgoff_t end = (offset + len - 1) >> PAGE_SHIFT;
 	int ret = 0;
 
 	inode_lock(&inode->v);
 	inode_dio_wait(&inode->v);
-	bch2_pagecache_block_get(&inode->ei_pagecache_lock);
+	bch2_pagecache_block_get_range(&inode->ei_pagecache_lock, start, end);
 
 	ret = __bch2_truncate_page(inode,
 				   offset >> PAGE_SHIFT,
@@ -2426,7 +3560,7 @@ static long bchfs_fpunch(struct bch_inode_info *inode, loff_t offset, loff_t len
 		i_sectors_acct(c, inode, NULL, i_sectors_delta);
 	}
 err:
-	bch2_pagecache_block_put(&inode->ei_pagecache_lock);
+	bch2_pagecache_block_put_range(&inode->ei_pagecache_lock, start, end);
 	inode_unlock(&inode->v);
 
 	return ret;
@@ -2458,6 +3592,7 @@ static long bchfs_fcollapse_finsert(struct bch_inode_info *inode,
 	 * iterators
 	 */
 	inode_lock(&inode->v);
+	bch2_truncate_wait(inode);
 	inode_dio_wait(&inode->v);
 	bch2_pagecache_block_get(&inode->ei_pagecache_lock);
 
@@ -2635,8 +3770,11 @@ static long bchfs_fallocate(struct bch_inode_info *inode, int mode,
 	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 0);
 
 	inode_lock(&inode->v);
+	bch2_truncate_wait(inode);
 	inode_dio_wait(&inode->v);
-	bch2_pagecache_block_get(&inode->ei_pagecache_lock);
+	bch2_pagecache_block_get_range(&inode->ei_pagecache_lock,
+				       block_start >> PAGE_SHIFT,
+				       (block_end - 1) >> PAGE_SHIFT);
 
 	if (!(mode & FALLOC_FL_KEEP_SIZE) && end > inode->v.i_size) {
 		ret = inode_newsize_ok(&inode->v, end);
@@ -2661,6 +3799,9 @@ static long bchfs_fallocate(struct bch_inode_info *inode, int mode,
 		truncate_pagecache_range(&inode->v, offset, end - 1);
 	}
 
+	if (!(mode & FALLOC_FL_ZERO_RANGE))
+		set_bit(EI_INODE_PREALLOCATED, &inode->ei_flags);
+
 	iter = bch2_trans_get_iter(&trans, BTREE_ID_EXTENTS,
 			POS(inode->v.i_ino, block_start >> 9),
 			BTREE_ITER_SLOTS|BTREE_ITER_INTENT);
@@ -2779,7 +3920,9 @@ static long bchfs_fallocate(struct bch_inode_info *inode, int mode,
 	}
 err:
 	bch2_trans_exit(&trans);
-	bch2_pagecache_block_put(&inode->ei_pagecache_lock);
+	bch2_pagecache_block_put_range(&inode->ei_pagecache_lock,
+				       block_start >> PAGE_SHIFT,
+				       (block_end - 1) >> PAGE_SHIFT);
 	inode_unlock(&inode->v);
 	return ret;
 }
@@ -2864,9 +4007,6 @@ loff_t bch2_remap_file_range(struct file *file_src, loff_t pos_src,
 	if (remap_flags & ~(REMAP_FILE_DEDUP|REMAP_FILE_ADVISORY))
 		return -EINVAL;
 
-	if (remap_flags & REMAP_FILE_DEDUP)
-		return -EOPNOTSUPP;
-
 	if ((pos_src & (block_bytes(c) - 1)) ||
 	    (pos_dst & (block_bytes(c) - 1)))
 		return -EINVAL;
@@ -2875,9 +4015,37 @@ loff_t bch2_remap_file_range(struct file *file_src, loff_t pos_src,
 	    abs(pos_src - pos_dst) < len)
 		return -EINVAL;
 
+	/*
+	 * Converting the source extents to indirect extents is most of the
+	 * work, and doesn't change the file's contents - do it before taking
+	 * the inode locks; anything written in the meantime gets converted
+	 * under the locks, by bch2_remap_range():
+	 */
+	if (S_ISREG(src->v.i_mode)) {
+		loff_t isize = i_size_read(&src->v);
+		u64 src_len = isize > pos_src ? isize - pos_src : 0;
+
+		if (len)
+			src_len = min_t(u64, src_len, len);
+
+		if (src_len) {
+			ret = filemap_write_and_wait_range(src->v.i_mapping,
+						pos_src, pos_src + src_len - 1) ?:
+				bch2_make_range_indirect(c,
+						POS(src->v.i_ino, pos_src >> 9),
+						round_up(src_len, block_bytes(c)) >> 9,
+						&src->ei_journal_seq);
+			if (ret)
+				return ret;
+		}
+	}
+
 	bch2_lock_inodes(INODE_LOCK|INODE_PAGECACHE_BLOCK, src, dst);
+	bch2_truncate_wait(dst);
 
-	file_update_time(file_dst);
+	/* Dedup doesn't change the file's contents: */
+	if (!(remap_flags & REMAP_FILE_DEDUP))
+		file_update_time(file_dst);
 
 	inode_dio_wait(&src->v);
 	inode_dio_wait(&dst->v);
@@ -2924,6 +4092,143 @@ loff_t bch2_remap_file_range(struct file *file_src, loff_t pos_src,
 	return ret;
 }
 
+/* Returns 1 if the ranges have the same contents, 0 if not: */
+static int bch2_dedup_compare(struct bch_inode_info *src, loff_t pos_src,
+			      struct bch_inode_info *dst, loff_t pos_dst,
+			      u64 len)
+{
+	int ret = 1;
+
+	while (len && ret > 0) {
+		unsigned src_offset = offset_in_page(pos_src);
+		unsigned dst_offset = offset_in_page(pos_dst);
+		unsigned n = min_t(u64, len,
+				   PAGE_SIZE - max(src_offset, dst_offset));
+		struct page *src_page, *dst_page;
+		void *src_p, *dst_p;
+
+		src_page = read_mapping_page(src->v.i_mapping,
+					     pos_src >> PAGE_SHIFT, NULL);
+		if (IS_ERR(src_page))
+			return PTR_ERR(src_page);
+
+		dst_page = read_mapping_page(dst->v.i_mapping,
+					     pos_dst >> PAGE_SHIFT, NULL);
+		if (IS_ERR(dst_page)) {
+			put_page(src_page);
+			return PTR_ERR(dst_page);
+		}
+
+		src_p = kmap_atomic(src_page);
+		dst_p = kmap_atomic(dst_page);
+
+		if (memcmp(src_p + src_offset, dst_p + dst_offset, n))
+			ret = 0;
+
+		kunmap_atomic(dst_p);
+		kunmap_atomic(src_p);
+		put_page(dst_page);
+		put_page(src_page);
+
+		pos_src	+= n;
+		pos_dst	+= n;
+		len	-= n;
+
+		cond_resched();
+	}
+
+	return ret;
+}
+
+/*
+ * Background dedup: FIDEDUPERANGE, on inode numbers instead of open files -
+ * the ranges are compared under the inode locks, and if they match @dst is
+ * remapped to share @src's data.
+ *
+ * Returns sectors deduplicated, 0 if the ranges didn't match or no longer
+ * exist:
+ */
+s64 bch2_dedup_extents(struct bch_fs *c,
+		       struct bpos src_start, struct bpos dst_start,
+		       u64 sectors)
+{
+	struct inode *vsrc, *vdst;
+	struct bch_inode_info *src, *dst;
+	loff_t pos_src = src_start.offset << 9;
+	loff_t pos_dst = dst_start.offset << 9;
+	u64 len = sectors << 9;
+	s64 i_sectors_delta = 0;
+	s64 ret = 0;
+
+	if (!c->opts.reflink || !c->vfs_sb)
+		return -EOPNOTSUPP;
+
+	vsrc = bch2_vfs_inode_get(c, src_start.inode);
+	if (IS_ERR(vsrc))
+		return PTR_ERR(vsrc) == -ENOENT ? 0 : PTR_ERR(vsrc);
+
+	vdst = bch2_vfs_inode_get(c, dst_start.inode);
+	if (IS_ERR(vdst)) {
+		iput(vsrc);
+		return PTR_ERR(vdst) == -ENOENT ? 0 : PTR_ERR(vdst);
+	}
+
+	src = to_bch_ei(vsrc);
+	dst = to_bch_ei(vdst);
+
+	if (!S_ISREG(src->v.i_mode) ||
+	    !S_ISREG(dst->v.i_mode) ||
+	    (src == dst && abs(pos_src - pos_dst) < len))
+		goto out;
+
+	/* Frozen? Then this range can wait for the next pass: */
+	if (!sb_start_write_trylock(c->vfs_sb))
+		goto out;
+
+	ret = filemap_write_and_wait_range(src->v.i_mapping,
+					   pos_src, pos_src + len - 1) ?:
+		filemap_write_and_wait_range(dst->v.i_mapping,
+					     pos_dst, pos_dst + len - 1) ?:
+		bch2_make_range_indirect(c, src_start, sectors,
+					 &src->ei_journal_seq);
+	if (ret)
+		goto out_end_write;
+
+	bch2_lock_inodes(INODE_LOCK|INODE_PAGECACHE_BLOCK, src, dst);
+
+	inode_dio_wait(&src->v);
+	inode_dio_wait(&dst->v);
+
+	if (pos_src + len > i_size_read(&src->v) ||
+	    pos_dst + len > i_size_read(&dst->v))
+		goto unlock;
+
+	ret = bch2_dedup_compare(src, pos_src, dst, pos_dst, len);
+	if (ret <= 0)
+		goto unlock;
+
+	ret = write_invalidate_inode_pages_range(dst->v.i_mapping,
+					pos_dst, pos_dst + len - 1);
+	if (ret)
+		goto unlock;
+
+	mark_range_unallocated(src, pos_src, pos_src + len);
+
+	ret = bch2_remap_range(c, dst_start, src_start, sectors,
+			       &dst->ei_journal_seq,
+			       pos_dst + len, &i_sectors_delta);
+	if (ret >= 0)
+		i_sectors_acct(c, dst, NULL, i_sectors_delta);
+unlock:
+	bch2_unlock_inodes(INODE_LOCK|INODE_PAGECACHE_BLOCK, src, dst);
+out_end_write:
+	sb_end_write(c->vfs_sb);
+out:
+	iput(vdst);
+	iput(vsrc);
+	return ret;
+}
+
 /* fseek: */
 
 static int page_data_offset(struct page *page, unsigned offset)
@@ -2939,42 +4244,68 @@ static int page_data_offset(struct page *page, unsigned offset)
 	return -1;
 }
 
-static loff_t bch2_seek_pagecache_data(struct inode *vinode,
-				       loff_t start_offset,
-				       loff_t end_offset)
+static loff_t __bch2_seek_pagecache_data(struct address_space *mapping,
+					 loff_t start_offset,
+					 loff_t end_offset,
+					 xa_mark_t tag)
 {
-	struct address_space *mapping = vinode->i_mapping;
+	struct pagevec pvec;
 	struct page *page;
 	pgoff_t start_index	= start_offset >> PAGE_SHIFT;
 	pgoff_t end_index	= end_offset >> PAGE_SHIFT;
 	pgoff_t index		= start_index;
-	loff_t ret;
+	loff_t ret = end_offset;
+	unsigned i;
 	int offset;
 
-	while (index <= end_index) {
-		if (find_get_pages_range(mapping, &index, end_index, 1, &page)) {
-			lock_page(page);
+	pagevec_init(&pvec);
 
+	while (index <= end_index &&
+	       pagevec_lookup_range_tag(&pvec, mapping, &index,
+					end_index, tag)) {
+		for (i = 0; i < pagevec_count(&pvec); i++) {
+			page = pvec.pages[i];
+
+			lock_page(page);
 			offset = page_data_offset(page,
 					page->index == start_index
 					? start_offset & (PAGE_SIZE - 1)
 					: 0);
+			unlock_page(page);
+
 			if (offset >= 0) {
 				ret = clamp(((loff_t) page->index << PAGE_SHIFT) +
 					    offset,
 					    start_offset, end_offset);
-				unlock_page(page);
-				put_page(page);
-				return ret;
+				break;
 			}
+		}
 
-			unlock_page(page);
-			put_page(page);
-		} else {
+		pagevec_release(&pvec);
+
+		if (ret != end_offset)
 			break;
-		}
+		cond_resched();
 	}
 
+	return ret;
+}
+
+/*
+ * Data in the page cache that isn't yet in the extents btree is on pages that
+ * are either dirty or under writeback - clean pages with data were read from
+ * existing extents - so skip over everything else using page cache tags:
+ */
+static loff_t bch2_seek_pagecache_data(struct inode *vinode,
+				       loff_t start_offset,
+				       loff_t end_offset)
+{
+	struct address_space *mapping = vinode->i_mapping;
+
+	end_offset = __bch2_seek_pagecache_data(mapping, start_offset,
+					end_offset, PAGECACHE_TAG_DIRTY);
+	end_offset = __bch2_seek_pagecache_data(mapping, start_offset,
+					end_offset, PAGECACHE_TAG_WRITEBACK);
 	return end_offset;
 }
 
@@ -3034,40 +4365,51 @@ static int __page_hole_offset(struct page *page, unsigned offset)
 	return -1;
 }
 
-static loff_t page_hole_offset(struct address_space *mapping, loff_t offset)
+/*
+ * Returns the first hole at or after @start_offset and before @end_offset, in a
+ * range that's a hole in the extents btree: that's either a page that isn't in
+ * the page cache, or a sector that isn't dirty. Pages are looked up a pagevec's
+ * worth at a time with find_get_pages_contig(), which stops at the first page
+ * that's missing:
+ */
+static loff_t bch2_seek_pagecache_hole(struct inode *vinode,
+				       loff_t start_offset,
+				       loff_t end_offset)
 {
-	pgoff_t index = offset >> PAGE_SHIFT;
-	struct page *page;
+	struct address_space *mapping = vinode->i_mapping;
+	struct page *pages[PAGEVEC_SIZE];
+	pgoff_t index = start_offset >> PAGE_SHIFT;
+	loff_t hole = -1;
+	unsigned i, nr;
 	int pg_offset;
-	loff_t ret = -1;
-
-	page = find_lock_page(mapping, index);
-	if (!page)
-		return offset;
 
-	pg_offset = __page_hole_offset(page, offset & (PAGE_SIZE - 1));
-	if (pg_offset >= 0)
-		ret = ((loff_t) index << PAGE_SHIFT) + pg_offset;
+	while (((loff_t) index << PAGE_SHIFT) < end_offset) {
+		nr = find_get_pages_contig(mapping, index, PAGEVEC_SIZE, pages);
 
-	unlock_page(page);
+		for (i = 0; i < nr; i++) {
+			if (hole < 0) {
+				lock_page(pages[i]);
+				pg_offset = __page_hole_offset(pages[i],
+						index + i == start_offset >> PAGE_SHIFT
+						? start_offset & (PAGE_SIZE - 1)
+						: 0);
+				unlock_page(pages[i]);
 
-	return ret;
-}
+				if (pg_offset >= 0)
+					hole = ((loff_t) (index + i) << PAGE_SHIFT) +
+						pg_offset;
+			}
+			put_page(pages[i]);
+		}
 
-static loff_t bch2_seek_pagecache_hole(struct inode *vinode,
-				       loff_t start_offset,
-				       loff_t end_offset)
-{
-	struct address_space *mapping = vinode->i_mapping;
-	loff_t offset = start_offset, hole;
+		if (hole < 0 && nr < PAGEVEC_SIZE)
+			hole = (loff_t) (index + nr) << PAGE_SHIFT;
 
-	while (offset < end_offset) {
-		hole = page_hole_offset(mapping, offset);
-		if (hole >= 0 && hole <= end_offset)
-			return max(start_offset, hole);
+		if (hole >= 0)
+			return clamp(hole, start_offset, end_offset);
 
-		offset += PAGE_SIZE;
-		offset &= PAGE_MASK;
+		index += nr;
+		cond_resched();
 	}
 
 	return end_offset;
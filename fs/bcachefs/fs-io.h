@@ -10,6 +10,9 @@
 #include <linux/uio.h>
 
 struct quota_res;
+struct bch_ioctl_encoded_extent;
+
+void bch2_quota_reservation_flush(struct bch_fs *, struct bch_inode_info *);
 
 int __must_check bch2_write_inode_size(struct bch_fs *,
 				       struct bch_inode_info *,
@@ -29,13 +32,18 @@ int bch2_write_end(struct file *, struct address_space *, loff_t,
 ssize_t bch2_read_iter(struct kiocb *, struct iov_iter *);
 ssize_t bch2_write_iter(struct kiocb *, struct iov_iter *);
 
+int bch2_encoded_read(struct file *, struct bch_ioctl_encoded_extent *);
+int bch2_encoded_write(struct file *, struct bch_ioctl_encoded_extent *);
+
 int bch2_fsync(struct file *, loff_t, loff_t, int);
 
+void bch2_truncate_work(struct work_struct *);
 int bch2_truncate(struct bch_inode_info *, struct iattr *);
 long bch2_fallocate_dispatch(struct file *, int, loff_t, loff_t);
 
 loff_t bch2_remap_file_range(struct file *, loff_t, struct file *,
 			     loff_t, loff_t, unsigned);
+s64 bch2_dedup_extents(struct bch_fs *, struct bpos, struct bpos, u64);
 
 loff_t bch2_llseek(struct file *, loff_t, int);
 
@@ -49,6 +57,12 @@ int bch2_migrate_page(struct address_space *, struct page *,
 void bch2_fs_fsio_exit(struct bch_fs *);
 int bch2_fs_fsio_init(struct bch_fs *);
 #else
+static inline s64 bch2_dedup_extents(struct bch_fs *c, struct bpos src,
+				     struct bpos dst, u64 sectors)
+{
+	return -EOPNOTSUPP;
+}
+
 static inline void bch2_fs_fsio_exit(struct bch_fs *c) {}
 static inline int bch2_fs_fsio_init(struct bch_fs *c) { return 0; }
 #endif
@@ -6,7 +6,9 @@
 #include "dirent.h"
 #include "fs.h"
 #include "fs-common.h"
+#include "fs-io.h"
 #include "fs-ioctl.h"
+#include "move.h"
 #include "quota.h"
 
 #include <linux/compat.h>
@@ -247,6 +249,228 @@ static int bch2_ioc_reinherit_attrs(struct bch_fs *c,
 	return ret;
 }
 
+static int bch2_ioc_defrag(struct bch_fs *c,
+			   struct file *file,
+			   struct bch_inode_info *inode,
+			   struct bch_ioctl_defrag __user *user_arg)
+{
+	struct bch_ioctl_defrag arg;
+	struct bch_move_stats stats = { 0 };
+	unsigned extent_sectors;
+	u64 end;
+	int ret;
+
+	if (copy_from_user(&arg, user_arg, sizeof(arg)))
+		return -EFAULT;
+
+	if (arg.flags)
+		return -EINVAL;
+
+	if (!S_ISREG(inode->v.i_mode))
+		return -EINVAL;
+
+	if (!(file->f_mode & FMODE_WRITE) &&
+	    !capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	extent_sectors = arg.extent_size >> 9 ?:
+		c->opts.defrag_extent_size ?:
+		c->sb.encoded_extent_max;
+
+	end = arg.len && arg.start + arg.len > arg.start
+		? DIV_ROUND_UP_ULL(arg.start + arg.len, 512)
+		: U64_MAX;
+
+	ret = mnt_want_write_file(file);
+	if (ret)
+		return ret;
+
+	/* Dirty data in the page cache hasn't been allocated yet: */
+	ret = filemap_write_and_wait(inode->v.i_mapping) ?:
+		bch2_defrag(c,
+			    POS(inode->v.i_ino, arg.start >> 9),
+			    POS(inode->v.i_ino, end),
+			    extent_sectors, &stats);
+
+	mnt_drop_write_file(file);
+	return ret;
+}
+
+#define BULKSTAT_BATCH		64
+
+static int bch2_ioc_encoded_io(struct file *file, bool write,
+			       struct bch_ioctl_encoded_extent __user *user_arg)
+{
+	struct bch_inode_info *inode = file_bch_inode(file);
+	struct bch_ioctl_encoded_extent arg;
+	int ret;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	if (!S_ISREG(inode->v.i_mode))
+		return -EINVAL;
+
+	if (!(file->f_mode & (write ? FMODE_WRITE : FMODE_READ)))
+		return -EBADF;
+
+	if (copy_from_user(&arg, user_arg, sizeof(arg)))
+		return -EFAULT;
+
+	if (!write) {
+		ret = bch2_encoded_read(file, &arg);
+
+		/* On -E2BIG, report how big the buffer needs to be: */
+		if ((!ret || ret == -E2BIG) &&
+		    copy_to_user(user_arg, &arg, sizeof(arg)))
+			ret = -EFAULT;
+	} else {
+		ret = bch2_encoded_write(file, &arg);
+	}
+
+	return ret;
+}
+
+static s64 bulkstat_time(struct bch_fs *c, u64 time)
+{
+	struct timespec64 ts = bch2_time_to_timespec(c, time);
+
+	return timespec64_to_ns(&ts);
+}
+
+static bool bulkstat_want(struct bch_ioctl_bulkstat *arg,
+			  struct bch_ioctl_bulkstat_inode *i)
+{
+	return (!arg->mode_type ||
+		(i->mode & S_IFMT) == arg->mode_type) &&
+		(!arg->changed_since ||
+		 i->mtime >= arg->changed_since ||
+		 i->ctime >= arg->changed_since);
+}
+
+/*
+ * Fill @out with up to @nr inodes starting from *@inum, advancing *@inum past
+ * the last inode looked at; returns number of inodes returned:
+ */
+static int bulkstat_batch(struct bch_fs *c, struct bch_ioctl_bulkstat *arg,
+			  u64 *inum, struct bch_ioctl_bulkstat_inode *out,
+			  unsigned nr)
+{
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	struct bch_inode_unpacked u;
+	struct bch_ioctl_bulkstat_inode *i;
+	unsigned ret_nr = 0, seen = 0;
+	int ret;
+
+	bch2_trans_init(&trans, c, 0, 0);
+
+	for_each_btree_key(&trans, iter, BTREE_ID_INODES, POS(0, *inum),
+			   BTREE_ITER_PREFETCH, k, ret) {
+		if (ret_nr == nr ||
+		    seen++ == nr * 16)
+			break;
+
+		*inum = k.k->p.offset + 1;
+
+		if (k.k->type != KEY_TYPE_inode)
+			continue;
+
+		ret = bch2_inode_unpack(bkey_s_c_to_inode(k), &u);
+		if (ret)
+			break;
+
+		i = out + ret_nr;
+		memset(i, 0, sizeof(*i));
+		i->inum		= u.bi_inum;
+		i->size		= u.bi_size;
+		i->sectors	= u.bi_sectors;
+		i->atime	= bulkstat_time(c, u.bi_atime);
+		i->mtime	= bulkstat_time(c, u.bi_mtime);
+		i->ctime	= bulkstat_time(c, u.bi_ctime);
+		i->otime	= bulkstat_time(c, u.bi_otime);
+		i->generation	= u.bi_generation;
+		i->flags	= u.bi_flags;
+		i->mode		= u.bi_mode;
+		i->uid		= u.bi_uid;
+		i->gid		= u.bi_gid;
+		i->nlink	= bch2_inode_nlink_get(&u);
+		i->dev		= u.bi_dev;
+
+		if (bulkstat_want(arg, i))
+			ret_nr++;
+	}
+	bch2_trans_iter_put(&trans, iter);
+
+	ret = bch2_trans_exit(&trans) ?: ret;
+	return ret ?: ret_nr;
+}
+
+static int bch2_ioc_bulkstat(struct bch_fs *c,
+			     struct bch_ioctl_bulkstat __user *user_arg)
+{
+	struct bch_ioctl_bulkstat arg;
+	struct bch_ioctl_bulkstat_inode *buf;
+	struct bch_ioctl_bulkstat_inode __user *user_buf;
+	u64 inum;
+	unsigned nr = 0;
+	int ret = 0;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	if (copy_from_user(&arg, user_arg, sizeof(arg)))
+		return -EFAULT;
+
+	if (arg.flags || arg.pad)
+		return -EINVAL;
+
+	buf = kmalloc_array(BULKSTAT_BATCH, sizeof(*buf), GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	user_buf	= (void __user *)(unsigned long) arg.buf;
+	inum		= max_t(u64, arg.start, BCACHEFS_ROOT_INO);
+
+	while (nr < arg.nr && inum != U64_MAX) {
+		u64 prev = inum;
+
+		ret = bulkstat_batch(c, &arg, &inum, buf,
+				     min_t(unsigned, arg.nr - nr,
+					   BULKSTAT_BATCH));
+		if (ret < 0)
+			break;
+
+		/* Copy out with no btree locks held: */
+		if (copy_to_user(user_buf + nr, buf, sizeof(*buf) * ret)) {
+			ret = -EFAULT;
+			break;
+		}
+		nr += ret;
+		ret = 0;
+
+		if (inum == prev)
+			break;
+
+		if (fatal_signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+		cond_resched();
+	}
+
+	kfree(buf);
+
+	if (ret)
+		return ret;
+
+	arg.start	= inum;
+	arg.nr		= nr;
+
+	return copy_to_user(user_arg, &arg, sizeof(arg)) ? -EFAULT : 0;
+}
+
 long bch2_fs_file_ioctl(struct file *file, unsigned cmd, unsigned long arg)
 {
 	struct bch_inode_info *inode = file_bch_inode(file);
@@ -270,6 +494,18 @@ long bch2_fs_file_ioctl(struct file *file, unsigned cmd, unsigned long arg)
 		return bch2_ioc_reinherit_attrs(c, file, inode,
 						(void __user *) arg);
 
+	case BCHFS_IOC_DEFRAG:
+		return bch2_ioc_defrag(c, file, inode, (void __user *) arg);
+
+	case BCHFS_IOC_BULKSTAT:
+		return bch2_ioc_bulkstat(c, (void __user *) arg);
+
+	case BCHFS_IOC_ENCODED_READ:
+		return bch2_ioc_encoded_io(file, false, (void __user *) arg);
+
+	case BCHFS_IOC_ENCODED_WRITE:
+		return bch2_ioc_encoded_io(file, true, (void __user *) arg);
+
 	case FS_IOC_GETVERSION:
 		return -ENOTTY;
 	case FS_IOC_SETVERSION:
@@ -7,6 +7,7 @@
 #include "btree_update.h"
 #include "buckets.h"
 #include "chardev.h"
+#include "dedup.h"
 #include "dirent.h"
 #include "extents.h"
 #include "fs.h"
@@ -27,8 +28,10 @@
 #include <linux/exportfs.h>
 #include <linux/fiemap.h>
 #include <linux/module.h>
+#include <linux/pagemap.h>
 #include <linux/posix_acl.h>
 #include <linux/random.h>
+#include <linux/sort.h>
 #include <linux/statfs.h>
 #include <linux/xattr.h>
 
@@ -55,60 +58,104 @@ static void journal_seq_copy(struct bch_fs *c,
 		if (old >= journal_seq)
 			break;
 	} while ((v = atomic64_cmpxchg(dst_seq, old, journal_seq)) != old);
+}
+
+static unsigned long pagecache_lock_stripes(pgoff_t start, pgoff_t end)
+{
+	pgoff_t i = start >> PAGECACHE_LOCK_STRIPE_SHIFT;
+	pgoff_t last = end >> PAGECACHE_LOCK_STRIPE_SHIFT;
+	unsigned long stripes = 0;
 
-	bch2_journal_set_has_inum(&c->journal, dst->v.i_ino, journal_seq);
+	if (last - i >= PAGECACHE_LOCK_STRIPES - 1)
+		return (1UL << PAGECACHE_LOCK_STRIPES) - 1;
+
+	for (; i <= last; i++)
+		stripes |= 1UL << (i & (PAGECACHE_LOCK_STRIPES - 1));
+	return stripes;
 }
 
-static void __pagecache_lock_put(struct pagecache_lock *lock, long i)
+static void __pagecache_lock_put(struct pagecache_lock *lock,
+				 unsigned long stripes, long i)
 {
-	BUG_ON(atomic_long_read(&lock->v) == 0);
+	bool wake = false;
+	unsigned s;
+
+	for_each_set_bit(s, &stripes, PAGECACHE_LOCK_STRIPES) {
+		BUG_ON(atomic_long_read(&lock->v[s]) == 0);
 
-	if (atomic_long_sub_return_release(i, &lock->v) == 0)
+		if (atomic_long_sub_return_release(i, &lock->v[s]) == 0)
+			wake = true;
+	}
+
+	if (wake)
 		wake_up_all(&lock->wait);
 }
 
-static bool __pagecache_lock_tryget(struct pagecache_lock *lock, long i)
+static bool __pagecache_lock_tryget_stripe(atomic_long_t *lock, long i)
 {
-	long v = atomic_long_read(&lock->v), old;
+	long v = atomic_long_read(lock), old;
 
 	do {
 		old = v;
 
 		if (i > 0 ? v < 0 : v > 0)
 			return false;
-	} while ((v = atomic_long_cmpxchg_acquire(&lock->v,
+	} while ((v = atomic_long_cmpxchg_acquire(lock,
 					old, old + i)) != old);
 	return true;
 }
 
-static void __pagecache_lock_get(struct pagecache_lock *lock, long i)
+static bool __pagecache_lock_tryget(struct pagecache_lock *lock,
+				    unsigned long stripes, long i)
 {
-	wait_event(lock->wait, __pagecache_lock_tryget(lock, i));
+	unsigned s;
+
+	for_each_set_bit(s, &stripes, PAGECACHE_LOCK_STRIPES)
+		if (!__pagecache_lock_tryget_stripe(&lock->v[s], i)) {
+			/* Don't hold some stripes while waiting on others: */
+			stripes &= (1UL << s) - 1;
+			if (stripes)
+				__pagecache_lock_put(lock, stripes, i);
+			return false;
+		}
+
+	return true;
 }
 
-void bch2_pagecache_add_put(struct pagecache_lock *lock)
+static void __pagecache_lock_get(struct pagecache_lock *lock,
+				 unsigned long stripes, long i)
 {
-	__pagecache_lock_put(lock, 1);
+	wait_event(lock->wait, __pagecache_lock_tryget(lock, stripes, i));
 }
 
-bool bch2_pagecache_add_tryget(struct pagecache_lock *lock)
+void bch2_pagecache_add_put_range(struct pagecache_lock *lock,
+				  pgoff_t start, pgoff_t end)
 {
-	return __pagecache_lock_tryget(lock, 1);
+	__pagecache_lock_put(lock, pagecache_lock_stripes(start, end), 1);
 }
 
-void bch2_pagecache_add_get(struct pagecache_lock *lock)
+bool bch2_pagecache_add_tryget_range(struct pagecache_lock *lock,
+				     pgoff_t start, pgoff_t end)
 {
-	__pagecache_lock_get(lock, 1);
+	return __pagecache_lock_tryget(lock, pagecache_lock_stripes(start, end), 1);
 }
 
-void bch2_pagecache_block_put(struct pagecache_lock *lock)
+void bch2_pagecache_add_get_range(struct pagecache_lock *lock,
+				  pgoff_t start, pgoff_t end)
 {
-	__pagecache_lock_put(lock, -1);
+	__pagecache_lock_get(lock, pagecache_lock_stripes(start, end), 1);
 }
 
-void bch2_pagecache_block_get(struct pagecache_lock *lock)
+void bch2_pagecache_block_put_range(struct pagecache_lock *lock,
+				    pgoff_t start, pgoff_t end)
 {
-	__pagecache_lock_get(lock, -1);
+	__pagecache_lock_put(lock, pagecache_lock_stripes(start, end), -1);
+}
+
+void bch2_pagecache_block_get_range(struct pagecache_lock *lock,
+				    pgoff_t start, pgoff_t end)
+{
+	__pagecache_lock_get(lock, pagecache_lock_stripes(start, end), -1);
 }
 
 void bch2_inode_update_after_write(struct bch_fs *c,
@@ -133,14 +180,15 @@ void bch2_inode_update_after_write(struct bch_fs *c,
 	bch2_inode_flags_to_vfs(inode);
 }
 
-int __must_check bch2_write_inode(struct bch_fs *c,
-				  struct bch_inode_info *inode,
-				  inode_set_fn set,
-				  void *p, unsigned fields)
+int __must_check __bch2_write_inode(struct bch_fs *c,
+				    struct bch_inode_info *inode,
+				    inode_set_fn set,
+				    void *p, unsigned fields,
+				    u64 *journal_seq)
 {
 	struct btree_trans trans;
 	struct btree_iter *iter;
-	struct bch_inode_unpacked inode_u;
+	struct bch_inode_unpacked inode_u, orig;
 	int ret;
 
 	bch2_trans_init(&trans, c, 0, 0);
@@ -149,14 +197,28 @@ int __must_check bch2_write_inode(struct bch_fs *c,
 
 	iter = bch2_inode_peek(&trans, &inode_u, inode->v.i_ino,
 			       BTREE_ITER_INTENT);
-	ret   = PTR_ERR_OR_ZERO(iter) ?:
-		(set ? set(inode, &inode_u, p) : 0) ?:
-		bch2_inode_write(&trans, iter, &inode_u) ?:
-		bch2_trans_commit(&trans, NULL,
-				  &inode->ei_journal_seq,
+	ret = PTR_ERR_OR_ZERO(iter);
+	if (ret)
+		goto err;
+
+	orig = inode_u;
+
+	ret = set ? set(inode, &inode_u, p) : 0;
+	if (ret)
+		goto err;
+
+	/*
+	 * Nothing changed - e.g. the timestamps were already written along with
+	 * the last data write - so skip the update:
+	 */
+	if (!memcmp(&orig, &inode_u, sizeof(inode_u)))
+		goto err;
+
+	ret   = bch2_inode_write(&trans, iter, &inode_u) ?:
+		bch2_trans_commit(&trans, NULL, journal_seq,
 				  BTREE_INSERT_NOUNLOCK|
 				  BTREE_INSERT_NOFAIL);
-
+err:
 	/*
 	 * the btree node lock protects inode->ei_inode, not ei_update_lock;
 	 * this is important for inode updates via bchfs_write_index_update
@@ -825,15 +887,86 @@ static int bch2_tmpfile(struct inode *vdir, struct dentry *dentry, umode_t mode)
 	return 0;
 }
 
-static int bch2_fill_extent(struct bch_fs *c,
-			    struct fiemap_extent_info *info,
-			    struct bkey_s_c k, unsigned flags)
+/*
+ * fiemap extents are collected in a batch, with btree locks held, and only
+ * copied out to userspace - which can fault - once the batch is full and the
+ * btree is unlocked. The last extent in the batch is kept back when flushing,
+ * so that the next key can still be merged into it if it's physically
+ * contiguous:
+ */
+#define FIEMAP_BATCH		64
+
+struct fiemap_ent {
+	u64			logical;
+	u64			phys;
+	u64			len;
+	u32			flags;
+};
+
+struct fiemap_batch {
+	unsigned		nr;
+	struct fiemap_ent	e[FIEMAP_BATCH];
+};
+
+static void fiemap_add(struct fiemap_batch *b, u64 logical, u64 phys,
+		       u64 len, u32 flags)
+{
+	struct fiemap_ent *last = b->nr ? &b->e[b->nr - 1] : NULL;
+
+	if (last &&
+	    last->flags == flags &&
+	    !(flags & FIEMAP_EXTENT_DATA_INLINE) &&
+	    last->logical + last->len == logical &&
+	    (phys ? last->phys + last->len == phys : !last->phys)) {
+		last->len += len;
+		return;
+	}
+
+	BUG_ON(b->nr >= FIEMAP_BATCH);
+	b->e[b->nr++] = (struct fiemap_ent) {
+		.logical	= logical,
+		.phys		= phys,
+		.len		= len,
+		.flags		= flags,
+	};
+}
+
+/*
+ * Copy out everything but the last extent, or everything if @last; returns 1 if
+ * the user's buffer is full:
+ */
+static int fiemap_flush(struct fiemap_extent_info *info,
+			struct fiemap_batch *b, bool last)
+{
+	unsigned i, nr = last ? b->nr : b->nr - 1;
+	int ret = 0;
+
+	if (!b->nr)
+		return 0;
+
+	if (last)
+		b->e[b->nr - 1].flags |= FIEMAP_EXTENT_LAST;
+
+	for (i = 0; i < nr && !ret; i++)
+		ret = fiemap_fill_next_extent(info,
+					      b->e[i].logical,
+					      b->e[i].phys,
+					      b->e[i].len,
+					      b->e[i].flags);
+
+	memmove(b->e, b->e + nr, (b->nr - nr) * sizeof(b->e[0]));
+	b->nr -= nr;
+	return ret;
+}
+
+static void bch2_fill_extent(struct bch_fs *c,
+			     struct fiemap_batch *b,
+			     struct bkey_s_c k, unsigned flags)
 {
 	if (bkey_extent_is_direct_data(k.k)) {
 		struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(k);
 		const union bch_extent_entry *entry;
 		struct extent_ptr_decoded p;
-		int ret;
 
 		if (k.k->type == KEY_TYPE_reflink_v)
 			flags |= FIEMAP_EXTENT_SHARED;
@@ -851,33 +984,60 @@ static int bch2_fill_extent(struct bch_fs *c,
 			    (k.k->size & (c->opts.block_size - 1)))
 				flags2 |= FIEMAP_EXTENT_NOT_ALIGNED;
 
-			ret = fiemap_fill_next_extent(info,
-						bkey_start_offset(k.k) << 9,
-						offset << 9,
-						k.k->size << 9, flags|flags2);
-			if (ret)
-				return ret;
+			fiemap_add(b, bkey_start_offset(k.k) << 9,
+				   offset << 9,
+				   k.k->size << 9, flags|flags2);
 		}
-
-		return 0;
 	} else if (bkey_extent_is_inline_data(k.k)) {
-		return fiemap_fill_next_extent(info,
-					       bkey_start_offset(k.k) << 9,
-					       0, k.k->size << 9,
-					       flags|
-					       FIEMAP_EXTENT_DATA_INLINE);
+		fiemap_add(b, bkey_start_offset(k.k) << 9,
+			   0, k.k->size << 9,
+			   flags|
+			   FIEMAP_EXTENT_DATA_INLINE);
 	} else if (k.k->type == KEY_TYPE_reservation) {
-		return fiemap_fill_next_extent(info,
-					       bkey_start_offset(k.k) << 9,
-					       0, k.k->size << 9,
-					       flags|
-					       FIEMAP_EXTENT_DELALLOC|
-					       FIEMAP_EXTENT_UNWRITTEN);
+		fiemap_add(b, bkey_start_offset(k.k) << 9,
+			   0, k.k->size << 9,
+			   flags|
+			   FIEMAP_EXTENT_DELALLOC|
+			   FIEMAP_EXTENT_UNWRITTEN);
 	} else {
 		BUG();
 	}
 }
 
+/*
+ * Consecutive reflink pointers in a file usually point into the same indirect
+ * extent, so keep the last one we looked up instead of going to the reflink
+ * btree for every key:
+ */
+static int fiemap_read_indirect_extent(struct btree_trans *trans,
+				       struct bkey_buf *indirect,
+				       unsigned *offset_into_extent,
+				       struct bkey_buf *k)
+{
+	u64 reflink_offset;
+	int ret;
+
+	if (k->k->k.type != KEY_TYPE_reflink_p)
+		return 0;
+
+	reflink_offset = le64_to_cpu(bkey_i_to_reflink_p(k->k)->v.idx) +
+		*offset_into_extent;
+
+	if (indirect->k->k.type != KEY_TYPE_deleted &&
+	    reflink_offset >= bkey_start_offset(&indirect->k->k) &&
+	    reflink_offset < indirect->k->k.p.offset) {
+		*offset_into_extent = reflink_offset -
+			bkey_start_offset(&indirect->k->k);
+		bch2_bkey_buf_copy(k, trans->c, indirect->k);
+		return 0;
+	}
+
+	ret = bch2_read_indirect_extent(trans, offset_into_extent, k);
+	if (!ret)
+		bch2_bkey_buf_copy(indirect, trans->c, k->k);
+	return ret;
+}
+
 static int bch2_fiemap(struct inode *vinode, struct fiemap_extent_info *info,
 		       u64 start, u64 len)
 {
@@ -886,10 +1046,10 @@ static int bch2_fiemap(struct inode *vinode, struct fiemap_extent_info *info,
 	struct btree_trans trans;
 	struct btree_iter *iter;
 	struct bkey_s_c k;
-	struct bkey_buf cur, prev;
+	struct bkey_buf cur, indirect;
+	struct fiemap_batch *batch;
 	struct bpos end = POS(ei->v.i_ino, (start + len) >> 9);
 	unsigned offset_into_extent, sectors;
-	bool have_extent = false;
 	int ret = 0;
 
 	ret = fiemap_prep(&ei->v, info, start, &len, FIEMAP_FLAG_SYNC);
@@ -899,12 +1059,19 @@ static int bch2_fiemap(struct inode *vinode, struct fiemap_extent_info *info,
 	if (start + len < start)
 		return -EINVAL;
 
+	batch = kmalloc(sizeof(*batch), GFP_KERNEL);
+	if (!batch)
+		return -ENOMEM;
+	batch->nr = 0;
+
 	bch2_bkey_buf_init(&cur);
-	bch2_bkey_buf_init(&prev);
+	bch2_bkey_buf_init(&indirect);
+	bkey_init(&indirect.k->k);
 	bch2_trans_init(&trans, c, 0, 0);
 
 	iter = bch2_trans_get_iter(&trans, BTREE_ID_EXTENTS,
-				   POS(ei->v.i_ino, start >> 9), 0);
+				   POS(ei->v.i_ino, start >> 9),
+				   BTREE_ITER_PREFETCH);
 retry:
 	while ((k = bch2_btree_iter_peek(iter)).k &&
 	       !(ret = bkey_err(k)) &&
@@ -921,13 +1088,12 @@ static int bch2_fiemap(struct inode *vinode, struct fiemap_extent_info *info,
 
 		bch2_bkey_buf_reassemble(&cur, c, k);
 
-		ret = bch2_read_indirect_extent(&trans,
+		ret = fiemap_read_indirect_extent(&trans, &indirect,
 					&offset_into_extent, &cur);
 		if (ret)
 			break;
 
 		k = bkey_i_to_s_c(cur.k);
-		bch2_bkey_buf_realloc(&prev, c, k.k->u64s);
 
 		sectors = min(sectors, k.k->size - offset_into_extent);
 
@@ -939,15 +1105,15 @@ static int bch2_fiemap(struct inode *vinode, struct fiemap_extent_info *info,
 		cur.k->k.p = iter->pos;
 		cur.k->k.p.offset += cur.k->k.size;
 
-		if (have_extent) {
-			ret = bch2_fill_extent(c, info,
-					bkey_i_to_s_c(prev.k), 0);
+		if (batch->nr + BCH_BKEY_PTRS_MAX > FIEMAP_BATCH) {
+			bch2_trans_unlock(&trans);
+
+			ret = fiemap_flush(info, batch, false);
 			if (ret)
 				break;
 		}
 
-		bkey_copy(prev.k, cur.k);
-		have_extent = true;
+		bch2_fill_extent(c, batch, bkey_i_to_s_c(cur.k), 0);
 
 		bch2_btree_iter_set_pos(iter,
 			POS(iter->pos.inode, iter->pos.offset + sectors));
@@ -956,13 +1122,14 @@ static int bch2_fiemap(struct inode *vinode, struct fiemap_extent_info *info,
 	if (ret == -EINTR)
 		goto retry;
 
-	if (!ret && have_extent)
-		ret = bch2_fill_extent(c, info, bkey_i_to_s_c(prev.k),
-				       FIEMAP_EXTENT_LAST);
-
 	ret = bch2_trans_exit(&trans) ?: ret;
+
+	if (!ret)
+		ret = fiemap_flush(info, batch, true);
+
+	bch2_bkey_buf_exit(&indirect, c);
 	bch2_bkey_buf_exit(&cur, c);
-	bch2_bkey_buf_exit(&prev, c);
+	kfree(batch);
 	return ret < 0 ? ret : 0;
 }
 
@@ -996,7 +1163,211 @@ static int bch2_vfs_readdir(struct file *file, struct dir_context *ctx)
 	if (!dir_emit_dots(file, ctx))
 		return 0;
 
-	return bch2_readdir(c, inode->v.i_ino, ctx);
+	/* getdents calls on a file are serialized by f_pos_lock: */
+	if (!file->private_data)
+		file->private_data = kzalloc(sizeof(struct readdir_buf),
+					     GFP_KERNEL);
+
+	if (!test_bit(EI_DIR_READDIR, &inode->ei_flags))
+		set_bit(EI_DIR_READDIR, &inode->ei_flags);
+
+	return bch2_readdir(c, inode->v.i_ino, ctx, file->private_data);
+}
+
+static int bch2_dir_release(struct inode *vinode, struct file *file)
+{
+	kfree(file->private_data);
+	return 0;
+}
+
+/*
+ * Cross file readahead:
+ *
+ * Reading many small files in readdir order (tar, rsync, build systems) costs
+ * an inode lookup, an extents lookup and a data read per file, each of them
+ * random IO - so once we see files being opened in readdir order, after a
+ * readdir of their directory, read the next opts.dir_readahead files' inodes
+ * (into the inode cache), first extents and, for small files, data (into the
+ * page cache) in the background.
+ *
+ * Readdir order is dirent hash order, so the dirent hash of the name a file was
+ * opened by tells us where we are; a new batch is started when opens get
+ * halfway through the last one.
+ */
+
+#define DIR_RA_MAX		128
+/* files up to this size are read in full: */
+#define DIR_RA_SMALL_FILE	(64 << 10)
+
+struct bch_dir_readahead {
+	struct work_struct	work;
+	struct bch_inode_info	*dir;
+	u64			pos;
+	u64			inums[DIR_RA_MAX];
+};
+
+static void bch2_inode_readahead(struct bch_fs *c, u64 inum)
+{
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct inode *vinode;
+	loff_t size;
+
+	vinode = bch2_vfs_inode_get(c, inum);
+	if (IS_ERR(vinode))
+		return;
+
+	size = i_size_read(vinode);
+
+	if (!S_ISREG(vinode->i_mode) || !size)
+		goto out;
+
+	if (size <= DIR_RA_SMALL_FILE) {
+		DEFINE_READAHEAD(ractl, NULL, vinode->i_mapping, 0);
+
+		if (!vinode->i_mapping->nrpages)
+			page_cache_ra_unbounded(&ractl,
+					DIV_ROUND_UP(size, PAGE_SIZE), 0);
+	} else {
+		bch2_trans_init(&trans, c, 0, 0);
+		iter = bch2_trans_get_iter(&trans, BTREE_ID_EXTENTS,
+					   POS(inum, 0), 0);
+		bch2_btree_iter_peek(iter);
+		bch2_trans_exit(&trans);
+	}
+out:
+	iput(vinode);
+}
+
+static int inum_cmp(const void *l, const void *r)
+{
+	return cmp_int(*((u64 *) l), *((u64 *) r));
+}
+
+static void bch2_dir_readahead_work(struct work_struct *work)
+{
+	struct bch_dir_readahead *ra =
+		container_of(work, struct bch_dir_readahead, work);
+	struct bch_inode_info *dir = ra->dir;
+	struct bch_fs *c = dir->v.i_sb->s_fs_info;
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	struct bkey_s_c_dirent d;
+	unsigned i, nr = 0, want = min_t(unsigned, c->opts.dir_readahead,
+					 DIR_RA_MAX);
+	u64 mark = U64_MAX, end = ra->pos;
+	int ret;
+
+	bch2_trans_init(&trans, c, 0, 0);
+
+	for_each_btree_key(&trans, iter, BTREE_ID_DIRENTS,
+			   POS(dir->v.i_ino, ra->pos + 1),
+			   BTREE_ITER_PREFETCH, k, ret) {
+		if (k.k->p.inode > dir->v.i_ino || nr >= want)
+			break;
+
+		if (k.k->type != KEY_TYPE_dirent)
+			continue;
+
+		d = bkey_s_c_to_dirent(k);
+		if (d.v->d_type != DT_REG)
+			continue;
+
+		ra->inums[nr++]	= le64_to_cpu(d.v->d_inum);
+		end		= k.k->p.offset;
+
+		if (nr == DIV_ROUND_UP(want, 2))
+			mark = end;
+	}
+	bch2_trans_iter_put(&trans, iter);
+	bch2_trans_exit(&trans);
+
+	/* If we hit the end of the directory, mark stays at U64_MAX: */
+	WRITE_ONCE(dir->ei_ra_end, end);
+	WRITE_ONCE(dir->ei_ra_mark, nr == want ? mark : U64_MAX);
+
+	/* In inode number order, so our inodes btree reads are sequential: */
+	sort(ra->inums, nr, sizeof(ra->inums[0]), inum_cmp, NULL);
+
+	for (i = 0; i < nr; i++)
+		bch2_inode_readahead(c, ra->inums[i]);
+
+	clear_bit_unlock(EI_DIR_READAHEAD, &dir->ei_flags);
+	iput(&dir->v);
+	kfree(ra);
+
+	if (atomic_dec_and_test(&c->nr_dir_readahead))
+		wake_up_var(&c->nr_dir_readahead);
+}
+
+static void bch2_dir_readahead(struct bch_fs *c, struct bch_inode_info *dir,
+			       const struct qstr *name)
+{
+	struct bch_dir_readahead *ra;
+	u64 pos, prev;
+
+	if (!c->opts.dir_readahead ||
+	    !test_bit(EI_DIR_READDIR, &dir->ei_flags))
+		return;
+
+	pos  = bch2_dirent_hash(&dir->ei_str_hash, name);
+	prev = xchg(&dir->ei_ra_pos, pos);
+
+	/* Only while files are being opened in readdir order: */
+	if (pos <= prev ||
+	    pos < READ_ONCE(dir->ei_ra_mark) ||
+	    test_and_set_bit_lock(EI_DIR_READAHEAD, &dir->ei_flags))
+		return;
+
+	ra = kmalloc(sizeof(*ra), GFP_KERNEL|__GFP_NOWARN);
+	if (!ra) {
+		clear_bit_unlock(EI_DIR_READAHEAD, &dir->ei_flags);
+		return;
+	}
+
+	INIT_WORK(&ra->work, bch2_dir_readahead_work);
+	ihold(&dir->v);
+	ra->dir = dir;
+	ra->pos = max(pos, READ_ONCE(dir->ei_ra_end));
+
+	atomic_inc(&c->nr_dir_readahead);
+	queue_work(system_unbound_wq, &ra->work);
+}
+
+static int bch2_file_open(struct inode *vinode, struct file *file)
+{
+	struct bch_fs *c = vinode->i_sb->s_fs_info;
+	struct name_snapshot name;
+	struct dentry *parent;
+
+	file->f_mode |= FMODE_NOWAIT;
+
+	if (c->opts.dir_readahead) {
+		/* We don't hold the parent's i_rwsem, the dentry may be renamed: */
+		take_dentry_name_snapshot(&name, file->f_path.dentry);
+		parent = dget_parent(file->f_path.dentry);
+		bch2_dir_readahead(c, to_bch_ei(d_inode(parent)), &name.name);
+		dput(parent);
+		release_dentry_name_snapshot(&name);
+	}
+
+	return generic_file_open(vinode, file);
+}
+
+static int bch2_file_release(struct inode *vinode, struct file *file)
+{
+	struct bch_fs *c = vinode->i_sb->s_fs_info;
+
+	/*
+	 * Last writer: hand back the quota reservation cached in the inode,
+	 * instead of leaving it charged until the inode is evicted. Dirty
+	 * pages hold their own reservations, so they aren't affected:
+	 */
+	if ((file->f_mode & FMODE_WRITE) &&
+	    atomic_read(&vinode->i_writecount) <= 1)
+		bch2_quota_reservation_flush(c, to_bch_ei(vinode));
+	return 0;
 }
 
 static const struct file_operations bch_file_operations = {
@@ -1004,7 +1375,8 @@ static const struct file_operations bch_file_operations = {
 	.read_iter	= bch2_read_iter,
 	.write_iter	= bch2_write_iter,
 	.mmap		= bch2_mmap,
-	.open		= generic_file_open,
+	.open		= bch2_file_open,
+	.release	= bch2_file_release,
 	.fsync		= bch2_fsync,
 	.splice_read	= generic_file_splice_read,
 #if 0
@@ -1054,6 +1426,7 @@ static const struct file_operations bch_dir_file_operations = {
 	.llseek		= bch2_dir_llseek,
 	.read		= generic_read_dir,
 	.iterate_shared	= bch2_vfs_readdir,
+	.release	= bch2_dir_release,
 	.fsync		= bch2_fsync,
 	.unlocked_ioctl = bch2_fs_file_ioctl,
 #ifdef CONFIG_COMPAT
@@ -1153,7 +1526,9 @@ static void bch2_vfs_inode_init(struct bch_fs *c,
 
 	inode->ei_flags		= 0;
 	inode->ei_journal_seq	= 0;
+	inode->ei_journal_seq_times = 0;
 	inode->ei_quota_reserved = 0;
+	inode->ei_quota_cached = 0;
 	inode->ei_str_hash	= bch2_hash_info_init(c, bi);
 	inode->ei_qid		= bch_qid(bi);
 
@@ -1192,6 +1567,13 @@ static struct inode *bch2_alloc_inode(struct super_block *sb)
 	pagecache_lock_init(&inode->ei_pagecache_lock);
 	mutex_init(&inode->ei_quota_lock);
 	inode->ei_journal_seq = 0;
+	inode->ei_journal_seq_times = 0;
+	atomic64_set(&inode->ei_xattr_present, 0);
+	INIT_WORK(&inode->ei_truncate_work, bch2_truncate_work);
+	atomic_set(&inode->ei_write_acks_pending, 0);
+	inode->ei_ra_pos = 0;
+	inode->ei_ra_mark = 0;
+	inode->ei_ra_end = 0;
 
 	return &inode->v;
 }
@@ -1229,9 +1611,14 @@ static int bch2_vfs_write_inode(struct inode *vinode,
 	struct bch_inode_info *inode = to_bch_ei(vinode);
 	int ret;
 
+	/*
+	 * Only timestamps are written here: use a separate journal sequence
+	 * number so that fdatasync doesn't have to wait on them:
+	 */
 	mutex_lock(&inode->ei_update_lock);
-	ret = bch2_write_inode(c, inode, inode_update_times_fn, NULL,
-			       ATTR_ATIME|ATTR_MTIME|ATTR_CTIME);
+	ret = __bch2_write_inode(c, inode, inode_update_times_fn, NULL,
+				 ATTR_ATIME|ATTR_MTIME|ATTR_CTIME,
+				 &inode->ei_journal_seq_times);
 	mutex_unlock(&inode->ei_update_lock);
 
 	return ret;
@@ -1243,17 +1630,26 @@ static void bch2_evict_inode(struct inode *vinode)
 	struct bch_inode_info *inode = to_bch_ei(vinode);
 
 	truncate_inode_pages_final(&inode->v.i_data);
+	bch2_inode_write_acks_wait(inode);
 
 	clear_inode(&inode->v);
 
+	bch2_quota_reservation_flush(c, inode);
 	BUG_ON(!is_bad_inode(&inode->v) && inode->ei_quota_reserved);
 
+	if (inode->v.i_nlink && !is_bad_inode(&inode->v))
+		bch2_journal_inode_evicted(&c->journal, inode->v.i_ino,
+					   max(inode->ei_journal_seq,
+					       inode->ei_journal_seq_times));
+
 	if (!inode->v.i_nlink && !is_bad_inode(&inode->v)) {
 		bch2_quota_acct(c, inode->ei_qid, Q_SPC, -((s64) inode->v.i_blocks),
 				KEY_TYPE_QUOTA_WARN);
 		bch2_quota_acct(c, inode->ei_qid, Q_INO, -1,
 				KEY_TYPE_QUOTA_WARN);
-		bch2_inode_rm(c, inode->v.i_ino, true);
+
+		if (!bch2_inode_rm_defer(c, inode->v.i_ino))
+			bch2_inode_rm(c, inode->v.i_ino, true);
 	}
 }
 
@@ -1261,7 +1657,7 @@ static int bch2_statfs(struct dentry *dentry, struct kstatfs *buf)
 {
 	struct super_block *sb = dentry->d_sb;
 	struct bch_fs *c = sb->s_fs_info;
-	struct bch_fs_usage_short usage = bch2_fs_usage_read_short(c);
+	struct bch_fs_usage_short usage = bch2_fs_usage_read_short_cached(c);
 	unsigned shift = sb->s_blocksize_bits - 9;
 	/*
 	 * this assumes inodes take up 64 bytes, which is a decent average
@@ -1617,6 +2013,19 @@ static void bch2_kill_sb(struct super_block *sb)
 {
 	struct bch_fs *c = sb->s_fs_info;
 
+	/*
+	 * Background dedup, truncates and directory readahead hold inode refs,
+	 * and have to be done before evict_inodes():
+	 */
+	down_write(&c->state_lock);
+	bch2_dedup_stop(c);
+	up_write(&c->state_lock);
+
+	wait_var_event(&c->nr_async_truncates,
+		       !atomic_read(&c->nr_async_truncates));
+	wait_var_event(&c->nr_dir_readahead,
+		       !atomic_read(&c->nr_dir_readahead));
+
 	generic_shutdown_super(sb);
 	bch2_fs_free(c);
 }
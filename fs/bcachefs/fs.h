@@ -13,23 +13,61 @@
 /*
  * Two-state lock - can be taken for add or block - both states are shared,
  * like read side of rwsem, but conflict with other state:
+ *
+ * The lock is striped by page cache offset, so that adds and blocks on
+ * disjoint ranges of a file don't exclude each other: each stripe covers every
+ * PAGECACHE_LOCK_STRIPES'th chunk of (1 << PAGECACHE_LOCK_STRIPE_SHIFT) pages,
+ * and a range is locked by taking every stripe it touches, all or nothing.
  */
+#define PAGECACHE_LOCK_STRIPES		8
+#define PAGECACHE_LOCK_STRIPE_SHIFT	9
+
 struct pagecache_lock {
-	atomic_long_t		v;
+	atomic_long_t		v[PAGECACHE_LOCK_STRIPES];
 	wait_queue_head_t	wait;
 };
 
 static inline void pagecache_lock_init(struct pagecache_lock *lock)
 {
-	atomic_long_set(&lock->v, 0);
+	unsigned i;
+
+	for (i = 0; i < PAGECACHE_LOCK_STRIPES; i++)
+		atomic_long_set(&lock->v[i], 0);
 	init_waitqueue_head(&lock->wait);
 }
 
-void bch2_pagecache_add_put(struct pagecache_lock *);
-bool bch2_pagecache_add_tryget(struct pagecache_lock *);
-void bch2_pagecache_add_get(struct pagecache_lock *);
-void bch2_pagecache_block_put(struct pagecache_lock *);
-void bch2_pagecache_block_get(struct pagecache_lock *);
+void bch2_pagecache_add_put_range(struct pagecache_lock *, pgoff_t, pgoff_t);
+bool bch2_pagecache_add_tryget_range(struct pagecache_lock *, pgoff_t, pgoff_t);
+void bch2_pagecache_add_get_range(struct pagecache_lock *, pgoff_t, pgoff_t);
+void bch2_pagecache_block_put_range(struct pagecache_lock *, pgoff_t, pgoff_t);
+void bch2_pagecache_block_get_range(struct pagecache_lock *, pgoff_t, pgoff_t);
+
+/* Whole file: */
+
+static inline void bch2_pagecache_add_put(struct pagecache_lock *lock)
+{
+	bch2_pagecache_add_put_range(lock, 0, ULONG_MAX);
+}
+
+static inline bool bch2_pagecache_add_tryget(struct pagecache_lock *lock)
+{
+	return bch2_pagecache_add_tryget_range(lock, 0, ULONG_MAX);
+}
+
+static inline void bch2_pagecache_add_get(struct pagecache_lock *lock)
+{
+	bch2_pagecache_add_get_range(lock, 0, ULONG_MAX);
+}
+
+static inline void bch2_pagecache_block_put(struct pagecache_lock *lock)
+{
+	bch2_pagecache_block_put_range(lock, 0, ULONG_MAX);
+}
+
+static inline void bch2_pagecache_block_get(struct pagecache_lock *lock)
+{
+	bch2_pagecache_block_get_range(lock, 0, ULONG_MAX);
+}
 
 struct bch_inode_info {
 	struct inode		v;
@@ -37,7 +75,10 @@ struct bch_inode_info {
 
 	struct mutex		ei_update_lock;
 	u64			ei_journal_seq;
+	/* timestamp only updates, not needed by fdatasync: */
+	u64			ei_journal_seq_times;
 	u64			ei_quota_reserved;
+	u64			ei_quota_cached;
 	unsigned long		ei_last_dirtied;
 
 	struct pagecache_lock	ei_pagecache_lock;
@@ -47,6 +88,33 @@ struct bch_inode_info {
 
 	struct bch_hash_info	ei_str_hash;
 
+	/*
+	 * Negative xattr lookup cache: low bits are a bitmap, by hash of type
+	 * and name, of xattrs that exist, then a valid bit; high bits are a
+	 * sequence number, bumped whenever an xattr on this inode is set - see
+	 * bch2_xattr_get():
+	 */
+	atomic64_t		ei_xattr_present;
+
+	/* Background deletion of extents past i_size - see bch2_truncate(): */
+	struct work_struct	ei_truncate_work;
+	u64			ei_truncate_start;
+
+	/*
+	 * Replica writes still in flight from writes that were completed early
+	 * (write_early_ack) - fsync and eviction wait for them:
+	 */
+	atomic_t		ei_write_acks_pending;
+
+	/*
+	 * For directories, cross file readahead - dirent positions of the last
+	 * file opened, of the file that triggers the next readahead, and of the
+	 * last file read ahead. See bch2_dir_readahead():
+	 */
+	u64			ei_ra_pos;
+	u64			ei_ra_mark;
+	u64			ei_ra_end;
+
 	/* copy of inode in btree: */
 	struct bch_inode_unpacked ei_inode;
 };
@@ -57,6 +125,26 @@ struct bch_inode_info {
  */
 #define EI_INODE_ERROR			0
 
+/*
+ * Set while extents past i_size are being deleted in the background, after a
+ * truncate; anything that may write past i_size waits for it:
+ */
+#define EI_INODE_TRUNCATING		1
+
+/*
+ * Set once space has been preallocated with fallocate: writes to this inode
+ * get a write point of their own, so that they're laid out contiguously
+ * instead of being interleaved with whatever else the writer is writing:
+ */
+#define EI_INODE_PREALLOCATED		2
+
+/*
+ * Set on a directory once it's been read with readdir, and while cross file
+ * readahead for it is running:
+ */
+#define EI_DIR_READDIR			3
+#define EI_DIR_READAHEAD		4
+
 #define to_bch_ei(_inode)					\
 	container_of_or_null(_inode, struct bch_inode_info, v)
 
@@ -112,6 +200,12 @@ static inline struct bch_inode_info *file_bch_inode(struct file *file)
 	return to_bch_ei(file_inode(file));
 }
 
+static inline void bch2_inode_write_acks_wait(struct bch_inode_info *inode)
+{
+	wait_var_event(&inode->ei_write_acks_pending,
+		       !atomic_read(&inode->ei_write_acks_pending));
+}
+
 static inline bool inode_attr_changing(struct bch_inode_info *dir,
 				struct bch_inode_info *inode,
 				enum inode_opt_id id)
@@ -166,8 +260,17 @@ void bch2_inode_update_after_write(struct bch_fs *,
 				   struct bch_inode_info *,
 				   struct bch_inode_unpacked *,
 				   unsigned);
-int __must_check bch2_write_inode(struct bch_fs *, struct bch_inode_info *,
-				  inode_set_fn, void *, unsigned);
+int __must_check __bch2_write_inode(struct bch_fs *, struct bch_inode_info *,
+				    inode_set_fn, void *, unsigned, u64 *);
+
+static inline int __must_check bch2_write_inode(struct bch_fs *c,
+					struct bch_inode_info *inode,
+					inode_set_fn set,
+					void *p, unsigned fields)
+{
+	return __bch2_write_inode(c, inode, set, p, fields,
+				  &inode->ei_journal_seq);
+}
 
 void bch2_vfs_exit(void);
 int bch2_vfs_init(void);
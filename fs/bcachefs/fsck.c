@@ -3,17 +3,23 @@
 #include "bcachefs.h"
 #include "bkey_buf.h"
 #include "btree_update.h"
+#include "clock.h"
 #include "dirent.h"
 #include "error.h"
 #include "fs-common.h"
 #include "fsck.h"
 #include "inode.h"
 #include "keylist.h"
+#include "move.h"
 #include "super.h"
 #include "xattr.h"
 
+#include <linux/bsearch.h>
 #include <linux/dcache.h> /* struct qstr */
 #include <linux/generic-radix-tree.h>
+#include <linux/kthread.h>
+#include <linux/math64.h>
+#include <linux/sort.h>
 
 #define QSTR(n) { { { .len = strlen(n) } }, .name = n }
 
@@ -107,11 +113,21 @@ static int reattach_inode(struct bch_fs *c,
 	return ret;
 }
 
+/*
+ * The passes that walk keys per inode see inode numbers in increasing order, so
+ * the inode for each new inode number is found with a cursor over the inodes
+ * btree that's advanced in step with the btree being checked - a merge join,
+ * with the inodes btree prefetched - instead of a fresh lookup each time.
+ *
+ * This reads the inodes btree directly, not through the key cache, as
+ * bch2_gc_walk_inodes() does: fsck also updates inodes in the btree directly.
+ */
 struct inode_walker {
 	bool			first_this_inode;
 	bool			have_inode;
 	u64			cur_inum;
 	struct bch_inode_unpacked inode;
+	struct btree_iter	*iter;
 };
 
 static struct inode_walker inode_walker_init(void)
@@ -122,12 +138,35 @@ static struct inode_walker inode_walker_init(void)
 	};
 }
 
+static int inode_walker_lookup(struct btree_trans *trans,
+			       struct inode_walker *w, u64 inum)
+{
+	struct bkey_s_c k;
+	int ret;
+
+	if (!w->iter)
+		w->iter = bch2_trans_get_iter(trans, BTREE_ID_INODES,
+					      POS(0, inum),
+					      BTREE_ITER_SLOTS|
+					      BTREE_ITER_PREFETCH);
+	else
+		bch2_btree_iter_set_pos(w->iter, POS(0, inum));
+
+	k = bch2_btree_iter_peek_slot(w->iter);
+	ret = bkey_err(k);
+	if (ret)
+		return ret;
+
+	return k.k->type == KEY_TYPE_inode
+		? bch2_inode_unpack(bkey_s_c_to_inode(k), &w->inode)
+		: -ENOENT;
+}
+
 static int walk_inode(struct btree_trans *trans,
 		      struct inode_walker *w, u64 inum)
 {
 	if (inum != w->cur_inum) {
-		int ret = bch2_inode_find_by_inum_trans(trans, inum,
-							&w->inode);
+		int ret = inode_walker_lookup(trans, w, inum);
 
 		if (ret && ret != -ENOENT)
 			return ret;
@@ -142,6 +181,44 @@ static int walk_inode(struct btree_trans *trans,
 	return 0;
 }
 
+/*
+ * Dirent targets are found with their own cursor: files created in the same
+ * directory tend to have nearby inode numbers, so these lookups are mostly
+ * sequential too. Only the mode is needed, and it's cached for recently seen
+ * inodes, so that repeated targets don't need a lookup at all:
+ */
+#define FSCK_INODE_CACHE_NR	64
+
+struct inode_mode_cache {
+	struct inode_walker	w;
+	struct {
+		u64		inum;
+		u32		mode;
+		bool		exists;
+	}			e[FSCK_INODE_CACHE_NR]; /* zeroed: inode 0 doesn't exist */
+};
+
+static int inode_mode_lookup(struct btree_trans *trans,
+			     struct inode_mode_cache *cache,
+			     u64 inum, u32 *mode)
+{
+	unsigned i = hash_64(inum, ilog2(FSCK_INODE_CACHE_NR));
+	int ret;
+
+	if (cache->e[i].inum != inum) {
+		ret = inode_walker_lookup(trans, &cache->w, inum);
+		if (ret && ret != -ENOENT)
+			return ret;
+
+		cache->e[i].inum	= inum;
+		cache->e[i].exists	= !ret;
+		cache->e[i].mode	= !ret ? cache->w.inode.bi_mode : 0;
+	}
+
+	*mode = cache->e[i].mode;
+	return cache->e[i].exists ? 0 : -ENOENT;
+}
+
 struct hash_check {
 	struct bch_hash_info	info;
 
@@ -458,7 +535,7 @@ static int bch2_fix_overlapping_extent(struct btree_trans *trans,
  * that i_size an i_sectors are consistent
  */
 noinline_for_stack
-static int check_extents(struct bch_fs *c)
+static int check_extents(struct bch_fs *c, u64 start, u64 end)
 {
 	struct inode_walker w = inode_walker_init();
 	struct btree_trans trans;
@@ -472,13 +549,14 @@ static int check_extents(struct bch_fs *c)
 	prev.k->k = KEY(0, 0, 0);
 	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 0);
 
-	bch_verbose(c, "checking extents");
-
 	iter = bch2_trans_get_iter(&trans, BTREE_ID_EXTENTS,
-				   POS(BCACHEFS_ROOT_INO, 0),
+				   POS(max_t(u64, start, BCACHEFS_ROOT_INO), 0),
 				   BTREE_ITER_INTENT);
 retry:
 	for_each_btree_key_continue(iter, 0, k, ret) {
+		if (k.k->p.inode >= end)
+			break;
+
 		/*
 		 * due to retry errors we might see the same extent twice:
 		 */
@@ -578,9 +656,10 @@ static int check_extents(struct bch_fs *c)
  * validate d_type
  */
 noinline_for_stack
-static int check_dirents(struct bch_fs *c)
+static int check_dirents(struct bch_fs *c, u64 start, u64 end)
 {
 	struct inode_walker w = inode_walker_init();
+	struct inode_mode_cache *targets;
 	struct hash_check h;
 	struct btree_trans trans;
 	struct btree_iter *iter;
@@ -589,21 +668,28 @@ static int check_dirents(struct bch_fs *c)
 	char buf[200];
 	int ret = 0;
 
-	bch_verbose(c, "checking dirents");
+	targets = kzalloc(sizeof(*targets), GFP_KERNEL);
+	if (!targets)
+		return -ENOMEM;
+
+	targets->w = inode_walker_init();
 
 	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 0);
 
 	hash_check_init(&h);
 
 	iter = bch2_trans_get_iter(&trans, BTREE_ID_DIRENTS,
-				   POS(BCACHEFS_ROOT_INO, 0), 0);
+				   POS(max_t(u64, start, BCACHEFS_ROOT_INO), 0), 0);
 retry:
 	for_each_btree_key_continue(iter, 0, k, ret) {
 		struct bkey_s_c_dirent d;
-		struct bch_inode_unpacked target;
 		bool have_target;
+		u32 target_mode;
 		u64 d_inum;
 
+		if (k.k->p.inode >= end)
+			break;
+
 		ret = walk_inode(&trans, &w, k.k->p.inode);
 		if (ret)
 			break;
@@ -673,7 +759,7 @@ static int check_dirents(struct bch_fs *c)
 			continue;
 		}
 
-		ret = bch2_inode_find_by_inum_trans(&trans, d_inum, &target);
+		ret = inode_mode_lookup(&trans, targets, d_inum, &target_mode);
 		if (ret && ret != -ENOENT)
 			break;
 
@@ -692,9 +778,9 @@ static int check_dirents(struct bch_fs *c)
 
 		if (fsck_err_on(have_target &&
 				d.v->d_type !=
-				mode_to_type(target.bi_mode), c,
+				mode_to_type(target_mode), c,
 				"incorrect d_type: should be %u:\n%s",
-				mode_to_type(target.bi_mode),
+				mode_to_type(target_mode),
 				(bch2_bkey_val_to_text(&PBUF(buf), c,
 						       k), buf))) {
 			struct bkey_i_dirent *n;
@@ -706,7 +792,7 @@ static int check_dirents(struct bch_fs *c)
 			}
 
 			bkey_reassemble(&n->k_i, d.s_c);
-			n->v.d_type = mode_to_type(target.bi_mode);
+			n->v.d_type = mode_to_type(target_mode);
 
 			ret = __bch2_trans_do(&trans, NULL, NULL,
 					      BTREE_INSERT_NOFAIL|
@@ -725,14 +811,16 @@ static int check_dirents(struct bch_fs *c)
 	if (ret == -EINTR)
 		goto retry;
 
-	return bch2_trans_exit(&trans) ?: ret;
+	ret = bch2_trans_exit(&trans) ?: ret;
+	kfree(targets);
+	return ret;
 }
 
 /*
  * Walk xattrs: verify that they all have a corresponding inode
  */
 noinline_for_stack
-static int check_xattrs(struct bch_fs *c)
+static int check_xattrs(struct bch_fs *c, u64 start, u64 end)
 {
 	struct inode_walker w = inode_walker_init();
 	struct hash_check h;
@@ -741,16 +829,17 @@ static int check_xattrs(struct bch_fs *c)
 	struct bkey_s_c k;
 	int ret = 0;
 
-	bch_verbose(c, "checking xattrs");
-
 	hash_check_init(&h);
 
 	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 0);
 
 	iter = bch2_trans_get_iter(&trans, BTREE_ID_XATTRS,
-				   POS(BCACHEFS_ROOT_INO, 0), 0);
+				   POS(max_t(u64, start, BCACHEFS_ROOT_INO), 0), 0);
 retry:
 	for_each_btree_key_continue(iter, 0, k, ret) {
+		if (k.k->p.inode >= end)
+			break;
+
 		ret = walk_inode(&trans, &w, k.k->p.inode);
 		if (ret)
 			break;
@@ -864,36 +953,189 @@ static int check_lostfound(struct bch_fs *c,
 	return ret;
 }
 
-typedef GENRADIX(unsigned long) inode_bitmap;
-
-static inline bool inode_bitmap_test(inode_bitmap *b, size_t nr)
-{
-	unsigned long *w = genradix_ptr(b, nr / BITS_PER_LONG);
-	return w ? test_bit(nr & (BITS_PER_LONG - 1), w) : false;
+/*
+ * Directory structure and nlinks:
+ *
+ * Both are checked from a single pass over the dirents btree, which records
+ * what those checks need in flat arrays - memory used is proportional to the
+ * number of dirents, not to the highest inode number, and the dirents btree is
+ * never walked again:
+ *
+ * - directory dirents, as (parent, child, offset) edges: the dirents btree is
+ *   ordered by directory, so these come out sorted by parent and the DFS from
+ *   the root is done in memory
+ * - the target of every other dirent, for counting links
+ * - every directory that has dirents, for finding unreachable directories that
+ *   aren't empty
+ *
+ * Arrays are limited to an eighth of memory each: if they'd be any bigger, or
+ * allocating them fails, we fall back to walking the btrees directly - see
+ * check_dirs_and_nlinks().
+ */
+#define fsck_array(_type)						\
+struct {								\
+	size_t		nr;						\
+	size_t		size;						\
+	_type		*data;						\
 }
 
-static inline int inode_bitmap_set(inode_bitmap *b, size_t nr)
+static int __fsck_array_grow(void **data, size_t *size, size_t nr,
+			     size_t elem_size)
 {
-	unsigned long *w = genradix_ptr_alloc(b, nr / BITS_PER_LONG, GFP_KERNEL);
+	size_t new_size = max_t(size_t, 256, *size * 2);
+	void *n;
 
-	if (!w)
+	if (nr < *size)
+		return 0;
+
+	if (new_size * elem_size > (totalram_pages() << PAGE_SHIFT) / 8)
 		return -ENOMEM;
 
-	*w |= 1UL << (nr & (BITS_PER_LONG - 1));
+	n = kvpmalloc(new_size * elem_size, GFP_KERNEL);
+	if (!n)
+		return -ENOMEM;
+
+	if (*data)
+		memcpy(n, *data, nr * elem_size);
+	kvpfree(*data, *size * elem_size);
+
+	*data	= n;
+	*size	= new_size;
 	return 0;
 }
 
+#define fsck_array_push(_a, _v)						\
+({									\
+	int _ret = __fsck_array_grow((void **) &(_a)->data, &(_a)->size,\
+				     (_a)->nr, sizeof((_a)->data[0]));	\
+	if (!_ret)							\
+		(_a)->data[(_a)->nr++] = (_v);				\
+	_ret;								\
+})
+
+#define fsck_array_exit(_a)						\
+do {									\
+	kvpfree((_a)->data, (_a)->size * sizeof((_a)->data[0]));	\
+	memset((_a), 0, sizeof(*(_a)));					\
+} while (0)
+
+struct dir_edge {
+	u64		parent;
+	u64		child;		/* 0 once the dirent has been removed */
+	u64		offset;
+};
+
+typedef fsck_array(u64) inum_array;
+
+struct fsck_dirents {
+	fsck_array(struct dir_edge) subdirs;
+	inum_array	targets;
+	inum_array	nonempty_dirs;
+	/* directories fsck linked into lost+found: */
+	inum_array	reattached;
+};
+
+static void fsck_dirents_exit(struct fsck_dirents *d)
+{
+	fsck_array_exit(&d->reattached);
+	fsck_array_exit(&d->nonempty_dirs);
+	fsck_array_exit(&d->targets);
+	fsck_array_exit(&d->subdirs);
+}
+
+static int inum_cmp(const void *_l, const void *_r)
+{
+	const u64 *l = _l, *r = _r;
+
+	return cmp_int(*l, *r);
+}
+
+static bool inum_array_has(inum_array *a, u64 inum)
+{
+	return bsearch(&inum, a->data, a->nr, sizeof(a->data[0]), inum_cmp);
+}
+
+/* index of the first subdirectory edge from @parent, or where it would be: */
+static size_t subdirs_first(struct fsck_dirents *d, u64 parent)
+{
+	size_t l = 0, r = d->subdirs.nr;
+
+	while (l < r) {
+		size_t m = l + (r - l) / 2;
+
+		if (d->subdirs.data[m].parent < parent)
+			l = m + 1;
+		else
+			r = m;
+	}
+
+	return l;
+}
+
+noinline_for_stack
+static int walk_dirents(struct bch_fs *c, struct fsck_dirents *d)
+{
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	struct bkey_s_c_dirent dirent;
+	u64 d_inum, last_dir = 0;
+	int ret;
+
+	bch_verbose(c, "walking dirents");
+
+	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 0);
+
+	for_each_btree_key(&trans, iter, BTREE_ID_DIRENTS, POS_MIN,
+			   BTREE_ITER_PREFETCH, k, ret) {
+		if (k.k->type != KEY_TYPE_dirent)
+			continue;
+
+		dirent = bkey_s_c_to_dirent(k);
+		d_inum = le64_to_cpu(dirent.v->d_inum);
+
+		if (k.k->p.inode != last_dir) {
+			ret = fsck_array_push(&d->nonempty_dirs, k.k->p.inode);
+			if (ret)
+				break;
+			last_dir = k.k->p.inode;
+		}
+
+		if (dirent.v->d_type == DT_DIR)
+			ret = fsck_array_push(&d->subdirs, ((struct dir_edge) {
+				.parent	= k.k->p.inode,
+				.child	= d_inum,
+				.offset	= k.k->p.offset,
+			}));
+		else
+			ret = fsck_array_push(&d->targets, d_inum);
+		if (ret)
+			break;
+
+		bch2_trans_cond_resched(&trans);
+	}
+	ret = bch2_trans_exit(&trans) ?: ret;
+	/* -ENOMEM means the caller falls back to walking the btree: */
+	if (ret && ret != -ENOMEM)
+		bch_err(c, "error in fsck: error %i while walking dirents", ret);
+
+	return ret;
+}
+
 struct pathbuf {
 	size_t		nr;
 	size_t		size;
 
 	struct pathbuf_entry {
 		u64	inum;
+		/* next subdirectory edge to look at: */
+		size_t	edge;
+		/* or, when walking the dirents btree, the last dirent seen: */
 		u64	offset;
 	}		*entries;
 };
 
-static int path_down(struct pathbuf *p, u64 inum)
+static int path_down(struct pathbuf *p, u64 inum, size_t edge)
 {
 	if (p->nr == p->size) {
 		size_t new_size = max_t(size_t, 256UL, p->size * 2);
@@ -909,105 +1151,165 @@ static int path_down(struct pathbuf *p, u64 inum)
 
 	p->entries[p->nr++] = (struct pathbuf_entry) {
 		.inum = inum,
+		.edge = edge,
 		.offset = 0,
 	};
 	return 0;
 }
 
-noinline_for_stack
-static int check_directory_structure(struct bch_fs *c,
-				     struct bch_inode_unpacked *lostfound_inode)
+static int remove_subdir_dirent(struct btree_trans *trans,
+				struct dir_edge *e)
 {
-	inode_bitmap dirs_done;
-	struct pathbuf path = { 0, 0, NULL };
-	struct pathbuf_entry *e;
-	struct btree_trans trans;
 	struct btree_iter *iter;
 	struct bkey_s_c k;
-	struct bkey_s_c_dirent dirent;
-	bool had_unreachable;
-	u64 d_inum;
-	int ret = 0;
+	int ret;
+retry:
+	bch2_trans_begin(trans);
+
+	iter = bch2_trans_get_iter(trans, BTREE_ID_DIRENTS,
+				   POS(e->parent, e->offset),
+				   BTREE_ITER_SLOTS);
+	k = bch2_btree_iter_peek_slot(iter);
+	ret = bkey_err(k);
+	if (!ret &&
+	    k.k->type == KEY_TYPE_dirent &&
+	    le64_to_cpu(bkey_s_c_to_dirent(k).v->d_inum) == e->child)
+		ret = remove_dirent(trans, bkey_s_c_to_dirent(k));
+	bch2_trans_iter_put(trans, iter);
 
-	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 0);
+	if (ret == -EINTR)
+		goto retry;
+	if (!ret)
+		e->child = 0;
+	return ret;
+}
 
-	bch_verbose(c, "checking directory structure");
+struct dirs_seen {
+	inum_array	inums;
+	unsigned long	*seen;
+};
 
-	/* DFS: */
-restart_dfs:
-	genradix_init(&dirs_done);
-	had_unreachable = false;
+static int dirs_seen_init(struct fsck_dirents *d, struct dirs_seen *s)
+{
+	size_t i, j;
+	int ret;
 
-	ret = inode_bitmap_set(&dirs_done, BCACHEFS_ROOT_INO);
-	if (ret) {
-		bch_err(c, "memory allocation failure in inode_bitmap_set()");
-		goto err;
+	ret = fsck_array_push(&s->inums, BCACHEFS_ROOT_INO);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < d->subdirs.nr; i++) {
+		ret = fsck_array_push(&s->inums, d->subdirs.data[i].child);
+		if (ret)
+			return ret;
 	}
 
-	ret = path_down(&path, BCACHEFS_ROOT_INO);
-	if (ret)
-		goto err;
+	sort(s->inums.data, s->inums.nr, sizeof(s->inums.data[0]),
+	     inum_cmp, NULL);
 
-	while (path.nr) {
-next:
-		e = &path.entries[path.nr - 1];
+	for (i = j = 0; i < s->inums.nr; i++)
+		if (!j || s->inums.data[j - 1] != s->inums.data[i])
+			s->inums.data[j++] = s->inums.data[i];
+	s->inums.nr = j;
 
-		if (e->offset == U64_MAX)
-			goto up;
+	s->seen = kvpmalloc(BITS_TO_LONGS(s->inums.nr) * sizeof(unsigned long),
+			    GFP_KERNEL|__GFP_ZERO);
+	return s->seen ? 0 : -ENOMEM;
+}
 
-		for_each_btree_key(&trans, iter, BTREE_ID_DIRENTS,
-				   POS(e->inum, e->offset + 1), 0, k, ret) {
-			if (k.k->p.inode != e->inum)
-				break;
+static void dirs_seen_exit(struct dirs_seen *s)
+{
+	kvpfree(s->seen, BITS_TO_LONGS(s->inums.nr) * sizeof(unsigned long));
+	fsck_array_exit(&s->inums);
+}
 
-			e->offset = k.k->p.offset;
+/*
+ * Marks @inum as seen, returning true if it already was: directories nothing
+ * points to aren't tracked, but they can't be reached twice either
+ */
+static bool dirs_seen_test_and_set(struct dirs_seen *s, u64 inum)
+{
+	u64 *i = bsearch(&inum, s->inums.data, s->inums.nr,
+			 sizeof(s->inums.data[0]), inum_cmp);
 
-			if (k.k->type != KEY_TYPE_dirent)
-				continue;
+	return i ? __test_and_set_bit(i - s->inums.data, s->seen) : false;
+}
 
-			dirent = bkey_s_c_to_dirent(k);
+static int dir_dfs(struct btree_trans *trans, struct fsck_dirents *d,
+		   struct dirs_seen *s, struct pathbuf *path, u64 inum)
+{
+	struct bch_fs *c = trans->c;
+	struct pathbuf_entry *p;
+	struct dir_edge *e;
+	int ret = 0;
 
-			if (dirent.v->d_type != DT_DIR)
-				continue;
+	dirs_seen_test_and_set(s, inum);
 
-			d_inum = le64_to_cpu(dirent.v->d_inum);
+	ret = path_down(path, inum, subdirs_first(d, inum));
+	if (ret)
+		return ret;
 
-			if (fsck_err_on(inode_bitmap_test(&dirs_done, d_inum), c,
-					"directory %llu has multiple hardlinks",
-					d_inum)) {
-				ret = remove_dirent(&trans, dirent);
-				if (ret)
-					goto err;
-				continue;
-			}
+	while (path->nr) {
+		p = &path->entries[path->nr - 1];
 
-			ret = inode_bitmap_set(&dirs_done, d_inum);
-			if (ret) {
-				bch_err(c, "memory allocation failure in inode_bitmap_set()");
-				goto err;
-			}
+		if (p->edge >= d->subdirs.nr ||
+		    d->subdirs.data[p->edge].parent != p->inum) {
+			path->nr--;
+			continue;
+		}
 
-			ret = path_down(&path, d_inum);
-			if (ret) {
-				goto err;
-			}
+		e = &d->subdirs.data[p->edge++];
 
-			ret = bch2_trans_iter_free(&trans, iter);
-			if (ret) {
-				bch_err(c, "btree error %i in fsck", ret);
-				goto err;
+		if (dirs_seen_test_and_set(s, e->child)) {
+			if (fsck_err(c, "directory %llu has multiple hardlinks",
+				     e->child)) {
+				ret = remove_subdir_dirent(trans, e);
+				if (ret)
+					break;
 			}
-			goto next;
-		}
-		ret = bch2_trans_iter_free(&trans, iter) ?: ret;
-		if (ret) {
-			bch_err(c, "btree error %i in fsck", ret);
-			goto err;
+			continue;
 		}
-up:
-		path.nr--;
+
+		ret = path_down(path, e->child, subdirs_first(d, e->child));
+		if (ret)
+			break;
+	}
+fsck_err:
+	path->nr = 0;
+	return ret;
+}
+
+noinline_for_stack
+static int check_directory_structure(struct bch_fs *c,
+				     struct bch_inode_unpacked *lostfound_inode,
+				     struct fsck_dirents *d)
+{
+	struct dirs_seen s = { { 0 } };
+	struct pathbuf path = { 0, 0, NULL };
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	u64 inum;
+	int ret = 0;
+
+	bch_verbose(c, "checking directory structure");
+
+	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 0);
+
+	ret = dirs_seen_init(d, &s);
+	if (ret) {
+		bch_err(c, "memory allocation failure checking directory structure");
+		goto err;
 	}
 
+	ret = dir_dfs(&trans, d, &s, &path, BCACHEFS_ROOT_INO);
+	if (ret)
+		goto err;
+
+	/*
+	 * Directories the DFS didn't reach are reattached to lost+found, then
+	 * walked from there - which finds any loops they were part of:
+	 */
 	iter = bch2_trans_get_iter(&trans, BTREE_ID_INODES, POS_MIN, 0);
 retry:
 	for_each_btree_key_continue(iter, 0, k, ret) {
@@ -1017,41 +1319,30 @@ static int check_directory_structure(struct bch_fs *c,
 		if (!S_ISDIR(le16_to_cpu(bkey_s_c_to_inode(k).v->bi_mode)))
 			continue;
 
-		ret = bch2_empty_dir_trans(&trans, k.k->p.inode);
-		if (ret == -EINTR)
-			goto retry;
-		if (!ret)
+		inum = k.k->p.offset;
+
+		if (!inum_array_has(&d->nonempty_dirs, inum) ||
+		    dirs_seen_test_and_set(&s, inum))
 			continue;
 
-		if (fsck_err_on(!inode_bitmap_test(&dirs_done, k.k->p.offset), c,
-				"unreachable directory found (inum %llu)",
-				k.k->p.offset)) {
+		if (fsck_err(c, "unreachable directory found (inum %llu)",
+			     inum)) {
 			bch2_trans_unlock(&trans);
 
-			ret = reattach_inode(c, lostfound_inode, k.k->p.offset);
-			if (ret) {
-				goto err;
-			}
-
-			had_unreachable = true;
+			ret = reattach_inode(c, lostfound_inode, inum) ?:
+				fsck_array_push(&d->reattached, inum) ?:
+				dir_dfs(&trans, d, &s, &path, inum);
+			if (ret)
+				break;
 		}
 	}
-	bch2_trans_iter_free(&trans, iter);
-	if (ret)
-		goto err;
-
-	if (had_unreachable) {
-		bch_info(c, "reattached unreachable directories, restarting pass to check for loops");
-		genradix_free(&dirs_done);
-		kfree(path.entries);
-		memset(&dirs_done, 0, sizeof(dirs_done));
-		memset(&path, 0, sizeof(path));
-		goto restart_dfs;
-	}
+	if (ret == -EINTR)
+		goto retry;
+	bch2_trans_iter_put(&trans, iter);
 err:
 fsck_err:
 	ret = bch2_trans_exit(&trans) ?: ret;
-	genradix_free(&dirs_done);
+	dirs_seen_exit(&s);
 	kfree(path.entries);
 	return ret;
 }
@@ -1061,67 +1352,75 @@ struct nlink {
 	u32	dir_count;
 };
 
-typedef GENRADIX(struct nlink) nlink_table;
-
-static void inc_link(struct bch_fs *c, nlink_table *links,
-		     u64 range_start, u64 *range_end,
-		     u64 inum, bool dir)
-{
-	struct nlink *link;
-
-	if (inum < range_start || inum >= *range_end)
-		return;
-
-	link = genradix_ptr_alloc(links, inum - range_start, GFP_KERNEL);
-	if (!link) {
-		bch_verbose(c, "allocation failed during fsck - will need another pass");
-		*range_end = inum;
-		return;
-	}
+struct nlink_entry {
+	u64		inum;
+	struct nlink	l;
+};
 
-	if (dir)
-		link->dir_count++;
-	else
-		link->count++;
-}
+typedef fsck_array(struct nlink_entry) nlink_table;
 
-noinline_for_stack
-static int bch2_gc_walk_dirents(struct bch_fs *c, nlink_table *links,
-			       u64 range_start, u64 *range_end)
+/*
+ * Builds the nlink table from what walk_dirents() found: sorts the inode number
+ * of every link and every directory's parent, and counts runs:
+ */
+static int nlink_table_build(struct bch_fs *c, struct fsck_dirents *d,
+			     u64 lostfound_inum, nlink_table *links)
 {
-	struct btree_trans trans;
-	struct btree_iter *iter;
-	struct bkey_s_c k;
-	struct bkey_s_c_dirent d;
-	u64 d_inum;
+	inum_array parents = { 0 };
+	struct dir_edge *e;
+	struct nlink_entry n;
+	size_t i = 0, j = 0;
 	int ret;
 
-	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 0);
+	ret = fsck_array_push(&d->targets, BCACHEFS_ROOT_INO);
+	if (ret)
+		goto err;
 
-	inc_link(c, links, range_start, range_end, BCACHEFS_ROOT_INO, false);
+	for (e = d->subdirs.data;
+	     e < d->subdirs.data + d->subdirs.nr;
+	     e++) {
+		if (!e->child)
+			continue;
 
-	for_each_btree_key(&trans, iter, BTREE_ID_DIRENTS, POS_MIN, 0, k, ret) {
-		switch (k.k->type) {
-		case KEY_TYPE_dirent:
-			d = bkey_s_c_to_dirent(k);
-			d_inum = le64_to_cpu(d.v->d_inum);
+		ret = fsck_array_push(&d->targets, e->child) ?:
+			fsck_array_push(&parents, e->parent);
+		if (ret)
+			goto err;
+	}
+	fsck_array_exit(&d->subdirs);
 
-			if (d.v->d_type == DT_DIR)
-				inc_link(c, links, range_start, range_end,
-					 d.k->p.inode, true);
+	for (i = 0; i < d->reattached.nr; i++) {
+		ret = fsck_array_push(&d->targets, d->reattached.data[i]) ?:
+			fsck_array_push(&parents, lostfound_inum);
+		if (ret)
+			goto err;
+	}
 
-			inc_link(c, links, range_start, range_end,
-				 d_inum, false);
+	sort(d->targets.data, d->targets.nr, sizeof(d->targets.data[0]),
+	     inum_cmp, NULL);
+	sort(parents.data, parents.nr, sizeof(parents.data[0]),
+	     inum_cmp, NULL);
 
-			break;
-		}
+	i = 0;
+	while (i < d->targets.nr || j < parents.nr) {
+		n.inum = min(i < d->targets.nr	? d->targets.data[i]	: U64_MAX,
+			     j < parents.nr	? parents.data[j]	: U64_MAX);
+		n.l.count = n.l.dir_count = 0;
 
-		bch2_trans_cond_resched(&trans);
+		for (; i < d->targets.nr && d->targets.data[i] == n.inum; i++)
+			n.l.count++;
+		for (; j < parents.nr && parents.data[j] == n.inum; j++)
+			n.l.dir_count++;
+
+		ret = fsck_array_push(links, n);
+		if (ret)
+			goto err;
 	}
-	ret = bch2_trans_exit(&trans) ?: ret;
+err:
+	fsck_array_exit(&parents);
+	fsck_array_exit(&d->targets);
 	if (ret)
-		bch_err(c, "error in fsck: btree error %i while walking dirents", ret);
-
+		bch_err(c, "memory allocation failure building nlink table");
 	return ret;
 }
 
@@ -1328,44 +1627,33 @@ static int check_inode(struct btree_trans *trans,
 noinline_for_stack
 static int bch2_gc_walk_inodes(struct bch_fs *c,
 			       struct bch_inode_unpacked *lostfound_inode,
-			       nlink_table *links,
-			       u64 range_start, u64 range_end)
+			       nlink_table *links)
 {
 	struct btree_trans trans;
 	struct btree_iter *iter;
 	struct bkey_s_c k;
+	struct nlink_entry *n = links->data, *end = links->data + links->nr;
 	struct nlink *link, zero_links = { 0, 0 };
-	struct genradix_iter nlinks_iter;
 	int ret = 0, ret2 = 0;
-	u64 nlinks_pos;
 
 	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 0);
 
-	iter = bch2_trans_get_iter(&trans, BTREE_ID_INODES,
-				   POS(0, range_start), 0);
-	nlinks_iter = genradix_iter_init(links, 0);
+	iter = bch2_trans_get_iter(&trans, BTREE_ID_INODES, POS_MIN,
+				   BTREE_ITER_PREFETCH);
 
 	while ((k = bch2_btree_iter_peek(iter)).k &&
 	       !(ret2 = bkey_err(k))) {
-peek_nlinks:	link = genradix_iter_peek(&nlinks_iter, links);
-
-		if (!link && (!k.k || iter->pos.offset >= range_end))
-			break;
-
-		nlinks_pos = range_start + nlinks_iter.pos;
-		if (iter->pos.offset > nlinks_pos) {
+		for (; n < end && n->inum < k.k->p.offset; n++)
 			/* Should have been caught by dirents pass: */
-			need_fsck_err_on(link && link->count, c,
+			need_fsck_err_on(n->l.count, c,
 				"missing inode %llu (nlink %u)",
-				nlinks_pos, link->count);
-			genradix_iter_advance(&nlinks_iter, links);
-			goto peek_nlinks;
-		}
+				n->inum, n->l.count);
 
-		if (iter->pos.offset < nlinks_pos || !link)
-			link = &zero_links;
+		link = n < end && n->inum == k.k->p.offset
+			? &(n++)->l
+			: &zero_links;
 
-		if (k.k && k.k->type == KEY_TYPE_inode) {
+		if (k.k->type == KEY_TYPE_inode) {
 			ret = check_inode(&trans, lostfound_inode, iter,
 					  bkey_s_c_to_inode(k), link);
 			BUG_ON(ret == -EINTR);
@@ -1375,15 +1663,18 @@ peek_nlinks:	link = genradix_iter_peek(&nlinks_iter, links);
 			/* Should have been caught by dirents pass: */
 			need_fsck_err_on(link->count, c,
 				"missing inode %llu (nlink %u)",
-				nlinks_pos, link->count);
+				k.k->p.offset, link->count);
 		}
 
-		if (nlinks_pos == iter->pos.offset)
-			genradix_iter_advance(&nlinks_iter, links);
-
 		bch2_btree_iter_next(iter);
 		bch2_trans_cond_resched(&trans);
 	}
+
+	if (!ret && !ret2)
+		for (; n < end; n++)
+			need_fsck_err_on(n->l.count, c,
+				"missing inode %llu (nlink %u)",
+				n->inum, n->l.count);
 fsck_err:
 	bch2_trans_exit(&trans);
 
@@ -1395,93 +1686,795 @@ peek_nlinks:	link = genradix_iter_peek(&nlinks_iter, links);
 
 noinline_for_stack
 static int check_inode_nlinks(struct bch_fs *c,
-			      struct bch_inode_unpacked *lostfound_inode)
+			      struct bch_inode_unpacked *lostfound_inode,
+			      struct fsck_dirents *d)
 {
-	nlink_table links;
-	u64 this_iter_range_start, next_iter_range_start = 0;
-	int ret = 0;
+	nlink_table links = { 0 };
+	int ret;
 
 	bch_verbose(c, "checking inode nlinks");
 
-	genradix_init(&links);
-
-	do {
-		this_iter_range_start = next_iter_range_start;
-		next_iter_range_start = U64_MAX;
-
-		ret = bch2_gc_walk_dirents(c, &links,
-					  this_iter_range_start,
-					  &next_iter_range_start);
-		if (ret)
-			break;
-
-		ret = bch2_gc_walk_inodes(c, lostfound_inode, &links,
-					 this_iter_range_start,
-					 next_iter_range_start);
-		if (ret)
-			break;
-
-		genradix_free(&links);
-	} while (next_iter_range_start != U64_MAX);
-
-	genradix_free(&links);
+	ret =   nlink_table_build(c, d, lostfound_inode->bi_inum, &links) ?:
+		bch2_gc_walk_inodes(c, lostfound_inode, &links);
 
+	fsck_array_exit(&links);
 	return ret;
 }
 
 /*
- * Checks for inconsistencies that shouldn't happen, unless we have a bug.
- * Doesn't fix them yet, mainly because they haven't yet been observed:
+ * Fallback for when the arrays built by walk_dirents() would be too big: the
+ * directory structure check walks the dirents btree for each directory, and
+ * nlinks are counted one range of inode numbers at a time, as big as memory
+ * allows:
  */
-int bch2_fsck_full(struct bch_fs *c)
-{
-	struct bch_inode_unpacked root_inode, lostfound_inode;
 
-	return  check_extents(c) ?:
-		check_dirents(c) ?:
-		check_xattrs(c) ?:
-		check_root(c, &root_inode) ?:
-		check_lostfound(c, &root_inode, &lostfound_inode) ?:
-		check_directory_structure(c, &lostfound_inode) ?:
-		check_inode_nlinks(c, &lostfound_inode);
+typedef GENRADIX(unsigned long) inode_bitmap;
+
+static inline bool inode_bitmap_test(inode_bitmap *b, size_t nr)
+{
+	unsigned long *w = genradix_ptr(b, nr / BITS_PER_LONG);
+	return w ? test_bit(nr & (BITS_PER_LONG - 1), w) : false;
 }
 
-int bch2_fsck_inode_nlink(struct bch_fs *c)
+static inline int inode_bitmap_set(inode_bitmap *b, size_t nr)
 {
-	struct bch_inode_unpacked root_inode, lostfound_inode;
+	unsigned long *w = genradix_ptr_alloc(b, nr / BITS_PER_LONG, GFP_KERNEL);
 
-	return  check_root(c, &root_inode) ?:
-		check_lostfound(c, &root_inode, &lostfound_inode) ?:
-		check_inode_nlinks(c, &lostfound_inode);
+	if (!w)
+		return -ENOMEM;
+
+	*w |= 1UL << (nr & (BITS_PER_LONG - 1));
+	return 0;
 }
 
-int bch2_fsck_walk_inodes_only(struct bch_fs *c)
+noinline_for_stack
+static int check_directory_structure_btree(struct bch_fs *c,
+				struct bch_inode_unpacked *lostfound_inode)
 {
+	inode_bitmap dirs_done;
+	struct pathbuf path = { 0, 0, NULL };
+	struct pathbuf_entry *e;
 	struct btree_trans trans;
 	struct btree_iter *iter;
 	struct bkey_s_c k;
-	struct bkey_s_c_inode inode;
-	int ret;
+	struct bkey_s_c_dirent dirent;
+	bool had_unreachable;
+	u64 d_inum;
+	int ret = 0;
 
 	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 0);
 
-	for_each_btree_key(&trans, iter, BTREE_ID_INODES, POS_MIN, 0, k, ret) {
-		if (k.k->type != KEY_TYPE_inode)
-			continue;
+	bch_verbose(c, "checking directory structure");
 
-		inode = bkey_s_c_to_inode(k);
+	/* DFS: */
+restart_dfs:
+	genradix_init(&dirs_done);
+	had_unreachable = false;
 
-		if (inode.v->bi_flags &
-		    (BCH_INODE_I_SIZE_DIRTY|
-		     BCH_INODE_I_SECTORS_DIRTY|
-		     BCH_INODE_UNLINKED)) {
-			ret = check_inode(&trans, NULL, iter, inode, NULL);
-			BUG_ON(ret == -EINTR);
-			if (ret)
+	ret = inode_bitmap_set(&dirs_done, BCACHEFS_ROOT_INO);
+	if (ret) {
+		bch_err(c, "memory allocation failure in inode_bitmap_set()");
+		goto err;
+	}
+
+	ret = path_down(&path, BCACHEFS_ROOT_INO, 0);
+	if (ret)
+		goto err;
+
+	while (path.nr) {
+next:
+		e = &path.entries[path.nr - 1];
+
+		if (e->offset == U64_MAX)
+			goto up;
+
+		for_each_btree_key(&trans, iter, BTREE_ID_DIRENTS,
+				   POS(e->inum, e->offset + 1), 0, k, ret) {
+			if (k.k->p.inode != e->inum)
 				break;
+
+			e->offset = k.k->p.offset;
+
+			if (k.k->type != KEY_TYPE_dirent)
+				continue;
+
+			dirent = bkey_s_c_to_dirent(k);
+
+			if (dirent.v->d_type != DT_DIR)
+				continue;
+
+			d_inum = le64_to_cpu(dirent.v->d_inum);
+
+			if (fsck_err_on(inode_bitmap_test(&dirs_done, d_inum), c,
+					"directory %llu has multiple hardlinks",
+					d_inum)) {
+				ret = remove_dirent(&trans, dirent);
+				if (ret)
+					goto err;
+				continue;
+			}
+
+			ret = inode_bitmap_set(&dirs_done, d_inum);
+			if (ret) {
+				bch_err(c, "memory allocation failure in inode_bitmap_set()");
+				goto err;
+			}
+
+			ret = path_down(&path, d_inum, 0);
+			if (ret) {
+				goto err;
+			}
+
+			ret = bch2_trans_iter_free(&trans, iter);
+			if (ret) {
+				bch_err(c, "btree error %i in fsck", ret);
+				goto err;
+			}
+			goto next;
+		}
+		ret = bch2_trans_iter_free(&trans, iter) ?: ret;
+		if (ret) {
+			bch_err(c, "btree error %i in fsck", ret);
+			goto err;
 		}
+up:
+		path.nr--;
 	}
-	BUG_ON(ret == -EINTR);
 
-	return bch2_trans_exit(&trans) ?: ret;
+	iter = bch2_trans_get_iter(&trans, BTREE_ID_INODES, POS_MIN, 0);
+retry:
+	for_each_btree_key_continue(iter, 0, k, ret) {
+		if (k.k->type != KEY_TYPE_inode)
+			continue;
+
+		if (!S_ISDIR(le16_to_cpu(bkey_s_c_to_inode(k).v->bi_mode)))
+			continue;
+
+		ret = bch2_empty_dir_trans(&trans, k.k->p.inode);
+		if (ret == -EINTR)
+			goto retry;
+		if (!ret)
+			continue;
+
+		if (fsck_err_on(!inode_bitmap_test(&dirs_done, k.k->p.offset), c,
+				"unreachable directory found (inum %llu)",
+				k.k->p.offset)) {
+			bch2_trans_unlock(&trans);
+
+			ret = reattach_inode(c, lostfound_inode, k.k->p.offset);
+			if (ret) {
+				goto err;
+			}
+
+			had_unreachable = true;
+		}
+	}
+	bch2_trans_iter_free(&trans, iter);
+	if (ret)
+		goto err;
+
+	if (had_unreachable) {
+		bch_info(c, "reattached unreachable directories, restarting pass to check for loops");
+		genradix_free(&dirs_done);
+		kfree(path.entries);
+		memset(&dirs_done, 0, sizeof(dirs_done));
+		memset(&path, 0, sizeof(path));
+		goto restart_dfs;
+	}
+err:
+fsck_err:
+	ret = bch2_trans_exit(&trans) ?: ret;
+	genradix_free(&dirs_done);
+	kfree(path.entries);
+	return ret;
+}
+
+typedef GENRADIX(struct nlink) nlink_radix;
+
+static void inc_link(struct bch_fs *c, nlink_radix *links,
+		     u64 range_start, u64 *range_end,
+		     u64 inum, bool dir)
+{
+	struct nlink *link;
+
+	if (inum < range_start || inum >= *range_end)
+		return;
+
+	link = genradix_ptr_alloc(links, inum - range_start, GFP_KERNEL);
+	if (!link) {
+		bch_verbose(c, "allocation failed during fsck - will need another pass");
+		*range_end = inum;
+		return;
+	}
+
+	if (dir)
+		link->dir_count++;
+	else
+		link->count++;
+}
+
+noinline_for_stack
+static int bch2_gc_walk_dirents_range(struct bch_fs *c, nlink_radix *links,
+				      u64 range_start, u64 *range_end)
+{
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	struct bkey_s_c_dirent d;
+	u64 d_inum;
+	int ret;
+
+	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 0);
+
+	inc_link(c, links, range_start, range_end, BCACHEFS_ROOT_INO, false);
+
+	for_each_btree_key(&trans, iter, BTREE_ID_DIRENTS, POS_MIN, 0, k, ret) {
+		switch (k.k->type) {
+		case KEY_TYPE_dirent:
+			d = bkey_s_c_to_dirent(k);
+			d_inum = le64_to_cpu(d.v->d_inum);
+
+			if (d.v->d_type == DT_DIR)
+				inc_link(c, links, range_start, range_end,
+					 d.k->p.inode, true);
+
+			inc_link(c, links, range_start, range_end,
+				 d_inum, false);
+
+			break;
+		}
+
+		bch2_trans_cond_resched(&trans);
+	}
+	ret = bch2_trans_exit(&trans) ?: ret;
+	if (ret)
+		bch_err(c, "error in fsck: btree error %i while walking dirents", ret);
+
+	return ret;
+}
+
+
+noinline_for_stack
+static int bch2_gc_walk_inodes_range(struct bch_fs *c,
+				struct bch_inode_unpacked *lostfound_inode,
+				nlink_radix *links,
+				u64 range_start, u64 range_end)
+{
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	struct nlink *link, zero_links = { 0, 0 };
+	struct genradix_iter nlinks_iter;
+	int ret = 0, ret2 = 0;
+	u64 nlinks_pos;
+
+	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 0);
+
+	iter = bch2_trans_get_iter(&trans, BTREE_ID_INODES,
+				   POS(0, range_start), 0);
+	nlinks_iter = genradix_iter_init(links, 0);
+
+	while ((k = bch2_btree_iter_peek(iter)).k &&
+	       !(ret2 = bkey_err(k))) {
+peek_nlinks:	link = genradix_iter_peek(&nlinks_iter, links);
+
+		if (!link && (!k.k || iter->pos.offset >= range_end))
+			break;
+
+		nlinks_pos = range_start + nlinks_iter.pos;
+		if (iter->pos.offset > nlinks_pos) {
+			/* Should have been caught by dirents pass: */
+			need_fsck_err_on(link && link->count, c,
+				"missing inode %llu (nlink %u)",
+				nlinks_pos, link->count);
+			genradix_iter_advance(&nlinks_iter, links);
+			goto peek_nlinks;
+		}
+
+		if (iter->pos.offset < nlinks_pos || !link)
+			link = &zero_links;
+
+		if (k.k && k.k->type == KEY_TYPE_inode) {
+			ret = check_inode(&trans, lostfound_inode, iter,
+					  bkey_s_c_to_inode(k), link);
+			BUG_ON(ret == -EINTR);
+			if (ret)
+				break;
+		} else {
+			/* Should have been caught by dirents pass: */
+			need_fsck_err_on(link->count, c,
+				"missing inode %llu (nlink %u)",
+				nlinks_pos, link->count);
+		}
+
+		if (nlinks_pos == iter->pos.offset)
+			genradix_iter_advance(&nlinks_iter, links);
+
+		bch2_btree_iter_next(iter);
+		bch2_trans_cond_resched(&trans);
+	}
+fsck_err:
+	bch2_trans_exit(&trans);
+
+	if (ret2)
+		bch_err(c, "error in fsck: btree error %i while walking inodes", ret2);
+
+	return ret ?: ret2;
+}
+
+noinline_for_stack
+static int check_inode_nlinks_windowed(struct bch_fs *c,
+				struct bch_inode_unpacked *lostfound_inode)
+{
+	nlink_radix links;
+	u64 this_iter_range_start, next_iter_range_start = 0;
+	int ret = 0;
+
+	bch_verbose(c, "checking inode nlinks");
+
+	genradix_init(&links);
+
+	do {
+		this_iter_range_start = next_iter_range_start;
+		next_iter_range_start = U64_MAX;
+
+		ret = bch2_gc_walk_dirents_range(c, &links,
+					  this_iter_range_start,
+					  &next_iter_range_start);
+		if (ret)
+			break;
+
+		ret = bch2_gc_walk_inodes_range(c, lostfound_inode, &links,
+					 this_iter_range_start,
+					 next_iter_range_start);
+		if (ret)
+			break;
+
+		genradix_free(&links);
+	} while (next_iter_range_start != U64_MAX);
+
+	genradix_free(&links);
+
+	return ret;
+}
+
+static int check_dirs_and_nlinks(struct bch_fs *c,
+				 struct bch_inode_unpacked *lostfound_inode,
+				 bool check_dirs)
+{
+	struct fsck_dirents d = { { 0 } };
+	bool in_memory;
+	int ret;
+
+	ret = walk_dirents(c, &d);
+	if (ret && ret != -ENOMEM)
+		goto out;
+	in_memory = !ret;
+
+	if (check_dirs) {
+		ret = in_memory
+			? check_directory_structure(c, lostfound_inode, &d)
+			: -ENOMEM;
+		if (ret == -ENOMEM) {
+			/* may have already fixed things, d is out of date: */
+			fsck_dirents_exit(&d);
+			in_memory = false;
+
+			bch_info(c, "not enough memory, checking directory structure from the btree");
+			ret = check_directory_structure_btree(c, lostfound_inode);
+		}
+		if (ret)
+			goto out;
+	}
+
+	ret = in_memory
+		? check_inode_nlinks(c, lostfound_inode, &d)
+		: -ENOMEM;
+	if (ret == -ENOMEM) {
+		fsck_dirents_exit(&d);
+
+		bch_info(c, "not enough memory, checking inode nlinks in ranges");
+		ret = check_inode_nlinks_windowed(c, lostfound_inode);
+	}
+out:
+	fsck_dirents_exit(&d);
+	return ret;
+}
+
+/*
+ * The extents, dirents and xattrs passes each only look at keys in their own
+ * btree and at the inodes those keys belong to, and what they repair is local
+ * to one inode - so they're run concurrently, and each is split by inode number
+ * into opts.fsck_threads ranges, with one thread per pass per range.
+ *
+ * When asking before fixing errors, the passes are run one at a time so that
+ * questions aren't interleaved.
+ */
+typedef int (*fsck_pass_fn)(struct bch_fs *, u64, u64);
+
+struct fsck_worker {
+	struct bch_fs		*c;
+	fsck_pass_fn		fn;
+	u64			start;
+	u64			end;
+
+	struct task_struct	*thread;
+	struct completion	done;
+	int			ret;
+};
+
+static int fsck_worker_thread(void *arg)
+{
+	struct fsck_worker *w = arg;
+
+	w->ret = w->fn(w->c, w->start, w->end);
+	complete(&w->done);
+	return 0;
+}
+
+static u64 fsck_inode_nr_end(struct bch_fs *c)
+{
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	u64 ret = 0;
+
+	bch2_trans_init(&trans, c, 0, 0);
+	iter = bch2_trans_get_iter(&trans, BTREE_ID_INODES, POS(0, U64_MAX), 0);
+	k = bch2_btree_iter_prev(iter);
+	if (!IS_ERR_OR_NULL(k.k))
+		ret = k.k->p.offset + 1;
+	bch2_trans_iter_put(&trans, iter);
+	bch2_trans_exit(&trans);
+
+	return ret;
+}
+
+static int check_keys_per_inode(struct bch_fs *c)
+{
+	static const fsck_pass_fn passes[] = {
+		check_extents, check_dirents, check_xattrs,
+	};
+	unsigned nr_ranges = c->opts.fsck_threads;
+	unsigned i, nr = ARRAY_SIZE(passes) * nr_ranges;
+	u64 inode_end = fsck_inode_nr_end(c);
+	struct fsck_worker *w;
+	int ret = 0;
+
+	bch_verbose(c, "checking extents, dirents and xattrs");
+
+	w = c->opts.fix_errors != FSCK_OPT_ASK && inode_end
+		? kcalloc(nr, sizeof(*w), GFP_KERNEL)
+		: NULL;
+	if (!w)
+		return  check_extents(c, 0, U64_MAX) ?:
+			check_dirents(c, 0, U64_MAX) ?:
+			check_xattrs(c, 0, U64_MAX);
+
+	for (i = 0; i < nr; i++) {
+		unsigned r = i % nr_ranges;
+
+		w[i].c		= c;
+		w[i].fn		= passes[i / nr_ranges];
+		w[i].start	= mul_u64_u32_div(inode_end, r, nr_ranges);
+		w[i].end	= r + 1 < nr_ranges
+			? mul_u64_u32_div(inode_end, r + 1, nr_ranges)
+			: U64_MAX;
+		init_completion(&w[i].done);
+
+		w[i].thread = kthread_create(fsck_worker_thread, &w[i],
+					     "bch-fsck/%s", c->name);
+		if (IS_ERR(w[i].thread)) {
+			w[i].thread = NULL;
+			continue;
+		}
+
+		get_task_struct(w[i].thread);
+		wake_up_process(w[i].thread);
+	}
+
+	/* Ranges we couldn't start a thread for are checked here: */
+	for (i = 0; i < nr; i++)
+		if (!w[i].thread)
+			fsck_worker_thread(&w[i]);
+
+	for (i = 0; i < nr; i++) {
+		wait_for_completion(&w[i].done);
+
+		if (w[i].thread) {
+			kthread_stop(w[i].thread);
+			put_task_struct(w[i].thread);
+		}
+
+		ret = ret ?: w[i].ret;
+	}
+
+	kfree(w);
+	return ret;
+}
+
+/*
+ * Checks for inconsistencies that shouldn't happen, unless we have a bug.
+ * Doesn't fix them yet, mainly because they haven't yet been observed:
+ */
+int bch2_fsck_full(struct bch_fs *c)
+{
+	struct bch_inode_unpacked root_inode, lostfound_inode;
+
+	return  check_keys_per_inode(c) ?:
+		check_root(c, &root_inode) ?:
+		check_lostfound(c, &root_inode, &lostfound_inode) ?:
+		check_dirs_and_nlinks(c, &lostfound_inode, true);
+}
+
+int bch2_fsck_inode_nlink(struct bch_fs *c)
+{
+	struct bch_inode_unpacked root_inode, lostfound_inode;
+
+	return  check_root(c, &root_inode) ?:
+		check_lostfound(c, &root_inode, &lostfound_inode) ?:
+		check_dirs_and_nlinks(c, &lostfound_inode, false);
+}
+
+int bch2_fsck_walk_inodes_only(struct bch_fs *c)
+{
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	struct bkey_s_c_inode inode;
+	int ret;
+
+	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 0);
+
+	for_each_btree_key(&trans, iter, BTREE_ID_INODES, POS_MIN, 0, k, ret) {
+		if (k.k->type != KEY_TYPE_inode)
+			continue;
+
+		inode = bkey_s_c_to_inode(k);
+
+		if (inode.v->bi_flags &
+		    (BCH_INODE_I_SIZE_DIRTY|
+		     BCH_INODE_I_SECTORS_DIRTY|
+		     BCH_INODE_UNLINKED)) {
+			ret = check_inode(&trans, NULL, iter, inode, NULL);
+			BUG_ON(ret == -EINTR);
+			if (ret)
+				break;
+		}
+	}
+	BUG_ON(ret == -EINTR);
+
+	return bch2_trans_exit(&trans) ?: ret;
+}
+
+/* Online fsck: */
+
+/*
+ * The checks that are local to a single key - that the inode a key belongs to
+ * exists and has the right type, that extents aren't past i_size, that dirents
+ * point to inodes that exist and have the right d_type - are run against a live
+ * filesystem by BCH_DATA_OP_FSCK.
+ *
+ * Each key is checked in a transaction together with the inodes it refers to,
+ * looked up through the btree key cache, so the check sees a consistent
+ * snapshot and restarts if it races with an update. Errors are only logged and
+ * counted in stats->keys_inconsistent: repairing them needs an offline fsck.
+ */
+#define FSCK_ONLINE_BATCH	512
+
+static int fsck_online_inode(struct btree_trans *trans, u64 inum,
+			     struct bch_inode_unpacked *u)
+{
+	int ret = bch2_inode_find_by_inum_trans(trans, inum, u);
+
+	if (ret == -ENOENT) {
+		bch_err_ratelimited(trans->c, "missing inode %llu", inum);
+		ret = 1;
+	}
+
+	return ret;
+}
+
+static int fsck_online_extent(struct btree_trans *trans, struct bkey_s_c k)
+{
+	struct bch_fs *c = trans->c;
+	struct bch_inode_unpacked u;
+	int ret = fsck_online_inode(trans, k.k->p.inode, &u);
+
+	if (ret)
+		return ret;
+
+	if (!S_ISREG(u.bi_mode) && !S_ISLNK(u.bi_mode)) {
+		bch_err_ratelimited(c, "extent type %u for non regular file, inode %llu mode %o",
+				    k.k->type, k.k->p.inode, u.bi_mode);
+		return 1;
+	}
+
+	if (!(u.bi_flags & BCH_INODE_I_SIZE_DIRTY) &&
+	    k.k->type != KEY_TYPE_reservation &&
+	    k.k->p.offset > round_up(u.bi_size, block_bytes(c)) >> 9) {
+		bch_err_ratelimited(c, "extent type %u offset %llu past end of inode %llu, i_size %llu",
+				    k.k->type, k.k->p.offset, k.k->p.inode, u.bi_size);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int fsck_online_dirent(struct btree_trans *trans, struct bkey_s_c k)
+{
+	struct bch_fs *c = trans->c;
+	struct bkey_s_c_dirent d;
+	struct bch_inode_unpacked u;
+	u64 d_inum;
+	int ret;
+
+	if (k.k->type != KEY_TYPE_dirent)
+		return 0;
+
+	d = bkey_s_c_to_dirent(k);
+	d_inum = le64_to_cpu(d.v->d_inum);
+
+	ret = fsck_online_inode(trans, k.k->p.inode, &u);
+	if (ret)
+		return ret;
+
+	if (!S_ISDIR(u.bi_mode)) {
+		bch_err_ratelimited(c, "dirent in non directory inode %llu, type %u",
+				    k.k->p.inode, mode_to_type(u.bi_mode));
+		return 1;
+	}
+
+	if (d_inum == k.k->p.inode) {
+		bch_err_ratelimited(c, "dirent in inode %llu points to itself",
+				    k.k->p.inode);
+		return 1;
+	}
+
+	ret = fsck_online_inode(trans, d_inum, &u);
+	if (ret)
+		return ret;
+
+	if (d.v->d_type != mode_to_type(u.bi_mode)) {
+		bch_err_ratelimited(c, "dirent in inode %llu to inode %llu has d_type %u, should be %u",
+				    k.k->p.inode, d_inum, d.v->d_type,
+				    mode_to_type(u.bi_mode));
+		return 1;
+	}
+
+	return 0;
+}
+
+static int fsck_online_xattr(struct btree_trans *trans, struct bkey_s_c k)
+{
+	struct bch_inode_unpacked u;
+
+	return k.k->type == KEY_TYPE_xattr
+		? fsck_online_inode(trans, k.k->p.inode, &u)
+		: 0;
+}
+
+struct fsck_online_cursor {
+	enum btree_id	btree_id;
+	int		(*fn)(struct btree_trans *, struct bkey_s_c);
+	struct bpos	pos;
+	bool		done;
+};
+
+/*
+ * Checks up to FSCK_ONLINE_BATCH keys from @cur->pos, one transaction per key,
+ * and advances the cursor past them:
+ */
+static int fsck_online_batch(struct btree_trans *trans,
+			     struct fsck_online_cursor *cur, struct bpos end,
+			     struct bch_move_stats *stats)
+{
+	struct bch_fs *c = trans->c;
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	unsigned nr = 0;
+	int ret = 0;
+
+	iter = bch2_trans_get_iter(trans, cur->btree_id, cur->pos,
+				   BTREE_ITER_PREFETCH);
+
+	while (nr < FSCK_ONLINE_BATCH) {
+		bch2_trans_begin(trans);
+
+		k = bch2_btree_iter_peek(iter);
+		ret = bkey_err(k);
+		if (!ret && (!k.k || bkey_cmp(bkey_start_pos(k.k), end) >= 0)) {
+			cur->done = true;
+			break;
+		}
+
+		if (!ret)
+			ret = cur->fn(trans, k);
+		if (ret == -EINTR)
+			continue;
+		if (ret < 0) {
+			bch_err(c, "error %i in online fsck", ret);
+			break;
+		}
+
+		if (ret) {
+			atomic64_inc(&stats->keys_inconsistent);
+			ret = 0;
+		}
+
+		atomic64_add(k.k->size, &stats->sectors_seen);
+		bch2_btree_iter_next(iter);
+		nr++;
+	}
+
+	cur->pos = iter->pos;
+	bch2_trans_iter_put(trans, iter);
+	return ret;
+}
+
+/*
+ * Between batches we unlock, wait on the write IO clock so as to be throttled
+ * against foreground writes, and check if we've been told to stop:
+ */
+static int fsck_online_pause(struct bch_fs *c, struct btree_trans *trans)
+{
+	struct io_clock *clock = &c->io_clock[WRITE];
+
+	bch2_trans_unlock(trans);
+
+	bch2_kthread_io_clock_wait(clock,
+			atomic64_read(&clock->now) + (c->capacity >> 16),
+			HZ / 100);
+
+	return (current->flags & PF_KTHREAD) && kthread_should_stop()
+		? -EINTR : 0;
+}
+
+/*
+ * Check extents, dirents and xattrs in [@start, @end) against a live
+ * filesystem. The three btrees are walked together, always advancing the one
+ * that's furthest behind, so stats->pos - the minimum of their positions - is a
+ * checkpoint: an interrupted check can be resumed from there.
+ */
+int bch2_fsck_online(struct bch_fs *c, struct bpos start, struct bpos end,
+		     struct bch_move_stats *stats)
+{
+	struct fsck_online_cursor cursors[] = {
+		{ BTREE_ID_EXTENTS,	fsck_online_extent,	start },
+		{ BTREE_ID_DIRENTS,	fsck_online_dirent,	start },
+		{ BTREE_ID_XATTRS,	fsck_online_xattr,	start },
+	};
+	struct fsck_online_cursor *cur;
+	struct btree_trans trans;
+	unsigned i;
+	int ret = 0;
+
+	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 0);
+
+	stats->data_type = BCH_DATA_user;
+	stats->pos = start;
+
+	while (1) {
+		cur = NULL;
+		for (i = 0; i < ARRAY_SIZE(cursors); i++)
+			if (!cursors[i].done &&
+			    (!cur || bkey_cmp(cursors[i].pos, cur->pos) < 0))
+				cur = &cursors[i];
+		if (!cur)
+			break;
+
+		stats->btree_id = cur->btree_id;
+		stats->pos = cur->pos;
+
+		ret = fsck_online_batch(&trans, cur, end, stats) ?:
+			fsck_online_pause(c, &trans);
+		if (ret)
+			break;
+	}
+
+	if (!ret)
+		stats->pos = end;
+
+	bch2_trans_exit(&trans);
+	return ret == -EINTR ? 0 : ret;
 }
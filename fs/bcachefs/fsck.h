@@ -6,4 +6,8 @@ int bch2_fsck_full(struct bch_fs *);
 int bch2_fsck_inode_nlink(struct bch_fs *);
 int bch2_fsck_walk_inodes_only(struct bch_fs *);
 
+struct bch_move_stats;
+int bch2_fsck_online(struct bch_fs *, struct bpos, struct bpos,
+		     struct bch_move_stats *);
+
 #endif /* _BCACHEFS_FSCK_H */
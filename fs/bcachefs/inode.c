@@ -137,7 +137,7 @@ static void bch2_inode_pack_v2(struct bkey_inode_buf *packed,
 	nr_fields++;							\
 									\
 	if (inode->_name) {						\
-		ret = bch2_varint_encode(out, inode->_name);		\
+		ret = __bch2_varint_encode(out, inode->_name);		\
 		out += ret;						\
 									\
 		if (_bits > 64)						\
@@ -246,13 +246,13 @@ static int bch2_inode_unpack_v2(struct bkey_s_c_inode inode,
 
 #define x(_name, _bits)							\
 	if (fieldnr < INODE_NR_FIELDS(inode.v)) {			\
-		ret = bch2_varint_decode(in, end, &v[0]);		\
+		ret = __bch2_varint_decode(in, end, &v[0]);		\
 		if (ret < 0)						\
 			return ret;					\
 		in += ret;						\
 									\
 		if (_bits > 64) {					\
-			ret = bch2_varint_decode(in, end, &v[1]);	\
+			ret = __bch2_varint_decode(in, end, &v[1]);	\
 			if (ret < 0)					\
 				return ret;				\
 			in += ret;					\
@@ -469,14 +469,76 @@ static inline u32 bkey_generation(struct bkey_s_c k)
 	}
 }
 
+/* Max inode numbers a CPU claims at a time: */
+#define INODE_ALLOC_CHUNK	256
+
+/*
+ * Find the next run of unused inode numbers in [min, max], starting from where
+ * this shard's previous run ended, and make it the shard's new run.
+ *
+ * This walks keys, not slots, so in-use inode numbers are skipped over a leaf
+ * at a time:
+ */
+static int bch2_inode_alloc_refill(struct btree_trans *trans,
+				   struct inode_alloc_shard *s,
+				   u64 min, u64 max)
+{
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	u64 start = READ_ONCE(s->end), pos, end;
+	int ret;
+
+	if (start > max || start < min)
+		start = min;
+again:
+	pos = start;
+	end = max + 1;
+
+	for_each_btree_key(trans, iter, BTREE_ID_INODES, POS(0, start),
+			   BTREE_ITER_PREFETCH, k, ret) {
+		if (k.k->p.inode || k.k->p.offset > max)
+			break;
+
+		/* inode_generation keys are unused inode numbers: */
+		if (k.k->type != KEY_TYPE_inode)
+			continue;
+
+		if (pos < k.k->p.offset) {
+			end = k.k->p.offset;
+			break;
+		}
+
+		pos = k.k->p.offset + 1;
+	}
+	bch2_trans_iter_put(trans, iter);
+
+	if (ret)
+		return ret;
+
+	if (pos > max) {
+		if (start == min)
+			return -ENOSPC;
+
+		/* Retry from start */
+		start = min;
+		goto again;
+	}
+
+	WRITE_ONCE(s->end, 0);
+	atomic64_set(&s->next, pos);
+	WRITE_ONCE(s->end, min(end, pos + INODE_ALLOC_CHUNK));
+	return 0;
+}
+
 int bch2_inode_create(struct btree_trans *trans,
 		      struct bch_inode_unpacked *inode_u)
 {
 	struct bch_fs *c = trans->c;
 	struct bkey_inode_buf *inode_p;
-	struct btree_iter *iter = NULL;
+	struct inode_alloc_shard *s;
+	struct btree_iter *iter;
 	struct bkey_s_c k;
-	u64 min, max, start, *hint;
+	u64 min, max, inum;
 	int ret;
 
 	unsigned cpu = raw_smp_processor_id();
@@ -487,54 +549,44 @@ int bch2_inode_create(struct btree_trans *trans,
 	max = (cpu << bits) | ~(ULLONG_MAX << bits);
 
 	min = max_t(u64, min, BLOCKDEV_INODE_MAX);
-	hint = c->unused_inode_hints + cpu;
-
-	start = READ_ONCE(*hint);
-
-	if (start >= max || start < min)
-		start = min;
+	s = c->inode_alloc_shards + cpu;
 
 	inode_p = bch2_trans_kmalloc(trans, sizeof(*inode_p));
 	if (IS_ERR(inode_p))
 		return PTR_ERR(inode_p);
 again:
-	for_each_btree_key(trans, iter, BTREE_ID_INODES, POS(0, start),
-			   BTREE_ITER_SLOTS|BTREE_ITER_INTENT, k, ret) {
-		if (bkey_cmp(iter->pos, POS(0, max)) > 0)
-			break;
+	inum = atomic64_inc_return(&s->next) - 1;
 
-		/*
-		 * There's a potential cache coherency issue with the btree key
-		 * cache code here - we're iterating over the btree, skipping
-		 * that cache. We should never see an empty slot that isn't
-		 * actually empty due to a pending update in the key cache
-		 * because the update that creates the inode isn't done with a
-		 * cached iterator, but - better safe than sorry, check the
-		 * cache before using a slot:
-		 */
-		if (k.k->type != KEY_TYPE_inode &&
-		    !bch2_btree_key_cache_find(c, BTREE_ID_INODES, iter->pos))
-			goto found_slot;
+	if (inum < min || inum > max || inum >= READ_ONCE(s->end)) {
+		ret = bch2_inode_alloc_refill(trans, s, min, max);
+		if (ret)
+			return ret;
+		goto again;
 	}
 
-	bch2_trans_iter_put(trans, iter);
-
+	iter = bch2_trans_get_iter(trans, BTREE_ID_INODES, POS(0, inum),
+				   BTREE_ITER_SLOTS|BTREE_ITER_INTENT);
+	k = bch2_btree_iter_peek_slot(iter);
+	ret = bkey_err(k);
 	if (ret)
-		return ret;
+		goto err;
 
-	if (start != min) {
-		/* Retry from start */
-		start = min;
+	/*
+	 * The run was free when the shard was refilled, but we may have raced
+	 * with another create - and the refill walked the btree, skipping the
+	 * key cache - so check the slot before using it:
+	 */
+	if (k.k->type == KEY_TYPE_inode ||
+	    bch2_btree_key_cache_find(c, BTREE_ID_INODES, iter->pos)) {
+		bch2_trans_iter_put(trans, iter);
 		goto again;
 	}
 
-	return -ENOSPC;
-found_slot:
-	*hint			= k.k->p.offset;
-	inode_u->bi_inum	= k.k->p.offset;
+	inode_u->bi_inum	= inum;
 	inode_u->bi_generation	= bkey_generation(k);
 
 	ret = bch2_inode_write(trans, iter, inode_u);
+err:
 	bch2_trans_iter_put(trans, iter);
 	return ret;
 }
@@ -628,6 +680,61 @@ int bch2_inode_rm(struct bch_fs *c, u64 inode_nr, bool cached)
 	return ret;
 }
 
+/*
+ * Deleting an unlinked inode means deleting all of its extents, which for a big
+ * file - or an rm -rf of a big tree - can take a while, so evict hands that off
+ * to a worker.
+ *
+ * The list itself isn't persistent, but it doesn't need to be: the inode is
+ * still flagged BCH_INODE_UNLINKED in the btree until it's deleted, and after an
+ * unclean shutdown recovery deletes unlinked inodes. Each queued inode holds a
+ * ref on c->writes, so going read only waits for the list to be drained before
+ * marking the filesystem clean.
+ */
+struct inode_rm_entry {
+	struct llist_node	list;
+	u64			inum;
+};
+
+void bch2_inode_rm_work(struct work_struct *work)
+{
+	struct bch_fs *c = container_of(work, struct bch_fs, inode_rm_work);
+	struct llist_node *list =
+		llist_reverse_order(llist_del_all(&c->inode_rm_list));
+	struct inode_rm_entry *e, *n;
+	int ret;
+
+	llist_for_each_entry_safe(e, n, list, list) {
+		ret = bch2_inode_rm(c, e->inum, true);
+		if (ret)
+			bch_err(c, "error %i deleting inode %llu", ret, e->inum);
+
+		kfree(e);
+		percpu_ref_put(&c->writes);
+		cond_resched();
+	}
+}
+
+/* Returns false if the caller should delete the inode itself: */
+bool bch2_inode_rm_defer(struct bch_fs *c, u64 inum)
+{
+	struct inode_rm_entry *e = kmalloc(sizeof(*e), GFP_NOFS);
+
+	if (!e)
+		return false;
+
+	if (!percpu_ref_tryget(&c->writes)) {
+		kfree(e);
+		return false;
+	}
+
+	e->inum = inum;
+
+	if (llist_add(&e->list, &c->inode_rm_list))
+		queue_work(system_long_wq, &c->inode_rm_work);
+	return true;
+}
+
 int bch2_inode_find_by_inum_trans(struct btree_trans *trans, u64 inode_nr,
 				  struct bch_inode_unpacked *inode)
 {
@@ -29,8 +29,10 @@
 #include "rebalance.h"
 #include "super.h"
 #include "super-io.h"
+#include "usage_history.h"
 
 #include <linux/blkdev.h>
+#include <linux/hrtimer.h>
 #include <linux/random.h>
 #include <linux/sched/mm.h>
 
@@ -43,18 +45,56 @@ const char *bch2_blk_status_to_str(blk_status_t status)
 	return blk_status_to_str(status);
 }
 
-static bool bch2_target_congested(struct bch_fs *c, u16 target)
+/*
+ * Congestion control:
+ *
+ * Each device tracks how far its smoothed IO latency (cur_latency) is over a
+ * target latency, as a fraction of CONGESTED_MAX: at or under the target it's
+ * 0, and it reaches CONGESTED_MAX at twice the target. Promotes to a target
+ * are skipped, and background moves to a target are slowed down, in
+ * proportion - so as the target gets busier the extra load we put on it backs
+ * off smoothly, instead of switching on and off.
+ *
+ * The target latency is the congestion_target_latency option, or if that's
+ * not set, a multiple of the device's own typical latency.
+ */
+
+static u64 bch2_dev_target_latency(struct bch_dev *ca, int rw)
 {
+	u64 target = (u64) ca->fs->opts.congestion_target_latency *
+		NSEC_PER_USEC;
+
+	if (!target) {
+		/* ideally we'd be taking into account the device's variance here: */
+		target = ca->io_latency[rw].quantiles.entries[QUANTILE_IDX(1)].m;
+		target <<= rw == READ ? 2 : 3;
+	}
+
+	return target;
+}
+
+unsigned bch2_target_congested(struct bch_fs *c, u16 target)
+{
+	struct target t = target_decode(target);
 	const struct bch_devs_mask *devs;
 	unsigned d, nr = 0, total = 0;
-	u64 now = local_clock(), last;
-	s64 congested;
+	u64 now = local_clock();
 	struct bch_dev *ca;
 
 	if (!target)
-		return false;
+		return 0;
 
 	rcu_read_lock();
+	/* Single device targets are common, skip the mask walk: */
+	if (t.type == TARGET_DEV) {
+		ca = t.dev < c->sb.nr_devices
+			? rcu_dereference(c->devs[t.dev])
+			: NULL;
+		total = ca ? bch2_dev_congested(ca, now) : 0;
+		rcu_read_unlock();
+		return total;
+	}
+
 	devs = bch2_target_to_mask(c, target) ?:
 		&c->rw_devs[BCH_DATA_user];
 
@@ -63,46 +103,38 @@ static bool bch2_target_congested(struct bch_fs *c, u16 target)
 		if (!ca)
 			continue;
 
-		congested = atomic_read(&ca->congested);
-		last = READ_ONCE(ca->congested_last);
-		if (time_after64(now, last))
-			congested -= (now - last) >> 12;
-
-		total += max(congested, 0LL);
+		total += bch2_dev_congested(ca, now);
 		nr++;
 	}
 	rcu_read_unlock();
 
-	return bch2_rand_range(nr * CONGESTED_MAX) < total;
+	return nr ? total / nr : 0;
 }
 
-static inline void bch2_congested_acct(struct bch_dev *ca, u64 io_latency,
-				       u64 now, int rw)
+static inline void bch2_congested_acct(struct bch_dev *ca, u64 now, int rw)
 {
-	u64 latency_capable =
-		ca->io_latency[rw].quantiles.entries[QUANTILE_IDX(1)].m;
-	/* ideally we'd be taking into account the device's variance here: */
-	u64 latency_threshold = latency_capable << (rw == READ ? 2 : 3);
-	s64 latency_over = io_latency - latency_threshold;
+	u64 target = bch2_dev_target_latency(ca, rw);
+	u64 latency = atomic64_read(&ca->cur_latency[rw]);
+	unsigned congested = 0;
 
-	if (latency_threshold && latency_over > 0) {
-		/*
-		 * bump up congested by approximately latency_over * 4 /
-		 * latency_threshold - we don't need much accuracy here so don't
-		 * bother with the divide:
-		 */
-		if (atomic_read(&ca->congested) < CONGESTED_MAX)
-			atomic_add(latency_over >>
-				   max_t(int, ilog2(latency_threshold) - 2, 0),
-				   &ca->congested);
+	if (!target)
+		return;
+
+	if (latency > target)
+		congested = min_t(u64, div64_u64((latency - target) *
+						 CONGESTED_MAX, target),
+				  CONGESTED_MAX);
 
+	if (congested) {
 		ca->congested_last = now;
-	} else if (atomic_read(&ca->congested) > 0) {
-		atomic_dec(&ca->congested);
+		atomic_set(&ca->congested[rw], congested);
+	} else if (atomic_read(&ca->congested[rw])) {
+		atomic_set(&ca->congested[rw], 0);
 	}
 }
 
-void bch2_latency_acct(struct bch_dev *ca, u64 submit_time, int rw)
+void bch2_latency_acct(struct bch_dev *ca, u64 submit_time, int rw,
+		       enum bch_data_type type)
 {
 	atomic64_t *latency = &ca->cur_latency[rw];
 	u64 now = local_clock();
@@ -126,9 +158,37 @@ void bch2_latency_acct(struct bch_dev *ca, u64 submit_time, int rw)
 		new = ewma_add(old, io_latency, 5);
 	} while ((v = atomic64_cmpxchg(latency, old, new)) != old);
 
-	bch2_congested_acct(ca, io_latency, now, rw);
+	bch2_congested_acct(ca, now, rw);
 
 	__bch2_time_stats_update(&ca->io_latency[rw], submit_time, now);
+
+	if (ca->io_latency_hist[rw][type])
+		bch2_time_stats_hist_add(ca->io_latency_hist[rw][type], io_latency);
+	atomic_dec(&ca->io_in_flight[rw][type]);
+}
+
+int bch2_dev_io_latency_alloc(struct bch_dev *ca)
+{
+	unsigned rw, type;
+
+	for (rw = 0; rw < 2; rw++)
+		for (type = 0; type < BCH_DATA_NR; type++)
+			if (bch2_dev_io_type_tracked(type) &&
+			    !(ca->io_latency_hist[rw][type] =
+			      alloc_percpu(struct time_stats_hist)))
+				return -ENOMEM;
+	return 0;
+}
+
+void bch2_dev_io_latency_free(struct bch_dev *ca)
+{
+	unsigned rw, type;
+
+	for (rw = 0; rw < 2; rw++)
+		for (type = 0; type < BCH_DATA_NR; type++) {
+			free_percpu(ca->io_latency_hist[rw][type]);
+			ca->io_latency_hist[rw][type] = NULL;
+		}
 }
 
 /* Allocate, free from mempool: */
@@ -181,6 +241,64 @@ void bch2_bio_alloc_pages_pool(struct bch_fs *c, struct bio *bio,
 		mutex_unlock(&c->bio_bounce_pages_lock);
 }
 
+static unsigned bio_add_bounce_pages_nomerge(struct bch_fs *c, struct bio *bio,
+					     size_t size, bool *using_mempool)
+{
+	unsigned nr = 0;
+
+	while (size) {
+		struct page *page = __bio_alloc_page_pool(c, using_mempool);
+		unsigned len = min_t(size_t, PAGE_SIZE, size);
+
+		__bio_add_page(bio, page, len, 0);
+		size -= len;
+		nr++;
+	}
+
+	return nr;
+}
+
+/*
+ * Build a bio for reading an entire extent where we only want part of it:
+ * @head and @tail sectors go to bounce pages, and the part we want is read
+ * directly into @src's pages. Pages are added without merging, so that we know
+ * which bvecs to free:
+ */
+static void bch2_rbio_alloc_split_bounce(struct bch_fs *c,
+					 struct bch_read_bio *rbio,
+					 struct bio *src, struct bvec_iter iter,
+					 unsigned head, unsigned tail)
+{
+	struct bio *bio = &rbio->bio;
+	bool using_mempool = false;
+	struct bio_vec bv;
+
+	rbio->bounce_head_vecs =
+		bio_add_bounce_pages_nomerge(c, bio, head << 9, &using_mempool);
+
+	__bio_for_each_segment(bv, src, iter, iter)
+		__bio_add_page(bio, bv.bv_page, bv.bv_len, bv.bv_offset);
+
+	rbio->bounce_tail_vecs =
+		bio_add_bounce_pages_nomerge(c, bio, tail << 9, &using_mempool);
+
+	if (using_mempool)
+		mutex_unlock(&c->bio_bounce_pages_lock);
+}
+
+static void bch2_rbio_free_split_bounce(struct bch_read_bio *rbio)
+{
+	struct bio *bio = &rbio->bio;
+	unsigned i;
+
+	for (i = 0; i < bio->bi_vcnt; i++)
+		if (i < rbio->bounce_head_vecs ||
+		    i >= bio->bi_vcnt - rbio->bounce_tail_vecs)
+			mempool_free(bio->bi_io_vec[i].bv_page,
+				     &rbio->c->bio_bounce_pages);
+	bio->bi_vcnt = 0;
+}
+
 /* Extent update path: */
 
 int bch2_sum_sector_overwrites(struct btree_trans *trans,
@@ -250,13 +368,19 @@ int bch2_sum_sector_overwrites(struct btree_trans *trans,
 	return ret;
 }
 
-int bch2_extent_update(struct btree_trans *trans,
-		       struct btree_iter *iter,
-		       struct bkey_i *k,
-		       struct disk_reservation *disk_res,
-		       u64 *journal_seq,
-		       u64 new_i_size,
-		       s64 *i_sectors_delta_total)
+/*
+ * @new_mtime and @new_ctime, if nonzero, are applied if we're updating the
+ * inode anyway for i_size or i_sectors - so that the inode update for the
+ * timestamps that would otherwise follow on fsync becomes a noop:
+ */
+int __bch2_extent_update(struct btree_trans *trans,
+			 struct btree_iter *iter,
+			 struct bkey_i *k,
+			 struct disk_reservation *disk_res,
+			 u64 *journal_seq,
+			 u64 new_i_size,
+			 s64 *i_sectors_delta_total,
+			 s64 new_mtime, s64 new_ctime)
 {
 	/* this must live until after bch2_trans_commit(): */
 	struct bkey_inode_buf inode_p;
@@ -320,6 +444,11 @@ int bch2_extent_update(struct btree_trans *trans,
 		inode_u.bi_sectors += i_sectors_delta;
 
 		if (i_sectors_delta || new_i_size) {
+			if (new_mtime > inode_u.bi_mtime)
+				inode_u.bi_mtime = new_mtime;
+			if (new_ctime > inode_u.bi_ctime)
+				inode_u.bi_ctime = new_ctime;
+
 			bch2_inode_pack(trans->c, &inode_p, &inode_u);
 			bch2_trans_update(trans, inode_iter,
 					  &inode_p.inode.k_i, 0);
@@ -438,9 +567,11 @@ int bch2_write_index_default(struct bch_write_op *op)
 		bkey_copy(sk.k, k);
 		bch2_cut_front(iter->pos, sk.k);
 
-		ret = bch2_extent_update(&trans, iter, sk.k,
+		ret = bch2_trans_rebalance_work_add(&trans, sk.k, &op->opts) ?:
+			__bch2_extent_update(&trans, iter, sk.k,
 					 &op->res, op_journal_seq(op),
-					 op->new_i_size, &op->i_sectors_delta);
+					 op->new_i_size, &op->i_sectors_delta,
+					 op->new_mtime, op->new_ctime);
 		if (ret == -EINTR)
 			continue;
 		if (ret)
@@ -458,6 +589,94 @@ int bch2_write_index_default(struct bch_write_op *op)
 
 /* Writes */
 
+/*
+ * Write coalescing:
+ *
+ * Small sync writes (O_DSYNC writes, and fsync driven writeback) to a device
+ * are queued and submitted together from a worker under a single plug. Small
+ * writes are packed into percpu write points, so concurrent sync writes from
+ * different files tend to be physically adjacent, and the block layer merges
+ * them into larger requests - the journal flush that follows is batched by
+ * journal group commit.
+ */
+void bch2_dev_write_coalesce_work(struct work_struct *work)
+{
+	struct bch_dev *ca =
+		container_of(work, struct bch_dev, write_coalesce_work);
+	struct blk_plug plug;
+	struct bio_list bios;
+	struct bio *bio;
+
+	while (1) {
+		spin_lock(&ca->write_coalesce_lock);
+		bios = ca->write_coalesce_bios;
+		bio_list_init(&ca->write_coalesce_bios);
+		spin_unlock(&ca->write_coalesce_lock);
+
+		if (bio_list_empty(&bios))
+			break;
+
+		blk_start_plug(&plug);
+		while ((bio = bio_list_pop(&bios)))
+			submit_bio(bio);
+		blk_finish_plug(&plug);
+	}
+}
+
+static inline bool should_coalesce_write(struct bch_fs *c, struct bio *bio,
+					 enum bch_data_type type)
+{
+	return c->opts.write_coalesce &&
+		type == BCH_DATA_user &&
+		(bio->bi_opf & REQ_SYNC) &&
+		bio_sectors(bio) <= WRITE_POINT_PERCPU_MAX_SECTORS;
+}
+
+static void bch2_dev_write_coalesce(struct bch_dev *ca, struct bio *bio)
+{
+	bool kick;
+
+	spin_lock(&ca->write_coalesce_lock);
+	kick = bio_list_empty(&ca->write_coalesce_bios);
+	bio_list_add(&ca->write_coalesce_bios, bio);
+	spin_unlock(&ca->write_coalesce_lock);
+
+	if (kick)
+		queue_work(system_highpri_wq, &ca->write_coalesce_work);
+}
+
+static void __bch2_submit_wbio(struct bch_fs *c, struct bch_dev *ca,
+			       struct bch_write_bio *n,
+			       const struct bch_extent_ptr *ptr,
+			       enum bch_data_type type)
+{
+	n->c			= c;
+	n->dev			= ptr->dev;
+	n->have_ioref		= bch2_dev_get_ioref(ca,
+				type == BCH_DATA_btree ? READ : WRITE);
+	n->submit_time		= local_clock();
+	n->bio.bi_iter.bi_sector = ptr->offset;
+
+	if (likely(n->have_ioref)) {
+		this_cpu_add(ca->io_done->sectors[WRITE][type],
+			     bio_sectors(&n->bio));
+		bch2_dev_io_start(ca, WRITE, type);
+
+		if (type == BCH_DATA_user)
+			atomic_inc(&ca->data_writes_in_flight);
+
+		bio_set_dev(&n->bio, ca->disk_sb.bdev);
+
+		if (should_coalesce_write(c, &n->bio, type))
+			bch2_dev_write_coalesce(ca, &n->bio);
+		else
+			submit_bio(&n->bio);
+	} else {
+		n->bio.bi_status	= BLK_STS_REMOVED;
+		bio_endio(&n->bio);
+	}
+}
+
 void bch2_submit_wbio_replicas(struct bch_write_bio *wbio, struct bch_fs *c,
 			       enum bch_data_type type,
 			       const struct bkey_i *k)
@@ -492,23 +711,7 @@ void bch2_submit_wbio_replicas(struct bch_write_bio *wbio, struct bch_fs *c,
 			n->split		= false;
 		}
 
-		n->c			= c;
-		n->dev			= ptr->dev;
-		n->have_ioref		= bch2_dev_get_ioref(ca,
-					type == BCH_DATA_btree ? READ : WRITE);
-		n->submit_time		= local_clock();
-		n->bio.bi_iter.bi_sector = ptr->offset;
-
-		if (likely(n->have_ioref)) {
-			this_cpu_add(ca->io_done->sectors[WRITE][type],
-				     bio_sectors(&n->bio));
-
-			bio_set_dev(&n->bio, ca->disk_sb.bdev);
-			submit_bio(&n->bio);
-		} else {
-			n->bio.bi_status	= BLK_STS_REMOVED;
-			bio_endio(&n->bio);
-		}
+		__bch2_submit_wbio(c, ca, n, ptr, type);
 	}
 }
 
@@ -540,6 +743,23 @@ static void bch2_write_done(struct closure *cl)
 	}
 }
 
+static void bch2_write_ack_put(struct bch_write_ack *ack)
+{
+	if (atomic_dec_and_test(&ack->ref))
+		queue_work(ack->c->wq, &ack->work);
+}
+
+/* Late replica failures can't be handled until our extents are inserted: */
+static void bch2_write_acks_indexed(struct bch_write_op *op)
+{
+	struct bch_write_ack *ack;
+
+	while ((ack = op->acks)) {
+		op->acks = ack->next;
+		bch2_write_ack_put(ack);
+	}
+}
+
 /**
  * bch_write_index - after a write, update index to point to new data
  */
@@ -606,6 +826,7 @@ static void __bch2_write_index(struct bch_write_op *op)
 		bch2_open_bucket_write_error(c, &op->open_buckets, dev);
 
 	bch2_open_buckets_put(c, &op->open_buckets);
+	bch2_write_acks_indexed(op);
 	return;
 err:
 	keys->top = keys->keys;
@@ -649,7 +870,8 @@ static void bch2_write_endio(struct bio *bio)
 		set_bit(wbio->dev, op->failed.d);
 
 	if (wbio->have_ioref) {
-		bch2_latency_acct(ca, wbio->submit_time, WRITE);
+		bch2_latency_acct(ca, wbio->submit_time, WRITE, BCH_DATA_user);
+		atomic_dec(&ca->data_writes_in_flight);
 		percpu_ref_put(&ca->io_ref);
 	}
 
@@ -667,6 +889,267 @@ static void bch2_write_endio(struct bio *bio)
 		continue_at_nobarrier(cl, bch2_write_index, index_update_wq(op));
 }
 
+/*
+ * Early write acknowledgement:
+ *
+ * With write_early_ack set, a write with more replicas than
+ * data_replicas_required doesn't wait for the slowest device: each replica is
+ * submitted as a separate clone of the bounced data, and once nr_required of
+ * them have completed we let the op do its index update (with all pointers)
+ * and complete. The rest finish in the background; if any of them then fail,
+ * bch2_write_ack_work() drops those pointers from the extents we wrote, which
+ * updates replicas accounting like any other extent update - the extent is
+ * left degraded, as if the device had failed. That only runs once both the
+ * last replica write and the op's index update are done, so the pointers are
+ * always dropped from extents that have already been inserted.
+ *
+ * Only bounced, checksummed writes of a single extent to the extents btree are
+ * eligible: the data and the open buckets have to outlive the op, and until a
+ * late replica completes a read from it will fail its checksum and be retried
+ * from another replica.
+ *
+ * Completing early only means nr_required replicas are on disk - writes that
+ * have to be durable when they complete (BCH_WRITE_FLUSH, i.e. O_DSYNC direct
+ * IO) always wait for every replica. Otherwise durability is up to fsync, which
+ * waits for op->acks_pending: if we crash before then, the extent may point to
+ * replicas that were never written, and is left degraded, as above.
+ */
+static void bch2_write_ack_drop_ptrs(struct bch_write_ack *ack)
+{
+	struct bch_fs *c = ack->c;
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	struct bkey_buf sk;
+	struct bkey_i *orig;
+	struct bch_extent_ptr *ptr;
+	const struct bch_extent_ptr *o;
+	unsigned nr_ptrs;
+	int ret = 0;
+
+	bch2_bkey_buf_init(&sk);
+	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 0);
+
+	for (orig = (void *) ack->keys;
+	     orig != (void *) (ack->keys + ack->keys_u64s) && !ret;
+	     orig = bkey_next(orig)) {
+		iter = bch2_trans_get_iter(&trans, BTREE_ID_EXTENTS,
+					   bkey_start_pos(&orig->k),
+					   BTREE_ITER_INTENT);
+
+		while ((k = bch2_btree_iter_peek(iter)).k &&
+		       !(ret = bkey_err(k)) &&
+		       bkey_cmp(bkey_start_pos(k.k), orig->k.p) < 0) {
+			bch2_bkey_buf_reassemble(&sk, c, k);
+			nr_ptrs = bch2_bkey_nr_ptrs(bkey_i_to_s_c(sk.k));
+
+			/* Only pointers to exactly what we wrote: */
+			bch2_bkey_drop_ptrs(bkey_i_to_s(sk.k), ptr,
+				test_bit(ptr->dev, ack->late_failed.d) &&
+				(o = bch2_bkey_has_device(bkey_i_to_s_c(orig),
+							  ptr->dev)) &&
+				o->offset == ptr->offset &&
+				o->gen == ptr->gen);
+
+			if (bch2_bkey_nr_ptrs(bkey_i_to_s_c(sk.k)) == nr_ptrs ||
+			    !bch2_bkey_nr_ptrs(bkey_i_to_s_c(sk.k))) {
+				bch2_btree_iter_next(iter);
+				continue;
+			}
+
+			bch2_btree_iter_set_pos(iter, bkey_start_pos(&sk.k->k));
+
+			bch2_trans_update(&trans, iter, sk.k, 0);
+
+			ret = bch2_trans_commit(&trans, NULL, NULL,
+						BTREE_INSERT_NOFAIL);
+			if (ret == -EINTR)
+				ret = 0;
+			if (ret)
+				break;
+		}
+
+		bch2_trans_iter_put(&trans, iter);
+	}
+
+	bch2_trans_exit(&trans);
+	bch2_bkey_buf_exit(&sk, c);
+
+	if (ret)
+		bch_err_inum_ratelimited(c, ack->inum,
+			"error %i dropping pointers to failed replica writes", ret);
+}
+
+static void bch2_write_ack_work(struct work_struct *work)
+{
+	struct bch_write_ack *ack =
+		container_of(work, struct bch_write_ack, work);
+	struct bch_fs *c = ack->c;
+	struct bch_write_bio *wbio = to_wbio(ack->bio);
+
+	if (!bitmap_empty(ack->late_failed.d, BCH_SB_MEMBERS_MAX))
+		bch2_write_ack_drop_ptrs(ack);
+
+	bch2_open_buckets_put(c, &ack->open_buckets);
+
+	if (wbio->bounce)
+		bch2_bio_free_pages_pool(c, &wbio->bio);
+	if (wbio->put_bio)
+		bio_put(&wbio->bio);
+
+	if (ack->pending &&
+	    atomic_dec_and_test(ack->pending))
+		wake_up_var(ack->pending);
+
+	percpu_ref_put(&c->writes);
+	kfree(ack);
+}
+
+static void bch2_write_ack_endio(struct bio *bio)
+{
+	struct bch_write_ack *ack	= bio->bi_private;
+	struct bch_write_bio *wbio	= to_wbio(bio);
+	struct bch_fs *c		= ack->c;
+	struct bch_dev *ca		= bch_dev_bkey_exists(c, wbio->dev);
+	struct bch_write_op *op		= NULL;
+	unsigned long flags;
+	bool failed, done;
+
+	failed = bch2_dev_inum_io_err_on(bio->bi_status, ca, ack->inum,
+				bio->bi_iter.bi_sector,
+				"data write error: %s",
+				bch2_blk_status_to_str(bio->bi_status));
+
+	if (wbio->have_ioref) {
+		bch2_latency_acct(ca, wbio->submit_time, WRITE, BCH_DATA_user);
+		atomic_dec(&ca->data_writes_in_flight);
+		percpu_ref_put(&ca->io_ref);
+	}
+
+	spin_lock_irqsave(&ack->lock, flags);
+	if (!ack->acked) {
+		if (failed)
+			set_bit(wbio->dev, ack->op->failed.d);
+		else
+			ack->nr_ok++;
+	} else if (failed) {
+		set_bit(wbio->dev, ack->late_failed.d);
+	}
+
+	done = !--ack->remaining;
+
+	if (!ack->acked &&
+	    (ack->nr_ok >= ack->nr_required || done)) {
+		ack->acked	= true;
+		op		= ack->op;
+		ack->op		= NULL;
+	}
+	spin_unlock_irqrestore(&ack->lock, flags);
+
+	bio_put(bio);
+
+	if (op)
+		closure_put(&op->cl);
+	if (done)
+		bch2_write_ack_put(ack);
+}
+
+/*
+ * Returns a bch_write_ack if @bio, which was just built for the keys starting
+ * at @k, may complete early; it then owns @bio:
+ */
+static struct bch_write_ack *bch2_write_ack_start(struct bch_write_op *op,
+						  struct bio *bio,
+						  struct bkey_i *k)
+{
+	struct bch_fs *c = op->c;
+	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(bkey_i_to_s_c(k));
+	const struct bch_extent_ptr *ptr;
+	struct bch_write_ack *ack;
+	struct open_bucket *ob;
+	unsigned i, nr_ptrs = 0, u64s = op->insert_keys.top_p - (u64 *) k;
+
+	if (!c->opts.write_early_ack ||
+	    (op->flags & BCH_WRITE_FLUSH) ||
+	    !to_wbio(bio)->bounce ||
+	    !op->csum_type ||
+	    op->opts.erasure_code ||
+	    op->index_update_fn != bch2_write_index_default ||
+	    (op->flags & BCH_WRITE_CACHED))
+		return NULL;
+
+	bkey_for_each_ptr(ptrs, ptr) {
+		if (ptr->cached)
+			return NULL;
+		nr_ptrs++;
+	}
+
+	if (nr_ptrs <= op->nr_replicas_required)
+		return NULL;
+
+	ack = kzalloc(struct_size(ack, keys, u64s), GFP_NOIO);
+	if (!ack)
+		return NULL;
+
+	ack->c		= c;
+	ack->op		= op;
+	ack->bio	= bio;
+	ack->inum	= op->pos.inode;
+	ack->pending	= op->acks_pending;
+	spin_lock_init(&ack->lock);
+	ack->remaining	= nr_ptrs;
+	ack->nr_required = op->nr_replicas_required;
+	atomic_set(&ack->ref, 2);
+	INIT_WORK(&ack->work, bch2_write_ack_work);
+
+	/* The buckets mustn't be reused while late replicas are in flight: */
+	open_bucket_for_each(c, &op->open_buckets, ob, i) {
+		atomic_inc(&ob->pin);
+		ob_push(c, &ack->open_buckets, ob);
+	}
+
+	ack->keys_u64s	= u64s;
+	memcpy_u64s(ack->keys, k, u64s);
+
+	ack->next	= op->acks;
+	op->acks	= ack;
+
+	if (ack->pending)
+		atomic_inc(ack->pending);
+
+	/* op holds a ref on c->writes, so this can't fail: */
+	percpu_ref_get(&c->writes);
+	return ack;
+}
+
+static void bch2_write_ack_submit(struct bch_write_ack *ack,
+				  const struct bkey_i *k)
+{
+	struct bch_fs *c = ack->c;
+	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(bkey_i_to_s_c(k));
+	const struct bch_extent_ptr *ptr;
+	struct bch_write_bio *n;
+	struct bch_dev *ca;
+
+	BUG_ON(c->opts.nochanges);
+
+	bkey_for_each_ptr(ptrs, ptr) {
+		ca = bch_dev_bkey_exists(c, ptr->dev);
+
+		n = to_wbio(bio_clone_fast(ack->bio, GFP_NOIO,
+					   &ca->replica_set));
+		n->bio.bi_end_io	= bch2_write_ack_endio;
+		n->bio.bi_private	= ack;
+		n->bio.bi_opf		= ack->bio->bi_opf;
+		n->parent		= NULL;
+		n->split		= false;
+		n->bounce		= false;
+		n->put_bio		= true;
+
+		__bch2_submit_wbio(c, ca, n, ptr, BCH_DATA_user);
+	}
+}
+
 static void init_append_extent(struct bch_write_op *op,
 			       struct write_point *wp,
 			       struct bversion version,
@@ -719,18 +1202,32 @@ static struct bio *bch2_write_bio_alloc(struct bch_fs *c,
 {
 	struct bch_write_bio *wbio;
 	struct bio *bio;
+	unsigned buf_offset = buf
+		? ((unsigned long) buf & (PAGE_SIZE - 1))
+		: 0;
 	unsigned output_available =
 		min(wp->sectors_free << 9, src->bi_iter.bi_size);
-	unsigned pages = DIV_ROUND_UP(output_available +
-				      (buf
-				       ? ((unsigned long) buf & (PAGE_SIZE - 1))
-				       : 0), PAGE_SIZE);
+	unsigned pages;
+
+	/*
+	 * Writeback bios can be bigger than BIO_MAX_PAGES (see
+	 * bch2_writepage_io_alloc()), bounce bios can't - the rest of @src goes
+	 * in the next extent:
+	 */
+	output_available = min_t(unsigned, output_available,
+				 BIO_MAX_PAGES * PAGE_SIZE - buf_offset);
+	pages = DIV_ROUND_UP(output_available + buf_offset, PAGE_SIZE);
 
 	bio = bio_alloc_bioset(GFP_NOIO, pages, &c->bio_write);
 	wbio			= wbio_init(bio);
 	wbio->put_bio		= true;
-	/* copy WRITE_SYNC flag */
+	/*
+	 * copy WRITE_SYNC flag, and the priority and blk-cgroup background
+	 * moves run at:
+	 */
 	wbio->bio.bi_opf	= src->bi_opf;
+	wbio->bio.bi_ioprio	= src->bi_ioprio;
+	bio_clone_blkg_association(bio, src);
 
 	if (buf) {
 		bch2_bio_map(bio, buf, output_available);
@@ -824,11 +1321,18 @@ static enum prep_encoded_ret {
 
 	BUG_ON(bio_sectors(bio) != op->crc.compressed_size);
 
-	/* Can we just write the entire extent as is? */
+	/*
+	 * Can we just write the entire extent as is? Not if it's checksummed
+	 * uncompressed data bigger than checksum_granularity - the normal path
+	 * below splits it:
+	 */
 	if (op->crc.uncompressed_size == op->crc.live_size &&
 	    op->crc.compressed_size <= wp->sectors_free &&
 	    (op->crc.compression_type == op->compression_type ||
-	     op->incompressible)) {
+	     op->incompressible) &&
+	    (crc_is_compressed(op->crc) ||
+	     !op->csum_type ||
+	     op->crc.uncompressed_size <= bch2_csum_granularity(c))) {
 		if (!crc_is_compressed(op->crc) &&
 		    op->csum_type != op->crc.csum_type &&
 		    bch2_write_rechecksum(c, op, op->csum_type))
@@ -884,12 +1388,187 @@ static enum prep_encoded_ret {
 	return PREP_ENCODED_OK;
 }
 
+/*
+ * Large compressed writes: the extents bch2_write_extent() is about to write
+ * are compressed in parallel up front, then copied into place in the bounce bio
+ * as the main loop gets to them:
+ */
+#define WRITE_COMPRESS_CHUNKS_MAX	16
+
+struct write_compress_chunk {
+	struct closure		cl;
+	struct bch_fs		*c;
+	struct bio		*src;
+	struct bvec_iter	iter;
+	unsigned		offset;
+	unsigned		compression_type;
+	unsigned		compression_level;
+	size_t			src_len;
+	size_t			dst_len;
+	void			*buf;
+	void			*workspace;
+};
+
+static void write_compress_chunk_work(struct closure *cl)
+{
+	struct write_compress_chunk *chunk =
+		container_of(cl, struct write_compress_chunk, cl);
+
+	chunk->dst_len = chunk->iter.bi_size;
+	chunk->compression_type =
+		bch2_bio_compress_to_buf(chunk->c, chunk->workspace,
+					 chunk->buf, &chunk->dst_len,
+					 chunk->src, chunk->iter,
+					 &chunk->src_len,
+					 chunk->compression_type,
+					 chunk->compression_level);
+	closure_return(cl);
+}
+
+static void write_compress_chunks_free(struct bch_fs *c,
+				       struct write_compress_chunk *chunks,
+				       unsigned nr)
+{
+	unsigned i;
+
+	if (!chunks)
+		return;
+
+	for (i = 0; i < nr; i++)
+		kvpfree(chunks[i].buf, c->sb.encoded_extent_max << 9);
+	kfree(chunks);
+}
+
+static struct write_compress_chunk *
+write_compress_parallel(struct bch_write_op *op, struct write_point *wp,
+			struct bio *dst, unsigned *nr)
+{
+	struct bch_fs *c = op->c;
+	struct bio *src = &op->wbio.bio;
+	struct write_compress_chunk *chunks;
+	struct bvec_iter iter = src->bi_iter;
+	unsigned chunk_bytes = c->sb.encoded_extent_max << 9;
+	unsigned i, bytes = min3(src->bi_iter.bi_size,
+				 dst->bi_iter.bi_size,
+				 wp->sectors_free << 9);
+	struct closure cl;
+
+	/* Only compress ahead what we know this write point has room for: */
+	*nr = min3(bytes / chunk_bytes,
+		   (unsigned) WRITE_COMPRESS_CHUNKS_MAX,
+		   num_online_cpus());
+	if (*nr < 2)
+		return NULL;
+
+	chunks = kcalloc(*nr, sizeof(*chunks), GFP_NOIO);
+	if (!chunks)
+		return NULL;
+
+	/*
+	 * Each chunk gets its own workspace, allocated here without touching
+	 * the workspace mempool - that only reserves one, so a write can't
+	 * take more than one element from it without risking deadlock:
+	 */
+	for (i = 0; i < *nr; i++) {
+		chunks[i].buf = kvpmalloc(chunk_bytes, GFP_NOIO|__GFP_NOWARN);
+		if (!chunks[i].buf)
+			break;
+
+		chunks[i].workspace =
+			bch2_compress_workspace_alloc(c, op->compression_type);
+		if (!chunks[i].workspace) {
+			kvpfree(chunks[i].buf, chunk_bytes);
+			chunks[i].buf = NULL;
+			break;
+		}
+
+		chunks[i].c		= c;
+		chunks[i].src		= src;
+		chunks[i].iter		= iter;
+		chunks[i].iter.bi_size	= chunk_bytes;
+		chunks[i].offset	= i * chunk_bytes;
+		chunks[i].compression_type = op->compression_type;
+		chunks[i].compression_level = op->compression_level;
+
+		bio_advance_iter(src, &iter, chunk_bytes);
+	}
+
+	*nr = i;
+	if (*nr < 2)
+		goto err;
+
+	closure_init_stack(&cl);
+
+	for (i = 1; i < *nr; i++)
+		closure_call(&chunks[i].cl, write_compress_chunk_work,
+			     system_unbound_wq, &cl);
+
+	/* The first chunk is done on this CPU: */
+	closure_init(&chunks[0].cl, &cl);
+	write_compress_chunk_work(&chunks[0].cl);
+
+	closure_sync(&cl);
+err:
+	for (i = 0; i < *nr; i++) {
+		bch2_compress_workspace_free(c, op->compression_type,
+					     chunks[i].workspace);
+		chunks[i].workspace = NULL;
+	}
+
+	if (*nr < 2) {
+		write_compress_chunks_free(c, chunks, *nr);
+		return NULL;
+	}
+
+	return chunks;
+}
+
+static unsigned write_compress(struct bch_write_op *op,
+			       struct write_compress_chunk *chunks,
+			       unsigned nr_chunks, unsigned offset,
+			       struct bio *dst, size_t *dst_len,
+			       struct bio *src, size_t *src_len)
+{
+	struct write_compress_chunk *chunk;
+	struct bvec_iter iter;
+
+	/*
+	 * We can only use a chunk if the previous extent ended exactly where
+	 * this chunk starts, and if its output fits:
+	 */
+	for (chunk = chunks; chunk < chunks + nr_chunks; chunk++)
+		if (chunk->offset == offset)
+			goto found;
+
+	return bch2_bio_compress(op->c, dst, dst_len, src, src_len,
+				 op->compression_type, op->compression_level);
+found:
+	if (chunk->compression_type == BCH_COMPRESSION_TYPE_none ||
+	    chunk->compression_type == BCH_COMPRESSION_TYPE_incompressible)
+		return chunk->compression_type;
+
+	if (chunk->dst_len > dst->bi_iter.bi_size)
+		return bch2_bio_compress(op->c, dst, dst_len, src, src_len,
+					 op->compression_type,
+					 op->compression_level);
+
+	iter = dst->bi_iter;
+	iter.bi_size = chunk->dst_len;
+	memcpy_to_bio(dst, iter, chunk->buf);
+
+	*dst_len = chunk->dst_len;
+	*src_len = chunk->src_len;
+	return chunk->compression_type;
+}
+
 static int bch2_write_extent(struct bch_write_op *op, struct write_point *wp,
 			     struct bio **_dst)
 {
 	struct bch_fs *c = op->c;
 	struct bio *src = &op->wbio.bio, *dst = src;
 	struct bvec_iter saved_iter;
+	struct write_compress_chunk *compress_chunks = NULL;
+	unsigned nr_compress_chunks = 0;
 	void *ec_buf;
 	struct bpos ec_pos = op->pos;
 	unsigned total_output = 0, total_input = 0;
@@ -937,6 +1616,10 @@ static int bch2_write_extent(struct bch_write_op *op, struct write_point *wp,
 
 	saved_iter = dst->bi_iter;
 
+	if (op->compression_type && !op->incompressible && bounce)
+		compress_chunks = write_compress_parallel(op, wp, dst,
+						&nr_compress_chunks);
+
 	do {
 		struct bch_extent_crc_unpacked crc =
 			(struct bch_extent_crc_unpacked) { 0 };
@@ -956,8 +1639,9 @@ static int bch2_write_extent(struct bch_write_op *op, struct write_point *wp,
 		crc.compression_type = op->incompressible
 			? BCH_COMPRESSION_TYPE_incompressible
 			: op->compression_type
-			? bch2_bio_compress(c, dst, &dst_len, src, &src_len,
-					    op->compression_type)
+			? write_compress(op, compress_chunks,
+					 nr_compress_chunks, total_input,
+					 dst, &dst_len, src, &src_len)
 			: 0;
 		if (!crc_is_compressed(crc)) {
 			dst_len = min(dst->bi_iter.bi_size, src->bi_iter.bi_size);
@@ -965,7 +1649,7 @@ static int bch2_write_extent(struct bch_write_op *op, struct write_point *wp,
 
 			if (op->csum_type)
 				dst_len = min_t(unsigned, dst_len,
-						c->sb.encoded_extent_max << 9);
+						bch2_csum_granularity(c) << 9);
 
 			if (bounce) {
 				swap(dst->bi_iter.bi_size, dst_len);
@@ -1046,8 +1730,13 @@ static int bch2_write_extent(struct bch_write_op *op, struct write_point *wp,
 				      ARRAY_SIZE(op->inline_keys),
 				      BKEY_EXTENT_U64s_MAX));
 
+	write_compress_chunks_free(c, compress_chunks, nr_compress_chunks);
+
 	more = src->bi_iter.bi_size != 0;
 
+	bch2_usage_history_account_write(c, total_input >> 9,
+					 total_output >> 9);
+
 	dst->bi_iter = saved_iter;
 
 	if (dst == src && more) {
@@ -1072,6 +1761,8 @@ static int bch2_write_extent(struct bch_write_op *op, struct write_point *wp,
 		"rewriting existing data (memory corruption?)");
 	ret = -EIO;
 err:
+	write_compress_chunks_free(c, compress_chunks, nr_compress_chunks);
+
 	if (to_wbio(dst)->bounce)
 		bch2_bio_free_pages_pool(c, dst);
 	if (to_wbio(dst)->put_bio)
@@ -1086,11 +1777,21 @@ static void __bch2_write(struct closure *cl)
 	struct bch_fs *c = op->c;
 	struct write_point *wp;
 	struct bio *bio;
+	struct bch_write_ack *ack;
+	struct blk_plug plug;
 	bool skip_put = true;
 	unsigned nofs_flags;
 	int ret;
 
 	nofs_flags = memalloc_nofs_save();
+	/*
+	 * Plug across the whole op: a write that's split into multiple extents,
+	 * or written to multiple replicas, then goes down to each device as one
+	 * batch, and adjacent extents can be merged. If we block (on the
+	 * allocator, or in closure_sync() below) the plug is flushed by the
+	 * scheduler:
+	 */
+	blk_start_plug(&plug);
 again:
 	memset(&op->failed, 0, sizeof(op->failed));
 
@@ -1174,21 +1875,36 @@ static void __bch2_write(struct closure *cl)
 		bio->bi_private	= &op->cl;
 		bio->bi_opf |= REQ_OP_WRITE;
 
+		key_to_write = (void *) (op->insert_keys.keys_p +
+					 key_to_write_offset);
+
+		/*
+		 * Early ack is only for ops written as a single bio; the ack
+		 * then drops the ref on op->cl we take here:
+		 */
+		ack = !ret && !key_to_write_offset
+			? bch2_write_ack_start(op, bio, key_to_write)
+			: NULL;
+		if (ack)
+			skip_put = false;
+
 		if (!skip_put)
-			closure_get(bio->bi_private);
+			closure_get(&op->cl);
 		else
 			op->flags |= BCH_WRITE_SKIP_CLOSURE_PUT;
 
-		key_to_write = (void *) (op->insert_keys.keys_p +
-					 key_to_write_offset);
-
-		bch2_submit_wbio_replicas(to_wbio(bio), c, BCH_DATA_user,
-					  key_to_write);
+		if (ack)
+			bch2_write_ack_submit(ack, key_to_write);
+		else
+			bch2_submit_wbio_replicas(to_wbio(bio), c, BCH_DATA_user,
+						  key_to_write);
 	} while (ret);
 
 	if (!skip_put)
 		continue_at(cl, bch2_write_index, index_update_wq(op));
 out:
+	/* @op may already be freed - the plug is on our stack: */
+	blk_finish_plug(&plug);
 	memalloc_nofs_restore(nofs_flags);
 	return;
 err:
@@ -1225,6 +1941,11 @@ static void __bch2_write(struct closure *cl)
 	goto again;
 }
 
+static unsigned bch2_write_inline_data_max(struct bch_fs *c)
+{
+	return c->opts.inline_data_max ?: min(block_bytes(c) / 2, 1024U);
+}
+
 static void bch2_write_data_inline(struct bch_write_op *op, unsigned data_len)
 {
 	struct closure *cl = &op->cl;
@@ -1326,7 +2047,7 @@ void bch2_write(struct closure *cl)
 			 op->new_i_size - (op->pos.offset << 9));
 
 	if (c->opts.inline_data &&
-	    data_len <= min(block_bytes(c) / 2, 1024U)) {
+	    data_len <= bch2_write_inline_data_max(c)) {
 		bch2_write_data_inline(op, data_len);
 		return;
 	}
@@ -1354,6 +2075,7 @@ struct promote_op {
 
 	struct rhash_head	hash;
 	struct bpos		pos;
+	unsigned		sectors;
 
 	struct migrate_write	write;
 	struct bio_vec		bi_inline_vecs[0]; /* must be last */
@@ -1365,30 +2087,145 @@ static const struct rhashtable_params bch_promote_params = {
 	.key_len	= sizeof(struct bpos),
 };
 
-static inline bool should_promote(struct bch_fs *c, struct bkey_s_c k,
-				  struct bpos pos,
-				  struct bch_io_opts opts,
-				  unsigned flags)
+/*
+ * Promote admission filter:
+ *
+ * With promote_min_accesses > 1, we only promote extents that have been read
+ * that many times recently - so that scans and one-off reads don't churn the
+ * cache device. Accesses are counted in a small count-min sketch, keyed by the
+ * extent's position; counters are halved every PROMOTE_SKETCH_WINDOW accesses
+ * so that old accesses age out (as in TinyLFU).
+ *
+ * Updates aren't atomic - races just lose the occasional count:
+ */
+#define PROMOTE_SKETCH_ROWS	4
+#define PROMOTE_SKETCH_BITS	12
+#define PROMOTE_SKETCH_WIDTH	(1U << PROMOTE_SKETCH_BITS)
+#define PROMOTE_SKETCH_SIZE	(PROMOTE_SKETCH_ROWS * PROMOTE_SKETCH_WIDTH)
+#define PROMOTE_SKETCH_WINDOW	(PROMOTE_SKETCH_WIDTH * 8)
+
+static void promote_sketch_age(struct bch_fs *c)
+{
+	unsigned i;
+
+	for (i = 0; i < PROMOTE_SKETCH_SIZE; i++)
+		WRITE_ONCE(c->promote_sketch[i],
+			   READ_ONCE(c->promote_sketch[i]) >> 1);
+}
+
+/* Records an access, and returns the (approximate) number of recent accesses: */
+static unsigned promote_sketch_access(struct bch_fs *c, struct bpos pos)
+{
+	unsigned i, ret = U8_MAX;
+
+	for (i = 0; i < PROMOTE_SKETCH_ROWS; i++) {
+		u8 *p = c->promote_sketch + i * PROMOTE_SKETCH_WIDTH +
+			(jhash(&pos, sizeof(pos), i) & (PROMOTE_SKETCH_WIDTH - 1));
+		u8 v = READ_ONCE(*p);
+
+		if (v < U8_MAX)
+			WRITE_ONCE(*p, ++v);
+		ret = min_t(unsigned, ret, v);
+	}
+
+	if (atomic_inc_return(&c->promote_sketch_nr) == PROMOTE_SKETCH_WINDOW) {
+		promote_sketch_age(c);
+		atomic_set(&c->promote_sketch_nr, 0);
+	}
+
+	return ret;
+}
+
+/*
+ * The sketch is saved in the superblock at clean shutdown, so that a remount
+ * doesn't start with every extent cold. Counters are clamped to 4 bits, which
+ * is enough for any promote_min_accesses. It's only a hint, so if there's no
+ * room for it we quietly skip it:
+ */
+#define PROMOTE_SKETCH_SB_MAX	15
+
+void bch2_promote_sketch_to_sb(struct bch_fs *c)
+{
+	struct bch_sb_field_promote_sketch *s;
+	unsigned i, u64s = DIV_ROUND_UP(sizeof(*s) + PROMOTE_SKETCH_SIZE / 2,
+					sizeof(u64));
+
+	lockdep_assert_held(&c->sb_lock);
+
+	if (!bch2_sb_field_resize_fits(c, BCH_SB_FIELD_promote_sketch, u64s))
+		return;
+
+	s = bch2_sb_resize_promote_sketch(&c->disk_sb, u64s);
+	if (!s)
+		return;
+
+	s->nr	= cpu_to_le32(PROMOTE_SKETCH_SIZE);
+	s->pad	= 0;
+	memset(s->counters, 0, PROMOTE_SKETCH_SIZE / 2);
+
+	for (i = 0; i < PROMOTE_SKETCH_SIZE; i++)
+		s->counters[i / 2] |= min_t(u8, READ_ONCE(c->promote_sketch[i]),
+					    PROMOTE_SKETCH_SB_MAX) << ((i & 1) * 4);
+}
+
+static void bch2_promote_sketch_from_sb(struct bch_fs *c)
+{
+	struct bch_sb_field_promote_sketch *s =
+		bch2_sb_get_promote_sketch(c->disk_sb.sb);
+	unsigned i;
+
+	if (!s || le32_to_cpu(s->nr) != PROMOTE_SKETCH_SIZE)
+		return;
+
+	for (i = 0; i < PROMOTE_SKETCH_SIZE; i++)
+		c->promote_sketch[i] = (s->counters[i / 2] >> ((i & 1) * 4)) &
+			PROMOTE_SKETCH_SB_MAX;
+}
+
+static const char * const bch2_promote_results[] = {
+#define x(n)	#n,
+	BCH_PROMOTE_RESULTS()
+#undef x
+	NULL
+};
+
+static inline enum bch_promote_result
+should_promote(struct bch_fs *c, struct bkey_s_c k,
+	       struct bpos pos,
+	       struct bch_io_opts opts,
+	       unsigned flags)
 {
 	if (!(flags & BCH_READ_MAY_PROMOTE))
-		return false;
+		return BCH_PROMOTE_none;
 
 	if (!opts.promote_target)
-		return false;
+		return BCH_PROMOTE_none;
 
 	if (bch2_bkey_has_target(c, k, opts.promote_target))
-		return false;
+		return BCH_PROMOTE_already_cached;
+
+	if (c->opts.promote_min_accesses > 1 &&
+	    promote_sketch_access(c, k.k->p) < c->opts.promote_min_accesses)
+		return BCH_PROMOTE_not_admitted;
 
-	if (bch2_target_congested(c, opts.promote_target)) {
+	if (bch2_rand_range(CONGESTED_MAX) <
+	    bch2_target_congested(c, opts.promote_target)) {
 		/* XXX trace this */
-		return false;
+		return BCH_PROMOTE_congested;
 	}
 
 	if (rhashtable_lookup_fast(&c->promote_table, &pos,
 				   bch_promote_params))
-		return false;
+		return BCH_PROMOTE_in_flight;
 
-	return true;
+	return BCH_PROMOTE_promoted;
+}
+
+static inline void promote_result_account(struct bch_fs *c,
+					  enum bch_promote_result r)
+{
+	if (r != BCH_PROMOTE_none)
+		this_cpu_inc(c->promote_stats[r]);
 }
 
 static void promote_free(struct bch_fs *c, struct promote_op *op)
@@ -1433,8 +2270,16 @@ static void promote_start(struct promote_op *op, struct bch_read_bio *rbio)
 
 	bch2_migrate_read_done(&op->write, rbio);
 
+	/*
+	 * We may have read more than we're promoting - the write path
+	 * rechecksums (or decompresses) just the part we want:
+	 */
+	op->write.op.crc.offset		+= op->pos.offset - rbio->pos.offset;
+	op->write.op.crc.live_size	= op->sectors;
+	op->write.op.pos		= op->pos;
+
 	closure_init(cl, NULL);
-	closure_call(&op->write.op.cl, bch2_write, c->wq, cl);
+	closure_call(&op->write.op.cl, bch2_write, c->move_wq, cl);
 	closure_return_with_destructor(cl, promote_done);
 }
 
@@ -1442,6 +2287,7 @@ static struct promote_op *__promote_alloc(struct bch_fs *c,
 					  enum btree_id btree_id,
 					  struct bkey_s_c k,
 					  struct bpos pos,
+					  unsigned promote_sectors,
 					  struct extent_ptr_decoded *pick,
 					  struct bch_io_opts opts,
 					  unsigned sectors,
@@ -1461,6 +2307,7 @@ static struct promote_op *__promote_alloc(struct bch_fs *c,
 
 	op->start_time = local_clock();
 	op->pos = pos;
+	op->sectors = promote_sectors;
 
 	/*
 	 * We don't use the mempool here because extents that aren't
@@ -1512,40 +2359,87 @@ static struct promote_op *__promote_alloc(struct bch_fs *c,
 	return NULL;
 }
 
+/*
+ * Partial promotion: with promote_window set (or promote_whole_extents
+ * cleared), we only promote the part of the extent around what was read,
+ * rounded out to promote_window (relative to the start of the extent, so that
+ * reads of the same extent agree on where windows start). The migrate index
+ * update then splits the extent, so that the new cached pointer only covers
+ * the part we promoted.
+ *
+ * If the extent is checksummed or compressed we still have to read all of it,
+ * but we only write what we're promoting:
+ */
+static void promote_window(struct bch_fs *c, struct bkey_s_c k,
+			   unsigned *offset, unsigned *sectors)
+{
+	unsigned window = c->opts.promote_window;
+	unsigned start = *offset, end = *offset + *sectors;
+
+	if (!window)
+		return;
+
+	start	= rounddown(start, window);
+	end	= start + min(k.k->size - start, roundup(end - start, window));
+
+	*offset		= start;
+	*sectors	= end - start;
+}
+
 noinline
 static struct promote_op *promote_alloc(struct bch_fs *c,
-					       struct bvec_iter iter,
 					       struct bkey_s_c k,
 					       struct extent_ptr_decoded *pick,
 					       struct bch_io_opts opts,
 					       unsigned flags,
 					       struct bch_read_bio **rbio,
 					       bool *bounce,
-					       bool *read_full)
+					       bool *read_full,
+					       unsigned *offset,
+					       unsigned *sectors)
 {
-	bool promote_full = *read_full || READ_ONCE(c->promote_whole_extents);
-	/* data might have to be decompressed in the write path: */
-	unsigned sectors = promote_full
-		? max(pick->crc.compressed_size, pick->crc.live_size)
-		: bvec_iter_sectors(iter);
-	struct bpos pos = promote_full
-		? bkey_start_pos(k.k)
-		: POS(k.k->p.inode, iter.bi_sector);
+	bool promote_full = !c->opts.promote_window &&
+		READ_ONCE(c->promote_whole_extents);
+	struct bpos pos = bkey_start_pos(k.k);
+	unsigned promote_offset = 0, promote_sectors = k.k->size;
+	unsigned alloc_sectors;
 	struct promote_op *promote;
+	enum bch_promote_result r;
+
+	if (!promote_full) {
+		promote_offset	= *offset;
+		promote_sectors	= *sectors;
+		promote_window(c, k, &promote_offset, &promote_sectors);
+		pos.offset	+= promote_offset;
+	}
 
-	if (!should_promote(c, k, pos, opts, flags))
+	r = should_promote(c, k, pos, opts, flags);
+	if (r != BCH_PROMOTE_promoted) {
+		promote_result_account(c, r);
 		return NULL;
+	}
+
+	/* data might have to be decompressed in the write path: */
+	alloc_sectors = promote_full || *read_full
+		? max(pick->crc.compressed_size, pick->crc.live_size)
+		: promote_sectors;
 
 	promote = __promote_alloc(c,
 				  k.k->type == KEY_TYPE_reflink_v
 				  ? BTREE_ID_REFLINK
 				  : BTREE_ID_EXTENTS,
-				  k, pos, pick, opts, sectors, rbio);
+				  k, pos, promote_sectors, pick, opts,
+				  alloc_sectors, rbio);
+	promote_result_account(c, promote
+			       ? BCH_PROMOTE_promoted
+			       : BCH_PROMOTE_alloc_failed);
 	if (!promote)
 		return NULL;
 
 	*bounce		= true;
-	*read_full	= promote_full;
+	*read_full	|= promote_full;
+	*offset		= promote_offset;
+	*sectors	= promote_sectors;
 	return promote;
 }
 
@@ -1567,6 +2461,19 @@ bch2_rbio_parent(struct bch_read_bio *rbio)
 	return rbio->split ? rbio->parent : rbio;
 }
 
+static inline struct workqueue_struct *
+rbio_complete_wq(struct bch_read_bio *rbio, enum rbio_context context)
+{
+	struct bch_fs *c = rbio->c;
+
+	if (rbio->flags & BCH_READ_NODECODE)
+		return c->move_read_complete_wq;
+
+	return context == RBIO_CONTEXT_HIGHPRI
+		? c->read_complete_wq
+		: c->read_complete_unbound_wq;
+}
+
 __always_inline
 static void bch2_rbio_punt(struct bch_read_bio *rbio, work_func_t fn,
 			   enum rbio_context context,
@@ -1592,6 +2499,9 @@ static inline struct bch_read_bio *bch2_rbio_free(struct bch_read_bio *rbio)
 	if (rbio->bounce)
 		bch2_bio_free_pages_pool(rbio->c, &rbio->bio);
 
+	if (rbio->split_bounce)
+		bch2_rbio_free_split_bounce(rbio);
+
 	if (rbio->split) {
 		struct bch_read_bio *parent = rbio->parent;
 
@@ -1790,8 +2700,8 @@ static void bch2_rbio_error(struct bch_read_bio *rbio, int retry,
 		rbio->bio.bi_status = error;
 		bch2_rbio_done(rbio);
 	} else {
-		bch2_rbio_punt(rbio, bch2_rbio_retry,
-			       RBIO_CONTEXT_UNBOUND, system_unbound_wq);
+		bch2_rbio_punt(rbio, bch2_rbio_retry, RBIO_CONTEXT_UNBOUND,
+			       rbio_complete_wq(rbio, RBIO_CONTEXT_UNBOUND));
 	}
 }
 
@@ -1873,7 +2783,7 @@ static void __bch2_read_endio(struct work_struct *work)
 	struct bch_csum csum;
 
 	/* Reset iterator for checksumming and copying bounced data: */
-	if (rbio->bounce) {
+	if (rbio->bounce || rbio->split_bounce) {
 		src->bi_iter.bi_size		= crc.compressed_size << 9;
 		src->bi_iter.bi_idx		= 0;
 		src->bi_iter.bi_bvec_done	= 0;
@@ -1955,6 +2865,201 @@ static void __bch2_read_endio(struct work_struct *work)
 	return;
 }
 
+/*
+ * Hedged reads:
+ *
+ * If a read of replicated data hasn't completed within the configured
+ * percentile of the device's read latency, we issue a second read of the same
+ * data from another replica (or via EC reconstruction), and use whichever
+ * completes first - so that a single stalled device doesn't stall the read.
+ *
+ * The first read is always bounced, so that if it loses it never touches the
+ * parent bio's pages. Whichever read completes first claims the hedge: if the
+ * second read wins, it copies its data into the parent bio and completes the
+ * first read's part of it. The second read is done synchronously from a
+ * worker, like a retry, into its own buffer.
+ *
+ * The hedge holds a ref on the first device's io_ref, so that the device (and
+ * filesystem) can't go away while the second read is outstanding.
+ */
+struct bch_read_hedge {
+	struct hrtimer		timer;
+	struct work_struct	work;
+	atomic_t		ref;
+	atomic_t		claimed;
+
+	struct bch_fs		*c;
+	struct bch_dev		*ca;
+	struct bch_read_bio	*orig;
+	struct bch_io_opts	opts;
+	struct bvec_iter	iter;
+	unsigned		offset_into_extent;
+	unsigned		flags;
+	struct bch_io_failures	failed;
+
+	/* the extent being read, for the second read: */
+	u64			k[];
+};
+
+static void bch2_read_hedge_put(struct bch_read_hedge *h)
+{
+	if (atomic_dec_and_test(&h->ref)) {
+		percpu_ref_put(&h->ca->io_ref);
+		kfree(h);
+	}
+}
+
+/*
+ * Whether to hedge a read from @pick, and how long to wait first: returns 0 if
+ * hedging is off, we don't know the device's latency distribution yet, or
+ * there's nothing else to read from:
+ */
+static u64 bch2_read_hedge_delay(struct bch_fs *c, struct bkey_s_c k,
+				 struct extent_ptr_decoded *pick,
+				 struct bch_io_failures *failed)
+{
+	unsigned percentile = c->opts.read_hedge_percentile;
+	struct bch_dev *ca = bch_dev_bkey_exists(c, pick->ptr.dev);
+	struct bch_io_failures f = { .nr = 0 };
+	struct extent_ptr_decoded p;
+	int idx;
+	u64 delay;
+
+	if (!percentile)
+		return 0;
+
+	/* quantiles are at 1/16ths: */
+	idx = clamp_t(int, percentile * (NR_QUANTILES + 1) / 100 - 1,
+		      0, NR_QUANTILES - 1);
+	delay = READ_ONCE(ca->io_latency[READ].quantiles.entries[
+						QUANTILE_IDX(idx)].m);
+	if (!delay)
+		return 0;
+
+	if (failed)
+		f = *failed;
+	bch2_mark_io_failure(&f, pick);
+
+	if (bch2_bkey_pick_read_device(c, k, &f, &p) <= 0 ||
+	    (p.ptr.dev == pick->ptr.dev && p.idx == pick->idx))
+		return 0;
+
+	return delay;
+}
+
+static void bch2_read_hedge_work(struct work_struct *work)
+{
+	struct bch_read_hedge *h =
+		container_of(work, struct bch_read_hedge, work);
+	struct bch_fs *c = h->c;
+	struct btree_trans trans;
+	struct bch_read_bio *rbio;
+	struct bvec_iter src_iter, dst_iter = h->iter;
+	unsigned bytes = h->iter.bi_size;
+	int ret;
+
+	if (atomic_read(&h->claimed))
+		goto out;
+
+	rbio = rbio_init(bio_alloc_bioset(GFP_NOIO,
+					  DIV_ROUND_UP(bytes, PAGE_SIZE),
+					  &c->bio_read_split),
+			 h->opts);
+	bch2_bio_alloc_pages_pool(c, &rbio->bio, bytes);
+	rbio->c		= c;
+	src_iter	= rbio->bio.bi_iter;
+
+	atomic_long_inc(&c->read_hedges);
+
+	bch2_trans_init(&trans, c, 0, 0);
+	ret = __bch2_read_extent(&trans, rbio, src_iter,
+				 bkey_i_to_s_c((struct bkey_i *) h->k),
+				 h->offset_into_extent, &h->failed,
+				 h->flags);
+	bch2_trans_exit(&trans);
+
+	if (!ret && !rbio->bio.bi_status &&
+	    !atomic_xchg(&h->claimed, 1)) {
+		atomic_long_inc(&c->read_hedges_won);
+
+		bio_copy_data_iter(&h->orig->bio, &dst_iter,
+				   &rbio->bio, &src_iter);
+		bch2_rbio_done(h->orig);
+	}
+
+	bch2_bio_free_pages_pool(c, &rbio->bio);
+	bio_put(&rbio->bio);
+out:
+	bch2_read_hedge_put(h);
+}
+
+static enum hrtimer_restart bch2_read_hedge_timer(struct hrtimer *timer)
+{
+	struct bch_read_hedge *h =
+		container_of(timer, struct bch_read_hedge, timer);
+
+	/* The ref the timer had now belongs to the work item: */
+	queue_work(system_unbound_wq, &h->work);
+	return HRTIMER_NORESTART;
+}
+
+static void bch2_read_hedge_start(struct bch_read_bio *rbio,
+				  struct bch_read_bio *orig,
+				  struct bvec_iter iter, struct bkey_s_c k,
+				  unsigned offset_into_extent,
+				  struct bch_io_failures *failed,
+				  unsigned flags, u64 delay)
+{
+	struct bch_fs *c = rbio->c;
+	struct bch_read_hedge *h;
+
+	h = kmalloc(sizeof(*h) + bkey_bytes(k.k), GFP_NOIO);
+	if (!h)
+		return;
+
+	hrtimer_init(&h->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	h->timer.function	= bch2_read_hedge_timer;
+	INIT_WORK(&h->work, bch2_read_hedge_work);
+	atomic_set(&h->ref, 2);
+	atomic_set(&h->claimed, 0);
+
+	h->c			= c;
+	h->ca			= bch_dev_bkey_exists(c, rbio->pick.ptr.dev);
+	h->orig			= orig;
+	h->opts			= orig->opts;
+	h->iter			= iter;
+	h->offset_into_extent	= offset_into_extent;
+	h->flags		= (flags & ~(BCH_READ_LAST_FRAGMENT|
+					     BCH_READ_MAY_PROMOTE|
+					     BCH_READ_USER_MAPPED))|
+		BCH_READ_IN_RETRY;
+	h->failed.nr		= 0;
+	if (failed)
+		h->failed	= *failed;
+	bch2_mark_io_failure(&h->failed, &rbio->pick);
+	bkey_reassemble((struct bkey_i *) h->k, k);
+
+	/* The caller has an io ref on this device, for the first read: */
+	percpu_ref_get(&h->ca->io_ref);
+
+	rbio->hedge = h;
+	hrtimer_start(&h->timer, ns_to_ktime(delay), HRTIMER_MODE_REL);
+}
+
+/*
+ * Called when the first read of a hedged read completes: returns true if it
+ * won, and should complete the parent bio as normal. The caller still owns the
+ * first read's ref on @h, and drops it once it's done with its bio:
+ */
+static bool bch2_read_hedge_claim(struct bch_read_hedge *h)
+{
+	bool won = !atomic_xchg(&h->claimed, 1);
+
+	if (hrtimer_try_to_cancel(&h->timer) == 1)
+		bch2_read_hedge_put(h);
+	return won;
+}
+
 static void bch2_read_endio(struct bio *bio)
 {
 	struct bch_read_bio *rbio =
@@ -1963,12 +3068,32 @@ static void bch2_read_endio(struct bio *bio)
 	struct bch_dev *ca	= bch_dev_bkey_exists(c, rbio->pick.ptr.dev);
 	struct workqueue_struct *wq = NULL;
 	enum rbio_context context = RBIO_CONTEXT_NULL;
+	struct bch_read_hedge *h = rbio->hedge;
 
 	if (rbio->have_ioref) {
-		bch2_latency_acct(ca, rbio->submit_time, READ);
+		bch2_latency_acct(ca, rbio->submit_time, READ,
+				  rbio->pick.ptr.cached
+				  ? BCH_DATA_cached : BCH_DATA_user);
+		atomic_dec(&ca->reads_in_flight);
 		percpu_ref_put(&ca->io_ref);
 	}
 
+	if (h) {
+		rbio->hedge = NULL;
+
+		if (!bch2_read_hedge_claim(h)) {
+			/*
+			 * The hedged read beat us, and completed the parent
+			 * bio - the hedge's io ref has to outlive our bio:
+			 */
+			bch2_rbio_free(rbio);
+			bch2_read_hedge_put(h);
+			return;
+		}
+
+		bch2_read_hedge_put(h);
+	}
+
 	if (!rbio->split)
 		rbio->bio.bi_end_io = rbio->end_io;
 
@@ -2000,9 +3125,12 @@ static void bch2_read_endio(struct bio *bio)
 	if (rbio->narrow_crcs ||
 	    crc_is_compressed(rbio->pick.crc) ||
 	    bch2_csum_type_is_encryption(rbio->pick.crc.csum_type))
-		context = RBIO_CONTEXT_UNBOUND,	wq = system_unbound_wq;
+		context = RBIO_CONTEXT_UNBOUND;
 	else if (rbio->pick.crc.csum_type)
-		context = RBIO_CONTEXT_HIGHPRI,	wq = system_highpri_wq;
+		context = RBIO_CONTEXT_HIGHPRI;
+
+	if (context != RBIO_CONTEXT_NULL)
+		wq = rbio_complete_wq(rbio, context);
 
 	bch2_rbio_punt(rbio, __bch2_read_endio, context, wq);
 }
@@ -2053,7 +3181,13 @@ int __bch2_read_extent(struct btree_trans *trans, struct bch_read_bio *orig,
 	struct bch_dev *ca;
 	struct promote_op *promote = NULL;
 	bool bounce = false, read_full = false, narrow_crcs = false;
+	bool split_bounce = false;
+	unsigned split_bounce_vecs = 0;
 	struct bpos pos = bkey_start_pos(k.k);
+	/* part of the extent to read, if we're not reading all of it: */
+	unsigned read_offset = offset_into_extent;
+	unsigned read_sectors = bvec_iter_sectors(iter);
+	u64 hedge_delay = 0;
 	int pick_ret;
 
 	if (bkey_extent_is_inline_data(k.k)) {
@@ -2095,6 +3229,12 @@ int __bch2_read_extent(struct btree_trans *trans, struct bch_read_bio *orig,
 		goto get_bio;
 	}
 
+	if (!(flags & BCH_READ_IN_RETRY) && !pick.idx) {
+		hedge_delay = bch2_read_hedge_delay(c, k, &pick, failed);
+		if (hedge_delay)
+			flags |= BCH_READ_MUST_BOUNCE;
+	}
+
 	if (!(flags & BCH_READ_LAST_FRAGMENT) ||
 	    bio_flagged(&orig->bio, BIO_CHAIN))
 		flags |= BCH_READ_MUST_CLONE;
@@ -2118,8 +3258,24 @@ int __bch2_read_extent(struct btree_trans *trans, struct bch_read_bio *orig,
 	}
 
 	if (orig->opts.promote_target)
-		promote = promote_alloc(c, iter, k, &pick, orig->opts, flags,
-					&rbio, &bounce, &read_full);
+		promote = promote_alloc(c, k, &pick, orig->opts, flags,
+					&rbio, &bounce, &read_full,
+					&read_offset, &read_sectors);
+
+	/*
+	 * If we're only bouncing because we want part of a checksummed
+	 * extent, read the part we want directly into the destination and only
+	 * bounce the rest - the checksum is verified over the whole bio in
+	 * place, and there's nothing to copy:
+	 */
+	if (read_full && !promote &&
+	    !crc_is_compressed(pick.crc) &&
+	    !bch2_csum_type_is_encryption(pick.crc.csum_type) &&
+	    !narrow_crcs &&
+	    !(flags & BCH_READ_MUST_BOUNCE)) {
+		split_bounce	= true;
+		bounce		= false;
+	}
 
 	if (!read_full) {
 		EBUG_ON(crc_is_compressed(pick.crc));
@@ -2129,17 +3285,36 @@ int __bch2_read_extent(struct btree_trans *trans, struct bch_read_bio *orig,
 			 pick.crc.offset ||
 			 offset_into_extent));
 
-		pos.offset += offset_into_extent;
+		pos.offset += read_offset;
 		pick.ptr.offset += pick.crc.offset +
-			offset_into_extent;
-		offset_into_extent		= 0;
-		pick.crc.compressed_size	= bvec_iter_sectors(iter);
-		pick.crc.uncompressed_size	= bvec_iter_sectors(iter);
+			read_offset;
+		offset_into_extent		-= read_offset;
+		pick.crc.compressed_size	= read_sectors;
+		pick.crc.uncompressed_size	= read_sectors;
 		pick.crc.offset			= 0;
-		pick.crc.live_size		= bvec_iter_sectors(iter);
-		offset_into_extent		= 0;
+		pick.crc.live_size		= read_sectors;
 	}
 get_bio:
+	if (split_bounce) {
+		unsigned head = pick.crc.offset + offset_into_extent;
+		unsigned tail = pick.crc.compressed_size - head -
+			bvec_iter_sectors(iter);
+		struct bvec_iter i = iter;
+		struct bio_vec bv;
+
+		split_bounce_vecs = DIV_ROUND_UP(head, PAGE_SECTORS) +
+			DIV_ROUND_UP(tail, PAGE_SECTORS);
+
+		__bio_for_each_segment(bv, &orig->bio, i, iter)
+			split_bounce_vecs++;
+
+		/* Too many bvecs for one bio, bounce the whole extent: */
+		if (split_bounce_vecs > BIO_MAX_PAGES) {
+			split_bounce	= false;
+			bounce		= true;
+		}
+	}
+
 	if (rbio) {
 		/*
 		 * promote already allocated bounce rbio:
@@ -2160,8 +3335,25 @@ int __bch2_read_extent(struct btree_trans *trans, struct bch_read_bio *orig,
 				 orig->opts);
 
 		bch2_bio_alloc_pages_pool(c, &rbio->bio, sectors << 9);
+		rbio->bio.bi_ioprio = orig->bio.bi_ioprio;
+		bio_clone_blkg_association(&rbio->bio, &orig->bio);
 		rbio->bounce	= true;
 		rbio->split	= true;
+	} else if (split_bounce) {
+		unsigned head = pick.crc.offset + offset_into_extent;
+		unsigned tail = pick.crc.compressed_size - head -
+			bvec_iter_sectors(iter);
+
+		rbio = rbio_init(bio_alloc_bioset(GFP_NOIO, split_bounce_vecs,
+						  &c->bio_read_split),
+				 orig->opts);
+
+		bch2_rbio_alloc_split_bounce(c, rbio, &orig->bio, iter,
+					     head, tail);
+		rbio->bio.bi_ioprio = orig->bio.bi_ioprio;
+		bio_clone_blkg_association(&rbio->bio, &orig->bio);
+		rbio->split_bounce = true;
+		rbio->split	= true;
 	} else if (flags & BCH_READ_MUST_CLONE) {
 		/*
 		 * Have to clone if there were any splits, due to error
@@ -2194,6 +3386,11 @@ int __bch2_read_extent(struct btree_trans *trans, struct bch_read_bio *orig,
 	rbio->offset_into_extent= offset_into_extent;
 	rbio->flags		= flags;
 	rbio->have_ioref	= pick_ret > 0 && bch2_dev_get_ioref(ca, READ);
+	if (rbio->have_ioref) {
+		atomic_inc(&ca->reads_in_flight);
+		bch2_dev_io_start(ca, READ, pick.ptr.cached
+				  ? BCH_DATA_cached : BCH_DATA_user);
+	}
 	rbio->narrow_crcs	= narrow_crcs;
 	rbio->hole		= 0;
 	rbio->retry		= 0;
@@ -2238,8 +3435,26 @@ int __bch2_read_extent(struct btree_trans *trans, struct bch_read_bio *orig,
 
 		this_cpu_add(ca->io_done->sectors[READ][BCH_DATA_user],
 			     bio_sectors(&rbio->bio));
+
+		if (orig->opts.promote_target &&
+		    !(flags & BCH_READ_NODECODE)) {
+			if (pick.ptr.cached ||
+			    bch2_dev_in_target(c, ca->dev_idx,
+					       orig->opts.promote_target))
+				this_cpu_add(ca->io_done->cache_hit,
+					     bio_sectors(&rbio->bio));
+			else
+				this_cpu_add(ca->io_done->cache_miss,
+					     bio_sectors(&rbio->bio));
+		}
+
 		bio_set_dev(&rbio->bio, ca->disk_sb.bdev);
 
+		if (hedge_delay && rbio->bounce && !rbio->promote)
+			bch2_read_hedge_start(rbio, orig, iter, k,
+					      offset_into_extent, failed,
+					      flags, hedge_delay);
+
 		if (likely(!(flags & BCH_READ_IN_RETRY)))
 			submit_bio(&rbio->bio);
 		else
@@ -2388,8 +3603,42 @@ void bch2_read(struct bch_fs *c, struct bch_read_bio *rbio, u64 inode)
 	goto out;
 }
 
+void bch2_dev_cache_stats_to_text(struct printbuf *out, struct bch_dev *ca)
+{
+	pr_buf(out, "hit:\t\t%llu\n",
+	       percpu_u64_get(&ca->io_done->cache_hit) << 9);
+	pr_buf(out, "miss:\t\t%llu\n",
+	       percpu_u64_get(&ca->io_done->cache_miss) << 9);
+	pr_buf(out, "evicted:\t%llu\n",
+	       percpu_u64_get(&ca->io_done->cache_evicted) << 9);
+}
+
+void bch2_fs_cache_stats_to_text(struct printbuf *out, struct bch_fs *c)
+{
+	struct bch_dev *ca;
+	unsigned i;
+
+	pr_buf(out, "promotes:\n");
+	for (i = BCH_PROMOTE_promoted; i < BCH_PROMOTE_RESULT_NR; i++)
+		pr_buf(out, "  %-16s%llu\n",
+		       bch2_promote_results[i],
+		       percpu_u64_get(&c->promote_stats[i]));
+
+	pr_buf(out, "bytes read/evicted:\n");
+	pr_buf(out, "  %-16s%-16s%-16s%-16s\n",
+	       "device", "hit", "miss", "evicted");
+
+	for_each_member_device(ca, c, i)
+		pr_buf(out, "  %-16s%-16llu%-16llu%-16llu\n", ca->name,
+		       percpu_u64_get(&ca->io_done->cache_hit) << 9,
+		       percpu_u64_get(&ca->io_done->cache_miss) << 9,
+		       percpu_u64_get(&ca->io_done->cache_evicted) << 9);
+}
+
 void bch2_fs_io_exit(struct bch_fs *c)
 {
+	free_percpu(c->promote_stats);
+	kvpfree(c->promote_sketch, PROMOTE_SKETCH_SIZE);
 	if (c->promote_table.tbl)
 		rhashtable_destroy(&c->promote_table);
 	mempool_exit(&c->bio_bounce_pages);
@@ -2411,8 +3660,14 @@ int bch2_fs_io_init(struct bch_fs *c)
 					 c->opts.btree_node_size,
 					 c->sb.encoded_extent_max) /
 				   PAGE_SECTORS, 0) ||
-	    rhashtable_init(&c->promote_table, &bch_promote_params))
+	    rhashtable_init(&c->promote_table, &bch_promote_params) ||
+	    !(c->promote_sketch = kvpmalloc(PROMOTE_SKETCH_SIZE,
+					    GFP_KERNEL|__GFP_ZERO)) ||
+	    !(c->promote_stats = __alloc_percpu(sizeof(u64) *
+						BCH_PROMOTE_RESULT_NR,
+						sizeof(u64))))
 		return -ENOMEM;
 
+	bch2_promote_sketch_from_sb(c);
 	return 0;
 }
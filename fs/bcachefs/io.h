@@ -15,8 +15,50 @@
 void bch2_bio_free_pages_pool(struct bch_fs *, struct bio *);
 void bch2_bio_alloc_pages_pool(struct bch_fs *, struct bio *, size_t);
 
-void bch2_latency_acct(struct bch_dev *, u64, int);
+void bch2_latency_acct(struct bch_dev *, u64, int, enum bch_data_type);
 
+static inline bool bch2_dev_io_type_tracked(enum bch_data_type type)
+{
+	return  type == BCH_DATA_journal ||
+		type == BCH_DATA_btree ||
+		type == BCH_DATA_user ||
+		type == BCH_DATA_cached;
+}
+
+/* Must be paired with a bch2_latency_acct() call when the bio completes: */
+static inline void bch2_dev_io_start(struct bch_dev *ca, int rw,
+				     enum bch_data_type type)
+{
+	atomic_inc(&ca->io_in_flight[rw][type]);
+}
+
+int bch2_dev_io_latency_alloc(struct bch_dev *);
+void bch2_dev_io_latency_free(struct bch_dev *);
+
+/* How long an idle device takes to go from fully congested to uncongested: */
+#define CONGESTED_DECAY_NS	(100 * NSEC_PER_MSEC)
+
+/*
+ * Returns how congested @ca is, from 0 to CONGESTED_MAX - see io.c: an idle
+ * device doesn't get IO completions to bring it back down, so it decays with
+ * time since it was last congested:
+ */
+static inline unsigned bch2_dev_congested(struct bch_dev *ca, u64 now)
+{
+	unsigned congested = max(atomic_read(&ca->congested[READ]),
+				 atomic_read(&ca->congested[WRITE]));
+	u64 last = READ_ONCE(ca->congested_last);
+
+	if (congested && time_after64(now, last))
+		congested -= min_t(u64, congested,
+				   div64_u64((now - last) * CONGESTED_MAX,
+					     CONGESTED_DECAY_NS));
+	return congested;
+}
+
+unsigned bch2_target_congested(struct bch_fs *, u16);
+
+void bch2_dev_write_coalesce_work(struct work_struct *);
 void bch2_submit_wbio_replicas(struct bch_write_bio *, struct bch_fs *,
 			       enum bch_data_type, const struct bkey_i *);
 
@@ -57,14 +99,28 @@ static inline struct workqueue_struct *index_update_wq(struct bch_write_op *op)
 {
 	return op->alloc_reserve == RESERVE_MOVINGGC
 		? op->c->copygc_wq
+		: op->flags & BCH_WRITE_FROM_INTERNAL
+		? op->c->move_wq
 		: op->c->wq;
 }
 
 int bch2_sum_sector_overwrites(struct btree_trans *, struct btree_iter *,
 			       struct bkey_i *, bool *, bool *, s64 *, s64 *);
-int bch2_extent_update(struct btree_trans *, struct btree_iter *,
-		       struct bkey_i *, struct disk_reservation *,
-		       u64 *, u64, s64 *);
+int __bch2_extent_update(struct btree_trans *, struct btree_iter *,
+			 struct bkey_i *, struct disk_reservation *,
+			 u64 *, u64, s64 *, s64, s64);
+
+static inline int bch2_extent_update(struct btree_trans *trans,
+				     struct btree_iter *iter,
+				     struct bkey_i *k,
+				     struct disk_reservation *disk_res,
+				     u64 *journal_seq, u64 new_i_size,
+				     s64 *i_sectors_delta)
+{
+	return __bch2_extent_update(trans, iter, k, disk_res, journal_seq,
+				    new_i_size, i_sectors_delta, 0, 0);
+}
+
 int bch2_fpunch_at(struct btree_trans *, struct btree_iter *,
 		   struct bpos, u64 *, s64 *);
 int bch2_fpunch(struct bch_fs *c, u64, u64, u64, u64 *, s64 *);
@@ -81,11 +137,14 @@ static inline void bch2_write_op_init(struct bch_write_op *op, struct bch_fs *c,
 	op->error		= 0;
 	op->csum_type		= bch2_data_checksum_type(c, opts.data_checksum);
 	op->compression_type	= bch2_compression_opt_to_type[opts.compression];
+	op->compression_level	= c->opts.compression_level;
 	op->nr_replicas		= 0;
 	op->nr_replicas_required = c->opts.data_replicas_required;
 	op->alloc_reserve	= RESERVE_NONE;
 	op->incompressible	= 0;
 	op->open_buckets.nr	= 0;
+	op->acks		= NULL;
+	op->acks_pending	= NULL;
 	op->devs_have.nr	= 0;
 	op->target		= 0;
 	op->opts		= opts;
@@ -96,6 +155,8 @@ static inline void bch2_write_op_init(struct bch_write_op *op, struct bch_fs *c,
 	op->journal_seq		= 0;
 	op->new_i_size		= U64_MAX;
 	op->i_sectors_delta	= 0;
+	op->new_mtime		= 0;
+	op->new_ctime		= 0;
 	op->index_update_fn	= bch2_write_index_default;
 }
 
@@ -161,10 +222,16 @@ static inline struct bch_read_bio *rbio_init(struct bio *bio,
 
 	rbio->_state	= 0;
 	rbio->promote	= NULL;
+	rbio->hedge	= NULL;
 	rbio->opts	= opts;
 	return rbio;
 }
 
+void bch2_promote_sketch_to_sb(struct bch_fs *);
+
+void bch2_dev_cache_stats_to_text(struct printbuf *, struct bch_dev *);
+void bch2_fs_cache_stats_to_text(struct printbuf *, struct bch_fs *);
+
 void bch2_fs_io_exit(struct bch_fs *);
 int bch2_fs_io_init(struct bch_fs *);
 
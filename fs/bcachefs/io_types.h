@@ -13,6 +13,22 @@
 #include <linux/llist.h>
 #include <linux/workqueue.h>
 
+#define BCH_PROMOTE_RESULTS()		\
+	x(none)				\
+	x(promoted)			\
+	x(already_cached)		\
+	x(not_admitted)			\
+	x(congested)			\
+	x(in_flight)			\
+	x(alloc_failed)
+
+enum bch_promote_result {
+#define x(n)	BCH_PROMOTE_##n,
+	BCH_PROMOTE_RESULTS()
+#undef x
+	BCH_PROMOTE_RESULT_NR
+};
+
 struct bch_read_bio {
 	struct bch_fs		*c;
 	u64			start_time;
@@ -50,11 +66,20 @@ struct bch_read_bio {
 				narrow_crcs:1,
 				hole:1,
 				retry:2,
-				context:2;
+				context:2,
+				split_bounce:1;
 	};
 	u16			_state;
 	};
 
+	/*
+	 * With @split_bounce, only the part of the extent we don't want is
+	 * bounced: the first and last bvecs of @bio are bounce pages, the rest
+	 * belong to the parent bio:
+	 */
+	unsigned		bounce_head_vecs;
+	unsigned		bounce_tail_vecs;
+
 	struct bch_devs_list	devs_have;
 
 	struct extent_ptr_decoded pick;
@@ -63,6 +88,7 @@ struct bch_read_bio {
 	struct bversion		version;
 
 	struct promote_op	*promote;
+	struct bch_read_hedge	*hedge;
 
 	struct bch_io_opts	opts;
 
@@ -89,6 +115,39 @@ struct bch_write_bio {
 	struct bio		bio;
 };
 
+/*
+ * Replica writes of one extent write that may complete as soon as
+ * nr_required replicas are written - see bch2_write_ack_start():
+ */
+struct bch_write_ack {
+	struct bch_fs		*c;
+	/* NULL once the op has been completed: */
+	struct bch_write_op	*op;
+	/* on op->acks until the op's index update is done: */
+	struct bch_write_ack	*next;
+	/* one for the replica writes, one for the index update: */
+	atomic_t		ref;
+	/* bounced data, freed when the last replica write completes: */
+	struct bio		*bio;
+	u64			inum;
+	/* from the op, decremented when the last replica write completes: */
+	atomic_t		*pending;
+
+	spinlock_t		lock;
+	unsigned		remaining;
+	unsigned		nr_ok;
+	unsigned		nr_required;
+	bool			acked;
+	/* replica writes that failed after the op was completed: */
+	struct bch_devs_mask	late_failed;
+
+	struct open_buckets	open_buckets;
+	struct work_struct	work;
+
+	unsigned		keys_u64s;
+	u64			keys[];
+};
+
 struct bch_write_op {
 	struct closure		cl;
 	struct bch_fs		*c;
@@ -101,6 +160,7 @@ struct bch_write_op {
 
 	unsigned		csum_type:4;
 	unsigned		compression_type:4;
+	unsigned		compression_level:5;
 	unsigned		nr_replicas:4;
 	unsigned		nr_replicas_required:4;
 	unsigned		alloc_reserve:3;
@@ -122,6 +182,13 @@ struct bch_write_op {
 	struct disk_reservation	res;
 
 	struct open_buckets	open_buckets;
+	/* early acked replica writes waiting for our index update: */
+	struct bch_write_ack	*acks;
+	/*
+	 * Optional: counts this op's replica writes still in flight after it
+	 * was completed early, so that fsync can wait for them:
+	 */
+	atomic_t		*acks_pending;
 
 	/*
 	 * If caller wants to flush but hasn't passed us a journal_seq ptr, we
@@ -133,6 +200,12 @@ struct bch_write_op {
 	};
 	u64			new_i_size;
 	s64			i_sectors_delta;
+	/*
+	 * Timestamps to write along with i_size and i_sectors, when the index
+	 * update changes them - saves a separate inode update on fsync:
+	 */
+	s64			new_mtime;
+	s64			new_ctime;
 
 	int			(*index_update_fn)(struct bch_write_op *);
 
@@ -84,8 +84,10 @@ static void bch2_journal_buf_init(struct journal *j)
 	buf->noflush	= false;
 	buf->must_flush	= false;
 	buf->separate_flush = false;
-
-	memset(buf->has_inode, 0, sizeof(buf->has_inode));
+	buf->write_started = false;
+	buf->write_allocated = false;
+	buf->write_done	= false;
+	buf->nr_acks_required = 0;
 
 	memset(buf->data, 0, sizeof(*buf->data));
 	buf->data->seq	= cpu_to_le64(journal_cur_seq(j));
@@ -113,9 +115,145 @@ void bch2_journal_halt(struct journal *j)
 
 /* journal entry close/open: */
 
+/*
+ * Start the write of the oldest closed journal entry that hasn't been started
+ * yet: writes are started in order, and the next one isn't started until the
+ * previous has been allocated (bch2_journal_write() calls us again then).
+ */
+void bch2_journal_do_writes(struct journal *j)
+{
+	struct bch_fs *c = container_of(j, struct bch_fs, journal);
+	union journal_res_state s = READ_ONCE(j->reservations);
+	u64 seq, start = last_unwritten_seq(j);
+	unsigned depth = READ_ONCE(c->opts.journal_write_depth);
+
+	lockdep_assert_held(&j->lock);
+
+	for (seq = start;
+	     seq < journal_cur_seq(j) && seq < start + depth;
+	     seq++) {
+		struct journal_buf *w = j->buf + (seq & JOURNAL_BUF_MASK);
+
+		if (w->write_started) {
+			if (!w->write_allocated)
+				break;
+			continue;
+		}
+
+		if (!journal_state_count(s, seq & JOURNAL_BUF_MASK)) {
+			w->write_started = true;
+			closure_call(&w->io, bch2_journal_write,
+				     system_highpri_wq, NULL);
+		}
+		break;
+	}
+}
+
 void __bch2_journal_buf_put(struct journal *j)
 {
-	closure_call(&j->io, bch2_journal_write, system_highpri_wq, NULL);
+	spin_lock(&j->lock);
+	bch2_journal_do_writes(j);
+	spin_unlock(&j->lock);
+}
+
+/* percpu reservations: */
+
+static void journal_res_cpu_retire(struct journal *j,
+				   struct journal_res_cpu *p,
+				   union journal_res_cpu_state old,
+				   bool locked)
+{
+	struct journal_res res = {
+		.ref	= true,
+		.idx	= old.idx,
+		.offset	= old.offset,
+		.u64s	= old.end - old.offset,
+	};
+
+	while (res.u64s)
+		bch2_journal_add_entry(j, &res,
+				       BCH_JSET_ENTRY_btree_keys,
+				       0, 0, NULL, 0);
+
+	if (atomic_dec_and_test(&p->count[old.idx])) {
+		/*
+		 * With j->lock held we're closing the entry, which still
+		 * holds its own ref - it'll start the write:
+		 */
+		if (locked)
+			journal_state_buf_put(j, old.idx);
+		else
+			bch2_journal_buf_put(j, old.idx);
+	}
+}
+
+static void journal_res_cpu_try_retire(struct journal *j,
+				       struct journal_res_cpu *p,
+				       unsigned idx, bool locked)
+{
+	union journal_res_cpu_state old, new;
+	u64 v = atomic64_read(&p->state.counter);
+
+	do {
+		old.v = new.v = v;
+		if (!old.active || old.idx != idx)
+			return;
+
+		new.active = false;
+	} while ((v = atomic64_cmpxchg(&p->state.counter,
+				       old.v, new.v)) != old.v);
+
+	journal_res_cpu_retire(j, p, old, locked);
+}
+
+/*
+ * Get a new chunk of the current journal entry for this cpu, then carve @res
+ * out of it: called with preemption disabled.
+ */
+bool bch2_journal_res_get_percpu_refill(struct journal *j,
+					struct journal_res_cpu *p,
+					struct journal_res *res)
+{
+	struct journal_res chunk = { 0 };
+	union journal_res_state s;
+	union journal_res_cpu_state old, new;
+	unsigned chunk_u64s = min_t(unsigned, JOURNAL_RES_CHUNK_U64S,
+			READ_ONCE(j->cur_entry_u64s) / (4 * num_online_cpus()));
+
+	/* Small entries, or big reservations - not worth it: */
+	if (chunk_u64s < res->u64s * 2)
+		return false;
+
+	chunk.u64s = chunk_u64s;
+	if (!journal_res_get_fast(j, &chunk, 0))
+		return false;
+
+	/*
+	 * We only need one ref on the buf in j->reservations, no matter how
+	 * many chunks we have in it:
+	 */
+	if (atomic_inc_return(&p->count[chunk.idx]) != 1)
+		journal_state_buf_put(j, chunk.idx);
+
+	new.v		= 0;
+	new.offset	= chunk.offset;
+	new.end		= chunk.offset + chunk_u64s;
+	new.idx		= chunk.idx;
+	new.active	= true;
+
+	old.v = atomic64_xchg(&p->state.counter, new.v);
+	if (old.active)
+		journal_res_cpu_retire(j, p, old, false);
+
+	/*
+	 * If the entry was closed before our chunk was visible,
+	 * __journal_entry_close() may have missed it:
+	 */
+	s = READ_ONCE(j->reservations);
+	if (s.idx != chunk.idx || !__journal_entry_is_open(s))
+		journal_res_cpu_try_retire(j, p, chunk.idx, false);
+
+	return __journal_res_get_percpu(j, p, res);
 }
 
 /*
@@ -130,7 +268,7 @@ static bool __journal_entry_close(struct journal *j)
 	struct journal_buf *buf = journal_cur_buf(j);
 	union journal_res_state old, new;
 	u64 v = atomic64_read(&j->reservations.counter);
-	unsigned sectors;
+	unsigned sectors, cpu;
 
 	lockdep_assert_held(&j->lock);
 
@@ -160,6 +298,11 @@ static bool __journal_entry_close(struct journal *j)
 	} while ((v = atomic64_cmpxchg(&j->reservations.counter,
 				       old.v, new.v)) != old.v);
 
+	/* Give back what's left of percpu chunks in the old buffer: */
+	for_each_possible_cpu(cpu)
+		journal_res_cpu_try_retire(j, per_cpu_ptr(j->res_cpu, cpu),
+					   old.idx, true);
+
 	/* Close out old buffer: */
 	buf->data->u64s		= cpu_to_le32(old.cur_entry_offset);
 
@@ -201,20 +344,23 @@ static bool __journal_entry_close(struct journal *j)
 
 	bch2_journal_space_available(j);
 
-	bch2_journal_buf_put(j, old.idx);
+	if (!journal_state_count(journal_state_buf_put(j, old.idx), old.idx))
+		bch2_journal_do_writes(j);
 	return true;
 }
 
 static bool journal_entry_want_write(struct journal *j)
 {
+	struct bch_fs *c = container_of(j, struct bch_fs, journal);
 	union journal_res_state s = READ_ONCE(j->reservations);
 	bool ret = false;
 
 	/*
-	 * Don't close it yet if we already have a write in flight, but do set
-	 * NEED_WRITE:
+	 * Don't close it yet if we already have as many writes in flight as
+	 * we're allowed, but do set NEED_WRITE:
 	 */
-	if (s.idx != s.unwritten_idx)
+	if (((s.idx - s.unwritten_idx) & JOURNAL_BUF_MASK) >=
+	    READ_ONCE(c->opts.journal_write_depth))
 		set_bit(JOURNAL_NEED_WRITE, &j->flags);
 	else
 		ret = __journal_entry_close(j);
@@ -330,52 +476,106 @@ static void journal_write_work(struct work_struct *work)
 }
 
 /*
- * Given an inode number, if that inode number has data in the journal that
- * hasn't yet been flushed, return the journal sequence number that needs to be
- * flushed:
+ * Exact tracking of the journal entries an inode needs flushed, for fsync:
+ *
+ * The VFS inode tracks the last journal seq that updated it in ei_journal_seq.
+ * When an inode with unflushed updates is evicted, we remember its seq here -
+ * so that it's not lost if the inode is read back in before that seq has been
+ * flushed. Entries are dropped once their seq has been flushed.
  */
-u64 bch2_inode_journal_seq(struct journal *j, u64 inode)
+struct journal_evicted_inode {
+	struct hlist_node	hash;
+	struct list_head	list;
+	u64			inum;
+	u64			seq;
+};
+
+static void journal_evicted_inode_free(struct journal_evicted_inode *i)
 {
-	size_t h = hash_64(inode, ilog2(sizeof(j->buf[0].has_inode) * 8));
-	union journal_res_state s;
-	unsigned i;
-	u64 seq;
+	hash_del(&i->hash);
+	list_del(&i->list);
+	kfree(i);
+}
 
+static void journal_evicted_inodes_prune(struct journal *j)
+{
+	struct journal_evicted_inode *i;
+	u64 flushed_seq = READ_ONCE(j->flushed_seq_ondisk);
 
-	spin_lock(&j->lock);
-	seq = journal_cur_seq(j);
-	s = READ_ONCE(j->reservations);
-	i = s.idx;
+	lockdep_assert_held(&j->evicted_inodes_lock);
 
-	while (1) {
-		if (test_bit(h, j->buf[i].has_inode))
-			goto out;
+	while ((i = list_first_entry_or_null(&j->evicted_inodes_list,
+					struct journal_evicted_inode, list)) &&
+	       i->seq <= flushed_seq)
+		journal_evicted_inode_free(i);
+}
 
-		if (i == s.unwritten_idx)
-			break;
+static struct journal_evicted_inode *
+journal_evicted_inode_find(struct journal *j, u64 inum)
+{
+	struct journal_evicted_inode *i;
 
-		i = (i - 1) & JOURNAL_BUF_MASK;
-		seq--;
-	}
+	hash_for_each_possible(j->evicted_inodes, i, hash, inum)
+		if (i->inum == inum)
+			return i;
+	return NULL;
+}
 
-	seq = 0;
-out:
-	spin_unlock(&j->lock);
+void bch2_journal_inode_evicted(struct journal *j, u64 inum, u64 seq)
+{
+	struct journal_evicted_inode *n, *i;
 
-	return seq;
+	if (seq <= READ_ONCE(j->flushed_seq_ondisk))
+		return;
+
+	n = kmalloc(sizeof(*n), GFP_NOFS|__GFP_NOWARN);
+
+	spin_lock(&j->evicted_inodes_lock);
+	journal_evicted_inodes_prune(j);
+
+	i = journal_evicted_inode_find(j, inum);
+	if (i) {
+		i->seq = max(i->seq, seq);
+	} else if (n) {
+		n->inum	= inum;
+		n->seq	= seq;
+		hash_add(j->evicted_inodes, &n->hash, inum);
+		list_add_tail(&n->list, &j->evicted_inodes_list);
+		n = NULL;
+	} else {
+		/* Can't track it exactly - flush it for every inode read in: */
+		j->evicted_inodes_seq_lost =
+			max(j->evicted_inodes_seq_lost, seq);
+	}
+	spin_unlock(&j->evicted_inodes_lock);
+
+	kfree(n);
 }
 
-void bch2_journal_set_has_inum(struct journal *j, u64 inode, u64 seq)
+/*
+ * Given an inode number that's being read in, if that inode number has data in
+ * the journal that hasn't yet been flushed, return the journal sequence number
+ * that needs to be flushed:
+ */
+u64 bch2_inode_journal_seq(struct journal *j, u64 inum)
 {
-	size_t h = hash_64(inode, ilog2(sizeof(j->buf[0].has_inode) * 8));
-	struct journal_buf *buf;
+	struct journal_evicted_inode *i;
+	u64 seq = 0;
 
-	spin_lock(&j->lock);
+	spin_lock(&j->evicted_inodes_lock);
+	journal_evicted_inodes_prune(j);
 
-	if ((buf = journal_seq_to_buf(j, seq)))
-		set_bit(h, buf->has_inode);
+	i = journal_evicted_inode_find(j, inum);
+	if (i) {
+		seq = i->seq;
+		journal_evicted_inode_free(i);
+	}
 
-	spin_unlock(&j->lock);
+	if (j->evicted_inodes_seq_lost > READ_ONCE(j->flushed_seq_ondisk))
+		seq = max(seq, j->evicted_inodes_seq_lost);
+	spin_unlock(&j->evicted_inodes_lock);
+
+	return seq;
 }
 
 static int __journal_res_get(struct journal *j, struct journal_res *res,
@@ -558,6 +758,38 @@ void bch2_journal_entry_res_resize(struct journal *j,
 
 /* journal flushing: */
 
+static void journal_flush_request_account(struct journal *j)
+{
+	u64 now = local_clock();
+
+	lockdep_assert_held(&j->lock);
+
+	if (j->last_flush_request)
+		j->flush_interval_ewma = j->flush_interval_ewma
+			? ewma_add(j->flush_interval_ewma,
+				   now - j->last_flush_request, 3)
+			: now - j->last_flush_request;
+	j->last_flush_request = now;
+}
+
+/*
+ * With adaptive write delay, a flush closes the current entry right away at
+ * low load. But if flushes are coming in faster than journal writes complete
+ * and there's already a write in flight, we batch: the entry is closed when
+ * the next write completes, which picks up every flush that arrived in the
+ * meantime:
+ */
+static bool journal_flush_want_batch(struct journal *j)
+{
+	union journal_res_state s = READ_ONCE(j->reservations);
+	u64 write_time = READ_ONCE(j->write_time->average_duration);
+
+	return j->write_delay_adaptive &&
+		s.idx != s.unwritten_idx &&
+		j->flush_interval_ewma &&
+		j->flush_interval_ewma < write_time;
+}
+
 /**
  * bch2_journal_flush_seq_async - wait for a journal entry to be written
  *
@@ -630,8 +862,14 @@ int bch2_journal_flush_seq_async(struct journal *j, u64 seq,
 	if (parent && !closure_wait(&buf->wait, parent))
 		BUG();
 want_write:
-	if (seq == journal_cur_seq(j))
-		journal_entry_want_write(j);
+	if (seq == journal_cur_seq(j)) {
+		journal_flush_request_account(j);
+
+		if (journal_flush_want_batch(j))
+			set_bit(JOURNAL_NEED_WRITE, &j->flags);
+		else
+			journal_entry_want_write(j);
+	}
 out:
 	spin_unlock(&j->lock);
 	return ret;
@@ -787,8 +1025,7 @@ static int __bch2_set_nr_journal_buckets(struct bch_dev *ca, unsigned nr,
 			}
 		} else {
 			rcu_read_lock();
-			ob = bch2_bucket_alloc(c, ca, RESERVE_NONE,
-					       false, cl);
+			ob = bch2_bucket_alloc(c, ca, RESERVE_NONE, 0, cl);
 			rcu_read_unlock();
 			if (IS_ERR(ob)) {
 				ret = cl ? -EAGAIN : -ENOSPC;
@@ -1052,11 +1289,16 @@ int bch2_fs_journal_start(struct journal *j, u64 cur_seq,
 
 void bch2_dev_journal_exit(struct bch_dev *ca)
 {
-	kfree(ca->journal.bio);
+	unsigned i;
+
+	for (i = 0; i < ARRAY_SIZE(ca->journal.bio); i++) {
+		kfree(ca->journal.bio[i]);
+		ca->journal.bio[i] = NULL;
+	}
+
 	kfree(ca->journal.buckets);
 	kfree(ca->journal.bucket_seq);
 
-	ca->journal.bio		= NULL;
 	ca->journal.buckets	= NULL;
 	ca->journal.bucket_seq	= NULL;
 }
@@ -1066,7 +1308,7 @@ int bch2_dev_journal_init(struct bch_dev *ca, struct bch_sb *sb)
 	struct journal_device *ja = &ca->journal;
 	struct bch_sb_field_journal *journal_buckets =
 		bch2_sb_get_journal(sb);
-	unsigned i;
+	unsigned i, nr_bvecs = DIV_ROUND_UP(JOURNAL_ENTRY_SIZE_MAX, PAGE_SIZE);
 
 	ja->nr = bch2_nr_journal_buckets(journal_buckets);
 
@@ -1074,10 +1316,17 @@ int bch2_dev_journal_init(struct bch_dev *ca, struct bch_sb *sb)
 	if (!ja->bucket_seq)
 		return -ENOMEM;
 
-	ca->journal.bio = bio_kmalloc(GFP_KERNEL,
-			DIV_ROUND_UP(JOURNAL_ENTRY_SIZE_MAX, PAGE_SIZE));
-	if (!ca->journal.bio)
-		return -ENOMEM;
+	for (i = 0; i < ARRAY_SIZE(ja->bio); i++) {
+		ja->bio[i] = kmalloc(struct_size(ja->bio[i], bio.bi_inline_vecs,
+						 nr_bvecs), GFP_KERNEL);
+		if (!ja->bio[i])
+			return -ENOMEM;
+
+		ja->bio[i]->ca		= ca;
+		ja->bio[i]->buf_idx	= i;
+		bio_init(&ja->bio[i]->bio, ja->bio[i]->bio.bi_inline_vecs,
+			 nr_bvecs);
+	}
 
 	ja->buckets = kcalloc(ja->nr, sizeof(u64), GFP_KERNEL);
 	if (!ja->buckets)
@@ -1091,11 +1340,16 @@ int bch2_dev_journal_init(struct bch_dev *ca, struct bch_sb *sb)
 
 void bch2_fs_journal_exit(struct journal *j)
 {
+	struct journal_evicted_inode *e, *n;
 	unsigned i;
 
+	list_for_each_entry_safe(e, n, &j->evicted_inodes_list, list)
+		journal_evicted_inode_free(e);
+
 	for (i = 0; i < ARRAY_SIZE(j->buf); i++)
 		kvpfree(j->buf[i].data, j->buf[i].buf_size);
 	free_fifo(&j->pin);
+	free_percpu(j->res_cpu);
 }
 
 int bch2_fs_journal_init(struct journal *j)
@@ -1109,6 +1363,9 @@ int bch2_fs_journal_init(struct journal *j)
 
 	spin_lock_init(&j->lock);
 	spin_lock_init(&j->err_lock);
+	spin_lock_init(&j->evicted_inodes_lock);
+	hash_init(j->evicted_inodes);
+	INIT_LIST_HEAD(&j->evicted_inodes_list);
 	init_waitqueue_head(&j->wait);
 	INIT_DELAYED_WORK(&j->write_work, journal_write_work);
 	init_waitqueue_head(&j->pin_flush_wait);
@@ -1117,6 +1374,8 @@ int bch2_fs_journal_init(struct journal *j)
 
 	lockdep_init_map(&j->res_map, "journal res", &res_key, 0);
 
+	bitmap_fill(j->noflush_devs.d, BCH_SB_MEMBERS_MAX);
+
 	j->write_delay_ms	= 1000;
 	j->reclaim_delay_ms	= 100;
 
@@ -1129,7 +1388,15 @@ int bch2_fs_journal_init(struct journal *j)
 		goto out;
 	}
 
+	j->res_cpu = alloc_percpu(struct journal_res_cpu);
+	if (!j->res_cpu) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
 	for (i = 0; i < ARRAY_SIZE(j->buf); i++) {
+		j->buf[i].idx = i;
+		INIT_WORK(&j->buf[i].ack_work, bch2_journal_write_ack_work);
 		j->buf[i].buf_size = JOURNAL_ENTRY_SIZE_MIN;
 		j->buf[i].data = kvpmalloc(j->buf[i].buf_size, GFP_KERNEL);
 		if (!j->buf[i].data) {
@@ -1165,8 +1432,11 @@ void __bch2_journal_debug_to_text(struct printbuf *out, struct journal *j)
 	       "prereserved:\t\t%u/%u\n"
 	       "nr flush writes:\t%llu\n"
 	       "nr noflush writes:\t%llu\n"
+	       "flush interval (ns):\t%llu\n"
 	       "nr direct reclaim:\t%llu\n"
 	       "nr background reclaim:\t%llu\n"
+	       "reclaim fill:\t\t%u%%\n"
+	       "reclaim rate:\t\t%u\n"
 	       "current entry sectors:\t%u\n"
 	       "current entry error:\t%u\n"
 	       "current entry:\t\t",
@@ -1179,8 +1449,11 @@ void __bch2_journal_debug_to_text(struct printbuf *out, struct journal *j)
 	       j->prereserved.remaining,
 	       j->nr_flush_writes,
 	       j->nr_noflush_writes,
+	       j->flush_interval_ewma,
 	       j->nr_direct_reclaim,
 	       j->nr_background_reclaim,
+	       j->reclaim_fill,
+	       j->reclaim_rate,
 	       j->cur_entry_sectors,
 	       j->cur_entry_error);
 
@@ -1206,8 +1479,11 @@ void __bch2_journal_debug_to_text(struct printbuf *out, struct journal *j)
 	while (i != s.unwritten_idx) {
 		i = (i - 1) & JOURNAL_BUF_MASK;
 
-		pr_buf(out, "unwritten entry:\tidx %u refcount %u sectors %u\n",
-		       i, journal_state_count(s, i), j->buf[i].sectors);
+		pr_buf(out, "unwritten entry:\tidx %u refcount %u sectors %u%s%s%s\n",
+		       i, journal_state_count(s, i), j->buf[i].sectors,
+		       j->buf[i].write_started	? " started" : "",
+		       j->buf[i].write_allocated	? " allocated" : "",
+		       j->buf[i].write_done	? " done" : "");
 	}
 
 	pr_buf(out,
@@ -141,8 +141,15 @@ static inline u64 journal_cur_seq(struct journal *j)
 	return j->pin.back - 1;
 }
 
+static inline unsigned bch2_journal_target(struct bch_fs *c)
+{
+	return  c->opts.journal_target ?:
+		c->opts.metadata_target ?:
+		c->opts.foreground_target;
+}
+
+void bch2_journal_inode_evicted(struct journal *, u64, u64);
 u64 bch2_inode_journal_seq(struct journal *, u64);
-void bch2_journal_set_has_inum(struct journal *, u64, u64);
 
 static inline int journal_state_count(union journal_res_state s, int idx)
 {
@@ -163,18 +170,6 @@ static inline void journal_state_inc(union journal_res_state *s)
 	s->buf3_count += s->idx == 3;
 }
 
-static inline void bch2_journal_set_has_inode(struct journal *j,
-					      struct journal_res *res,
-					      u64 inum)
-{
-	struct journal_buf *buf = &j->buf[res->idx];
-	unsigned long bit = hash_64(inum, ilog2(sizeof(buf->has_inode) * 8));
-
-	/* avoid atomic op if possible */
-	if (unlikely(!test_bit(bit, buf->has_inode)))
-		set_bit(bit, buf->has_inode);
-}
-
 /*
  * Amount of space that will be taken up by some keys in the journal (i.e.
  * including the jset header)
@@ -258,9 +253,11 @@ static inline bool journal_entry_empty(struct jset *j)
 	return true;
 }
 
+void bch2_journal_do_writes(struct journal *);
 void __bch2_journal_buf_put(struct journal *);
 
-static inline void bch2_journal_buf_put(struct journal *j, unsigned idx)
+static inline union journal_res_state
+journal_state_buf_put(struct journal *j, unsigned idx)
 {
 	union journal_res_state s;
 
@@ -273,8 +270,16 @@ static inline void bch2_journal_buf_put(struct journal *j, unsigned idx)
 
 	EBUG_ON(((s.idx - idx) & 3) >
 		((s.idx - s.unwritten_idx) & 3));
+	return s;
+}
 
-	if (!journal_state_count(s, idx) && idx == s.unwritten_idx)
+static inline void bch2_journal_buf_put(struct journal *j, unsigned idx)
+{
+	/*
+	 * The open entry holds a ref on its buf, so a count of zero means the
+	 * entry is closed and its write may be started:
+	 */
+	if (!journal_state_count(journal_state_buf_put(j, idx), idx))
 		__bch2_journal_buf_put(j);
 }
 
@@ -295,9 +300,13 @@ static inline void bch2_journal_res_put(struct journal *j,
 				       BCH_JSET_ENTRY_btree_keys,
 				       0, 0, NULL, 0);
 
-	bch2_journal_buf_put(j, res->idx);
+	if (!res->cpu)
+		bch2_journal_buf_put(j, res->idx);
+	else if (atomic_dec_and_test(&res->cpu->count[res->idx]))
+		bch2_journal_buf_put(j, res->idx);
 
 	res->ref = 0;
+	res->cpu = NULL;
 }
 
 int bch2_journal_res_get_slowpath(struct journal *, struct journal_res *,
@@ -307,6 +316,8 @@ int bch2_journal_res_get_slowpath(struct journal *, struct journal_res *,
 #define JOURNAL_RES_GET_CHECK		(1 << 1)
 #define JOURNAL_RES_GET_RESERVED	(1 << 2)
 #define JOURNAL_RES_GET_RECLAIM		(1 << 3)
+/* Don't use percpu chunks - see journal_res_pos_after(): */
+#define JOURNAL_RES_GET_ORDERED		(1 << 4)
 
 static inline int journal_res_get_fast(struct journal *j,
 				       struct journal_res *res,
@@ -350,9 +361,130 @@ static inline int journal_res_get_fast(struct journal *j,
 	res->idx	= old.idx;
 	res->offset	= old.cur_entry_offset;
 	res->seq	= le64_to_cpu(j->buf[old.idx].data->seq);
+	res->cpu	= NULL;
 	return 1;
 }
 
+/* percpu reservations: */
+
+#define JOURNAL_RES_CHUNK_U64S		256
+
+/*
+ * Carve a reservation out of this cpu's chunk: must be called with preemption
+ * disabled. Only the owning cpu activates a chunk, other cpus may only retire
+ * it - so the idx of an active chunk is stable here:
+ */
+static inline bool __journal_res_get_percpu(struct journal *j,
+					    struct journal_res_cpu *p,
+					    struct journal_res *res)
+{
+	union journal_res_cpu_state old, new;
+	u64 v = atomic64_read(&p->state.counter);
+	unsigned idx;
+
+	old.v = v;
+	if (!old.active || old.offset + res->u64s > old.end)
+		return false;
+
+	idx = old.idx;
+	atomic_inc(&p->count[idx]);
+
+	do {
+		old.v = new.v = v;
+
+		if (!old.active || old.offset + res->u64s > old.end) {
+			if (atomic_dec_and_test(&p->count[idx]))
+				bch2_journal_buf_put(j, idx);
+			return false;
+		}
+
+		new.offset += res->u64s;
+	} while ((v = atomic64_cmpxchg(&p->state.counter,
+				       old.v, new.v)) != old.v);
+
+	res->ref	= true;
+	res->idx	= idx;
+	res->offset	= old.offset;
+	res->seq	= le64_to_cpu(j->buf[idx].data->seq);
+	res->cpu	= p;
+	return true;
+}
+
+bool bch2_journal_res_get_percpu_refill(struct journal *,
+					struct journal_res_cpu *,
+					struct journal_res *);
+
+static inline bool journal_res_get_percpu(struct journal *j,
+					  struct journal_res *res,
+					  unsigned flags)
+{
+	struct journal_res_cpu *p;
+	bool ret;
+
+	if (flags & (JOURNAL_RES_GET_CHECK|
+		     JOURNAL_RES_GET_RESERVED|
+		     JOURNAL_RES_GET_ORDERED))
+		return false;
+
+	if (!test_bit(JOURNAL_MAY_GET_UNRESERVED, &j->flags))
+		return false;
+
+	p = get_cpu_ptr(j->res_cpu);
+	ret = __journal_res_get_percpu(j, p, res) ||
+		bch2_journal_res_get_percpu_refill(j, p, res);
+	put_cpu_ptr(j->res_cpu);
+
+	return ret;
+}
+
+/*
+ * Reservations from percpu chunks aren't handed out in (seq, offset) order,
+ * but journal replay (and the btree write buffer) applies keys at the same
+ * position in that order - so an update that has to come after another one
+ * must get a reservation after it. Btree nodes and key cache entries record the
+ * position of the last reservation used to update them, and commits check
+ * against that.
+ *
+ * A reservation from j->reservations always comes after everything handed out
+ * before it, chunks included - so that's the fallback
+ * (JOURNAL_RES_GET_ORDERED).
+ */
+static inline bool journal_res_pos_after(struct journal_res *res,
+					 struct journal_res_pos *pos)
+{
+	return !res->cpu ||
+		res->seq > pos->seq ||
+		(res->seq == pos->seq && res->offset > pos->offset);
+}
+
+/* Whether a reservation from a chunk may not come after @pos: */
+static inline bool journal_res_pos_needs_order(struct journal *j,
+					       struct journal_res_pos *pos)
+{
+	return pos->seq >= atomic64_read(&j->seq);
+}
+
+static inline void journal_res_pos_update(struct journal_res_pos *pos,
+					  struct journal_res *res)
+{
+	if (res->seq > pos->seq ||
+	    (res->seq == pos->seq && res->offset > pos->offset)) {
+		pos->seq	= res->seq;
+		pos->offset	= res->offset;
+	}
+}
+
+/*
+ * For a new btree node or key cache entry, whose keys were last updated at
+ * some unknown point in the current entry:
+ */
+static inline void journal_res_pos_reset(struct journal *j,
+					 struct journal_res_pos *pos)
+{
+	pos->seq	= atomic64_read(&j->seq);
+	pos->offset	= U32_MAX;
+}
+
 static inline int bch2_journal_res_get(struct journal *j, struct journal_res *res,
 				       unsigned u64s, unsigned flags)
 {
@@ -363,7 +495,8 @@ static inline int bch2_journal_res_get(struct journal *j, struct journal_res *re
 
 	res->u64s = u64s;
 
-	if (journal_res_get_fast(j, res, flags))
+	if (journal_res_get_percpu(j, res, flags) ||
+	    journal_res_get_fast(j, res, flags))
 		goto out;
 
 	ret = bch2_journal_res_get_slowpath(j, res, flags);
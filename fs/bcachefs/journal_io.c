@@ -5,6 +5,7 @@
 #include "btree_update_interior.h"
 #include "buckets.h"
 #include "checksum.h"
+#include "compress.h"
 #include "disk_groups.h"
 #include "error.h"
 #include "io.h"
@@ -619,6 +620,65 @@ static int jset_validate_for_write(struct bch_fs *c, struct jset *jset)
 		jset_validate_entries(c, jset, WRITE);
 }
 
+/*
+ * Decompress a journal entry we just read (after checksumming and decrypting
+ * it) into a newly allocated jset:
+ */
+static int jset_uncompress(struct bch_fs *c, struct bch_dev *ca,
+			   struct jset *jset, u64 sector,
+			   struct jset **out)
+{
+	struct jset_compressed *h = (void *) jset->_data;
+	unsigned compression_type = JSET_COMPRESSION_TYPE(jset);
+	unsigned compressed_bytes = le32_to_cpu(h->compressed_bytes);
+	size_t bytes = sizeof(*jset) + le32_to_cpu(h->u64s) * sizeof(u64);
+	struct jset *n = NULL;
+	int ret = 0, write = READ;
+
+	*out = NULL;
+
+	if (journal_entry_err_on(!(c->sb.features & (1ULL << BCH_FEATURE_journal_compression)), c,
+			"%s sector %llu seq %llu: compressed journal entry, but journal_compression feature not set",
+			ca->name, sector, le64_to_cpu(jset->seq)) ||
+	    journal_entry_err_on(compression_type != BCH_COMPRESSION_TYPE_lz4 &&
+				 compression_type != BCH_COMPRESSION_TYPE_gzip &&
+				 compression_type != BCH_COMPRESSION_TYPE_zstd, c,
+			"%s sector %llu seq %llu: journal entry with unknown compression type %u",
+			ca->name, sector, le64_to_cpu(jset->seq), compression_type) ||
+	    journal_entry_err_on(sizeof(*h) + compressed_bytes >
+				 le32_to_cpu(jset->u64s) * sizeof(u64), c,
+			"%s sector %llu seq %llu: compressed size past end of journal entry",
+			ca->name, sector, le64_to_cpu(jset->seq)) ||
+	    journal_entry_err_on(bytes > JOURNAL_ENTRY_SIZE_MAX, c,
+			"%s sector %llu seq %llu: uncompressed journal entry too big (%zu bytes)",
+			ca->name, sector, le64_to_cpu(jset->seq), bytes))
+		return JOURNAL_ENTRY_BAD;
+
+	n = kvpmalloc(bytes, GFP_KERNEL);
+	if (!n)
+		return -ENOMEM;
+
+	if (journal_entry_err_on(bch2_uncompress_buf(c, compression_type,
+					h->data, compressed_bytes,
+					n->_data, bytes - sizeof(*jset)), c,
+			"%s sector %llu seq %llu: journal entry decompression error",
+			ca->name, sector, le64_to_cpu(jset->seq))) {
+		kvpfree(n, bytes);
+		return JOURNAL_ENTRY_BAD;
+	}
+
+	memcpy(n, jset, sizeof(*jset));
+	n->u64s = h->u64s;
+	SET_JSET_COMPRESSION_TYPE(n, 0);
+
+	*out = n;
+	return 0;
+fsck_err:
+	if (n)
+		kvpfree(n, bytes);
+	return ret;
+}
+
 struct journal_read_buf {
 	void		*data;
 	size_t		size;
@@ -651,7 +711,7 @@ static int journal_read_bucket(struct bch_dev *ca,
 {
 	struct bch_fs *c = ca->fs;
 	struct journal_device *ja = &ca->journal;
-	struct jset *j = NULL;
+	struct jset *j = NULL, *uncompressed = NULL;
 	unsigned sectors, sectors_read = 0;
 	u64 offset = bucket_to_sector(ca, ja->buckets[bucket]),
 	    end = offset + ca->mi.bucket_size;
@@ -738,13 +798,37 @@ static int journal_read_bucket(struct bch_dev *ca,
 
 		ja->bucket_seq[bucket] = le64_to_cpu(j->seq);
 
+		if (JSET_COMPRESSION_TYPE(j)) {
+			int ret2 = jset_uncompress(c, ca, j, offset, &uncompressed);
+
+			if (ret2 == JOURNAL_ENTRY_BAD) {
+				/*
+				 * We can't get at the keys, but still add the
+				 * header so that replay and blacklisting see
+				 * this seq - a good copy on another device will
+				 * replace it:
+				 */
+				j->u64s = 0;
+				SET_JSET_COMPRESSION_TYPE(j, 0);
+				ret = JOURNAL_ENTRY_BAD;
+				saw_bad = true;
+			} else if (ret2) {
+				return ret2;
+			}
+		}
+
 		mutex_lock(&jlist->lock);
 		ret = journal_entry_add(c, ca, (struct bch_extent_ptr) {
 					.dev = ca->dev_idx,
 					.offset	= offset,
-					}, jlist, j, ret != 0);
+					}, jlist, uncompressed ?: j, ret != 0);
 		mutex_unlock(&jlist->lock);
 
+		if (uncompressed) {
+			kvpfree(uncompressed, vstruct_bytes(uncompressed));
+			uncompressed = NULL;
+		}
+
 		switch (ret) {
 		case JOURNAL_ENTRY_ADD_OK:
 			break;
@@ -847,6 +931,90 @@ static void bch2_journal_ptrs_to_text(struct printbuf *out, struct bch_fs *c,
 	}
 }
 
+/*
+ * Validating the keys in each journal entry is the expensive part of reading
+ * the journal, and entries are independent of each other - so validate them in
+ * parallel, with threads taking the next entry as they go:
+ */
+struct journal_validate {
+	struct bch_fs		*c;
+	struct journal_replay	**entries;
+	size_t			nr;
+	atomic_long_t		next;
+	int			ret;
+};
+
+struct journal_validate_thread {
+	struct closure		cl;
+	struct journal_validate	*v;
+};
+
+static void journal_validate_entries_thread(struct closure *cl)
+{
+	struct journal_validate_thread *t =
+		container_of(cl, struct journal_validate_thread, cl);
+	struct journal_validate *v = t->v;
+	size_t idx;
+	int ret;
+
+	while (!READ_ONCE(v->ret) &&
+	       (idx = atomic_long_inc_return(&v->next) - 1) < v->nr) {
+		ret = jset_validate_entries(v->c, &v->entries[idx]->j, READ);
+		if (ret) {
+			cmpxchg(&v->ret, 0, ret);
+			break;
+		}
+	}
+
+	closure_return(cl);
+}
+
+static int journal_validate_entries(struct bch_fs *c, struct list_head *list)
+{
+	struct journal_validate v = { .c = c };
+	struct journal_validate_thread *threads = NULL;
+	struct journal_replay *i;
+	struct closure cl;
+	unsigned nr_threads, t;
+	int ret = 0;
+
+	list_for_each_entry(i, list, list)
+		if (!i->ignore)
+			v.nr++;
+
+	if (!v.nr)
+		return 0;
+
+	nr_threads = min_t(size_t, num_online_cpus(), v.nr);
+
+	v.entries	= kvmalloc_array(v.nr, sizeof(v.entries[0]), GFP_KERNEL);
+	threads		= kcalloc(nr_threads, sizeof(threads[0]), GFP_KERNEL);
+	if (!v.entries || !threads) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	v.nr = 0;
+	list_for_each_entry(i, list, list)
+		if (!i->ignore)
+			v.entries[v.nr++] = i;
+
+	closure_init_stack(&cl);
+
+	for (t = 0; t < nr_threads; t++) {
+		threads[t].v = &v;
+		closure_call(&threads[t].cl, journal_validate_entries_thread,
+			     system_unbound_wq, &cl);
+	}
+
+	closure_sync(&cl);
+	ret = v.ret;
+out:
+	kfree(threads);
+	kvfree(v.entries);
+	return ret;
+}
+
 int bch2_journal_read(struct bch_fs *c, struct list_head *list,
 		      u64 *blacklist_seq, u64 *start_seq)
 {
@@ -981,6 +1149,10 @@ int bch2_journal_read(struct bch_fs *c, struct list_head *list,
 		seq++;
 	}
 
+	ret = journal_validate_entries(c, list);
+	if (ret)
+		goto fsck_err;
+
 	list_for_each_entry(i, list, list) {
 		struct jset_entry *entry;
 		struct bkey_i *k, *_n;
@@ -994,10 +1166,6 @@ int bch2_journal_read(struct bch_fs *c, struct list_head *list,
 		if (i->ignore)
 			continue;
 
-		ret = jset_validate_entries(c, &i->j, READ);
-		if (ret)
-			goto fsck_err;
-
 		for (ptr = 0; ptr < i->nr_ptrs; ptr++)
 			replicas.e.devs[replicas.e.nr_devs++] = i->ptrs[ptr].dev;
 
@@ -1091,6 +1259,38 @@ static void __journal_write_alloc(struct journal *j,
 	}
 }
 
+static unsigned journal_dev_write_cost(struct bch_dev *ca)
+{
+	/* Recent write latency, scaled by the journal writes in flight: */
+	u64 cost = atomic64_read(&ca->cur_latency[WRITE]) *
+		(atomic_read(&ca->journal.nr_writes_in_flight) + 1);
+
+	/* Devices within a factor of two of each other are equivalent: */
+	return fls64(cost);
+}
+
+/*
+ * Prefer the devices that have been completing writes fastest - stable, so
+ * that equivalent devices are still used in stripe order:
+ */
+static void journal_devs_sort(struct bch_fs *c, struct dev_alloc_list *devs)
+{
+	u8 cost[BCH_SB_MEMBERS_MAX];
+	unsigned i, j;
+
+	for (i = 0; i < devs->nr; i++) {
+		struct bch_dev *ca = rcu_dereference(c->devs[devs->devs[i]]);
+
+		cost[i] = ca ? journal_dev_write_cost(ca) : U8_MAX;
+	}
+
+	for (i = 1; i < devs->nr; i++)
+		for (j = i; j && cost[j - 1] > cost[j]; --j) {
+			swap(cost[j - 1], cost[j]);
+			swap(devs->devs[j - 1], devs->devs[j]);
+		}
+}
+
 /**
  * journal_next_bucket - move on to the next journal bucket if possible
  */
@@ -1102,8 +1302,7 @@ static int journal_write_alloc(struct journal *j, struct journal_buf *w,
 	struct journal_device *ja;
 	struct bch_dev *ca;
 	struct dev_alloc_list devs_sorted;
-	unsigned target = c->opts.metadata_target ?:
-		c->opts.foreground_target;
+	unsigned target = bch2_journal_target(c);
 	unsigned i, replicas = 0, replicas_want =
 		READ_ONCE(c->opts.metadata_replicas);
 
@@ -1112,6 +1311,7 @@ static int journal_write_alloc(struct journal *j, struct journal_buf *w,
 	devs = target_rw_devs(c, BCH_DATA_journal, target);
 
 	devs_sorted = bch2_dev_alloc_list(c, &j->wp.stripe, &devs);
+	journal_devs_sort(c, &devs_sorted);
 
 	__journal_write_alloc(j, w, &devs_sorted,
 			      sectors, &replicas, replicas_want);
@@ -1200,6 +1400,47 @@ static void journal_write_compact(struct jset *jset)
 	jset->u64s = cpu_to_le32((u64 *) prev - jset->_data);
 }
 
+/*
+ * Compress the entries of a jset we're about to write, if that saves at least
+ * one block - must be done after validating, and before encrypting and
+ * checksumming:
+ */
+static void jset_compress(struct bch_fs *c, struct jset *jset,
+			  unsigned compression_type)
+{
+	struct jset_compressed *h = (void *) jset->_data;
+	unsigned src_bytes = le32_to_cpu(jset->u64s) * sizeof(u64);
+	unsigned hdr_bytes = (void *) h->data - (void *) jset;
+	unsigned max_bytes = round_up(vstruct_bytes(jset), block_bytes(c)) -
+		block_bytes(c);
+	size_t dst_bytes;
+	void *buf;
+
+	if (max_bytes <= hdr_bytes)
+		return;
+
+	buf = kvpmalloc(src_bytes, GFP_NOIO|__GFP_NOWARN);
+	if (!buf)
+		return;
+
+	dst_bytes = bch2_compress_buf(c, compression_type,
+				      jset->_data, src_bytes,
+				      buf, max_bytes - hdr_bytes);
+	if (dst_bytes) {
+		h->compressed_bytes	= cpu_to_le32(dst_bytes);
+		h->u64s			= jset->u64s;
+		memcpy(h->data, buf, dst_bytes);
+
+		jset->u64s = cpu_to_le32(DIV_ROUND_UP(sizeof(*h) + dst_bytes,
+						      sizeof(u64)));
+		memset(h->data + dst_bytes, 0,
+		       (void *) vstruct_end(jset) - (void *) (h->data + dst_bytes));
+		SET_JSET_COMPRESSION_TYPE(jset, compression_type);
+	}
+
+	kvpfree(buf, src_bytes);
+}
+
 static void journal_buf_realloc(struct journal *j, struct journal_buf *buf)
 {
 	/* we aren't holding j->lock: */
@@ -1228,19 +1469,97 @@ static inline struct journal_buf *journal_last_unwritten_buf(struct journal *j)
 	return j->buf + j->reservations.unwritten_idx;
 }
 
+/*
+ * Called when a write has been allocated, in order:
+ *
+ * A flush write waits for every earlier write to complete before it's issued,
+ * so its preflush makes every earlier write durable on each device it goes to.
+ * A copy of it thus covers everything before it if that device also has a copy
+ * of every noflush write since the previous flush write - and once
+ * metadata_replicas_required such copies are on disk, we don't need to wait
+ * for the rest.
+ */
+static void journal_write_ack_devs(struct journal *j, struct journal_buf *w)
+{
+	struct bch_fs *c = container_of(j, struct bch_fs, journal);
+	struct bch_devs_mask devs;
+	struct bch_extent_ptr *ptr;
+	unsigned nr_ptrs = 0;
+
+	lockdep_assert_held(&j->lock);
+
+	memset(&devs, 0, sizeof(devs));
+	extent_for_each_ptr(bkey_i_to_s_extent(&w->key), ptr) {
+		__set_bit(ptr->dev, devs.d);
+		nr_ptrs++;
+	}
+
+	memset(&w->devs_written, 0, sizeof(w->devs_written));
+	atomic_set(&w->nr_acks, 0);
+	w->nr_acks_required = 0;
+
+	if (JSET_NO_FLUSH(w->data)) {
+		bitmap_and(j->noflush_devs.d, j->noflush_devs.d, devs.d,
+			   BCH_SB_MEMBERS_MAX);
+		return;
+	}
+
+	bitmap_and(w->ack_devs.d, j->noflush_devs.d, devs.d,
+		   BCH_SB_MEMBERS_MAX);
+	bitmap_fill(j->noflush_devs.d, BCH_SB_MEMBERS_MAX);
+
+	if (nr_ptrs > c->opts.metadata_replicas_required &&
+	    bitmap_weight(w->ack_devs.d, BCH_SB_MEMBERS_MAX) >=
+	    c->opts.metadata_replicas_required)
+		w->nr_acks_required = c->opts.metadata_replicas_required;
+}
+
+void bch2_journal_write_ack_work(struct work_struct *work)
+{
+	struct journal_buf *w = container_of(work, struct journal_buf, ack_work);
+	struct journal *j = container_of(w, struct journal, buf[w->idx]);
+	struct bch_fs *c = container_of(j, struct bch_fs, journal);
+	struct bch_devs_list devs = { .nr = 0 };
+	struct bch_replicas_padded replicas;
+	u64 seq = le64_to_cpu(w->data->seq);
+	unsigned i;
+
+	for_each_set_bit(i, w->devs_written.d, BCH_SB_MEMBERS_MAX)
+		if (test_bit(i, w->ack_devs.d))
+			bch2_dev_list_add_dev(&devs, i);
+
+	bch2_devlist_to_replicas(&replicas.e, BCH_DATA_journal, devs);
+
+	/* on error, journal_write_done() will sort it out: */
+	if (!bch2_mark_replicas(c, &replicas.e)) {
+		spin_lock(&j->lock);
+		if (seq > j->flushed_seq_ondisk) {
+			j->flushed_seq_ondisk	= seq;
+			j->last_seq_ondisk	= le64_to_cpu(w->data->last_seq);
+		}
+
+		closure_wake_up(&w->wait);
+		journal_wake(j);
+		spin_unlock(&j->lock);
+	}
+
+	/* journal_write_done() won't run until we're finished with @w: */
+	closure_put(&w->io);
+}
+
 static void journal_write_done(struct closure *cl)
 {
-	struct journal *j = container_of(cl, struct journal, io);
+	struct journal_buf *w = container_of(cl, struct journal_buf, io);
+	struct journal *j = container_of(w, struct journal, buf[w->idx]);
 	struct bch_fs *c = container_of(j, struct bch_fs, journal);
-	struct journal_buf *w = journal_last_unwritten_buf(j);
 	struct bch_devs_list devs =
 		bch2_bkey_devs(bkey_i_to_s_c(&w->key));
 	struct bch_replicas_padded replicas;
 	union journal_res_state old, new;
-	u64 v, seq, last_seq;
+	u64 v, seq;
 	int err = 0;
 
-	bch2_time_stats_update(j->write_time, j->write_start_time);
+	bch2_time_stats_update(j->write_time, w->write_start_time);
 
 	if (!devs.nr) {
 		bch_err(c, "unable to write journal to sufficient devices");
@@ -1256,82 +1575,109 @@ static void journal_write_done(struct closure *cl)
 
 	spin_lock(&j->lock);
 	seq = le64_to_cpu(w->data->seq);
-	last_seq = le64_to_cpu(w->data->last_seq);
 
 	if (seq >= j->pin.front)
 		journal_seq_pin(j, seq)->devs = devs;
 
-	j->seq_ondisk		= seq;
 	if (err && (!j->err_seq || seq < j->err_seq))
 		j->err_seq	= seq;
 
-	if (!JSET_NO_FLUSH(w->data)) {
-		j->flushed_seq_ondisk = seq;
-		j->last_seq_ondisk = last_seq;
-	}
+	/* must come before signalling write completion: */
+	closure_debug_destroy(cl);
+
+	w->write_allocated	= true;
+	w->write_done		= true;
 
 	/*
-	 * Updating last_seq_ondisk may let bch2_journal_reclaim_work() discard
-	 * more buckets:
-	 *
-	 * Must come before signaling write completion, for
-	 * bch2_fs_journal_stop():
+	 * Writes may complete out of order, but we only mark entries as
+	 * written, in order, once every write before them is done:
 	 */
-	journal_reclaim_kick(&c->journal);
+	while (j->reservations.idx != j->reservations.unwritten_idx &&
+	       (w = journal_last_unwritten_buf(j))->write_done) {
+		seq = le64_to_cpu(w->data->seq);
 
-	/* also must come before signalling write completion: */
-	closure_debug_destroy(cl);
+		j->seq_ondisk		= seq;
+
+		if (!JSET_NO_FLUSH(w->data)) {
+			j->flushed_seq_ondisk = seq;
+			j->last_seq_ondisk = le64_to_cpu(w->data->last_seq);
+		}
+
+		/*
+		 * Updating last_seq_ondisk may let bch2_journal_reclaim_work()
+		 * discard more buckets:
+		 *
+		 * Must come before signaling write completion, for
+		 * bch2_fs_journal_stop():
+		 */
+		journal_reclaim_kick(&c->journal);
+
+		v = atomic64_read(&j->reservations.counter);
+		do {
+			old.v = new.v = v;
+			BUG_ON(new.idx == new.unwritten_idx);
 
-	v = atomic64_read(&j->reservations.counter);
-	do {
-		old.v = new.v = v;
-		BUG_ON(new.idx == new.unwritten_idx);
+			new.unwritten_idx++;
+		} while ((v = atomic64_cmpxchg(&j->reservations.counter,
+					       old.v, new.v)) != old.v);
 
-		new.unwritten_idx++;
-	} while ((v = atomic64_cmpxchg(&j->reservations.counter,
-				       old.v, new.v)) != old.v);
+		closure_wake_up(&w->wait);
+	}
 
 	bch2_journal_space_available(j);
 
-	closure_wake_up(&w->wait);
 	journal_wake(j);
 
 	if (test_bit(JOURNAL_NEED_WRITE, &j->flags))
 		mod_delayed_work(system_freezable_wq, &j->write_work, 0);
-	spin_unlock(&j->lock);
 
-	if (new.unwritten_idx != new.idx &&
-	    !journal_state_count(new, new.unwritten_idx))
-		closure_call(&j->io, bch2_journal_write, system_highpri_wq, NULL);
+	bch2_journal_do_writes(j);
+	spin_unlock(&j->lock);
 }
 
 static void journal_write_endio(struct bio *bio)
 {
-	struct bch_dev *ca = bio->bi_private;
+	struct journal_bio *jbio = container_of(bio, struct journal_bio, bio);
+	struct bch_dev *ca = jbio->ca;
 	struct journal *j = &ca->fs->journal;
+	struct journal_buf *w = j->buf + jbio->buf_idx;
 
 	if (bch2_dev_io_err_on(bio->bi_status, ca, "journal write error: %s",
 			       bch2_blk_status_to_str(bio->bi_status)) ||
 	    bch2_meta_write_fault("journal")) {
-		struct journal_buf *w = journal_last_unwritten_buf(j);
 		unsigned long flags;
 
 		spin_lock_irqsave(&j->err_lock, flags);
 		bch2_bkey_drop_device(bkey_i_to_s(&w->key), ca->dev_idx);
 		spin_unlock_irqrestore(&j->err_lock, flags);
+	} else if (bio_op(bio) == REQ_OP_WRITE) {
+		set_bit(ca->dev_idx, w->devs_written.d);
+
+		if (w->nr_acks_required &&
+		    test_bit(ca->dev_idx, w->ack_devs.d) &&
+		    atomic_inc_return(&w->nr_acks) == w->nr_acks_required) {
+			closure_get(&w->io);
+			queue_work(system_highpri_wq, &w->ack_work);
+		}
 	}
 
-	closure_put(&j->io);
+	if (bio_op(bio) == REQ_OP_WRITE) {
+		bch2_latency_acct(ca, jbio->submit_time, WRITE, BCH_DATA_journal);
+		atomic_dec(&ca->journal.nr_writes_in_flight);
+	}
+
+	closure_put(&w->io);
 	percpu_ref_put(&ca->io_ref);
 }
 
 static void do_journal_write(struct closure *cl)
 {
-	struct journal *j = container_of(cl, struct journal, io);
+	struct journal_buf *w = container_of(cl, struct journal_buf, io);
+	struct journal *j = container_of(w, struct journal, buf[w->idx]);
 	struct bch_fs *c = container_of(j, struct bch_fs, journal);
 	struct bch_dev *ca;
-	struct journal_buf *w = journal_last_unwritten_buf(j);
 	struct bch_extent_ptr *ptr;
+	struct journal_bio *jbio;
 	struct bio *bio;
 	unsigned sectors = vstruct_sectors(w->data, c->block_bits);
 
@@ -1346,12 +1692,16 @@ static void do_journal_write(struct closure *cl)
 		this_cpu_add(ca->io_done->sectors[WRITE][BCH_DATA_journal],
 			     sectors);
 
-		bio = ca->journal.bio;
+		jbio = ca->journal.bio[w->idx];
+		jbio->submit_time = local_clock();
+		atomic_inc(&ca->journal.nr_writes_in_flight);
+		bch2_dev_io_start(ca, WRITE, BCH_DATA_journal);
+
+		bio = &jbio->bio;
 		bio_reset(bio);
 		bio_set_dev(bio, ca->disk_sb.bdev);
 		bio->bi_iter.bi_sector	= ptr->offset;
 		bio->bi_end_io		= journal_write_endio;
-		bio->bi_private		= ca;
 		bio->bi_opf		= REQ_OP_WRITE|REQ_SYNC|REQ_META;
 
 		BUG_ON(bio->bi_iter.bi_sector == ca->prev_journal_sector);
@@ -1366,39 +1716,89 @@ static void do_journal_write(struct closure *cl)
 
 		trace_journal_write(bio);
 		closure_bio_submit(bio, cl);
-
-		ca->journal.bucket_seq[ca->journal.cur_idx] =
-			le64_to_cpu(w->data->seq);
 	}
 
 	continue_at(cl, journal_write_done, system_highpri_wq);
 	return;
 }
 
+static void journal_write_preflush(struct closure *cl)
+{
+	struct journal_buf *w = container_of(cl, struct journal_buf, io);
+	struct journal *j = container_of(w, struct journal, buf[w->idx]);
+	struct bch_fs *c = container_of(j, struct bch_fs, journal);
+	struct bch_dev *ca;
+	struct bio *bio;
+	unsigned i;
+
+	if (JSET_NO_FLUSH(w->data))
+		goto write;
+
+	/*
+	 * A flush only makes earlier journal writes durable if they've
+	 * completed, so flush writes wait for all previous writes:
+	 */
+	spin_lock(&j->lock);
+	if (journal_last_unwritten_buf(j) != w) {
+		closure_wait(&j->async_wait, cl);
+		spin_unlock(&j->lock);
+		continue_at(cl, journal_write_preflush, system_highpri_wq);
+		return;
+	}
+	spin_unlock(&j->lock);
+
+	if (w->separate_flush) {
+		for_each_rw_member(ca, c, i) {
+			percpu_ref_get(&ca->io_ref);
+
+			bio = &ca->journal.bio[w->idx]->bio;
+			bio_reset(bio);
+			bio_set_dev(bio, ca->disk_sb.bdev);
+			bio->bi_opf		= REQ_OP_FLUSH;
+			bio->bi_end_io		= journal_write_endio;
+			closure_bio_submit(bio, cl);
+		}
+	}
+write:
+	continue_at(cl, do_journal_write, system_highpri_wq);
+}
+
 void bch2_journal_write(struct closure *cl)
 {
-	struct journal *j = container_of(cl, struct journal, io);
+	struct journal_buf *w = container_of(cl, struct journal_buf, io);
+	struct journal *j = container_of(w, struct journal, buf[w->idx]);
 	struct bch_fs *c = container_of(j, struct bch_fs, journal);
 	struct bch_dev *ca;
-	struct journal_buf *w = journal_last_unwritten_buf(j);
 	struct jset_entry *start, *end;
 	struct jset *jset;
-	struct bio *bio;
 	bool validate_before_checksum = false;
 	unsigned i, sectors, bytes, u64s, nr_rw_members = 0;
+	unsigned compression_type =
+		bch2_compression_opt_to_type[c->opts.journal_compression];
 	int ret;
 
 	BUG_ON(BCH_SB_CLEAN(c->disk_sb.sb));
 
+	if (!(c->sb.features & (1ULL << BCH_FEATURE_journal_compression)))
+		compression_type = 0;
+
 	journal_buf_realloc(j, w);
 	jset = w->data;
 
-	j->write_start_time = local_clock();
+	w->write_start_time = local_clock();
 
+	/*
+	 * Journal writes are only flush writes if something's waiting on it -
+	 * bch2_journal_flush_seq() - if journal reclaim needs last_seq_ondisk
+	 * to advance (JOURNAL_MAY_SKIP_FLUSH is cleared), or if it's been
+	 * longer than journal_flush_delay since the last flush write:
+	 */
 	spin_lock(&j->lock);
 	if (c->sb.features & (1ULL << BCH_FEATURE_journal_no_flush) &&
 	    !w->must_flush &&
-	    (jiffies - j->last_flush_write) < msecs_to_jiffies(j->write_delay_ms) &&
+	    (!c->opts.journal_flush_delay ||
+	     time_before(jiffies, j->last_flush_write +
+			 msecs_to_jiffies(c->opts.journal_flush_delay))) &&
 	    test_bit(JOURNAL_MAY_SKIP_FLUSH, &j->flags)) {
 		w->noflush = true;
 		SET_JSET_NO_FLUSH(jset, true);
@@ -1444,6 +1844,7 @@ void bch2_journal_write(struct closure *cl)
 
 	SET_JSET_BIG_ENDIAN(jset, CPU_BIG_ENDIAN);
 	SET_JSET_CSUM_TYPE(jset, bch2_meta_checksum_type(c));
+	SET_JSET_COMPRESSION_TYPE(jset, 0);
 
 	if (journal_entry_empty(jset))
 		j->last_empty_seq = le64_to_cpu(jset->seq);
@@ -1454,10 +1855,17 @@ void bch2_journal_write(struct closure *cl)
 	if (le32_to_cpu(jset->version) <= bcachefs_metadata_version_inode_btree_change)
 		validate_before_checksum = true;
 
+	/* can't validate after compressing: */
+	if (compression_type)
+		validate_before_checksum = true;
+
 	if (validate_before_checksum &&
 	    jset_validate_for_write(c, jset))
 		goto err;
 
+	if (compression_type)
+		jset_compress(c, jset, compression_type);
+
 	bch2_encrypt(c, JSET_CSUM_TYPE(jset), journal_nonce(jset),
 		    jset->encrypted_start,
 		    vstruct_end(jset) - (void *) jset->encrypted_start);
@@ -1496,6 +1904,13 @@ void bch2_journal_write(struct closure *cl)
 	 * available:
 	 */
 	bch2_journal_space_available(j);
+
+	if (!ret)
+		journal_write_ack_devs(j, w);
+
+	/* the next write can now be started: */
+	w->write_allocated = true;
+	bch2_journal_do_writes(j);
 	spin_unlock(&j->lock);
 
 	if (ret) {
@@ -1518,23 +1933,9 @@ void bch2_journal_write(struct closure *cl)
 	if (nr_rw_members > 1)
 		w->separate_flush = true;
 
-	if (!JSET_NO_FLUSH(jset) && w->separate_flush) {
-		for_each_rw_member(ca, c, i) {
-			percpu_ref_get(&ca->io_ref);
-
-			bio = ca->journal.bio;
-			bio_reset(bio);
-			bio_set_dev(bio, ca->disk_sb.bdev);
-			bio->bi_opf		= REQ_OP_FLUSH;
-			bio->bi_end_io		= journal_write_endio;
-			bio->bi_private		= ca;
-			closure_bio_submit(bio, cl);
-		}
-	}
-
 	bch2_bucket_seq_cleanup(c);
 
-	continue_at(cl, do_journal_write, system_highpri_wq);
+	continue_at(cl, journal_write_preflush, system_highpri_wq);
 	return;
 no_io:
 	bch2_bucket_seq_cleanup(c);
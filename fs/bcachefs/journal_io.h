@@ -42,6 +42,7 @@ static inline struct jset_entry *__jset_entry_type_next(struct jset *jset,
 
 int bch2_journal_read(struct bch_fs *, struct list_head *, u64 *, u64 *);
 
+void bch2_journal_write_ack_work(struct work_struct *);
 void bch2_journal_write(struct closure *);
 
 #endif /* _BCACHEFS_JOURNAL_IO_H */
@@ -2,6 +2,7 @@
 
 #include "bcachefs.h"
 #include "btree_key_cache.h"
+#include "disk_groups.h"
 #include "error.h"
 #include "journal.h"
 #include "journal_io.h"
@@ -9,6 +10,7 @@
 #include "replicas.h"
 #include "super.h"
 
+#include <linux/blkdev.h>
 #include <linux/kthread.h>
 #include <linux/sched/mm.h>
 #include <trace/events/bcachefs.h>
@@ -161,14 +163,16 @@ void bch2_journal_space_available(struct journal *j)
 	struct bch_dev *ca;
 	unsigned clean, clean_ondisk, total;
 	s64 u64s_remaining = 0;
-	unsigned max_entry_size	 = min(j->buf[0].buf_size >> 9,
-				       j->buf[1].buf_size >> 9);
+	unsigned max_entry_size	 = UINT_MAX;
 	unsigned i, nr_online = 0, nr_devs_want;
 	bool can_discard = false;
 	int ret = 0;
 
 	lockdep_assert_held(&j->lock);
 
+	for (i = 0; i < ARRAY_SIZE(j->buf); i++)
+		max_entry_size = min(max_entry_size, j->buf[i].buf_size >> 9);
+
 	rcu_read_lock();
 	for_each_member_device_rcu(ca, c, i,
 				   &c->rw_devs[BCH_DATA_journal]) {
@@ -404,6 +408,9 @@ void bch2_journal_pin_set(struct journal *j, u64 seq,
 	pin->seq	= seq;
 	pin->flush	= flush_fn;
 
+	if (flush_fn)
+		j->nr_pins_added++;
+
 	list_add(&pin->list, flush_fn ? &pin_list->list : &pin_list->flushed);
 	spin_unlock(&j->lock);
 
@@ -462,15 +469,25 @@ journal_get_next_pin(struct journal *j, u64 max_seq, u64 *seq)
 }
 
 /* returns true if we did work */
+/*
+ * Flushing pins mostly means writing btree nodes: plug so that the block layer
+ * can merge writes to adjacent nodes (nodes allocated from the same write point
+ * are contiguous on disk), and the IO scheduler sees them as a batch.
+ *
+ * @max_nr, if nonzero, limits the number of pins flushed:
+ */
 static u64 journal_flush_pins(struct journal *j, u64 seq_to_flush,
-			      unsigned min_nr)
+			      unsigned min_nr, unsigned max_nr)
 {
 	struct journal_entry_pin *pin;
+	struct blk_plug plug;
 	u64 seq, ret = 0;
 
 	lockdep_assert_held(&j->reclaim_lock);
 
-	while (1) {
+	blk_start_plug(&plug);
+
+	while (!max_nr || ret < max_nr) {
 		cond_resched();
 
 		j->last_flushed = jiffies;
@@ -491,6 +508,8 @@ static u64 journal_flush_pins(struct journal *j, u64 seq_to_flush,
 		ret++;
 	}
 
+	blk_finish_plug(&plug);
+
 	return ret;
 }
 
@@ -534,6 +553,67 @@ static u64 journal_seq_to_flush(struct journal *j)
 	return seq_to_flush;
 }
 
+/*
+ * Background reclaim controller:
+ *
+ * Rather than flushing everything once the journal or the btree or key caches
+ * cross a watermark, background reclaim flushes pins at a rate proportional to
+ * the rate new pins are being added, scaled by how full we are: at
+ * JOURNAL_RECLAIM_FILL_TARGET percent full we flush as fast as pins come in,
+ * fuller than that we flush faster, emptier slower. Fill is the max of journal
+ * fill and the dirty fraction of the btree node and key caches.
+ *
+ * Hard limits - prereserved space, the pin fifo, the key cache dirty limit -
+ * still force flushing.
+ */
+#define JOURNAL_RECLAIM_FILL_TARGET	50
+
+static unsigned journal_reclaim_nr_to_flush(struct journal *j,
+					    bool *flush_oldest)
+{
+	struct bch_fs *c = container_of(j, struct bch_fs, journal);
+	size_t nr_keys = READ_ONCE(c->btree_key_cache.nr_keys);
+	size_t btree_used = READ_ONCE(c->btree_cache.used);
+	unsigned journal_fill = 0, cache_fill = 0, fill;
+	u64 nr_added, nr;
+
+	spin_lock(&j->lock);
+	if (j->space[journal_space_total].total)
+		journal_fill = (j->space[journal_space_total].total -
+				min(j->space[journal_space_clean].total,
+				    j->space[journal_space_total].total)) * 100 /
+			j->space[journal_space_total].total;
+
+	nr_added = j->nr_pins_added - j->reclaim_pins_added_seen;
+	j->reclaim_pins_added_seen = j->nr_pins_added;
+	spin_unlock(&j->lock);
+
+	if (btree_used)
+		cache_fill = max_t(u64, cache_fill,
+				   atomic_read(&c->btree_cache.dirty) * 100ULL /
+				   btree_used);
+	if (nr_keys)
+		cache_fill = max_t(u64, cache_fill,
+				   READ_ONCE(c->btree_key_cache.nr_dirty) * 100ULL /
+				   nr_keys);
+
+	fill = min(max(journal_fill, cache_fill), 100U);
+
+	nr = div_u64(nr_added * fill, JOURNAL_RECLAIM_FILL_TARGET);
+	if (j->reclaim_batch)
+		nr = min_t(u64, nr, j->reclaim_batch);
+
+	/*
+	 * If it's the caches that are full, flushing up to seq_to_flush (which
+	 * only looks at journal space) might not flush anything:
+	 */
+	*flush_oldest = cache_fill > JOURNAL_RECLAIM_FILL_TARGET;
+
+	j->reclaim_fill	= fill;
+	j->reclaim_rate	= min_t(u64, nr, UINT_MAX);
+	return j->reclaim_rate;
+}
+
 /**
  * bch2_journal_reclaim - free up journal buckets
  *
@@ -595,10 +675,6 @@ static int __bch2_journal_reclaim(struct journal *j, bool direct)
 		if (j->prereserved.reserved * 2 > j->prereserved.remaining)
 			min_nr = 1;
 
-		if (atomic_read(&c->btree_cache.dirty) * 4 >
-		    c->btree_cache.used  * 3)
-			min_nr = 1;
-
 		if (fifo_free(&j->pin) <= 32)
 			min_nr = 1;
 
@@ -613,7 +689,18 @@ static int __bch2_journal_reclaim(struct journal *j, bool direct)
 				c->btree_key_cache.nr_dirty,
 				c->btree_key_cache.nr_keys);
 
-		nr_flushed = journal_flush_pins(j, seq_to_flush, min_nr);
+		if (direct || min_nr) {
+			nr_flushed = journal_flush_pins(j, seq_to_flush,
+							min_nr, 0);
+		} else {
+			bool flush_oldest;
+			unsigned nr = journal_reclaim_nr_to_flush(j, &flush_oldest);
+
+			nr_flushed = nr
+				? journal_flush_pins(j, seq_to_flush,
+						     flush_oldest ? nr : 0, nr)
+				: 0;
+		}
 
 		if (direct)
 			j->nr_direct_reclaim += nr_flushed;
@@ -711,7 +798,7 @@ static int journal_flush_done(struct journal *j, u64 seq_to_flush,
 
 	mutex_lock(&j->reclaim_lock);
 
-	*did_work = journal_flush_pins(j, seq_to_flush, 0) != 0;
+	*did_work = journal_flush_pins(j, seq_to_flush, 0, 0) != 0;
 
 	spin_lock(&j->lock);
 	/*
@@ -742,6 +829,36 @@ bool bch2_journal_flush_pins(struct journal *j, u64 seq_to_flush)
 	return did_work;
 }
 
+static int journal_replicas_gc(struct journal *j)
+{
+	struct bch_fs *c = container_of(j, struct bch_fs, journal);
+	u64 seq = 0;
+	int ret = 0;
+
+	mutex_lock(&c->replicas_gc_lock);
+	bch2_replicas_gc_start(c, 1 << BCH_DATA_journal);
+
+	spin_lock(&j->lock);
+	while (!ret && seq < j->pin.back) {
+		struct bch_replicas_padded replicas;
+
+		seq = max(seq, journal_last_seq(j));
+		bch2_devlist_to_replicas(&replicas.e, BCH_DATA_journal,
+					 journal_seq_pin(j, seq)->devs);
+		seq++;
+
+		spin_unlock(&j->lock);
+		ret = bch2_mark_replicas(c, &replicas.e);
+		spin_lock(&j->lock);
+	}
+	spin_unlock(&j->lock);
+
+	ret = bch2_replicas_gc_end(c, ret);
+	mutex_unlock(&c->replicas_gc_lock);
+
+	return ret;
+}
+
 int bch2_journal_flush_device_pins(struct journal *j, int dev_idx)
 {
 	struct bch_fs *c = container_of(j, struct bch_fs, journal);
@@ -763,28 +880,58 @@ int bch2_journal_flush_device_pins(struct journal *j, int dev_idx)
 	if (ret)
 		return ret;
 
-	mutex_lock(&c->replicas_gc_lock);
-	bch2_replicas_gc_start(c, 1 << BCH_DATA_journal);
+	return journal_replicas_gc(j);
+}
 
-	seq = 0;
+static bool journal_devs_outside_target(struct bch_fs *c,
+					struct bch_devs_list devs,
+					unsigned target)
+{
+	unsigned i;
 
-	spin_lock(&j->lock);
-	while (!ret && seq < j->pin.back) {
-		struct bch_replicas_padded replicas;
+	for (i = 0; i < devs.nr; i++)
+		if (!bch2_dev_in_target(c, devs.devs[i], target))
+			return true;
+	return false;
+}
 
-		seq = max(seq, journal_last_seq(j));
-		bch2_devlist_to_replicas(&replicas.e, BCH_DATA_journal,
-					 journal_seq_pin(j, seq)->devs);
-		seq++;
+/*
+ * After changing journal_target, new journal writes go to the new target - this
+ * gets the rest of the journal off devices outside the target, by flushing
+ * everything pinned by journal entries on them:
+ */
+int bch2_journal_migrate_to_target(struct journal *j)
+{
+	struct bch_fs *c = container_of(j, struct bch_fs, journal);
+	unsigned target = bch2_journal_target(c);
+	struct journal_entry_pin_list *p;
+	u64 iter, seq = 0;
+	int ret;
 
-		spin_unlock(&j->lock);
-		ret = bch2_mark_replicas(c, &replicas.e);
-		spin_lock(&j->lock);
-	}
+	if (!target)
+		return 0;
+
+	/* Close the current entry, so that the next write goes to the target: */
+	ret = bch2_journal_meta(j);
+	if (ret)
+		return ret;
+
+	spin_lock(&j->lock);
+	fifo_for_each_entry_ptr(p, &j->pin, iter)
+		if (journal_devs_outside_target(c, p->devs, target))
+			seq = iter;
 	spin_unlock(&j->lock);
 
-	ret = bch2_replicas_gc_end(c, ret);
-	mutex_unlock(&c->replicas_gc_lock);
+	bch2_journal_flush_pins(j, seq);
 
-	return ret;
+	/*
+	 * Write a journal entry with last_seq past the entries we just
+	 * flushed, before dropping their devices from the journal replicas:
+	 */
+	ret = bch2_journal_error(j) ?:
+		bch2_journal_meta(j);
+	if (ret)
+		return ret;
+
+	return journal_replicas_gc(j);
 }
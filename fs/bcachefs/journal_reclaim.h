@@ -84,5 +84,6 @@ static inline bool bch2_journal_flush_all_pins(struct journal *j)
 }
 
 int bch2_journal_flush_device_pins(struct journal *, int);
+int bch2_journal_migrate_to_target(struct journal *);
 
 #endif /* _BCACHEFS_JOURNAL_RECLAIM_H */
@@ -301,7 +301,7 @@ void bch2_blacklist_entries_gc(struct work_struct *work)
 			c->disk_sb.sb->features[0] &=
 				~(1ULL << BCH_FEATURE_journal_seq_blacklist_v3);
 
-		bch2_write_super(c);
+		bch2_write_super_async(c);
 	}
 out:
 	mutex_unlock(&c->sb_lock);
@@ -3,6 +3,7 @@
 #define _BCACHEFS_JOURNAL_TYPES_H
 
 #include <linux/cache.h>
+#include <linux/hashtable.h>
 #include <linux/workqueue.h>
 
 #include "alloc_types.h"
@@ -16,13 +17,30 @@
 /*
  * We put JOURNAL_BUF_NR of these in struct journal; we used them for writes to
  * the journal that are being staged or in flight.
+ *
+ * Up to opts.journal_write_depth writes may be in flight at a time: writes are
+ * started (prepared and allocated) in order, but may complete in any order -
+ * journal_write_done() only advances unwritten_idx past writes that are done.
  */
 struct journal_buf {
 	struct jset		*data;
 
 	__BKEY_PADDED(key, BCH_REPLICAS_MAX);
 
+	struct closure		io;
 	struct closure_waitlist	wait;
+	u64			write_start_time;
+
+	/*
+	 * A flush write is acknowledged - waiters woken - once
+	 * nr_acks_required copies on ack_devs have completed, without waiting
+	 * for the rest: see journal_write_ack_devs()
+	 */
+	struct work_struct	ack_work;
+	struct bch_devs_mask	ack_devs;
+	struct bch_devs_mask	devs_written;
+	atomic_t		nr_acks;
+	unsigned		nr_acks_required;
 
 	unsigned		buf_size;	/* size in bytes of @data */
 	unsigned		sectors;	/* maximum size for current entry */
@@ -32,8 +50,10 @@ struct journal_buf {
 	bool			noflush;	/* write has already been kicked off, and was noflush */
 	bool			must_flush;	/* something wants a flush */
 	bool			separate_flush;
-	/* bloom filter: */
-	unsigned long		has_inode[1024 / sizeof(unsigned long)];
+	bool			write_started;
+	bool			write_allocated;
+	bool			write_done;
+	u8			idx;
 };
 
 /*
@@ -65,6 +85,17 @@ struct journal_res {
 	u16			u64s;
 	u32			offset;
 	u64			seq;
+	/* set if this reservation was carved out of a percpu chunk: */
+	struct journal_res_cpu	*cpu;
+};
+
+/*
+ * Position of a journal reservation, for ordering updates with percpu chunks -
+ * see journal_res_pos_after():
+ */
+struct journal_res_pos {
+	u64			seq;
+	u32			offset;
 };
 
 /*
@@ -95,6 +126,38 @@ union journal_res_state {
 	};
 };
 
+union journal_res_cpu_state {
+	struct {
+		atomic64_t	counter;
+	};
+
+	struct {
+		u64		v;
+	};
+
+	struct {
+		u64		offset:20,
+				end:20,
+				idx:2,
+				active:1;
+	};
+};
+
+/*
+ * Each cpu reserves a chunk of the current journal entry with a single
+ * reservation on j->reservations, then hands out reservations from it locally:
+ *
+ * count[idx] is the number of outstanding reservations from chunks in buf idx,
+ * plus one while the chunk is active - while it's nonzero, this cpu holds one
+ * ref on buf idx in j->reservations. Whatever's left of a chunk when it's
+ * retired (when the entry is closed, or when the cpu needs a new chunk) is
+ * filled with empty jset entries, which journal_write_compact() drops.
+ */
+struct journal_res_cpu {
+	union journal_res_cpu_state state;
+	atomic_t		count[JOURNAL_BUF_NR];
+};
+
 union journal_preres_state {
 	struct {
 		atomic64_t	counter;
@@ -159,6 +222,7 @@ struct journal {
 	unsigned long		flags;
 
 	union journal_res_state reservations;
+	struct journal_res_cpu __percpu *res_cpu;
 
 	/* Max size of current journal entry */
 	unsigned		cur_entry_u64s;
@@ -185,8 +249,8 @@ struct journal {
 	unsigned		buf_size_want;
 
 	/*
-	 * Two journal entries -- one is currently open for new entries, the
-	 * other is possibly being written out.
+	 * Ring of journal entries -- one is currently open for new entries, the
+	 * others are possibly being written out.
 	 */
 	struct journal_buf	buf[JOURNAL_BUF_NR];
 
@@ -200,7 +264,9 @@ struct journal {
 	struct closure_waitlist	async_wait;
 	struct closure_waitlist	preres_wait;
 
-	struct closure		io;
+	/* devices with a copy of every noflush write since the last flush write: */
+	struct bch_devs_mask	noflush_devs;
+
 	struct delayed_work	write_work;
 
 	/* Sequence number of most recent journal entry (last entry in @pin) */
@@ -209,6 +275,15 @@ struct journal {
 	/* seq, last_seq from the most recent journal entry successfully written */
 	u64			seq_ondisk;
 	u64			flushed_seq_ondisk;
+
+	/*
+	 * Journal seqs of evicted inodes that haven't been flushed yet, for
+	 * bch2_inode_journal_seq():
+	 */
+	spinlock_t		evicted_inodes_lock;
+	DECLARE_HASHTABLE(evicted_inodes, 8);
+	struct list_head	evicted_inodes_list;
+	u64			evicted_inodes_seq_lost;
 	u64			last_seq_ondisk;
 	u64			err_seq;
 	u64			last_empty_seq;
@@ -248,6 +323,12 @@ struct journal {
 	u64			nr_direct_reclaim;
 	u64			nr_background_reclaim;
 
+	/* background reclaim controller state: */
+	u64			nr_pins_added;
+	u64			reclaim_pins_added_seen;
+	unsigned		reclaim_fill;
+	unsigned		reclaim_rate;
+
 	unsigned long		last_flushed;
 	struct journal_entry_pin *flush_in_progress;
 	wait_queue_head_t	pin_flush_wait;
@@ -257,12 +338,20 @@ struct journal {
 	bool			can_discard;
 
 	unsigned		write_delay_ms;
+	/*
+	 * Adaptive group commit: under heavy flush load, flushes wait for the
+	 * next journal write to complete instead of closing the entry:
+	 */
+	bool			write_delay_adaptive;
+	u64			last_flush_request;
+	u64			flush_interval_ewma;
 	unsigned		reclaim_delay_ms;
+	/* max pins background reclaim flushes per reclaim_delay_ms, 0 for no limit: */
+	unsigned		reclaim_batch;
 	unsigned long		last_flush_write;
 
 	u64			res_get_blocked_start;
 	u64			need_write_time;
-	u64			write_start_time;
 
 	u64			nr_flush_writes;
 	u64			nr_noflush_writes;
@@ -277,6 +366,14 @@ struct journal {
 #endif
 };
 
+struct journal_bio {
+	struct bch_dev		*ca;
+	unsigned		buf_idx;
+	u64			submit_time;
+
+	struct bio		bio;
+};
+
 /*
  * Embedded in struct bch_dev. First three fields refer to the array of journal
  * buckets, in bch_sb.
@@ -301,8 +398,9 @@ struct journal_device {
 
 	u64			*buckets;
 
-	/* Bio for journal reads/writes to this device */
-	struct bio		*bio;
+	/* Bio for journal writes to this device, one per journal_buf */
+	struct journal_bio	*bio[JOURNAL_BUF_NR];
+	atomic_t		nr_writes_in_flight;
 
 	/* for bch_journal_read_device */
 	struct closure		read;
@@ -0,0 +1,154 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include "bcachefs.h"
+#include "alloc_background.h"
+#include "btree_iter.h"
+#include "btree_update.h"
+#include "buckets.h"
+#include "lru.h"
+
+/*
+ * LRU btree:
+ *
+ * Buckets that only contain cached data are indexed by last read time in
+ * BTREE_ID_LRU, so that the allocator can find the coldest cached buckets to
+ * evict by walking the start of the index, instead of scanning every bucket on
+ * the device.
+ *
+ * Entries are added and removed via the btree write buffer: when a cached
+ * bucket is read (bch2_bucket_io_time_reset()), and when a bucket starts or
+ * stops being cached only (from the alloc key updates done by triggers). So
+ * maintaining the index costs the read path no btree lookups - but the index
+ * is only a hint: it lags behind by whatever hasn't been flushed yet, and
+ * invalidating a bucket doesn't remove its entry.
+ *
+ * Users check each entry against the in memory bucket mark and read time with
+ * bch2_lru_entry_valid(), and stale entries are deleted in the background by
+ * bch2_dev_lru_cleanup_work().
+ */
+
+#define LRU_CLEANUP_BATCH		64
+
+const char *bch2_lru_invalid(const struct bch_fs *c, struct bkey_s_c k)
+{
+	if (bkey_val_bytes(k.k))
+		return "nonempty value";
+
+	return NULL;
+}
+
+void bch2_lru_to_text(struct printbuf *out, struct bch_fs *c,
+		      struct bkey_s_c k)
+{
+	pr_buf(out, "dev %u read_time %llu bucket %llu",
+	       bch2_lru_pos_dev(k.k->p),
+	       bch2_lru_pos_time(k.k->p),
+	       k.k->p.offset);
+}
+
+static int lru_update(struct btree_trans *trans, struct bpos pos,
+		      unsigned type)
+{
+	struct bkey_i k;
+
+	if (!bch2_fs_has_lru(trans->c))
+		return 0;
+
+	bkey_init(&k.k);
+	k.k.type	= type;
+	k.k.p		= pos;
+
+	return bch2_trans_update_buffered(trans, BTREE_ID_LRU, &k);
+}
+
+int bch2_lru_set(struct btree_trans *trans, unsigned dev,
+		 u64 bucket, u64 time)
+{
+	return lru_update(trans, bch2_lru_pos(dev, bucket, time),
+			  KEY_TYPE_lru);
+}
+
+int bch2_lru_delete(struct btree_trans *trans, unsigned dev,
+		    u64 bucket, u64 time)
+{
+	return lru_update(trans, bch2_lru_pos(dev, bucket, time),
+			  KEY_TYPE_deleted);
+}
+
+/*
+ * Must be called with ca->bucket_lock or c->mark_lock held: an entry is valid
+ * if the bucket is still cached only, and hasn't been read (or invalidated)
+ * since the entry was added:
+ */
+bool bch2_lru_entry_valid(struct bch_dev *ca, struct bpos pos)
+{
+	struct bucket *g;
+	struct bucket_mark m;
+
+	BUILD_BUG_ON(BCH_LRU_TIME_SHIFT != BUCKET_IO_TIME_SHIFT);
+
+	if (bch2_lru_pos_dev(pos) != ca->dev_idx ||
+	    pos.offset <  ca->mi.first_bucket ||
+	    pos.offset >= ca->mi.nbuckets)
+		return false;
+
+	g = bucket(ca, pos.offset);
+	m = READ_ONCE(g->mark);
+
+	return bch2_bucket_is_lru(m.dirty_sectors, m.cached_sectors) &&
+		(u32) (bch2_lru_pos_time(pos) >> BUCKET_IO_TIME_SHIFT) ==
+		g->io_time[READ];
+}
+
+/*
+ * Delete stale entries from the start of a device's LRU index, where the
+ * allocator looks - i.e. entries for buckets it's evicted. Queued by the
+ * allocator when it sees them, since the allocator thread itself can't be
+ * waiting on write buffer flushes:
+ */
+void bch2_dev_lru_cleanup_work(struct work_struct *work)
+{
+	struct bch_dev *ca = container_of(work, struct bch_dev,
+					  lru_cleanup_work);
+	struct bch_fs *c = ca->fs;
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	size_t nr_valid = 0, nr_deleted = 0;
+	bool valid;
+	int ret;
+
+	bch2_trans_init(&trans, c, 0, 0);
+
+	for_each_btree_key(&trans, iter, BTREE_ID_LRU,
+			   bch2_lru_pos(ca->dev_idx, 0, 0), 0, k, ret) {
+		if (bch2_lru_pos_dev(k.k->p) != ca->dev_idx)
+			break;
+
+		down_read(&ca->bucket_lock);
+		valid = k.k->type == KEY_TYPE_lru &&
+			bch2_lru_entry_valid(ca, k.k->p);
+		up_read(&ca->bucket_lock);
+
+		if (valid) {
+			if (++nr_valid >= ALLOC_SCAN_BATCH(ca) * 2)
+				break;
+			continue;
+		}
+
+		ret = lru_update(&trans, k.k->p, KEY_TYPE_deleted);
+		if (!ret && !(++nr_deleted % LRU_CLEANUP_BATCH))
+			ret = bch2_trans_commit(&trans, NULL, NULL, 0);
+		if (ret)
+			break;
+	}
+	bch2_trans_iter_put(&trans, iter);
+
+	if (!ret)
+		ret = bch2_trans_commit(&trans, NULL, NULL, 0);
+
+	bch2_trans_exit(&trans);
+
+	if (ret && ret != -EROFS && ret != -EINTR)
+		bch_err(c, "%s: error %i cleaning up lru", ca->name, ret);
+}
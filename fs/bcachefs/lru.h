@@ -0,0 +1,52 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _BCACHEFS_LRU_H
+#define _BCACHEFS_LRU_H
+
+const char *bch2_lru_invalid(const struct bch_fs *, struct bkey_s_c);
+void bch2_lru_to_text(struct printbuf *, struct bch_fs *, struct bkey_s_c);
+
+#define bch2_bkey_ops_lru (struct bkey_ops) {		\
+	.key_invalid	= bch2_lru_invalid,		\
+	.val_to_text	= bch2_lru_to_text,		\
+}
+
+static inline bool bch2_fs_has_lru(struct bch_fs *c)
+{
+	return c->sb.features & (1ULL << BCH_FEATURE_lru);
+}
+
+static inline u64 bch2_lru_time_mask(void)
+{
+	return ~(~0ULL << BCH_LRU_TIME_BITS);
+}
+
+static inline struct bpos bch2_lru_pos(unsigned dev, u64 bucket, u64 time)
+{
+	return POS(((u64) dev << BCH_LRU_TIME_BITS)|
+		   ((time >> BCH_LRU_TIME_SHIFT) & bch2_lru_time_mask()),
+		   bucket);
+}
+
+static inline unsigned bch2_lru_pos_dev(struct bpos pos)
+{
+	return pos.inode >> BCH_LRU_TIME_BITS;
+}
+
+static inline u64 bch2_lru_pos_time(struct bpos pos)
+{
+	return (pos.inode & bch2_lru_time_mask()) << BCH_LRU_TIME_SHIFT;
+}
+
+/* Buckets that are indexed by the LRU btree: */
+static inline bool bch2_bucket_is_lru(u16 dirty_sectors, u16 cached_sectors)
+{
+	return !dirty_sectors && cached_sectors;
+}
+
+int bch2_lru_set(struct btree_trans *, unsigned, u64, u64);
+int bch2_lru_delete(struct btree_trans *, unsigned, u64, u64);
+
+bool bch2_lru_entry_valid(struct bch_dev *, struct bpos);
+void bch2_dev_lru_cleanup_work(struct work_struct *);
+
+#endif /* _BCACHEFS_LRU_H */
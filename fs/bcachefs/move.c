@@ -2,12 +2,16 @@
 
 #include "bcachefs.h"
 #include "alloc_foreground.h"
+#include "backpointers.h"
 #include "bkey_buf.h"
 #include "btree_gc.h"
 #include "btree_update.h"
 #include "btree_update_interior.h"
+#include "btree_write_buffer.h"
 #include "buckets.h"
 #include "disk_groups.h"
+#include "ec.h"
+#include "fsck.h"
 #include "inode.h"
 #include "io.h"
 #include "journal_reclaim.h"
@@ -16,12 +20,15 @@
 #include "super-io.h"
 #include "keylist.h"
 
+#include <linux/cgroup.h>
 #include <linux/ioprio.h>
 #include <linux/kthread.h>
+#include <linux/sched/clock.h>
 
 #include <trace/events/bcachefs.h>
 
 #define SECTORS_IN_FLIGHT_PER_DEVICE	2048
+#define MOVE_CONGESTED_DELAY_MAX	(HZ / 10)
 
 struct moving_io {
 	struct list_head	list;
@@ -221,8 +228,21 @@ void bch2_migrate_read_done(struct migrate_write *m, struct bch_read_bio *rbio)
 		m->op.csum_type = m->op.crc.csum_type;
 	}
 
-	if (m->data_cmd == DATA_REWRITE)
+	/*
+	 * Copygc and device evacuation just relocate data, changing how it's
+	 * encoded is rebalance's job: write it out exactly as it was read, so
+	 * that the write path can pass it through without decompressing,
+	 * recompressing or rechecksumming it - the checksum was already checked
+	 * by the read:
+	 */
+	if (m->data_cmd == DATA_REWRITE) {
+		m->op.csum_type		= m->op.crc.csum_type;
+		m->op.compression_type	= crc_is_compressed(m->op.crc)
+			? m->op.crc.compression_type
+			: BCH_COMPRESSION_TYPE_none;
+
 		bch2_dev_list_drop_dev(&m->op.devs_have, m->data_opts.rewrite_dev);
+	}
 }
 
 int bch2_migrate_write_init(struct bch_fs *c, struct migrate_write *m,
@@ -245,11 +265,17 @@ int bch2_migrate_write_init(struct bch_fs *c, struct migrate_write *m,
 
 	bch2_write_op_init(&m->op, c, io_opts);
 
-	if (!bch2_bkey_is_incompressible(k))
+	if (data_opts.erasure_code)
+		m->op.opts.erasure_code = true;
+
+	if (!bch2_bkey_is_incompressible(k)) {
 		m->op.compression_type =
 			bch2_compression_opt_to_type[io_opts.background_compression ?:
 						     io_opts.compression];
-	else
+		m->op.compression_level = io_opts.background_compression
+			? c->opts.background_compression_level
+			: c->opts.compression_level;
+	} else
 		m->op.incompressible = true;
 
 	m->op.target	= data_opts.target,
@@ -337,6 +363,10 @@ static void move_free(struct closure *cl)
 		if (bv->bv_page)
 			__free_page(bv->bv_page);
 
+	/* Drop blk-cgroup refs: */
+	bio_uninit(&io->rbio.bio);
+	bio_uninit(&io->write.op.wbio.bio);
+
 	wake_up(&ctxt->wait);
 
 	kfree(io);
@@ -347,6 +377,7 @@ static void move_write_done(struct closure *cl)
 	struct moving_io *io = container_of(cl, struct moving_io, cl);
 
 	atomic_sub(io->write_sectors, &io->write.ctxt->write_sectors);
+	atomic_dec(&io->write.ctxt->stats->writes_in_flight);
 	closure_return_with_destructor(cl, move_free);
 }
 
@@ -362,6 +393,7 @@ static void move_write(struct closure *cl)
 	bch2_migrate_read_done(&io->write, &io->rbio);
 
 	atomic_add(io->write_sectors, &io->write.ctxt->write_sectors);
+	atomic_inc(&io->write.ctxt->stats->writes_in_flight);
 	closure_call(&io->write.op.cl, bch2_write, NULL, cl);
 	continue_at(cl, move_write_done, NULL);
 }
@@ -380,6 +412,7 @@ static void move_read_endio(struct bio *bio)
 	struct moving_context *ctxt = io->write.ctxt;
 
 	atomic_sub(io->read_sectors, &ctxt->read_sectors);
+	atomic_dec(&ctxt->stats->reads_in_flight);
 	io->read_completed = true;
 
 	if (next_pending_write(ctxt))
@@ -417,6 +450,120 @@ static void bch2_move_ctxt_wait_for_io(struct moving_context *ctxt)
 		atomic_read(&ctxt->write_sectors) != sectors_pending);
 }
 
+/*
+ * Background data moves are charged to the blk-cgroup set via sysfs
+ * (move_io_cgroup), so that the io controller can throttle them relative to
+ * foreground IO. Writing 1 selects the io cgroup of the writer, writing 0
+ * clears it.
+ *
+ * Much of a move's IO is submitted from workqueues and endio context, not the
+ * moving thread, so the blk-cgroup goes on each moving_io's bios: the bios the
+ * read and write paths split, clone or bounce from them inherit it, and
+ * bio_set_dev() keeps it for the device they're submitted to.
+ */
+#ifdef CONFIG_BLK_CGROUP
+static void move_blkcg_set(struct bch_fs *c, struct cgroup_subsys_state *css)
+{
+	struct cgroup_subsys_state *old;
+
+	spin_lock(&c->move_blkcg_lock);
+	old = c->move_blkcg_css;
+	c->move_blkcg_css = css;
+	spin_unlock(&c->move_blkcg_lock);
+
+	if (old)
+		css_put(old);
+}
+
+int bch2_move_blkcg_set_current(struct bch_fs *c, bool set)
+{
+	move_blkcg_set(c, set ? task_get_css(current, io_cgrp_id) : NULL);
+	return 0;
+}
+
+void bch2_move_blkcg_to_text(struct printbuf *out, struct bch_fs *c)
+{
+	struct cgroup_subsys_state *css;
+
+	spin_lock(&c->move_blkcg_lock);
+	css = c->move_blkcg_css;
+	if (css)
+		css_get(css);
+	spin_unlock(&c->move_blkcg_lock);
+
+	if (css) {
+		cgroup_path(css->cgroup, out->pos, printbuf_remaining(out));
+		out->pos += strlen(out->pos);
+		css_put(css);
+	} else {
+		pr_buf(out, "(none)");
+	}
+	pr_buf(out, "\n");
+}
+
+/*
+ * bio_associate_blkg_from_css() needs a device to look up the blkg on: any
+ * device does, since it's redone for the real one at submission:
+ */
+static void move_blkcg_associate(struct bch_fs *c, struct moving_io *io,
+				 struct bkey_s_c k)
+{
+	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(k);
+	const struct bch_extent_ptr *ptr;
+	struct bch_dev *ca;
+
+	if (!READ_ONCE(c->move_blkcg_css))
+		return;
+
+	bkey_for_each_ptr(ptrs, ptr) {
+		ca = bch_dev_bkey_exists(c, ptr->dev);
+		if (!percpu_ref_tryget(&ca->io_ref))
+			continue;
+
+		bio_set_dev(&io->rbio.bio, ca->disk_sb.bdev);
+		bio_set_dev(&io->write.op.wbio.bio, ca->disk_sb.bdev);
+
+		spin_lock(&c->move_blkcg_lock);
+		if (c->move_blkcg_css) {
+			bio_associate_blkg_from_css(&io->rbio.bio,
+						    c->move_blkcg_css);
+			bio_associate_blkg_from_css(&io->write.op.wbio.bio,
+						    c->move_blkcg_css);
+		}
+		spin_unlock(&c->move_blkcg_lock);
+
+		percpu_ref_put(&ca->io_ref);
+		break;
+	}
+}
+
+void bch2_fs_move_exit(struct bch_fs *c)
+{
+	move_blkcg_set(c, NULL);
+}
+
+void bch2_fs_move_init(struct bch_fs *c)
+{
+	spin_lock_init(&c->move_blkcg_lock);
+}
+#else
+int bch2_move_blkcg_set_current(struct bch_fs *c, bool set)
+{
+	return -EOPNOTSUPP;
+}
+
+void bch2_move_blkcg_to_text(struct printbuf *out, struct bch_fs *c)
+{
+	pr_buf(out, "(not supported)\n");
+}
+
+static inline void move_blkcg_associate(struct bch_fs *c, struct moving_io *io,
+					struct bkey_s_c k) {}
+
+void bch2_fs_move_exit(struct bch_fs *c) {}
+void bch2_fs_move_init(struct bch_fs *c) {}
+#endif
+
 static int bch2_move_extent(struct btree_trans *trans,
 			    struct moving_context *ctxt,
 			    struct write_point_specifier wp,
@@ -475,6 +622,8 @@ static int bch2_move_extent(struct btree_trans *trans,
 	io->rbio.bio.bi_iter.bi_sector	= bkey_start_offset(k.k);
 	io->rbio.bio.bi_end_io		= move_read_endio;
 
+	move_blkcg_associate(c, io, k);
+
 	ret = bch2_migrate_write_init(c, &io->write, wp, io_opts,
 				      data_cmd, data_opts, btree_id, k);
 	if (ret)
@@ -486,6 +635,7 @@ static int bch2_move_extent(struct btree_trans *trans,
 	trace_move_extent(k.k);
 
 	atomic_add(io->read_sectors, &ctxt->read_sectors);
+	atomic_inc(&ctxt->stats->reads_in_flight);
 	list_add_tail(&io->list, &ctxt->reads);
 
 	/*
@@ -499,6 +649,8 @@ static int bch2_move_extent(struct btree_trans *trans,
 	return 0;
 err_free_pages:
 	bio_free_pages(&io->write.op.wbio.bio);
+	bio_uninit(&io->rbio.bio);
+	bio_uninit(&io->write.op.wbio.bio);
 err_free:
 	kfree(io);
 err:
@@ -506,6 +658,73 @@ static int bch2_move_extent(struct btree_trans *trans,
 	return ret;
 }
 
+/*
+ * Slow down in proportion to how congested the devices we're moving data to and
+ * from are, so that background moves back off smoothly when they're busy with
+ * foreground IO. Since the read can be done from whichever replica is least
+ * congested, the source is only as congested as its least congested device:
+ */
+static void move_congested_wait(struct bch_fs *c, struct bkey_s_c k, u16 target)
+{
+	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(k);
+	const struct bch_extent_ptr *ptr;
+	unsigned congested = bch2_target_congested(c, target);
+	unsigned src = CONGESTED_MAX;
+	bool have_src = false;
+	u64 now = local_clock();
+	unsigned long delay;
+
+	bkey_for_each_ptr(ptrs, ptr) {
+		if (ptr->cached)
+			continue;
+
+		src = min(src, bch2_dev_congested(bch_dev_bkey_exists(c, ptr->dev),
+						  now));
+		have_src = true;
+	}
+
+	if (have_src)
+		congested = max(congested, src);
+
+	delay = congested * MOVE_CONGESTED_DELAY_MAX / CONGESTED_MAX;
+	if (delay)
+		schedule_timeout_interruptible(delay);
+}
+
+/* Returns nonzero if the caller should stop, i.e. the kthread is stopping: */
+static int move_ratelimit(struct btree_trans *trans,
+			  struct moving_context *ctxt,
+			  struct bch_ratelimit *rate)
+{
+	bool kthread = (current->flags & PF_KTHREAD) != 0;
+	u64 delay;
+
+	do {
+		delay = rate ? bch2_ratelimit_delay(rate) : 0;
+
+		if (delay) {
+			bch2_trans_unlock(trans);
+			set_current_state(TASK_INTERRUPTIBLE);
+		}
+
+		if (kthread && kthread_should_stop()) {
+			__set_current_state(TASK_RUNNING);
+			return 1;
+		}
+
+		if (delay)
+			schedule_timeout(delay);
+
+		if (unlikely(freezing(current))) {
+			bch2_trans_unlock(trans);
+			move_ctxt_wait_event(ctxt, list_empty(&ctxt->reads));
+			try_to_freeze();
+		}
+	} while (delay);
+
+	return 0;
+}
+
 static int __bch2_move_data(struct bch_fs *c,
 		struct moving_context *ctxt,
 		struct bch_ratelimit *rate,
@@ -516,7 +735,6 @@ static int __bch2_move_data(struct bch_fs *c,
 		struct bch_move_stats *stats,
 		enum btree_id btree_id)
 {
-	bool kthread = (current->flags & PF_KTHREAD) != 0;
 	struct bch_io_opts io_opts = bch2_opts_to_inode_opts(c->opts);
 	struct bkey_buf sk;
 	struct btree_trans trans;
@@ -524,7 +742,7 @@ static int __bch2_move_data(struct bch_fs *c,
 	struct bkey_s_c k;
 	struct data_opts data_opts;
 	enum data_cmd data_cmd;
-	u64 delay, cur_inum = U64_MAX;
+	u64 cur_inum = U64_MAX;
 	int ret = 0, ret2;
 
 	bch2_bkey_buf_init(&sk);
@@ -541,28 +759,9 @@ static int __bch2_move_data(struct bch_fs *c,
 		bch2_ratelimit_reset(rate);
 
 	while (1) {
-		do {
-			delay = rate ? bch2_ratelimit_delay(rate) : 0;
-
-			if (delay) {
-				bch2_trans_unlock(&trans);
-				set_current_state(TASK_INTERRUPTIBLE);
-			}
-
-			if (kthread && (ret = kthread_should_stop())) {
-				__set_current_state(TASK_RUNNING);
-				goto out;
-			}
-
-			if (delay)
-				schedule_timeout(delay);
-
-			if (unlikely(freezing(current))) {
-				bch2_trans_unlock(&trans);
-				move_ctxt_wait_event(ctxt, list_empty(&ctxt->reads));
-				try_to_freeze();
-			}
-		} while (delay);
+		ret = move_ratelimit(&trans, ctxt, rate);
+		if (ret)
+			goto out;
 peek:
 		k = bch2_btree_iter_peek(iter);
 
@@ -593,6 +792,8 @@ static int __bch2_move_data(struct bch_fs *c,
 			goto peek;
 		}
 
+		data_opts = (struct data_opts) { 0 };
+
 		switch ((data_cmd = pred(c, arg, k, &io_opts, &data_opts))) {
 		case DATA_SKIP:
 			goto next;
@@ -611,6 +812,8 @@ static int __bch2_move_data(struct bch_fs *c,
 		k = bkey_i_to_s_c(sk.k);
 		bch2_trans_unlock(&trans);
 
+		move_congested_wait(c, k, data_opts.target);
+
 		ret2 = bch2_move_extent(&trans, ctxt, wp, io_opts, btree_id, k,
 					data_cmd, data_opts);
 		if (ret2) {
@@ -680,18 +883,251 @@ int bch2_move_data(struct bch_fs *c,
 	return ret;
 }
 
-static int bch2_move_btree(struct bch_fs *c,
-			   move_pred_fn pred,
-			   void *arg,
-			   struct bch_move_stats *stats)
+static int __bch2_move_data_phys(struct bch_fs *c,
+		struct moving_context *ctxt,
+		struct bch_ratelimit *rate,
+		struct write_point_specifier wp,
+		unsigned dev, u64 start, u64 end,
+		move_pred_fn pred, void *arg,
+		struct bch_move_stats *stats)
+{
+	struct bch_io_opts io_opts;
+	struct bkey_buf sk;
+	struct btree_trans trans;
+	struct btree_iter *bp_iter, *iter;
+	struct bkey_s_c k;
+	struct bch_backpointer bp;
+	struct bpos bp_end;
+	struct data_opts data_opts;
+	enum data_cmd data_cmd;
+	int ret = 0, ret2;
+
+	start	= min(start, BCH_BACKPOINTER_OFFSET_MAX);
+	end	= min(end, BCH_BACKPOINTER_OFFSET_MAX);
+	bp_end	= bch2_backpointer_pos(dev, end, 0);
+
+	bch2_bkey_buf_init(&sk);
+	bch2_trans_init(&trans, c, 0, 0);
+
+	stats->data_type = BCH_DATA_user;
+	stats->btree_id	= BTREE_ID_BACKPOINTERS;
+	stats->pos	= POS_MIN;
+
+	bp_iter = bch2_trans_get_iter(&trans, BTREE_ID_BACKPOINTERS,
+				      bch2_backpointer_pos(dev, start, 0),
+				      BTREE_ITER_PREFETCH);
+
+	while (1) {
+		ret = move_ratelimit(&trans, ctxt, rate);
+		if (ret)
+			break;
+
+		k = bch2_btree_iter_peek(bp_iter);
+
+		stats->pos = bp_iter->pos;
+
+		if (!k.k)
+			break;
+		ret = bkey_err(k);
+		if (ret == -EINTR) {
+			bch2_trans_reset(&trans, 0);
+			continue;
+		}
+		if (ret)
+			break;
+		if (bkey_cmp(k.k->p, bp_end) >= 0)
+			break;
+
+		if (k.k->type != KEY_TYPE_backpointer)
+			goto next_nondata;
+
+		bp = *bkey_s_c_to_backpointer(k).v;
+
+		k = bch2_backpointer_get_key(&trans, &iter, bp_iter->pos, bp);
+		ret = bkey_err(k);
+		if (!ret && k.k)
+			bch2_bkey_buf_reassemble(&sk, c, k);
+		bch2_trans_iter_put(&trans, iter);
+
+		if (ret == -EINTR) {
+			bch2_trans_reset(&trans, 0);
+			continue;
+		}
+		if (ret)
+			break;
+
+		/* stale backpointer: */
+		if (!k.k)
+			goto next_nondata;
+
+		/* unlock before looking up the inode, and doing IO: */
+		k = bkey_i_to_s_c(sk.k);
+		bch2_trans_unlock(&trans);
+
+		io_opts = bch2_opts_to_inode_opts(c->opts);
+		if (bp.btree_id == BTREE_ID_EXTENTS) {
+			struct bch_inode_unpacked inode;
+
+			if (!bch2_inode_find_by_inum(c, k.k->p.inode, &inode))
+				bch2_io_opts_apply(&io_opts, bch2_inode_opts_get(&inode));
+		}
+
+		data_opts = (struct data_opts) { 0 };
+
+		switch ((data_cmd = pred(c, arg, k, &io_opts, &data_opts))) {
+		case DATA_SKIP:
+			goto next;
+		case DATA_SCRUB:
+			BUG();
+		case DATA_ADD_REPLICAS:
+		case DATA_REWRITE:
+		case DATA_PROMOTE:
+			break;
+		default:
+			BUG();
+		}
+
+		move_congested_wait(c, k, data_opts.target);
+
+		ret2 = bch2_move_extent(&trans, ctxt, wp, io_opts, bp.btree_id,
+					k, data_cmd, data_opts);
+		if (ret2) {
+			if (ret2 == -EINTR) {
+				bch2_trans_reset(&trans, 0);
+				bch2_trans_cond_resched(&trans);
+				continue;
+			}
+
+			if (ret2 == -ENOMEM) {
+				/* memory allocation failure, wait for some IO to finish */
+				bch2_move_ctxt_wait_for_io(ctxt);
+				continue;
+			}
+
+			/* XXX signal failure */
+			goto next;
+		}
+
+		if (rate)
+			bch2_ratelimit_increment(rate, k.k->size);
+next:
+		atomic64_add(k.k->size * bch2_bkey_nr_ptrs_allocated(k),
+			     &stats->sectors_seen);
+next_nondata:
+		bch2_btree_iter_next(bp_iter);
+		bch2_trans_cond_resched(&trans);
+	}
+
+	ret = bch2_trans_exit(&trans) ?: ret;
+	bch2_bkey_buf_exit(&sk, c);
+
+	return ret;
+}
+
+/*
+ * Move the data with dirty pointers into each of @ranges (sorted, of sectors
+ * [start, end)) of device @dev, found via the backpointers btree: the cost is
+ * proportional to the amount of live data in the ranges, not the size of the
+ * filesystem. IO for all the ranges shares one moving_context, and is only
+ * waited on at the end.
+ *
+ * The caller must check bch2_fs_has_backpointers(), and should flush the btree
+ * write buffer first - backpointers that haven't been flushed won't be seen.
+ * @rate isn't reset, so that it carries over when called several times.
+ */
+int bch2_move_data_phys_ranges(struct bch_fs *c,
+			       struct bch_ratelimit *rate,
+			       struct write_point_specifier wp,
+			       unsigned dev,
+			       const struct move_phys_range *ranges, size_t nr,
+			       move_pred_fn pred, void *arg,
+			       struct bch_move_stats *stats)
+{
+	struct moving_context ctxt = { .stats = stats };
+	size_t i;
+	int ret = 0;
+
+	closure_init_stack(&ctxt.cl);
+	INIT_LIST_HEAD(&ctxt.reads);
+	init_waitqueue_head(&ctxt.wait);
+
+	for (i = 0; i < nr && !ret; i++)
+		ret = __bch2_move_data_phys(c, &ctxt, rate, wp, dev,
+					    ranges[i].start, ranges[i].end,
+					    pred, arg, stats);
+
+	move_ctxt_wait_event(&ctxt, list_empty(&ctxt.reads));
+	closure_sync(&ctxt.cl);
+
+	EBUG_ON(atomic_read(&ctxt.write_sectors));
+
+	trace_move_data(c,
+			atomic64_read(&stats->sectors_moved),
+			atomic64_read(&stats->keys_moved));
+
+	return ret;
+}
+
+int bch2_move_data_phys(struct bch_fs *c,
+			struct bch_ratelimit *rate,
+			struct write_point_specifier wp,
+			unsigned dev, u64 start, u64 end,
+			move_pred_fn pred, void *arg,
+			struct bch_move_stats *stats)
+{
+	struct move_phys_range range = { .start = start, .end = end };
+
+	return bch2_move_data_phys_ranges(c, rate, wp, dev, &range, 1,
+					  pred, arg, stats);
+}
+
+struct move_btree_pred_arg {
+	move_pred_fn		pred;
+	void			*arg;
+	struct bch_io_opts	*io_opts;
+};
+
+static enum data_cmd move_btree_node_pred(struct bch_fs *c,
+					  move_pred_fn pred, void *arg,
+					  struct btree *b,
+					  struct bch_io_opts *io_opts)
+{
+	struct data_opts data_opts = { 0 };
+	enum data_cmd cmd = pred(c, arg, bkey_i_to_s_c(&b->key),
+				 io_opts, &data_opts);
+
+	switch (cmd) {
+	case DATA_SKIP:
+	case DATA_ADD_REPLICAS:
+	case DATA_REWRITE:
+		return cmd;
+	default:
+		BUG();
+	}
+}
+
+static bool move_btree_sibling_pred(struct bch_fs *c, struct btree *b,
+				    void *_arg)
+{
+	struct move_btree_pred_arg *arg = _arg;
+
+	return move_btree_node_pred(c, arg->pred, arg->arg, b,
+				    arg->io_opts) != DATA_SKIP;
+}
+
+/*
+ * Rewrites the btree nodes @pred returns true for - @pred sees the node, not
+ * just its key, so it may decide by btree ID and level:
+ */
+int bch2_move_btree_nodes(struct bch_fs *c,
+			  btree_node_rewrite_pred_fn pred,
+			  void *arg,
+			  struct bch_move_stats *stats)
 {
-	struct bch_io_opts io_opts = bch2_opts_to_inode_opts(c->opts);
 	struct btree_trans trans;
 	struct btree_iter *iter;
 	struct btree *b;
 	unsigned id;
-	struct data_opts data_opts;
-	enum data_cmd cmd;
 	int ret = 0;
 
 	bch2_trans_init(&trans, c, 0, 0);
@@ -705,22 +1141,17 @@ static int bch2_move_btree(struct bch_fs *c,
 				    BTREE_ITER_PREFETCH, b) {
 			stats->pos = iter->pos;
 
-			switch ((cmd = pred(c, arg,
-					    bkey_i_to_s_c(&b->key),
-					    &io_opts, &data_opts))) {
-			case DATA_SKIP:
+			if (!pred(c, b, arg))
 				goto next;
-			case DATA_SCRUB:
-				BUG();
-			case DATA_ADD_REPLICAS:
-			case DATA_REWRITE:
-				break;
-			default:
-				BUG();
-			}
 
-			ret = bch2_btree_node_rewrite(c, iter,
-					b->data->keys.seq, 0) ?: ret;
+			/*
+			 * Siblings that also need to be moved are rewritten
+			 * along with this node; we'll see the new nodes as we
+			 * iterate, and they'll be skipped by @pred:
+			 */
+			ret = bch2_btree_node_rewrite_batch(c, iter,
+					b->data->keys.seq, 0,
+					pred, arg) ?: ret;
 next:
 			bch2_trans_cond_resched(&trans);
 		}
@@ -733,6 +1164,22 @@ static int bch2_move_btree(struct bch_fs *c,
 	return ret;
 }
 
+static int bch2_move_btree(struct bch_fs *c,
+			   move_pred_fn pred,
+			   void *arg,
+			   struct bch_move_stats *stats)
+{
+	struct bch_io_opts io_opts = bch2_opts_to_inode_opts(c->opts);
+	struct move_btree_pred_arg sib_arg = {
+		.pred		= pred,
+		.arg		= arg,
+		.io_opts	= &io_opts,
+	};
+
+	return bch2_move_btree_nodes(c, move_btree_sibling_pred,
+				     &sib_arg, stats);
+}
+
 #if 0
 static enum data_cmd scrub_pred(struct bch_fs *c, void *arg,
 				struct bkey_s_c k,
@@ -786,6 +1233,94 @@ static enum data_cmd migrate_pred(struct bch_fs *c, void *arg,
 	return DATA_REWRITE;
 }
 
+/*
+ * Evacuating a device: the device is split into opts.migrate_threads ranges,
+ * each walked by its own thread - so each has its own moving_context and limit
+ * on IO in flight, and its own write point, so that writes go to several
+ * devices at once:
+ */
+struct migrate_worker {
+	struct bch_fs		*c;
+	struct bch_ioctl_data	*op;
+	struct bch_move_stats	*stats;
+	u64			start;
+	u64			end;
+
+	struct task_struct	*thread;
+	struct completion	done;
+	int			ret;
+};
+
+static int migrate_worker_thread(void *arg)
+{
+	struct migrate_worker *w = arg;
+
+	w->ret = bch2_move_data_phys(w->c, NULL,
+				     writepoint_hashed((unsigned long) current),
+				     w->op->migrate.dev, w->start, w->end,
+				     migrate_pred, w->op, w->stats);
+	complete(&w->done);
+	return 0;
+}
+
+static int migrate_data_phys(struct bch_fs *c, struct bch_ioctl_data *op,
+			     struct bch_move_stats *stats)
+{
+	struct bch_dev *ca;
+	unsigned i, nr = c->opts.migrate_threads;
+	u64 sectors = 0;
+	struct migrate_worker *w;
+	int ret = 0;
+
+	rcu_read_lock();
+	ca = rcu_dereference(c->devs[op->migrate.dev]);
+	if (ca)
+		sectors = bucket_to_sector(ca, ca->mi.nbuckets);
+	rcu_read_unlock();
+
+	w = nr > 1 && sectors ? kcalloc(nr, sizeof(*w), GFP_KERNEL) : NULL;
+	if (!w)
+		return bch2_move_data_phys(c, NULL,
+				writepoint_hashed((unsigned long) current),
+				op->migrate.dev, 0, U64_MAX,
+				migrate_pred, op, stats);
+
+	for (i = 0; i < nr; i++) {
+		w[i].c		= c;
+		w[i].op		= op;
+		w[i].stats	= stats;
+		w[i].start	= div_u64(sectors * i, nr);
+		w[i].end	= i + 1 < nr ? div_u64(sectors * (i + 1), nr) : U64_MAX;
+		init_completion(&w[i].done);
+
+		w[i].thread = kthread_create(migrate_worker_thread, &w[i],
+					     "bch-migrate/%s", c->name);
+		if (IS_ERR(w[i].thread)) {
+			ret = PTR_ERR(w[i].thread);
+			w[i].thread = NULL;
+			break;
+		}
+
+		get_task_struct(w[i].thread);
+		wake_up_process(w[i].thread);
+	}
+
+	/* Run until done, or until we're told to stop: */
+	for (i = 0; i < nr && w[i].thread; i++)
+		while (!wait_for_completion_timeout(&w[i].done, HZ / 10) &&
+		       !kthread_should_stop())
+			;
+
+	for (i = 0; i < nr && w[i].thread; i++) {
+		kthread_stop(w[i].thread);
+		put_task_struct(w[i].thread);
+		ret = w[i].ret ?: ret;
+	}
+
+	kfree(w);
+	return ret;
+}
+
 int bch2_data_job(struct bch_fs *c,
 		  struct bch_move_stats *stats,
 		  struct bch_ioctl_data op)
@@ -804,6 +1339,13 @@ int bch2_data_job(struct bch_fs *c,
 
 		ret = bch2_replicas_gc2(c) ?: ret;
 
+		/*
+		 * Rebuild stripes with blocks on failed devices first: that
+		 * restores the durability of the extents in them, so they're
+		 * skipped below instead of being rereplicated one at a time:
+		 */
+		ret = bch2_ec_rebuild(c, stats) ?: ret;
+
 		ret = bch2_move_data(c, NULL,
 				     writepoint_hashed((unsigned long) current),
 				     op.start,
@@ -821,16 +1363,180 @@ int bch2_data_job(struct bch_fs *c,
 		ret = bch2_move_btree(c, migrate_pred, &op, stats) ?: ret;
 		ret = bch2_replicas_gc2(c) ?: ret;
 
-		ret = bch2_move_data(c, NULL,
-				     writepoint_hashed((unsigned long) current),
-				     op.start,
-				     op.end,
-				     migrate_pred, &op, stats) ?: ret;
+		/*
+		 * Migrating everything off a device: only the extents with
+		 * pointers to it need to be looked at:
+		 */
+		if (bch2_fs_has_backpointers(c) &&
+		    !bkey_cmp(op.start, POS_MIN) &&
+		    !bkey_cmp(op.end, POS_MAX))
+			ret = bch2_btree_write_buffer_flush(c) ?:
+				migrate_data_phys(c, &op, stats) ?: ret;
+		else
+			ret = bch2_move_data(c, NULL,
+					writepoint_hashed((unsigned long) current),
+					op.start,
+					op.end,
+					migrate_pred, &op, stats) ?: ret;
 		ret = bch2_replicas_gc2(c) ?: ret;
 		break;
+	case BCH_DATA_OP_CHECK_MARKS:
+		ret = bch2_gc_check_marks(c, op.start, op.end, stats);
+		break;
+	case BCH_DATA_OP_FSCK:
+		ret = bch2_fsck_online(c, op.start, op.end, stats);
+		break;
 	default:
 		ret = -EINVAL;
 	}
 
 	return ret;
 }
+
+/*
+ * Defragmentation: runs of logically adjacent extents, all smaller than
+ * @extent_sectors and not all physically contiguous, are rewritten in order
+ * through a single write point - so that they end up contiguous on disk, and
+ * are merged into larger extents as btree nodes are compacted:
+ */
+
+static bool bkey_first_dirty_ptr(struct bkey_s_c k,
+				 struct extent_ptr_decoded *ret)
+{
+	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(k);
+	const union bch_extent_entry *entry;
+	struct extent_ptr_decoded p;
+
+	bkey_for_each_ptr_decode(k.k, ptrs, p, entry)
+		if (!p.ptr.cached) {
+			*ret = p;
+			return true;
+		}
+
+	return false;
+}
+
+static bool defrag_extents_contiguous(struct bkey_s_c l, struct bkey_s_c r)
+{
+	struct extent_ptr_decoded lp, rp;
+
+	if (!bkey_first_dirty_ptr(l, &lp) ||
+	    !bkey_first_dirty_ptr(r, &rp) ||
+	    lp.ptr.dev != rp.ptr.dev)
+		return false;
+
+	return (crc_is_compressed(lp.crc)
+		? lp.ptr.offset + lp.crc.compressed_size
+		: lp.ptr.offset + lp.crc.offset + lp.crc.live_size) ==
+	       (crc_is_compressed(rp.crc)
+		? rp.ptr.offset
+		: rp.ptr.offset + rp.crc.offset);
+}
+
+static enum data_cmd defrag_pred(struct bch_fs *c, void *arg,
+				 struct bkey_s_c k,
+				 struct bch_io_opts *io_opts,
+				 struct data_opts *data_opts)
+{
+	unsigned *extent_sectors = arg;
+	struct extent_ptr_decoded p;
+
+	if (k.k->type != KEY_TYPE_extent ||
+	    k.k->size >= *extent_sectors ||
+	    !bkey_first_dirty_ptr(k, &p))
+		return DATA_SKIP;
+
+	data_opts->target		= io_opts->foreground_target;
+	data_opts->nr_replicas		= 1;
+	data_opts->btree_insert_flags	= 0;
+	data_opts->rewrite_dev		= p.ptr.dev;
+	return DATA_REWRITE;
+}
+
+int bch2_defrag(struct bch_fs *c, struct bpos start, struct bpos end,
+		unsigned extent_sectors, struct bch_move_stats *stats)
+{
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	struct bkey_buf prev;
+	struct bpos run_start = POS_MIN, run_end = POS_MIN;
+	bool kthread = (current->flags & PF_KTHREAD) != 0;
+	bool discontiguous = false;
+	unsigned nr = 0;
+	int ret = 0;
+
+	if (!extent_sectors)
+		return -EINVAL;
+
+	bch2_bkey_buf_init(&prev);
+	bch2_trans_init(&trans, c, 0, 0);
+
+	iter = bch2_trans_get_iter(&trans, BTREE_ID_EXTENTS, start,
+				   BTREE_ITER_PREFETCH);
+
+	while (1) {
+		bool small;
+
+		k = bch2_btree_iter_peek(iter);
+		ret = bkey_err(k);
+		if (ret)
+			break;
+
+		if (k.k && bkey_cmp(bkey_start_pos(k.k), end) >= 0)
+			k.k = NULL;
+
+		small = k.k &&
+			k.k->type == KEY_TYPE_extent &&
+			k.k->size < extent_sectors;
+
+		if (nr && (!small || bkey_cmp(bkey_start_pos(k.k), run_end))) {
+			bool move = nr > 1 && discontiguous;
+
+			nr = 0;
+			discontiguous = false;
+
+			if (move) {
+				bch2_trans_unlock(&trans);
+
+				ret = bch2_move_data(c, NULL,
+					writepoint_hashed((unsigned long) current),
+					run_start, run_end,
+					defrag_pred, &extent_sectors, stats);
+				if (ret)
+					break;
+
+				/* @k is no longer valid: */
+				continue;
+			}
+		}
+
+		if (!k.k)
+			break;
+
+		if (small) {
+			if (!nr)
+				run_start = bkey_start_pos(k.k);
+			else if (!defrag_extents_contiguous(bkey_i_to_s_c(prev.k), k))
+				discontiguous = true;
+
+			nr++;
+			run_end = k.k->p;
+			bch2_bkey_buf_reassemble(&prev, c, k);
+		}
+
+		bch2_btree_iter_next(iter);
+		bch2_trans_cond_resched(&trans);
+
+		if (kthread ? kthread_should_stop() : fatal_signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+	}
+
+	bch2_trans_iter_put(&trans, iter);
+	ret = bch2_trans_exit(&trans) ?: ret;
+	bch2_bkey_buf_exit(&prev, c);
+
+	return ret;
+}
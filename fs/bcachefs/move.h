@@ -3,6 +3,7 @@
 #define _BCACHEFS_MOVE_H
 
 #include "btree_iter.h"
+#include "btree_update.h"
 #include "buckets.h"
 #include "io_types.h"
 #include "move_types.h"
@@ -23,6 +24,8 @@ struct data_opts {
 	u8		rewrite_dev;
 	u8		nr_replicas;
 	int		btree_insert_flags;
+	/* write the new copy to an erasure coded stripe: */
+	bool		erasure_code;
 };
 
 struct migrate_write {
@@ -58,8 +61,36 @@ int bch2_move_data(struct bch_fs *, struct bch_ratelimit *,
 		   move_pred_fn, void *,
 		   struct bch_move_stats *);
 
+/* A range of sectors on a device, for bch2_move_data_phys_ranges(): */
+struct move_phys_range {
+	u64			start;
+	u64			end;
+};
+
+int bch2_move_data_phys_ranges(struct bch_fs *, struct bch_ratelimit *,
+			       struct write_point_specifier, unsigned,
+			       const struct move_phys_range *, size_t,
+			       move_pred_fn, void *,
+			       struct bch_move_stats *);
+int bch2_move_data_phys(struct bch_fs *, struct bch_ratelimit *,
+			struct write_point_specifier,
+			unsigned, u64, u64,
+			move_pred_fn, void *,
+			struct bch_move_stats *);
+int bch2_move_btree_nodes(struct bch_fs *, btree_node_rewrite_pred_fn, void *,
+			  struct bch_move_stats *);
+
+int bch2_move_blkcg_set_current(struct bch_fs *, bool);
+void bch2_move_blkcg_to_text(struct printbuf *, struct bch_fs *);
+
 int bch2_data_job(struct bch_fs *,
 		  struct bch_move_stats *,
 		  struct bch_ioctl_data);
 
+int bch2_defrag(struct bch_fs *, struct bpos, struct bpos, unsigned,
+		struct bch_move_stats *);
+
+void bch2_fs_move_exit(struct bch_fs *);
+void bch2_fs_move_init(struct bch_fs *);
+
 #endif /* _BCACHEFS_MOVE_H */
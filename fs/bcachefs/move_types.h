@@ -12,6 +12,10 @@ struct bch_move_stats {
 	atomic64_t		sectors_moved;
 	atomic64_t		sectors_seen;
 	atomic64_t		sectors_raced;
+	atomic64_t		keys_inconsistent;
+
+	atomic_t		reads_in_flight;
+	atomic_t		writes_in_flight;
 };
 
 #endif /* _BCACHEFS_MOVE_TYPES_H */
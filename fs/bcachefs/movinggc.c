@@ -7,11 +7,14 @@
 
 #include "bcachefs.h"
 #include "alloc_foreground.h"
+#include "backpointers.h"
 #include "btree_iter.h"
 #include "btree_update.h"
+#include "btree_write_buffer.h"
 #include "buckets.h"
 #include "clock.h"
 #include "disk_groups.h"
+#include "ec.h"
 #include "error.h"
 #include "extents.h"
 #include "eytzinger.h"
@@ -44,6 +47,12 @@
 #define COPYGC_BUCKETS_PER_ITER(ca)					\
 	((ca)->free[RESERVE_MOVINGGC].size / 2)
 
+/*
+ * Bounds the number of sparse stripes (see bch2_ec_sparse_stripes()) whose
+ * blocks we evacuate in one iteration:
+ */
+#define COPYGC_STRIPES_PER_ITER		64
+
 static int bucket_offset_cmp(const void *_l, const void *_r, size_t size)
 {
 	const struct copygc_heap_entry *l = _l;
@@ -53,26 +62,34 @@ static int bucket_offset_cmp(const void *_l, const void *_r, size_t size)
 		cmp_int(l->offset, r->offset);
 }
 
+/*
+ * @arg is the device copygc is running on: only pointers to that device are
+ * considered, since other devices' buckets are evacuated by their own threads.
+ */
 static enum data_cmd copygc_pred(struct bch_fs *c, void *arg,
 				 struct bkey_s_c k,
 				 struct bch_io_opts *io_opts,
 				 struct data_opts *data_opts)
 {
-	copygc_heap *h = &c->copygc_heap;
+	struct bch_dev *ca = arg;
+	copygc_heap *h = &ca->copygc_heap;
 	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(k);
 	const union bch_extent_entry *entry;
 	struct extent_ptr_decoded p = { 0 };
 
 	bkey_for_each_ptr_decode(k.k, ptrs, p, entry) {
-		struct bch_dev *ca = bch_dev_bkey_exists(c, p.ptr.dev);
 		struct copygc_heap_entry search = {
 			.dev	= p.ptr.dev,
 			.offset	= p.ptr.offset,
 		};
+		ssize_t i;
+
+		if (p.ptr.dev != ca->dev_idx)
+			continue;
 
-		ssize_t i = eytzinger0_find_le(h->data, h->used,
-					       sizeof(h->data[0]),
-					       bucket_offset_cmp, &search);
+		i = eytzinger0_find_le(h->data, h->used,
+				       sizeof(h->data[0]),
+				       bucket_offset_cmp, &search);
 #if 0
 		/* eytzinger search verify code: */
 		ssize_t j = -1, k;
@@ -121,65 +138,183 @@ static inline int fragmentation_cmp(copygc_heap *heap,
 	return cmp_int(l.fragmentation, r.fragmentation);
 }
 
-static int bch2_copygc(struct bch_fs *c)
+/*
+ * Stripe compaction: evacuate our blocks of stripes that are mostly empty, so
+ * that the stripe can be deleted. These go in with zero fragmentation, ahead of
+ * everything else - freeing a stripe frees every bucket in it.
+ *
+ * This is best effort: on error we just don't compact this time.
+ */
+static void copygc_add_sparse_stripes(struct bch_dev *ca)
 {
-	copygc_heap *h = &c->copygc_heap;
+	struct bch_fs *c = ca->fs;
+	copygc_heap *h = &ca->copygc_heap;
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	struct bch_extent_ptr ptrs[COPYGC_STRIPES_PER_ITER];
+	u32 *idx;
+	size_t i, nr_idx, nr_ptrs = 0;
+	unsigned j;
+
+	idx = kmalloc_array(COPYGC_STRIPES_PER_ITER, sizeof(*idx), GFP_KERNEL);
+	if (!idx)
+		return;
+
+	nr_idx = bch2_ec_sparse_stripes(c, ca->dev_idx, idx,
+					COPYGC_STRIPES_PER_ITER);
+	if (!nr_idx)
+		goto out;
+
+	bch2_trans_init(&trans, c, 0, 0);
+	iter = bch2_trans_get_iter(&trans, BTREE_ID_EC, POS_MIN,
+				   BTREE_ITER_SLOTS);
+
+	for (i = 0; i < nr_idx && nr_ptrs < ARRAY_SIZE(ptrs); i++) {
+		const struct bch_stripe *s;
+
+		bch2_btree_iter_set_pos(iter, POS(0, idx[i]));
+		k = bch2_btree_iter_peek_slot(iter);
+		if (bkey_err(k))
+			break;
+
+		if (k.k->type != KEY_TYPE_stripe)
+			continue;
+
+		s = bkey_s_c_to_stripe(k).v;
+
+		for (j = 0;
+		     j < s->nr_blocks - s->nr_redundant &&
+		     nr_ptrs < ARRAY_SIZE(ptrs);
+		     j++)
+			if (s->ptrs[j].dev == ca->dev_idx)
+				ptrs[nr_ptrs++] = s->ptrs[j];
+	}
+	bch2_trans_exit(&trans);
+out:
+	kfree(idx);
+
+	down_read(&ca->bucket_lock);
+	for (i = 0; i < nr_ptrs; i++) {
+		struct bucket *g = PTR_BUCKET(ca, &ptrs[i], 0);
+		struct bucket_mark m = READ_ONCE(g->mark);
+		struct copygc_heap_entry e;
+
+		if (m.gen != ptrs[i].gen ||
+		    m.owned_by_allocator ||
+		    m.data_type != BCH_DATA_user ||
+		    !bucket_sectors_used(m))
+			continue;
+
+		e = (struct copygc_heap_entry) {
+			.dev		= ca->dev_idx,
+			.gen		= m.gen,
+			.replicas	= 1 + g->stripe_redundancy,
+			.fragmentation	= 0,
+			.sectors	= bucket_sectors_used(m),
+			.offset		= bucket_to_sector(ca,
+						PTR_BUCKET_NR(ca, &ptrs[i])),
+		};
+		heap_add_or_replace(h, e, -fragmentation_cmp, NULL);
+	}
+	up_read(&ca->bucket_lock);
+}
+
+/*
+ * Buckets of sparse stripes that are also in a fragmentation bin get added
+ * twice: keep one entry for each, at the lower fragmentation:
+ */
+static void copygc_heap_dedup(copygc_heap *h)
+{
+	struct copygc_heap_entry *i, *dst = h->data;
+
+	sort_cmp_size(h->data, h->used, sizeof(h->data[0]),
+		      bucket_offset_cmp, NULL);
+
+	for (i = h->data; i < h->data + h->used; i++) {
+		if (dst != h->data &&
+		    !bucket_offset_cmp(dst - 1, i, sizeof(*i))) {
+			dst[-1].fragmentation = min(dst[-1].fragmentation,
+						    i->fragmentation);
+			continue;
+		}
+
+		*dst++ = *i;
+	}
+
+	h->used = dst - h->data;
+	heap_resort(h, -fragmentation_cmp, NULL);
+}
+
+static int bch2_copygc(struct bch_dev *ca)
+{
+	struct bch_fs *c = ca->fs;
+	copygc_heap *h = &ca->copygc_heap;
 	struct copygc_heap_entry e, *i;
 	struct bucket_array *buckets;
 	struct bch_move_stats move_stats;
 	u64 sectors_to_move = 0, sectors_not_moved = 0;
-	u64 sectors_reserved = 0;
+	u64 sectors_reserved = 0, dev_sectors = 0;
 	u64 buckets_to_move, buckets_not_moved = 0;
-	struct bch_dev *ca;
-	unsigned dev_idx;
-	size_t b, heap_size = 0;
+	size_t b, dev_buckets = 0, heap_size = ca->mi.nbuckets >> 7;
+	unsigned bin;
 	int ret;
 
 	memset(&move_stats, 0, sizeof(move_stats));
 	/*
 	 * Find buckets with lowest sector counts, skipping completely
-	 * empty buckets, by building a maxheap sorted by sector count,
-	 * and repeatedly replacing the maximum element until all
-	 * buckets have been visited.
+	 * empty buckets, by building a maxheap sorted by sector count from
+	 * the emptiest buckets in the device's bucket index, and
+	 * repeatedly replacing the maximum element.
 	 */
 	h->used = 0;
 
-	for_each_rw_member(ca, c, dev_idx)
-		heap_size += ca->mi.nbuckets >> 7;
-
 	if (h->size < heap_size) {
-		free_heap(&c->copygc_heap);
-		if (!init_heap(&c->copygc_heap, heap_size, GFP_KERNEL)) {
-			bch_err(c, "error allocating copygc heap");
+		free_heap(h);
+		if (!init_heap(h, heap_size, GFP_KERNEL)) {
+			bch_err(ca, "error allocating copygc heap");
 			return 0;
 		}
 	}
 
-	for_each_rw_member(ca, c, dev_idx) {
-		closure_wait_event(&c->freelist_wait, have_copygc_reserve(ca));
+	closure_wait_event(&c->freelist_wait, have_copygc_reserve(ca));
+
+	spin_lock(&ca->fs->freelist_lock);
+	sectors_reserved = fifo_used(&ca->free[RESERVE_MOVINGGC]) * ca->mi.bucket_size;
+	spin_unlock(&ca->fs->freelist_lock);
 
-		spin_lock(&ca->fs->freelist_lock);
-		sectors_reserved += fifo_used(&ca->free[RESERVE_MOVINGGC]) * ca->mi.bucket_size;
-		spin_unlock(&ca->fs->freelist_lock);
+	copygc_add_sparse_stripes(ca);
 
-		down_read(&ca->bucket_lock);
-		buckets = bucket_array(ca);
+	down_read(&ca->bucket_lock);
+	buckets = bucket_array(ca);
 
-		for (b = buckets->first_bucket; b < buckets->nbuckets; b++) {
-			struct bucket *g = buckets->b + b;
+	/*
+	 * Walk the bucket index from the emptiest bin up, stopping
+	 * after the bin where we have more than we can move in one
+	 * pass - the heap sorts out the order within a bin:
+	 */
+	for (bin = 0;
+	     bin < BUCKET_FRAG_BINS &&
+	     dev_sectors < sectors_reserved &&
+	     dev_buckets < heap_size;
+	     bin++)
+		for_each_set_bit(b, ca->buckets_frag[bin], buckets->nbuckets) {
+			struct bucket *g = bucket_array_entry(buckets, b);
 			struct bucket_mark m = READ_ONCE(g->mark);
-			struct copygc_heap_entry e;
+			int actual_bin = bucket_frag_bin(ca, m);
 
-			if (m.owned_by_allocator ||
-			    m.data_type != BCH_DATA_user ||
-			    !bucket_sectors_used(m) ||
-			    bucket_sectors_used(m) >= ca->mi.bucket_size)
+			if (actual_bin != bin) {
+				/* lost a race with bucket marking: */
+				clear_bit(b, ca->buckets_frag[bin]);
+				if (actual_bin >= 0)
+					set_bit(b, ca->buckets_frag[actual_bin]);
 				continue;
+			}
 
 			WARN_ON(m.stripe && !g->stripe_redundancy);
 
 			e = (struct copygc_heap_entry) {
-				.dev		= dev_idx,
+				.dev		= ca->dev_idx,
 				.gen		= m.gen,
 				.replicas	= 1 + g->stripe_redundancy,
 				.fragmentation	= bucket_sectors_used(m) * (1U << 15)
@@ -188,12 +323,17 @@ static int bch2_copygc(struct bch_fs *c)
 				.offset		= bucket_to_sector(ca, b),
 			};
 			heap_add_or_replace(h, e, -fragmentation_cmp, NULL);
+
+			dev_sectors += e.sectors * e.replicas;
+			dev_buckets++;
 		}
-		up_read(&ca->bucket_lock);
-	}
+	up_read(&ca->bucket_lock);
+
+	copygc_heap_dedup(h);
 
 	if (!sectors_reserved) {
-		bch2_fs_fatal_error(c, "stuck, ran out of copygc reserve!");
+		bch2_fs_fatal_error(c, "%s: stuck, ran out of copygc reserve!",
+				    ca->name);
 		return -1;
 	}
 
@@ -219,37 +359,75 @@ static int bch2_copygc(struct bch_fs *c)
 			sizeof(h->data[0]),
 			bucket_offset_cmp, NULL);
 
-	ret = bch2_move_data(c, &c->copygc_pd.rate,
-			     writepoint_ptr(&c->copygc_write_point),
-			     POS_MIN, POS_MAX,
-			     copygc_pred, NULL,
-			     &move_stats);
-
-	for_each_rw_member(ca, c, dev_idx) {
-		down_read(&ca->bucket_lock);
-		buckets = bucket_array(ca);
-		for (i = h->data; i < h->data + h->used; i++) {
-			struct bucket_mark m;
-			size_t b;
-
-			if (i->dev != dev_idx)
-				continue;
+	if (bch2_fs_has_backpointers(c)) {
+		/*
+		 * Walk just the victim buckets, via backpointers, instead of
+		 * every extent in the filesystem:
+		 */
+		struct move_phys_range *ranges;
+		size_t nr_ranges = 0;
+		ssize_t j;
+
+		bch2_ratelimit_reset(&ca->copygc_pd.rate);
+
+		ret = bch2_btree_write_buffer_flush(c);
+		if (ret)
+			goto walk_done;
+
+		ranges = kvmalloc_array(h->used, sizeof(*ranges), GFP_KERNEL);
+		if (!ranges) {
+			bch_err(ca, "error allocating copygc ranges");
+			ret = -ENOMEM;
+			goto walk_done;
+		}
 
-			b = sector_to_bucket(ca, i->offset);
-			m = READ_ONCE(buckets->b[b].mark);
+		/* In bucket order, merging adjacent buckets: */
+		eytzinger0_for_each(j, h->used) {
+			u64 start = h->data[j].offset;
+
+			if (nr_ranges &&
+			    ranges[nr_ranges - 1].end == start)
+				ranges[nr_ranges - 1].end += ca->mi.bucket_size;
+			else
+				ranges[nr_ranges++] = (struct move_phys_range) {
+					.start	= start,
+					.end	= start + ca->mi.bucket_size,
+				};
+		}
 
-			if (i->gen == m.gen &&
-			    bucket_sectors_used(m)) {
-				sectors_not_moved += bucket_sectors_used(m);
-				buckets_not_moved++;
-			}
+		ret = bch2_move_data_phys_ranges(c, &ca->copygc_pd.rate,
+					writepoint_ptr(&c->copygc_write_point),
+					ca->dev_idx, ranges, nr_ranges,
+					copygc_pred, ca, &move_stats);
+		kvfree(ranges);
+	} else {
+		ret = bch2_move_data(c, &ca->copygc_pd.rate,
+				     writepoint_ptr(&c->copygc_write_point),
+				     POS_MIN, POS_MAX,
+				     copygc_pred, ca,
+				     &move_stats);
+	}
+walk_done:
+	down_read(&ca->bucket_lock);
+	buckets = bucket_array(ca);
+	for (i = h->data; i < h->data + h->used; i++) {
+		struct bucket_mark m;
+
+		b = sector_to_bucket(ca, i->offset);
+		m = READ_ONCE(bucket_array_entry(buckets, b)->mark);
+
+		if (i->gen == m.gen &&
+		    bucket_sectors_used(m)) {
+			sectors_not_moved += bucket_sectors_used(m);
+			buckets_not_moved++;
 		}
-		up_read(&ca->bucket_lock);
 	}
+	up_read(&ca->bucket_lock);
 
 	if (sectors_not_moved && !ret)
 		bch_warn_ratelimited(c,
-			"copygc finished but %llu/%llu sectors, %llu/%llu buckets not moved (move stats: moved %llu sectors, raced %llu keys, %llu sectors)",
+			"%s: copygc finished but %llu/%llu sectors, %llu/%llu buckets not moved (move stats: moved %llu sectors, raced %llu keys, %llu sectors)",
+			 ca->name,
 			 sectors_not_moved, sectors_to_move,
 			 buckets_not_moved, buckets_to_move,
 			 atomic64_read(&move_stats.sectors_moved),
@@ -276,29 +454,46 @@ static int bch2_copygc(struct bch_fs *c)
  * often and continually reduce the amount of fragmented space as the device
  * fills up. So, we increase the threshold by half the current free space.
  */
-unsigned long bch2_copygc_wait_amount(struct bch_fs *c)
+unsigned long bch2_copygc_wait_amount(struct bch_dev *ca)
 {
-	struct bch_dev *ca;
-	unsigned dev_idx;
-	u64 fragmented_allowed = c->copygc_threshold;
-	u64 fragmented = 0;
+	struct bch_dev_usage usage = bch2_dev_usage_read(ca);
+	u64 fragmented_allowed = ca->copygc_threshold +
+		((__dev_buckets_available(ca, usage) * ca->mi.bucket_size) >> 1);
 
-	for_each_rw_member(ca, c, dev_idx) {
-		struct bch_dev_usage usage = bch2_dev_usage_read(ca);
+	return max_t(s64, 0, fragmented_allowed -
+		     usage.d[BCH_DATA_user].fragmented);
+}
 
-		fragmented_allowed += ((__dev_buckets_available(ca, usage) *
-					ca->mi.bucket_size) >> 1);
-		fragmented += usage.d[BCH_DATA_user].fragmented;
-	}
+/*
+ * Each device has its own copygc thread, but only opts.copygc_threads of them
+ * may be moving data at once:
+ */
+static bool copygc_running_get(struct bch_fs *c)
+{
+	int v = atomic_read(&c->copygc_running);
 
-	return max_t(s64, 0, fragmented_allowed - fragmented);
+	do {
+		if (v >= c->opts.copygc_threads)
+			return false;
+	} while (!atomic_try_cmpxchg(&c->copygc_running, &v, v + 1));
+
+	return true;
+}
+
+static void copygc_running_put(struct bch_fs *c)
+{
+	atomic_dec(&c->copygc_running);
+	wake_up(&c->copygc_running_wait);
 }
 
 static int bch2_copygc_thread(void *arg)
 {
-	struct bch_fs *c = arg;
+	struct bch_dev *ca = arg;
+	struct bch_fs *c = ca->fs;
 	struct io_clock *clock = &c->io_clock[WRITE];
 	u64 last, wait;
+	bool running;
+	int ret;
 
 	set_freezable();
 
@@ -307,7 +502,7 @@ static int bch2_copygc_thread(void *arg)
 			break;
 
 		last = atomic64_read(&clock->now);
-		wait = bch2_copygc_wait_amount(c);
+		wait = bch2_copygc_wait_amount(ca);
 
 		if (wait > clock->max_slop) {
 			bch2_kthread_io_clock_wait(clock, last + wait,
@@ -315,30 +510,41 @@ static int bch2_copygc_thread(void *arg)
 			continue;
 		}
 
-		if (bch2_copygc(c))
+		running = false;
+		wait_event_freezable(c->copygc_running_wait,
+				     (running = copygc_running_get(c)) ||
+				     kthread_should_stop());
+		if (!running)
+			break;
+
+		ret = bch2_copygc(ca);
+		copygc_running_put(c);
+
+		if (ret)
 			break;
 	}
 
 	return 0;
 }
 
-void bch2_copygc_stop(struct bch_fs *c)
+void bch2_dev_copygc_stop(struct bch_dev *ca)
 {
-	c->copygc_pd.rate.rate = UINT_MAX;
-	bch2_ratelimit_reset(&c->copygc_pd.rate);
+	ca->copygc_pd.rate.rate = UINT_MAX;
+	bch2_ratelimit_reset(&ca->copygc_pd.rate);
 
-	if (c->copygc_thread) {
-		kthread_stop(c->copygc_thread);
-		put_task_struct(c->copygc_thread);
+	if (ca->copygc_thread) {
+		kthread_stop(ca->copygc_thread);
+		put_task_struct(ca->copygc_thread);
 	}
-	c->copygc_thread = NULL;
+	ca->copygc_thread = NULL;
 }
 
-int bch2_copygc_start(struct bch_fs *c)
+int bch2_dev_copygc_start(struct bch_dev *ca)
 {
+	struct bch_fs *c = ca->fs;
 	struct task_struct *t;
 
-	if (c->copygc_thread)
+	if (ca->copygc_thread)
 		return 0;
 
 	if (c->opts.nochanges)
@@ -347,20 +553,64 @@ int bch2_copygc_start(struct bch_fs *c)
 	if (bch2_fs_init_fault("copygc_start"))
 		return -ENOMEM;
 
-	t = kthread_create(bch2_copygc_thread, c, "bch-copygc/%s", c->name);
+	t = kthread_create(bch2_copygc_thread, ca, "bch-copygc/%s", ca->name);
 	if (IS_ERR(t))
 		return PTR_ERR(t);
 
 	get_task_struct(t);
 
-	c->copygc_thread = t;
-	wake_up_process(c->copygc_thread);
+	ca->copygc_thread = t;
+	wake_up_process(ca->copygc_thread);
 
 	return 0;
 }
 
+void bch2_copygc_stop(struct bch_fs *c)
+{
+	struct bch_dev *ca;
+	unsigned i;
+
+	for_each_member_device(ca, c, i)
+		bch2_dev_copygc_stop(ca);
+}
+
+int bch2_copygc_start(struct bch_fs *c)
+{
+	struct bch_dev *ca;
+	unsigned i;
+	int ret;
+
+	for_each_rw_member(ca, c, i) {
+		ret = bch2_dev_copygc_start(ca);
+		if (ret) {
+			percpu_ref_put(&ca->io_ref);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+void bch2_copygc_wakeup(struct bch_fs *c)
+{
+	struct bch_dev *ca;
+	unsigned i;
+
+	rcu_read_lock();
+	for_each_member_device_rcu(ca, c, i, NULL)
+		if (ca->copygc_thread)
+			wake_up_process(ca->copygc_thread);
+	rcu_read_unlock();
+}
+
+void bch2_dev_copygc_init(struct bch_dev *ca)
+{
+	bch2_pd_controller_init(&ca->copygc_pd);
+	ca->copygc_pd.d_term = 0;
+}
+
 void bch2_fs_copygc_init(struct bch_fs *c)
 {
-	bch2_pd_controller_init(&c->copygc_pd);
-	c->copygc_pd.d_term = 0;
+	atomic_set(&c->copygc_running, 0);
+	init_waitqueue_head(&c->copygc_running_wait);
 }
@@ -2,8 +2,12 @@
 #ifndef _BCACHEFS_MOVINGGC_H
 #define _BCACHEFS_MOVINGGC_H
 
+void bch2_dev_copygc_stop(struct bch_dev *);
+int bch2_dev_copygc_start(struct bch_dev *);
 void bch2_copygc_stop(struct bch_fs *);
 int bch2_copygc_start(struct bch_fs *);
+void bch2_copygc_wakeup(struct bch_fs *);
+void bch2_dev_copygc_init(struct bch_dev *);
 void bch2_fs_copygc_init(struct bch_fs *);
 
 #endif /* _BCACHEFS_MOVINGGC_H */
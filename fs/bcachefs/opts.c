@@ -27,6 +27,7 @@ const char * const bch2_csum_opts[] = {
 	"none",
 	"crc32c",
 	"crc64",
+	"xxhash",
 	NULL
 };
 
@@ -41,6 +42,7 @@ const char * const bch2_str_hash_types[] = {
 	"crc32c",
 	"crc64",
 	"siphash",
+	"xxhash",
 	NULL
 };
 
@@ -301,10 +303,29 @@ int bch2_opt_check_may_set(struct bch_fs *c, int id, u64 v)
 	case Opt_background_compression:
 		ret = bch2_check_set_has_compressed_data(c, v);
 		break;
+	case Opt_metadata_compression:
+		ret = bch2_check_set_has_compressed_data(c, v);
+		if (!ret && v)
+			bch2_check_set_feature(c, BCH_FEATURE_btree_node_compression);
+		break;
+	case Opt_journal_compression:
+		ret = bch2_check_set_has_compressed_data(c, v);
+		if (!ret && v)
+			bch2_check_set_feature(c, BCH_FEATURE_journal_compression);
+		break;
 	case Opt_erasure_code:
 		if (v)
 			bch2_check_set_feature(c, BCH_FEATURE_ec);
 		break;
+	case Opt_data_checksum:
+	case Opt_metadata_checksum:
+		if (v == BCH_CSUM_OPT_XXHASH)
+			bch2_check_set_feature(c, BCH_FEATURE_xxhash);
+		break;
+	case Opt_str_hash:
+		if (v == BCH_STR_HASH_OPT_XXHASH)
+			bch2_check_set_feature(c, BCH_FEATURE_xxhash);
+		break;
 	}
 
 	return ret;
@@ -98,7 +98,7 @@ enum opt_type {
 	  "#",		"Number of metadata replicas")			\
 	x(data_replicas,		u8,				\
 	  OPT_FORMAT|OPT_MOUNT|OPT_RUNTIME|OPT_INODE,			\
-	  OPT_UINT(1, BCH_REPLICAS_MAX),				\
+	  OPT_UINT(1, BCH_REPLICAS_MAX + 1),				\
 	  BCH_SB_DATA_REPLICAS_WANT,	1,				\
 	  "#",		"Number of data replicas")			\
 	x(metadata_replicas_required, u8,				\
@@ -121,6 +121,13 @@ enum opt_type {
 	  OPT_STR(bch2_csum_opts),					\
 	  BCH_SB_DATA_CSUM_TYPE,	BCH_CSUM_OPT_CRC32C,		\
 	  NULL,		NULL)						\
+	x(checksum_granularity,		u32,				\
+	  OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_SECTORS(0, 1U << 20),					\
+	  NO_SB_OPT,			0,				\
+	  "size",	"Uncompressed data is checksummed in chunks of at\n"\
+			"most this size, so small reads only read and verify\n"\
+			"the chunks they touch; 0 = encoded_extent_max")	\
 	x(compression,			u8,				\
 	  OPT_FORMAT|OPT_MOUNT|OPT_RUNTIME|OPT_INODE,			\
 	  OPT_STR(bch2_compression_opts),				\
@@ -131,6 +138,27 @@ enum opt_type {
 	  OPT_STR(bch2_compression_opts),				\
 	  BCH_SB_BACKGROUND_COMPRESSION_TYPE,BCH_COMPRESSION_OPT_none,	\
 	  NULL,		NULL)						\
+	x(metadata_compression,		u8,				\
+	  OPT_FORMAT|OPT_MOUNT|OPT_RUNTIME,				\
+	  OPT_STR(bch2_compression_opts),				\
+	  BCH_SB_METADATA_COMPRESSION_TYPE,BCH_COMPRESSION_OPT_none,	\
+	  NULL,		"Compression type for btree nodes")		\
+	x(journal_compression,		u8,				\
+	  OPT_FORMAT|OPT_MOUNT|OPT_RUNTIME,				\
+	  OPT_STR(bch2_compression_opts),				\
+	  BCH_SB_JOURNAL_COMPRESSION_TYPE,BCH_COMPRESSION_OPT_none,	\
+	  NULL,		"Compression type for journal entries")	\
+	x(compression_level,		u8,				\
+	  OPT_MOUNT,							\
+	  OPT_UINT(0, 22),						\
+	  NO_SB_OPT,			0,				\
+	  NULL,		"Compression level for foreground writes, 0 for the default;\n"\
+			"for lz4, a nonzero level selects lz4hc")	\
+	x(background_compression_level,	u8,				\
+	  OPT_MOUNT,							\
+	  OPT_UINT(0, 22),						\
+	  NO_SB_OPT,			0,				\
+	  NULL,		"Compression level for background_compression")	\
 	x(str_hash,			u8,				\
 	  OPT_FORMAT|OPT_MOUNT|OPT_RUNTIME,				\
 	  OPT_STR(bch2_str_hash_types),					\
@@ -141,6 +169,17 @@ enum opt_type {
 	  OPT_FN(bch2_opt_target),					\
 	  BCH_SB_METADATA_TARGET,	0,				\
 	  "(target)",	"Device or disk group for metadata writes")	\
+	x(btree_leaf_target,		u16,				\
+	  OPT_FORMAT|OPT_MOUNT|OPT_RUNTIME,				\
+	  OPT_FN(bch2_opt_target),					\
+	  BCH_SB_BTREE_LEAF_TARGET,	0,				\
+	  "(target)",	"Device or disk group for leaf nodes of the extents\n"\
+			"and reflink btrees, instead of metadata_target")\
+	x(journal_target,		u16,				\
+	  OPT_FORMAT|OPT_MOUNT|OPT_RUNTIME,				\
+	  OPT_FN(bch2_opt_target),					\
+	  BCH_SB_JOURNAL_TARGET,	0,				\
+	  "(target)",	"Device or disk group for journal writes")	\
 	x(foreground_target,		u16,				\
 	  OPT_FORMAT|OPT_MOUNT|OPT_RUNTIME|OPT_INODE,			\
 	  OPT_FN(bch2_opt_target),					\
@@ -156,6 +195,52 @@ enum opt_type {
 	  OPT_FN(bch2_opt_target),					\
 	  BCH_SB_PROMOTE_TARGET,	0,				\
 	  "(target)",	"Device or disk group to promote data to on read")\
+	x(promote_min_accesses,		u8,				\
+	  OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(1, 15),						\
+	  NO_SB_OPT,			1,				\
+	  NULL,		"Only promote extents read at least this many\n"\
+			"times recently")				\
+	x(promote_window,		u32,				\
+	  OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_SECTORS(0, 1U << 20),					\
+	  NO_SB_OPT,			0,				\
+	  "size",	"Promote only the aligned window of this size\n"\
+			"around the data read, instead of the whole\n"\
+			"extent; 0 = whole extents")			\
+	x(writeback_max_io,		u32,				\
+	  OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_SECTORS(8, 1U << 15),					\
+	  NO_SB_OPT,			2048,				\
+	  "size",	"Maximum size of bios built by writeback")	\
+	x(writeback_io_align,		u32,				\
+	  OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_SECTORS(0, 1U << 20),					\
+	  NO_SB_OPT,			0,				\
+	  "size",	"Writeback bios don't cross multiples of this;\n"\
+			"0 = the largest optimal IO size of devices\n"	\
+			"written to, or bucket size with erasure coding")\
+	x(read_hedge_percentile,	u8,				\
+	  OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(0, 99),						\
+	  NO_SB_OPT,			0,				\
+	  NULL,		"Reissue reads of replicated data to another\n"\
+			"replica if they take longer than this\n"	\
+			"percentile of device read latency; 0 = off")	\
+	x(congestion_target_latency,	u32,				\
+	  OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(0, U32_MAX),						\
+	  NO_SB_OPT,			0,				\
+	  "us",		"Device latency above which promotes and\n"	\
+			"background moves to it are throttled;\n"	\
+			"0 = based on each device's typical latency")	\
+	x(alloc_latency_weight,		u8,				\
+	  OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(0, 100),						\
+	  NO_SB_OPT,			50,				\
+	  NULL,		"How much to weigh device write latency and\n"\
+			"writes in flight against free space when\n"\
+			"striping allocations; 0 for free space only")	\
 	x(erasure_code,			u16,				\
 	  OPT_FORMAT|OPT_MOUNT|OPT_RUNTIME|OPT_INODE,			\
 	  OPT_BOOL(),							\
@@ -166,6 +251,13 @@ enum opt_type {
 	  OPT_BOOL(),							\
 	  BCH_SB_INODE_32BIT,		false,				\
 	  NULL,		"Constrain inode numbers to 32 bits")		\
+	x(dir_readahead,		u8,				\
+	  OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(0, 128),						\
+	  NO_SB_OPT,			32,				\
+	  NULL,		"When files in a directory are opened in readdir\n"\
+			"order, read ahead the inodes, extents and small\n"\
+			"file data of the next this many; 0 to disable")\
 	x(gc_reserve_percent,		u8,				\
 	  OPT_FORMAT|OPT_MOUNT|OPT_RUNTIME,				\
 	  OPT_UINT(5, 21),						\
@@ -177,6 +269,56 @@ enum opt_type {
 	  BCH_SB_GC_RESERVE_BYTES,	0,				\
 	  "%",		"Amount of disk space to reserve for copygc\n"	\
 			"Takes precedence over gc_reserve_percent if set")\
+	x(copygc_threads,		u8,				\
+	  OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(1, U8_MAX),						\
+	  NO_SB_OPT,			4,				\
+	  NULL,		"Max number of devices to run copygc on at once")\
+	x(migrate_threads,		u8,				\
+	  OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(1, U8_MAX),						\
+	  NO_SB_OPT,			4,				\
+	  NULL,		"Number of threads evacuating a device moves\n"\
+			"data with, each with its own part of the device")\
+	x(rebuild_threads,		u8,				\
+	  OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(1, U8_MAX),						\
+	  NO_SB_OPT,			4,				\
+	  NULL,		"Number of threads rebuilding erasure coded\n"	\
+			"stripes after a device failure")		\
+	x(scrub_interval,		u32,				\
+	  OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(0, U32_MAX),						\
+	  NO_SB_OPT,			0,				\
+	  "seconds",	"Interval between background scrub passes,\n"\
+			"which read and verify all data; 0 to disable")	\
+	x(scrub_rate,			u32,				\
+	  OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(0, U32_MAX),						\
+	  NO_SB_OPT,			16,				\
+	  "MiB/sec",	"Maximum rate at which background scrub reads;\n"\
+			"0 for no limit")				\
+	x(dedup_interval,		u32,				\
+	  OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(0, U32_MAX),						\
+	  NO_SB_OPT,			0,				\
+	  "seconds",	"Interval between background dedup passes,\n"\
+			"which share identical extents via reflink;\n"	\
+			"0 to disable")					\
+	x(defrag_extent_size,		u32,				\
+	  OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_SECTORS(0, 1U << 20),					\
+	  NO_SB_OPT,			0,				\
+	  "size",	"Runs of adjacent extents smaller than this that\n"\
+			"aren't contiguous on disk are rewritten by\n"	\
+			"rebalance; 0 = rebalance doesn't defragment")	\
+	x(erasure_code_cold_age,	u64,				\
+	  OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_SECTORS(0, U64_MAX),					\
+	  NO_SB_OPT,			0,				\
+	  "size",	"Replicated data not read or written in this\n"\
+			"much IO is converted to erasure coding by\n"	\
+			"rebalance; 0 = no conversion")			\
 	x(root_reserve_percent,		u8,				\
 	  OPT_FORMAT|OPT_MOUNT,						\
 	  OPT_UINT(0, 100),						\
@@ -192,6 +334,73 @@ enum opt_type {
 	  OPT_BOOL(),							\
 	  NO_SB_OPT,			true,				\
 	  NULL,		"Enable inline data extents")			\
+	x(inline_data_max,		u16,				\
+	  OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(0, BCH_INLINE_DATA_MAX),				\
+	  NO_SB_OPT,			0,				\
+	  NULL,		"Max size in bytes of inline data extents;\n"	\
+			"0 for half a block, up to 1k")		\
+	x(write_coalesce,		u8,				\
+	  OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_BOOL(),							\
+	  NO_SB_OPT,			false,				\
+	  NULL,		"Submit small synchronous data writes to each device\n"\
+			"in batches, so adjacent writes can be merged")	\
+	x(write_early_ack,		u8,				\
+	  OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_BOOL(),							\
+	  NO_SB_OPT,			false,				\
+	  NULL,		"Complete data writes once data_replicas_required\n"\
+			"replicas are written, finishing the rest in the\n"\
+			"background; fsync and O_DSYNC still wait for all\n"\
+			"replicas, a crash before then may leave extents\n"\
+			"degraded")					\
+	x(btree_background_merge,	u8,				\
+	  OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_BOOL(),							\
+	  NO_SB_OPT,			true,				\
+	  NULL,		"Coalesce underfull btree leaf nodes in the\n"	\
+			"background, after deletes have emptied them")	\
+	x(btree_background_compact,	u8,				\
+	  OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_BOOL(),							\
+	  NO_SB_OPT,			true,				\
+	  NULL,		"Compact btree nodes full of deleted and\n"	\
+			"overwritten keys in the background")		\
+	x(btree_lockless_reads,		u8,				\
+	  OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_BOOL(),							\
+	  NO_SB_OPT,			false,				\
+	  NULL,		"Lockless traversal of interior btree nodes")	\
+	x(btree_pin_interior,		u32,				\
+	  OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(0, U32_MAX),						\
+	  NO_SB_OPT,			0,				\
+	  NULL,		"Bitmask of btree IDs whose interior nodes are\n"\
+			"kept in memory")				\
+	x(btree_pin_interior_size,	u64,				\
+	  OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_SECTORS(0, U64_MAX),					\
+	  NO_SB_OPT,			0,				\
+	  NULL,		"Memory budget for pinned interior btree nodes")\
+	x(btree_cache_min_size,		u64,				\
+	  OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_SECTORS(0, U64_MAX),					\
+	  NO_SB_OPT,			0,				\
+	  NULL,		"Size of btree node cache never given up to\n"\
+			"memory pressure")				\
+	x(btree_key_cache_min_nr,	u32,				\
+	  OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(0, U32_MAX),						\
+	  NO_SB_OPT,			0,				\
+	  NULL,		"Number of cached btree keys never given up to\n"\
+			"memory pressure")				\
+	x(btree_cache_memcg,		u8,				\
+	  OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_BOOL(),							\
+	  NO_SB_OPT,			false,				\
+	  NULL,		"Charge btree node and key cache growth to the\n"\
+			"memory cgroup of the task doing the IO")	\
 	x(acl,				u8,				\
 	  OPT_FORMAT|OPT_MOUNT,						\
 	  OPT_BOOL(),							\
@@ -232,11 +441,24 @@ enum opt_type {
 	  OPT_BOOL(),							\
 	  NO_SB_OPT,			false,				\
 	  NULL,		"Enable discard/TRIM support")			\
+	x(discard_rate,			u32,				\
+	  OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(0, U32_MAX),						\
+	  NO_SB_OPT,			0,				\
+	  "MiB/sec",	"Maximum rate at which each device issues\n"\
+			"discards while it has plenty of free buckets;\n"\
+			"0 for no limit")				\
 	x(verbose,			u8,				\
 	  OPT_MOUNT,							\
 	  OPT_BOOL(),							\
 	  NO_SB_OPT,			false,				\
 	  NULL,		"Extra debugging information during mount/recovery")\
+	x(statfs_cache_ms,		u32,				\
+	  OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(0, U32_MAX),						\
+	  NO_SB_OPT,			10,				\
+	  "ms",		"Maximum age of the usage summary returned by\n"\
+			"statfs; 0 to always sum the percpu counters")	\
 	x(journal_flush_disabled,	u8,				\
 	  OPT_MOUNT|OPT_RUNTIME,					\
 	  OPT_BOOL(),							\
@@ -244,6 +466,19 @@ enum opt_type {
 	  NULL,		"Disable journal flush on sync/fsync\n"		\
 			"If enabled, writes can be lost, but only since the\n"\
 			"last journal write (default 1 second)")	\
+	x(journal_flush_delay,		u32,				\
+	  OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(0, U32_MAX),						\
+	  NO_SB_OPT,			1000,				\
+	  NULL,		"Maximum delay in milliseconds between journal\n"\
+			"flush writes; 0 to only issue flush writes when\n"\
+			"something asks for one, or journal reclaim\n"\
+			"needs it")						\
+	x(journal_write_depth,		u8,				\
+	  OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(1, JOURNAL_BUF_NR - 1),				\
+	  NO_SB_OPT,			JOURNAL_BUF_NR - 1,		\
+	  NULL,		"Maximum number of journal writes in flight")	\
 	x(fsck,				u8,				\
 	  OPT_MOUNT,							\
 	  OPT_BOOL(),							\
@@ -254,6 +489,29 @@ enum opt_type {
 	  OPT_BOOL(),							\
 	  NO_SB_OPT,			false,				\
 	  NULL,		"Fix errors during fsck without asking")	\
+	x(gc_parallel,			u8,				\
+	  OPT_MOUNT,							\
+	  OPT_BOOL(),							\
+	  NO_SB_OPT,			false,				\
+	  NULL,		"Mark btrees in parallel during initial gc/fsck")\
+	x(fsck_threads,			u8,				\
+	  OPT_MOUNT,							\
+	  OPT_UINT(1, U8_MAX),						\
+	  NO_SB_OPT,			4,				\
+	  NULL,		"Number of inode ranges fsck checks extents,\n"\
+			"dirents and xattrs in, each in parallel")	\
+	x(journal_replay_threads,	u8,				\
+	  OPT_MOUNT,							\
+	  OPT_UINT(1, U8_MAX),						\
+	  NO_SB_OPT,			4,				\
+	  NULL,		"Number of threads replaying btree leaf updates\n"\
+			"from the journal after an unclean shutdown")	\
+	x(btree_walk_prefetch,		u16,				\
+	  OPT_MOUNT,							\
+	  OPT_UINT(1, 1024),						\
+	  NO_SB_OPT,			64,				\
+	  NULL,		"Maximum number of btree nodes read ahead of\n"\
+			"btree walks at mount time, per level")		\
 	x(ratelimit_errors,		u8,				\
 	  OPT_MOUNT,							\
 	  OPT_BOOL(),							\
@@ -3,6 +3,9 @@
 #include "bcachefs.h"
 #include "alloc_foreground.h"
 #include "btree_iter.h"
+#include "btree_update.h"
+#include "btree_update_interior.h"
+#include "btree_write_buffer.h"
 #include "buckets.h"
 #include "clock.h"
 #include "disk_groups.h"
@@ -17,6 +20,46 @@
 #include <linux/sched/cputime.h>
 #include <trace/events/bcachefs.h>
 
+/*
+ * Rebalance work index:
+ *
+ * Writes whose data doesn't yet satisfy its background_target or
+ * background_compression options add the range they wrote to
+ * BTREE_ID_REBALANCE_WORK, via the btree write buffer in the same transaction
+ * as the extent update - so the rebalance thread only has to look at those
+ * ranges, instead of scanning the whole extents btree every time there's work.
+ *
+ * Full scans are still done when options change (and on filesystems without
+ * the index), since that can create work for data that was written before.
+ * Defragmentation, when defrag_extent_size is set, and conversion of cold
+ * replicated data to erasure coding are done on full scans.
+ */
+
+#define REBALANCE_WORK_BATCH		64
+
+const char *bch2_rebalance_work_invalid(const struct bch_fs *c, struct bkey_s_c k)
+{
+	struct bkey_s_c_rebalance_work w;
+
+	if (bkey_val_bytes(k.k) != sizeof(struct bch_rebalance_work))
+		return "incorrect value size";
+
+	w = bkey_s_c_to_rebalance_work(k);
+
+	if (le64_to_cpu(w.v->end) <= k.k->p.offset)
+		return "end before start";
+
+	return NULL;
+}
+
+void bch2_rebalance_work_key_to_text(struct printbuf *out, struct bch_fs *c,
+				     struct bkey_s_c k)
+{
+	struct bkey_s_c_rebalance_work w = bkey_s_c_to_rebalance_work(k);
+
+	pr_buf(out, "end %llu", le64_to_cpu(w.v->end));
+}
+
 /*
  * Check if an extent should be moved:
  * returns -1 if it should not be moved, or
@@ -66,19 +109,165 @@ void bch2_rebalance_add_key(struct bch_fs *c,
 		rebalance_wakeup(c);
 }
 
+/*
+ * Called for each extent a write inserts, before bch2_extent_update() - which
+ * may insert less than all of @k, but covering more than was inserted is
+ * harmless:
+ */
+int bch2_trans_rebalance_work_add(struct btree_trans *trans,
+				  struct bkey_i *k,
+				  struct bch_io_opts *io_opts)
+{
+	struct bkey_i_rebalance_work w;
+
+	if (!bch2_fs_has_rebalance_work(trans->c) ||
+	    !k->k.size ||
+	    __bch2_rebalance_pred(trans->c, bkey_i_to_s_c(k), io_opts) < 0)
+		return 0;
+
+	bkey_rebalance_work_init(&w.k_i);
+	w.k.p	= bkey_start_pos(&k->k);
+	w.v.end	= cpu_to_le64(k->k.p.offset);
+
+	return bch2_trans_update_buffered(trans, BTREE_ID_REBALANCE_WORK, &w.k_i);
+}
+
+/*
+ * Conversion of cold replicated data to erasure coding:
+ *
+ * With erasure_code_cold_age set, full scans also look for extents that are
+ * replicated, not erasure coded, and whose buckets haven't been read or written
+ * in that much IO. One replica is rewritten to a new stripe with the
+ * extent's full durability; the index update then marks the now redundant
+ * replicas cached, so their space is reclaimed.
+ *
+ * The bucket's io times stand in for the extent's: they're approximate, but we
+ * don't track access times per extent.
+ */
+static const struct bch_extent_ptr *
+rebalance_ec_convert_ptr(struct bch_fs *c, struct bkey_s_c k,
+			 struct bch_io_opts *io_opts)
+{
+	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(k);
+	const union bch_extent_entry *entry;
+	const struct bch_extent_ptr *ret = NULL;
+	struct extent_ptr_decoded p;
+	u64 age = c->opts.erasure_code_cold_age;
+	u64 now[2] = {
+		atomic64_read(&c->io_clock[READ].now),
+		atomic64_read(&c->io_clock[WRITE].now),
+	};
+	unsigned nr_ptrs = 0;
+	int rw;
+
+	if (!age || io_opts->erasure_code || io_opts->data_replicas < 2)
+		return NULL;
+
+	rcu_read_lock();
+	bkey_for_each_ptr_decode(k.k, ptrs, p, entry) {
+		struct bch_dev *ca = bch_dev_bkey_exists(c, p.ptr.dev);
+		struct bucket *g;
+
+		if (p.ptr.cached)
+			continue;
+
+		if (p.has_ec)
+			goto not_cold;
+
+		g = PTR_BUCKET(ca, &p.ptr, 0);
+
+		for (rw = READ; rw <= WRITE; rw++)
+			if (now[rw] - bucket_io_time(g, rw, now[rw]) < age)
+				goto not_cold;
+
+		if (!ret)
+			ret = &entry->ptr;
+		nr_ptrs++;
+	}
+	rcu_read_unlock();
+
+	return nr_ptrs >= 2 ? ret : NULL;
+not_cold:
+	rcu_read_unlock();
+	return NULL;
+}
+
 static enum data_cmd rebalance_pred(struct bch_fs *c, void *arg,
 				    struct bkey_s_c k,
 				    struct bch_io_opts *io_opts,
 				    struct data_opts *data_opts)
 {
+	const struct bch_extent_ptr *ptr;
+
 	if (__bch2_rebalance_pred(c, k, io_opts) >= 0) {
 		data_opts->target		= io_opts->background_target;
 		data_opts->nr_replicas		= 1;
 		data_opts->btree_insert_flags	= 0;
 		return DATA_ADD_REPLICAS;
-	} else {
-		return DATA_SKIP;
 	}
+
+	ptr = rebalance_ec_convert_ptr(c, k, io_opts);
+	if (ptr) {
+		data_opts->target		= io_opts->background_target;
+		data_opts->rewrite_dev		= ptr->dev;
+		data_opts->nr_replicas		= io_opts->data_replicas;
+		data_opts->btree_insert_flags	= 0;
+		data_opts->erasure_code		= true;
+		return DATA_REWRITE;
+	}
+
+	return DATA_SKIP;
+}
+
+/*
+ * Btree nodes that aren't on the target btree_node_target() gives for their
+ * btree and level - written before the placement options were changed, or
+ * when the target was full:
+ */
+static bool rebalance_btree_node_pred(struct bch_fs *c, struct btree *b,
+				      void *arg)
+{
+	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(bkey_i_to_s_c(&b->key));
+	const struct bch_extent_ptr *ptr;
+	unsigned target = btree_node_target(c, b->c.btree_id, b->c.level);
+
+	if (!target)
+		return false;
+
+	bkey_for_each_ptr(ptrs, ptr)
+		if (!bch2_dev_in_target(c, ptr->dev, target))
+			return true;
+
+	return false;
+}
+
+/*
+ * Data becomes cold without anything happening to it, so nothing would trigger
+ * a scan for it: instead, we do a full scan each time erasure_code_cold_age
+ * worth of IO has gone by.
+ */
+static void rebalance_ec_convert_timer_fn(struct io_timer *timer)
+{
+	struct bch_fs *c = container_of(timer, struct bch_fs,
+					rebalance.ec_convert_timer);
+
+	clear_bit(0, &c->rebalance.ec_convert_timer_armed);
+	bch2_rebalance_add_work(c, S64_MAX);
+}
+
+static void rebalance_ec_convert_timer_arm(struct bch_fs *c)
+{
+	struct bch_fs_rebalance *r = &c->rebalance;
+	struct io_clock *clock = &c->io_clock[WRITE];
+	u64 age = c->opts.erasure_code_cold_age;
+
+	if (!age || test_and_set_bit(0, &r->ec_convert_timer_armed))
+		return;
+
+	r->ec_convert_timer.fn		= rebalance_ec_convert_timer_fn;
+	r->ec_convert_timer.expire	= atomic64_read(&clock->now) +
+		min_t(u64, age, ULONG_MAX >> 1);
+	bch2_io_timer_add(clock, &r->ec_convert_timer);
 }
 
 void bch2_rebalance_add_work(struct bch_fs *c, u64 sectors)
@@ -152,6 +341,107 @@ static void rebalance_work_reset(struct bch_fs *c)
 	atomic64_set(&c->rebalance.work_unknown_dev, 0);
 }
 
+/*
+ * Process the rebalance work index: entries are taken in batches, with adjacent
+ * entries in the same inode merged into one range so that we're not waiting on
+ * IO for each small write separately.
+ *
+ * Entries are deleted before their range is processed, not after: a write that
+ * races with us then either adds a new entry after the deletion, or its extent
+ * is already visible when we walk the range.
+ */
+static int rebalance_work_index_process(struct bch_fs *c)
+{
+	struct bch_fs_rebalance *r = &c->rebalance;
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	struct bkey_i delete;
+	struct bpos batch_pos, start = POS_MIN, end = POS_MIN;
+	unsigned nr;
+	int ret;
+
+	ret = bch2_btree_write_buffer_flush(c);
+	if (ret)
+		return ret;
+
+	bch2_trans_init(&trans, c, 0, 0);
+	iter = bch2_trans_get_iter(&trans, BTREE_ID_REBALANCE_WORK, POS_MIN,
+				   BTREE_ITER_PREFETCH);
+
+	while (!kthread_should_stop()) {
+		nr = 0;
+		batch_pos = iter->pos;
+
+		while ((k = bch2_btree_iter_peek(iter)).k &&
+		       !(ret = bkey_err(k))) {
+			struct bpos k_end;
+
+			if (k.k->type != KEY_TYPE_rebalance_work)
+				goto next;
+
+			k_end = POS(k.k->p.inode,
+				    le64_to_cpu(bkey_s_c_to_rebalance_work(k).v->end));
+
+			if (nr &&
+			    (nr >= REBALANCE_WORK_BATCH ||
+			     k.k->p.inode != end.inode ||
+			     bkey_cmp(k.k->p, end) > 0))
+				break;
+
+			if (!nr++) {
+				start	= k.k->p;
+				end	= k_end;
+			} else {
+				end	= bkey_cmp(k_end, end) > 0 ? k_end : end;
+			}
+
+			bkey_init(&delete.k);
+			delete.k.p = k.k->p;
+
+			ret = bch2_trans_update_buffered(&trans,
+					BTREE_ID_REBALANCE_WORK, &delete);
+			if (ret)
+				break;
+next:
+			bch2_btree_iter_next(iter);
+		}
+
+		if (!ret && nr)
+			ret = bch2_trans_commit(&trans, NULL, NULL, 0);
+
+		if (ret == -EINTR) {
+			/* Restart the batch: */
+			bch2_trans_begin(&trans);
+			bch2_btree_iter_set_pos(iter, batch_pos);
+			ret = 0;
+			continue;
+		}
+
+		if (ret || !nr)
+			break;
+
+		bch2_trans_unlock(&trans);
+
+		ret = bch2_move_data(c,
+				     /* ratelimiting disabled for now */
+				     NULL, /*  &r->pd.rate, */
+				     writepoint_ptr(&c->rebalance_write_point),
+				     start, end,
+				     rebalance_pred, NULL,
+				     &r->move_stats);
+		if (ret)
+			break;
+	}
+
+	bch2_trans_iter_put(&trans, iter);
+	ret = bch2_trans_exit(&trans) ?: ret;
+
+	if (ret && ret != -EROFS)
+		bch_err(c, "error %i processing rebalance work", ret);
+	return ret;
+}
+
 static unsigned long curr_cputime(void)
 {
 	u64 utime, stime;
@@ -171,6 +461,7 @@ static int bch2_rebalance_thread(void *arg)
 	unsigned long cputime, prev_cputime;
 	u64 io_start;
 	long throttle;
+	bool full_scan;
 
 	set_freezable();
 
@@ -236,15 +527,33 @@ static int bch2_rebalance_thread(void *arg)
 
 		r->state = REBALANCE_RUNNING;
 		memset(&r->move_stats, 0, sizeof(r->move_stats));
+		full_scan = !bch2_fs_has_rebalance_work(c) ||
+			atomic64_read(&r->work_unknown_dev);
 		rebalance_work_reset(c);
 
-		bch2_move_data(c,
-			       /* ratelimiting disabled for now */
-			       NULL, /*  &r->pd.rate, */
-			       writepoint_ptr(&c->rebalance_write_point),
-			       POS_MIN, POS_MAX,
-			       rebalance_pred, NULL,
-			       &r->move_stats);
+		if (full_scan)
+			bch2_move_data(c,
+				       /* ratelimiting disabled for now */
+				       NULL, /*  &r->pd.rate, */
+				       writepoint_ptr(&c->rebalance_write_point),
+				       POS_MIN, POS_MAX,
+				       rebalance_pred, NULL,
+				       &r->move_stats);
+
+		if (full_scan)
+			bch2_move_btree_nodes(c, rebalance_btree_node_pred,
+					      NULL, &r->move_stats);
+
+		if (full_scan && c->opts.defrag_extent_size)
+			bch2_defrag(c, POS_MIN, POS_MAX,
+				    c->opts.defrag_extent_size,
+				    &r->move_stats);
+
+		if (full_scan)
+			rebalance_ec_convert_timer_arm(c);
+
+		if (bch2_fs_has_rebalance_work(c))
+			rebalance_work_index_process(c);
 	}
 
 	return 0;
@@ -295,6 +604,10 @@ void bch2_rebalance_stop(struct bch_fs *c)
 	c->rebalance.pd.rate.rate = UINT_MAX;
 	bch2_ratelimit_reset(&c->rebalance.pd.rate);
 
+	if (test_and_clear_bit(0, &c->rebalance.ec_convert_timer_armed))
+		bch2_io_timer_del(&c->io_clock[WRITE],
+				  &c->rebalance.ec_convert_timer);
+
 	p = rcu_dereference_protected(c->rebalance.thread, 1);
 	c->rebalance.thread = NULL;
 
@@ -314,6 +627,13 @@ int bch2_rebalance_start(struct bch_fs *c)
 	if (c->opts.nochanges)
 		return 0;
 
+	/*
+	 * With the work index, we don't need the initial full scan that finds
+	 * work from before we were started:
+	 */
+	if (bch2_fs_has_rebalance_work(c))
+		atomic64_cmpxchg(&c->rebalance.work_unknown_dev, S64_MAX, 0);
+
 	p = kthread_create(bch2_rebalance_thread, c, "bch-rebalance/%s", c->name);
 	if (IS_ERR(p))
 		return PTR_ERR(p);
@@ -321,6 +641,8 @@ int bch2_rebalance_start(struct bch_fs *c)
 	get_task_struct(p);
 	rcu_assign_pointer(c->rebalance.thread, p);
 	wake_up_process(p);
+
+	rebalance_ec_convert_timer_arm(c);
 	return 0;
 }
 
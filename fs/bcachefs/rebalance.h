@@ -4,6 +4,20 @@
 
 #include "rebalance_types.h"
 
+const char *bch2_rebalance_work_invalid(const struct bch_fs *, struct bkey_s_c);
+void bch2_rebalance_work_key_to_text(struct printbuf *, struct bch_fs *,
+				     struct bkey_s_c);
+
+#define bch2_bkey_ops_rebalance_work (struct bkey_ops) {	\
+	.key_invalid	= bch2_rebalance_work_invalid,		\
+	.val_to_text	= bch2_rebalance_work_key_to_text,	\
+}
+
+static inline bool bch2_fs_has_rebalance_work(struct bch_fs *c)
+{
+	return c->sb.features & (1ULL << BCH_FEATURE_rebalance_work);
+}
+
 static inline void rebalance_wakeup(struct bch_fs *c)
 {
 	struct task_struct *p;
@@ -17,6 +31,8 @@ static inline void rebalance_wakeup(struct bch_fs *c)
 
 void bch2_rebalance_add_key(struct bch_fs *, struct bkey_s_c,
 			    struct bch_io_opts *);
+int bch2_trans_rebalance_work_add(struct btree_trans *, struct bkey_i *,
+				  struct bch_io_opts *);
 void bch2_rebalance_add_work(struct bch_fs *, u64);
 
 void bch2_rebalance_work_to_text(struct printbuf *, struct bch_fs *);
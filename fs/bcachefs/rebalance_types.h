@@ -21,6 +21,9 @@ struct bch_fs_rebalance {
 	unsigned long		throttled_until_cputime;
 	struct bch_move_stats	move_stats;
 
+	struct io_timer		ec_convert_timer;
+	unsigned long		ec_convert_timer_armed;
+
 	unsigned		enabled:1;
 };
 
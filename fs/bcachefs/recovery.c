@@ -8,6 +8,7 @@
 #include "btree_update_interior.h"
 #include "btree_io.h"
 #include "buckets.h"
+#include "compress.h"
 #include "dirent.h"
 #include "ec.h"
 #include "error.h"
@@ -19,8 +20,10 @@
 #include "quota.h"
 #include "recovery.h"
 #include "replicas.h"
+#include "super.h"
 #include "super-io.h"
 
+#include <linux/kthread.h>
 #include <linux/sort.h>
 #include <linux/stat.h>
 
@@ -106,6 +109,12 @@ int bch2_journal_key_insert(struct bch_fs *c, enum btree_id id,
 	struct journal_iter *iter;
 	unsigned idx = journal_key_search(keys, id, level, k->k.p);
 
+	/*
+	 * The journal keys array may be reallocated, so this can't run
+	 * concurrently with anything else iterating over it:
+	 */
+	EBUG_ON(test_bit(BCH_FS_GC_PARALLEL, &c->flags));
+
 	if (idx < keys->nr &&
 	    journal_key_cmp(&n, &keys->d[idx]) == 0) {
 		if (keys->d[idx].allocated)
@@ -132,8 +141,10 @@ int bch2_journal_key_insert(struct bch_fs *c, enum btree_id id,
 
 	array_insert_item(keys->d, keys->nr, idx, n);
 
+	spin_lock(&c->journal_iters_lock);
 	list_for_each_entry(iter, &c->journal_iters, list)
 		journal_iter_fix(c, iter, idx);
+	spin_unlock(&c->journal_iters_lock);
 
 	return 0;
 }
@@ -179,7 +190,11 @@ static void bch2_journal_iter_advance(struct journal_iter *iter)
 
 static void bch2_journal_iter_exit(struct journal_iter *iter)
 {
+	struct bch_fs *c = container_of(iter->keys, struct bch_fs, journal_keys);
+
+	spin_lock(&c->journal_iters_lock);
 	list_del(&iter->list);
+	spin_unlock(&c->journal_iters_lock);
 }
 
 static void bch2_journal_iter_init(struct bch_fs *c,
@@ -191,7 +206,10 @@ static void bch2_journal_iter_init(struct bch_fs *c,
 	iter->level	= level;
 	iter->keys	= &c->journal_keys;
 	iter->idx	= journal_key_search(&c->journal_keys, id, level, pos);
+
+	spin_lock(&c->journal_iters_lock);
 	list_add(&iter->list, &c->journal_iters);
+	spin_unlock(&c->journal_iters_lock);
 }
 
 static struct bkey_s_c bch2_journal_iter_peek_btree(struct btree_and_journal_iter *iter)
@@ -291,29 +309,37 @@ void bch2_btree_and_journal_iter_init_node_iter(struct btree_and_journal_iter *i
 
 /* Walk btree, overlaying keys from the journal: */
 
+/*
+ * Walks at mount time read the btree cold, so children are read ahead of the
+ * walk to keep the device busy. The read ahead distance at each level starts
+ * small and doubles whenever the walk reaches a node that's still being read,
+ * up to opts.btree_walk_prefetch - which also bounds the number of reads in
+ * flight per level:
+ */
+struct btree_walk_prefetch {
+	struct btree_and_journal_iter	iter;	/* next key to read ahead */
+	unsigned			ahead;	/* from the walk's position */
+	unsigned			depth;
+};
+
 static void btree_and_journal_iter_prefetch(struct bch_fs *c, struct btree *b,
-					   struct btree_and_journal_iter iter)
+					    struct btree_walk_prefetch *p,
+					    struct bkey_buf *tmp)
 {
-	unsigned i = 0, nr = b->c.level > 1 ? 2 : 16;
 	struct bkey_s_c k;
-	struct bkey_buf tmp;
 
 	BUG_ON(!b->c.level);
 
-	bch2_bkey_buf_init(&tmp);
+	while (p->ahead < p->depth &&
+	       (k = bch2_btree_and_journal_iter_peek(&p->iter)).k) {
+		bch2_bkey_buf_reassemble(tmp, c, k);
 
-	while (i < nr &&
-	       (k = bch2_btree_and_journal_iter_peek(&iter)).k) {
-		bch2_bkey_buf_reassemble(&tmp, c, k);
-
-		bch2_btree_node_prefetch(c, NULL, tmp.k,
+		bch2_btree_node_prefetch(c, NULL, tmp->k,
 					b->c.btree_id, b->c.level - 1);
 
-		bch2_btree_and_journal_iter_advance(&iter);
-		i++;
+		bch2_btree_and_journal_iter_advance(&p->iter);
+		p->ahead++;
 	}
-
-	bch2_bkey_buf_exit(&tmp, c);
 }
 
 static int bch2_btree_and_journal_walk_recurse(struct bch_fs *c, struct btree *b,
@@ -323,15 +349,23 @@ static int bch2_btree_and_journal_walk_recurse(struct bch_fs *c, struct btree *b
 				btree_walk_key_fn key_fn)
 {
 	struct btree_and_journal_iter iter;
+	struct btree_walk_prefetch prefetch;
 	struct bkey_s_c k;
-	struct bkey_buf tmp;
+	struct bkey_buf tmp, prefetch_tmp;
 	struct btree *child;
 	int ret = 0;
 
 	bch2_bkey_buf_init(&tmp);
+	bch2_bkey_buf_init(&prefetch_tmp);
 	bch2_btree_and_journal_iter_init_node_iter(&iter, c, b);
 
+	prefetch.ahead	= 0;
+	prefetch.depth	= min_t(unsigned, b->c.level > 1 ? 2 : 16,
+				c->opts.btree_walk_prefetch);
+
 	while ((k = bch2_btree_and_journal_iter_peek(&iter)).k) {
+		atomic64_inc(&c->recovery_keys_walked);
+
 		ret = key_fn(c, btree_id, b->c.level, k);
 		if (ret)
 			break;
@@ -339,7 +373,17 @@ static int bch2_btree_and_journal_walk_recurse(struct bch_fs *c, struct btree *b
 		if (b->c.level) {
 			bch2_bkey_buf_reassemble(&tmp, c, k);
 
+			if (!prefetch.ahead)
+				prefetch.iter = iter;
+			else if (!bch2_btree_node_cached(c, tmp.k))
+				prefetch.depth = min_t(unsigned, prefetch.depth * 2,
+						       c->opts.btree_walk_prefetch);
+
+			btree_and_journal_iter_prefetch(c, b, &prefetch,
+							&prefetch_tmp);
+
 			bch2_btree_and_journal_iter_advance(&iter);
+			prefetch.ahead--;
 
 			child = bch2_btree_node_get_noiter(c, tmp.k,
 						b->c.btree_id, b->c.level - 1,
@@ -349,8 +393,6 @@ static int bch2_btree_and_journal_walk_recurse(struct bch_fs *c, struct btree *b
 			if (ret)
 				break;
 
-			btree_and_journal_iter_prefetch(c, b, iter);
-
 			ret   = (node_fn ? node_fn(c, b) : 0) ?:
 				bch2_btree_and_journal_walk_recurse(c, child,
 					journal_keys, btree_id, node_fn, key_fn);
@@ -364,6 +406,7 @@ static int bch2_btree_and_journal_walk_recurse(struct bch_fs *c, struct btree *b
 	}
 
 	bch2_btree_and_journal_iter_exit(&iter);
+	bch2_bkey_buf_exit(&prefetch_tmp, c);
 	bch2_bkey_buf_exit(&tmp, c);
 	return ret;
 }
@@ -389,6 +432,167 @@ int bch2_btree_and_journal_walk(struct bch_fs *c, struct journal_keys *journal_k
 	return ret;
 }
 
+/*
+ * Parallel walk: the subtrees under the root are walked concurrently, so only
+ * for callers whose key_fn and node_fn don't depend on the order keys are
+ * visited in and are safe to call from multiple threads - this is mainly for
+ * getting more btree node reads in flight at mount time:
+ */
+struct btree_walk_parallel {
+	struct bch_fs		*c;
+	struct journal_keys	*journal_keys;
+	struct btree		*b;
+	btree_walk_node_fn	node_fn;
+	btree_walk_key_fn	key_fn;
+	struct bkey_buf		*keys;
+	size_t			nr;
+	atomic_long_t		next;
+	int			ret;
+};
+
+struct btree_walk_parallel_thread {
+	struct closure		cl;
+	struct btree_walk_parallel *w;
+};
+
+static void btree_and_journal_walk_thread(struct closure *cl)
+{
+	struct btree_walk_parallel_thread *t =
+		container_of(cl, struct btree_walk_parallel_thread, cl);
+	struct btree_walk_parallel *w = t->w;
+	struct btree *b = w->b, *child;
+	size_t idx;
+	int ret;
+
+	while (!READ_ONCE(w->ret) &&
+	       (idx = atomic_long_inc_return(&w->next) - 1) < w->nr) {
+		child = bch2_btree_node_get_noiter(w->c, w->keys[idx].k,
+					b->c.btree_id, b->c.level - 1,
+					false);
+		ret = PTR_ERR_OR_ZERO(child);
+		if (!ret) {
+			/*
+			 * key_fn marks buckets; the caller's mark_lock doesn't
+			 * cover us, we're running in a different task:
+			 */
+			percpu_down_read(&w->c->mark_lock);
+			ret   = (w->node_fn ? w->node_fn(w->c, b) : 0) ?:
+				bch2_btree_and_journal_walk_recurse(w->c, child,
+					w->journal_keys, b->c.btree_id,
+					w->node_fn, w->key_fn);
+			percpu_up_read(&w->c->mark_lock);
+			six_unlock_read(&child->c.lock);
+		}
+
+		if (ret) {
+			cmpxchg(&w->ret, 0, ret);
+			break;
+		}
+	}
+
+	closure_return(cl);
+}
+
+static int btree_and_journal_walk_children(struct bch_fs *c,
+				struct journal_keys *journal_keys,
+				struct btree *b,
+				btree_walk_node_fn node_fn,
+				btree_walk_key_fn key_fn)
+{
+	struct btree_walk_parallel w = {
+		.c		= c,
+		.journal_keys	= journal_keys,
+		.b		= b,
+		.node_fn	= node_fn,
+		.key_fn		= key_fn,
+	};
+	struct btree_walk_parallel_thread *threads = NULL;
+	struct btree_and_journal_iter iter;
+	struct bkey_s_c k;
+	struct closure cl;
+	unsigned nr_threads, i;
+	int ret = 0;
+
+	bch2_btree_and_journal_iter_init_node_iter(&iter, c, b);
+	while (bch2_btree_and_journal_iter_peek(&iter).k) {
+		w.nr++;
+		bch2_btree_and_journal_iter_advance(&iter);
+	}
+	bch2_btree_and_journal_iter_exit(&iter);
+
+	if (!w.nr)
+		return 0;
+
+	nr_threads = min_t(size_t, num_online_cpus(), w.nr);
+
+	w.keys	= kvmalloc_array(w.nr, sizeof(w.keys[0]), GFP_KERNEL);
+	threads	= kcalloc(nr_threads, sizeof(threads[0]), GFP_KERNEL);
+	if (!w.keys || !threads) {
+		kfree(threads);
+		kvfree(w.keys);
+		return -ENOMEM;
+	}
+
+	w.nr = 0;
+	bch2_btree_and_journal_iter_init_node_iter(&iter, c, b);
+	while ((k = bch2_btree_and_journal_iter_peek(&iter)).k) {
+		ret = key_fn(c, b->c.btree_id, b->c.level, k);
+		if (ret)
+			break;
+
+		bch2_bkey_buf_init(&w.keys[w.nr]);
+		bch2_bkey_buf_reassemble(&w.keys[w.nr++], c, k);
+		bch2_btree_and_journal_iter_advance(&iter);
+	}
+	bch2_btree_and_journal_iter_exit(&iter);
+
+	if (!ret) {
+		closure_init_stack(&cl);
+
+		for (i = 0; i < nr_threads; i++) {
+			threads[i].w = &w;
+			closure_call(&threads[i].cl,
+				     btree_and_journal_walk_thread,
+				     system_unbound_wq, &cl);
+		}
+
+		closure_sync(&cl);
+		ret = w.ret;
+	}
+
+	while (w.nr)
+		bch2_bkey_buf_exit(&w.keys[--w.nr], c);
+	kfree(threads);
+	kvfree(w.keys);
+	return ret;
+}
+
+int bch2_btree_and_journal_walk_parallel(struct bch_fs *c,
+				struct journal_keys *journal_keys,
+				enum btree_id btree_id,
+				btree_walk_node_fn node_fn,
+				btree_walk_key_fn key_fn)
+{
+	struct btree *b = c->btree_roots[btree_id].b;
+	int ret = 0;
+
+	if (btree_node_fake(b))
+		return 0;
+
+	if (!b->c.level)
+		return bch2_btree_and_journal_walk(c, journal_keys, btree_id,
+						   node_fn, key_fn);
+
+	six_lock_read(&b->c.lock, NULL, NULL);
+	ret   = (node_fn ? node_fn(c, b) : 0) ?:
+		btree_and_journal_walk_children(c, journal_keys, b,
+						node_fn, key_fn) ?:
+		key_fn(c, btree_id, b->c.level + 1, bkey_i_to_s_c(&b->key));
+	six_unlock_read(&b->c.lock);
+
+	return ret;
+}
+
 /* sort and dedup all keys in the journal: */
 
 void bch2_journal_entries_free(struct list_head *list)
@@ -431,13 +635,144 @@ void bch2_journal_keys_free(struct journal_keys *keys)
 	keys->nr = 0;
 }
 
+/*
+ * Sorting the journal keys is parallelized with a merge sort: the keys are
+ * split into one chunk per thread and each chunk is sorted, then pairs of runs
+ * are merged in parallel until there's one left. Keys that were overwritten by
+ * newer keys at the same position are dropped in the last merge.
+ */
+
+#define JOURNAL_KEYS_SORT_CHUNK_MIN	4096
+
+struct journal_keys_sort_work {
+	struct closure		cl;
+	struct journal_key	*src;
+	struct journal_key	*src_mid;
+	struct journal_key	*src_end;
+	struct journal_key	*dst;
+	struct journal_key	*dst_end;
+	bool			dedup;
+};
+
+static void journal_keys_sort_chunk(struct closure *cl)
+{
+	struct journal_keys_sort_work *w =
+		container_of(cl, struct journal_keys_sort_work, cl);
+
+	sort(w->src, w->src_end - w->src, sizeof(w->src[0]),
+	     journal_sort_key_cmp, NULL);
+	closure_return(cl);
+}
+
+static inline struct journal_key *
+journal_keys_merge_push(struct journal_key *start, struct journal_key *dst,
+			struct journal_key *k, bool dedup)
+{
+	/* Newer keys sort last - overwrite the older key at the same pos: */
+	if (dedup &&
+	    dst > start &&
+	    dst[-1].btree_id	== k->btree_id &&
+	    dst[-1].level	== k->level &&
+	    !bkey_cmp(dst[-1].k->k.p, k->k->k.p))
+		dst--;
+
+	*dst++ = *k;
+	return dst;
+}
+
+static void journal_keys_merge(struct closure *cl)
+{
+	struct journal_keys_sort_work *w =
+		container_of(cl, struct journal_keys_sort_work, cl);
+	struct journal_key *l = w->src, *r = w->src_mid, *dst = w->dst;
+
+	while (l < w->src_mid && r < w->src_end)
+		dst = journal_keys_merge_push(w->dst, dst,
+				journal_sort_key_cmp(l, r) < 0 ? l++ : r++,
+				w->dedup);
+
+	while (l < w->src_mid)
+		dst = journal_keys_merge_push(w->dst, dst, l++, w->dedup);
+	while (r < w->src_end)
+		dst = journal_keys_merge_push(w->dst, dst, r++, w->dedup);
+
+	w->dst_end = dst;
+	closure_return(cl);
+}
+
+/*
+ * Sorts and dedups @nr keys, using @tmp (which must be as big as @d) as scratch
+ * space: returns the buffer the result ended up in, with the new number of keys
+ * in @nr, or NULL on allocation failure.
+ */
+static struct journal_key *journal_keys_sort_parallel(struct journal_key *d,
+						      struct journal_key *tmp,
+						      size_t *nr)
+{
+	struct journal_keys_sort_work *works;
+	struct journal_key *src = d, *dst = tmp;
+	struct closure cl;
+	unsigned nr_chunks, nr_runs, width, i;
+	bool dedup;
+
+#define chunk_start(_i)	(*nr * min(_i, nr_chunks) / nr_chunks)
+
+	nr_chunks = rounddown_pow_of_two(num_online_cpus());
+	nr_chunks = min_t(size_t, nr_chunks,
+			  max_t(size_t, *nr / JOURNAL_KEYS_SORT_CHUNK_MIN, 1));
+	nr_chunks = rounddown_pow_of_two(nr_chunks);
+
+	works = kcalloc(nr_chunks, sizeof(works[0]), GFP_KERNEL);
+	if (!works)
+		return NULL;
+
+	closure_init_stack(&cl);
+
+	for (i = 0; i < nr_chunks; i++) {
+		works[i].src		= d + chunk_start(i);
+		works[i].src_end	= d + chunk_start(i + 1);
+		closure_call(&works[i].cl, journal_keys_sort_chunk,
+			     system_unbound_wq, &cl);
+	}
+	closure_sync(&cl);
+
+	nr_runs = nr_chunks;
+	width	= 1;
+
+	do {
+		dedup = nr_runs <= 2;
+
+		for (i = 0; i < nr_runs; i += 2) {
+			struct journal_keys_sort_work *w = works + i / 2;
+
+			w->src		= src + chunk_start(i * width);
+			w->src_mid	= src + chunk_start((i + 1) * width);
+			w->src_end	= src + chunk_start((i + 2) * width);
+			w->dst		= dst + chunk_start(i * width);
+			w->dedup	= dedup;
+			closure_call(&w->cl, journal_keys_merge,
+				     system_unbound_wq, &cl);
+		}
+		closure_sync(&cl);
+
+		swap(src, dst);
+		nr_runs = DIV_ROUND_UP(nr_runs, 2);
+		width *= 2;
+	} while (!dedup);
+#undef chunk_start
+
+	*nr = works[0].dst_end - src;
+	kfree(works);
+	return src;
+}
+
 static struct journal_keys journal_keys_sort(struct list_head *journal_entries)
 {
 	struct journal_replay *i;
 	struct jset_entry *entry;
 	struct bkey_i *k, *_n;
 	struct journal_keys keys = { NULL };
-	struct journal_key *src, *dst;
+	struct journal_key *tmp = NULL, *sorted;
 	size_t nr_keys = 0;
 
 	if (list_empty(journal_entries))
@@ -456,8 +791,9 @@ static struct journal_keys journal_keys_sort(struct list_head *journal_entries)
 
 	keys.size = roundup_pow_of_two(nr_keys);
 
-	keys.d = kvmalloc(sizeof(keys.d[0]) * keys.size, GFP_KERNEL);
-	if (!keys.d)
+	keys.d	= kvmalloc(sizeof(keys.d[0]) * keys.size, GFP_KERNEL);
+	tmp	= kvmalloc(sizeof(keys.d[0]) * keys.size, GFP_KERNEL);
+	if (!keys.d || !tmp)
 		goto err;
 
 	list_for_each_entry(i, journal_entries, list) {
@@ -477,21 +813,19 @@ static struct journal_keys journal_keys_sort(struct list_head *journal_entries)
 			};
 	}
 
-	sort(keys.d, keys.nr, sizeof(keys.d[0]), journal_sort_key_cmp, NULL);
-
-	src = dst = keys.d;
-	while (src < keys.d + keys.nr) {
-		while (src + 1 < keys.d + keys.nr &&
-		       src[0].btree_id	== src[1].btree_id &&
-		       src[0].level	== src[1].level &&
-		       !bkey_cmp(src[0].k->k.p, src[1].k->k.p))
-			src++;
-
-		*dst++ = *src++;
-	}
+	sorted = journal_keys_sort_parallel(keys.d, tmp, &keys.nr);
+	if (!sorted)
+		goto err;
 
-	keys.nr = dst - keys.d;
+	if (sorted != keys.d)
+		swap(keys.d, tmp);
+	kvfree(tmp);
+	return keys;
 err:
+	kvfree(tmp);
+	kvfree(keys.d);
+	keys.d	= NULL;
+	keys.nr	= 0;
 	return keys;
 }
 
@@ -676,6 +1010,225 @@ static int bch2_alloc_replay_key(struct bch_fs *c, struct bkey_i *k)
 			__bch2_alloc_replay_key(&trans, k));
 }
 
+/*
+ * Leaf updates are replayed in parallel, in windows of JOURNAL_REPLAY_WINDOW
+ * keys: keys are handed out to workers by btree and position, so that updates
+ * to the same key - or, for extents, the same inode - are still applied in
+ * journal order by the same worker.
+ *
+ * Journal pins are only released between windows: updates pin the journal at
+ * the start of their window, which is never later than their own sequence
+ * number.
+ *
+ * Replaying a reflink pointer re-marks it, which updates refcounts of indirect
+ * extents in the reflink btree - so within each window the reflink btree is
+ * replayed first, on its own, before the workers for everything else start.
+ *
+ * Keys that aren't extents are committed in batches of JOURNAL_REPLAY_BATCH:
+ */
+#define JOURNAL_REPLAY_WINDOW	(1U << 14)
+#define JOURNAL_REPLAY_BATCH	16
+
+struct journal_replay_worker {
+	struct bch_fs		*c;
+	struct journal_key	*start;
+	struct journal_key	*end;
+	unsigned		idx;
+	unsigned		nr;
+	/* replaying the reflink btree, or everything else: */
+	bool			reflink;
+
+	struct task_struct	*thread;
+	struct completion	done;
+	int			ret;
+	struct journal_key	*err_key;
+};
+
+static unsigned journal_key_worker(struct journal_key *k, unsigned nr)
+{
+	enum btree_node_type type = __btree_node_type(k->level, k->btree_id);
+	u64 h = btree_node_type_is_extents(type)
+		? k->k->k.p.inode
+		: k->k->k.p.inode ^ k->k->k.p.offset;
+
+	return ((u32) hash_64(h, 32) + k->btree_id) % nr;
+}
+
+static int journal_replay_batch(struct btree_trans *trans,
+				struct journal_key **keys, unsigned nr)
+{
+	unsigned i;
+	int ret = 0;
+
+	for (i = 0; i < nr && !ret; i++)
+		ret = __bch2_journal_replay_key(trans, keys[i]->btree_id,
+						keys[i]->level, keys[i]->k);
+	return ret;
+}
+
+static int journal_replay_commit(struct btree_trans *trans,
+				 struct journal_key **keys, unsigned nr)
+{
+	unsigned commit_flags = BTREE_INSERT_NOFAIL|
+		BTREE_INSERT_LAZY_RW;
+
+	if (!keys[0]->allocated)
+		commit_flags |= BTREE_INSERT_JOURNAL_REPLAY;
+
+	return __bch2_trans_do(trans, NULL, NULL, commit_flags,
+			journal_replay_batch(trans, keys, nr));
+}
+
+static int journal_replay_worker_thread(void *arg)
+{
+	struct journal_replay_worker *w = arg;
+	struct bch_fs *c = w->c;
+	struct btree_trans trans;
+	struct journal_key *i, *batch[JOURNAL_REPLAY_BATCH];
+	unsigned nr = 0;
+	int ret = 0;
+
+	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 0);
+
+	for (i = w->start; i < w->end; i++) {
+		if (i->level ||
+		    i->btree_id == BTREE_ID_ALLOC ||
+		    (i->btree_id == BTREE_ID_REFLINK) != w->reflink ||
+		    journal_key_worker(i, w->nr) != w->idx)
+			continue;
+
+		cond_resched();
+
+		if (nr &&
+		    (nr == ARRAY_SIZE(batch) ||
+		     batch[0]->allocated != i->allocated ||
+		     i->k->k.size)) {
+			ret = journal_replay_commit(&trans, batch, nr);
+			if (ret) {
+				w->err_key = batch[0];
+				goto out;
+			}
+			nr = 0;
+		}
+
+		if (i->k->k.size) {
+			ret = bch2_extent_replay_key(c, i->btree_id, i->k);
+			if (ret) {
+				w->err_key = i;
+				goto out;
+			}
+			continue;
+		}
+
+		batch[nr++] = i;
+	}
+
+	if (nr) {
+		ret = journal_replay_commit(&trans, batch, nr);
+		if (ret)
+			w->err_key = batch[0];
+	}
+out:
+	bch2_trans_exit(&trans);
+
+	w->ret = ret;
+	complete(&w->done);
+	return 0;
+}
+
+static int journal_replay_window(struct bch_fs *c,
+				 struct journal_replay_worker *w, unsigned nr,
+				 struct journal_key *start,
+				 struct journal_key *end,
+				 struct journal_key **err_key)
+{
+	unsigned i;
+	int ret = 0;
+
+	w[0] = (struct journal_replay_worker) {
+		.c		= c,
+		.start		= start,
+		.end		= end,
+		.nr		= 1,
+		.reflink	= true,
+	};
+	init_completion(&w[0].done);
+
+	journal_replay_worker_thread(&w[0]);
+	if (w[0].ret) {
+		*err_key = w[0].err_key;
+		return w[0].ret;
+	}
+
+	for (i = 0; i < nr; i++) {
+		w[i] = (struct journal_replay_worker) {
+			.c	= c,
+			.start	= start,
+			.end	= end,
+			.idx	= i,
+			.nr	= nr,
+		};
+		init_completion(&w[i].done);
+
+		if (nr == 1)
+			continue;
+
+		w[i].thread = kthread_create(journal_replay_worker_thread, &w[i],
+					     "bch-replay/%s", c->name);
+		if (IS_ERR(w[i].thread)) {
+			w[i].thread = NULL;
+			continue;
+		}
+
+		get_task_struct(w[i].thread);
+		wake_up_process(w[i].thread);
+	}
+
+	/* Keys we couldn't start a thread for are replayed here: */
+	for (i = 0; i < nr; i++)
+		if (!w[i].thread)
+			journal_replay_worker_thread(&w[i]);
+
+	for (i = 0; i < nr; i++) {
+		wait_for_completion(&w[i].done);
+
+		if (w[i].thread) {
+			kthread_stop(w[i].thread);
+			put_task_struct(w[i].thread);
+		}
+
+		if (!ret && w[i].ret) {
+			ret = w[i].ret;
+			*err_key = w[i].err_key;
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * Keys point into the journal entries they were read from, but once a key has
+ * been replayed nothing looks at it again: free entries older than @seq as
+ * replay gets past them, so that replaying a big journal doesn't need all of it
+ * in memory until the end:
+ */
+static void journal_entries_free_before(struct bch_fs *c, u64 seq)
+{
+	struct journal_replay *i, *n;
+
+	if (c->opts.keep_journal)
+		return;
+
+	list_for_each_entry_safe(i, n, &c->journal_entries, list) {
+		if (le64_to_cpu(i->j.seq) >= seq)
+			break;
+
+		list_del(&i->list);
+		kvpfree(i, offsetof(struct journal_replay, j) +
+			vstruct_bytes(&i->j));
+	}
+}
+
 static int journal_sort_seq_cmp(const void *_l, const void *_r)
 {
 	const struct journal_key *l = _l;
@@ -691,10 +1244,16 @@ static int bch2_journal_replay(struct bch_fs *c,
 			       struct journal_keys keys)
 {
 	struct journal *j = &c->journal;
-	struct journal_key *i;
+	struct journal_key *i, *end;
+	struct journal_replay_worker *w;
+	unsigned nr_workers = c->opts.journal_replay_threads;
 	u64 seq;
 	int ret;
 
+	w = kcalloc(nr_workers, sizeof(*w), GFP_KERNEL);
+	if (!w)
+		return -ENOMEM;
+
 	sort(keys.d, keys.nr, sizeof(keys.d[0]), journal_sort_seq_cmp, NULL);
 
 	if (keys.nr)
@@ -743,23 +1302,33 @@ static int bch2_journal_replay(struct bch_fs *c,
 	j->replay_journal_seq = seq;
 
 	/*
-	 * Now replay leaf node updates:
+	 * Now replay leaf node updates - interior node updates sort first:
 	 */
-	for_each_journal_key(keys, i) {
-		cond_resched();
+	for (i = keys.d; i < keys.d + keys.nr && i->level; i++)
+		;
 
-		if (i->level || i->btree_id == BTREE_ID_ALLOC)
-			continue;
+	while (i < keys.d + keys.nr) {
+		end = i + min_t(size_t, JOURNAL_REPLAY_WINDOW,
+				keys.d + keys.nr - i);
 
 		replay_now_at(j, keys.journal_seq_base + i->journal_seq);
 
-		ret = i->k->k.size
-			? bch2_extent_replay_key(c, i->btree_id, i->k)
-			: bch2_journal_replay_key(c, i);
+		ret = journal_replay_window(c, w, nr_workers, i, end, &i);
 		if (ret)
 			goto err;
+
+		/*
+		 * Alloc and interior node keys were replayed first, and leaf
+		 * keys are in journal seq order:
+		 */
+		i = end;
+		journal_entries_free_before(c, i < keys.d + keys.nr
+					    ? keys.journal_seq_base + i->journal_seq
+					    : U64_MAX);
 	}
 
+	kfree(w);
+
 	replay_now_at(j, j->replay_journal_seq_end);
 	j->replay_journal_seq = 0;
 
@@ -767,6 +1336,7 @@ static int bch2_journal_replay(struct bch_fs *c,
 	bch2_journal_flush_all_pins(j);
 	return bch2_journal_error(j);
 err:
+	kfree(w);
 	bch_err(c, "journal replay: error %d while replaying key at btree %s level %u",
 		ret, bch2_btree_ids[i->btree_id], i->level);
 	return ret;
@@ -885,6 +1455,7 @@ static int journal_replay_early(struct bch_fs *c,
 {
 	struct journal_replay *i;
 	struct jset_entry *entry;
+	unsigned nr_replicas = c->replicas.nr;
 	int ret;
 
 	if (clean) {
@@ -910,6 +1481,24 @@ static int journal_replay_early(struct bch_fs *c,
 
 	bch2_fs_usage_initialize(c);
 
+	/*
+	 * Replicas entries that were only in the journal: the check that we
+	 * have enough devices was done against the superblock, without them -
+	 * redo it, and get them into the superblock:
+	 */
+	if (c->replicas.nr != nr_replicas) {
+		if (!bch2_fs_may_start(c)) {
+			bch_err(c, "insufficient devices for replicas entries found in journal");
+			return -EINVAL;
+		}
+
+		ret = bch2_replicas_write_sb(c);
+		if (ret) {
+			bch_err(c, "error writing replicas entries found in journal to superblock");
+			return ret;
+		}
+	}
+
 	return 0;
 }
 
@@ -1025,8 +1614,138 @@ static struct bch_sb_field_clean *read_superblock_clean(struct bch_fs *c)
 	return ERR_PTR(ret);
 }
 
+/* Mount time instrumentation: */
+
+const char * const bch2_recovery_phases[] = {
+#define x(n)	#n,
+	BCH_RECOVERY_PHASES()
+#undef x
+	NULL
+};
+
+static u64 fs_io_sectors(struct bch_fs *c, int rw)
+{
+	struct bch_dev *ca;
+	unsigned i, type;
+	u64 ret = 0;
+
+	rcu_read_lock();
+	for_each_member_device_rcu(ca, c, i, NULL)
+		for (type = 0; type < BCH_DATA_NR; type++)
+			ret += percpu_u64_get(&ca->io_done->sectors[rw][type]);
+	rcu_read_unlock();
+
+	return ret;
+}
+
+static void recovery_phase_start(struct bch_fs *c,
+				 struct recovery_phase_stats *start)
+{
+	start->duration		= local_clock();
+	start->sectors_read	= fs_io_sectors(c, READ);
+	start->sectors_written	= fs_io_sectors(c, WRITE);
+	start->keys		= atomic64_read(&c->recovery_keys_walked);
+}
+
+/*
+ * @keys is for phases that don't go through bch2_btree_and_journal_walk(), and
+ * count the keys they process themselves:
+ */
+static void recovery_phase_end(struct bch_fs *c,
+			       enum bch_recovery_phase phase,
+			       struct recovery_phase_stats *start,
+			       u64 keys)
+{
+	struct recovery_phase_stats *p = &c->recovery_phases[phase];
+
+	p->duration		+= local_clock() - start->duration;
+	p->sectors_read		+= fs_io_sectors(c, READ) - start->sectors_read;
+	p->sectors_written	+= fs_io_sectors(c, WRITE) - start->sectors_written;
+	p->keys			+= atomic64_read(&c->recovery_keys_walked) -
+		start->keys + keys;
+
+	bch_verbose(c, "%s: %llu ms, %llu sectors read, %llu written, %llu keys",
+		    bch2_recovery_phases[phase],
+		    div_u64(p->duration, NSEC_PER_MSEC),
+		    p->sectors_read, p->sectors_written, p->keys);
+}
+
+void bch2_recovery_phases_to_text(struct printbuf *out, struct bch_fs *c)
+{
+	struct recovery_phase_stats *p;
+	unsigned i;
+
+	pr_buf(out, "%-20s%12s%16s%16s%12s\n",
+	       "phase", "ms", "sectors read", "written", "keys");
+
+	for (i = 0; i < BCH_RECOVERY_PHASE_NR; i++) {
+		p = &c->recovery_phases[i];
+
+		pr_buf(out, "%-20s%12llu%16llu%16llu%12llu\n",
+		       bch2_recovery_phases[i],
+		       div_u64(p->duration, NSEC_PER_MSEC),
+		       p->sectors_read, p->sectors_written, p->keys);
+	}
+}
+
+/* One line summary, for the log: */
+static void recovery_phases_log(struct bch_fs *c)
+{
+	char buf[256];
+	struct printbuf out = PBUF(buf);
+	unsigned i;
+
+	for (i = 0; i < BCH_RECOVERY_PHASE_NR; i++)
+		if (c->recovery_phases[i].duration)
+			pr_buf(&out, " %s=%llums", bch2_recovery_phases[i],
+			       div_u64(c->recovery_phases[i].duration,
+				       NSEC_PER_MSEC));
+
+	bch_info(c, "recovery phases:%s", buf);
+}
+
+/*
+ * The biggest btrees are walked first thing after the roots are read - the
+ * alloc btree by bch2_alloc_read(), extents and inodes by gc and fsck - so
+ * start reading their roots' children right away:
+ */
+static const enum btree_id btree_roots_prefetch[] = {
+	BTREE_ID_ALLOC, BTREE_ID_EXTENTS, BTREE_ID_INODES,
+};
+
+static void btree_root_prefetch_children(struct bch_fs *c, enum btree_id id)
+{
+	struct btree *b = c->btree_roots[id].b;
+	struct btree_and_journal_iter iter;
+	struct bkey_s_c k;
+	struct bkey_buf tmp;
+	unsigned nr = 0;
+
+	if (!b || btree_node_fake(b) || !b->c.level)
+		return;
+
+	bch2_bkey_buf_init(&tmp);
+	six_lock_read(&b->c.lock, NULL, NULL);
+	bch2_btree_and_journal_iter_init_node_iter(&iter, c, b);
+
+	while (nr++ < c->opts.btree_walk_prefetch &&
+	       (k = bch2_btree_and_journal_iter_peek(&iter)).k) {
+		bch2_bkey_buf_reassemble(&tmp, c, k);
+
+		bch2_btree_node_prefetch(c, NULL, tmp.k, id, b->c.level - 1);
+
+		bch2_btree_and_journal_iter_advance(&iter);
+	}
+
+	bch2_btree_and_journal_iter_exit(&iter);
+	six_unlock_read(&b->c.lock);
+	bch2_bkey_buf_exit(&tmp, c);
+}
+
 static int read_btree_roots(struct bch_fs *c)
 {
+	struct btree *b[BTREE_ID_NR] = { NULL };
+	int err[BTREE_ID_NR] = { 0 };
 	unsigned i;
 	int ret = 0;
 
@@ -1050,9 +1769,24 @@ static int read_btree_roots(struct bch_fs *c)
 			if (i == BTREE_ID_ALLOC)
 				c->sb.compat &= ~(1ULL << BCH_COMPAT_FEAT_ALLOC_INFO);
 		}
+	}
 
-		ret = bch2_btree_root_read(c, i, &r->key, r->level);
-		if (ret) {
+	/* Issue all the root reads, then wait for them: */
+	for (i = 0; i < BTREE_ID_NR; i++) {
+		struct btree_root *r = &c->btree_roots[i];
+
+		if (r->alive &&
+		    !(i == BTREE_ID_ALLOC && c->opts.reconstruct_alloc))
+			b[i] = bch2_btree_root_read_start(c, i, &r->key,
+							  r->level);
+	}
+
+	for (i = 0; i < BTREE_ID_NR; i++)
+		if (b[i])
+			err[i] = bch2_btree_root_read_finish(c, b[i]);
+
+	for (i = 0; i < BTREE_ID_NR; i++)
+		if (err[i]) {
 			__fsck_err(c, i == BTREE_ID_ALLOC
 				   ? FSCK_CAN_IGNORE : 0,
 				   "error reading btree root %s",
@@ -1060,11 +1794,14 @@ static int read_btree_roots(struct bch_fs *c)
 			if (i == BTREE_ID_ALLOC)
 				c->sb.compat &= ~(1ULL << BCH_COMPAT_FEAT_ALLOC_INFO);
 		}
-	}
 
 	for (i = 0; i < BTREE_ID_NR; i++)
 		if (!c->btree_roots[i].b)
 			bch2_btree_root_alloc(c, i);
+
+	for (i = 0; i < ARRAY_SIZE(btree_roots_prefetch); i++)
+		if (!err[btree_roots_prefetch[i]])
+			btree_root_prefetch_children(c, btree_roots_prefetch[i]);
 fsck_err:
 	return ret;
 }
@@ -1074,6 +1811,7 @@ int bch2_fs_recovery(struct bch_fs *c)
 	const char *err = "cannot allocate memory";
 	struct bch_sb_field_clean *clean = NULL;
 	struct jset *last_journal_entry = NULL;
+	struct recovery_phase_stats phase;
 	u64 blacklist_seq, journal_seq;
 	bool write_sb = false;
 	int ret;
@@ -1110,6 +1848,8 @@ int bch2_fs_recovery(struct bch_fs *c)
 	if (!c->sb.clean || c->opts.fsck || c->opts.keep_journal) {
 		struct journal_replay *i;
 
+		recovery_phase_start(c, &phase);
+
 		ret = bch2_journal_read(c, &c->journal_entries,
 					&blacklist_seq, &journal_seq);
 		if (ret)
@@ -1131,6 +1871,8 @@ int bch2_fs_recovery(struct bch_fs *c)
 		}
 
 		if (!last_journal_entry) {
+			recovery_phase_end(c, BCH_RECOVERY_journal_read,
+					   &phase, 0);
 			fsck_err_on(!c->sb.clean, c, "no journal entries found");
 			goto use_clean;
 		}
@@ -1141,6 +1883,9 @@ int bch2_fs_recovery(struct bch_fs *c)
 			goto err;
 		}
 
+		recovery_phase_end(c, BCH_RECOVERY_journal_read, &phase,
+				   c->journal_keys.nr);
+
 		if (c->sb.clean && last_journal_entry) {
 			ret = verify_superblock_clean(c, &clean,
 						      last_journal_entry);
@@ -1198,22 +1943,28 @@ int bch2_fs_recovery(struct bch_fs *c)
 	if (ret)
 		goto err;
 
+	recovery_phase_start(c, &phase);
 	ret = read_btree_roots(c);
 	if (ret)
 		goto err;
+	recovery_phase_end(c, BCH_RECOVERY_btree_roots_read, &phase, 0);
 
 	bch_verbose(c, "starting alloc read");
 	err = "error reading allocation information";
+	recovery_phase_start(c, &phase);
 	ret = bch2_alloc_read(c, &c->journal_keys);
 	if (ret)
 		goto err;
+	recovery_phase_end(c, BCH_RECOVERY_alloc_read, &phase, 0);
 	bch_verbose(c, "alloc read done");
 
 	bch_verbose(c, "starting stripes_read");
 	err = "error reading stripes";
+	recovery_phase_start(c, &phase);
 	ret = bch2_stripes_read(c, &c->journal_keys);
 	if (ret)
 		goto err;
+	recovery_phase_end(c, BCH_RECOVERY_stripes_read, &phase, 0);
 	bch_verbose(c, "stripes_read done");
 
 	set_bit(BCH_FS_ALLOC_READ_DONE, &c->flags);
@@ -1224,13 +1975,20 @@ int bch2_fs_recovery(struct bch_fs *c)
 	    test_bit(BCH_FS_REBUILD_REPLICAS, &c->flags)) {
 		bch_info(c, "starting mark and sweep");
 		err = "error in mark and sweep";
+		recovery_phase_start(c, &phase);
 		ret = bch2_gc(c, true);
 		if (ret)
 			goto err;
+		recovery_phase_end(c, BCH_RECOVERY_initial_gc, &phase, 0);
 		bch_verbose(c, "mark and sweep done");
+	} else {
+		bch_verbose(c, "alloc info consistent, skipping mark and sweep");
 	}
 
-	bch2_stripes_heap_start(c);
+	err = "error indexing stripes";
+	ret = bch2_stripes_heap_start(c);
+	if (ret)
+		goto err;
 
 	clear_bit(BCH_FS_REBUILD_REPLICAS, &c->flags);
 	set_bit(BCH_FS_INITIAL_GC_DONE, &c->flags);
@@ -1247,11 +2005,20 @@ int bch2_fs_recovery(struct bch_fs *c)
 
 	bch_verbose(c, "starting journal replay");
 	err = "journal replay failed";
+	recovery_phase_start(c, &phase);
 	ret = bch2_journal_replay(c, c->journal_keys);
 	if (ret)
 		goto err;
+	recovery_phase_end(c, BCH_RECOVERY_journal_replay, &phase,
+			   c->journal_keys.nr);
 	bch_verbose(c, "journal replay done");
 
+	/* Nothing after replay uses the journal keys; don't hold them over fsck: */
+	if (!c->opts.keep_journal) {
+		bch2_journal_keys_free(&c->journal_keys);
+		bch2_journal_entries_free(&c->journal_entries);
+	}
+
 	if (test_bit(BCH_FS_NEED_ALLOC_WRITE, &c->flags) &&
 	    !c->opts.nochanges) {
 		/*
@@ -1262,14 +2029,19 @@ int bch2_fs_recovery(struct bch_fs *c)
 		bch_verbose(c, "writing allocation info");
 		err = "error writing out alloc info";
 		ret = bch2_stripes_write(c, BTREE_INSERT_LAZY_RW) ?:
-			bch2_alloc_write(c, BTREE_INSERT_LAZY_RW);
+			(c->opts.reconstruct_alloc
+			 ? bch2_alloc_write_reconstructed(c)
+			 : bch2_alloc_write(c, BTREE_INSERT_LAZY_RW));
 		if (ret) {
 			bch_err(c, "error writing alloc info");
 			goto err;
 		}
+		clear_bit(BCH_FS_NEED_ALLOC_WRITE, &c->flags);
 		bch_verbose(c, "alloc write done");
 	}
 
+	recovery_phase_start(c, &phase);
+
 	if (!c->sb.clean) {
 		if (!(c->sb.features & (1 << BCH_FEATURE_atomic_nlink))) {
 			bch_info(c, "checking inode link counts");
@@ -1298,6 +2070,9 @@ int bch2_fs_recovery(struct bch_fs *c)
 		bch_verbose(c, "fsck done");
 	}
 
+	if (!c->sb.clean || c->opts.fsck)
+		recovery_phase_end(c, BCH_RECOVERY_fsck, &phase, 0);
+
 	if (enabled_qtypes(c)) {
 		bch_verbose(c, "reading quotas");
 		ret = bch2_fs_quota_read(c);
@@ -1316,7 +2091,8 @@ int bch2_fs_recovery(struct bch_fs *c)
 		write_sb = true;
 	}
 
-	if (!test_bit(BCH_FS_ERROR, &c->flags)) {
+	if (!test_bit(BCH_FS_ERROR, &c->flags) &&
+	    !test_bit(BCH_FS_NEED_ALLOC_WRITE, &c->flags)) {
 		c->disk_sb.sb->compat[0] |= 1ULL << BCH_COMPAT_FEAT_ALLOC_INFO;
 		write_sb = true;
 	}
@@ -1328,6 +2104,13 @@ int bch2_fs_recovery(struct bch_fs *c)
 		write_sb = true;
 	}
 
+	if (!c->opts.nochanges &&
+	    (bch2_metadata_compression_features(c) & ~c->sb.features)) {
+		c->disk_sb.sb->features[0] |=
+			cpu_to_le64(bch2_metadata_compression_features(c));
+		write_sb = true;
+	}
+
 	if (write_sb)
 		bch2_write_super(c);
 	mutex_unlock(&c->sb_lock);
@@ -1335,6 +2118,8 @@ int bch2_fs_recovery(struct bch_fs *c)
 	if (c->journal_seq_blacklist_table &&
 	    c->journal_seq_blacklist_table->nr > 128)
 		queue_work(system_long_wq, &c->journal_seq_blacklist_gc_work);
+
+	recovery_phases_log(c);
 out:
 	ret = 0;
 err:
@@ -1376,7 +2161,25 @@ int bch2_fs_initialize(struct bch_fs *c)
 	c->disk_sb.sb->version = c->disk_sb.sb->version_min =
 		le16_to_cpu(bcachefs_metadata_version_current);
 	c->disk_sb.sb->features[0] |= 1ULL << BCH_FEATURE_atomic_nlink;
+	c->disk_sb.sb->features[0] |= 1ULL << BCH_FEATURE_accounting;
+	c->disk_sb.sb->features[0] |= 1ULL << BCH_FEATURE_lru;
+	c->disk_sb.sb->features[0] |= 1ULL << BCH_FEATURE_backpointers;
+	c->disk_sb.sb->features[0] |= 1ULL << BCH_FEATURE_rebalance_work;
 	c->disk_sb.sb->features[0] |= BCH_SB_FEATURES_ALL;
+	c->disk_sb.sb->features[0] |=
+		cpu_to_le64(bch2_metadata_compression_features(c));
+
+	/* Every btree gets an entry, to be changed later via sysfs: */
+	for (i = 0; i < BTREE_ID_NR; i++) {
+		ret = bch2_sb_btree_node_sectors_set(c, i,
+			c->btree_node_sectors[i] != c->opts.btree_node_size
+			? c->btree_node_sectors[i] : 0);
+		if (ret) {
+			mutex_unlock(&c->sb_lock);
+			err = "error writing btree node sizes";
+			goto err;
+		}
+	}
 
 	bch2_write_super(c);
 	mutex_unlock(&c->sb_lock);
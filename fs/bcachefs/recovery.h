@@ -51,10 +51,16 @@ typedef int (*btree_walk_key_fn)(struct bch_fs *c, enum btree_id id,
 
 int bch2_btree_and_journal_walk(struct bch_fs *, struct journal_keys *, enum btree_id,
 				btree_walk_node_fn, btree_walk_key_fn);
+int bch2_btree_and_journal_walk_parallel(struct bch_fs *, struct journal_keys *,
+				enum btree_id, btree_walk_node_fn,
+				btree_walk_key_fn);
 
 void bch2_journal_keys_free(struct journal_keys *);
 void bch2_journal_entries_free(struct list_head *);
 
+extern const char * const bch2_recovery_phases[];
+void bch2_recovery_phases_to_text(struct printbuf *, struct bch_fs *);
+
 int bch2_fs_recovery(struct bch_fs *);
 int bch2_fs_initialize(struct bch_fs *);
 
@@ -190,6 +190,138 @@ static struct bkey_s_c get_next_src(struct btree_iter *iter, struct bpos end)
 	return k;
 }
 
+/*
+ * Convert the extents in a range to indirect extents, ahead of remapping it:
+ * this doesn't change the file's contents, so it can be done without the
+ * inode locks and the remap that follows only has to insert reflink pointers.
+ * Progress is kept if we're interrupted:
+ */
+int bch2_make_range_indirect(struct bch_fs *c, struct bpos start,
+			     u64 sectors, u64 *journal_seq)
+{
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	struct bkey_buf sk;
+	struct bpos end = start;
+	int ret = 0;
+
+	if (!c->opts.reflink)
+		return -EOPNOTSUPP;
+
+	if (!percpu_ref_tryget(&c->writes))
+		return -EROFS;
+
+	bch2_check_set_feature(c, BCH_FEATURE_reflink);
+
+	end.offset += sectors;
+
+	bch2_bkey_buf_init(&sk);
+	bch2_trans_init(&trans, c, BTREE_ITER_MAX, 1024);
+
+	iter = bch2_trans_get_iter(&trans, BTREE_ID_EXTENTS, start,
+				   BTREE_ITER_INTENT);
+
+	while (1) {
+		bch2_trans_begin(&trans);
+
+		trans.mem_top = 0;
+
+		if (fatal_signal_pending(current)) {
+			ret = -EINTR;
+			break;
+		}
+
+		k = get_next_src(iter, end);
+		ret = bkey_err(k);
+		if (ret)
+			goto btree_err;
+
+		if (!k.k)
+			break;
+
+		if (k.k->type == KEY_TYPE_reflink_p) {
+			bch2_btree_iter_set_pos(iter, k.k->p);
+			continue;
+		}
+
+		bch2_bkey_buf_reassemble(&sk, c, k);
+		bch2_cut_front(iter->pos,	sk.k);
+		bch2_cut_back(end,		sk.k);
+
+		ret = bch2_make_extent_indirect(&trans, iter, sk.k) ?:
+			bch2_trans_commit(&trans, NULL, journal_seq,
+					  BTREE_INSERT_NOFAIL);
+		if (!ret)
+			bch2_btree_iter_set_pos(iter, sk.k->k.p);
+btree_err:
+		if (ret == -EINTR)
+			ret = 0;
+		if (ret)
+			break;
+	}
+
+	bch2_trans_iter_put(&trans, iter);
+	ret = bch2_trans_exit(&trans) ?: ret;
+	bch2_bkey_buf_exit(&sk, c);
+
+	percpu_ref_put(&c->writes);
+
+	return ret;
+}
+
+/*
+ * Runs of source reflink pointers to adjacent indirect extents - which is what
+ * converting a range of extents produces, as indirect extents are allocated
+ * sequentially - are remapped with a single reflink pointer, so that the
+ * refcount updates for the whole run go in one transaction:
+ */
+#define REMAP_MERGE_MAX		16
+
+static void remap_merge_src(struct btree_trans *trans,
+			    struct btree_iter *src_iter, struct bpos src_end,
+			    struct bkey_i *dst)
+{
+	struct bkey_i_reflink_p *dst_p = bkey_i_to_reflink_p(dst);
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	struct bpos pos = bpos_min(POS(src_iter->pos.inode,
+				       src_iter->pos.offset + dst->k.size),
+				   src_end);
+	u64 idx = le64_to_cpu(dst_p->v.idx) + dst->k.size;
+	unsigned nr = 1;
+
+	iter = bch2_trans_copy_iter(trans, src_iter);
+
+	while (nr < REMAP_MERGE_MAX &&
+	       bkey_cmp(pos, src_end) < 0) {
+		struct bkey_s_c_reflink_p p;
+		u64 sectors;
+
+		bch2_btree_iter_set_pos(iter, pos);
+		k = bch2_btree_iter_peek(iter);
+		if (bkey_err(k) || !k.k ||
+		    k.k->type != KEY_TYPE_reflink_p ||
+		    bkey_cmp(bkey_start_pos(k.k), pos))
+			break;
+
+		p = bkey_s_c_to_reflink_p(k);
+		if (le64_to_cpu(p.v->idx) != idx)
+			break;
+
+		sectors = min(k.k->p.offset, src_end.offset) - pos.offset;
+		if (dst->k.size + sectors > KEY_SIZE_MAX)
+			break;
+
+		bch2_key_resize(&dst->k, dst->k.size + sectors);
+		pos.offset	+= sectors;
+		idx		+= sectors;
+		nr++;
+	}
+
+	bch2_trans_iter_put(trans, iter);
+}
+
 s64 bch2_remap_range(struct bch_fs *c,
 		     struct bpos dst_start, struct bpos src_start,
 		     u64 remap_sectors, u64 *journal_seq,
@@ -291,6 +423,8 @@ s64 bch2_remap_range(struct bch_fs *c,
 				min(src_k.k->p.offset - src_iter->pos.offset,
 				    dst_end.offset - dst_iter->pos.offset));
 
+		remap_merge_src(&trans, src_iter, src_end, new_dst.k);
+
 		ret = bch2_extent_update(&trans, dst_iter, new_dst.k,
 					 NULL, journal_seq,
 					 new_i_size, i_sectors_delta);
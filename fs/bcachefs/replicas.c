@@ -6,6 +6,8 @@
 #include "replicas.h"
 #include "super-io.h"
 
+#include <linux/jhash.h>
+
 static int bch2_cpu_replicas_to_sb_replicas(struct bch_fs *,
 					    struct bch_replicas_cpu *);
 
@@ -194,12 +196,69 @@ static inline int __replicas_entry_idx(struct bch_replicas_cpu *r,
 	return idx < r->nr ? idx : -1;
 }
 
+/*
+ * Marking looks up the replicas entry of every key it marks, and with many
+ * devices the replicas table can have thousands of entries - so c->replicas
+ * also has an open addressing hash table, rebuilt along with the usage arrays
+ * whenever the replicas table changes:
+ */
+static inline u32 replicas_entry_hash(struct bch_replicas_entry *e)
+{
+	return jhash(e, replicas_entry_bytes(e), 0);
+}
+
+static inline int replicas_hash_find(struct bch_fs *c,
+				     struct bch_replicas_entry *search)
+{
+	unsigned entry_size = replicas_entry_bytes(search);
+	unsigned h = replicas_entry_hash(search);
+	u32 v;
+
+	if (unlikely(entry_size > c->replicas.entry_size))
+		return -1;
+
+	verify_replicas_entry(search);
+
+	while ((v = c->replicas_hash[h & c->replicas_hash_mask])) {
+		if (!memcmp(cpu_replicas_entry(&c->replicas, v - 1),
+			    search, entry_size))
+			return v - 1;
+		h++;
+	}
+
+	return -1;
+}
+
+static int replicas_hash_build(struct bch_replicas_cpu *r,
+			       u32 **hash, unsigned *mask)
+{
+	unsigned i, h, size = roundup_pow_of_two(max(r->nr * 2, 16U));
+	u32 *t = kvmalloc_array(size, sizeof(*t), GFP_KERNEL|__GFP_ZERO);
+
+	if (!t)
+		return -ENOMEM;
+
+	for (i = 0; i < r->nr; i++) {
+		for (h = replicas_entry_hash(cpu_replicas_entry(r, i));
+		     t[h & (size - 1)];
+		     h++)
+			;
+		t[h & (size - 1)] = i + 1;
+	}
+
+	*hash	= t;
+	*mask	= size - 1;
+	return 0;
+}
+
 int bch2_replicas_entry_idx(struct bch_fs *c,
 			    struct bch_replicas_entry *search)
 {
 	bch2_replicas_entry_sort(search);
 
-	return __replicas_entry_idx(&c->replicas, search);
+	return likely(c->replicas_hash)
+		? replicas_hash_find(c, search)
+		: __replicas_entry_idx(&c->replicas, search);
 }
 
 static bool __replicas_has_entry(struct bch_replicas_cpu *r,
@@ -219,7 +278,7 @@ bool bch2_replicas_marked(struct bch_fs *c,
 	verify_replicas_entry(search);
 
 	percpu_down_read(&c->mark_lock);
-	marked = __replicas_has_entry(&c->replicas, search) &&
+	marked = bch2_replicas_entry_idx(c, search) >= 0 &&
 		(likely((!c->replicas_gc.entries)) ||
 		 __replicas_has_entry(&c->replicas_gc, search));
 	percpu_up_read(&c->mark_lock);
@@ -266,59 +325,109 @@ static void __replicas_table_update_pcpu(struct bch_fs_usage __percpu *dst_p,
 
 /*
  * Resize filesystem accounting:
+ *
+ * Every transaction commit takes mark_lock for read, so we want to hold it for
+ * write for as little time as possible: the new usage arrays are allocated
+ * before taking mark_lock, and only the copy and the swap are done under it.
  */
-static int replicas_table_update(struct bch_fs *c,
-				 struct bch_replicas_cpu *new_r)
+struct replicas_table {
+	struct bch_fs_usage __percpu	*usage[JOURNAL_BUF_NR];
+	struct bch_fs_usage __percpu	*gc;
+	struct bch_fs_usage		*base;
+	struct bch_fs_usage		*scratch;
+	u32				*hash;
+	unsigned			hash_mask;
+};
+
+static void replicas_table_free(struct replicas_table *t)
+{
+	unsigned i;
+
+	kvfree(t->hash);
+	free_percpu(t->gc);
+	kfree(t->scratch);
+	for (i = 0; i < ARRAY_SIZE(t->usage); i++)
+		free_percpu(t->usage[i]);
+	kfree(t->base);
+	memset(t, 0, sizeof(*t));
+}
+
+static int replicas_table_alloc(struct bch_fs *c,
+				struct bch_replicas_cpu *new_r,
+				struct replicas_table *t,
+				bool gc)
 {
-	struct bch_fs_usage __percpu *new_usage[JOURNAL_BUF_NR];
-	struct bch_fs_usage *new_scratch = NULL;
-	struct bch_fs_usage __percpu *new_gc = NULL;
-	struct bch_fs_usage *new_base = NULL;
 	unsigned i, bytes = sizeof(struct bch_fs_usage) +
 		sizeof(u64) * new_r->nr;
-	int ret = 0;
 
-	memset(new_usage, 0, sizeof(new_usage));
+	memset(t, 0, sizeof(*t));
 
-	for (i = 0; i < ARRAY_SIZE(new_usage); i++)
-		if (!(new_usage[i] = __alloc_percpu_gfp(bytes,
+	for (i = 0; i < ARRAY_SIZE(t->usage); i++)
+		if (!(t->usage[i] = __alloc_percpu_gfp(bytes,
 					sizeof(u64), GFP_KERNEL)))
 			goto err;
 
-	if (!(new_base = kzalloc(bytes, GFP_KERNEL)) ||
-	    !(new_scratch  = kmalloc(bytes, GFP_KERNEL)) ||
-	    (c->usage_gc &&
-	     !(new_gc = __alloc_percpu_gfp(bytes, sizeof(u64), GFP_KERNEL))))
+	if (!(t->base = kzalloc(bytes, GFP_KERNEL)) ||
+	    !(t->scratch  = kmalloc(bytes, GFP_KERNEL)) ||
+	    (gc &&
+	     !(t->gc = __alloc_percpu_gfp(bytes, sizeof(u64), GFP_KERNEL))) ||
+	    replicas_hash_build(new_r, &t->hash, &t->hash_mask))
 		goto err;
 
-	for (i = 0; i < ARRAY_SIZE(new_usage); i++)
+	return 0;
+err:
+	bch_err(c, "error updating replicas table: memory allocation failure");
+	replicas_table_free(t);
+	return -ENOMEM;
+}
+
+/*
+ * Must be called with mark_lock held for write; @t must have been allocated
+ * for @new_r (and with a gc array, if gc may be running):
+ */
+static void replicas_table_swap(struct bch_fs *c,
+				struct bch_replicas_cpu *new_r,
+				struct replicas_table *t)
+{
+	unsigned i;
+
+	BUG_ON(c->usage_gc && !t->gc);
+
+	for (i = 0; i < ARRAY_SIZE(t->usage); i++)
 		if (c->usage[i])
-			__replicas_table_update_pcpu(new_usage[i], new_r,
+			__replicas_table_update_pcpu(t->usage[i], new_r,
 						     c->usage[i], &c->replicas);
 	if (c->usage_base)
-		__replicas_table_update(new_base,		new_r,
+		__replicas_table_update(t->base,		new_r,
 					c->usage_base,		&c->replicas);
 	if (c->usage_gc)
-		__replicas_table_update_pcpu(new_gc,		new_r,
+		__replicas_table_update_pcpu(t->gc,		new_r,
 					     c->usage_gc,	&c->replicas);
 
-	for (i = 0; i < ARRAY_SIZE(new_usage); i++)
-		swap(c->usage[i],	new_usage[i]);
-	swap(c->usage_base,	new_base);
-	swap(c->usage_scratch,	new_scratch);
-	swap(c->usage_gc,	new_gc);
+	for (i = 0; i < ARRAY_SIZE(t->usage); i++)
+		swap(c->usage[i],	t->usage[i]);
+	swap(c->usage_base,	t->base);
+	swap(c->usage_scratch,	t->scratch);
+	if (c->usage_gc)
+		swap(c->usage_gc, t->gc);
+	swap(c->replicas_hash,	t->hash);
+	swap(c->replicas_hash_mask, t->hash_mask);
 	swap(c->replicas,	*new_r);
-out:
-	free_percpu(new_gc);
-	kfree(new_scratch);
-	free_percpu(new_usage[1]);
-	free_percpu(new_usage[0]);
-	kfree(new_base);
-	return ret;
-err:
-	bch_err(c, "error updating replicas table: memory allocation failure");
-	ret = -ENOMEM;
-	goto out;
+}
+
+static int replicas_table_update(struct bch_fs *c,
+				 struct bch_replicas_cpu *new_r)
+{
+	struct replicas_table t;
+	int ret;
+
+	ret = replicas_table_alloc(c, new_r, &t, c->usage_gc != NULL);
+	if (ret)
+		return ret;
+
+	replicas_table_swap(c, new_r, &t);
+	replicas_table_free(&t);
+	return 0;
 }
 
 static unsigned reserve_journal_replicas(struct bch_fs *c,
@@ -352,12 +461,14 @@ static int bch2_mark_replicas_slowpath(struct bch_fs *c,
 				struct bch_replicas_entry *new_entry)
 {
 	struct bch_replicas_cpu new_r, new_gc;
+	struct replicas_table t;
 	int ret = 0;
 
 	verify_replicas_entry(new_entry);
 
 	memset(&new_r, 0, sizeof(new_r));
 	memset(&new_gc, 0, sizeof(new_gc));
+	memset(&t, 0, sizeof(t));
 
 	mutex_lock(&c->sb_lock);
 
@@ -377,6 +488,14 @@ static int bch2_mark_replicas_slowpath(struct bch_fs *c,
 		if (ret)
 			goto err;
 
+		/*
+		 * Always allocate a gc array: gc may start before we take
+		 * mark_lock:
+		 */
+		ret = replicas_table_alloc(c, &new_r, &t, true);
+		if (ret)
+			goto err;
+
 		bch2_journal_entry_res_resize(&c->journal,
 				&c->replicas_journal_res,
 				reserve_journal_replicas(c, &new_r));
@@ -388,19 +507,32 @@ static int bch2_mark_replicas_slowpath(struct bch_fs *c,
 
 	/* allocations done, now commit: */
 
-	if (new_r.entries)
+	/*
+	 * Every journal write includes a usage entry for every replicas entry
+	 * in c->replicas, and recovery adds back any replicas entries it finds
+	 * there - so once the new entry is in memory, it's persisted by the
+	 * same journal write as the first key that uses it, and the superblock
+	 * write can happen lazily (coalescing with other new entries).
+	 *
+	 * Except for journal replicas entries: those describe the journal
+	 * itself and must be in the superblock before we rely on them.
+	 */
+	if (new_r.entries && new_entry->data_type == BCH_DATA_journal)
 		bch2_write_super(c);
 
-	/* don't update in memory replicas until changes are persistent */
 	percpu_down_write(&c->mark_lock);
 	if (new_r.entries)
-		ret = replicas_table_update(c, &new_r);
+		replicas_table_swap(c, &new_r, &t);
 	if (new_gc.entries)
 		swap(new_gc, c->replicas_gc);
 	percpu_up_write(&c->mark_lock);
+
+	if (new_r.entries && new_entry->data_type != BCH_DATA_journal)
+		bch2_write_super_async(c);
 out:
 	mutex_unlock(&c->sb_lock);
 
+	replicas_table_free(&t);
 	kfree(new_r.entries);
 	kfree(new_gc.entries);
 
@@ -656,6 +788,28 @@ int bch2_replicas_set_usage(struct bch_fs *c,
 	return 0;
 }
 
+/*
+ * New replicas entries go to the superblock lazily (see
+ * bch2_mark_replicas_slowpath()), so after a crash some may only be in the
+ * journal: recovery adds them back with bch2_replicas_set_usage(), then writes
+ * them out with this:
+ */
+int bch2_replicas_write_sb(struct bch_fs *c)
+{
+	int ret;
+
+	mutex_lock(&c->sb_lock);
+	percpu_down_read(&c->mark_lock);
+	ret = bch2_cpu_replicas_to_sb_replicas(c, &c->replicas);
+	percpu_up_read(&c->mark_lock);
+
+	if (!ret)
+		bch2_write_super(c);
+	mutex_unlock(&c->sb_lock);
+
+	return ret;
+}
+
 /* Replicas tracking - superblock: */
 
 static int
@@ -729,6 +883,7 @@ int bch2_sb_replicas_to_cpu_replicas(struct bch_fs *c)
 	struct bch_sb_field_replicas *sb_v1;
 	struct bch_sb_field_replicas_v0 *sb_v0;
 	struct bch_replicas_cpu new_r = { 0, 0, NULL };
+	struct replicas_table t;
 	int ret = 0;
 
 	if ((sb_v1 = bch2_sb_get_replicas(c->disk_sb.sb)))
@@ -741,11 +896,17 @@ int bch2_sb_replicas_to_cpu_replicas(struct bch_fs *c)
 
 	bch2_cpu_replicas_sort(&new_r);
 
-	percpu_down_write(&c->mark_lock);
+	ret = replicas_table_alloc(c, &new_r, &t, true);
+	if (ret) {
+		kfree(new_r.entries);
+		return ret;
+	}
 
-	ret = replicas_table_update(c, &new_r);
+	percpu_down_write(&c->mark_lock);
+	replicas_table_swap(c, &new_r, &t);
 	percpu_up_write(&c->mark_lock);
 
+	replicas_table_free(&t);
 	kfree(new_r.entries);
 
 	return 0;
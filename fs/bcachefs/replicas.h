@@ -51,6 +51,7 @@ int bch2_replicas_gc2(struct bch_fs *);
 int bch2_replicas_set_usage(struct bch_fs *,
 			    struct bch_replicas_entry *,
 			    u64);
+int bch2_replicas_write_sb(struct bch_fs *);
 
 #define for_each_cpu_replicas_entry(_r, _i)				\
 	for (_i = (_r)->entries;					\
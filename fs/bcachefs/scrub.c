@@ -0,0 +1,513 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include "bcachefs.h"
+#include "bkey_buf.h"
+#include "btree_iter.h"
+#include "buckets.h"
+#include "checksum.h"
+#include "ec.h"
+#include "error.h"
+#include "extents.h"
+#include "io.h"
+#include "move.h"
+#include "scrub.h"
+#include "super-io.h"
+#include "super.h"
+
+#include <linux/freezer.h>
+#include <linux/ioprio.h>
+#include <linux/kthread.h>
+#include <linux/sched/clock.h>
+#include <linux/vmalloc.h>
+
+/*
+ * Background scrub:
+ *
+ * Every opts.scrub_interval seconds, read every dirty replica of every extent
+ * and every block of every erasure coded stripe, and check them against their
+ * checksums - so that media errors are found while there's still a good copy to
+ * repair from, not when the data is next needed.
+ *
+ * Replicas are read one at a time, directly from the device, throttled to
+ * opts.scrub_rate and backing off while the device is congested with foreground
+ * IO. A replica that can't be read or doesn't match its checksum is repaired by
+ * rewriting the extent off of it with the normal move path, whose reads fall
+ * back to the other replicas. Bad stripe blocks are reported: reads of them are
+ * already reconstructed from the rest of the stripe.
+ *
+ * The position of the current pass is saved in the superblock as it goes
+ * (BCH_SB_FIELD_scrub), so that a pass interrupted by unmount or a crash resumes
+ * from there.
+ */
+
+#define SCRUB_CONGESTED_DELAY_MAX	(HZ / 10)
+#define SCRUB_SAVE_INTERVAL		(60 * HZ)
+
+static const enum btree_id scrub_btrees[] = {
+	BTREE_ID_EXTENTS,
+	BTREE_ID_REFLINK,
+	BTREE_ID_EC,
+};
+
+static int scrub_btree_idx(enum btree_id id)
+{
+	unsigned i;
+
+	for (i = 0; i < ARRAY_SIZE(scrub_btrees); i++)
+		if (scrub_btrees[i] == id)
+			return i;
+	return -1;
+}
+
+static bool scrub_pass_in_progress(struct bch_fs_scrub *s)
+{
+	return s->btree_id != scrub_btrees[0] || bkey_cmp(s->pos, POS_MIN);
+}
+
+static void scrub_cursor_load(struct bch_fs *c)
+{
+	struct bch_fs_scrub *s = &c->scrub;
+	struct bch_sb_field_scrub *f;
+
+	s->btree_id		= scrub_btrees[0];
+	s->pos			= POS_MIN;
+	s->last_completed	= 0;
+
+	mutex_lock(&c->sb_lock);
+	f = bch2_sb_get_scrub(c->disk_sb.sb);
+	if (f && scrub_btree_idx(f->btree_id) >= 0) {
+		s->btree_id		= f->btree_id;
+		s->pos			= POS(le64_to_cpu(f->inode),
+					      le64_to_cpu(f->offset));
+		s->last_completed	= le64_to_cpu(f->last_completed);
+	}
+	mutex_unlock(&c->sb_lock);
+}
+
+static void scrub_cursor_save(struct bch_fs *c)
+{
+	struct bch_fs_scrub *s = &c->scrub;
+	struct bch_sb_field_scrub *f;
+
+	mutex_lock(&c->sb_lock);
+	f = bch2_sb_resize_scrub(&c->disk_sb, sizeof(*f) / sizeof(u64));
+	if (f) {
+		f->last_completed	= cpu_to_le64(s->last_completed);
+		f->inode		= cpu_to_le64(s->pos.inode);
+		f->offset		= cpu_to_le64(s->pos.offset);
+		f->btree_id		= s->btree_id;
+		memset(f->pad, 0, sizeof(f->pad));
+
+		bch2_write_super_async(c);
+	}
+	mutex_unlock(&c->sb_lock);
+
+	s->last_saved = jiffies;
+}
+
+/*
+ * Back off while the device is congested, as background moves do, then
+ * throttle to opts.scrub_rate; returns nonzero if the thread should stop:
+ */
+static int scrub_wait(struct bch_fs *c, struct bch_dev *ca)
+{
+	struct bch_fs_scrub *s = &c->scrub;
+	unsigned long delay = ca
+		? bch2_dev_congested(ca, local_clock()) *
+		  SCRUB_CONGESTED_DELAY_MAX / CONGESTED_MAX
+		: 0;
+
+	if (delay) {
+		schedule_timeout_interruptible(delay);
+		try_to_freeze();
+	}
+
+	if (!c->opts.scrub_rate)
+		return kthread_should_stop();
+
+	s->rate.rate = c->opts.scrub_rate << 11;
+
+	while ((delay = bch2_ratelimit_delay(&s->rate))) {
+		if (kthread_should_stop())
+			return 1;
+
+		schedule_timeout_interruptible(delay);
+		try_to_freeze();
+	}
+
+	return kthread_should_stop();
+}
+
+static void scrub_done(struct bch_fs *c, unsigned sectors)
+{
+	atomic64_add(sectors, &c->scrub.sectors_checked);
+
+	if (c->opts.scrub_rate)
+		bch2_ratelimit_increment(&c->scrub.rate, sectors);
+}
+
+/* Returns -EIO if the replica couldn't be read or didn't match its checksum: */
+static int scrub_ptr(struct bch_fs *c, struct bkey_s_c k,
+		     struct extent_ptr_decoded p)
+{
+	struct bch_fs_scrub *s = &c->scrub;
+	struct bch_dev *ca = bch_dev_bkey_exists(c, p.ptr.dev);
+	unsigned sectors = p.crc.compressed_size, done = 0;
+	struct bch_csum csum;
+	struct bio *bio;
+	int ret = 0;
+
+	/* Checksummed extents are never bigger than encoded_extent_max: */
+	if (p.crc.csum_type && sectors > s->buf_sectors)
+		return 0;
+
+	if (ptr_stale(ca, &p.ptr) ||
+	    !bch2_dev_get_ioref(ca, READ))
+		return 0;
+
+	while (done < sectors) {
+		unsigned len = min(sectors - done, s->buf_sectors);
+
+		bio = bio_kmalloc(GFP_KERNEL, DIV_ROUND_UP(len, PAGE_SECTORS));
+		if (!bio) {
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		bio_set_dev(bio, ca->disk_sb.bdev);
+		bio->bi_opf		= REQ_OP_READ;
+		bio->bi_iter.bi_sector	= p.ptr.offset + done;
+		bio_set_prio(bio, IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0));
+		bch2_bio_map(bio, s->buf, len << 9);
+
+		this_cpu_add(ca->io_done->sectors[READ][BCH_DATA_user], len);
+
+		ret = submit_bio_wait(bio);
+		bio_put(bio);
+
+		if (bch2_dev_inum_io_err_on(ret, ca, k.k->p.inode,
+					    bkey_start_offset(k.k),
+					    "scrub read error %i", ret)) {
+			ret = -EIO;
+			goto out;
+		}
+
+		done += len;
+		scrub_done(c, len);
+	}
+
+	/* Raced with the bucket being reused, we may have read anything: */
+	if (ptr_stale(ca, &p.ptr))
+		goto out;
+
+	if (p.crc.csum_type) {
+		csum = bch2_checksum(c, p.crc.csum_type,
+				     extent_nonce(k.k->version, p.crc),
+				     s->buf, sectors << 9);
+
+		if (bch2_crc_cmp(csum, p.crc.csum)) {
+			bch2_dev_inum_io_error(ca, k.k->p.inode,
+				bkey_start_offset(k.k),
+				"scrub: data checksum error: expected %0llx:%0llx got %0llx:%0llx (type %u)",
+				p.crc.csum.hi, p.crc.csum.lo,
+				csum.hi, csum.lo, p.crc.csum_type);
+			ret = -EIO;
+		}
+	}
+out:
+	percpu_ref_put(&ca->io_ref);
+	return ret;
+}
+
+struct scrub_repair {
+	struct bpos		pos;
+	unsigned		dev;
+};
+
+static enum data_cmd scrub_repair_pred(struct bch_fs *c, void *arg,
+				       struct bkey_s_c k,
+				       struct bch_io_opts *io_opts,
+				       struct data_opts *data_opts)
+{
+	struct scrub_repair *r = arg;
+
+	if (bkey_cmp(bkey_start_pos(k.k), r->pos) ||
+	    !bch2_bkey_has_device(k, r->dev))
+		return DATA_SKIP;
+
+	data_opts->target		= 0;
+	data_opts->nr_replicas		= 1;
+	data_opts->btree_insert_flags	= 0;
+	data_opts->rewrite_dev		= r->dev;
+	return DATA_REWRITE;
+}
+
+/* Rewrite the extent off of a bad replica, reading from the good ones: */
+static void scrub_repair(struct bch_fs *c, struct bkey_s_c k, unsigned dev)
+{
+	struct scrub_repair r = {
+		.pos	= bkey_start_pos(k.k),
+		.dev	= dev,
+	};
+	struct bch_move_stats stats = { 0 };
+	int ret;
+
+	ret = bch2_move_data(c, NULL,
+			     writepoint_hashed((unsigned long) current),
+			     r.pos, k.k->p,
+			     scrub_repair_pred, &r, &stats);
+
+	if (!ret &&
+	    atomic64_read(&stats.keys_moved) &&
+	    !atomic64_read(&stats.keys_raced))
+		atomic64_inc(&c->scrub.replicas_repaired);
+	else
+		bch_err_ratelimited(c, "scrub: error repairing extent at %llu:%llu on device %u",
+				    r.pos.inode, r.pos.offset, dev);
+}
+
+static int scrub_extent(struct bch_fs *c, struct bkey_s_c k)
+{
+	struct bkey_ptrs_c ptrs;
+	const union bch_extent_entry *entry;
+	struct extent_ptr_decoded p;
+	int ret;
+
+	if (!bkey_extent_is_direct_data(k.k))
+		return 0;
+
+	ptrs = bch2_bkey_ptrs_c(k);
+	bkey_for_each_ptr_decode(k.k, ptrs, p, entry) {
+		if (p.ptr.cached)
+			continue;
+
+		ret = scrub_wait(c, bch_dev_bkey_exists(c, p.ptr.dev));
+		if (ret)
+			return ret;
+
+		if (scrub_ptr(c, k, p) == -EIO) {
+			atomic64_inc(&c->scrub.replicas_bad);
+			scrub_repair(c, k, p.ptr.dev);
+		}
+	}
+
+	return 0;
+}
+
+static int scrub_stripe(struct bch_fs *c, struct bkey_s_c k)
+{
+	const struct bch_stripe *v;
+	int ret;
+
+	if (k.k->type != KEY_TYPE_stripe)
+		return 0;
+
+	ret = scrub_wait(c, NULL);
+	if (ret)
+		return ret;
+
+	v = bkey_s_c_to_stripe(k).v;
+
+	ret = bch2_ec_stripe_scrub(c, k);
+	if (ret < 0)
+		return 0;
+
+	scrub_done(c, le16_to_cpu(v->sectors) * v->nr_blocks);
+	atomic64_inc(&c->scrub.stripes_checked);
+
+	if (ret) {
+		atomic64_add(ret, &c->scrub.stripe_blocks_bad);
+		bch_err_ratelimited(c, "scrub: %i bad blocks in stripe %llu",
+				    ret, k.k->p.offset);
+	}
+
+	return 0;
+}
+
+/* Returns nonzero if the thread should stop: */
+static int scrub_btree(struct bch_fs *c, enum btree_id btree_id)
+{
+	struct bch_fs_scrub *s = &c->scrub;
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct bkey_buf sk;
+	struct bkey_s_c k;
+	int ret = 0;
+
+	bch2_bkey_buf_init(&sk);
+	bch2_trans_init(&trans, c, 0, 0);
+
+	iter = bch2_trans_get_iter(&trans, btree_id, s->pos,
+				   BTREE_ITER_PREFETCH);
+
+	while (1) {
+		k = bch2_btree_iter_peek(iter);
+		if (!k.k)
+			break;
+		ret = bkey_err(k);
+		if (ret == -EINTR) {
+			bch2_trans_reset(&trans, 0);
+			ret = 0;
+			continue;
+		}
+		if (ret)
+			break;
+
+		/* don't hold btree locks while doing IO: */
+		bch2_bkey_buf_reassemble(&sk, c, k);
+		k = bkey_i_to_s_c(sk.k);
+		bch2_trans_unlock(&trans);
+
+		ret = btree_id == BTREE_ID_EC
+			? scrub_stripe(c, k)
+			: scrub_extent(c, k);
+		if (ret)
+			break;
+
+		bch2_btree_iter_next(iter);
+		s->pos = iter->pos;
+
+		if (time_after(jiffies, s->last_saved + SCRUB_SAVE_INTERVAL))
+			scrub_cursor_save(c);
+
+		bch2_trans_cond_resched(&trans);
+	}
+
+	bch2_trans_exit(&trans);
+	bch2_bkey_buf_exit(&sk, c);
+
+	return ret;
+}
+
+/* Returns nonzero if the thread should stop: */
+static int scrub_pass(struct bch_fs *c)
+{
+	struct bch_fs_scrub *s = &c->scrub;
+	unsigned i = scrub_btree_idx(s->btree_id);
+	int ret;
+
+	bch2_ratelimit_reset(&s->rate);
+
+	for (; i < ARRAY_SIZE(scrub_btrees); i++) {
+		s->btree_id = scrub_btrees[i];
+
+		ret = scrub_btree(c, s->btree_id);
+		if (ret)
+			return ret;
+
+		s->pos = POS_MIN;
+	}
+
+	s->btree_id		= scrub_btrees[0];
+	s->pos			= POS_MIN;
+	s->last_completed	= ktime_get_real_seconds();
+	scrub_cursor_save(c);
+	return 0;
+}
+
+static int bch2_scrub_thread(void *arg)
+{
+	struct bch_fs *c = arg;
+	struct bch_fs_scrub *s = &c->scrub;
+	u64 now, next;
+
+	set_freezable();
+
+	while (!kthread_wait_freezable(c->opts.scrub_interval)) {
+		now	= ktime_get_real_seconds();
+		next	= s->last_completed + c->opts.scrub_interval;
+
+		if (!scrub_pass_in_progress(s) && now < next) {
+			s->state = SCRUB_WAITING;
+
+			set_current_state(TASK_INTERRUPTIBLE);
+			if (kthread_should_stop())
+				break;
+
+			/* woken early if scrub_interval changes: */
+			schedule_timeout(min_t(u64, next - now, 3600) * HZ);
+			try_to_freeze();
+			continue;
+		}
+
+		s->state = SCRUB_RUNNING;
+
+		if (scrub_pass(c))
+			break;
+	}
+
+	__set_current_state(TASK_RUNNING);
+
+	if (s->state == SCRUB_RUNNING)
+		scrub_cursor_save(c);
+	s->state = SCRUB_WAITING;
+	return 0;
+}
+
+void bch2_scrub_status_to_text(struct printbuf *out, struct bch_fs *c)
+{
+	struct bch_fs_scrub *s = &c->scrub;
+
+	pr_buf(out, "%s\n", s->state == SCRUB_RUNNING ? "running" : "waiting");
+	pr_buf(out, "pos:\t\t\t%s %llu:%llu\n",
+	       bch2_btree_ids[s->btree_id], s->pos.inode, s->pos.offset);
+	pr_buf(out, "last completed:\t\t%llu\n", s->last_completed);
+	pr_buf(out, "sectors checked:\t%llu\n",
+	       (u64) atomic64_read(&s->sectors_checked));
+	pr_buf(out, "bad replicas:\t\t%llu\n",
+	       (u64) atomic64_read(&s->replicas_bad));
+	pr_buf(out, "repaired replicas:\t%llu\n",
+	       (u64) atomic64_read(&s->replicas_repaired));
+	pr_buf(out, "stripes checked:\t%llu\n",
+	       (u64) atomic64_read(&s->stripes_checked));
+	pr_buf(out, "bad stripe blocks:\t%llu\n",
+	       (u64) atomic64_read(&s->stripe_blocks_bad));
+}
+
+void bch2_scrub_stop(struct bch_fs *c)
+{
+	struct task_struct *p;
+
+	p = rcu_dereference_protected(c->scrub.thread, 1);
+	c->scrub.thread = NULL;
+
+	if (p) {
+		/* for sychronizing with bch2_scrub_wakeup() */
+		synchronize_rcu();
+
+		kthread_stop(p);
+		put_task_struct(p);
+	}
+
+	vfree(c->scrub.buf);
+	c->scrub.buf = NULL;
+}
+
+int bch2_scrub_start(struct bch_fs *c)
+{
+	struct bch_fs_scrub *s = &c->scrub;
+	struct task_struct *p;
+
+	if (c->opts.nochanges)
+		return 0;
+
+	s->buf_sectors	= c->sb.encoded_extent_max;
+	s->buf		= vmalloc(s->buf_sectors << 9);
+	if (!s->buf)
+		return -ENOMEM;
+
+	scrub_cursor_load(c);
+	s->last_saved	= jiffies;
+
+	p = kthread_create(bch2_scrub_thread, c, "bch-scrub/%s", c->name);
+	if (IS_ERR(p)) {
+		vfree(s->buf);
+		s->buf = NULL;
+		return PTR_ERR(p);
+	}
+
+	get_task_struct(p);
+	rcu_assign_pointer(s->thread, p);
+	wake_up_process(p);
+	return 0;
+}
@@ -0,0 +1,23 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _BCACHEFS_SCRUB_H
+#define _BCACHEFS_SCRUB_H
+
+#include "scrub_types.h"
+
+static inline void bch2_scrub_wakeup(struct bch_fs *c)
+{
+	struct task_struct *p;
+
+	rcu_read_lock();
+	p = rcu_dereference(c->scrub.thread);
+	if (p)
+		wake_up_process(p);
+	rcu_read_unlock();
+}
+
+void bch2_scrub_status_to_text(struct printbuf *, struct bch_fs *);
+
+void bch2_scrub_stop(struct bch_fs *);
+int bch2_scrub_start(struct bch_fs *);
+
+#endif /* _BCACHEFS_SCRUB_H */
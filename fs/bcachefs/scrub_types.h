@@ -0,0 +1,33 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _BCACHEFS_SCRUB_TYPES_H
+#define _BCACHEFS_SCRUB_TYPES_H
+
+enum scrub_state {
+	SCRUB_WAITING,
+	SCRUB_RUNNING,
+};
+
+struct bch_fs_scrub {
+	struct task_struct __rcu *thread;
+	struct bch_ratelimit	rate;
+
+	enum scrub_state	state;
+
+	/* position of the current pass, saved in BCH_SB_FIELD_scrub: */
+	enum btree_id		btree_id;
+	struct bpos		pos;
+	u64			last_completed;
+	unsigned long		last_saved;
+
+	/* for reading one replica at a time: */
+	void			*buf;
+	unsigned		buf_sectors;
+
+	atomic64_t		sectors_checked;
+	atomic64_t		replicas_bad;
+	atomic64_t		replicas_repaired;
+	atomic64_t		stripes_checked;
+	atomic64_t		stripe_blocks_bad;
+};
+
+#endif /* _BCACHEFS_SCRUB_TYPES_H */
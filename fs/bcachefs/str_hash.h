@@ -11,6 +11,7 @@
 #include "super.h"
 
 #include <linux/crc32c.h>
+#include <linux/xxhash.h>
 #include <crypto/hash.h>
 #include <crypto/sha.h>
 
@@ -26,6 +27,8 @@ bch2_str_hash_opt_to_type(struct bch_fs *c, enum bch_str_hash_opts opt)
 		return c->sb.features & (1ULL << BCH_FEATURE_new_siphash)
 			? BCH_STR_HASH_SIPHASH
 			: BCH_STR_HASH_SIPHASH_OLD;
+	case BCH_STR_HASH_OPT_XXHASH:
+		return BCH_STR_HASH_XXHASH;
 	default:
 	     BUG();
 	}
@@ -68,6 +71,7 @@ struct bch_str_hash_ctx {
 		u32		crc32c;
 		u64		crc64;
 		SIPHASH_CTX	siphash;
+		struct xxh64_state xxhash;
 	};
 };
 
@@ -85,6 +89,9 @@ static inline void bch2_str_hash_init(struct bch_str_hash_ctx *ctx,
 	case BCH_STR_HASH_SIPHASH:
 		SipHash24_Init(&ctx->siphash, &info->siphash_key);
 		break;
+	case BCH_STR_HASH_XXHASH:
+		xxh64_reset(&ctx->xxhash, le64_to_cpu(info->crc_key));
+		break;
 	default:
 		BUG();
 	}
@@ -105,6 +112,9 @@ static inline void bch2_str_hash_update(struct bch_str_hash_ctx *ctx,
 	case BCH_STR_HASH_SIPHASH:
 		SipHash24_Update(&ctx->siphash, data, len);
 		break;
+	case BCH_STR_HASH_XXHASH:
+		xxh64_update(&ctx->xxhash, data, len);
+		break;
 	default:
 		BUG();
 	}
@@ -121,6 +131,8 @@ static inline u64 bch2_str_hash_end(struct bch_str_hash_ctx *ctx,
 	case BCH_STR_HASH_SIPHASH_OLD:
 	case BCH_STR_HASH_SIPHASH:
 		return SipHash24_End(&ctx->siphash) >> 1;
+	case BCH_STR_HASH_XXHASH:
+		return xxh64_digest(&ctx->xxhash) >> 1;
 	default:
 		BUG();
 	}
@@ -194,6 +194,40 @@ struct bch_sb_field *bch2_sb_field_resize(struct bch_sb_handle *sb,
 	return f;
 }
 
+static bool sb_resize_fits(struct bch_sb_handle *sb, ssize_t d)
+{
+	return !sb->have_layout ||
+		__vstruct_bytes(struct bch_sb, le32_to_cpu(sb->sb->u64s) + d) <=
+		512 << sb->sb->layout.sb_max_size_bits;
+}
+
+/*
+ * For optional fields: returns whether bch2_sb_field_resize() would have room
+ * in every online member's superblock, without it complaining when it doesn't:
+ */
+bool bch2_sb_field_resize_fits(struct bch_fs *c,
+			       enum bch_sb_field_type type,
+			       unsigned u64s)
+{
+	struct bch_sb_field *f = bch2_sb_field_get(c->disk_sb.sb, type);
+	ssize_t d = (ssize_t) u64s - (f ? le32_to_cpu(f->u64s) : 0);
+	struct bch_dev *ca;
+	unsigned i;
+
+	lockdep_assert_held(&c->sb_lock);
+
+	if (!sb_resize_fits(&c->disk_sb, d))
+		return false;
+
+	for_each_online_member(ca, c, i)
+		if (!sb_resize_fits(&ca->disk_sb, d)) {
+			percpu_ref_put(&ca->ref);
+			return false;
+		}
+
+	return true;
+}
+
 /* Superblock validate: */
 
 static inline void __bch2_sb_layout_size_assert(void)
@@ -637,7 +671,7 @@ static void write_super_endio(struct bio *bio)
 			       bch2_blk_status_to_str(bio->bi_status)))
 		ca->sb_write_error = 1;
 
-	closure_put(&ca->fs->sb_write);
+	closure_put(&ca->sb_write_cl);
 	percpu_ref_put(&ca->io_ref);
 }
 
@@ -658,7 +692,7 @@ static void read_back_super(struct bch_fs *c, struct bch_dev *ca)
 		     bio_sectors(bio));
 
 	percpu_ref_get(&ca->io_ref);
-	closure_bio_submit(bio, &c->sb_write);
+	closure_bio_submit(bio, &ca->sb_write_cl);
 }
 
 static void write_one_super(struct bch_fs *c, struct bch_dev *ca, unsigned idx)
@@ -686,17 +720,36 @@ static void write_one_super(struct bch_fs *c, struct bch_dev *ca, unsigned idx)
 		     bio_sectors(bio));
 
 	percpu_ref_get(&ca->io_ref);
-	closure_bio_submit(bio, &c->sb_write);
+	closure_bio_submit(bio, &ca->sb_write_cl);
+}
+
+/*
+ * Each device writes its superblock copies one at a time, so that a crash
+ * mid-write can't take out every copy - but devices don't wait on each other:
+ * a slow device only delays its own next copy, not every device's.
+ */
+static void write_super_dev(struct closure *cl)
+{
+	struct bch_dev *ca = container_of(cl, struct bch_dev, sb_write_cl);
+
+	if (ca->sb_write_error ||
+	    ca->sb_write_idx >= ca->disk_sb.sb->layout.nr_superblocks) {
+		closure_return(cl);
+		return;
+	}
+
+	write_one_super(ca->fs, ca, ca->sb_write_idx++);
+	continue_at(cl, write_super_dev, system_highpri_wq);
 }
 
 int bch2_write_super(struct bch_fs *c)
 {
 	struct closure *cl = &c->sb_write;
 	struct bch_dev *ca;
-	unsigned i, sb = 0, nr_wrote;
+	unsigned i, nr_wrote;
 	const char *err;
 	struct bch_devs_mask sb_written;
-	bool wrote, can_mount_without_written, can_mount_with_written;
+	bool can_mount_without_written, can_mount_with_written;
 	int ret = 0;
 
 	lockdep_assert_held(&c->sb_lock);
@@ -729,8 +782,11 @@ int bch2_write_super(struct bch_fs *c)
 		ca->sb_write_error = 0;
 	}
 
-	for_each_online_member(ca, c, i)
+	for_each_online_member(ca, c, i) {
+		closure_init(&ca->sb_write_cl, cl);
 		read_back_super(c, ca);
+		closure_return(&ca->sb_write_cl);
+	}
 	closure_sync(cl);
 
 	for_each_online_member(ca, c, i) {
@@ -745,17 +801,11 @@ int bch2_write_super(struct bch_fs *c)
 		}
 	}
 
-	do {
-		wrote = false;
-		for_each_online_member(ca, c, i)
-			if (!ca->sb_write_error &&
-			    sb < ca->disk_sb.sb->layout.nr_superblocks) {
-				write_one_super(c, ca, sb);
-				wrote = true;
-			}
-		closure_sync(cl);
-		sb++;
-	} while (wrote);
+	for_each_online_member(ca, c, i) {
+		ca->sb_write_idx = 0;
+		closure_call(&ca->sb_write_cl, write_super_dev, NULL, cl);
+	}
+	closure_sync(cl);
 
 	for_each_online_member(ca, c, i) {
 		if (ca->sb_write_error)
@@ -795,6 +845,27 @@ int bch2_write_super(struct bch_fs *c)
 	return ret;
 }
 
+void bch2_write_super_work(struct work_struct *work)
+{
+	struct bch_fs *c = container_of(work, struct bch_fs, sb_write_work);
+
+	mutex_lock(&c->sb_lock);
+	bch2_write_super(c);
+	mutex_unlock(&c->sb_lock);
+}
+
+/*
+ * For superblock updates that don't need to be persistent before the caller
+ * continues: these are coalesced, and the caller doesn't wait on (or hold
+ * sb_lock across) the device writes. Any number of updates made before the
+ * work runs are written out together, since it writes whatever disk_sb
+ * contains when it gets sb_lock:
+ */
+void bch2_write_super_async(struct bch_fs *c)
+{
+	queue_work(system_long_wq, &c->sb_write_work);
+}
+
 void __bch2_check_set_feature(struct bch_fs *c, unsigned feat)
 {
 	mutex_lock(&c->sb_lock);
@@ -953,6 +1024,8 @@ int bch2_fs_mark_dirty(struct bch_fs *c)
 
 	mutex_lock(&c->sb_lock);
 	SET_BCH_SB_CLEAN(c->disk_sb.sb, false);
+	/* Only valid as of a clean shutdown, and already loaded: */
+	bch2_sb_field_delete(&c->disk_sb, BCH_SB_FIELD_promote_sketch);
 	c->disk_sb.sb->features[0] |= 1ULL << BCH_FEATURE_new_extent_overwrite;
 	c->disk_sb.sb->features[0] |= 1ULL << BCH_FEATURE_extents_above_btree_updates;
 	c->disk_sb.sb->features[0] |= 1ULL << BCH_FEATURE_btree_updates_journalled;
@@ -1081,8 +1154,16 @@ void bch2_fs_mark_clean(struct bch_fs *c)
 
 	SET_BCH_SB_CLEAN(c->disk_sb.sb, true);
 
-	c->disk_sb.sb->compat[0] |= 1ULL << BCH_COMPAT_FEAT_ALLOC_INFO;
-	c->disk_sb.sb->compat[0] |= 1ULL << BCH_COMPAT_FEAT_ALLOC_METADATA;
+	/*
+	 * Alloc info and usage are only consistent on disk if everything gc
+	 * corrected was written out; otherwise the next mount has to run gc:
+	 */
+	if (!test_bit(BCH_FS_NEED_ALLOC_WRITE, &c->flags)) {
+		c->disk_sb.sb->compat[0] |= 1ULL << BCH_COMPAT_FEAT_ALLOC_INFO;
+		c->disk_sb.sb->compat[0] |= 1ULL << BCH_COMPAT_FEAT_ALLOC_METADATA;
+	} else {
+		c->disk_sb.sb->compat[0] &= ~(1ULL << BCH_COMPAT_FEAT_ALLOC_INFO);
+	}
 	c->disk_sb.sb->features[0] &= ~(1ULL << BCH_FEATURE_extents_above_btree_updates);
 	c->disk_sb.sb->features[0] &= ~(1ULL << BCH_FEATURE_btree_updates_journalled);
 
@@ -1112,6 +1193,8 @@ void bch2_fs_mark_clean(struct bch_fs *c)
 	    bcachefs_metadata_version_bkey_renumber)
 		bch2_sb_clean_renumber(sb_clean, WRITE);
 
+	bch2_promote_sketch_to_sb(c);
+
 	bch2_write_super(c);
 out:
 	mutex_unlock(&c->sb_lock);
@@ -1132,6 +1215,219 @@ static const struct bch_sb_field_ops bch_sb_field_ops_clean = {
 	.validate	= bch2_sb_validate_clean,
 };
 
+/* BCH_SB_FIELD_btree_node_size: */
+
+static unsigned btree_node_size_nr_entries(struct bch_sb_field_btree_node_size *f)
+{
+	return (vstruct_bytes(&f->field) - sizeof(*f)) / sizeof(f->sectors[0]);
+}
+
+unsigned bch2_sb_btree_node_sectors(struct bch_sb *sb, enum btree_id id)
+{
+	struct bch_sb_field_btree_node_size *f = bch2_sb_get_btree_node_size(sb);
+	unsigned sectors = f && id < btree_node_size_nr_entries(f)
+		? le16_to_cpu(f->sectors[id])
+		: 0;
+
+	return sectors ?: BCH_SB_BTREE_NODE_SIZE(sb);
+}
+
+/*
+ * Set a btree's node size - 0 for btree_node_size - in the superblock and in
+ * memory; called with sb_lock held, caller writes the superblock. Nodes already
+ * written at the old size are fine: they're split or rewritten to the new size
+ * as they're updated.
+ */
+int bch2_sb_btree_node_sectors_set(struct bch_fs *c, enum btree_id id,
+				   unsigned sectors)
+{
+	struct bch_sb_field_btree_node_size *f;
+	unsigned u64s;
+
+	lockdep_assert_held(&c->sb_lock);
+
+	if (sectors &&
+	    (!is_power_of_2(sectors) ||
+	     sectors < c->opts.block_size ||
+	     sectors > c->opts.btree_node_size))
+		return -EINVAL;
+
+	f = bch2_sb_get_btree_node_size(c->disk_sb.sb);
+	if (!f || id >= btree_node_size_nr_entries(f)) {
+		u64s = DIV_ROUND_UP(sizeof(*f) +
+				    sizeof(f->sectors[0]) * BTREE_ID_NR,
+				    sizeof(u64));
+
+		f = bch2_sb_resize_btree_node_size(&c->disk_sb, u64s);
+		if (!f)
+			return -ENOSPC;
+	}
+
+	f->sectors[id] = cpu_to_le16(sectors);
+
+	c->btree_node_sectors[id] = sectors ?: c->opts.btree_node_size;
+	c->btree_foreground_merge_threshold[id] =
+		BTREE_FOREGROUND_MERGE_THRESHOLD(c, id);
+	return 0;
+}
+
+void bch2_btree_node_sizes_to_text(struct printbuf *out, struct bch_fs *c)
+{
+	unsigned i;
+
+	for (i = 0; i < BTREE_ID_NR; i++) {
+		pr_buf(out, "%s\t", bch2_btree_ids[i]);
+		bch2_hprint(out, c->btree_node_sectors[i] << 9);
+		pr_buf(out, "\n");
+	}
+}
+
+/* From sysfs: "<btree>=<size>", size 0 for btree_node_size: */
+int bch2_btree_node_sizes_set(struct bch_fs *c, const char *buf)
+{
+	char *tmp, *p, *name;
+	u64 bytes;
+	int id, ret;
+
+	tmp = kstrdup(buf, GFP_KERNEL);
+	if (!tmp)
+		return -ENOMEM;
+
+	p = strim(tmp);
+	name = strsep(&p, "=");
+
+	ret = -EINVAL;
+	id = match_string(bch2_btree_ids, BTREE_ID_NR, name);
+	if (id < 0 || !p ||
+	    bch2_strtou64_h(p, &bytes) ||
+	    (bytes & 511) ||
+	    bytes >> 9 > U16_MAX)
+		goto out;
+
+	mutex_lock(&c->sb_lock);
+	ret = bch2_sb_btree_node_sectors_set(c, id, bytes >> 9);
+	if (!ret)
+		bch2_write_super(c);
+	mutex_unlock(&c->sb_lock);
+out:
+	kfree(tmp);
+	return ret;
+}
+
+static const char *bch2_sb_validate_btree_node_size(struct bch_sb *sb,
+						    struct bch_sb_field *f)
+{
+	struct bch_sb_field_btree_node_size *n =
+		field_to_type(f, btree_node_size);
+	unsigned i, sectors;
+
+	for (i = 0; i < btree_node_size_nr_entries(n); i++) {
+		sectors = le16_to_cpu(n->sectors[i]);
+		if (!sectors)
+			continue;
+
+		if (!is_power_of_2(sectors))
+			return "invalid btree node size: not a power of two";
+
+		if (sectors < le16_to_cpu(sb->block_size))
+			return "invalid btree node size: smaller than block size";
+
+		if (sectors > BCH_SB_BTREE_NODE_SIZE(sb))
+			return "invalid btree node size: larger than btree_node_size";
+	}
+
+	return NULL;
+}
+
+static void bch2_sb_btree_node_size_to_text(struct printbuf *out,
+					    struct bch_sb *sb,
+					    struct bch_sb_field *f)
+{
+	struct bch_sb_field_btree_node_size *n =
+		field_to_type(f, btree_node_size);
+	unsigned i;
+
+	for (i = 0; i < btree_node_size_nr_entries(n); i++) {
+		if (!n->sectors[i])
+			continue;
+
+		if (i < BTREE_ID_NR)
+			pr_buf(out, "%s", bch2_btree_ids[i]);
+		else
+			pr_buf(out, "%u", i);
+
+		pr_buf(out, "=");
+		bch2_hprint(out, le16_to_cpu(n->sectors[i]) << 9);
+		pr_buf(out, " ");
+	}
+}
+
+static const struct bch_sb_field_ops bch_sb_field_ops_btree_node_size = {
+	.validate	= bch2_sb_validate_btree_node_size,
+	.to_text	= bch2_sb_btree_node_size_to_text,
+};
+
+/* BCH_SB_FIELD_promote_sketch: */
+
+static const char *bch2_sb_validate_promote_sketch(struct bch_sb *sb,
+						   struct bch_sb_field *f)
+{
+	struct bch_sb_field_promote_sketch *s =
+		field_to_type(f, promote_sketch);
+
+	if (vstruct_bytes(&s->field) <
+	    sizeof(*s) + DIV_ROUND_UP(le32_to_cpu(s->nr), 2))
+		return "invalid promote sketch: too small";
+
+	return NULL;
+}
+
+static void bch2_sb_promote_sketch_to_text(struct printbuf *out,
+					   struct bch_sb *sb,
+					   struct bch_sb_field *f)
+{
+	struct bch_sb_field_promote_sketch *s =
+		field_to_type(f, promote_sketch);
+
+	pr_buf(out, "%u counters", le32_to_cpu(s->nr));
+}
+
+static const struct bch_sb_field_ops bch_sb_field_ops_promote_sketch = {
+	.validate	= bch2_sb_validate_promote_sketch,
+	.to_text	= bch2_sb_promote_sketch_to_text,
+};
+
+/* BCH_SB_FIELD_scrub: */
+
+static const char *bch2_sb_validate_scrub(struct bch_sb *sb,
+					  struct bch_sb_field *f)
+{
+	struct bch_sb_field_scrub *s = field_to_type(f, scrub);
+
+	if (vstruct_bytes(&s->field) < sizeof(*s))
+		return "invalid scrub field: too small";
+
+	return NULL;
+}
+
+static void bch2_sb_scrub_to_text(struct printbuf *out,
+				  struct bch_sb *sb,
+				  struct bch_sb_field *f)
+{
+	struct bch_sb_field_scrub *s = field_to_type(f, scrub);
+
+	pr_buf(out, "last completed %llu position %u:%llu:%llu",
+	       le64_to_cpu(s->last_completed),
+	       s->btree_id,
+	       le64_to_cpu(s->inode),
+	       le64_to_cpu(s->offset));
+}
+
+static const struct bch_sb_field_ops bch_sb_field_ops_scrub = {
+	.validate	= bch2_sb_validate_scrub,
+	.to_text	= bch2_sb_scrub_to_text,
+};
+
 static const struct bch_sb_field_ops *bch2_sb_field_ops[] = {
 #define x(f, nr)					\
 	[BCH_SB_FIELD_##f] = &bch_sb_field_ops_##f,
@@ -10,6 +10,8 @@
 #include <asm/byteorder.h>
 
 struct bch_sb_field *bch2_sb_field_get(struct bch_sb *, enum bch_sb_field_type);
+bool bch2_sb_field_resize_fits(struct bch_fs *, enum bch_sb_field_type,
+			       unsigned);
 struct bch_sb_field *bch2_sb_field_resize(struct bch_sb_handle *,
 					  enum bch_sb_field_type, unsigned);
 void bch2_sb_field_delete(struct bch_sb_handle *, enum bch_sb_field_type);
@@ -70,6 +72,8 @@ const char *bch2_sb_validate(struct bch_sb_handle *);
 
 int bch2_read_super(const char *, struct bch_opts *, struct bch_sb_handle *);
 int bch2_write_super(struct bch_fs *);
+void bch2_write_super_work(struct work_struct *);
+void bch2_write_super_async(struct bch_fs *);
 void __bch2_check_set_feature(struct bch_fs *, unsigned);
 
 static inline void bch2_check_set_feature(struct bch_fs *c, unsigned feat)
@@ -130,6 +134,13 @@ void bch2_sb_clean_renumber(struct bch_sb_field_clean *, int);
 int bch2_fs_mark_dirty(struct bch_fs *);
 void bch2_fs_mark_clean(struct bch_fs *);
 
+/* BCH_SB_FIELD_btree_node_size: */
+
+unsigned bch2_sb_btree_node_sectors(struct bch_sb *, enum btree_id);
+int bch2_sb_btree_node_sectors_set(struct bch_fs *, enum btree_id, unsigned);
+void bch2_btree_node_sizes_to_text(struct printbuf *, struct bch_fs *);
+int bch2_btree_node_sizes_set(struct bch_fs *, const char *);
+
 void bch2_sb_field_to_text(struct printbuf *, struct bch_sb *,
 			   struct bch_sb_field *);
 
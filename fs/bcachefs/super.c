@@ -16,11 +16,13 @@
 #include "btree_key_cache.h"
 #include "btree_update_interior.h"
 #include "btree_io.h"
+#include "btree_write_buffer.h"
 #include "chardev.h"
 #include "checksum.h"
 #include "clock.h"
 #include "compress.h"
 #include "debug.h"
+#include "dedup.h"
 #include "disk_groups.h"
 #include "ec.h"
 #include "error.h"
@@ -32,6 +34,7 @@
 #include "journal.h"
 #include "journal_reclaim.h"
 #include "journal_seq_blacklist.h"
+#include "lru.h"
 #include "move.h"
 #include "migrate.h"
 #include "movinggc.h"
@@ -39,9 +42,11 @@
 #include "rebalance.h"
 #include "recovery.h"
 #include "replicas.h"
+#include "scrub.h"
 #include "super.h"
 #include "super-io.h"
 #include "sysfs.h"
+#include "usage_history.h"
 
 #include <linux/backing-dev.h>
 #include <linux/blkdev.h>
@@ -186,7 +191,10 @@ static void __bch2_fs_read_only(struct bch_fs *c)
 {
 	struct bch_dev *ca;
 	unsigned i, clean_passes = 0;
+	int ret;
 
+	bch2_dedup_stop(c);
+	bch2_scrub_stop(c);
 	bch2_rebalance_stop(c);
 	bch2_copygc_stop(c);
 	bch2_gc_thread_stop(c);
@@ -204,6 +212,24 @@ static void __bch2_fs_read_only(struct bch_fs *c)
 	if (!test_bit(BCH_FS_ALLOCATOR_RUNNING, &c->flags))
 		goto nowrote_alloc;
 
+	/*
+	 * gc may have corrected alloc info in memory without writing it out:
+	 * write it now, so that alloc info on disk is consistent when we mark
+	 * the filesystem clean and the next mount can skip gc:
+	 */
+	if (test_bit(BCH_FS_NEED_ALLOC_WRITE, &c->flags)) {
+		bch_verbose(c, "writing allocation info");
+
+		ret = bch2_stripes_write(c, BTREE_INSERT_NOCHECK_RW) ?:
+			bch2_alloc_write(c, BTREE_INSERT_NOCHECK_RW);
+		if (ret) {
+			bch_err(c, "error %i writing alloc info", ret);
+			goto nowrote_alloc;
+		}
+
+		clear_bit(BCH_FS_NEED_ALLOC_WRITE, &c->flags);
+	}
+
 	bch_verbose(c, "flushing journal and stopping allocators");
 
 	bch2_journal_flush_all_pins(&c->journal);
@@ -286,7 +312,10 @@ void bch2_fs_read_only(struct bch_fs *c)
 	percpu_ref_kill(&c->writes);
 
 	cancel_work_sync(&c->ec_stripe_delete_work);
+	cancel_delayed_work_sync(&c->btree_merge_work);
+	cancel_delayed_work_sync(&c->btree_compact_work);
 	cancel_delayed_work(&c->pd_controllers_update);
+	bch2_fs_usage_history_stop(c);
 
 	/*
 	 * If we're not doing an emergency shutdown, we want to wait on
@@ -305,6 +334,10 @@ void bch2_fs_read_only(struct bch_fs *c)
 
 	__bch2_fs_read_only(c);
 
+	/* Commits from __bch2_fs_read_only() may have queued them again: */
+	cancel_delayed_work_sync(&c->btree_merge_work);
+	cancel_delayed_work_sync(&c->btree_compact_work);
+
 	wait_event(bch_read_only_wait,
 		   test_bit(BCH_FS_WRITE_DISABLE_COMPLETE, &c->flags));
 
@@ -371,7 +404,20 @@ static int bch2_fs_read_write_late(struct bch_fs *c)
 		return ret;
 	}
 
+	ret = bch2_scrub_start(c);
+	if (ret) {
+		bch_err(c, "error starting scrub thread");
+		return ret;
+	}
+
+	ret = bch2_dedup_start(c);
+	if (ret) {
+		bch_err(c, "error starting dedup thread");
+		return ret;
+	}
+
 	schedule_delayed_work(&c->pd_controllers_update, 5 * HZ);
+	bch2_fs_usage_history_start(c);
 
 	schedule_work(&c->ec_stripe_delete_work);
 
@@ -463,15 +509,21 @@ static void __bch2_fs_free(struct bch_fs *c)
 	unsigned i;
 	int cpu;
 
+	cancel_delayed_work_sync(&c->btree_merge_work);
+	cancel_delayed_work_sync(&c->btree_compact_work);
+
 	for (i = 0; i < BCH_TIME_STAT_NR; i++)
 		bch2_time_stats_exit(&c->times[i]);
 
+	bch2_fs_move_exit(c);
+	bch2_fs_usage_history_exit(c);
 	bch2_fs_quota_exit(c);
 	bch2_fs_fsio_exit(c);
 	bch2_fs_ec_exit(c);
 	bch2_fs_encryption_exit(c);
 	bch2_fs_io_exit(c);
 	bch2_fs_btree_interior_update_exit(c);
+	bch2_fs_btree_write_buffer_exit(c);
 	bch2_fs_btree_iter_exit(c);
 	bch2_fs_btree_key_cache_exit(&c->btree_key_cache);
 	bch2_fs_btree_cache_exit(c);
@@ -496,15 +548,26 @@ static void __bch2_fs_free(struct bch_fs *c)
 	mempool_exit(&c->large_bkey_pool);
 	mempool_exit(&c->btree_bounce_pool);
 	bioset_exit(&c->btree_bio);
+	mempool_exit(&c->btree_read_bsets);
 	mempool_exit(&c->fill_iter);
 	percpu_ref_exit(&c->writes);
+	kvfree(c->replicas_hash);
 	kfree(c->replicas.entries);
 	kfree(c->replicas_gc.entries);
 	kfree(rcu_dereference_protected(c->disk_groups, 1));
 	kfree(c->journal_seq_blacklist_table);
-	kfree(c->unused_inode_hints);
-	free_heap(&c->copygc_heap);
-
+	kfree(c->inode_alloc_shards);
+
+	if (c->move_read_complete_wq)
+		destroy_workqueue(c->move_read_complete_wq);
+	if (c->read_complete_unbound_wq)
+		destroy_workqueue(c->read_complete_unbound_wq);
+	if (c->read_complete_wq)
+		destroy_workqueue(c->read_complete_wq);
+	if (c->btree_read_complete_wq)
+		destroy_workqueue(c->btree_read_complete_wq);
+	if (c->move_wq)
+		destroy_workqueue(c->move_wq);
 	if (c->copygc_wq)
 		destroy_workqueue(c->copygc_wq);
 	if (c->wq)
@@ -562,7 +625,9 @@ void __bch2_fs_stop(struct bch_fs *c)
 
 	cancel_work_sync(&c->btree_write_error_work);
 	cancel_delayed_work_sync(&c->pd_controllers_update);
+	bch2_fs_usage_history_stop(c);
 	cancel_work_sync(&c->read_only_work);
+	flush_work(&c->sb_write_work);
 
 	for (i = 0; i < c->sb.nr_devices; i++)
 		if (c->devs[i])
@@ -670,10 +735,12 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 	INIT_WORK(&c->read_only_work, bch2_fs_read_only_work);
 
 	init_rwsem(&c->gc_lock);
+	spin_lock_init(&c->gc_oldest_gen_lock);
 
 	for (i = 0; i < BCH_TIME_STAT_NR; i++)
 		bch2_time_stats_init(&c->times[i]);
 
+	bch2_fs_move_init(c);
 	bch2_fs_copygc_init(c);
 	bch2_fs_btree_key_cache_init_early(&c->btree_key_cache);
 	bch2_fs_allocator_background_init(c);
@@ -690,12 +757,18 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 	bio_list_init(&c->btree_write_error_list);
 	spin_lock_init(&c->btree_write_error_lock);
 	INIT_WORK(&c->btree_write_error_work, bch2_btree_write_error_work);
+	init_llist_head(&c->inode_rm_list);
+	INIT_WORK(&c->inode_rm_work, bch2_inode_rm_work);
 
 	INIT_WORK(&c->journal_seq_blacklist_gc_work,
 		  bch2_blacklist_entries_gc);
+	bch2_fs_btree_merge_init(c);
+	bch2_fs_btree_compact_init(c);
+	INIT_WORK(&c->sb_write_work, bch2_write_super_work);
 
 	INIT_LIST_HEAD(&c->journal_entries);
 	INIT_LIST_HEAD(&c->journal_iters);
+	spin_lock_init(&c->journal_iters_lock);
 
 	INIT_LIST_HEAD(&c->fsck_errors);
 	mutex_init(&c->fsck_error_lock);
@@ -705,12 +778,15 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 
 	INIT_LIST_HEAD(&c->ec_stripe_new_list);
 	mutex_init(&c->ec_stripe_new_lock);
+	mutex_init(&c->ec_recov_cache_lock);
 
 	spin_lock_init(&c->ec_stripes_heap_lock);
 
 	seqcount_init(&c->gc_pos_lock);
 
 	seqcount_init(&c->usage_lock);
+	spin_lock_init(&c->usage_cached_lock);
+	seqcount_init(&c->usage_cached_seq);
 
 	sema_init(&c->io_in_flight, 64);
 
@@ -746,7 +822,14 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 	bch2_opts_apply(&c->opts, opts);
 
 	c->block_bits		= ilog2(c->opts.block_size);
-	c->btree_foreground_merge_threshold = BTREE_FOREGROUND_MERGE_THRESHOLD(c);
+
+	for (i = 0; i < BTREE_ID_NR; i++) {
+		c->btree_node_sectors[i] =
+			min_t(unsigned, bch2_sb_btree_node_sectors(sb, i),
+			      c->opts.btree_node_size);
+		c->btree_foreground_merge_threshold[i] =
+			BTREE_FOREGROUND_MERGE_THRESHOLD(c, i);
+	}
 
 	if (bch2_fs_init_fault("fs_alloc"))
 		goto err;
@@ -758,12 +841,25 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 	c->inode_shard_bits = ilog2(roundup_pow_of_two(num_possible_cpus()));
 
 	if (!(c->wq = alloc_workqueue("bcachefs",
-				WQ_FREEZABLE|WQ_MEM_RECLAIM|WQ_CPU_INTENSIVE, 1)) ||
+				WQ_FREEZABLE|WQ_MEM_RECLAIM|WQ_CPU_INTENSIVE|WQ_HIGHPRI, 1)) ||
 	    !(c->copygc_wq = alloc_workqueue("bcachefs_copygc",
 				WQ_FREEZABLE|WQ_MEM_RECLAIM|WQ_CPU_INTENSIVE, 1)) ||
+	    !(c->move_wq = alloc_workqueue("bcachefs_move",
+				WQ_FREEZABLE|WQ_MEM_RECLAIM|WQ_CPU_INTENSIVE, 1)) ||
+	    !(c->btree_read_complete_wq = alloc_workqueue("bcachefs_btree_read_complete",
+				WQ_UNBOUND|WQ_HIGHPRI|WQ_MEM_RECLAIM, 0)) ||
+	    !(c->read_complete_wq = alloc_workqueue("bcachefs_read_complete",
+				WQ_HIGHPRI|WQ_MEM_RECLAIM, 0)) ||
+	    !(c->read_complete_unbound_wq = alloc_workqueue("bcachefs_read_complete_unbound",
+				WQ_UNBOUND|WQ_HIGHPRI|WQ_MEM_RECLAIM, 0)) ||
+	    !(c->move_read_complete_wq = alloc_workqueue("bcachefs_move_read_complete",
+				WQ_UNBOUND|WQ_MEM_RECLAIM, 0)) ||
 	    percpu_ref_init(&c->writes, bch2_writes_disabled,
 			    PERCPU_REF_INIT_DEAD, GFP_KERNEL) ||
 	    mempool_init_kmalloc_pool(&c->fill_iter, 1, iter_size) ||
+	    mempool_init_kvpmalloc_pool(&c->btree_read_bsets, 1,
+					btree_blocks(c) *
+					sizeof(struct btree_read_bset)) ||
 	    bioset_init(&c->btree_bio, 1,
 			max(offsetof(struct btree_read_bio, bio),
 			    offsetof(struct btree_write_bio, wbio.bio)),
@@ -773,8 +869,8 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 	    mempool_init_kvpmalloc_pool(&c->btree_bounce_pool, 1,
 					btree_bytes(c)) ||
 	    mempool_init_kmalloc_pool(&c->large_bkey_pool, 1, 2048) ||
-	    !(c->unused_inode_hints = kcalloc(1U << c->inode_shard_bits,
-					      sizeof(u64), GFP_KERNEL)) ||
+	    !(c->inode_alloc_shards = kcalloc(1U << c->inode_shard_bits,
+				sizeof(struct inode_alloc_shard), GFP_KERNEL)) ||
 	    bch2_io_clock_init(&c->io_clock[READ]) ||
 	    bch2_io_clock_init(&c->io_clock[WRITE]) ||
 	    bch2_fs_journal_init(&c->journal) ||
@@ -782,12 +878,14 @@ static struct bch_fs *bch2_fs_alloc(struct bch_sb *sb, struct bch_opts opts)
 	    bch2_fs_btree_cache_init(c) ||
 	    bch2_fs_btree_key_cache_init(&c->btree_key_cache) ||
 	    bch2_fs_btree_iter_init(c) ||
+	    bch2_fs_btree_write_buffer_init(c) ||
 	    bch2_fs_btree_interior_update_init(c) ||
 	    bch2_fs_io_init(c) ||
 	    bch2_fs_encryption_init(c) ||
 	    bch2_fs_compress_init(c) ||
 	    bch2_fs_ec_init(c) ||
-	    bch2_fs_fsio_init(c))
+	    bch2_fs_fsio_init(c) ||
+	    bch2_fs_usage_history_init(c))
 		goto err;
 
 	mi = bch2_sb_get_members(c->disk_sb.sb);
@@ -1002,6 +1100,8 @@ static void bch2_dev_release(struct kobject *kobj)
 static void bch2_dev_free(struct bch_dev *ca)
 {
 	cancel_work_sync(&ca->io_error_work);
+	flush_work(&ca->write_coalesce_work);
+	cancel_work_sync(&ca->lru_cleanup_work);
 
 	if (ca->kobj.state_in_sysfs &&
 	    ca->disk_sb.bdev)
@@ -1015,8 +1115,10 @@ static void bch2_dev_free(struct bch_dev *ca)
 	bch2_dev_journal_exit(ca);
 
 	free_percpu(ca->io_done);
+	bch2_dev_io_latency_free(ca);
 	bioset_exit(&ca->replica_set);
 	bch2_dev_buckets_free(ca);
+	free_heap(&ca->copygc_heap);
 	free_page((unsigned long) ca->sb_read_scratch);
 
 	bch2_time_stats_exit(&ca->io_latency[WRITE]);
@@ -1113,6 +1215,14 @@ static struct bch_dev *__bch2_dev_alloc(struct bch_fs *c,
 
 	INIT_WORK(&ca->io_error_work, bch2_io_error_work);
 
+	spin_lock_init(&ca->write_coalesce_lock);
+	bio_list_init(&ca->write_coalesce_bios);
+	INIT_WORK(&ca->write_coalesce_work, bch2_dev_write_coalesce_work);
+	INIT_WORK(&ca->lru_cleanup_work, bch2_dev_lru_cleanup_work);
+	bch2_dev_copygc_init(ca);
+
+	ca->numa_node = NUMA_NO_NODE;
+
 	bch2_time_stats_init(&ca->io_latency[READ]);
 	bch2_time_stats_init(&ca->io_latency[WRITE]);
 
@@ -1130,7 +1240,8 @@ static struct bch_dev *__bch2_dev_alloc(struct bch_fs *c,
 	    bch2_dev_buckets_alloc(c, ca) ||
 	    bioset_init(&ca->replica_set, 4,
 			offsetof(struct bch_write_bio, bio), 0) ||
-	    !(ca->io_done	= alloc_percpu(*ca->io_done)))
+	    !(ca->io_done	= alloc_percpu(*ca->io_done)) ||
+	    bch2_dev_io_latency_alloc(ca))
 		goto err;
 
 	return ca;
@@ -1196,6 +1307,24 @@ static int __bch2_dev_attach_bdev(struct bch_dev *ca, struct bch_sb_handle *sb)
 		return -EINVAL;
 	}
 
+	if (bdev_is_zoned(sb->bdev)) {
+		/*
+		 * We don't yet guarantee that writes within a bucket are
+		 * submitted in order, which host managed devices require:
+		 */
+		if (bdev_zoned_model(sb->bdev) == BLK_ZONED_HM) {
+			bch_err(ca, "cannot online: host managed zoned devices not supported");
+			return -EINVAL;
+		}
+
+		if (ca->mi.bucket_size != bdev_zone_sectors(sb->bdev)) {
+			bch_err(ca, "cannot online: bucket size %u must match zone size %llu",
+				ca->mi.bucket_size,
+				(u64) bdev_zone_sectors(sb->bdev));
+			return -EINVAL;
+		}
+	}
+
 	BUG_ON(!percpu_ref_is_zero(&ca->io_ref));
 
 	if (get_capacity(sb->bdev->bd_disk) <
@@ -1214,6 +1343,8 @@ static int __bch2_dev_attach_bdev(struct bch_dev *ca, struct bch_sb_handle *sb)
 		ca->disk_sb.bdev->bd_holder = ca;
 	memset(sb, 0, sizeof(*sb));
 
+	ca->numa_node = bdev_get_queue(ca->disk_sb.bdev)->node;
+
 	percpu_ref_reinit(&ca->io_ref);
 
 	return 0;
@@ -1305,7 +1436,7 @@ bool bch2_dev_state_allowed(struct bch_fs *c, struct bch_dev *ca,
 	}
 }
 
-static bool bch2_fs_may_start(struct bch_fs *c)
+bool bch2_fs_may_start(struct bch_fs *c)
 {
 	struct bch_sb_field_members *mi;
 	struct bch_dev *ca;
@@ -1343,6 +1474,9 @@ static bool bch2_fs_may_start(struct bch_fs *c)
 
 static void __bch2_dev_read_only(struct bch_fs *c, struct bch_dev *ca)
 {
+	struct bch_dev *ca2;
+	unsigned i;
+
 	/*
 	 * Device going read only means the copygc reserve get smaller, so we
 	 * don't want that happening while copygc is in progress:
@@ -1356,7 +1490,9 @@ static void __bch2_dev_read_only(struct bch_fs *c, struct bch_dev *ca)
 	bch2_dev_allocator_remove(c, ca);
 	bch2_dev_journal_stop(&c->journal, ca);
 
-	bch2_copygc_start(c);
+	for_each_rw_member(ca2, c, i)
+		if (ca2 != ca)
+			bch2_dev_copygc_start(ca2);
 }
 
 static const char *__bch2_dev_read_write(struct bch_fs *c, struct bch_dev *ca)
@@ -1371,6 +1507,10 @@ static const char *__bch2_dev_read_write(struct bch_fs *c, struct bch_dev *ca)
 	if (bch2_dev_allocator_start(ca))
 		return "error starting allocator thread";
 
+	if (test_bit(BCH_FS_RW, &c->flags) &&
+	    bch2_dev_copygc_start(ca))
+		return "error starting copygc thread";
+
 	return NULL;
 }
 
@@ -1535,6 +1675,11 @@ int bch2_dev_remove(struct bch_fs *c, struct bch_dev *ca, int flags)
 	mi = bch2_sb_get_members(c->disk_sb.sb);
 	memset(&mi->members[dev_idx].uuid, 0, sizeof(mi->members[dev_idx].uuid));
 
+	/* Drop the removed device from the cached group masks: */
+	ret = bch2_sb_disk_groups_to_cpu(c);
+	if (ret)
+		bch_err(c, "error updating disk groups: %i", ret);
+
 	bch2_write_super(c);
 
 	mutex_unlock(&c->sb_lock);
@@ -1657,6 +1802,10 @@ int bch2_dev_add(struct bch_fs *c, const char *path)
 	ca->disk_sb.sb->dev_idx	= dev_idx;
 	bch2_dev_attach(c, ca, dev_idx);
 
+	ret = bch2_sb_disk_groups_to_cpu(c);
+	if (ret)
+		bch_err(c, "error updating disk groups: %i", ret);
+
 	bch2_write_super(c);
 	mutex_unlock(&c->sb_lock);
 
@@ -2050,5 +2199,15 @@ static int __init bcachefs_init(void)
 BCH_DEBUG_PARAMS()
 #undef BCH_DEBUG_PARAM
 
+#ifdef CONFIG_BCACHEFS_DEBUG
+#define BCH_VERIFY_RATE(name, description)				\
+	unsigned bch2_verify_##name##_rate = 1;				\
+	module_param_named(verify_##name##_rate,			\
+			   bch2_verify_##name##_rate, uint, 0644);	\
+	MODULE_PARM_DESC(verify_##name##_rate, description);
+BCH_VERIFY_RATES()
+#undef BCH_VERIFY_RATE
+#endif
+
 module_exit(bcachefs_exit);
 module_init(bcachefs_init);
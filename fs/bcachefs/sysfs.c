@@ -15,22 +15,30 @@
 #include "btree_io.h"
 #include "btree_iter.h"
 #include "btree_key_cache.h"
+#include "btree_write_buffer.h"
 #include "btree_update.h"
 #include "btree_update_interior.h"
 #include "btree_gc.h"
 #include "buckets.h"
 #include "clock.h"
+#include "dedup.h"
 #include "disk_groups.h"
 #include "ec.h"
 #include "inode.h"
+#include "io.h"
 #include "journal.h"
+#include "journal_reclaim.h"
 #include "keylist.h"
 #include "move.h"
+#include "movinggc.h"
 #include "opts.h"
 #include "rebalance.h"
+#include "recovery.h"
 #include "replicas.h"
+#include "scrub.h"
 #include "super-io.h"
 #include "tests.h"
+#include "usage_history.h"
 
 #include <linux/blkdev.h>
 #include <linux/sort.h>
@@ -134,6 +142,7 @@ do {									\
 write_attribute(trigger_journal_flush);
 write_attribute(trigger_btree_coalesce);
 write_attribute(trigger_gc);
+write_attribute(trigger_dedup);
 write_attribute(prune_cache);
 rw_attribute(btree_gc_periodic);
 
@@ -151,6 +160,7 @@ read_attribute(io_latency_read);
 read_attribute(io_latency_write);
 read_attribute(io_latency_stats_read);
 read_attribute(io_latency_stats_write);
+read_attribute(io_latency_by_type);
 read_attribute(congested);
 
 read_attribute(bucket_quantiles_last_read);
@@ -161,14 +171,22 @@ read_attribute(bucket_quantiles_oldest_gen);
 read_attribute(reserve_stats);
 read_attribute(btree_cache_size);
 read_attribute(compression_stats);
+read_attribute(usage_history);
+read_attribute(cache_stats);
 read_attribute(journal_debug);
 read_attribute(journal_pins);
 read_attribute(btree_updates);
 read_attribute(dirty_btree_nodes);
 read_attribute(btree_cache);
+read_attribute(btree_cache_stats);
+read_attribute(mempools);
 read_attribute(btree_key_cache);
 read_attribute(btree_transactions);
+read_attribute(btree_lockless_stats);
+read_attribute(btree_trans_restarts);
+read_attribute(btree_write_buffer);
 read_attribute(stripes_heap);
+read_attribute(recovery_phases);
 
 read_attribute(internal_uuid);
 
@@ -177,11 +195,15 @@ read_attribute(alloc_debug);
 write_attribute(wake_allocator);
 
 read_attribute(read_realloc_races);
+read_attribute(read_hedges);
+read_attribute(read_hedges_won);
 read_attribute(extent_migrate_done);
 read_attribute(extent_migrate_raced);
 
 rw_attribute(journal_write_delay_ms);
+rw_attribute(journal_write_delay_adaptive);
 rw_attribute(journal_reclaim_delay_ms);
+rw_attribute(journal_reclaim_batch);
 
 rw_attribute(discard);
 rw_attribute(cache_replacement_policy);
@@ -194,6 +216,10 @@ rw_attribute(rebalance_enabled);
 sysfs_pd_controller_attribute(rebalance);
 read_attribute(rebalance_work);
 rw_attribute(promote_whole_extents);
+rw_attribute(move_io_cgroup);
+rw_attribute(btree_node_sizes);
+read_attribute(scrub);
+read_attribute(dedup);
 
 read_attribute(new_stripes);
 
@@ -204,6 +230,7 @@ read_attribute(io_timers_write);
 
 #ifdef CONFIG_BCACHEFS_TESTS
 write_attribute(perf_test);
+read_attribute(perf_test_results);
 #endif /* CONFIG_BCACHEFS_TESTS */
 
 #define x(_name)						\
@@ -225,6 +252,8 @@ static size_t bch2_btree_cache_size(struct bch_fs *c)
 	mutex_lock(&c->btree_cache.lock);
 	list_for_each_entry(b, &c->btree_cache.live, list)
 		ret += btree_bytes(c);
+	list_for_each_entry(b, &c->btree_cache.live_hot, list)
+		ret += btree_bytes(c);
 
 	mutex_unlock(&c->btree_cache.lock);
 	return ret;
@@ -245,6 +274,51 @@ static int fs_alloc_debug_to_text(struct printbuf *out, struct bch_fs *c)
 	return 0;
 }
 
+static const char * const compression_type_names[] = {
+#define x(t, n) [BCH_COMPRESSION_TYPE_##t] = #t,
+	BCH_COMPRESSION_TYPES()
+#undef x
+};
+
+static void bch2_fs_mempools_to_text(struct printbuf *out, struct bch_fs *c)
+{
+	size_t bytes, total = 0;
+	unsigned i;
+
+#define pr_mempool(_name, _pool)					\
+	do {								\
+		bytes = mempool_reserved_bytes(_pool);			\
+		total += bytes;						\
+		if (bytes)						\
+			pr_buf(out, "%s:\t%zu\n", _name, bytes);	\
+	} while (0)
+
+	pr_mempool("fill_iter",			&c->fill_iter);
+	pr_mempool("btree_read_bsets",		&c->btree_read_bsets);
+	pr_mempool("btree_bounce_pool",		&c->btree_bounce_pool);
+	pr_mempool("btree_interior_update_pool", &c->btree_interior_update_pool);
+	pr_mempool("btree_iters_pool",		&c->btree_iters_pool);
+	pr_mempool("large_bkey_pool",		&c->large_bkey_pool);
+	pr_mempool("bio_bounce_pages",		&c->bio_bounce_pages);
+	pr_mempool("compression_bounce_read",	&c->compression_bounce[READ]);
+	pr_mempool("compression_bounce_write",	&c->compression_bounce[WRITE]);
+
+	for (i = 0; i < BCH_COMPRESSION_TYPE_NR; i++) {
+		char name[64];
+
+		snprintf(name, sizeof(name), "compress_workspace_%s",
+			 compression_type_names[i]);
+		pr_mempool(name, &c->compress_workspace[i]);
+
+		snprintf(name, sizeof(name), "decompress_workspace_%s",
+			 compression_type_names[i]);
+		pr_mempool(name, &c->decompress_workspace[i]);
+	}
+#undef pr_mempool
+
+	pr_buf(out, "total:\t%zu\n", total);
+}
+
 static int bch2_compression_stats_to_text(struct printbuf *out, struct bch_fs *c)
 {
 	struct btree_trans trans;
@@ -313,7 +387,9 @@ SHOW(bch2_fs)
 	sysfs_printf(internal_uuid, "%pU",	c->sb.uuid.b);
 
 	sysfs_print(journal_write_delay_ms,	c->journal.write_delay_ms);
+	sysfs_printf(journal_write_delay_adaptive, "%i", c->journal.write_delay_adaptive);
 	sysfs_print(journal_reclaim_delay_ms,	c->journal.reclaim_delay_ms);
+	sysfs_print(journal_reclaim_batch,	c->journal.reclaim_batch);
 
 	sysfs_print(block_size,			block_bytes(c));
 	sysfs_print(btree_node_size,		btree_bytes(c));
@@ -321,6 +397,10 @@ SHOW(bch2_fs)
 
 	sysfs_print(read_realloc_races,
 		    atomic_long_read(&c->read_realloc_races));
+	sysfs_print(read_hedges,
+		    atomic_long_read(&c->read_hedges));
+	sysfs_print(read_hedges_won,
+		    atomic_long_read(&c->read_hedges_won));
 	sysfs_print(extent_migrate_done,
 		    atomic_long_read(&c->extent_migrate_done));
 	sysfs_print(extent_migrate_raced,
@@ -335,7 +415,6 @@ SHOW(bch2_fs)
 
 	sysfs_printf(rebalance_enabled,		"%i", c->rebalance.enabled);
 	sysfs_pd_controller_show(rebalance,	&c->rebalance.pd); /* XXX */
-	sysfs_pd_controller_show(copy_gc,	&c->copygc_pd);
 
 	if (attr == &sysfs_rebalance_work) {
 		bch2_rebalance_work_to_text(&out, c);
@@ -344,6 +423,26 @@ SHOW(bch2_fs)
 
 	sysfs_print(promote_whole_extents,	c->promote_whole_extents);
 
+	if (attr == &sysfs_move_io_cgroup) {
+		bch2_move_blkcg_to_text(&out, c);
+		return out.pos - buf;
+	}
+
+	if (attr == &sysfs_btree_node_sizes) {
+		bch2_btree_node_sizes_to_text(&out, c);
+		return out.pos - buf;
+	}
+
+	if (attr == &sysfs_scrub) {
+		bch2_scrub_status_to_text(&out, c);
+		return out.pos - buf;
+	}
+
+	if (attr == &sysfs_dedup) {
+		bch2_dedup_status_to_text(&out, c);
+		return out.pos - buf;
+	}
+
 	/* Debugging: */
 
 	if (attr == &sysfs_alloc_debug)
@@ -374,6 +473,11 @@ SHOW(bch2_fs)
 		return out.pos - buf;
 	}
 
+	if (attr == &sysfs_btree_cache_stats) {
+		bch2_btree_cache_stats_to_text(&out, c);
+		return out.pos - buf;
+	}
+
 	if (attr == &sysfs_btree_key_cache) {
 		bch2_btree_key_cache_to_text(&out, &c->btree_key_cache);
 		return out.pos - buf;
@@ -384,16 +488,51 @@ SHOW(bch2_fs)
 		return out.pos - buf;
 	}
 
+	if (attr == &sysfs_btree_write_buffer) {
+		bch2_btree_write_buffer_to_text(&out, c);
+		return out.pos - buf;
+	}
+
+	if (attr == &sysfs_btree_trans_restarts) {
+		bch2_btree_trans_restarts_to_text(&out, c);
+		return out.pos - buf;
+	}
+
+	if (attr == &sysfs_btree_lockless_stats) {
+		bch2_btree_lockless_stats_to_text(&out, c);
+		return out.pos - buf;
+	}
+
 	if (attr == &sysfs_stripes_heap) {
 		bch2_stripes_heap_to_text(&out, c);
 		return out.pos - buf;
 	}
 
+	if (attr == &sysfs_recovery_phases) {
+		bch2_recovery_phases_to_text(&out, c);
+		return out.pos - buf;
+	}
+
 	if (attr == &sysfs_compression_stats) {
 		bch2_compression_stats_to_text(&out, c);
 		return out.pos - buf;
 	}
 
+	if (attr == &sysfs_mempools) {
+		bch2_fs_mempools_to_text(&out, c);
+		return out.pos - buf;
+	}
+
+	if (attr == &sysfs_usage_history) {
+		bch2_fs_usage_history_to_text(&out, c);
+		return out.pos - buf;
+	}
+
+	if (attr == &sysfs_cache_stats) {
+		bch2_fs_cache_stats_to_text(&out, c);
+		return out.pos - buf;
+	}
+
 	if (attr == &sysfs_new_stripes) {
 		bch2_new_stripes_to_text(&out, c);
 		return out.pos - buf;
@@ -408,6 +547,13 @@ SHOW(bch2_fs)
 		return out.pos - buf;
 	}
 
+#ifdef CONFIG_BCACHEFS_TESTS
+	if (attr == &sysfs_perf_test_results) {
+		bch2_perf_test_results_to_text(&out);
+		return out.pos - buf;
+	}
+#endif
+
 	return 0;
 }
 
@@ -416,7 +562,9 @@ STORE(bch2_fs)
 	struct bch_fs *c = container_of(kobj, struct bch_fs, kobj);
 
 	sysfs_strtoul(journal_write_delay_ms, c->journal.write_delay_ms);
+	sysfs_strtoul(journal_write_delay_adaptive, c->journal.write_delay_adaptive);
 	sysfs_strtoul(journal_reclaim_delay_ms, c->journal.reclaim_delay_ms);
+	sysfs_strtoul(journal_reclaim_batch,	c->journal.reclaim_batch);
 
 	if (attr == &sysfs_btree_gc_periodic) {
 		ssize_t ret = strtoul_safe(buf, c->btree_gc_periodic)
@@ -430,8 +578,7 @@ STORE(bch2_fs)
 		ssize_t ret = strtoul_safe(buf, c->copy_gc_enabled)
 			?: (ssize_t) size;
 
-		if (c->copygc_thread)
-			wake_up_process(c->copygc_thread);
+		bch2_copygc_wakeup(c);
 		return ret;
 	}
 
@@ -443,10 +590,16 @@ STORE(bch2_fs)
 		return ret;
 	}
 
+	if (attr == &sysfs_move_io_cgroup)
+		return bch2_move_blkcg_set_current(c, strtoul_or_return(buf))
+			?: (ssize_t) size;
+
+	if (attr == &sysfs_btree_node_sizes)
+		return bch2_btree_node_sizes_set(c, buf) ?: (ssize_t) size;
+
 	sysfs_strtoul(pd_controllers_update_seconds,
 		      c->pd_controllers_update_seconds);
 	sysfs_pd_controller_store(rebalance,	&c->rebalance.pd);
-	sysfs_pd_controller_store(copy_gc,	&c->copygc_pd);
 
 	sysfs_strtoul(promote_whole_extents,	c->promote_whole_extents);
 
@@ -463,6 +616,9 @@ STORE(bch2_fs)
 	if (attr == &sysfs_trigger_btree_coalesce)
 		bch2_coalesce(c);
 
+	if (attr == &sysfs_trigger_dedup)
+		bch2_dedup_trigger(c);
+
 	if (attr == &sysfs_trigger_gc) {
 		/*
 		 * Full gc is currently incompatible with btree key cache:
@@ -472,7 +628,7 @@ STORE(bch2_fs)
 		bch2_gc(c, false, false);
 		up_read(&c->state_lock);
 #else
-		bch2_gc_gens(c);
+		bch2_gc_gens(c, false);
 #endif
 	}
 
@@ -512,17 +668,23 @@ struct attribute *bch2_fs_files[] = {
 	&sysfs_minor,
 	&sysfs_block_size,
 	&sysfs_btree_node_size,
+	&sysfs_btree_node_sizes,
 	&sysfs_btree_cache_size,
 
 	&sysfs_journal_write_delay_ms,
+	&sysfs_journal_write_delay_adaptive,
 	&sysfs_journal_reclaim_delay_ms,
+	&sysfs_journal_reclaim_batch,
 
 	&sysfs_promote_whole_extents,
 
 	&sysfs_compression_stats,
+	&sysfs_usage_history,
+	&sysfs_cache_stats,
 
 #ifdef CONFIG_BCACHEFS_TESTS
 	&sysfs_perf_test,
+	&sysfs_perf_test_results,
 #endif
 	NULL
 };
@@ -549,17 +711,26 @@ struct attribute *bch2_fs_internal_files[] = {
 	&sysfs_btree_updates,
 	&sysfs_dirty_btree_nodes,
 	&sysfs_btree_cache,
+	&sysfs_btree_cache_stats,
+	&sysfs_mempools,
 	&sysfs_btree_key_cache,
 	&sysfs_btree_transactions,
+	&sysfs_btree_trans_restarts,
+	&sysfs_btree_write_buffer,
+	&sysfs_btree_lockless_stats,
 	&sysfs_stripes_heap,
+	&sysfs_recovery_phases,
 
 	&sysfs_read_realloc_races,
+	&sysfs_read_hedges,
+	&sysfs_read_hedges_won,
 	&sysfs_extent_migrate_done,
 	&sysfs_extent_migrate_raced,
 
 	&sysfs_trigger_journal_flush,
 	&sysfs_trigger_btree_coalesce,
 	&sysfs_trigger_gc,
+	&sysfs_trigger_dedup,
 	&sysfs_prune_cache,
 
 	&sysfs_copy_gc_enabled,
@@ -567,7 +738,9 @@ struct attribute *bch2_fs_internal_files[] = {
 	&sysfs_rebalance_enabled,
 	&sysfs_rebalance_work,
 	sysfs_pd_controller_files(rebalance),
-	sysfs_pd_controller_files(copy_gc),
+	&sysfs_move_io_cgroup,
+	&sysfs_scrub,
+	&sysfs_dedup,
 
 	&sysfs_new_stripes,
 
@@ -619,18 +792,40 @@ STORE(bch2_fs_opts_dir)
 	if (opt->set_sb != SET_NO_SB_OPT) {
 		mutex_lock(&c->sb_lock);
 		opt->set_sb(c->disk_sb.sb, v);
-		bch2_write_super(c);
+		bch2_write_super_async(c);
 		mutex_unlock(&c->sb_lock);
 	}
 
 	bch2_opt_set_by_id(&c->opts, id, v);
 
-	if ((id == Opt_background_target ||
-	     id == Opt_background_compression) && v) {
+	if (((id == Opt_background_target ||
+	      id == Opt_background_compression ||
+	      id == Opt_defrag_extent_size ||
+	      id == Opt_erasure_code_cold_age) && v) ||
+	    id == Opt_metadata_target ||
+	    id == Opt_btree_leaf_target) {
 		bch2_rebalance_add_work(c, S64_MAX);
 		rebalance_wakeup(c);
 	}
 
+	if (id == Opt_copygc_threads)
+		wake_up(&c->copygc_running_wait);
+
+	if (id == Opt_scrub_interval)
+		bch2_scrub_wakeup(c);
+
+	if (id == Opt_dedup_interval)
+		bch2_dedup_wakeup(c);
+
+	if ((id == Opt_journal_target ||
+	     id == Opt_metadata_target ||
+	     id == Opt_foreground_target) &&
+	    test_bit(BCH_FS_RW, &c->flags)) {
+		ret = bch2_journal_migrate_to_target(&c->journal);
+		if (ret)
+			return ret;
+	}
+
 	return size;
 }
 SYSFS_OPS(bch2_fs_opts_dir);
@@ -695,8 +890,9 @@ static unsigned bucket_last_io_fn(struct bch_fs *c, struct bch_dev *ca,
 				  size_t b, void *private)
 {
 	int rw = (private ? 1 : 0);
+	u64 now = atomic64_read(&c->io_clock[rw].now);
 
-	return atomic64_read(&c->io_clock[rw].now) - bucket(ca, b)->io_time[rw];
+	return now - bucket_io_time(bucket(ca, b), rw, now);
 }
 
 static unsigned bucket_sectors_used_fn(struct bch_fs *c, struct bch_dev *ca,
@@ -804,7 +1000,9 @@ static void dev_alloc_debug_to_text(struct printbuf *out, struct bch_dev *ca)
 	       "\n"
 	       "free_inc\t\t%zu/%zu\n"
 	       "free[RESERVE_MOVINGGC]\t%zu/%zu\n"
-	       "free[RESERVE_NONE]\t%zu/%zu\n"
+	       "free[RESERVE_NONE]\t%zu/%zu (want %zu)\n"
+	       "alloc rate\t\t%llu buckets/sec\n"
+	       "refill latency\t\t%llu usec\n"
 	       "freelist_wait\t\t%s\n"
 	       "open buckets\t\t%u/%u (reserved %u)\n"
 	       "open_buckets_wait\t%s\n"
@@ -817,6 +1015,9 @@ static void dev_alloc_debug_to_text(struct printbuf *out, struct bch_dev *ca)
 	       fifo_used(&ca->free_inc),		ca->free_inc.size,
 	       fifo_used(&ca->free[RESERVE_MOVINGGC]),	ca->free[RESERVE_MOVINGGC].size,
 	       fifo_used(&ca->free[RESERVE_NONE]),	ca->free[RESERVE_NONE].size,
+	       ca->free_want,
+	       ca->alloc_rate,
+	       div_u64(ca->refill_latency, NSEC_PER_USEC),
 	       c->freelist_wait.list.first		? "waiting" : "empty",
 	       c->open_buckets_nr_free, OPEN_BUCKETS_COUNT,
 	       BTREE_NODE_OPEN_BUCKET_RESERVE,
@@ -846,6 +1047,34 @@ static void dev_iodone_to_text(struct printbuf *out, struct bch_dev *ca)
 	}
 }
 
+static void dev_io_latency_to_text(struct printbuf *out, struct bch_dev *ca)
+{
+	static const unsigned per_mille[] = { 500, 990, 999 };
+	u64 v[ARRAY_SIZE(per_mille)], nr;
+	int rw, i, j;
+
+	pr_buf(out, "%-6s %-8s %10s %12s %10s %10s %10s\n",
+	       "", "type", "in_flight", "count", "p50", "p99", "p999");
+
+	for (rw = 0; rw < 2; rw++)
+		for (i = 1; i < BCH_DATA_NR; i++) {
+			if (!ca->io_latency_hist[rw][i])
+				continue;
+
+			nr = bch2_time_stats_hist_percentiles(ca->io_latency_hist[rw][i],
+						per_mille, v, ARRAY_SIZE(v));
+
+			pr_buf(out, "%-6s %-8s %10i %12llu",
+			       bch2_rw[rw], bch2_data_types[i],
+			       atomic_read(&ca->io_in_flight[rw][i]), nr);
+			for (j = 0; j < ARRAY_SIZE(v); j++)
+				pr_buf(out, " %10llu", div_u64(v[j], NSEC_PER_USEC));
+			pr_buf(out, "\n");
+		}
+
+	pr_buf(out, "(latencies in us)\n");
+}
+
 SHOW(bch2_dev)
 {
 	struct bch_dev *ca = container_of(kobj, struct bch_dev, kobj);
@@ -861,6 +1090,8 @@ SHOW(bch2_dev)
 	sysfs_print(durability,		ca->mi.durability);
 	sysfs_print(discard,		ca->mi.discard);
 
+	sysfs_pd_controller_show(copy_gc, &ca->copygc_pd);
+
 	if (attr == &sysfs_label) {
 		if (ca->mi.group) {
 			mutex_lock(&c->sb_lock);
@@ -900,6 +1131,16 @@ SHOW(bch2_dev)
 		return out.pos - buf;
 	}
 
+	if (attr == &sysfs_usage_history) {
+		bch2_dev_usage_history_to_text(&out, ca);
+		return out.pos - buf;
+	}
+
+	if (attr == &sysfs_cache_stats) {
+		bch2_dev_cache_stats_to_text(&out, ca);
+		return out.pos - buf;
+	}
+
 	sysfs_print(io_latency_read,		atomic64_read(&ca->cur_latency[READ]));
 	sysfs_print(io_latency_write,		atomic64_read(&ca->cur_latency[WRITE]));
 
@@ -911,10 +1152,13 @@ SHOW(bch2_dev)
 		bch2_time_stats_to_text(&out, &ca->io_latency[WRITE]);
 		return out.pos - buf;
 	}
+	if (attr == &sysfs_io_latency_by_type) {
+		dev_io_latency_to_text(&out, ca);
+		return out.pos - buf;
+	}
 
 	sysfs_printf(congested,			"%u%%",
-		     clamp(atomic_read(&ca->congested), 0, CONGESTED_MAX)
-		     * 100 / CONGESTED_MAX);
+		     bch2_dev_congested(ca, local_clock()) * 100 / CONGESTED_MAX);
 
 	if (attr == &sysfs_bucket_quantiles_last_read)
 		return quantiles_to_text(&out, c, ca, bucket_last_io_fn, (void *) 0) ?: out.pos - buf;
@@ -951,7 +1195,7 @@ STORE(bch2_dev)
 
 		if (v != BCH_MEMBER_DISCARD(mi)) {
 			SET_BCH_MEMBER_DISCARD(mi, v);
-			bch2_write_super(c);
+			bch2_write_super_async(c);
 		}
 		mutex_unlock(&c->sb_lock);
 	}
@@ -967,7 +1211,7 @@ STORE(bch2_dev)
 
 		if ((unsigned) v != BCH_MEMBER_REPLACEMENT(mi)) {
 			SET_BCH_MEMBER_REPLACEMENT(mi, v);
-			bch2_write_super(c);
+			bch2_write_super_async(c);
 		}
 		mutex_unlock(&c->sb_lock);
 	}
@@ -989,6 +1233,8 @@ STORE(bch2_dev)
 	if (attr == &sysfs_wake_allocator)
 		bch2_wake_allocator(ca);
 
+	sysfs_pd_controller_store(copy_gc, &ca->copygc_pd);
+
 	return size;
 }
 SYSFS_OPS(bch2_dev);
@@ -1009,11 +1255,14 @@ struct attribute *bch2_dev_files[] = {
 
 	&sysfs_has_data,
 	&sysfs_iodone,
+	&sysfs_usage_history,
+	&sysfs_cache_stats,
 
 	&sysfs_io_latency_read,
 	&sysfs_io_latency_write,
 	&sysfs_io_latency_stats_read,
 	&sysfs_io_latency_stats_write,
+	&sysfs_io_latency_by_type,
 	&sysfs_congested,
 
 	/* alloc info - other stats: */
@@ -1024,6 +1273,8 @@ struct attribute *bch2_dev_files[] = {
 
 	&sysfs_reserve_stats,
 
+	sysfs_pd_controller_files(copy_gc),
+
 	/* debug: */
 	&sysfs_alloc_debug,
 	&sysfs_wake_allocator,
@@ -2,12 +2,18 @@
 #ifdef CONFIG_BCACHEFS_TESTS
 
 #include "bcachefs.h"
+#include "bkey_sort.h"
+#include "btree_cache.h"
+#include "btree_io.h"
 #include "btree_update.h"
+#include "btree_update_interior.h"
+#include "inode.h"
 #include "journal_reclaim.h"
 #include "tests.h"
 
 #include "linux/kthread.h"
 #include "linux/random.h"
+#include "linux/sort.h"
 
 static void delete_test_keys(struct bch_fs *c)
 {
@@ -342,6 +348,69 @@ static int test_iterate_slots_extents(struct bch_fs *c, u64 nr)
 	return 0;
 }
 
+static int test_lookup_batch(struct bch_fs *c, u64 nr)
+{
+	struct btree_trans trans;
+	struct bpos *pos = NULL;
+	struct bkey_s_c *k = NULL;
+	u64 i;
+	int ret = 0;
+
+	bch2_trans_init(&trans, c, 0, 0);
+
+	delete_test_keys(c);
+
+	pos	= kvmalloc_array(nr * 2, sizeof(*pos), GFP_KERNEL);
+	k	= kvmalloc_array(nr * 2, sizeof(*k), GFP_KERNEL);
+	if (!pos || !k) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	pr_info("inserting test keys");
+
+	for (i = 0; i < nr; i++) {
+		struct bkey_i_cookie k;
+
+		bkey_cookie_init(&k.k_i);
+		k.k.p.offset = i * 2;
+
+		ret = bch2_btree_insert(c, BTREE_ID_XATTRS, &k.k_i,
+					NULL, NULL, 0);
+		if (ret) {
+			bch_err(c, "insert error in test_lookup_batch: %i", ret);
+			goto err;
+		}
+	}
+
+	pr_info("looking up keys and holes");
+
+	for (i = 0; i < nr * 2; i++)
+		pos[i] = POS(0, i);
+
+	do {
+		bch2_trans_begin(&trans);
+
+		ret = bch2_btree_lookup_batch(&trans, BTREE_ID_XATTRS,
+					      pos, k, nr * 2, 0);
+	} while (ret == -EINTR);
+
+	if (ret) {
+		bch_err(c, "lookup error in test_lookup_batch: %i", ret);
+		goto err;
+	}
+
+	for (i = 0; i < nr * 2; i++) {
+		BUG_ON(bkey_cmp(k[i].k->p, pos[i]));
+		BUG_ON(bkey_deleted(k[i].k) != (i & 1));
+	}
+err:
+	kvfree(k);
+	kvfree(pos);
+	bch2_trans_exit(&trans);
+	return ret;
+}
+
 /*
  * XXX: we really want to make sure we've got a btree with depth > 0 for these
  * tests
@@ -450,6 +519,20 @@ static int test_extent_overwrite_all(struct bch_fs *c, u64 nr)
 
 /* perf tests */
 
+/*
+ * Only one perf test runs at a time, so that tests don't skew each other's
+ * numbers - this also protects perf_test_latency:
+ */
+static DEFINE_MUTEX(perf_test_lock);
+static struct time_stats *perf_test_latency;
+
+/* Perf tests that loop doing one operation at a time record its latency: */
+static inline void perf_test_op_done(u64 start)
+{
+	if (perf_test_latency)
+		__bch2_time_stats_update(perf_test_latency, start, local_clock());
+}
+
 static u64 test_rand(void)
 {
 	u64 v;
@@ -471,6 +554,8 @@ static int rand_insert(struct bch_fs *c, u64 nr)
 	bch2_trans_init(&trans, c, 0, 0);
 
 	for (i = 0; i < nr; i++) {
+		u64 start = local_clock();
+
 		bkey_cookie_init(&k.k_i);
 		k.k.p.offset = test_rand();
 
@@ -480,6 +565,8 @@ static int rand_insert(struct bch_fs *c, u64 nr)
 			bch_err(c, "error in rand_insert: %i", ret);
 			break;
 		}
+
+		perf_test_op_done(start);
 	}
 
 	bch2_trans_exit(&trans);
@@ -498,6 +585,8 @@ static int rand_lookup(struct bch_fs *c, u64 nr)
 	iter = bch2_trans_get_iter(&trans, BTREE_ID_XATTRS, POS_MIN, 0);
 
 	for (i = 0; i < nr; i++) {
+		u64 start = local_clock();
+
 		bch2_btree_iter_set_pos(iter, POS(0, test_rand()));
 
 		k = bch2_btree_iter_peek(iter);
@@ -506,6 +595,8 @@ static int rand_lookup(struct bch_fs *c, u64 nr)
 			bch_err(c, "error in rand_lookup: %i", ret);
 			break;
 		}
+
+		perf_test_op_done(start);
 	}
 
 	bch2_trans_iter_free(&trans, iter);
@@ -513,7 +604,8 @@ static int rand_lookup(struct bch_fs *c, u64 nr)
 	return ret;
 }
 
-static int rand_mixed(struct bch_fs *c, u64 nr)
+/* Does an update after every (write_mask + 1) lookups: */
+static int __rand_mixed(struct bch_fs *c, u64 nr, u64 write_mask)
 {
 	struct btree_trans trans;
 	struct btree_iter *iter;
@@ -525,6 +617,8 @@ static int rand_mixed(struct bch_fs *c, u64 nr)
 	iter = bch2_trans_get_iter(&trans, BTREE_ID_XATTRS, POS_MIN, 0);
 
 	for (i = 0; i < nr; i++) {
+		u64 start = local_clock();
+
 		bch2_btree_iter_set_pos(iter, POS(0, test_rand()));
 
 		k = bch2_btree_iter_peek(iter);
@@ -534,7 +628,7 @@ static int rand_mixed(struct bch_fs *c, u64 nr)
 			break;
 		}
 
-		if (!(i & 3) && k.k) {
+		if (!(i & write_mask) && k.k) {
 			struct bkey_i_cookie k;
 
 			bkey_cookie_init(&k.k_i);
@@ -547,6 +641,8 @@ static int rand_mixed(struct bch_fs *c, u64 nr)
 				break;
 			}
 		}
+
+		perf_test_op_done(start);
 	}
 
 	bch2_trans_iter_free(&trans, iter);
@@ -554,6 +650,21 @@ static int rand_mixed(struct bch_fs *c, u64 nr)
 	return ret;
 }
 
+static int rand_mixed(struct bch_fs *c, u64 nr)
+{
+	return __rand_mixed(c, nr, 3);
+}
+
+static int rand_mixed_read_mostly(struct bch_fs *c, u64 nr)
+{
+	return __rand_mixed(c, nr, 15);
+}
+
+static int rand_mixed_write_heavy(struct bch_fs *c, u64 nr)
+{
+	return __rand_mixed(c, nr, 1);
+}
+
 static int __do_delete(struct btree_trans *trans, struct bpos pos)
 {
 	struct btree_iter *iter;
@@ -590,6 +701,7 @@ static int rand_delete(struct bch_fs *c, u64 nr)
 
 	for (i = 0; i < nr; i++) {
 		struct bpos pos = POS(0, test_rand());
+		u64 start = local_clock();
 
 		ret = __bch2_trans_do(&trans, NULL, NULL, 0,
 			__do_delete(&trans, pos));
@@ -597,6 +709,223 @@ static int rand_delete(struct bch_fs *c, u64 nr)
 			bch_err(c, "error in rand_delete: %i", ret);
 			break;
 		}
+
+		perf_test_op_done(start);
+	}
+
+	bch2_trans_exit(&trans);
+	return ret;
+}
+
+/* Updates several random keys, each with its own iterator, in one commit: */
+#define MULTI_ITER_NR		4
+
+static int __multi_iter_update(struct btree_trans *trans, u64 *pos)
+{
+	struct btree_iter *iter[MULTI_ITER_NR] = { NULL };
+	struct bkey_i_cookie *u;
+	struct bkey_s_c k;
+	unsigned i;
+	int ret = 0;
+
+	for (i = 0; i < MULTI_ITER_NR; i++) {
+		iter[i] = bch2_trans_get_iter(trans, BTREE_ID_XATTRS,
+					      POS(0, pos[i]), BTREE_ITER_INTENT);
+		k = bch2_btree_iter_peek(iter[i]);
+		ret = bkey_err(k);
+		if (ret)
+			goto err;
+
+		if (!k.k)
+			continue;
+
+		u = bch2_trans_kmalloc(trans, sizeof(*u));
+		ret = PTR_ERR_OR_ZERO(u);
+		if (ret)
+			goto err;
+
+		bkey_cookie_init(&u->k_i);
+		u->k.p = k.k->p;
+
+		bch2_trans_update(trans, iter[i], &u->k_i, 0);
+	}
+err:
+	for (i = 0; i < MULTI_ITER_NR; i++)
+		bch2_trans_iter_put(trans, iter[i]);
+	return ret;
+}
+
+static int multi_iter_update(struct bch_fs *c, u64 nr)
+{
+	struct btree_trans trans;
+	u64 pos[MULTI_ITER_NR];
+	unsigned j;
+	int ret = 0;
+	u64 i;
+
+	bch2_trans_init(&trans, c, 0, 0);
+
+	for (i = 0; i < nr; i++) {
+		u64 start = local_clock();
+
+		for (j = 0; j < MULTI_ITER_NR; j++)
+			pos[j] = test_rand();
+
+		ret = __bch2_trans_do(&trans, NULL, NULL, 0,
+			__multi_iter_update(&trans, pos));
+		if (ret) {
+			bch_err(c, "error in multi_iter_update: %i", ret);
+			break;
+		}
+
+		perf_test_op_done(start);
+	}
+
+	bch2_trans_exit(&trans);
+	return ret;
+}
+
+/* Every thread updating the same small set of keys, for lock contention: */
+#define PERF_TEST_SHARED_KEYS	16
+
+static int shared_key_update(struct bch_fs *c, u64 nr)
+{
+	struct btree_trans trans;
+	struct bkey_i_cookie k;
+	int ret = 0;
+	u64 i;
+
+	bch2_trans_init(&trans, c, 0, 0);
+
+	for (i = 0; i < nr; i++) {
+		u64 start = local_clock();
+
+		bkey_cookie_init(&k.k_i);
+		k.k.p.offset = test_rand() & (PERF_TEST_SHARED_KEYS - 1);
+
+		ret = __bch2_trans_do(&trans, NULL, NULL, 0,
+			__bch2_btree_insert(&trans, BTREE_ID_XATTRS, &k.k_i));
+		if (ret) {
+			bch_err(c, "error in shared_key_update: %i", ret);
+			break;
+		}
+
+		perf_test_op_done(start);
+	}
+
+	bch2_trans_exit(&trans);
+	return ret;
+}
+
+/*
+ * Key cache: updates inodes through cached iterators, in an inode number range
+ * well away from anything the filesystem allocates. Run inode_delete_cached
+ * afterwards to get rid of them:
+ */
+#define PERF_TEST_INODE_BASE	(1ULL << 62)
+#define PERF_TEST_INODES	1024
+
+static int __inode_update_cached(struct btree_trans *trans, u64 inum)
+{
+	struct btree_iter *iter;
+	struct bch_inode_unpacked u;
+	struct bkey_s_c k;
+	int ret;
+
+	iter = bch2_trans_get_iter(trans, BTREE_ID_INODES, POS(0, inum),
+				   BTREE_ITER_CACHED|BTREE_ITER_INTENT);
+	k = bch2_btree_iter_peek_cached(iter);
+	ret = bkey_err(k);
+	if (ret)
+		goto err;
+
+	if (k.k->type == KEY_TYPE_inode) {
+		ret = bch2_inode_unpack(bkey_s_c_to_inode(k), &u);
+		if (ret)
+			goto err;
+	} else {
+		bch2_inode_init(trans->c, &u, 0, 0, S_IFREG|0644, 0, NULL);
+		u.bi_inum = inum;
+	}
+
+	u.bi_size += 512;
+
+	ret = bch2_inode_write(trans, iter, &u);
+err:
+	bch2_trans_iter_put(trans, iter);
+	return ret;
+}
+
+static int inode_update_cached(struct bch_fs *c, u64 nr)
+{
+	struct btree_trans trans;
+	int ret = 0;
+	u64 i;
+
+	bch2_trans_init(&trans, c, 0, 0);
+
+	for (i = 0; i < nr; i++) {
+		u64 inum = PERF_TEST_INODE_BASE +
+			test_rand() % PERF_TEST_INODES;
+		u64 start = local_clock();
+
+		ret = __bch2_trans_do(&trans, NULL, NULL, 0,
+			__inode_update_cached(&trans, inum));
+		if (ret) {
+			bch_err(c, "error in inode_update_cached: %i", ret);
+			break;
+		}
+
+		perf_test_op_done(start);
+	}
+
+	bch2_trans_exit(&trans);
+	return ret;
+}
+
+static int __inode_delete_cached(struct btree_trans *trans, u64 inum)
+{
+	struct btree_iter *iter;
+	struct bkey_i *delete;
+	struct bkey_s_c k;
+	int ret;
+
+	iter = bch2_trans_get_iter(trans, BTREE_ID_INODES, POS(0, inum),
+				   BTREE_ITER_CACHED|BTREE_ITER_INTENT);
+	k = bch2_btree_iter_peek_cached(iter);
+	ret = bkey_err(k);
+	if (ret || k.k->type != KEY_TYPE_inode)
+		goto err;
+
+	delete = bch2_trans_kmalloc(trans, sizeof(*delete));
+	ret = PTR_ERR_OR_ZERO(delete);
+	if (ret)
+		goto err;
+
+	bkey_init(&delete->k);
+	delete->k.p = iter->pos;
+
+	bch2_trans_update(trans, iter, delete, 0);
+err:
+	bch2_trans_iter_put(trans, iter);
+	return ret;
+}
+
+static int inode_delete_cached(struct bch_fs *c, u64 nr)
+{
+	struct btree_trans trans;
+	int ret = 0;
+	u64 i;
+
+	bch2_trans_init(&trans, c, 0, 0);
+
+	for (i = 0; i < PERF_TEST_INODES; i++) {
+		ret = __bch2_trans_do(&trans, NULL, NULL, 0,
+			__inode_delete_cached(&trans, PERF_TEST_INODE_BASE + i));
+		if (ret) {
+			bch_err(c, "error in inode_delete_cached: %i", ret);
+			break;
+		}
 	}
 
 	bch2_trans_exit(&trans);
@@ -634,6 +963,36 @@ static int seq_insert(struct bch_fs *c, u64 nr)
 	return ret;
 }
 
+struct seq_bulk_load_state {
+	struct bkey_i_cookie	k;
+	u64			i;
+	u64			nr;
+};
+
+static struct bkey_i *seq_bulk_load_next(struct bch_fs *c, void *arg)
+{
+	struct seq_bulk_load_state *s = arg;
+
+	if (s->i == s->nr)
+		return NULL;
+
+	bkey_cookie_init(&s->k.k_i);
+	s->k.k.p = POS(0, s->i++);
+	return &s->k.k_i;
+}
+
+static int seq_bulk_load(struct bch_fs *c, u64 nr)
+{
+	struct seq_bulk_load_state s = { .nr = nr };
+	int ret;
+
+	ret = bch2_btree_bulk_load(c, BTREE_ID_XATTRS, 0,
+				   seq_bulk_load_next, &s);
+	if (ret)
+		bch_err(c, "error in seq_bulk_load: %i", ret);
+	return ret;
+}
+
 static int seq_lookup(struct bch_fs *c, u64 nr)
 {
 	struct btree_trans trans;
@@ -687,6 +1046,374 @@ static int seq_delete(struct bch_fs *c, u64 nr)
 	return ret;
 }
 
+/* Doesn't touch the btree - just inode pack/unpack: */
+static int inode_pack(struct bch_fs *c, u64 nr)
+{
+	struct bkey_inode_buf packed;
+	struct bch_inode_unpacked inode, unpacked;
+	int ret = 0;
+	u64 i;
+
+	bch2_inode_init(c, &inode, 0, 0, S_IFREG|0644, 0, NULL);
+
+	for (i = 0; i < nr; i++) {
+		inode.bi_inum	= BLOCKDEV_INODE_MAX + i;
+		inode.bi_size	= test_rand() >> (i & 63);
+		inode.bi_sectors = inode.bi_size >> 9;
+		inode.bi_mtime	= test_rand();
+
+		bch2_inode_pack(c, &packed, &inode);
+
+		ret = bch2_inode_unpack(inode_i_to_s_c(&packed.inode),
+					&unpacked);
+		if (ret ||
+		    unpacked.bi_size	!= inode.bi_size ||
+		    unpacked.bi_mtime	!= inode.bi_mtime) {
+			bch_err(c, "error in inode_pack: %i", ret);
+			ret = -EINVAL;
+			break;
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * Microbenchmarks for the bkey packing and eytzinger search code - these don't
+ * touch the btree either, so they time just the data structure code:
+ */
+#define MICROBENCH_NR		1024
+
+/* Keys laid out like an extents btree node: a few inodes, ascending offsets */
+static void microbench_keys(struct bkey *keys, unsigned nr)
+{
+	u64 offset = 0;
+	unsigned i;
+
+	for (i = 0; i < nr; i++) {
+		offset += 1 + (test_rand() & 255);
+
+		bkey_init(&keys[i]);
+		keys[i].p.inode		= BLOCKDEV_INODE_MAX + (i * 4) / nr;
+		keys[i].p.offset	= offset;
+		keys[i].size		= 1 + (test_rand() & 127);
+	}
+}
+
+static struct bkey_packed *microbench_packed(u64 *packed, unsigned i)
+{
+	return (void *) (packed + i * BKEY_U64s);
+}
+
+static int __key_pack_unpack(struct bch_fs *c, u64 nr, bool unpack)
+{
+	struct bkey_format_state s;
+	struct bkey_format f;
+	struct bkey *keys;
+	u64 *packed;
+	u64 i, sum = 0;
+	int ret = 0;
+
+	keys	= kvmalloc_array(MICROBENCH_NR, sizeof(*keys), GFP_KERNEL);
+	packed	= kvmalloc_array(MICROBENCH_NR, sizeof(struct bkey), GFP_KERNEL);
+	if (!keys || !packed) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	microbench_keys(keys, MICROBENCH_NR);
+
+	bch2_bkey_format_init(&s);
+	for (i = 0; i < MICROBENCH_NR; i++)
+		bch2_bkey_format_add_key(&s, &keys[i]);
+	f = bch2_bkey_format_done(&s);
+
+	for (i = 0; i < MICROBENCH_NR; i++)
+		if (!bch2_bkey_pack_key(microbench_packed(packed, i), &keys[i], &f)) {
+			bch_err(c, "error packing key in key_pack_unpack");
+			ret = -EINVAL;
+			goto err;
+		}
+
+	if (unpack)
+		for (i = 0; i < nr; i++) {
+			struct bkey u = __bch2_bkey_unpack_key(&f,
+				microbench_packed(packed, i % MICROBENCH_NR));
+
+			sum += u.p.offset;
+		}
+	else
+		for (i = 0; i < nr; i++)
+			sum += bch2_bkey_pack_key(microbench_packed(packed, i % MICROBENCH_NR),
+						  &keys[i % MICROBENCH_NR], &f);
+
+	OPTIMIZER_HIDE_VAR(sum);
+err:
+	kvfree(packed);
+	kvfree(keys);
+	return ret;
+}
+
+static int key_pack(struct bch_fs *c, u64 nr)
+{
+	return __key_pack_unpack(c, nr, false);
+}
+
+static int key_unpack(struct bch_fs *c, u64 nr)
+{
+	return __key_pack_unpack(c, nr, true);
+}
+
+static int microbench_cmp_u64(const void *l, const void *r, size_t size)
+{
+	return cmp_int(*((u64 *) l), *((u64 *) r));
+}
+
+/* Searches an eytzinger laid out array the size of a bset's aux search tree: */
+static int eytzinger_lookup(struct bch_fs *c, u64 nr)
+{
+	unsigned nr_elements = MICROBENCH_NR * 4;
+	u64 *array, *search;
+	u64 i, sum = 0;
+	int ret = 0;
+
+	array	= kvmalloc_array(nr_elements, sizeof(*array), GFP_KERNEL);
+	search	= kvmalloc_array(MICROBENCH_NR, sizeof(*search), GFP_KERNEL);
+	if (!array || !search) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	for (i = 0; i < nr_elements; i++)
+		array[i] = test_rand();
+	for (i = 0; i < MICROBENCH_NR; i++)
+		search[i] = test_rand();
+
+	eytzinger0_sort(array, nr_elements, sizeof(*array),
+			microbench_cmp_u64, NULL);
+
+	for (i = 0; i < nr; i++)
+		sum += eytzinger0_find_le(array, nr_elements, sizeof(*array),
+					  microbench_cmp_u64,
+					  &search[i % MICROBENCH_NR]);
+
+	OPTIMIZER_HIDE_VAR(sum);
+err:
+	kvfree(search);
+	kvfree(array);
+	return ret;
+}
+
+/*
+ * The bset benchmarks run on a node from the btree node cache that's never
+ * hashed or written, holding keys spread over a few inodes like an xattrs node:
+ */
+#define MICROBENCH_INODES	4
+#define MICROBENCH_OFFSET_MAX	((1ULL << 28) - 1)
+#define MICROBENCH_SORT_RUNS	4
+
+static struct bpos microbench_pos(void)
+{
+	return POS(BLOCKDEV_INODE_MAX + test_rand() % MICROBENCH_INODES,
+		   test_rand() & MICROBENCH_OFFSET_MAX);
+}
+
+static void microbench_node_reset(struct btree *b)
+{
+	bch2_btree_keys_init(b);
+	bch2_bset_init_first(b, &b->data->keys);
+	bch2_btree_build_aux_trees(b);
+}
+
+static struct btree *microbench_node_alloc(struct bch_fs *c)
+{
+	struct bkey_format_state s;
+	struct btree *b;
+
+	b = bch2_btree_node_mem_alloc(c, false);
+	if (IS_ERR(b))
+		return b;
+
+	b->c.level	= 0;
+	b->c.btree_id	= BTREE_ID_XATTRS;
+	b->data->flags	= 0;
+	b->data->min_key = POS_MIN;
+	b->data->max_key = POS_MAX;
+
+	bch2_bkey_format_init(&s);
+	bch2_bkey_format_add_pos(&s, POS(BLOCKDEV_INODE_MAX, 0));
+	bch2_bkey_format_add_pos(&s, POS(BLOCKDEV_INODE_MAX +
+					 MICROBENCH_INODES - 1,
+					 MICROBENCH_OFFSET_MAX));
+	b->data->format = bch2_bkey_format_done(&s);
+	btree_node_set_format(b, b->data->format);
+
+	microbench_node_reset(b);
+	return b;
+}
+
+static void microbench_node_free(struct bch_fs *c, struct btree *b)
+{
+	mutex_lock(&c->btree_cache.lock);
+	list_move(&b->list, &c->btree_cache.freeable);
+	mutex_unlock(&c->btree_cache.lock);
+
+	six_unlock_write(&b->c.lock);
+	six_unlock_intent(&b->c.lock);
+}
+
+static bool microbench_node_full(struct bch_fs *c, struct btree *b)
+{
+	return bch_btree_keys_u64s_remaining(c, b) < BKEY_U64s * 2;
+}
+
+static void microbench_node_insert(struct btree *b, struct bpos pos)
+{
+	struct btree_node_iter iter;
+	struct bkey_packed *where;
+	struct bkey_i k;
+
+	bkey_init(&k.k);
+	k.k.type	= KEY_TYPE_error;
+	k.k.p		= pos;
+
+	bch2_btree_node_iter_init(&iter, b, &k.k.p);
+	where = bch2_btree_node_iter_bset_pos(&iter, b, bset_tree_last(b));
+	bch2_bset_insert(b, &iter, where, &k, 0);
+}
+
+/* Random order inserts into a node's unwritten bset and its rw aux tree: */
+static int bset_insert(struct bch_fs *c, u64 nr)
+{
+	struct btree *b = microbench_node_alloc(c);
+	u64 i;
+
+	if (IS_ERR(b))
+		return PTR_ERR(b);
+
+	for (i = 0; i < nr; i++) {
+		if (microbench_node_full(c, b))
+			microbench_node_reset(b);
+
+		microbench_node_insert(b, microbench_pos());
+	}
+
+	microbench_node_free(c, b);
+	return 0;
+}
+
+/* Lookups in a full node, via a bset's ro (eytzinger) aux search tree: */
+static int bset_lookup(struct bch_fs *c, u64 nr)
+{
+	struct btree_node_iter iter;
+	struct bpos *search;
+	struct btree *b;
+	u64 i, sum = 0;
+	int ret = 0;
+
+	search = kvmalloc_array(MICROBENCH_NR, sizeof(*search), GFP_KERNEL);
+	if (!search)
+		return -ENOMEM;
+
+	b = microbench_node_alloc(c);
+	if (IS_ERR(b)) {
+		ret = PTR_ERR(b);
+		goto err;
+	}
+
+	while (!microbench_node_full(c, b))
+		microbench_node_insert(b, microbench_pos());
+
+	bch2_bset_build_aux_tree(b, bset_tree_last(b), false);
+
+	for (i = 0; i < MICROBENCH_NR; i++)
+		search[i] = microbench_pos();
+
+	for (i = 0; i < nr; i++) {
+		bch2_btree_node_iter_init(&iter, b, &search[i % MICROBENCH_NR]);
+		sum += iter.data[0].k;
+	}
+
+	OPTIMIZER_HIDE_VAR(sum);
+	microbench_node_free(c, b);
+err:
+	kvfree(search);
+	return ret;
+}
+
+static int microbench_cmp_bkey(const void *l, const void *r)
+{
+	return bkey_cmp(((struct bkey *) l)->p, ((struct bkey *) r)->p);
+}
+
+/* Merging sorted runs of packed keys, like a btree node sort on write: */
+static int key_sort(struct bch_fs *c, u64 nr)
+{
+	struct bkey_packed *start[MICROBENCH_SORT_RUNS], *out;
+	size_t bytes = sizeof(struct bkey) *
+		MICROBENCH_SORT_RUNS * MICROBENCH_NR;
+	struct sort_iter sort_iter;
+	struct bkey *keys;
+	struct btree *b;
+	void *src, *dst;
+	unsigned r, j;
+	u64 i;
+	int ret = 0;
+
+	keys	= kvmalloc_array(MICROBENCH_NR, sizeof(*keys), GFP_KERNEL);
+	src	= kvmalloc(bytes, GFP_KERNEL);
+	dst	= kvmalloc(bytes, GFP_KERNEL);
+	if (!keys || !src || !dst) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	b = microbench_node_alloc(c);
+	if (IS_ERR(b)) {
+		ret = PTR_ERR(b);
+		goto err;
+	}
+
+	out = src;
+	for (r = 0; r < MICROBENCH_SORT_RUNS; r++) {
+		for (j = 0; j < MICROBENCH_NR; j++) {
+			bkey_init(&keys[j]);
+			keys[j].type	= KEY_TYPE_error;
+			keys[j].p	= microbench_pos();
+		}
+
+		sort(keys, MICROBENCH_NR, sizeof(keys[0]),
+		     microbench_cmp_bkey, NULL);
+
+		start[r] = out;
+		for (j = 0; j < MICROBENCH_NR; j++) {
+			if (!bch2_bkey_pack_key(out, &keys[j], &b->format)) {
+				bch_err(c, "error packing key in key_sort");
+				ret = -EINVAL;
+				goto err_free;
+			}
+			out = bkey_next(out);
+		}
+	}
+
+	for (i = 0; i < nr; i += MICROBENCH_SORT_RUNS * MICROBENCH_NR) {
+		sort_iter_init(&sort_iter, b);
+		for (r = 0; r < MICROBENCH_SORT_RUNS; r++)
+			sort_iter_add(&sort_iter, start[r],
+				      r + 1 < MICROBENCH_SORT_RUNS
+				      ? start[r + 1] : out);
+
+		bch2_sort_keys(dst, &sort_iter, false);
+	}
+err_free:
+	microbench_node_free(c, b);
+err:
+	kvfree(dst);
+	kvfree(src);
+	kvfree(keys);
+	return ret;
+}
+
 typedef int (*perf_test_fn)(struct bch_fs *, u64);
 
 struct test_job {
@@ -730,33 +1457,65 @@ static int btree_perf_test_thread(void *data)
 	return 0;
 }
 
-int bch2_btree_perf_test(struct bch_fs *c, const char *testname,
-			 u64 nr, unsigned nr_threads)
+/* Results of the most recent perf test runs, for sysfs: */
+#define PERF_TEST_RESULTS_NR	32
+
+static const unsigned perf_test_per_mille[] = { 500, 990, 999 };
+
+struct perf_test_result {
+	char			name[24];
+	unsigned		nr_threads;
+	u64			nr;
+	u64			per_sec;
+	u64			restarts;
+	u64			latency[ARRAY_SIZE(perf_test_per_mille)];
+};
+
+static DEFINE_MUTEX(perf_test_results_lock);
+static struct perf_test_result perf_test_results[PERF_TEST_RESULTS_NR];
+static unsigned perf_test_results_nr;
+
+static u64 perf_test_restarts(struct bch_fs *c)
 {
-	struct test_job j = { .c = c, .nr = nr, .nr_threads = nr_threads };
-	char name_buf[20], nr_buf[20], per_sec_buf[20];
+	u64 ret = 0;
 	unsigned i;
-	u64 time;
 
-	atomic_set(&j.ready, nr_threads);
-	init_waitqueue_head(&j.ready_wait);
-
-	atomic_set(&j.done, nr_threads);
-	init_completion(&j.done_completion);
+	for (i = 0; i < BCH_TRANS_RESTART_NR; i++)
+		ret += percpu_u64_get(&c->btree_trans_restart_stats->reason[i]);
+	return ret;
+}
 
+static perf_test_fn perf_test_lookup(const char *testname)
+{
 #define perf_test(_test)				\
-	if (!strcmp(testname, #_test)) j.fn = _test
+	if (!strcmp(testname, #_test)) return _test
 
 	perf_test(rand_insert);
 	perf_test(rand_lookup);
 	perf_test(rand_mixed);
+	perf_test(rand_mixed_read_mostly);
+	perf_test(rand_mixed_write_heavy);
 	perf_test(rand_delete);
 
+	perf_test(multi_iter_update);
+	perf_test(shared_key_update);
+	perf_test(inode_update_cached);
+	perf_test(inode_delete_cached);
+
 	perf_test(seq_insert);
+	perf_test(seq_bulk_load);
 	perf_test(seq_lookup);
 	perf_test(seq_overwrite);
 	perf_test(seq_delete);
 
+	perf_test(inode_pack);
+	perf_test(key_pack);
+	perf_test(key_unpack);
+	perf_test(eytzinger_lookup);
+	perf_test(bset_insert);
+	perf_test(bset_lookup);
+	perf_test(key_sort);
+
 	/* a unit test, not a perf test: */
 	perf_test(test_delete);
 	perf_test(test_delete_written);
@@ -764,6 +1523,7 @@ int bch2_btree_perf_test(struct bch_fs *c, const char *testname,
 	perf_test(test_iterate_extents);
 	perf_test(test_iterate_slots);
 	perf_test(test_iterate_slots_extents);
+	perf_test(test_lookup_batch);
 	perf_test(test_peek_end);
 	perf_test(test_peek_end_extents);
 
@@ -771,13 +1531,36 @@ int bch2_btree_perf_test(struct bch_fs *c, const char *testname,
 	perf_test(test_extent_overwrite_back);
 	perf_test(test_extent_overwrite_middle);
 	perf_test(test_extent_overwrite_all);
+#undef perf_test
 
-	if (!j.fn) {
-		pr_err("unknown test %s", testname);
-		return -EINVAL;
-	}
+	return NULL;
+}
+
+/* Called with perf_test_lock held: */
+static int __bch2_btree_perf_test(struct bch_fs *c, const char *testname,
+				  perf_test_fn fn, u64 nr, unsigned nr_threads)
+{
+	struct test_job j = {
+		.c		= c,
+		.nr		= nr,
+		.nr_threads	= nr_threads,
+		.fn		= fn,
+	};
+	struct time_stats latency;
+	struct perf_test_result *r;
+	char name_buf[20], nr_buf[20], per_sec_buf[20];
+	u64 time, restarts;
+	unsigned i;
 
-	//pr_info("running test %s:", testname);
+	atomic_set(&j.ready, nr_threads);
+	init_waitqueue_head(&j.ready_wait);
+
+	atomic_set(&j.done, nr_threads);
+	init_completion(&j.done_completion);
+
+	bch2_time_stats_init(&latency);
+	perf_test_latency = &latency;
+	restarts = perf_test_restarts(c);
 
 	if (nr_threads == 1)
 		btree_perf_test_thread(&j);
@@ -789,17 +1572,122 @@ int bch2_btree_perf_test(struct bch_fs *c, const char *testname,
 	while (wait_for_completion_interruptible(&j.done_completion))
 		;
 
-	time = j.finish - j.start;
+	perf_test_latency = NULL;
+	restarts = perf_test_restarts(c) - restarts;
+	time = max(j.finish - j.start, 1ULL);
+
+	mutex_lock(&perf_test_results_lock);
+	r = perf_test_results +
+		perf_test_results_nr++ % PERF_TEST_RESULTS_NR;
+	memset(r, 0, sizeof(*r));
+	strlcpy(r->name, testname, sizeof(r->name));
+	r->nr_threads	= nr_threads;
+	r->nr		= nr;
+	r->per_sec	= div64_u64(nr * NSEC_PER_SEC, time);
+	r->restarts	= restarts;
+	bch2_time_stats_percentiles(&latency, perf_test_per_mille,
+				    r->latency, ARRAY_SIZE(r->latency));
+	mutex_unlock(&perf_test_results_lock);
+
+	bch2_time_stats_exit(&latency);
 
 	scnprintf(name_buf, sizeof(name_buf), "%s:", testname);
 	bch2_hprint(&PBUF(nr_buf), nr);
-	bch2_hprint(&PBUF(per_sec_buf), nr * NSEC_PER_SEC / time);
-	printk(KERN_INFO "%-12s %s with %u threads in %5llu sec, %5llu nsec per iter, %5s per sec\n",
+	bch2_hprint(&PBUF(per_sec_buf), r->per_sec);
+	printk(KERN_INFO "%-12s %s with %u threads in %5llu sec, %5llu nsec per iter, %5s per sec, %llu restarts\n",
 		name_buf, nr_buf, nr_threads,
 		time / NSEC_PER_SEC,
 		time * nr_threads / nr,
-		per_sec_buf);
+		per_sec_buf, restarts);
 	return j.ret;
 }
 
+/*
+ * The tests in the suite run in this order at each thread count - rand_insert
+ * first so that the rest have keys to work on:
+ */
+static const char * const perf_test_suite[] = {
+	"rand_insert",
+	"rand_lookup",
+	"rand_mixed_read_mostly",
+	"rand_mixed",
+	"rand_mixed_write_heavy",
+	"multi_iter_update",
+	"shared_key_update",
+	"inode_update_cached",
+	"rand_delete",
+};
+
+/*
+ * Runs each test in the suite with 1, 2, 4 ... up to @max_threads threads,
+ * then deletes the keys the suite created:
+ */
+static int bch2_btree_perf_suite(struct bch_fs *c, u64 nr, unsigned max_threads)
+{
+	unsigned i, nr_threads;
+	int ret = 0;
+
+	for (nr_threads = 1;; nr_threads = min(nr_threads * 2, max_threads)) {
+		for (i = 0; !ret && i < ARRAY_SIZE(perf_test_suite); i++)
+			ret = __bch2_btree_perf_test(c, perf_test_suite[i],
+					perf_test_lookup(perf_test_suite[i]),
+					nr, nr_threads);
+
+		if (ret || nr_threads == max_threads)
+			break;
+	}
+
+	return  inode_delete_cached(c, 0) ?:
+		seq_delete(c, 0) ?:
+		ret;
+}
+
+int bch2_btree_perf_test(struct bch_fs *c, const char *testname,
+			 u64 nr, unsigned nr_threads)
+{
+	perf_test_fn fn = perf_test_lookup(testname);
+	int ret;
+
+	if (!nr || !nr_threads)
+		return -EINVAL;
+
+	if (!fn && strcmp(testname, "suite")) {
+		pr_err("unknown test %s", testname);
+		return -EINVAL;
+	}
+
+	mutex_lock(&perf_test_lock);
+	ret = fn
+		? __bch2_btree_perf_test(c, testname, fn, nr, nr_threads)
+		: bch2_btree_perf_suite(c, nr, nr_threads);
+	mutex_unlock(&perf_test_lock);
+
+	return ret;
+}
+
+void bch2_perf_test_results_to_text(struct printbuf *out)
+{
+	struct perf_test_result *r;
+	unsigned i, j, nr;
+
+	pr_buf(out, "%-24s %7s %10s %10s %9s %9s %9s %9s\n",
+	       "test", "threads", "iters", "per sec", "restarts",
+	       "p50 ns", "p99 ns", "p999 ns");
+
+	mutex_lock(&perf_test_results_lock);
+	nr = min_t(unsigned, perf_test_results_nr, PERF_TEST_RESULTS_NR);
+
+	for (i = perf_test_results_nr - nr; i < perf_test_results_nr; i++) {
+		r = perf_test_results + i % PERF_TEST_RESULTS_NR;
+
+		pr_buf(out, "%-24s %7u %10llu %10llu %9llu",
+		       r->name, r->nr_threads, r->nr,
+		       r->per_sec, r->restarts);
+		for (j = 0; j < ARRAY_SIZE(r->latency); j++)
+			pr_buf(out, " %9llu", r->latency[j]);
+		pr_buf(out, "\n");
+	}
+	mutex_unlock(&perf_test_results_lock);
+}
+
 #endif /* CONFIG_BCACHEFS_TESTS */
@@ -3,10 +3,12 @@
 #define _BCACHEFS_TEST_H
 
 struct bch_fs;
+struct printbuf;
 
 #ifdef CONFIG_BCACHEFS_TESTS
 
 int bch2_btree_perf_test(struct bch_fs *, const char *, u64, unsigned);
+void bch2_perf_test_results_to_text(struct printbuf *);
 
 #else
 
@@ -0,0 +1,158 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include "bcachefs.h"
+#include "buckets.h"
+#include "super.h"
+#include "usage_history.h"
+
+#include <linux/timekeeping.h>
+
+/*
+ * Usage history:
+ *
+ * Once a second we take a snapshot of filesystem usage - space used, number of
+ * inodes, and sectors written since the last snapshot, before and after
+ * compression - along with the sectors written to each device per data type,
+ * and keep the last BCH_USAGE_HISTORY_NR in a ring, for sysfs.
+ *
+ * This is meant for watching trends, without having to poll usage ioctls: it
+ * only looks at counters we're already keeping, so it's cheap.
+ */
+
+static struct write_compression_count
+write_compression_read(struct bch_fs *c)
+{
+	struct write_compression_count ret = { 0 };
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct write_compression_count *i =
+			per_cpu_ptr(c->usage_history.written, cpu);
+
+		ret.uncompressed	+= i->uncompressed;
+		ret.compressed		+= i->compressed;
+	}
+
+	return ret;
+}
+
+static void bch2_usage_history_snapshot(struct bch_fs *c)
+{
+	struct bch_fs_usage_history *h = &c->usage_history;
+	struct bch_fs_usage_short usage = bch2_fs_usage_read_short_cached(c);
+	struct write_compression_count written = write_compression_read(c);
+	unsigned idx = h->nr % BCH_USAGE_HISTORY_NR;
+	struct usage_snapshot *s = &h->s[idx];
+	struct bch_dev *ca;
+	unsigned i, t;
+
+	mutex_lock(&h->lock);
+	s->time			= ktime_get_real_seconds();
+	s->used			= usage.used;
+	s->nr_inodes		= usage.nr_inodes;
+	s->written.uncompressed	= written.uncompressed - h->last.uncompressed;
+	s->written.compressed	= written.compressed - h->last.compressed;
+	h->last			= written;
+
+	for_each_member_device(ca, c, i) {
+		struct bch_dev_usage_history *d = &ca->usage_history;
+
+		for (t = 0; t < BCH_DATA_NR; t++) {
+			u64 v = percpu_u64_get(&ca->io_done->sectors[WRITE][t]);
+
+			d->written[idx][t] = d->valid ? v - d->last[t] : 0;
+			d->last[t] = v;
+		}
+		d->valid = true;
+	}
+
+	h->nr++;
+	mutex_unlock(&h->lock);
+}
+
+static void bch2_usage_history_work(struct work_struct *work)
+{
+	struct bch_fs *c = container_of(to_delayed_work(work),
+					struct bch_fs, usage_history.work);
+
+	bch2_usage_history_snapshot(c);
+	schedule_delayed_work(&c->usage_history.work, HZ);
+}
+
+void bch2_fs_usage_history_to_text(struct printbuf *out, struct bch_fs *c)
+{
+	struct bch_fs_usage_history *h = &c->usage_history;
+	u64 i;
+
+	pr_buf(out, "time used nr_inodes written written_compressed (sectors)\n");
+
+	mutex_lock(&h->lock);
+	for (i = h->nr - min_t(u64, h->nr, BCH_USAGE_HISTORY_NR);
+	     i < h->nr;
+	     i++) {
+		struct usage_snapshot *s = &h->s[i % BCH_USAGE_HISTORY_NR];
+
+		pr_buf(out, "%llu %llu %llu %llu %llu\n",
+		       s->time,
+		       s->used,
+		       s->nr_inodes,
+		       s->written.uncompressed,
+		       s->written.compressed);
+	}
+	mutex_unlock(&h->lock);
+}
+
+void bch2_dev_usage_history_to_text(struct printbuf *out, struct bch_dev *ca)
+{
+	struct bch_fs *c = ca->fs;
+	struct bch_fs_usage_history *h = &c->usage_history;
+	unsigned t;
+	u64 i;
+
+	pr_buf(out, "time");
+	for (t = 1; t < BCH_DATA_NR; t++)
+		pr_buf(out, " %s", bch2_data_types[t]);
+	pr_buf(out, " (sectors written)\n");
+
+	mutex_lock(&h->lock);
+	for (i = h->nr - min_t(u64, h->nr, BCH_USAGE_HISTORY_NR);
+	     i < h->nr;
+	     i++) {
+		unsigned idx = i % BCH_USAGE_HISTORY_NR;
+
+		pr_buf(out, "%llu", h->s[idx].time);
+		for (t = 1; t < BCH_DATA_NR; t++)
+			pr_buf(out, " %llu", ca->usage_history.written[idx][t]);
+		pr_buf(out, "\n");
+	}
+	mutex_unlock(&h->lock);
+}
+
+void bch2_fs_usage_history_stop(struct bch_fs *c)
+{
+	cancel_delayed_work_sync(&c->usage_history.work);
+}
+
+void bch2_fs_usage_history_start(struct bch_fs *c)
+{
+	schedule_delayed_work(&c->usage_history.work, HZ);
+}
+
+void bch2_fs_usage_history_exit(struct bch_fs *c)
+{
+	free_percpu(c->usage_history.written);
+}
+
+int bch2_fs_usage_history_init(struct bch_fs *c)
+{
+	struct bch_fs_usage_history *h = &c->usage_history;
+
+	mutex_init(&h->lock);
+	INIT_DELAYED_WORK(&h->work, bch2_usage_history_work);
+
+	h->written = alloc_percpu(struct write_compression_count);
+	if (!h->written)
+		return -ENOMEM;
+
+	return 0;
+}
@@ -0,0 +1,24 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _BCACHEFS_USAGE_HISTORY_H
+#define _BCACHEFS_USAGE_HISTORY_H
+
+#include "usage_history_types.h"
+
+static inline void bch2_usage_history_account_write(struct bch_fs *c,
+						    u64 uncompressed,
+						    u64 compressed)
+{
+	this_cpu_add(c->usage_history.written->uncompressed, uncompressed);
+	this_cpu_add(c->usage_history.written->compressed, compressed);
+}
+
+void bch2_fs_usage_history_to_text(struct printbuf *, struct bch_fs *);
+void bch2_dev_usage_history_to_text(struct printbuf *, struct bch_dev *);
+
+void bch2_fs_usage_history_stop(struct bch_fs *);
+void bch2_fs_usage_history_start(struct bch_fs *);
+
+void bch2_fs_usage_history_exit(struct bch_fs *);
+int bch2_fs_usage_history_init(struct bch_fs *);
+
+#endif /* _BCACHEFS_USAGE_HISTORY_H */
@@ -0,0 +1,38 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _BCACHEFS_USAGE_HISTORY_TYPES_H
+#define _BCACHEFS_USAGE_HISTORY_TYPES_H
+
+#define BCH_USAGE_HISTORY_NR		48
+
+struct write_compression_count {
+	u64			uncompressed;
+	u64			compressed;
+};
+
+struct usage_snapshot {
+	u64			time;
+	u64			used;
+	u64			nr_inodes;
+	/* sectors written since the previous snapshot: */
+	struct write_compression_count written;
+};
+
+struct bch_fs_usage_history {
+	struct delayed_work	work;
+	/* protects the rings, for readers: */
+	struct mutex		lock;
+	/* total number of snapshots taken: */
+	u64			nr;
+	struct write_compression_count last;
+	struct write_compression_count __percpu *written;
+	struct usage_snapshot	s[BCH_USAGE_HISTORY_NR];
+};
+
+struct bch_dev_usage_history {
+	bool			valid;
+	u64			last[BCH_DATA_NR];
+	/* sectors written per data type, indexed with the filesystem ring: */
+	u64			written[BCH_USAGE_HISTORY_NR][BCH_DATA_NR];
+};
+
+#endif /* _BCACHEFS_USAGE_HISTORY_TYPES_H */
@@ -219,6 +219,32 @@ static void bch2_quantiles_update(struct quantiles *q, u64 v)
 
 /* time stats: */
 
+/* Midpoint of the range of durations that land in bucket @idx: */
+static u64 time_stats_hist_val(unsigned idx)
+{
+	unsigned shift, sub;
+
+	if (idx < (1U << TIME_STATS_HIST_SUB_BITS))
+		return idx;
+
+	shift	= (idx >> TIME_STATS_HIST_SUB_BITS) - 1;
+	sub	= idx & ((1U << TIME_STATS_HIST_SUB_BITS) - 1);
+
+	return (((u64) (1U << TIME_STATS_HIST_SUB_BITS) + sub) << shift) +
+		((1ULL << shift) >> 1);
+}
+
+static u64 time_stats_hist_bucket(struct time_stats_hist __percpu *hist,
+				  unsigned idx)
+{
+	u64 ret = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		ret += READ_ONCE(per_cpu_ptr(hist, cpu)->b[idx]);
+	return ret;
+}
+
 static void bch2_time_stats_update_one(struct time_stats *stats,
 				       u64 start, u64 end)
 {
@@ -248,8 +274,12 @@ static void bch2_time_stats_update_one(struct time_stats *stats,
 
 void __bch2_time_stats_update(struct time_stats *stats, u64 start, u64 end)
 {
+	u64 duration = time_after64(end, start) ? end - start : 0;
 	unsigned long flags;
 
+	if (stats->hist)
+		bch2_time_stats_hist_add(stats->hist, duration);
+
 	if (!stats->buffer) {
 		spin_lock_irqsave(&stats->lock, flags);
 		bch2_time_stats_update_one(stats, start, end);
@@ -311,13 +341,79 @@ static const struct time_unit *pick_time_units(u64 ns)
 	return u;
 }
 
-static void pr_time_units(struct printbuf *out, u64 ns)
+void bch2_pr_time_units(struct printbuf *out, u64 ns)
 {
 	const struct time_unit *u = pick_time_units(ns);
 
 	pr_buf(out, "%llu %s", div_u64(ns, u->nsecs), u->name);
 }
 
+/*
+ * Sets @v[j] to the duration that @per_mille[j] / 1000 of events completed
+ * within; @per_mille must be sorted. All zeroes if nothing has been recorded:
+ */
+void bch2_time_stats_percentiles(struct time_stats *stats,
+				 const unsigned *per_mille, u64 *v, unsigned nr)
+{
+	memset(v, 0, sizeof(*v) * nr);
+
+	if (stats->hist)
+		bch2_time_stats_hist_percentiles(stats->hist, per_mille, v, nr);
+}
+
+/*
+ * As bch2_time_stats_percentiles(), for a bare histogram; returns the number of
+ * events recorded:
+ */
+u64 bch2_time_stats_hist_percentiles(struct time_stats_hist __percpu *hist,
+				     const unsigned *per_mille, u64 *v,
+				     unsigned nr)
+{
+	u64 total = 0, seen = 0;
+	unsigned i, j = 0;
+
+	memset(v, 0, sizeof(*v) * nr);
+
+	for (i = 0; i < TIME_STATS_HIST_NR; i++)
+		total += time_stats_hist_bucket(hist, i);
+
+	if (!total)
+		return 0;
+
+	/*
+	 * Buckets keep being incremented while we walk them: clamp to the total
+	 * we just computed, and anything past it falls into the last bucket:
+	 */
+	for (i = 0; i < TIME_STATS_HIST_NR && j < nr; i++) {
+		seen += time_stats_hist_bucket(hist, i);
+
+		while (j < nr && seen * 1000 >= total * per_mille[j])
+			v[j++] = time_stats_hist_val(i);
+	}
+
+	while (j < nr)
+		v[j++] = time_stats_hist_val(TIME_STATS_HIST_NR - 1);
+
+	return total;
+}
+
+static void time_stats_hist_to_text(struct printbuf *out,
+				    struct time_stats *stats)
+{
+	static const char * const names[] = { "p50", "p99", "p999" };
+	static const unsigned per_mille[] = { 500, 990, 999 };
+	u64 v[ARRAY_SIZE(per_mille)];
+	unsigned j;
+
+	bch2_time_stats_percentiles(stats, per_mille, v, ARRAY_SIZE(v));
+
+	for (j = 0; j < ARRAY_SIZE(v); j++) {
+		pr_buf(out, "%s:\t\t", names[j]);
+		bch2_pr_time_units(out, v[j]);
+		pr_buf(out, "\n");
+	}
+}
+
 void bch2_time_stats_to_text(struct printbuf *out, struct time_stats *stats)
 {
 	const struct time_unit *u;
@@ -331,13 +427,13 @@ void bch2_time_stats_to_text(struct printbuf *out, struct time_stats *stats)
 	       freq ?  div64_u64(NSEC_PER_SEC, freq) : 0);
 
 	pr_buf(out, "frequency:\t");
-	pr_time_units(out, freq);
+	bch2_pr_time_units(out, freq);
 
 	pr_buf(out, "\navg duration:\t");
-	pr_time_units(out, stats->average_duration);
+	bch2_pr_time_units(out, stats->average_duration);
 
 	pr_buf(out, "\nmax duration:\t");
-	pr_time_units(out, stats->max_duration);
+	bch2_pr_time_units(out, stats->max_duration);
 
 	i = eytzinger0_first(NR_QUANTILES);
 	u = pick_time_units(stats->quantiles.entries[i].m);
@@ -352,10 +448,14 @@ void bch2_time_stats_to_text(struct printbuf *out, struct time_stats *stats)
 		       is_last ? "\n" : " ");
 		last_q = q;
 	}
+
+	if (stats->hist)
+		time_stats_hist_to_text(out, stats);
 }
 
 void bch2_time_stats_exit(struct time_stats *stats)
 {
+	free_percpu(stats->hist);
 	free_percpu(stats->buffer);
 }
 
@@ -363,6 +463,9 @@ void bch2_time_stats_init(struct time_stats *stats)
 {
 	memset(stats, 0, sizeof(*stats));
 	spin_lock_init(&stats->lock);
+
+	/* Histogram is optional - percentiles just aren't reported without it: */
+	stats->hist = alloc_percpu(struct time_stats_hist);
 }
 
 /* ratelimit: */
@@ -755,6 +858,20 @@ int mempool_init_kvpmalloc_pool(mempool_t *pool, int min_nr, size_t size)
 			       mempool_free_vp, (void *) size);
 }
 
+/*
+ * Memory a mempool holds in reserve - only for page pools and pools created by
+ * mempool_init_k(vp)malloc_pool(), where pool_data is the element size:
+ */
+size_t mempool_reserved_bytes(mempool_t *pool)
+{
+	if (!mempool_initialized(pool))
+		return 0;
+
+	return pool->min_nr * (pool->alloc == mempool_alloc_pages
+			       ? PAGE_SIZE << (unsigned long) pool->pool_data
+			       : (size_t) pool->pool_data);
+}
+
 #if 0
 void eytzinger1_test(void)
 {
@@ -107,6 +107,7 @@ static inline void *kvpmalloc(size_t size, gfp_t gfp_mask)
 }
 
 int mempool_init_kvpmalloc_pool(mempool_t *, int, size_t);
+size_t mempool_reserved_bytes(mempool_t *);
 
 #define HEAP(type)							\
 struct {								\
@@ -367,6 +368,44 @@ struct time_stat_buffer {
 	}		entries[32];
 };
 
+/*
+ * Log-linear histogram of durations: values below 2^TIME_STATS_HIST_SUB_BITS ns
+ * get one bucket each, every power of two above that is split into
+ * 2^TIME_STATS_HIST_SUB_BITS linear buckets (so bucketing error is bounded at
+ * 12.5%); durations past 2^(TIME_STATS_HIST_MAX_BIT + 1) ns are clamped into
+ * the last bucket:
+ */
+#define TIME_STATS_HIST_SUB_BITS	3
+#define TIME_STATS_HIST_MAX_BIT		36
+#define TIME_STATS_HIST_NR					\
+	((TIME_STATS_HIST_MAX_BIT - TIME_STATS_HIST_SUB_BITS + 2) <<	\
+	 TIME_STATS_HIST_SUB_BITS)
+
+struct time_stats_hist {
+	u64		b[TIME_STATS_HIST_NR];
+};
+
+static inline unsigned time_stats_hist_idx(u64 v)
+{
+	unsigned msb;
+
+	if (v < (1U << TIME_STATS_HIST_SUB_BITS))
+		return v;
+
+	v = min_t(u64, v, (2ULL << TIME_STATS_HIST_MAX_BIT) - 1);
+	msb = fls64(v) - 1;
+
+	return ((msb - TIME_STATS_HIST_SUB_BITS + 1) << TIME_STATS_HIST_SUB_BITS) +
+		((v >> (msb - TIME_STATS_HIST_SUB_BITS)) &
+		 ((1U << TIME_STATS_HIST_SUB_BITS) - 1));
+}
+
+static inline void bch2_time_stats_hist_add(struct time_stats_hist __percpu *hist,
+					    u64 duration)
+{
+	this_cpu_inc(hist->b[time_stats_hist_idx(duration)]);
+}
+
 struct time_stats {
 	spinlock_t	lock;
 	u64		count;
@@ -378,6 +417,8 @@ struct time_stats {
 	struct quantiles quantiles;
 
 	struct time_stat_buffer __percpu *buffer;
+	/* updated locklessly, summed across cpus when read: */
+	struct time_stats_hist __percpu *hist;
 };
 
 void __bch2_time_stats_update(struct time_stats *stats, u64, u64);
@@ -387,6 +428,11 @@ static inline void bch2_time_stats_update(struct time_stats *stats, u64 start)
 	__bch2_time_stats_update(stats, start, local_clock());
 }
 
+void bch2_time_stats_percentiles(struct time_stats *, const unsigned *,
+				 u64 *, unsigned);
+u64 bch2_time_stats_hist_percentiles(struct time_stats_hist __percpu *,
+				     const unsigned *, u64 *, unsigned);
+void bch2_pr_time_units(struct printbuf *, u64);
 void bch2_time_stats_to_text(struct printbuf *, struct time_stats *);
 
 void bch2_time_stats_exit(struct time_stats *);
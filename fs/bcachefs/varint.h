@@ -2,6 +2,63 @@
 #ifndef _BCACHEFS_VARINT_H
 #define _BCACHEFS_VARINT_H
 
+#include <linux/bitops.h>
+#include <asm/unaligned.h>
+
+/*
+ * Inlined versions, for packing and unpacking inodes and alloc keys a field at a
+ * time. Like the out of line versions, these read and write a full u64, past
+ * the end of shorter varints:
+ */
+
+static inline int __bch2_varint_encode(u8 *out, u64 v)
+{
+	unsigned bits = fls64(v|1);
+	unsigned bytes = DIV_ROUND_UP(bits, 7);
+
+	if (likely(bytes < 9)) {
+		v <<= bytes;
+		v |= ~(~0 << (bytes - 1));
+	} else {
+		*out++ = 255;
+		bytes = 9;
+	}
+
+	put_unaligned_le64(v, out);
+	return bytes;
+}
+
+static inline int __bch2_varint_decode(const u8 *in, const u8 *end, u64 *out)
+{
+	u64 v;
+	unsigned bytes;
+
+	if (unlikely(in >= end))
+		return -1;
+
+	/* Single byte varints, i.e. values < 128, are the common case: */
+	if (likely(!(*in & 1))) {
+		*out = *in >> 1;
+		return 1;
+	}
+
+	v = get_unaligned_le64(in);
+	bytes = ffz(v & 255) + 1;
+
+	if (unlikely(in + bytes > end))
+		return -1;
+
+	if (likely(bytes < 9)) {
+		v >>= bytes;
+		v &= ~(~0ULL << (7 * bytes));
+	} else {
+		v = get_unaligned_le64(++in);
+	}
+
+	*out = v;
+	return bytes;
+}
+
 int bch2_varint_encode(u8 *, u64);
 int bch2_varint_decode(const u8 *, const u8 *, u64 *);
 
@@ -10,6 +10,7 @@
 #include "xattr.h"
 
 #include <linux/dcache.h>
+#include <linux/jhash.h>
 #include <linux/posix_acl_xattr.h>
 #include <linux/xattr.h>
 
@@ -118,14 +119,87 @@ void bch2_xattr_to_text(struct printbuf *out, struct bch_fs *c,
 		      le16_to_cpu(xattr.v->x_val_len));
 }
 
+/*
+ * Security modules look up xattrs that usually don't exist (e.g.
+ * security.capability, on every write), so the inode caches a bitmap, by hash
+ * of type and name, of the xattrs that do exist: a lookup whose bit is clear
+ * can't find anything. Colliding names just mean a real lookup.
+ *
+ * The bitmap is filled in by walking the inode's xattrs on first use, and
+ * invalidated whenever an xattr on the inode is set, by bumping the sequence
+ * number in the high bits - a fill that raced with a set is thrown away.
+ */
+#define XATTR_PRESENT_BITS	32
+#define XATTR_PRESENT_VALID	(1ULL << XATTR_PRESENT_BITS)
+#define XATTR_PRESENT_SEQ_SHIFT	(XATTR_PRESENT_BITS + 1)
+
+static u64 xattr_present_bit(int type, const char *name, unsigned len)
+{
+	return 1ULL << (jhash(name, len, type) % XATTR_PRESENT_BITS);
+}
+
+static u64 xattr_present_fill(struct bch_fs *c, struct bch_inode_info *inode,
+			      u64 v)
+{
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	u64 inum = inode->v.i_ino, bits = 0, old;
+	int ret;
+
+	bch2_trans_init(&trans, c, 0, 0);
+
+	for_each_btree_key(&trans, iter, BTREE_ID_XATTRS,
+			   POS(inum, 0), 0, k, ret) {
+		struct bkey_s_c_xattr xattr;
+
+		if (k.k->p.inode > inum)
+			break;
+
+		if (k.k->type != KEY_TYPE_xattr)
+			continue;
+
+		xattr = bkey_s_c_to_xattr(k);
+		bits |= xattr_present_bit(xattr.v->x_type,
+					  xattr.v->x_name,
+					  xattr.v->x_name_len);
+	}
+	ret = bch2_trans_exit(&trans) ?: ret;
+	if (ret)
+		return v;
+
+	/* Only if no xattrs were set since @v was read: */
+	old = atomic64_cmpxchg(&inode->ei_xattr_present, v,
+			       v|XATTR_PRESENT_VALID|bits);
+	return old == v ? v|XATTR_PRESENT_VALID|bits : old;
+}
+
+static void xattr_present_invalidate(struct bch_inode_info *inode)
+{
+	u64 v = atomic64_read(&inode->ei_xattr_present), old;
+
+	while ((old = atomic64_cmpxchg(&inode->ei_xattr_present, v,
+			((v >> XATTR_PRESENT_SEQ_SHIFT) + 1) <<
+			XATTR_PRESENT_SEQ_SHIFT)) != v)
+		v = old;
+}
+
 int bch2_xattr_get(struct bch_fs *c, struct bch_inode_info *inode,
 		   const char *name, void *buffer, size_t size, int type)
 {
 	struct btree_trans trans;
 	struct btree_iter *iter;
 	struct bkey_s_c_xattr xattr;
+	u64 present = atomic64_read(&inode->ei_xattr_present);
 	int ret;
 
+	if (!(present & XATTR_PRESENT_VALID))
+		present = xattr_present_fill(c, inode, present);
+
+	if ((present & XATTR_PRESENT_VALID) &&
+	    !(present & xattr_present_bit(type, name, strlen(name))))
+		return -ENODATA;
+
 	bch2_trans_init(&trans, c, 0, 0);
 
 	iter = bch2_hash_lookup(&trans, bch2_xattr_hash_desc,
@@ -326,12 +400,15 @@ static int bch2_xattr_set_handler(const struct xattr_handler *handler,
 {
 	struct bch_inode_info *inode = to_bch_ei(vinode);
 	struct bch_fs *c = inode->v.i_sb->s_fs_info;
+	int ret;
 
-	return bch2_trans_do(c, NULL, &inode->ei_journal_seq, 0,
+	ret = bch2_trans_do(c, NULL, &inode->ei_journal_seq, 0,
 			bch2_xattr_set(&trans, inode->v.i_ino,
 				       &inode->ei_str_hash,
 				       name, value, size,
 				       handler->flags, flags));
+	xattr_present_invalidate(inode);
+	return ret;
 }
 
 static const struct xattr_handler bch_xattr_user_handler = {
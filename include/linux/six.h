@@ -56,6 +56,14 @@
  * correct type, six_lock_increment() may be used to bump up the counter for
  * that type - the only effect is that one more call to unlock will be required
  * before the lock is unlocked.
+ *
+ * Per-CPU reader mode: six_lock_pcpu_alloc() switches a lock to tracking read
+ * locks with per-CPU counters instead of in the shared lock word, so that
+ * heavily read locked objects don't bounce a cacheline between CPUs. Taking the
+ * lock for write then has to sum the per-CPU counters, so this only makes
+ * sense for locks that are rarely write locked. six_lock_pcpu_alloc() may be
+ * called with the lock held for write (and not for read); six_lock_pcpu_free()
+ * must only be called once nothing else can reach the lock.
  */
 
 #include <linux/lockdep.h>
@@ -80,7 +88,9 @@ union six_lock_state {
 	};
 
 	struct {
-		unsigned	read_lock:28;
+		unsigned	read_lock:27;
+		/* percpu reader mode: a writer is waiting for readers to drain */
+		unsigned	write_locking:1;
 		unsigned	intent_lock:1;
 		unsigned	waiters:3;
 		/*
@@ -106,6 +116,7 @@ struct six_lock {
 	union six_lock_state	state;
 	unsigned		intent_lock_recurse;
 	struct task_struct	*owner;
+	unsigned __percpu	*readers;
 	struct optimistic_spin_queue osq;
 
 	raw_spinlock_t		wait_lock;
@@ -194,4 +205,7 @@ void six_lock_increment(struct six_lock *, enum six_lock_type);
 
 void six_lock_wakeup_all(struct six_lock *);
 
+void six_lock_pcpu_free(struct six_lock *);
+void six_lock_pcpu_alloc(struct six_lock *);
+
 #endif /* _LINUX_SIX_H */
@@ -721,6 +721,32 @@ DEFINE_EVENT(transaction_restart,	trans_restart_traverse,
 	TP_ARGS(ip)
 );
 
+TRACE_EVENT(trans_commit_phases,
+	TP_PROTO(unsigned long ip, const u64 *ns),
+	TP_ARGS(ip, ns),
+
+	TP_STRUCT__entry(
+		__field(unsigned long,		ip	)
+		__array(u64,			ns, BCH_TRANS_COMMIT_PHASE_NR)
+	),
+
+	TP_fast_assign(
+		__entry->ip = ip;
+		memcpy(__entry->ns, ns, sizeof(__entry->ns));
+	),
+
+	TP_printk("%ps triggers %llu journal_preres %llu write_locks %llu "
+		  "journal_res %llu mark %llu insert %llu unlock %llu",
+		  (void *) __entry->ip,
+		  __entry->ns[BCH_TRANS_COMMIT_PHASE_triggers],
+		  __entry->ns[BCH_TRANS_COMMIT_PHASE_journal_preres],
+		  __entry->ns[BCH_TRANS_COMMIT_PHASE_write_locks],
+		  __entry->ns[BCH_TRANS_COMMIT_PHASE_journal_res],
+		  __entry->ns[BCH_TRANS_COMMIT_PHASE_mark],
+		  __entry->ns[BCH_TRANS_COMMIT_PHASE_insert],
+		  __entry->ns[BCH_TRANS_COMMIT_PHASE_unlock])
+);
+
 DECLARE_EVENT_CLASS(node_lock_fail,
 	TP_PROTO(unsigned level, u32 iter_seq, unsigned node, u32 node_seq),
 	TP_ARGS(level, iter_seq, node, node_seq),
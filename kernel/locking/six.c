@@ -2,6 +2,7 @@
 
 #include <linux/export.h>
 #include <linux/log2.h>
+#include <linux/percpu.h>
 #include <linux/preempt.h>
 #include <linux/rcupdate.h>
 #include <linux/sched.h>
@@ -76,15 +77,115 @@ static inline void six_set_owner(struct six_lock *lock, enum six_lock_type type,
 	}
 }
 
+static inline void six_lock_wakeup(struct six_lock *,
+				   union six_lock_state, unsigned);
+
+/*
+ * Per-CPU reader mode:
+ *
+ * Readers first increment their per-CPU count, then - after a full barrier -
+ * check that no writer holds the lock or is trying to take it. Writers first
+ * set write_locking, then - after a full barrier - check that the per-CPU
+ * counts sum to zero. Either the reader sees write_locking or the writer sees
+ * the reader's count, so they can't both succeed; whichever side fails backs
+ * off, and a reader that backs off because of a waiting writer wakes it up so
+ * that it recounts.
+ */
+
+#define __SIX_PCPU_READ_FAIL	(__SIX_LOCK_HELD_write|__SIX_VAL(write_locking, 1))
+
+static inline unsigned pcpu_read_count(struct six_lock *lock)
+{
+	unsigned read_count = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		read_count += *per_cpu_ptr(lock->readers, cpu);
+	return read_count;
+}
+
+static inline void six_wake_writer(struct six_lock *lock)
+{
+	struct task_struct *p = READ_ONCE(lock->owner);
+
+	if (p)
+		wake_up_process(p);
+}
+
+static bool six_pcpu_read_trylock(struct six_lock *lock,
+				  bool check_seq, u32 seq)
+{
+	union six_lock_state old;
+	bool ret;
+
+	preempt_disable();
+	this_cpu_inc(*lock->readers);
+
+	smp_mb();
+
+	old.v = READ_ONCE(lock->state.v);
+	ret = !(old.v & __SIX_PCPU_READ_FAIL) &&
+		(!check_seq || old.seq == seq);
+
+	if (!ret)
+		this_cpu_dec(*lock->readers);
+	preempt_enable();
+
+	/* A writer may have seen our count and gone to sleep: */
+	if (!ret && old.write_locking)
+		six_wake_writer(lock);
+
+	return ret;
+}
+
+/*
+ * Called with write_locking set: take the write lock if there were no readers,
+ * otherwise clear write_locking and let readers back in:
+ */
+static bool six_pcpu_write_finish(struct six_lock *lock, bool ok)
+{
+	union six_lock_state state;
+
+	if (ok) {
+		/* order the reader count check before the critical section: */
+		smp_mb();
+		atomic64_add(__SIX_VAL(seq, 1) - __SIX_VAL(write_locking, 1),
+			     &lock->state.counter);
+	} else {
+		state.v = atomic64_sub_return_release(__SIX_VAL(write_locking, 1),
+						      &lock->state.counter);
+		six_lock_wakeup(lock, state, SIX_LOCK_read);
+	}
+
+	return ok;
+}
+
+static bool six_pcpu_write_trylock(struct six_lock *lock)
+{
+	atomic64_add(__SIX_VAL(write_locking, 1), &lock->state.counter);
+	smp_mb__after_atomic();
+
+	return six_pcpu_write_finish(lock, !pcpu_read_count(lock));
+}
+
 static __always_inline bool do_six_trylock_type(struct six_lock *lock,
 						enum six_lock_type type)
 {
 	const struct six_lock_vals l[] = LOCK_VALS;
 	union six_lock_state old;
-	u64 v = READ_ONCE(lock->state.v);
+	u64 v;
 
 	EBUG_ON(type == SIX_LOCK_write && lock->owner != current);
 
+	if (lock->readers) {
+		if (type == SIX_LOCK_read)
+			return six_pcpu_read_trylock(lock, false, 0);
+		if (type == SIX_LOCK_write)
+			return six_pcpu_write_trylock(lock);
+	}
+
+	v = READ_ONCE(lock->state.v);
+
 	do {
 		old.v = v;
 
@@ -119,8 +220,22 @@ static bool __six_relock_type(struct six_lock *lock, enum six_lock_type type,
 {
 	const struct six_lock_vals l[] = LOCK_VALS;
 	union six_lock_state old;
-	u64 v = READ_ONCE(lock->state.v);
+	u64 v;
+
+	if (lock->readers && type == SIX_LOCK_read) {
+		if (!six_pcpu_read_trylock(lock, true, seq))
+			return false;
+		goto out;
+	}
+
+	if (lock->readers && type == SIX_LOCK_write) {
+		if (READ_ONCE(lock->state.seq) != seq ||
+		    !six_pcpu_write_trylock(lock))
+			return false;
+		goto out;
+	}
 
+	v = READ_ONCE(lock->state.v);
 	do {
 		old.v = v;
 
@@ -131,6 +246,7 @@ static bool __six_relock_type(struct six_lock *lock, enum six_lock_type type,
 				old.v + l[type].lock_val)) != old.v);
 
 	six_set_owner(lock, type, old);
+out:
 	if (type != SIX_LOCK_write)
 		six_acquire(&lock->dep_map, 1);
 	return true;
@@ -266,12 +382,76 @@ static inline bool six_optimistic_spin(struct six_lock *lock, enum six_lock_type
 
 #endif
 
+/*
+ * Percpu reader mode, read lock: returns true if we got the lock, otherwise sets
+ * the read waiters bit - if the lock was still unavailable - so that we get
+ * woken up when it's released:
+ */
+static bool six_pcpu_read_lock_or_wait(struct six_lock *lock)
+{
+	union six_lock_state old, new;
+	u64 v;
+retry:
+	if (six_pcpu_read_trylock(lock, false, 0))
+		return true;
+
+	v = READ_ONCE(lock->state.v);
+	do {
+		new.v = old.v = v;
+
+		if (!(old.v & __SIX_PCPU_READ_FAIL))
+			goto retry;
+
+		if (new.waiters & (1 << SIX_LOCK_read))
+			break;
+
+		new.waiters |= 1 << SIX_LOCK_read;
+	} while ((v = atomic64_cmpxchg(&lock->state.counter,
+				       old.v, new.v)) != old.v);
+
+	return false;
+}
+
+/*
+ * Percpu reader mode, write lock: write_locking stays set while we wait, which
+ * keeps new readers out; readers wake us up as they drop their locks:
+ */
+static int six_pcpu_write_lock_slowpath(struct six_lock *lock,
+					six_lock_should_sleep_fn should_sleep_fn,
+					void *p)
+{
+	int ret = 0;
+
+	EBUG_ON(lock->owner != current);
+
+	atomic64_add(__SIX_VAL(write_locking, 1), &lock->state.counter);
+	smp_mb__after_atomic();
+
+	while (1) {
+		set_current_state(TASK_UNINTERRUPTIBLE);
+
+		ret = should_sleep_fn ? should_sleep_fn(lock, p) : 0;
+		if (ret)
+			break;
+
+		if (!pcpu_read_count(lock))
+			break;
+
+		schedule();
+	}
+
+	__set_current_state(TASK_RUNNING);
+
+	six_pcpu_write_finish(lock, !ret);
+	return ret;
+}
+
 noinline
 static int __six_lock_type_slowpath(struct six_lock *lock, enum six_lock_type type,
 				    six_lock_should_sleep_fn should_sleep_fn, void *p)
 {
 	const struct six_lock_vals l[] = LOCK_VALS;
-	union six_lock_state old, new;
+	union six_lock_state old = { .v = 0 }, new;
 	struct six_lock_waiter wait;
 	int ret = 0;
 	u64 v;
@@ -280,6 +460,9 @@ static int __six_lock_type_slowpath(struct six_lock *lock, enum six_lock_type ty
 	if (ret)
 		return ret;
 
+	if (lock->readers && type == SIX_LOCK_write)
+		return six_pcpu_write_lock_slowpath(lock, should_sleep_fn, p);
+
 	if (six_optimistic_spin(lock, type))
 		return 0;
 
@@ -302,6 +485,14 @@ static int __six_lock_type_slowpath(struct six_lock *lock, enum six_lock_type ty
 		if (ret)
 			break;
 
+		if (lock->readers && type == SIX_LOCK_read) {
+			if (six_pcpu_read_lock_or_wait(lock))
+				break;
+
+			schedule();
+			continue;
+		}
+
 		v = READ_ONCE(lock->state.v);
 		do {
 			new.v = old.v = v;
@@ -362,6 +553,13 @@ static inline void six_lock_wakeup(struct six_lock *lock,
 	struct list_head *wait_list = &lock->wait_list[waitlist_id];
 	struct six_lock_waiter *w, *next;
 
+	/* Percpu reader mode: a waiting writer is marked by write_locking */
+	if (waitlist_id == SIX_LOCK_write && lock->readers) {
+		if (state.write_locking)
+			six_wake_writer(lock);
+		return;
+	}
+
 	if (waitlist_id == SIX_LOCK_write && state.read_lock)
 		return;
 
@@ -372,10 +570,7 @@ static inline void six_lock_wakeup(struct six_lock *lock,
 		  (unsigned long *) &lock->state.v);
 
 	if (waitlist_id == SIX_LOCK_write) {
-		struct task_struct *p = READ_ONCE(lock->owner);
-
-		if (p)
-			wake_up_process(p);
+		six_wake_writer(lock);
 		return;
 	}
 
@@ -402,7 +597,8 @@ static void __six_unlock_type(struct six_lock *lock, enum six_lock_type type)
 	const struct six_lock_vals l[] = LOCK_VALS;
 	union six_lock_state state;
 
-	EBUG_ON(!(lock->state.v & l[type].held_mask));
+	EBUG_ON(!(type == SIX_LOCK_read && lock->readers) &&
+		!(lock->state.v & l[type].held_mask));
 	EBUG_ON(type == SIX_LOCK_write &&
 		!(lock->state.v & __SIX_LOCK_HELD_intent));
 
@@ -420,8 +616,16 @@ static void __six_unlock_type(struct six_lock *lock, enum six_lock_type type)
 		lock->owner = NULL;
 	}
 
-	state.v = atomic64_add_return_release(l[type].unlock_val,
-					      &lock->state.counter);
+	if (type == SIX_LOCK_read && lock->readers) {
+		smp_mb(); /* unlock barrier */
+		this_cpu_dec(*lock->readers);
+		smp_mb(); /* between dropping our count and checking for writers */
+		state.v = READ_ONCE(lock->state.v);
+	} else {
+		state.v = atomic64_add_return_release(l[type].unlock_val,
+						      &lock->state.counter);
+	}
+
 	six_lock_wakeup(lock, state, l[type].unlock_wakeup);
 }
 
@@ -474,9 +678,15 @@ bool six_lock_tryupgrade(struct six_lock *lock)
 	do {
 		new.v = old.v = v;
 
-		EBUG_ON(!(old.v & l[SIX_LOCK_read].held_mask));
+		EBUG_ON(!lock->readers &&
+			!(old.v & l[SIX_LOCK_read].held_mask));
 
-		new.v += l[SIX_LOCK_read].unlock_val;
+		/*
+		 * In percpu reader mode our read lock is dropped below, once
+		 * we have the intent lock:
+		 */
+		if (!lock->readers)
+			new.v += l[SIX_LOCK_read].unlock_val;
 
 		if (new.v & l[SIX_LOCK_intent].lock_fail)
 			return false;
@@ -485,6 +695,9 @@ bool six_lock_tryupgrade(struct six_lock *lock)
 	} while ((v = atomic64_cmpxchg_acquire(&lock->state.counter,
 				old.v, new.v)) != old.v);
 
+	if (lock->readers)
+		this_cpu_dec(*lock->readers);
+
 	six_set_owner(lock, SIX_LOCK_intent, old);
 	six_lock_wakeup(lock, new, l[SIX_LOCK_read].unlock_wakeup);
 
@@ -525,7 +738,10 @@ void six_lock_increment(struct six_lock *lock, enum six_lock_type type)
 
 	switch (type) {
 	case SIX_LOCK_read:
-		atomic64_add(l[type].lock_val, &lock->state.counter);
+		if (lock->readers)
+			this_cpu_inc(*lock->readers);
+		else
+			atomic64_add(l[type].lock_val, &lock->state.counter);
 		break;
 	case SIX_LOCK_intent:
 		lock->intent_lock_recurse++;
@@ -551,3 +767,30 @@ void six_lock_wakeup_all(struct six_lock *lock)
 	raw_spin_unlock(&lock->wait_lock);
 }
 EXPORT_SYMBOL_GPL(six_lock_wakeup_all);
+
+/*
+ * Readers may be touching the per-CPU counts without holding the lock, so the
+ * lock must not be reachable by anyone else when they're freed:
+ */
+void six_lock_pcpu_free(struct six_lock *lock)
+{
+	BUG_ON(lock->readers && pcpu_read_count(lock));
+	BUG_ON(lock->state.read_lock);
+
+	free_percpu(lock->readers);
+	lock->readers = NULL;
+}
+EXPORT_SYMBOL_GPL(six_lock_pcpu_free);
+
+/*
+ * The lock must not be held for read - holding it for write is sufficient.
+ * If the allocation fails the lock stays in the normal mode:
+ */
+void six_lock_pcpu_alloc(struct six_lock *lock)
+{
+	BUG_ON(lock->state.read_lock);
+
+	if (!lock->readers)
+		lock->readers = alloc_percpu(unsigned);
+}
+EXPORT_SYMBOL_GPL(six_lock_pcpu_alloc);